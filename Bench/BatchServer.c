@@ -0,0 +1,206 @@
+/*
+**  BatchServer
+**
+**  Stands in for a pricing or reference-data service behind batched UDFs
+**  (Common/MicroBatch.h). It creates the server segment at the path given,
+**  with --connections channels, and serves each channel on its own thread,
+**  so it handles at most that many requests at once, as a service that
+**  limits each client's connections does. A request of n calls takes
+**  --latency-ms plus n times --call-us, the fixed cost of a round trip plus
+**  the work per call, and answers every call with the sum of its arguments
+**  (cDoubleInner's x + y).
+**
+**  Point XLL_BATCH_SERVER at the segment before the XLL loads. The server
+**  runs until it is killed, or until its stop word is set, and then deletes
+**  the segment. Every --report-ms milliseconds it prints the requests and
+**  calls served so far.
+**
+**  Usage: BatchServer [options] segment-path
+**    --connections N    channels served at once (default 4)
+**    --latency-ms MS    fixed cost of a request (default 100)
+**    --call-us US       cost of each call in a request (default 50)
+**    --report-ms MS     print the totals this often, 0 never (default 0)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "XlHost.h"
+#include "MicroBatch.h"
+
+typedef struct ServerOptions
+{
+    const char* path;
+    int connections;
+    double latencyMs;
+    double callUs;
+    int reportMs;
+} ServerOptions;
+
+typedef struct ServerChannel
+{
+    pthread_t thread;
+    MicroBatchServer* server;
+    const ServerOptions* opt;
+    int index;
+    HANDLE request;
+    HANDLE reply;
+} ServerChannel;
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void OnSignal(int sig)
+{
+    (void)sig;
+    g_stop = 1;
+}
+
+static HANDLE ChannelSemaphore(DWORD pid, int channel, const WCHAR* role)
+{
+    WCHAR name[96];
+    swprintf_s(name, _countof(name), MICROBATCH_SEMAPHORE, (unsigned)pid, channel, role);
+    return CreateSemaphoreW(NULL, 0, 0x10000, name);
+}
+
+static void SleepUs(double us)
+{
+    struct timespec ts = { (time_t)(us / 1e6), (long)(((LONGLONG)us % 1000000) * 1000) };
+    if (us > 0.0)
+        nanosleep(&ts, NULL);
+}
+
+static void* ChannelMain(void* arg)
+{
+    ServerChannel* ch = (ServerChannel*)arg;
+    MicroBatchChannel* c = MICROBATCH_CHANNEL(ch->server, ch->index);
+
+    while (!g_stop && !ReadAcquire(&ch->server->stop))
+    {
+        int calls, argCount, i, k;
+
+        if (ReadAcquire(&c->state) != MICROBATCH_REQUEST)
+        {
+            WaitForSingleObject(ch->request, MICROBATCH_POLL_MS);
+            continue;
+        }
+        calls = c->calls < 0 ? 0 : c->calls > MICROBATCH_MAX_CALLS ? MICROBATCH_MAX_CALLS : c->calls;
+        argCount = c->argCount < 0 ? 0 : c->argCount > MICROBATCH_MAX_ARGS ? MICROBATCH_MAX_ARGS : c->argCount;
+        SleepUs(ch->opt->latencyMs * 1000.0 + ch->opt->callUs * calls);
+        for (i = 0; i < calls; i++)
+        {
+            double sum = 0.0;
+            for (k = 0; k < argCount; k++)
+                sum += c->args[i * argCount + k];
+            c->results[i] = sum;
+        }
+        WriteRelease64(&c->requests, c->requests + 1);
+        WriteRelease64(&c->served, c->served + calls);
+        WriteRelease(&c->state, MICROBATCH_REPLY);
+        ReleaseSemaphore(ch->reply, 1, NULL);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    ServerOptions opt = { NULL, 4, 100.0, 50.0, 0 };
+    ServerChannel channels[MICROBATCH_MAX_CHANNELS];
+    MicroBatchServer* server;
+    HANDLE file, mapping;
+    WCHAR path[MAX_PATH];
+    SIZE_T bytes;
+    DWORD pid = GetCurrentProcessId();
+    LONGLONG requests, served;
+    ULONGLONG lastReport;
+    int a, i;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--connections") && a + 1 < argc) opt.connections = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--latency-ms") && a + 1 < argc) opt.latencyMs = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--call-us") && a + 1 < argc) opt.callUs = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--report-ms") && a + 1 < argc) opt.reportMs = atoi(argv[++a]);
+        else
+        {
+            fprintf(stderr, "BatchServer: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.path = argv[a];
+    if (!opt.path)
+    {
+        fprintf(stderr, "usage: BatchServer [--connections N] [--latency-ms MS] [--call-us US] [--report-ms MS] segment-path\n");
+        return 2;
+    }
+    if (opt.connections < 1) opt.connections = 1;
+    if (opt.connections > MICROBATCH_MAX_CHANNELS) opt.connections = MICROBATCH_MAX_CHANNELS;
+
+    bytes = MICROBATCH_SEGMENT_BYTES(opt.connections);
+    mbstowcs(path, opt.path, MAX_PATH);
+    file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    mapping = file != INVALID_HANDLE_VALUE ? CreateFileMappingW(file, NULL, PAGE_READWRITE, 0, (DWORD)bytes, NULL) : NULL;
+    server = mapping ? (MicroBatchServer*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes) : NULL;
+    if (!server)
+    {
+        fprintf(stderr, "BatchServer: cannot create %s\n", opt.path);
+        return 1;
+    }
+    memset(server, 0, bytes);
+    server->version = MICROBATCH_VERSION;
+    server->channels = (UINT32)opt.connections;
+    server->pid = (UINT32)pid;
+    server->maxCalls = MICROBATCH_MAX_CALLS;
+    server->maxArgs = MICROBATCH_MAX_ARGS;
+
+    signal(SIGTERM, OnSignal);
+    signal(SIGINT, OnSignal);
+    for (i = 0; i < opt.connections; i++)
+    {
+        channels[i].server = server;
+        channels[i].opt = &opt;
+        channels[i].index = i;
+        channels[i].request = ChannelSemaphore(pid, i, L"request");
+        channels[i].reply = ChannelSemaphore(pid, i, L"reply");
+        pthread_create(&channels[i].thread, NULL, ChannelMain, &channels[i]);
+    }
+    WriteRelease(&server->magic, MICROBATCH_MAGIC);
+    printf("BatchServer: pid %u, %d connections, %.1f ms per request + %.1f us per call, segment %s\n",
+        (unsigned)pid, opt.connections, opt.latencyMs, opt.callUs, opt.path);
+    fflush(stdout);
+
+    lastReport = XlHostNowNs();
+    while (!g_stop && !ReadAcquire(&server->stop))
+    {
+        SleepUs(10000.0);
+        if (opt.reportMs <= 0 || XlHostNowNs() - lastReport < (ULONGLONG)opt.reportMs * 1000000ull)
+            continue;
+        lastReport = XlHostNowNs();
+        for (i = 0, requests = served = 0; i < opt.connections; i++)
+        {
+            requests += ReadAcquire64(&MICROBATCH_CHANNEL(server, i)->requests);
+            served += ReadAcquire64(&MICROBATCH_CHANNEL(server, i)->served);
+        }
+        printf("BatchServer: %lld requests, %lld calls\n", requests, served);
+        fflush(stdout);
+    }
+
+    InterlockedExchange(&server->stop, 1);
+    for (i = 0; i < opt.connections; i++)
+    {
+        pthread_join(channels[i].thread, NULL);
+        CloseHandle(channels[i].request);
+        CloseHandle(channels[i].reply);
+    }
+    UnmapViewOfFile(server);
+    CloseHandle(mapping);
+    CloseHandle(file);
+    DeleteFileW(path);
+    return 0;
+}
@@ -0,0 +1,337 @@
+/*
+**  Batching
+**
+**  Measures requests per second of a batched backend function
+**  (Common/MicroBatch.h) against the same calls sent one per round trip.
+**  It starts BatchServer (from the directory this bench runs from) with
+**  --connections, --latency-ms and --call-us, and then runs each window in
+**  --windows in a forked process that loads the XLL fresh with
+**  XLL_BATCH_WINDOW_US set to it: 0 is the unbatched path, anything else
+**  batches with that window. --threads threads, standing in for Excel's calc
+**  threads, share --calls calls of cDoubleInner, each with its own
+**  arguments, so coalescing and the result cache have nothing to share.
+**
+**  Every configuration first makes --warmup calls on all threads, so the
+**  batcher's estimate of the gap between arrivals has settled before the
+**  clock starts. The output gives requests per second, the per-call p50 and p99,
+**  the round trips the server saw, the mean and largest batch, how batches
+**  were closed (full, quiet gap or window), and calls that came back wrong
+**  or NaN.
+**
+**  Usage: Batching [options] MultithreadCrash.so
+**    --threads T        calling threads (default 64)
+**    --calls K          measured calls (default 3000)
+**    --warmup K         calls before measuring (default 1000)
+**    --windows A,B,..   XLL_BATCH_WINDOW_US values to compare (default 0,500,2000)
+**    --connections N    server connections (default 4)
+**    --latency-ms MS    server cost of a request (default 100)
+**    --call-us US       server cost of each call in a request (default 50)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/wait.h>
+#include "XlHost.h"
+#include "MicroBatch.h"
+
+#define MAX_THREADS 256
+#define MAX_CONFIGS 8
+
+typedef struct BatchingOptions
+{
+    const char* xll;
+    int    threads;
+    long   calls;
+    long   warmup;
+    long   windows[MAX_CONFIGS];
+    int    configs;
+    int    connections;
+    double latencyMs;
+    double callUs;
+} BatchingOptions;
+
+typedef struct BatchingThread
+{
+    pthread_t thread;
+    long   wrong;
+    long   nan;
+} BatchingThread;
+
+static const XlHostFunc* g_func;
+static volatile LONG g_nextCall = 0;
+static long g_callLimit = 0;
+static long g_callBase = 0;
+static double* g_latencyNs = NULL;
+static pid_t g_server = -1;
+
+static void* CallerMain(void* arg)
+{
+    BatchingThread* w = (BatchingThread*)arg;
+    XLOPER12 x, y, res;
+    LPXLOPER12 args[2] = { &x, &y };
+    long i;
+
+    while ((i = InterlockedIncrement(&g_nextCall) - 1) < g_callLimit)
+    {
+        ULONGLONG t0 = XlHostNowNs();
+        XlHostSetNum(&x, (double)(g_callBase + i));
+        XlHostSetNum(&y, 0.25);
+        if (XlHostCall(g_func, 2, args, &res) != xlretSuccess)
+            continue;
+        if (g_latencyNs)
+            g_latencyNs[i] = (double)(XlHostNowNs() - t0);
+        if ((res.xltype & xltypeNum) != xltypeNum || isnan(res.val.num))
+            w->nan++;
+        else if (res.val.num != (double)(g_callBase + i) + 0.25)
+            w->wrong++;
+        XlHostFreeResult(&res);
+    }
+    return NULL;
+}
+
+// calls calls on 'threads' threads; the sum of wrong and NaN results in *bad
+static void RunCalls(int threads, long base, long calls, long bad[2])
+{
+    BatchingThread t[MAX_THREADS];
+    int i;
+
+    memset(t, 0, sizeof(t));
+    g_callBase = base;
+    g_callLimit = calls;
+    g_nextCall = 0;
+    for (i = 0; i < threads; i++)
+        pthread_create(&t[i].thread, NULL, CallerMain, &t[i]);
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(t[i].thread, NULL);
+        bad[0] += t[i].wrong;
+        bad[1] += t[i].nan;
+    }
+}
+
+// One row of mcBatchStats by name
+static double BatchCounter(int module, const WCHAR* name)
+{
+    const XlHostFunc* stats = XlHostFindFunc(module, L"mcBatchStats");
+    XLOPER12 res;
+    double value = -1.0;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 2)
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * 2];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(name)
+                && wcsncmp(&key->val.str[1], name, key->val.str[0]) == 0)
+                value = res.val.array.lparray[r * 2 + 1].val.num;
+        }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+static int CompareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Runs inside the child process: load, warm up, measure, print one row
+static int RunConfig(const BatchingOptions* opt, long window)
+{
+    long bad[2] = { 0, 0 };
+    double trips0, trips, sent0, full0, quiet0, windowed0;
+    ULONGLONG t0, t1;
+    char label[32];
+    int module;
+
+    module = XlHostLoad(opt->xll);
+    if (module < 0)
+        return 1;
+    g_func = XlHostFindFunc(module, L"cDoubleInner");
+    if (!g_func || BatchCounter(module, L"Connections") <= 0.0)
+    {
+        fprintf(stderr, "Batching: %s did not connect to the server\n", opt->xll);
+        return 1;
+    }
+
+    RunCalls(opt->threads, 1000000000l, opt->warmup, bad);
+    bad[0] = bad[1] = 0;
+    trips0 = BatchCounter(module, L"RoundTrips");
+    sent0 = BatchCounter(module, L"MeanBatch") * trips0;
+    full0 = BatchCounter(module, L"ClosedFull");
+    quiet0 = BatchCounter(module, L"ClosedQuiet");
+    windowed0 = BatchCounter(module, L"ClosedWindow");
+
+    g_latencyNs = (double*)calloc(opt->calls, sizeof(double));
+    t0 = XlHostNowNs();
+    RunCalls(opt->threads, 0, opt->calls, bad);
+    t1 = XlHostNowNs();
+    qsort(g_latencyNs, opt->calls, sizeof(double), CompareDouble);
+
+    trips = BatchCounter(module, L"RoundTrips") - trips0;
+    if (window)
+        snprintf(label, sizeof(label), "%ld us", window);
+    else
+        snprintf(label, sizeof(label), "unbatched");
+    printf("%-10s %7ld %9.0f %9.1f %9.1f %9.1f %7.0f %7.1f %5.0f %5.0f/%.0f/%.0f %5ld %5ld\n", label, opt->calls,
+        (double)(t1 - t0) / 1e6, (double)opt->calls * 1e9 / (double)(t1 - t0),
+        g_latencyNs[opt->calls / 2] / 1e6, g_latencyNs[opt->calls * 99 / 100] / 1e6, trips,
+        trips > 0.0 ? (BatchCounter(module, L"MeanBatch") * (trips0 + trips) - sent0) / trips : 0.0,
+        BatchCounter(module, L"MaxBatch"), BatchCounter(module, L"ClosedFull") - full0,
+        BatchCounter(module, L"ClosedQuiet") - quiet0, BatchCounter(module, L"ClosedWindow") - windowed0,
+        bad[0], bad[1]);
+    fflush(stdout);
+    free(g_latencyNs);
+    g_latencyNs = NULL;
+    XlHostUnloadAll();
+    return 0;
+}
+
+// Forks so each window loads the XLL, and reads XLL_BATCH_WINDOW_US, in a fresh process
+static void SpawnConfig(const BatchingOptions* opt, long window)
+{
+    pid_t pid = fork();
+    int status = 0;
+
+    if (pid == 0)
+    {
+        char n[24];
+        unsetenv("XLL_RESULT_CACHE");
+        unsetenv("XLL_WORKERS");
+        unsetenv("XLL_GOVERN");
+        setenv("XLL_SINGLEFLIGHT", "0", 1);
+        snprintf(n, sizeof(n), "%ld", window);
+        setenv("XLL_BATCH_WINDOW_US", n, 1);
+        _exit(RunConfig(opt, window));
+    }
+    // Reap the server too if it dies meanwhile: the XLL only sees it gone once it is no zombie
+    for (pid_t done = 0; done != pid && done != -1; )
+    {
+        done = waitpid(-1, &status, 0);
+        if (done == g_server)
+        {
+            fprintf(stderr, "Batching: BatchServer exited\n");
+            g_server = -1;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "Batching: window %ld failed (status %d)\n", window, status);
+}
+
+// Starts BatchServer on 'segment' and waits until it has published the segment
+static pid_t StartServer(const BatchingOptions* opt, const char* self, const char* segment)
+{
+    char server[4096], connections[16], latency[32], call[32], copy[4096];
+    unsigned int magic = 0;
+    pid_t pid;
+    int tries;
+
+    snprintf(copy, sizeof(copy), "%s", self);
+    snprintf(server, sizeof(server), "%s/BatchServer", dirname(copy));
+    snprintf(connections, sizeof(connections), "%d", opt->connections);
+    snprintf(latency, sizeof(latency), "%g", opt->latencyMs);
+    snprintf(call, sizeof(call), "%g", opt->callUs);
+    unlink(segment);
+    pid = fork();
+    if (pid == 0)
+    {
+        execl(server, server, "--connections", connections, "--latency-ms", latency, "--call-us", call, segment, (char*)NULL);
+        fprintf(stderr, "Batching: cannot run %s\n", server);
+        _exit(127);
+    }
+    for (tries = 0; pid > 0 && tries < 500 && magic != MICROBATCH_MAGIC; tries++)
+    {
+        FILE* f = fopen(segment, "rb");
+        if (!f || fread(&magic, sizeof(magic), 1, f) != 1)
+            magic = 0;
+        if (f)
+            fclose(f);
+        if (magic != MICROBATCH_MAGIC)
+            usleep(10000);
+    }
+    if (magic != MICROBATCH_MAGIC)
+    {
+        if (pid > 0)
+            kill(pid, SIGKILL);
+        return -1;
+    }
+    return pid;
+}
+
+int main(int argc, char** argv)
+{
+    BatchingOptions opt = { NULL, 64, 3000, 1000, { 0, 500, 2000 }, 3, 4, 100.0, 50.0 };
+    char segment[256];
+    int a, c, status;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--warmup") && a + 1 < argc) opt.warmup = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--windows") && a + 1 < argc)
+        {
+            char* p = argv[++a];
+            for (opt.configs = 0; *p && opt.configs < MAX_CONFIGS; )
+            {
+                opt.windows[opt.configs++] = strtol(p, &p, 10);
+                if (*p == ',')
+                    p++;
+            }
+        }
+        else if (!strcmp(argv[a], "--connections") && a + 1 < argc) opt.connections = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--latency-ms") && a + 1 < argc) opt.latencyMs = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--call-us") && a + 1 < argc) opt.callUs = atof(argv[++a]);
+        else
+        {
+            fprintf(stderr, "Batching: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: Batching [--threads T] [--calls K] [--warmup K] [--windows A,B,..] [--connections N]\n"
+                        "                [--latency-ms MS] [--call-us US] MultithreadCrash.so\n");
+        return 2;
+    }
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+    if (opt.calls < 1) opt.calls = 1;
+    if (opt.warmup < 0) opt.warmup = 0;
+
+    snprintf(segment, sizeof(segment), "/tmp/XllBatchServer-%d.bin", (int)getpid());
+    g_server = StartServer(&opt, argv[0], segment);
+    if (g_server < 0)
+    {
+        fprintf(stderr, "Batching: BatchServer did not start\n");
+        return 1;
+    }
+    setenv("XLL_BATCH_SERVER", segment, 1);
+
+    printf("cDoubleInner: %ld calls on %d threads after %ld warm-up calls; server: %d connections, %g ms + %g us per call\n",
+        opt.calls, opt.threads, opt.warmup, opt.connections, opt.latencyMs, opt.callUs);
+    printf("%-10s %7s %9s %9s %9s %9s %7s %7s %5s %13s %5s %5s\n", "window", "calls", "wall_ms", "req/s",
+        "p50_ms", "p99_ms", "trips", "batch", "max", "full/quiet/win", "wrong", "nan");
+    fflush(stdout);
+    for (c = 0; c < opt.configs; c++)
+        SpawnConfig(&opt, opt.windows[c] < 0 ? 0 : opt.windows[c]);
+
+    if (g_server > 0)
+    {
+        kill(g_server, SIGTERM);
+        waitpid(g_server, &status, 0);
+    }
+    unlink(segment);
+    return 0;
+}
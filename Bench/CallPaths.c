@@ -0,0 +1,296 @@
+/*
+**  CallPaths
+**
+**  Cost of each way the XLLs call cDoubleInner back through Excel. The
+**  callers all compute the same x + y; they differ only in the entry point
+**  (Excel12f, Excel12 or MdCallBack12 directly), in how the function is named
+**  (a name string or the register id) and in where the argument XLOPERs live
+**  (a per-thread context, framework temporaries or fresh heap blocks).
+**
+**  Every path is run at 1, 2, 4 .. --threads threads for each callback cost
+**  in --callback-ns, with the cDoubleInner of the same XLL called directly as
+**  the baseline. Per path and thread count it reports:
+**    ns/call      thread time per call
+**    overhead     ns/call above the direct call at the same thread count
+**    allocs/free  GlobalAlloc and GlobalFree per call, frees at the end of the
+**                 recalc (epoch reclamation) included; leak/call is the rest
+**    callback     time inside the callback itself, nested cDoubleInner excluded
+**    speedup      throughput against the same path on one thread
+**
+**  Sleep() inside UDFs is scaled by --sleep-scale (default 0, a yield), and
+**  coalescing and the result cache are off, so calls do not share results.
+**
+**  Usage: CallPaths [options] MultithreadCrash.so [ThreadSafeC.so]
+**    --threads N            highest thread count (default 8)
+**    --calls K              calls per path and thread count (default 100000)
+**    --callback-ns A,B,..   busy-wait added to every callback, one matrix per value (default 0)
+**    --serialise-callbacks  run callbacks under one process-wide lock
+**    --sleep-scale S        multiplier for Sleep() inside UDFs (default 0)
+**    --csv FILE             also write the matrix as CSV
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <pthread.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 256
+#define MAX_COSTS   8
+
+// The call paths, by the XLL that implements them
+typedef struct CallPath
+{
+    const char* module;         // Substring of the XLL's path
+    const WCHAR* function;
+    const char* entry;
+    const char* target;
+    const char* args;
+} CallPath;
+
+static const CallPath g_paths[] = {
+    { "MultithreadCrash", L"cDoubleCaller",                  "Excel12f",     "name, heap (retired)", "thread context" },
+    { "MultithreadCrash", L"cDoubleCallerById",              "Excel12f",     "register id",          "thread context" },
+    { "MultithreadCrash", L"cDoubleCallerDirect",            "Excel12",      "name, heap (leaked)",  "heap (leaked)" },
+    { "MultithreadCrash", L"cDoubleCallerDirectById",        "Excel12",      "register id",          "heap" },
+    { "MultithreadCrash", L"cDoubleCallerExcel12Direct",     "MdCallBack12", "name, heap (leaked)",  "thread context" },
+    { "MultithreadCrash", L"cDoubleCallerExcel12DirectById", "MdCallBack12", "register id",          "thread context" },
+    { "ThreadSafeC",      L"cDoubleCaller",                  "Excel12f",     "TempStr12",            "TempNum12" },
+    { "ThreadSafeC",      L"cDoubleCallerTLS",               "Excel12f",     "register id",          "thread context" },
+};
+
+typedef struct PathOptions
+{
+    int    maxThreads;
+    long   calls;
+    long   costs[MAX_COSTS];
+    int    costCount;
+    const char* csvPath;
+} PathOptions;
+
+typedef struct PathWorker
+{
+    pthread_t thread;
+    const XlHostFunc* func;
+    long first;
+    long calls;
+    pthread_barrier_t* barrier;
+    ULONGLONG busyNs;
+    XlHostStats stats;
+} PathWorker;
+
+typedef struct PathRun
+{
+    double wallNs;
+    double nsPerCall;           // Thread time per call
+    double callsPerSec;
+    XlHostStats stats;          // Workers plus the end-of-recalc reclamation
+} PathRun;
+
+static void* WorkerMain(void* arg)
+{
+    PathWorker* w = (PathWorker*)arg;
+    ULONGLONG t0;
+    long i;
+
+    XlHostResetThreadStats();
+    pthread_barrier_wait(w->barrier);
+    t0 = XlHostNowNs();
+    for (i = 0; i < w->calls; i++)
+    {
+        XLOPER12 x, y, res;
+        LPXLOPER12 args[2] = { &x, &y };
+        XlHostSetNum(&x, (double)(w->first + i));
+        XlHostSetNum(&y, 0.5);
+        if (XlHostCall(w->func, 2, args, &res) == xlretSuccess)
+            XlHostFreeResult(&res);
+    }
+    w->busyNs = XlHostNowNs() - t0;
+    w->stats = *XlHostThreadStats();
+    return NULL;
+}
+
+static PathRun RunPath(const XlHostFunc* f, int threads, long calls)
+{
+    PathWorker workers[MAX_THREADS];
+    pthread_barrier_t barrier;
+    ULONGLONG t0, t1, busy = 0;
+    PathRun run;
+    long first = 0;
+    int t;
+
+    memset(&run, 0, sizeof(run));
+    pthread_barrier_init(&barrier, NULL, (unsigned)threads + 1);
+    for (t = 0; t < threads; t++)
+    {
+        workers[t].func = f;
+        workers[t].calls = calls / threads + (t < calls % threads ? 1 : 0);
+        workers[t].first = first;
+        workers[t].barrier = &barrier;
+        first += workers[t].calls;
+        pthread_create(&workers[t].thread, NULL, WorkerMain, &workers[t]);
+    }
+    pthread_barrier_wait(&barrier);
+    t0 = XlHostNowNs();
+    for (t = 0; t < threads; t++)
+        pthread_join(workers[t].thread, NULL);
+    t1 = XlHostNowNs();
+    pthread_barrier_destroy(&barrier);
+
+    // What the recalc retired is freed here, and belongs to the path's cost
+    XlHostResetThreadStats();
+    XlHostFireEvent(xleventCalculationEnded);
+    run.stats = *XlHostThreadStats();
+
+    for (t = 0; t < threads; t++)
+    {
+        busy += workers[t].busyNs;
+        XlHostAddStats(&run.stats, &workers[t].stats);
+    }
+    run.wallNs = (double)(t1 > t0 ? t1 - t0 : 1);
+    run.nsPerCall = (double)busy / (double)calls;
+    run.callsPerSec = (double)calls * 1e9 / run.wallNs;
+    return run;
+}
+
+static int ParseCosts(const char* s, PathOptions* opt)
+{
+    opt->costCount = 0;
+    while (*s && opt->costCount < MAX_COSTS)
+    {
+        char* end;
+        opt->costs[opt->costCount++] = strtol(s, &end, 10);
+        if (end == s)
+            return 0;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return opt->costCount;
+}
+
+int main(int argc, char** argv)
+{
+    PathOptions opt;
+    const XlHostFunc* inner[XLHOST_MAX_MODULES];
+    double baseline[XLHOST_MAX_MODULES][MAX_THREADS + 1];
+    FILE* csv = NULL;
+    int a, c, m, p, t, loaded = 0;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.maxThreads = 8;
+    opt.calls = 100000;
+    opt.costCount = 1;
+    g_xlHostConfig.sleepScale = 0.0;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.maxThreads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--callback-ns") && a + 1 < argc)
+        {
+            if (!ParseCosts(argv[++a], &opt))
+            {
+                fprintf(stderr, "CallPaths: bad --callback-ns list %s\n", argv[a]);
+                return 2;
+            }
+        }
+        else if (!strcmp(argv[a], "--serialise-callbacks")) g_xlHostConfig.serialiseCallbacks = 1;
+        else if (!strcmp(argv[a], "--sleep-scale") && a + 1 < argc) g_xlHostConfig.sleepScale = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--csv") && a + 1 < argc) opt.csvPath = argv[++a];
+        else
+        {
+            fprintf(stderr, "CallPaths: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a >= argc)
+    {
+        fprintf(stderr, "usage: CallPaths [--threads N] [--calls K] [--callback-ns A,B,..] [--serialise-callbacks]\n"
+                        "                 [--sleep-scale S] [--csv FILE] MultithreadCrash.so [ThreadSafeC.so]\n");
+        return 2;
+    }
+    if (opt.maxThreads < 1) opt.maxThreads = 1;
+    if (opt.maxThreads > MAX_THREADS) opt.maxThreads = MAX_THREADS;
+    if (opt.calls < 1) opt.calls = 1;
+
+    // Every call must run the path: no shared or cached results
+    setenv("XLL_SINGLEFLIGHT", "0", 1);
+    unsetenv("XLL_RESULT_CACHE");
+    g_xlHostConfig.multiThreadedCalc = 1;
+    for (; a < argc; a++)
+        if (XlHostLoad(argv[a]) >= 0)
+            loaded++;
+    if (!loaded)
+        return 1;
+    for (m = 0; m < XlHostModuleCount(); m++)
+        inner[m] = XlHostFindFunc(m, L"cDoubleInner");
+
+    if (opt.csvPath)
+    {
+        csv = fopen(opt.csvPath, "w");
+        if (csv)
+            fprintf(csv, "callback_ns,module,function,entry,target,args,threads,ns_per_call,overhead_ns,"
+                         "allocs_per_call,frees_per_call,leaks_per_call,callback_ns_per_call,calls_per_sec,speedup\n");
+    }
+
+    printf("CallPaths: %ld calls per run, 1..%d threads, sleep scale %g%s\n", opt.calls, opt.maxThreads,
+        g_xlHostConfig.sleepScale, g_xlHostConfig.serialiseCallbacks ? ", serialised callbacks" : "");
+    for (c = 0; c < opt.costCount; c++)
+    {
+        g_xlHostConfig.callbackCostNs = opt.costs[c];
+        printf("\ncallback cost %ld ns\n", opt.costs[c]);
+        printf("%-32s %-12s %-20s %-15s %3s %9s %9s %7s %7s %7s %9s %10s %7s\n", "function", "entry", "target", "args",
+            "thr", "ns/call", "overhead", "allocs", "frees", "leak", "callback", "calls/s", "speedup");
+
+        // Baselines: each XLL's cDoubleInner called directly
+        for (m = 0; m < XlHostModuleCount(); m++)
+        {
+            if (!inner[m])
+                continue;
+            for (t = 1; t <= opt.maxThreads; t *= 2)
+            {
+                PathRun run = RunPath(inner[m], t, opt.calls);
+                baseline[m][t] = run.nsPerCall;
+            }
+        }
+
+        for (p = 0; p < (int)_countof(g_paths); p++)
+        {
+            const CallPath* path = &g_paths[p];
+            const XlHostFunc* f = NULL;
+            double single = 0.0;
+
+            for (m = 0; m < XlHostModuleCount() && !f; m++)
+                if (strstr(XlHostModulePath(m), path->module))
+                    f = XlHostFindFunc(m, path->function);
+            if (!f)
+                continue;
+            for (t = 1; t <= opt.maxThreads; t *= 2)
+            {
+                PathRun run = RunPath(f, t, opt.calls);
+                double n = (double)opt.calls;
+                double overhead = inner[f->module] ? run.nsPerCall - baseline[f->module][t] : run.nsPerCall;
+                double allocs = (double)run.stats.allocCalls / n;
+                double frees = (double)run.stats.freeCalls / n;
+                double callback = (double)run.stats.callbackNs / n;
+                if (t == 1)
+                    single = run.callsPerSec;
+                printf("%-32ls %-12s %-20s %-15s %3d %9.0f %9.0f %7.2f %7.2f %7.2f %9.0f %10.0f %7.2f\n",
+                    t == 1 ? path->function : L"", t == 1 ? path->entry : "", t == 1 ? path->target : "",
+                    t == 1 ? path->args : "", t, run.nsPerCall, overhead, allocs, frees, allocs - frees,
+                    callback, run.callsPerSec, single > 0 ? run.callsPerSec / single : 0.0);
+                if (csv)
+                    fprintf(csv, "%ld,%s,%ls,%s,%s,%s,%d,%.1f,%.1f,%.3f,%.3f,%.3f,%.1f,%.0f,%.3f\n",
+                        opt.costs[c], path->module, path->function, path->entry, path->target, path->args, t,
+                        run.nsPerCall, overhead, allocs, frees, allocs - frees, callback, run.callsPerSec,
+                        single > 0 ? run.callsPerSec / single : 0.0);
+            }
+            fflush(stdout);
+        }
+    }
+
+    if (csv)
+        fclose(csv);
+    XlHostUnloadAll();
+    return 0;
+}
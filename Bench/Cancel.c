@@ -0,0 +1,350 @@
+/*
+**  Cancel
+**
+**  Measures cooperative cancellation (Common/Cancel.c) with cPiSeries, a loop
+**  that polls its token once per term. Each slice in --slices runs in a
+**  forked process with XLL_CANCEL_SLICE_US set to it (0: xlAbort on every
+**  term), in three parts:
+**    overhead   --threads calls of --terms terms run to the end: time per
+**               term, and slow checks and xlAbort calls per second
+**    break      --threads endless calls; after --abort-ms the host starts
+**               reporting a break through xlAbort. Latency is the time from
+**               then until the last call has returned
+**    deadline   --threads endless calls with a budget of --budget-ms and
+**               partial results: the time each call actually took
+**  Every callback costs --callback-ns, standing in for Excel's own work in
+**  xlAbort.
+**
+**  Last, a discard check runs DISCARD_CALLS calls of cArrayFill with a break
+**  already pending, so each one throws its unfinished array away, and reads
+**  cArrayFill's live bytes from cAllocStats: anything left is a leak.
+**
+**  Usage: Cancel [options] ThreadSafeC.so
+**    --slices A,B,..    slice lengths in µs to compare (default 0,100,1000)
+**    --terms N          terms per overhead call (default 5000000)
+**    --threads T        calls at once (default 1)
+**    --abort-ms MS      delay before the break (default 100)
+**    --budget-ms MS     deadline of the deadline part (default 50)
+**    --callback-ns NS   cost of each callback (default 1000)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 64
+#define MAX_CONFIGS 8
+#define DISCARD_CALLS 100
+
+typedef struct CancelOptions
+{
+    const char* xll;
+    double slices[MAX_CONFIGS];
+    int    configs;
+    double terms;
+    int    threads;
+    long   abortMs;
+    double budgetMs;
+    long   callbackNs;
+} CancelOptions;
+
+typedef struct CancelThread
+{
+    pthread_t thread;
+    double terms;
+    double maxMs;
+    double partial;
+    ULONGLONG start;
+    ULONGLONG end;
+    double value;               // NaN for an error
+} CancelThread;
+
+static const XlHostFunc* g_series;
+static int g_module;
+
+static void* CallMain(void* arg)
+{
+    CancelThread* t = (CancelThread*)arg;
+    XLOPER12 a[3], res;
+    LPXLOPER12 args[3] = { &a[0], &a[1], &a[2] };
+
+    XlHostSetNum(&a[0], t->terms);
+    XlHostSetNum(&a[1], t->maxMs);
+    XlHostSetNum(&a[2], t->partial);
+    t->start = XlHostNowNs();
+    XlHostCall(g_series, 3, args, &res);
+    t->end = XlHostNowNs();
+    t->value = (res.xltype & xltypeNum) == xltypeNum ? res.val.num : NAN;
+    XlHostFreeResult(&res);
+    return NULL;
+}
+
+// Reads one row of cCancelStats
+static double CancelCounter(const WCHAR* name)
+{
+    const XlHostFunc* stats = XlHostFindFunc(g_module, L"cCancelStats");
+    XLOPER12 res;
+    double value = 0.0;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 2)
+    {
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * 2];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(name)
+                && wcsncmp(&key->val.str[1], name, key->val.str[0]) == 0)
+                value = res.val.array.lparray[r * 2 + 1].val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+// Live bytes of one function's row in cAllocStats
+static double LiveBytes(const WCHAR* function)
+{
+    const XlHostFunc* stats = XlHostFindFunc(g_module, L"cAllocStats");
+    XLOPER12 detail, res;
+    LPXLOPER12 args[1] = { &detail };
+    double value = 0.0;
+    int r;
+
+    XlHostSetNum(&detail, 0.0);
+    if (!stats || XlHostCall(stats, 1, args, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns > 5)
+    {
+        for (r = 1; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 row = &res.val.array.lparray[r * res.val.array.columns];
+            if ((row->xltype & xltypeStr) && (size_t)row->val.str[0] == wcslen(function)
+                && wcsncmp(&row->val.str[1], function, row->val.str[0]) == 0)
+                value = row[5].val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+// Child process: cancelled cArrayFill calls must free what they had allocated
+static int RunDiscard(const CancelOptions* opt)
+{
+    const XlHostFunc* fill;
+    XLOPER12 a[4], res;
+    LPXLOPER12 args[4] = { &a[0], &a[1], &a[2], &a[3] };
+    int i, cancelled = 0;
+
+    g_xlHostConfig.callbackCostNs = 0;
+    g_module = XlHostLoad(opt->xll);
+    if (g_module < 0)
+        return 1;
+    fill = XlHostFindFunc(g_module, L"cArrayFill");
+    if (!fill)
+    {
+        fprintf(stderr, "Cancel: %s does not register cArrayFill\n", opt->xll);
+        return 1;
+    }
+    XlHostSetNum(&a[0], 100.0);
+    XlHostSetNum(&a[1], 10.0);
+    XlHostSetNum(&a[2], 1.0);
+    XlHostSetNum(&a[3], 0.0);
+    g_xlHostConfig.abortRequested = 1;
+    for (i = 0; i < DISCARD_CALLS; i++)
+    {
+        if (XlHostCall(fill, 4, args, &res) != xlretSuccess)
+            continue;
+        cancelled += (res.xltype & xltypeErr) == xltypeErr;
+        XlHostFreeResult(&res);
+    }
+    g_xlHostConfig.abortRequested = 0;
+    XlHostFireEvent(xleventCalculationCanceled);
+    printf("discard check: %d of %d cArrayFill calls cancelled, %.0f bytes left live\n", cancelled,
+        DISCARD_CALLS, LiveBytes(L"cArrayFill"));
+    fflush(stdout);
+    XlHostUnloadAll();
+    return 0;
+}
+
+// Starts 'threads' calls of cPiSeries and, after abortMs (>= 0), reports a break
+static void RunCalls(CancelThread* threads, int count, double terms, double maxMs, double partial, long abortMs, ULONGLONG* abortAt)
+{
+    int t;
+
+    for (t = 0; t < count; t++)
+    {
+        threads[t].terms = terms;
+        threads[t].maxMs = maxMs;
+        threads[t].partial = partial;
+        pthread_create(&threads[t].thread, NULL, CallMain, &threads[t]);
+    }
+    if (abortMs >= 0)
+    {
+        usleep((useconds_t)abortMs * 1000);
+        *abortAt = XlHostNowNs();
+        __atomic_store_n(&g_xlHostConfig.abortRequested, 1, __ATOMIC_RELEASE);
+    }
+    for (t = 0; t < count; t++)
+        pthread_join(threads[t].thread, NULL);
+    if (abortMs >= 0)
+    {
+        g_xlHostConfig.abortRequested = 0;
+        XlHostFireEvent(xleventCalculationCanceled);
+    }
+}
+
+static int RunConfig(const CancelOptions* opt, double slice)
+{
+    CancelThread threads[MAX_THREADS];
+    ULONGLONG t0, t1, abortAt = 0, lastEnd = 0, maxDeadline = 0;
+    double checks0, calls0, checks, calls, seconds, partial = NAN;
+    int t, errors = 0;
+
+    g_xlHostConfig.callbackCostNs = opt->callbackNs;
+    g_module = XlHostLoad(opt->xll);
+    if (g_module < 0)
+        return 1;
+    g_series = XlHostFindFunc(g_module, L"cPiSeries");
+    if (!g_series)
+    {
+        fprintf(stderr, "Cancel: %s does not register cPiSeries\n", opt->xll);
+        return 1;
+    }
+
+    // Overhead: calls that run to the end
+    memset(threads, 0, sizeof(threads));
+    checks0 = CancelCounter(L"SlowChecks");
+    calls0 = CancelCounter(L"AbortCalls");
+    t0 = XlHostNowNs();
+    RunCalls(threads, opt->threads, opt->terms, 0.0, 0.0, -1, NULL);
+    t1 = XlHostNowNs();
+    seconds = (double)(t1 - t0) / 1e9;
+    checks = CancelCounter(L"SlowChecks") - checks0;
+    calls = CancelCounter(L"AbortCalls") - calls0;
+    for (t = 0; t < opt->threads; t++)
+        errors += fabs(threads[t].value - M_PI) > 1e-6;
+
+    // Break: endless calls stopped by xlAbort
+    memset(threads, 0, sizeof(threads));
+    RunCalls(threads, opt->threads, 1e15, 0.0, 0.0, opt->abortMs, &abortAt);
+    for (t = 0; t < opt->threads; t++)
+    {
+        if (threads[t].end > lastEnd)
+            lastEnd = threads[t].end;
+        errors += !isnan(threads[t].value);
+    }
+
+    // Deadline: endless calls stopped by their budget, with partial results
+    memset(threads, 0, sizeof(threads));
+    RunCalls(threads, opt->threads, 1e15, opt->budgetMs, 1.0, -1, NULL);
+    for (t = 0; t < opt->threads; t++)
+    {
+        if (threads[t].end - threads[t].start > maxDeadline)
+            maxDeadline = threads[t].end - threads[t].start;
+        partial = threads[t].value;
+        errors += isnan(threads[t].value);
+    }
+
+    printf("%8.0f %10.2f %12.0f %12.0f %12.2f %12.2f %14.6f %7d\n", slice,
+        seconds * 1e9 / (opt->threads * opt->terms), checks / seconds, calls / seconds,
+        (double)(lastEnd - abortAt) / 1e6, (double)maxDeadline / 1e6, partial, errors);
+    fflush(stdout);
+    XlHostUnloadAll();
+    return 0;
+}
+
+// Forks so each slice length is read fresh from the environment
+static void SpawnConfig(const CancelOptions* opt, double slice)
+{
+    pid_t pid = fork();
+    int status = 0;
+
+    if (pid == 0)
+    {
+        char n[32];
+        snprintf(n, sizeof(n), "%g", slice);
+        setenv("XLL_CANCEL_SLICE_US", n, 1);
+        unsetenv("XLL_CALL_BUDGET_MS");
+        _exit(RunConfig(opt, slice));
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "Cancel: slice %g failed (status %d)\n", slice, status);
+}
+
+// Forks the discard check with xlAbort asked on every poll
+static void SpawnDiscard(const CancelOptions* opt)
+{
+    pid_t pid = fork();
+    int status = 0;
+
+    if (pid == 0)
+    {
+        setenv("XLL_CANCEL_SLICE_US", "0", 1);
+        unsetenv("XLL_CALL_BUDGET_MS");
+        _exit(RunDiscard(opt));
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "Cancel: the discard check failed (status %d)\n", status);
+}
+
+int main(int argc, char** argv)
+{
+    CancelOptions opt = { NULL, { 0, 100, 1000 }, 3, 5e6, 1, 100, 50.0, 1000 };
+    int a, c;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--slices") && a + 1 < argc)
+        {
+            char* p = argv[++a];
+            for (opt.configs = 0; *p && opt.configs < MAX_CONFIGS; )
+            {
+                opt.slices[opt.configs++] = strtod(p, &p);
+                if (*p == ',')
+                    p++;
+            }
+        }
+        else if (!strcmp(argv[a], "--terms") && a + 1 < argc) opt.terms = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--abort-ms") && a + 1 < argc) opt.abortMs = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--budget-ms") && a + 1 < argc) opt.budgetMs = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--callback-ns") && a + 1 < argc) opt.callbackNs = atol(argv[++a]);
+        else
+        {
+            fprintf(stderr, "Cancel: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: Cancel [--slices A,B,..] [--terms N] [--threads T] [--abort-ms MS]\n"
+                        "              [--budget-ms MS] [--callback-ns NS] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.terms < 1) opt.terms = 1;
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+    if (opt.abortMs < 0) opt.abortMs = 0;
+
+    printf("%.0f terms, %d thread%s, break after %ld ms, budget %.0f ms, callbacks %ld ns\n", opt.terms,
+        opt.threads, opt.threads == 1 ? "" : "s", opt.abortMs, opt.budgetMs, opt.callbackNs);
+    printf("%8s %10s %12s %12s %12s %12s %14s %7s\n",
+        "slice_us", "ns/term", "checks/s", "xlabort/s", "break_ms", "deadline_ms", "partial", "errors");
+    fflush(stdout);
+    for (c = 0; c < opt.configs; c++)
+        SpawnConfig(&opt, opt.slices[c]);
+    SpawnDiscard(&opt);
+    return 0;
+}
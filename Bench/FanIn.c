@@ -0,0 +1,213 @@
+/*
+**  FanIn
+**
+**  Measures what single-flight coalescing (Common/SingleFlight.c) saves when
+**  many cells call one pure function with the same arguments at once. A
+**  recalc of --cells cells is spread over --threads threads through a shared
+**  cell counter, as Excel's calc chain hands out cells; every run of --fan-in
+**  consecutive cells calls cDoubleInner with the same arguments, so that
+**  many calls of each argument pair arrive together.
+**
+**  The recalc runs twice, each in a forked process that loads the XLL fresh:
+**    off   XLL_SINGLEFLIGHT=0, every call computes
+**    on    XLL_SINGLEFLIGHT=1, identical calls in flight share the leader's result
+**  Work is the time the kernel spent in Sleep(), summed over threads, so it
+**  counts duplicated computations directly. The result cache stays off.
+**
+**  Usage: FanIn [options] MultithreadCrash.so
+**    --function NAME    pure UDF to call, two number arguments (default cDoubleInner)
+**    --cells N          calls per recalc (default 400)
+**    --fan-in F         consecutive cells sharing one argument pair (default 8)
+**    --threads T        recalc threads (default 8)
+**    --sleep-scale S    multiplier for Sleep() inside UDFs (default 0.05)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 64
+
+typedef struct FanInOptions
+{
+    const char* xll;
+    const char* function;
+    long   cells;
+    long   fanIn;
+    int    threads;
+    double sleepScale;
+} FanInOptions;
+
+typedef struct FanInWorker
+{
+    pthread_t thread;
+    const XlHostFunc* func;
+    const FanInOptions* opt;
+    XlHostStats stats;
+} FanInWorker;
+
+static volatile LONG g_nextCell = 0;
+
+static void* WorkerMain(void* arg)
+{
+    FanInWorker* w = (FanInWorker*)arg;
+    long i;
+
+    XlHostResetThreadStats();
+    while ((i = InterlockedIncrement(&g_nextCell) - 1) < w->opt->cells)
+    {
+        XLOPER12 x, y, res;
+        LPXLOPER12 args[2] = { &x, &y };
+        XlHostSetNum(&x, (double)(i / w->opt->fanIn));
+        XlHostSetNum(&y, 0.5);
+        XlHostCall(w->func, 2, args, &res);
+        XlHostFreeResult(&res);
+    }
+    w->stats = *XlHostThreadStats();
+    return NULL;
+}
+
+// Reads one column of the function's row in mcSingleFlightStats, -1 if unavailable
+static double FlightCounter(int module, const WCHAR* function, const WCHAR* column)
+{
+    const XlHostFunc* stats = XlHostFindFunc(module, L"mcSingleFlightStats");
+    XLOPER12 res;
+    double value = -1.0;
+    int r, c, cols;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return value;
+    if ((res.xltype & xltypeMulti) == xltypeMulti)
+    {
+        cols = res.val.array.columns;
+        for (c = 0; c < cols; c++)
+        {
+            LPXLOPER12 head = &res.val.array.lparray[c];
+            if ((head->xltype & xltypeStr) && (size_t)head->val.str[0] == wcslen(column)
+                && wcsncmp(&head->val.str[1], column, head->val.str[0]) == 0)
+                break;
+        }
+        for (r = 1; c < cols && r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * cols];
+            LPXLOPER12 val = &res.val.array.lparray[r * cols + c];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(function)
+                && wcsncmp(&key->val.str[1], function, key->val.str[0]) == 0 && (val->xltype & xltypeNum))
+                value = val->val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+// Runs inside the child process: load, recalc, print one result line
+static int RunPhase(const FanInOptions* opt, const char* phase)
+{
+    FanInWorker workers[MAX_THREADS];
+    XlHostStats total;
+    WCHAR name[64];
+    const XlHostFunc* func;
+    ULONGLONG t0, t1;
+    double coalesced, peak;
+    int module, t;
+
+    g_xlHostConfig.sleepScale = opt->sleepScale;
+    module = XlHostLoad(opt->xll);
+    if (module < 0)
+        return 1;
+    mbstowcs(name, opt->function, _countof(name));
+    func = XlHostFindFunc(module, name);
+    if (!func || func->argCount != 2)
+    {
+        fprintf(stderr, "FanIn: %s does not register a two-argument %s\n", opt->xll, opt->function);
+        return 1;
+    }
+
+    t0 = XlHostNowNs();
+    for (t = 0; t < opt->threads; t++)
+    {
+        workers[t].func = func;
+        workers[t].opt = opt;
+        pthread_create(&workers[t].thread, NULL, WorkerMain, &workers[t]);
+    }
+    memset(&total, 0, sizeof(total));
+    for (t = 0; t < opt->threads; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        XlHostAddStats(&total, &workers[t].stats);
+    }
+    t1 = XlHostNowNs();
+    XlHostFireEvent(xleventCalculationEnded);
+
+    coalesced = FlightCounter(module, name, L"Coalesced");
+    peak = FlightCounter(module, name, L"PeakFanIn");
+    printf("%-5s %10.1f %7ld %10.1f %9.0f %9.1f %7.0f\n", phase,
+        (double)(t1 - t0) / 1e6, opt->cells, (double)total.sleepNs / 1e6,
+        coalesced < 0 ? 0.0 : coalesced, coalesced < 0 ? 0.0 : 100.0 * coalesced / (double)opt->cells,
+        peak < 0 ? 1.0 : peak);
+    fflush(stdout);
+    XlHostUnloadAll();
+    return 0;
+}
+
+// Forks so each phase loads the XLL into a fresh process
+static void SpawnPhase(const FanInOptions* opt, const char* phase)
+{
+    pid_t pid = fork();
+    int status = 0;
+
+    if (pid == 0)
+    {
+        unsetenv("XLL_RESULT_CACHE");
+        setenv("XLL_SINGLEFLIGHT", strcmp(phase, "off") == 0 ? "0" : "1", 1);
+        _exit(RunPhase(opt, phase));
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "FanIn: %s phase failed (status %d)\n", phase, status);
+}
+
+int main(int argc, char** argv)
+{
+    FanInOptions opt = { NULL, "cDoubleInner", 400, 8, 8, 0.05 };
+    int a;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--function") && a + 1 < argc) opt.function = argv[++a];
+        else if (!strcmp(argv[a], "--cells") && a + 1 < argc) opt.cells = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--fan-in") && a + 1 < argc) opt.fanIn = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--sleep-scale") && a + 1 < argc) opt.sleepScale = atof(argv[++a]);
+        else
+        {
+            fprintf(stderr, "FanIn: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: FanIn [--function NAME] [--cells N] [--fan-in F] [--threads T]\n"
+                        "             [--sleep-scale S] MultithreadCrash.so\n");
+        return 2;
+    }
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+    if (opt.fanIn < 1) opt.fanIn = 1;
+
+    printf("%s: %ld cells, %ld per argument pair, %d threads, sleep scale %g\n",
+        opt.function, opt.cells, opt.fanIn, opt.threads, opt.sleepScale);
+    printf("%-5s %10s %7s %10s %9s %9s %7s\n", "phase", "recalc_ms", "calls", "work_ms", "coalesced", "avoided%", "peak");
+    fflush(stdout);
+
+    SpawnPhase(&opt, "off");
+    SpawnPhase(&opt, "on");
+    return 0;
+}
@@ -0,0 +1,346 @@
+/*
+**  Handles
+**
+**  Measures what the handle store (Common/HandleStore.c) saves on a chain of
+**  array UDFs. Each recalc of a chain calls
+**      cArrayFill(rows, columns, seed)  ->  cArrayScale x --depth  ->  cArraySum
+**  with every result passed to the next call the way Excel passes cells:
+**    values    each result is an array. The host copies it into the "cell"
+**              and passes that copy to the next call, as Excel does.
+**    handles   each result is a handle string. The next call reads the matrix
+**              in place, and only the string goes through the cell.
+**  A chain's cells keep their last results until the next recalc replaces
+**  them, and every recalc ends with xleventCalculationEnded (which sweeps the
+**  store). Each call reports its own cell through xlfCaller, so the store
+**  keeps every object a cell shows. --threads chains recalculate side by
+**  side. After the last recalc, IDLE_RECALCS more recalcs leave the chains
+**  alone, as smart recalc does with unchanged cells, and then each chain's
+**  last handle is read again.
+**
+**  Last, a sheet check puts cArrayFill in cell A1 of two sheets, then
+**  recalculates only Sheet2. Sheet1's handle must still read, and the handle
+**  Sheet2 replaced must not.
+**
+**  Per mode it reports time per recalc, GlobalAlloc calls and bytes per
+**  recalc, the bytes held in cells, the store's peak bytes, live objects,
+**  the chains whose handle no longer read after the idle recalcs, and the
+**  final sum (the same in both modes).
+**
+**  Usage: Handles [options] ThreadSafeC.so
+**    --rows R         matrix rows (default 2000)
+**    --columns C      matrix columns (default 8)
+**    --depth D        cArrayScale calls per chain (default 8)
+**    --recalcs N      recalcs per mode (default 20)
+**    --threads T      chains recalculated at once (default 1)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 64
+#define MAX_DEPTH   64
+#define IDLE_RECALCS 4
+
+typedef struct HandlesOptions
+{
+    const char* xll;
+    int  rows;
+    int  columns;
+    int  depth;
+    int  recalcs;
+    int  threads;
+} HandlesOptions;
+
+typedef struct Chain
+{
+    pthread_t thread;
+    const HandlesOptions* opt;
+    int index;
+    int handles;
+    XLOPER12 cells[MAX_DEPTH + 2];  // The chain's cells: fill, scales, sum
+    double sum;
+    XlHostStats stats;
+} Chain;
+
+static const XlHostFunc* g_fill;
+static const XlHostFunc* g_scale;
+static const XlHostFunc* g_sum;
+static pthread_barrier_t g_start;
+static pthread_barrier_t g_done;
+
+// Bytes a cell value occupies in the host (what Excel would hold in the cell)
+static size_t CellBytes(const XLOPER12* x)
+{
+    DWORD type = x->xltype & ~(xlbitDLLFree | xlbitXLFree);
+    size_t n, i, bytes = sizeof(XLOPER12);
+
+    if (type == xltypeStr)
+        return bytes + ((size_t)x->val.str[0] + 2) * sizeof(XCHAR);
+    if (type != xltypeMulti)
+        return bytes;
+    n = (size_t)x->val.array.rows * (size_t)x->val.array.columns;
+    for (i = 0; i < n; i++)
+        bytes += CellBytes(&x->val.array.lparray[i]);
+    return bytes;
+}
+
+// One recalc of the chain: every cell is replaced by its new value
+static void Recalc(Chain* c, int recalc)
+{
+    const HandlesOptions* opt = c->opt;
+    XLOPER12 a[4], res;
+    LPXLOPER12 args[4] = { &a[0], &a[1], &a[2], &a[3] };
+    int d;
+
+    XlHostSetNum(&a[0], (double)opt->rows);
+    XlHostSetNum(&a[1], (double)opt->columns);
+    XlHostSetNum(&a[2], (double)(c->index + recalc));
+    XlHostSetNum(&a[3], (double)c->handles);
+    XlHostSetCaller(c->index, 0);
+    XlHostCall(g_fill, 4, args, &res);
+    XlHostFreeResult(&c->cells[0]);
+    c->cells[0] = res;
+
+    for (d = 1; d <= opt->depth; d++)
+    {
+        LPXLOPER12 scaleArgs[3] = { &c->cells[d - 1], &a[0], &a[1] };
+        XlHostSetNum(&a[0], 0.5);
+        XlHostSetNum(&a[1], (double)c->handles);
+        XlHostSetCaller(c->index, d);
+        XlHostCall(g_scale, 3, scaleArgs, &res);
+        XlHostFreeResult(&c->cells[d]);
+        c->cells[d] = res;
+    }
+
+    args[0] = &c->cells[opt->depth];
+    XlHostSetCaller(c->index, opt->depth + 1);
+    XlHostCall(g_sum, 1, args, &res);
+    XlHostFreeResult(&c->cells[opt->depth + 1]);
+    c->cells[opt->depth + 1] = res;
+}
+
+static void* ChainMain(void* arg)
+{
+    Chain* c = (Chain*)arg;
+    int r;
+
+    XlHostResetThreadStats();
+    for (r = 0; r < c->opt->recalcs; r++)
+    {
+        pthread_barrier_wait(&g_start);
+        Recalc(c, r);
+        pthread_barrier_wait(&g_done);
+    }
+    c->stats = *XlHostThreadStats();
+    if ((c->cells[c->opt->depth + 1].xltype & xltypeNum) == xltypeNum)
+        c->sum = c->cells[c->opt->depth + 1].val.num;
+    return NULL;
+}
+
+// Reads one row of cHandleStats
+static double HandleCounter(int module, const WCHAR* name)
+{
+    const XlHostFunc* stats = XlHostFindFunc(module, L"cHandleStats");
+    XLOPER12 res;
+    double value = 0.0;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 2)
+    {
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * 2];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(name)
+                && wcsncmp(&key->val.str[1], name, key->val.str[0]) == 0)
+                value = res.val.array.lparray[r * 2 + 1].val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+static void RunMode(const HandlesOptions* opt, int module, int handles)
+{
+    Chain chains[MAX_THREADS];
+    XlHostStats total;
+    ULONGLONG t0, t1, recalcNs = 0;
+    size_t cellBytes = 0;
+    double sum = 0.0, storePeak0 = HandleCounter(module, L"PeakBytes");
+    int t, r, d, stale = 0;
+
+    memset(chains, 0, sizeof(chains));
+    pthread_barrier_init(&g_start, NULL, (unsigned)opt->threads + 1);
+    pthread_barrier_init(&g_done, NULL, (unsigned)opt->threads + 1);
+    for (t = 0; t < opt->threads; t++)
+    {
+        chains[t].opt = opt;
+        chains[t].index = t;
+        chains[t].handles = handles;
+        for (d = 0; d < MAX_DEPTH + 2; d++)
+            chains[t].cells[d].xltype = xltypeNil;
+        pthread_create(&chains[t].thread, NULL, ChainMain, &chains[t]);
+    }
+    for (r = 0; r < opt->recalcs; r++)
+    {
+        t0 = XlHostNowNs();
+        pthread_barrier_wait(&g_start);
+        pthread_barrier_wait(&g_done);
+        t1 = XlHostNowNs();
+        XlHostFireEvent(xleventCalculationEnded);
+        recalcNs += t1 - t0;
+    }
+    memset(&total, 0, sizeof(total));
+    for (t = 0; t < opt->threads; t++)
+    {
+        pthread_join(chains[t].thread, NULL);
+        XlHostAddStats(&total, &chains[t].stats);
+        sum += chains[t].sum;
+    }
+
+    // Recalcs that leave the chains alone, then every chain's last cell is read again
+    for (r = 0; r < IDLE_RECALCS; r++)
+        XlHostFireEvent(xleventCalculationEnded);
+    for (t = 0; t < opt->threads; t++)
+    {
+        LPXLOPER12 args[1] = { &chains[t].cells[opt->depth] };
+        XLOPER12 res;
+        XlHostSetCaller(t, opt->depth + 1);
+        if (XlHostCall(g_sum, 1, args, &res) != xlretSuccess)
+        {
+            stale++;
+            continue;
+        }
+        if ((res.xltype & xltypeNum) != xltypeNum || isnan(res.val.num))
+            stale++;
+        XlHostFreeResult(&res);
+    }
+    XlHostSetCaller(-1, 0);
+
+    for (t = 0; t < opt->threads; t++)
+    {
+        for (d = 0; d <= opt->depth + 1; d++)
+        {
+            cellBytes += CellBytes(&chains[t].cells[d]);
+            XlHostFreeResult(&chains[t].cells[d]);
+        }
+    }
+    pthread_barrier_destroy(&g_start);
+    pthread_barrier_destroy(&g_done);
+
+    printf("%-8s %11.3f %11.1f %13.0f %12zu %12.0f %10.0f %6d %18.6g\n", handles ? "handles" : "values",
+        (double)recalcNs / 1e6 / opt->recalcs,
+        (double)total.allocCalls / opt->recalcs, (double)total.allocBytes / opt->recalcs,
+        cellBytes, handles ? HandleCounter(module, L"PeakBytes") : storePeak0,
+        HandleCounter(module, L"Live"), stale, sum);
+    fflush(stdout);
+}
+
+// cArraySum of a handle: "live" if it still reads (NaN, #NUM! in Excel, once it does not)
+static const char* HandleState(const XLOPER12* handle)
+{
+    LPXLOPER12 args[1] = { (LPXLOPER12)handle };
+    XLOPER12 res;
+    int live;
+
+    if (XlHostCall(g_sum, 1, args, &res) != xlretSuccess)
+        return "dropped";
+    live = (res.xltype & xltypeNum) == xltypeNum && !isnan(res.val.num);
+    XlHostFreeResult(&res);
+    return live ? "live" : "dropped";
+}
+
+// A1 on Sheet1 and on Sheet2 each show a handle; then only Sheet2 recalculates
+static void SheetCheck(const HandlesOptions* opt)
+{
+    XLOPER12 a[4], first, replaced, second;
+    LPXLOPER12 args[4] = { &a[0], &a[1], &a[2], &a[3] };
+    int r;
+
+    XlHostSetNum(&a[0], (double)opt->rows);
+    XlHostSetNum(&a[1], (double)opt->columns);
+    XlHostSetNum(&a[2], 1.0);
+    XlHostSetNum(&a[3], 1.0);
+    XlHostSetCaller(0, 0);
+    XlHostSetCallerSheet(1);
+    XlHostCall(g_fill, 4, args, &first);
+    XlHostSetCallerSheet(2);
+    XlHostCall(g_fill, 4, args, &replaced);
+    XlHostFireEvent(xleventCalculationEnded);
+
+    XlHostSetNum(&a[2], 2.0);
+    XlHostCall(g_fill, 4, args, &second);
+    for (r = 0; r <= IDLE_RECALCS; r++)
+        XlHostFireEvent(xleventCalculationEnded);
+    XlHostSetCaller(-1, 0);
+    XlHostSetCallerSheet(1);
+
+    printf("\nsheet check: after Sheet2 recalculates A1, Sheet1's A1 handle %s, Sheet2's old handle %s\n",
+        HandleState(&first), HandleState(&replaced));
+    XlHostFreeResult(&first);
+    XlHostFreeResult(&replaced);
+    XlHostFreeResult(&second);
+}
+
+int main(int argc, char** argv)
+{
+    HandlesOptions opt = { NULL, 2000, 8, 8, 20, 1 };
+    int a, module;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--rows") && a + 1 < argc) opt.rows = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--columns") && a + 1 < argc) opt.columns = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--depth") && a + 1 < argc) opt.depth = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--recalcs") && a + 1 < argc) opt.recalcs = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else
+        {
+            fprintf(stderr, "Handles: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: Handles [--rows R] [--columns C] [--depth D] [--recalcs N] [--threads T] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.rows < 1) opt.rows = 1;
+    if (opt.columns < 1) opt.columns = 1;
+    if (opt.depth < 0) opt.depth = 0;
+    if (opt.depth > MAX_DEPTH) opt.depth = MAX_DEPTH;
+    if (opt.recalcs < 1) opt.recalcs = 1;
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+
+    module = XlHostLoad(opt.xll);
+    if (module < 0)
+        return 1;
+    g_fill = XlHostFindFunc(module, L"cArrayFill");
+    g_scale = XlHostFindFunc(module, L"cArrayScale");
+    g_sum = XlHostFindFunc(module, L"cArraySum");
+    if (!g_fill || !g_scale || !g_sum)
+    {
+        fprintf(stderr, "Handles: %s does not register cArrayFill, cArrayScale and cArraySum\n", opt.xll);
+        return 1;
+    }
+
+    printf("%d x %d matrix, fill + %d scales + sum, %d recalcs, %d chain%s\n", opt.rows, opt.columns,
+        opt.depth, opt.recalcs, opt.threads, opt.threads == 1 ? "" : "s");
+    printf("%-8s %11s %11s %13s %12s %12s %10s %6s %18s\n",
+        "mode", "ms/recalc", "allocs", "alloc_bytes", "cell_bytes", "store_peak", "live", "stale", "sum");
+    fflush(stdout);
+    RunMode(&opt, module, 0);
+    RunMode(&opt, module, 1);
+    SheetCheck(&opt);
+    XlHostUnloadAll();
+    return 0;
+}
@@ -0,0 +1,434 @@
+/*
+**  Lookup
+**
+**  Compares lookups through a shared index (Common/Lookup.c) with per-call
+**  linear scans. The table has --rows rows and three columns: a key, a number
+**  and a string. Keys are strings (ID0000123) or numbers, in shuffled order,
+**  and about one lookup in eleven asks for a key that is not there.
+**
+**    build     cLookupIndex on the table from cell A1, then from B1 on an
+**              equal copy (the fingerprint finds the live index), then,
+**              a recalc later, from B1 on the copy with one key changed (a
+**              new index under a new handle)
+**    index     --lookups calls of cLookup, exact and then approximate
+**              (mode 1), spread over --threads threads sharing the index
+**    scan      --scans calls of cLookupScan on the same keys, one thread
+**
+**  Every scanned key is also looked up through the index, and the two answers
+**  must agree. Then the first index, which A1 still shows, should outlive
+**  four recalculations that leave A1 alone, and go as soon as A1 is
+**  recalculated over the changed copy and reuses the new index. Finally C1
+**  builds over the copy with four numbers nudged by +1, -1, -1 and +1 in
+**  their low bits, an edit a sum of position-weighted cells would not see:
+**  it must not count as a fingerprint collision.
+**
+**  Usage: Lookup [options] ThreadSafeC.so
+**    --rows N        table rows (default 500000)
+**    --keys K        str or num (default str)
+**    --lookups N     indexed lookups per mode (default 1000000)
+**    --scans N       scanned lookups per mode (default 200)
+**    --threads T     threads sharing the index (default 1)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <pthread.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 64
+
+typedef struct LookupOptions
+{
+    const char* xll;
+    int  rows;
+    int  strings;
+    int  lookups;
+    int  scans;
+    int  threads;
+} LookupOptions;
+
+typedef struct LookupThread
+{
+    pthread_t thread;
+    const LookupOptions* opt;
+    const XLOPER12* index;
+    int first;
+    int last;
+    int mode;
+    long found;
+} LookupThread;
+
+static const XlHostFunc* g_build;
+static const XlHostFunc* g_lookup;
+static const XlHostFunc* g_scan;
+static int g_module;
+
+static UINT64 Next(UINT64* state)
+{
+    UINT64 x = (*state += 0x9E3779B97F4A7C15ull);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// The key of id: a string or a number
+static void SetKey(LPXLOPER12 x, int strings, long id)
+{
+    WCHAR text[32];
+
+    if (!strings)
+    {
+        XlHostSetNum(x, (double)id);
+        return;
+    }
+    swprintf(text, 32, L"ID%07ld", id);
+    XlHostSetStr(x, text);
+}
+
+// Key i of the lookups: ids up to 10% past the table miss
+static void SetLookupKey(LPXLOPER12 x, const LookupOptions* opt, int i, int mode)
+{
+    UINT64 state = (UINT64)i * 7919u + 1;
+    long id = (long)(Next(&state) % (UINT64)(opt->rows + opt->rows / 10));
+
+    SetKey(x, opt->strings, id);
+    if (mode != 0 && !opt->strings)
+        x->val.num += 0.5;          // Between two keys: the lower one is the answer
+}
+
+// A rows x 3 table: a shuffled key, id * 1.5 and the id as text
+static void NewTable(LPXLOPER12 table, const LookupOptions* opt)
+{
+    LPXLOPER12 cells = (LPXLOPER12)calloc((size_t)opt->rows * 3, sizeof(XLOPER12));
+    long* ids = (long*)malloc((size_t)opt->rows * sizeof(long));
+    UINT64 state = 42;
+    WCHAR text[32];
+    int r;
+
+    for (r = 0; r < opt->rows; r++)
+        ids[r] = r;
+    for (r = opt->rows - 1; r > 0; r--)
+    {
+        int j = (int)(Next(&state) % (UINT64)(r + 1));
+        long t = ids[r];
+        ids[r] = ids[j];
+        ids[j] = t;
+    }
+    for (r = 0; r < opt->rows; r++)
+    {
+        SetKey(&cells[r * 3], opt->strings, ids[r]);
+        XlHostSetNum(&cells[r * 3 + 1], ids[r] * 1.5);
+        swprintf(text, 32, L"row %ld", ids[r]);
+        XlHostSetStr(&cells[r * 3 + 2], text);
+    }
+    free(ids);
+    table->xltype = xltypeMulti;
+    table->val.array.rows = opt->rows;
+    table->val.array.columns = 3;
+    table->val.array.lparray = cells;
+}
+
+static void FreeTable(LPXLOPER12 table)
+{
+    int i;
+
+    for (i = 0; i < table->val.array.rows * 3; i++)
+        XlHostFreeResult(&table->val.array.lparray[i]);
+    free(table->val.array.lparray);
+}
+
+static double Build(const XLOPER12* table, LPXLOPER12 handle)
+{
+    LPXLOPER12 args[1] = { (LPXLOPER12)table };
+    ULONGLONG t0 = XlHostNowNs();
+
+    XlHostCall(g_build, 1, args, handle);
+    return (double)(XlHostNowNs() - t0) / 1e6;
+}
+
+// One lookup through f (cLookup or cLookupScan) of column 2
+static void Lookup(const XlHostFunc* f, LPXLOPER12 key, const XLOPER12* source, int mode, LPXLOPER12 res)
+{
+    XLOPER12 a[2];
+    LPXLOPER12 args[4] = { key, (LPXLOPER12)source, &a[0], &a[1] };
+
+    XlHostSetNum(&a[0], 2.0);
+    XlHostSetNum(&a[1], (double)mode);
+    XlHostCall(f, 4, args, res);
+}
+
+static void* LookupMain(void* arg)
+{
+    LookupThread* t = (LookupThread*)arg;
+    XLOPER12 key, res;
+    int i;
+
+    for (i = t->first; i < t->last; i++)
+    {
+        SetLookupKey(&key, t->opt, i, t->mode);
+        Lookup(g_lookup, &key, t->index, t->mode, &res);
+        if ((res.xltype & xltypeNum) == xltypeNum)
+            t->found++;
+        XlHostFreeResult(&res);
+        XlHostFreeResult(&key);
+    }
+    return NULL;
+}
+
+// ns per indexed lookup over every thread
+static double TimeIndex(const LookupOptions* opt, const XLOPER12* index, int mode, long* found)
+{
+    LookupThread threads[MAX_THREADS];
+    ULONGLONG t0 = XlHostNowNs();
+    int t;
+
+    *found = 0;
+    for (t = 0; t < opt->threads; t++)
+    {
+        threads[t].opt = opt;
+        threads[t].index = index;
+        threads[t].first = (int)((long long)opt->lookups * t / opt->threads);
+        threads[t].last = (int)((long long)opt->lookups * (t + 1) / opt->threads);
+        threads[t].mode = mode;
+        threads[t].found = 0;
+        pthread_create(&threads[t].thread, NULL, LookupMain, &threads[t]);
+    }
+    for (t = 0; t < opt->threads; t++)
+    {
+        pthread_join(threads[t].thread, NULL);
+        *found += threads[t].found;
+    }
+    return (double)(XlHostNowNs() - t0) / opt->lookups;
+}
+
+static BOOL SameValue(const XLOPER12* a, const XLOPER12* b)
+{
+    DWORD type = a->xltype & 0x0FFF;
+
+    if (type != (b->xltype & 0x0FFF))
+        return FALSE;
+    if (type == xltypeNum)
+        return a->val.num == b->val.num;
+    if (type == xltypeErr)
+        return a->val.err == b->val.err;
+    return TRUE;
+}
+
+// ns per scanned lookup; counts the keys where the index answers differently
+static double TimeScan(const LookupOptions* opt, const XLOPER12* table, const XLOPER12* index, int mode, int* mismatches)
+{
+    XLOPER12 key, res, check;
+    ULONGLONG t0, ns = 0;
+    int i;
+
+    *mismatches = 0;
+    for (i = 0; i < opt->scans; i++)
+    {
+        SetLookupKey(&key, opt, i, mode);
+        t0 = XlHostNowNs();
+        Lookup(g_scan, &key, table, mode, &res);
+        ns += XlHostNowNs() - t0;
+        Lookup(g_lookup, &key, index, mode, &check);
+        if (!SameValue(&res, &check))
+            (*mismatches)++;
+        XlHostFreeResult(&res);
+        XlHostFreeResult(&check);
+        XlHostFreeResult(&key);
+    }
+    return (double)ns / opt->scans;
+}
+
+// Reads one row of cLookupStats
+static double LookupCounter(const WCHAR* name)
+{
+    const XlHostFunc* stats = XlHostFindFunc(g_module, L"cLookupStats");
+    XLOPER12 res;
+    double value = 0.0;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 2)
+    {
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * 2];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(name)
+                && wcsncmp(&key->val.str[1], name, key->val.str[0]) == 0)
+                value = res.val.array.lparray[r * 2 + 1].val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+// Nudges the numbers of rows r..r+3 by +1, -1, -1, +1 in their bits (sign -1 undoes it)
+static void Nudge(LPXLOPER12 table, int r, int sign)
+{
+    static const int steps[4] = { 1, -1, -1, 1 };
+    int k;
+
+    for (k = 0; k < 4; k++)
+    {
+        LPXLOPER12 x = &table->val.array.lparray[(r + k) * 3 + 1];
+        UINT64 bits;
+        memcpy(&bits, &x->val.num, sizeof(bits));
+        bits += (UINT64)(INT64)(steps[k] * sign);
+        memcpy(&x->val.num, &bits, sizeof(bits));
+    }
+}
+
+// C1 builds over the copy with an edit that leaves a linear fingerprint unchanged
+static void CollisionCheck(LPXLOPER12 copy)
+{
+    XLOPER12 handle;
+    double collisions = LookupCounter(L"Collisions");
+    int r;
+
+    // Rows whose numbers are not 0, so no nudge crosses zero
+    for (r = 0; r + 4 <= copy->val.array.rows; r++)
+        if (copy->val.array.lparray[r * 3 + 1].val.num != 0.0 && copy->val.array.lparray[(r + 1) * 3 + 1].val.num != 0.0
+            && copy->val.array.lparray[(r + 2) * 3 + 1].val.num != 0.0 && copy->val.array.lparray[(r + 3) * 3 + 1].val.num != 0.0)
+            break;
+    if (r + 4 > copy->val.array.rows)
+        return;
+    Nudge(copy, r, 1);
+    XlHostSetCaller(0, 2);
+    Build(copy, &handle);
+    XlHostSetCaller(-1, 0);
+    Nudge(copy, r, -1);
+    printf("collision check: an edit that cancels in a linear sum, %.0f fingerprint collisions\n",
+        LookupCounter(L"Collisions") - collisions);
+    XlHostFreeResult(&handle);
+}
+
+static void PrintStats(void)
+{
+    const XlHostFunc* stats = XlHostFindFunc(g_module, L"cLookupStats");
+    XLOPER12 res;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return;
+    if ((res.xltype & xltypeMulti) == xltypeMulti)
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 row = &res.val.array.lparray[r * 2];
+            printf("  %-14.*ls %.0f\n", (int)row[0].val.str[0], &row[0].val.str[1], row[1].val.num);
+        }
+    XlHostFreeResult(&res);
+}
+
+int main(int argc, char** argv)
+{
+    LookupOptions opt = { NULL, 500000, 1, 1000000, 200, 1 };
+    XLOPER12 table, copy, first, second, third, probe, res;
+    double indexNs[2], scanNs[2], ms;
+    long found[2];
+    int mismatches[2], mode, a, i;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--rows") && a + 1 < argc) opt.rows = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--keys") && a + 1 < argc) opt.strings = strcmp(argv[++a], "num") != 0;
+        else if (!strcmp(argv[a], "--lookups") && a + 1 < argc) opt.lookups = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--scans") && a + 1 < argc) opt.scans = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else
+        {
+            fprintf(stderr, "Lookup: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: Lookup [--rows N] [--keys str|num] [--lookups N] [--scans N] [--threads T] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.rows < 2) opt.rows = 2;
+    if (opt.lookups < 1) opt.lookups = 1;
+    if (opt.scans < 1) opt.scans = 1;
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+
+    g_module = XlHostLoad(opt.xll);
+    if (g_module < 0)
+        return 1;
+    g_build = XlHostFindFunc(g_module, L"cLookupIndex");
+    g_lookup = XlHostFindFunc(g_module, L"cLookup");
+    g_scan = XlHostFindFunc(g_module, L"cLookupScan");
+    if (!g_build || !g_lookup || !g_scan)
+    {
+        fprintf(stderr, "Lookup: %s does not register cLookupIndex, cLookup and cLookupScan\n", opt.xll);
+        return 1;
+    }
+
+    printf("%d rows x 3, %s keys\n", opt.rows, opt.strings ? "string" : "number");
+    NewTable(&table, &opt);
+    NewTable(&copy, &opt);
+    XlHostSetCaller(0, 0);
+    ms = Build(&table, &first);
+    printf("build    %8.1f ms  %.*ls\n", ms, (int)first.val.str[0], &first.val.str[1]);
+    XlHostSetCaller(0, 1);
+    ms = Build(&copy, &second);
+    printf("reuse    %8.1f ms  %.*ls (equal copy)\n", ms, (int)second.val.str[0], &second.val.str[1]);
+    XlHostFireEvent(xleventCalculationEnded);
+    XlHostFreeResult(&copy.val.array.lparray[0]);
+    SetKey(&copy.val.array.lparray[0], opt.strings, -1);
+    ms = Build(&copy, &third);
+    printf("rebuild  %8.1f ms  %.*ls (one key changed)\n", ms, (int)third.val.str[0], &third.val.str[1]);
+    XlHostFireEvent(xleventCalculationEnded);
+    XlHostSetCaller(-1, 0);
+
+    for (mode = 0; mode <= 1; mode++)
+    {
+        indexNs[mode] = TimeIndex(&opt, &first, mode, &found[mode]);
+        scanNs[mode] = TimeScan(&opt, &table, &first, mode, &mismatches[mode]);
+    }
+    printf("\n%-12s %14s %14s %10s %8s %11s\n", "mode", "index ns/key", "scan ns/key", "speedup", "found", "mismatches");
+    for (mode = 0; mode <= 1; mode++)
+        printf("%-12s %14.1f %14.0f %9.0fx %7.1f%% %11d\n", mode ? "approximate" : "exact", indexNs[mode], scanNs[mode],
+            scanNs[mode] / indexNs[mode], 100.0 * found[mode] / opt.lookups, mismatches[mode]);
+
+    // Only A1 shows the first index from here on; the rebuilt one is read every recalc
+    for (i = 0; i < 4; i++)
+    {
+        SetLookupKey(&probe, &opt, i, 0);
+        Lookup(g_lookup, &probe, &third, 0, &res);
+        XlHostFreeResult(&res);
+        XlHostFreeResult(&probe);
+        XlHostFireEvent(xleventCalculationEnded);
+    }
+    SetLookupKey(&probe, &opt, 0, 0);
+    Lookup(g_lookup, &probe, &first, 0, &res);
+    printf("\nafter 4 recalcs: first index %s, ", (res.xltype & xltypeErr) && res.val.err == xlerrValue ? "dropped" : "live");
+    XlHostFreeResult(&res);
+    Lookup(g_lookup, &probe, &third, 0, &res);
+    printf("rebuilt index %s\n", (res.xltype & xltypeErr) && res.val.err == xlerrValue ? "dropped" : "live");
+    XlHostFreeResult(&res);
+
+    // A1 recalculates over the changed copy: it reuses the rebuilt index and lets go of the first
+    XlHostSetCaller(0, 0);
+    XlHostFreeResult(&second);
+    Build(&copy, &second);
+    XlHostSetCaller(-1, 0);
+    Lookup(g_lookup, &probe, &first, 0, &res);
+    printf("after A1 reuses the rebuilt index: first index %s\n", (res.xltype & xltypeErr) && res.val.err == xlerrValue ? "dropped" : "live");
+    XlHostFreeResult(&res);
+    XlHostFreeResult(&probe);
+    CollisionCheck(&copy);
+
+    printf("\ncLookupStats\n");
+    PrintStats();
+    XlHostFreeResult(&first);
+    XlHostFreeResult(&second);
+    XlHostFreeResult(&third);
+    FreeTable(&table);
+    FreeTable(&copy);
+    XlHostUnloadAll();
+    return 0;
+}
@@ -0,0 +1,229 @@
+/*
+**  Marshal
+**
+**  Measures what each registration type code costs per call, using the
+**  cMarshal kernels (Common/Marshal.h): identical checksum kernels
+**  registered under B, Q, U, C%, D% and K%, with one and with four
+**  arguments. The host marshals each argument as Excel does for the code:
+**  a double for B, an XLOPER12 copied from the cell value for Q and U, a
+**  fresh null-terminated or counted string for C% and D%, and an FP12 of
+**  the array's numbers for K%.
+**
+**  Numbers are passed as one value. Text is passed at each of --lengths
+**  characters, and arrays as a column of each of --cells numbers. For every
+**  family, size and arity, the output gives ns per call for each code, the
+**  best of --reps runs of --calls calls (fewer for large arguments, so that
+**  each run moves about the same number of elements). Every code must
+**  return the same checksum; a code that does not is flagged. --no-copy
+**  passes Q and U arguments without the host's copy, which leaves the cost
+**  of the XLL side alone.
+**
+**  Usage: Marshal [options] ThreadSafeC.so
+**    --calls N          calls per run for the smallest sizes (default 200000)
+**    --reps R           runs per kernel, the fastest kept (default 5)
+**    --lengths A,B,..   text lengths (default 8,64,512,4096)
+**    --cells A,B,..     array sizes (default 1,16,256,4096)
+**    --no-copy          do not copy Q and U arguments
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include "XlHost.h"
+
+#define MAX_SIZES   8
+#define CODES       6
+
+typedef struct MarshalOptions
+{
+    const char* xll;
+    long calls;
+    int  reps;
+    int  lengths[MAX_SIZES];
+    int  lengthCount;
+    int  cells[MAX_SIZES];
+    int  cellCount;
+    int  copy;
+} MarshalOptions;
+
+// Columns of the matrix, and the families each code is registered for
+static const WCHAR* g_codes[CODES] = { L"B", L"Q", L"U", L"C", L"D", L"K" };
+static const char* g_codeNames[CODES] = { "B", "Q", "U", "C%", "D%", "K%" };
+static const WCHAR* g_families[3] = { L"Num", L"Str", L"Arr" };
+
+static int g_module;
+
+static int ParseList(char* p, int* out)
+{
+    int n = 0;
+
+    while (*p && n < MAX_SIZES)
+    {
+        out[n++] = (int)strtol(p, &p, 10);
+        if (*p == ',')
+            p++;
+        else if (*p)
+            break;
+    }
+    return n;
+}
+
+// The argument of a family at a size: a number, text of 'size' characters, or a column of 'size' numbers
+static void NewArg(LPXLOPER12 x, int family, int size)
+{
+    int i;
+
+    if (family == 0)
+        XlHostSetNum(x, 1.25);
+    else if (family == 1)
+    {
+        WCHAR* text = (WCHAR*)malloc((size + 1) * sizeof(WCHAR));
+        for (i = 0; i < size; i++)
+            text[i] = (WCHAR)(L'a' + i % 26);
+        text[size] = 0;
+        XlHostSetStr(x, text);
+        free(text);
+    }
+    else
+    {
+        x->xltype = xltypeMulti | xlbitXLFree;
+        x->val.array.rows = size;
+        x->val.array.columns = 1;
+        x->val.array.lparray = (LPXLOPER12)malloc((size_t)size * sizeof(XLOPER12));
+        for (i = 0; i < size; i++)
+            XlHostSetNum(&x->val.array.lparray[i], 0.5 * (i % 7));
+    }
+}
+
+// ns per call of f with 'arity' copies of arg, the fastest of reps runs; *sum gets its result
+static double TimeKernel(const XlHostFunc* f, int arity, LPXLOPER12 arg, long calls, int reps, double* sum)
+{
+    LPXLOPER12 args[4] = { arg, arg, arg, arg };
+    XLOPER12 res;
+    double best = 0.0;
+    int r;
+
+    XlHostCall(f, arity, args, &res);
+    *sum = (res.xltype & xltypeNum) == xltypeNum ? res.val.num : NAN;
+    XlHostFreeResult(&res);
+    for (r = 0; r < reps; r++)
+    {
+        ULONGLONG t0 = XlHostNowNs();
+        long i;
+        double ns;
+        for (i = 0; i < calls; i++)
+        {
+            XlHostCall(f, arity, args, &res);
+            XlHostFreeResult(&res);
+        }
+        ns = (double)(XlHostNowNs() - t0) / calls;
+        if (r == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+// One row of the matrix: every code registered for the family, at one size and arity
+static void Row(const MarshalOptions* opt, int family, int size, int arity)
+{
+    XLOPER12 arg;
+    char sizeText[16];
+    double first = NAN;
+    long elements = family == 0 ? 1 : size, calls = opt->calls;
+    int c, mismatch = 0;
+
+    if (elements > 16)
+        calls = opt->calls * 16 / elements;
+    if (calls < 200)
+        calls = 200;
+    NewArg(&arg, family, size);
+    if (family == 0)
+        snprintf(sizeText, sizeof(sizeText), "-");
+    else
+        snprintf(sizeText, sizeof(sizeText), "%d", size);
+    printf("%-4ls %6s %5d", g_families[family], sizeText, arity);
+    for (c = 0; c < CODES; c++)
+    {
+        WCHAR name[32];
+        const XlHostFunc* f;
+        double sum, ns;
+
+        swprintf(name, 32, L"cMarshal%ls%ls%d", g_families[family], g_codes[c], arity);
+        f = XlHostFindFunc(g_module, name);
+        if (!f)
+        {
+            printf(" %9s", "-");
+            continue;
+        }
+        ns = TimeKernel(f, arity, &arg, calls, opt->reps, &sum);
+        if (isnan(first))
+            first = sum;
+        else if (sum != first)
+            mismatch = 1;
+        printf(" %9.1f", ns);
+    }
+    printf("%s\n", mismatch ? "  checksum mismatch" : "");
+    fflush(stdout);
+    XlHostFreeResult(&arg);
+}
+
+int main(int argc, char** argv)
+{
+    MarshalOptions opt = { NULL, 200000, 5, { 8, 64, 512, 4096 }, 4, { 1, 16, 256, 4096 }, 4, 1 };
+    int a, c, i, arity;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--reps") && a + 1 < argc) opt.reps = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--lengths") && a + 1 < argc) opt.lengthCount = ParseList(argv[++a], opt.lengths);
+        else if (!strcmp(argv[a], "--cells") && a + 1 < argc) opt.cellCount = ParseList(argv[++a], opt.cells);
+        else if (!strcmp(argv[a], "--no-copy")) opt.copy = 0;
+        else
+        {
+            fprintf(stderr, "Marshal: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: Marshal [--calls N] [--reps R] [--lengths A,B,..] [--cells A,B,..] [--no-copy] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.calls < 1) opt.calls = 1;
+    if (opt.reps < 1) opt.reps = 1;
+    for (i = 0; i < opt.lengthCount; i++)
+        if (opt.lengths[i] < 0 || opt.lengths[i] > 32767) opt.lengths[i] = 32767;
+    for (i = 0; i < opt.cellCount; i++)
+        if (opt.cells[i] < 1) opt.cells[i] = 1;
+
+    g_xlHostConfig.copyArguments = opt.copy;
+    g_module = XlHostLoad(opt.xll);
+    if (g_module < 0)
+        return 1;
+    if (!XlHostFindFunc(g_module, L"cMarshalNumB1"))
+    {
+        fprintf(stderr, "Marshal: %s does not register the cMarshal kernels\n", opt.xll);
+        return 1;
+    }
+
+    printf("ns per call, best of %d runs; Q and U arguments %s\n", opt.reps, opt.copy ? "copied as from cells" : "passed as they are");
+    printf("%-4s %6s %5s", "kind", "size", "args");
+    for (c = 0; c < CODES; c++)
+        printf(" %9s", g_codeNames[c]);
+    printf("\n");
+    for (arity = 1; arity <= 4; arity += 3)
+        Row(&opt, 0, 1, arity);
+    for (i = 0; i < opt.lengthCount; i++)
+        for (arity = 1; arity <= 4; arity += 3)
+            Row(&opt, 1, opt.lengths[i], arity);
+    for (i = 0; i < opt.cellCount; i++)
+        for (arity = 1; arity <= 4; arity += 3)
+            Row(&opt, 2, opt.cells[i], arity);
+    XlHostUnloadAll();
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+**  MonteCarlo
+**
+**  Measures cMonteCarlo (Common/MonteCarlo.c) with each generator at each
+**  thread count in --threads. The pool is sized for the largest count, by
+**  setting XLL_REDUCE_THREADS before the XLL loads, and each call caps its
+**  threads with the threads argument. Every run prices the same Asian call
+**  (spot 100, strike 100, rate 3%, vol 20%, one year) on --paths paths of
+**  --steps fixings. The output gives paths per second, in total and per
+**  thread, and whether each price and standard error is bit-identical to
+**  the run on the first thread count.
+**
+**  Two checks follow. A one-step run is a European call, so its price must
+**  be within a few standard errors of Black-Scholes. cRandom must return
+**  the same number n whatever range of the stream it is asked for, and its
+**  uniforms must average about 1/2.
+**
+**  Usage: MonteCarlo [options] ThreadSafeC.so
+**    --paths N          paths per call (default 1000000)
+**    --steps N          fixings per path (default 64)
+**    --threads A,B,..   thread counts to compare (default 1,2,4)
+**    --calls N          calls per measurement (default 3)
+**    --seed S           (default 20261019)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include "XlHost.h"
+
+#define MAX_CONFIGS 8
+
+typedef struct McOptions
+{
+    const char* xll;
+    double paths;
+    double steps;
+    int threads[MAX_CONFIGS];
+    int configs;
+    int calls;
+    double seed;
+} McOptions;
+
+static const XlHostFunc* g_price;
+static const XlHostFunc* g_random;
+
+// cMonteCarlo with the bench's model; price and standard error in out, ms per call returned
+static double Price(const McOptions* opt, const WCHAR* generator, double steps, int threads, double out[2])
+{
+    XLOPER12 v[10], res;
+    LPXLOPER12 args[10];
+    const double model[8] = { 100.0, 100.0, 0.03, 0.2, 1.0, steps, opt->paths, opt->seed };
+    ULONGLONG t0;
+    int i, c;
+
+    for (i = 0; i < 8; i++)
+        XlHostSetNum(&v[i], model[i]);
+    XlHostSetStr(&v[8], generator);
+    XlHostSetNum(&v[9], threads);
+    for (i = 0; i < 10; i++)
+        args[i] = &v[i];
+    out[0] = out[1] = NAN;
+    t0 = XlHostNowNs();
+    for (c = 0; c < opt->calls; c++)
+    {
+        XlHostCall(g_price, 10, args, &res);
+        if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 2)
+        {
+            out[0] = res.val.array.lparray[0].val.num;
+            out[1] = res.val.array.lparray[1].val.num;
+        }
+        XlHostFreeResult(&res);
+    }
+    t0 = XlHostNowNs() - t0;
+    XlHostFreeResult(&v[8]);
+    return (double)t0 / 1e6 / opt->calls;
+}
+
+// cRandom(seed, first, count, "philox") into out; FALSE unless it returned count numbers
+static BOOL Uniforms(double seed, double first, int count, double* out)
+{
+    XLOPER12 v[4], res;
+    LPXLOPER12 args[4] = { &v[0], &v[1], &v[2], &v[3] };
+    BOOL ok;
+    int i;
+
+    XlHostSetNum(&v[0], seed);
+    XlHostSetNum(&v[1], first);
+    XlHostSetNum(&v[2], count);
+    XlHostSetStr(&v[3], L"philox");
+    XlHostCall(g_random, 4, args, &res);
+    ok = (res.xltype & xltypeMulti) == xltypeMulti && res.val.array.rows == count;
+    for (i = 0; ok && i < count; i++)
+        out[i] = res.val.array.lparray[i].val.num;
+    XlHostFreeResult(&res);
+    XlHostFreeResult(&v[3]);
+    return ok;
+}
+
+static double NormalCdf(double x)
+{
+    return 0.5 * erfc(-x / sqrt(2.0));
+}
+
+int main(int argc, char** argv)
+{
+    static const WCHAR* generators[2] = { L"philox", L"threefry" };
+    McOptions opt = { NULL, 1000000.0, 64.0, { 1, 2, 4 }, 3, 3, 20261019.0 };
+    double first[2][2], result[2], ms, bs, d1, d2, european[2];
+    double all[64], part[10], mean = 0.0, *many;
+    char n[16];
+    int a, g, c, i, max = 1, module, same;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--paths") && a + 1 < argc) opt.paths = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--steps") && a + 1 < argc) opt.steps = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc)
+        {
+            char* p = argv[++a];
+            for (opt.configs = 0; *p && opt.configs < MAX_CONFIGS; )
+            {
+                opt.threads[opt.configs++] = (int)strtol(p, &p, 10);
+                if (*p == ',')
+                    p++;
+            }
+        }
+        else if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--seed") && a + 1 < argc) opt.seed = atof(argv[++a]);
+        else
+        {
+            fprintf(stderr, "MonteCarlo: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: MonteCarlo [--paths N] [--steps N] [--threads A,B,..] [--calls N] [--seed S] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.paths < 1.0) opt.paths = 1.0;
+    if (opt.steps < 1.0) opt.steps = 1.0;
+    if (opt.calls < 1) opt.calls = 1;
+    for (c = 0; c < opt.configs; c++)
+    {
+        if (opt.threads[c] < 1) opt.threads[c] = 1;
+        if (opt.threads[c] > max) max = opt.threads[c];
+    }
+
+    snprintf(n, sizeof(n), "%d", max);
+    setenv("XLL_REDUCE_THREADS", n, 1);
+    module = XlHostLoad(opt.xll);
+    if (module < 0)
+        return 1;
+    g_price = XlHostFindFunc(module, L"cMonteCarlo");
+    g_random = XlHostFindFunc(module, L"cRandom");
+    if (!g_price || !g_random)
+    {
+        fprintf(stderr, "MonteCarlo: %s does not register cMonteCarlo and cRandom\n", opt.xll);
+        return 1;
+    }
+
+    printf("%.0f paths of %.0f steps, %d calls each, helpers for %d threads\n", opt.paths, opt.steps, opt.calls, max);
+    printf("%-9s %8s %10s %12s %14s %12s %12s %10s\n", "generator", "threads", "ms", "Mpaths/s", "Mpaths/s/thr",
+        "price", "stderr", "identical");
+    for (g = 0; g < 2; g++)
+        for (c = 0; c < opt.configs; c++)
+        {
+            ms = Price(&opt, generators[g], opt.steps, opt.threads[c], result);
+            if (c == 0)
+                memcpy(first[g], result, sizeof(result));
+            same = memcmp(result, first[g], sizeof(result)) == 0;
+            printf("%-9ls %8d %10.1f %12.3f %14.3f %12.6f %12.6f %10s\n", generators[g], opt.threads[c], ms,
+                opt.paths / ms / 1e3, opt.paths / ms / 1e3 / opt.threads[c], result[0], result[1], same ? "yes" : "NO");
+        }
+
+    d1 = (log(100.0 / 100.0) + (0.03 + 0.5 * 0.2 * 0.2) * 1.0) / 0.2;
+    d2 = d1 - 0.2;
+    bs = 100.0 * NormalCdf(d1) - 100.0 * exp(-0.03) * NormalCdf(d2);
+    for (g = 0; g < 2; g++)
+    {
+        Price(&opt, generators[g], 1.0, max, european);
+        printf("European %-9ls %.6f +- %.6f, Black-Scholes %.6f: %.2f standard errors\n", generators[g], european[0],
+            european[1], bs, fabs(european[0] - bs) / european[1]);
+    }
+
+    same = Uniforms(opt.seed, 0.0, 64, all) && Uniforms(opt.seed, 37.0, 10, part)
+        && memcmp(all + 37, part, sizeof(part)) == 0;
+    many = (double*)malloc(100000 * sizeof(double));
+    if (many && Uniforms(opt.seed, 1e12, 100000, many))
+    {
+        for (i = 0; i < 100000; i++)
+            mean += many[i];
+        mean /= 100000.0;
+    }
+    free(many);
+    printf("cRandom: numbers 37..46 %s numbers 37..46 of 0..63; mean of 100000 from 1e12 %.5f\n",
+        same ? "match" : "DO NOT match", mean);
+    return 0;
+}
@@ -0,0 +1,224 @@
+/*
+**  NestProbe
+**
+**  Cost of each nested Excel round trip, using cNestProbe: a UDF that calls
+**  itself back through xlUDF until depth levels lie below it and returns, per
+**  level, its thread and its entry and exit times. The round trip of a level
+**  is its own entry-to-exit time less that of the level below: the xlUDF call
+**  down, the dispatch, and the copy of the lower levels' rows back up.
+**
+**  For every thread count in --threads and depth in --depths, each thread
+**  runs --calls probes at once. Per thread count and depth it reports:
+**    trip ns      mean round trip over all calling levels
+**    first, last  mean round trip of the outermost and of the deepest calling
+**                 level
+**    ns/level     least-squares slope of the round trip against the level,
+**                 i.e. how much each level deeper adds to a call
+**    probe us     mean time of the whole probe, as its outermost level saw it
+**    short        probes that came back with fewer than depth + 1 rows
+**    switched     probes whose levels did not all run on one thread
+**
+**  The host runs nested calls on the calling thread, as Excel does, and only
+**  loads C add-ins, so the alternating (C and .NET) form of the probe is for
+**  Excel itself: =cNestProbe(8, 1) with ThreadSafeNet loaded.
+**
+**  Usage: NestProbe [options] ThreadSafeC.so
+**    --threads A,B,..   thread counts (default 1,2,4)
+**    --depths A,B,..    depths (default 1,2,4,8,16,32)
+**    --calls K          probes per thread (default 20000)
+**    --callback-ns N    busy-wait added to every callback (default 0)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <pthread.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 256
+#define MAX_LIST    8
+#define MAX_DEPTH   32
+#define COLUMNS     6
+
+typedef struct NestOptions
+{
+    const char* xll;
+    int  threads[MAX_LIST];
+    int  threadCount;
+    int  depths[MAX_LIST];
+    int  depthCount;
+    long calls;
+} NestOptions;
+
+typedef struct NestWorker
+{
+    pthread_t thread;
+    const XlHostFunc* func;
+    int depth;
+    long calls;
+    pthread_barrier_t* barrier;
+    double tripUs[MAX_DEPTH];   // Round trip summed per level
+    double probeUs;
+    long shortProbes;
+    long switched;
+} NestWorker;
+
+static int ParseList(char* p, int* out)
+{
+    int n = 0;
+
+    while (*p && n < MAX_LIST)
+    {
+        out[n++] = (int)strtol(p, &p, 10);
+        if (*p == ',')
+            p++;
+        else if (*p)
+            break;
+    }
+    return n;
+}
+
+static void* WorkerMain(void* arg)
+{
+    NestWorker* w = (NestWorker*)arg;
+    XLOPER12 depth, alternate, res;
+    LPXLOPER12 args[2] = { &depth, &alternate };
+    long i;
+    int r;
+
+    XlHostSetNum(&depth, (double)w->depth);
+    XlHostSetNum(&alternate, 0.0);
+    pthread_barrier_wait(w->barrier);
+    for (i = 0; i < w->calls; i++)
+    {
+        const XLOPER12* cells;
+        int rows = 0, rc = XlHostCall(w->func, 2, args, &res);
+
+        if (rc == xlretSuccess && (res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == COLUMNS)
+            rows = res.val.array.rows;
+        if (rows != w->depth + 1)
+        {
+            w->shortProbes++;
+            if (rc == xlretSuccess)
+                XlHostFreeResult(&res);
+            continue;
+        }
+        cells = res.val.array.lparray;
+        w->probeUs += cells[4].val.num - cells[3].val.num;
+        for (r = 0; r < w->depth; r++)
+            w->tripUs[r] += cells[r * COLUMNS + 5].val.num;
+        for (r = 1; r < rows; r++)
+            if (cells[r * COLUMNS + 2].val.num != cells[2].val.num)
+            {
+                w->switched++;
+                break;
+            }
+        XlHostFreeResult(&res);
+    }
+    return NULL;
+}
+
+static void Run(const XlHostFunc* f, int threads, int depth, long calls)
+{
+    NestWorker workers[MAX_THREADS];
+    pthread_barrier_t barrier;
+    double trip[MAX_DEPTH] = { 0 }, probeUs = 0.0, mean = 0.0, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0, slope = 0.0;
+    long done, shortProbes = 0, switched = 0;
+    int t, r;
+
+    memset(workers, 0, sizeof(workers));
+    pthread_barrier_init(&barrier, NULL, (unsigned)threads);
+    for (t = 0; t < threads; t++)
+    {
+        workers[t].func = f;
+        workers[t].depth = depth;
+        workers[t].calls = calls;
+        workers[t].barrier = &barrier;
+        pthread_create(&workers[t].thread, NULL, WorkerMain, &workers[t]);
+    }
+    for (t = 0; t < threads; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        for (r = 0; r < depth; r++)
+            trip[r] += workers[t].tripUs[r];
+        probeUs += workers[t].probeUs;
+        shortProbes += workers[t].shortProbes;
+        switched += workers[t].switched;
+    }
+    pthread_barrier_destroy(&barrier);
+    XlHostFireEvent(xleventCalculationEnded);
+
+    done = (long)threads * calls - shortProbes;
+    if (done < 1)
+    {
+        printf("%7d %5d %9s %9s %9s %9s %9s %7ld %8ld\n", threads, depth, "-", "-", "-", "-", "-", shortProbes, switched);
+        return;
+    }
+    for (r = 0; r < depth; r++)
+    {
+        trip[r] = trip[r] * 1e3 / (double)done;
+        mean += trip[r] / depth;
+        sx += r;
+        sy += trip[r];
+        sxx += (double)r * r;
+        sxy += r * trip[r];
+    }
+    if (depth > 1)
+        slope = (depth * sxy - sx * sy) / (depth * sxx - sx * sx);
+    printf("%7d %5d %9.1f %9.1f %9.1f %9.2f %9.2f %7ld %8ld\n", threads, depth, mean, trip[0], trip[depth - 1], slope,
+        probeUs / (double)done, shortProbes, switched);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    NestOptions opt = { NULL, { 1, 2, 4 }, 3, { 1, 2, 4, 8, 16, 32 }, 6, 20000 };
+    const XlHostFunc* f;
+    int a, i, j, module;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threadCount = ParseList(argv[++a], opt.threads);
+        else if (!strcmp(argv[a], "--depths") && a + 1 < argc) opt.depthCount = ParseList(argv[++a], opt.depths);
+        else if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--callback-ns") && a + 1 < argc) g_xlHostConfig.callbackCostNs = atol(argv[++a]);
+        else
+        {
+            fprintf(stderr, "NestProbe: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: NestProbe [--threads A,B,..] [--depths A,B,..] [--calls K] [--callback-ns N] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.calls < 1) opt.calls = 1;
+    for (i = 0; i < opt.threadCount; i++)
+        if (opt.threads[i] < 1 || opt.threads[i] > MAX_THREADS) opt.threads[i] = opt.threads[i] < 1 ? 1 : MAX_THREADS;
+    for (i = 0; i < opt.depthCount; i++)
+        if (opt.depths[i] < 1 || opt.depths[i] > MAX_DEPTH) opt.depths[i] = opt.depths[i] < 1 ? 1 : MAX_DEPTH;
+
+    g_xlHostConfig.sleepScale = 0.0;
+    g_xlHostConfig.multiThreadedCalc = 1;
+    module = XlHostLoad(opt.xll);
+    if (module < 0)
+        return 1;
+    f = XlHostFindFunc(module, L"cNestProbe");
+    if (!f)
+    {
+        fprintf(stderr, "NestProbe: %s does not register cNestProbe\n", opt.xll);
+        return 1;
+    }
+
+    printf("%ld probes per thread, callback cost %ld ns; round trips in ns\n", opt.calls, (long)g_xlHostConfig.callbackCostNs);
+    printf("%7s %5s %9s %9s %9s %9s %9s %7s %8s\n", "threads", "depth", "trip ns", "first", "last", "ns/level", "probe us", "short", "switched");
+    for (i = 0; i < opt.threadCount; i++)
+        for (j = 0; j < opt.depthCount; j++)
+            Run(f, opt.threads[i], opt.depths[j], opt.calls);
+    XlHostUnloadAll();
+    return 0;
+}
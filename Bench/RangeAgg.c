@@ -0,0 +1,233 @@
+/*
+**  RangeAgg
+**
+**  Measures incremental range aggregates (Common/RangeAgg.c). A --rows x 1
+**  range of numbers is recalculated --recalcs times. Before each recalc,
+**  --changes cells picked at random get new values. Each recalc calls
+**  cRangeAgg(range, --stat, full) twice over the same changes:
+**    full          full=1: every block aggregated again
+**    incremental   full=0: blocks fingerprinted, changed ones recomputed
+**  Each change count in the list runs both modes over the same sequence of
+**  changes. The output gives ms per call in each mode, blocks recomputed per
+**  incremental call, and whether every incremental result matched the full
+**  one exactly. A fixed edit runs first: 2048 cells of 1.0, then four of
+**  them changed so that a linear fingerprint would not see it, checked the
+**  same way.
+**
+**  Usage: RangeAgg [options] ThreadSafeC.so
+**    --rows R           cells in the range (default 1000000)
+**    --changes A,B,..   cells changed before each recalc (default 1,10,100,1000,10000)
+**    --recalcs N        recalcs per change count (default 20)
+**    --stat NAME        count, sum, mean, var, stdev, min or max (default var)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include "XlHost.h"
+
+#define MAX_CONFIGS 8
+
+typedef struct RangeAggOptions
+{
+    const char* xll;
+    int    rows;
+    int    changes[MAX_CONFIGS];
+    int    configs;
+    int    recalcs;
+    const char* stat;
+} RangeAggOptions;
+
+static const XlHostFunc* g_agg;
+static int g_module;
+
+// Reads one row of cRangeAggStats
+static double AggCounter(const WCHAR* name)
+{
+    const XlHostFunc* stats = XlHostFindFunc(g_module, L"cRangeAggStats");
+    XLOPER12 res;
+    double value = 0.0;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 2)
+    {
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * 2];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(name)
+                && wcsncmp(&key->val.str[1], name, key->val.str[0]) == 0)
+                value = res.val.array.lparray[r * 2 + 1].val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+// Deterministic cell values, so both modes see the same range and the same changes
+static void Fill(LPXLOPER12 cells, int rows)
+{
+    int i;
+
+    srand(12345);
+    for (i = 0; i < rows; i++)
+    {
+        cells[i].xltype = xltypeNum;
+        cells[i].val.num = (double)(rand() % 100000) / 100.0;
+    }
+}
+
+static void Change(LPXLOPER12 cells, int rows, int changes)
+{
+    int i;
+
+    for (i = 0; i < changes; i++)
+        cells[((unsigned)rand() * 32768u + (unsigned)rand()) % (unsigned)rows].val.num = (double)(rand() % 100000) / 100.0;
+}
+
+// One mode over the change sequence; results[] is filled (full) or compared (incremental).
+// Returns ms per call and sets *blocks to blocks recomputed per call.
+static double RunMode(const RangeAggOptions* opt, LPXLOPER12 range, int changes, int full, double* results,
+    int* mismatches, double* blocks)
+{
+    XLOPER12 a[3], res;
+    LPXLOPER12 args[3] = { range, &a[1], &a[2] };
+    ULONGLONG t0, ns = 0;
+    WCHAR stat[16];
+    double blocks0 = 0.0;
+    int r;
+
+    mbstowcs(stat, opt->stat, _countof(stat));
+    XlHostSetStr(&a[1], stat);
+    XlHostSetNum(&a[2], full ? 1.0 : 0.0);
+    Fill(range->val.array.lparray, opt->rows);
+    for (r = 0; r <= opt->recalcs; r++)
+    {
+        // Recalc 0 only builds the snapshot
+        if (r > 0)
+            Change(range->val.array.lparray, opt->rows, changes);
+        t0 = XlHostNowNs();
+        XlHostCall(g_agg, 3, args, &res);
+        if (r > 0)
+            ns += XlHostNowNs() - t0;
+        if (full)
+            results[r] = res.val.num;
+        else if ((res.xltype & xltypeNum) != xltypeNum || res.val.num != results[r])
+            (*mismatches)++;
+        XlHostFreeResult(&res);
+        if (r == 0)
+            blocks0 = AggCounter(L"BlocksRecomputed");
+    }
+    *blocks = (AggCounter(L"BlocksRecomputed") - blocks0) / opt->recalcs;
+    XlHostFreeResult(&a[1]);
+    return (double)ns / 1e6 / opt->recalcs;
+}
+
+// Sum of 2048 cells of 1.0 incrementally, then after an edit that leaves Σw and Σw·(2i+1)
+// over the raw bits unchanged, checked against the full sum
+static void EditCheck(void)
+{
+    static const double edit[4] = { 1.0625, 0.96875, 0.96875, 1.0625 };
+    XLOPER12 range, a[2], incr, full;
+    LPXLOPER12 args[3] = { &range, &a[0], &a[1] };
+    int i, match;
+
+    range.xltype = xltypeMulti;
+    range.val.array.rows = 2048;
+    range.val.array.columns = 1;
+    range.val.array.lparray = (LPXLOPER12)calloc(2048, sizeof(XLOPER12));
+    for (i = 0; i < 2048; i++)
+        XlHostSetNum(&range.val.array.lparray[i], 1.0);
+    XlHostSetStr(&a[0], L"sum");
+    XlHostSetNum(&a[1], 0.0);
+    XlHostCall(g_agg, 3, args, &incr);
+    XlHostFreeResult(&incr);
+    for (i = 0; i < 4; i++)
+        range.val.array.lparray[i].val.num = edit[i];
+    XlHostCall(g_agg, 3, args, &incr);
+    XlHostSetNum(&a[1], 1.0);
+    XlHostCall(g_agg, 3, args, &full);
+    match = (incr.xltype & xltypeNum) && (full.xltype & xltypeNum) && incr.val.num == full.val.num;
+    printf("edit check: incremental %.4f, full %.4f, match %s\n", incr.val.num, full.val.num, match ? "yes" : "NO");
+    XlHostFreeResult(&incr);
+    XlHostFreeResult(&full);
+    XlHostFreeResult(&a[0]);
+    free(range.val.array.lparray);
+}
+
+int main(int argc, char** argv)
+{
+    RangeAggOptions opt = { NULL, 1000000, { 1, 10, 100, 1000, 10000 }, 5, 20, "var" };
+    XLOPER12 range;
+    double* results;
+    int a, c;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--rows") && a + 1 < argc) opt.rows = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--changes") && a + 1 < argc)
+        {
+            char* p = argv[++a];
+            for (opt.configs = 0; *p && opt.configs < MAX_CONFIGS; )
+            {
+                opt.changes[opt.configs++] = (int)strtol(p, &p, 10);
+                if (*p == ',')
+                    p++;
+            }
+        }
+        else if (!strcmp(argv[a], "--recalcs") && a + 1 < argc) opt.recalcs = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--stat") && a + 1 < argc) opt.stat = argv[++a];
+        else
+        {
+            fprintf(stderr, "RangeAgg: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: RangeAgg [--rows R] [--changes A,B,..] [--recalcs N] [--stat NAME] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.rows < 1) opt.rows = 1;
+    if (opt.recalcs < 1) opt.recalcs = 1;
+
+    g_module = XlHostLoad(opt.xll);
+    if (g_module < 0)
+        return 1;
+    g_agg = XlHostFindFunc(g_module, L"cRangeAgg");
+    if (!g_agg)
+    {
+        fprintf(stderr, "RangeAgg: %s does not register cRangeAgg\n", opt.xll);
+        return 1;
+    }
+    range.xltype = xltypeMulti;
+    range.val.array.rows = opt.rows;
+    range.val.array.columns = 1;
+    range.val.array.lparray = (LPXLOPER12)calloc((size_t)opt.rows, sizeof(XLOPER12));
+    results = (double*)calloc((size_t)opt.recalcs + 1, sizeof(double));
+
+    EditCheck();
+    printf("%d cells, %s, %d recalcs\n", opt.rows, opt.stat, opt.recalcs);
+    printf("%8s %10s %10s %8s %14s %8s\n", "changes", "full_ms", "incr_ms", "speedup", "blocks/recalc", "match");
+    fflush(stdout);
+    for (c = 0; c < opt.configs; c++)
+    {
+        double fullMs, incrMs, blocks;
+        int mismatches = 0;
+
+        fullMs = RunMode(&opt, &range, opt.changes[c], 1, results, &mismatches, &blocks);
+        incrMs = RunMode(&opt, &range, opt.changes[c], 0, results, &mismatches, &blocks);
+        printf("%8d %10.3f %10.3f %7.1fx %14.1f %8s\n", opt.changes[c], fullMs, incrMs, fullMs / incrMs,
+            blocks, mismatches ? "NO" : "yes");
+        fflush(stdout);
+    }
+    free(results);
+    free(range.val.array.lparray);
+    XlHostUnloadAll();
+    return 0;
+}
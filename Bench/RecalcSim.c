@@ -0,0 +1,646 @@
+/*
+**  RecalcSim
+**
+**  Headless recalculation of a synthetic workbook-scale dependency graph,
+**  for seeing how the UDFs behave in 100k-cell graphs rather than the
+**  handful of cells the test workbooks hold.
+**
+**  The graph has --depth levels. Level 0 holds constants; every other cell
+**  is a formula over --fan-in precedents, taken from the level just above
+**  with probability --locality and from any earlier level otherwise, so the
+**  graph mixes long chains with cross-level fan-in. Each formula calls one
+**  function from the mix: by default every thread-safe function the XLLs
+**  registered with only number arguments and a number result (BB$, BBB$, ...),
+**  which includes the nested-call chains of cDoubleCaller and friends.
+**  Argument j is the sum of precedents j, j + a, j + 2a, ... for a function
+**  of a arguments, kept in [0, 1000).
+**
+**  Two schedulers evaluate it on --threads threads:
+**    chain  Excel's calc chain: threads take cells in chain order; a cell
+**           with an uncalculated precedent is moved off the chain and put
+**           back behind that precedent once it is calculated (a chain move)
+**    topo   dependency counting: a cell is queued when its last precedent
+**           completes, so no cell is ever taken before it can run
+**
+**  Each cell's time is measured, and the report gives total work, the
+**  critical path (the longest chain of dependent cell times), the recalc wall
+**  time, achieved parallelism (work / wall) and the bound work / critical path.
+**
+**  Usage: RecalcSim [options] ThreadSafeC.so MultithreadCrash.so
+**    --cells N            cells in the graph (default 100000)
+**    --depth D            levels, including the constants (default 50)
+**    --fan-in F           precedents per formula (default 2)
+**    --locality P         share of precedents from the level above (default 0.8)
+**    --mix NAME[:W],...   functions and weights (default: all numeric thread-safe UDFs)
+**    --threads T          calc threads (default 8)
+**    --scheduler S        chain or topo (default chain)
+**    --shuffle            start from a randomly ordered chain, as a first recalc would
+**    --sleep-scale S      multiplier for Sleep() inside UDFs (default 0.001)
+**    --seed N             graph seed (default 1)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "XlHost.h"
+
+#define MAX_THREADS     256
+#define MAX_MIX         64
+#define PARK_EMPTY      (-1)
+#define PARK_CLOSED     (-2)
+
+typedef struct SimOptions
+{
+    long   cells;
+    int    depth;
+    int    fanIn;
+    double locality;
+    const char* mix;
+    int    threads;
+    int    topo;
+    int    shuffle;
+    double sleepScale;
+    unsigned long long seed;
+} SimOptions;
+
+typedef struct SimFunc
+{
+    const XlHostFunc* func;
+    double weight;
+    long cells;
+    ULONGLONG ns;
+} SimFunc;
+
+// The graph: precedents as fixed-width rows, dependents in CSR form
+typedef struct SimGraph
+{
+    long cells;
+    long constants;
+    int fanIn;
+    int* prec;                  // cells * fanIn
+    long* depStart;             // cells + 1
+    int* deps;
+    signed char* func;          // Index into the mix, -1 for a constant
+    double* value;
+    volatile LONG* done;
+    volatile LONG* pending;     // topo: precedents not yet calculated
+    volatile LONG* parkHead;    // chain: first cell waiting on this one
+    int* parkNext;
+    ULONGLONG* ns;              // Measured time of each cell
+} SimGraph;
+
+// Calc queue shared by the threads: the chain (or ready list) in order
+typedef struct SimQueue
+{
+    int* items;
+    long capacity;
+    long head;
+    long count;
+    long remaining;             // Cells not yet calculated
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} SimQueue;
+
+typedef struct SimWorker
+{
+    pthread_t thread;
+    int index;
+    long cells;
+    long moves;
+    XlHostStats stats;
+} SimWorker;
+
+static SimOptions g_opt;
+static SimGraph g_graph;
+static SimQueue g_queue;
+static SimFunc g_mix[MAX_MIX];
+static int g_mixCount = 0;
+
+static unsigned long long g_rng;
+
+static unsigned long long Rand64(void)
+{
+    // xorshift64*
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 2685821657736338717ull;
+}
+
+static long RandBelow(long n)
+{
+    return (long)(Rand64() % (unsigned long long)n);
+}
+
+static double RandUnit(void)
+{
+    return (double)(Rand64() >> 11) / 9007199254740992.0;
+}
+
+/*
+** Function mix
+*/
+static int NumericOnly(const XlHostFunc* f)
+{
+    int i;
+    if (!f->threadSafe || f->retType != 'B' || f->argCount < 1)
+        return 0;
+    for (i = 0; i < f->argCount; i++)
+        if (f->argTypes[i] != 'B')
+            return 0;
+    return 1;
+}
+
+static int BuildMix(const char* spec)
+{
+    int i;
+
+    if (!spec)
+    {
+        for (i = 0; i < XlHostFuncCount() && g_mixCount < MAX_MIX; i++)
+        {
+            if (!NumericOnly(XlHostFuncAt(i)))
+                continue;
+            g_mix[g_mixCount].func = XlHostFuncAt(i);
+            g_mix[g_mixCount++].weight = 1.0;
+        }
+        return g_mixCount;
+    }
+
+    while (*spec && g_mixCount < MAX_MIX)
+    {
+        char name[64];
+        WCHAR wname[64];
+        double weight = 1.0;
+        size_t n = strcspn(spec, ",:");
+        const XlHostFunc* f;
+
+        snprintf(name, sizeof(name), "%.*s", (int)n, spec);
+        spec += n;
+        if (*spec == ':')
+        {
+            weight = strtod(spec + 1, (char**)&spec);
+            spec += strcspn(spec, ",");
+        }
+        if (*spec == ',')
+            spec++;
+        mbstowcs(wname, name, _countof(wname));
+        f = XlHostFindFunc(-1, wname);
+        if (!f || f->argCount < 1 || f->argCount > XLHOST_MAX_ARGS)
+        {
+            fprintf(stderr, "RecalcSim: %s is not a registered function with arguments\n", name);
+            return 0;
+        }
+        if (!f->threadSafe)
+            fprintf(stderr, "RecalcSim: warning: %s is not registered thread-safe\n", name);
+        g_mix[g_mixCount].func = f;
+        g_mix[g_mixCount++].weight = weight > 0 ? weight : 0;
+    }
+    return g_mixCount;
+}
+
+static int PickFunc(void)
+{
+    double total = 0, r;
+    int i;
+    for (i = 0; i < g_mixCount; i++)
+        total += g_mix[i].weight;
+    r = RandUnit() * total;
+    for (i = 0; i < g_mixCount - 1; i++)
+    {
+        if (r < g_mix[i].weight)
+            return i;
+        r -= g_mix[i].weight;
+    }
+    return g_mixCount - 1;
+}
+
+/*
+** Graph
+*/
+static int BuildGraph(void)
+{
+    SimGraph* g = &g_graph;
+    long perLevel, c, k, edges;
+    int level, j;
+
+    g->cells = g_opt.cells;
+    g->fanIn = g_opt.fanIn;
+    perLevel = g->cells / g_opt.depth;
+    if (perLevel < 1)
+        perLevel = 1;
+    g->constants = perLevel;
+
+    g->prec = (int*)calloc((size_t)g->cells * g->fanIn, sizeof(int));
+    g->depStart = (long*)calloc((size_t)g->cells + 1, sizeof(long));
+    g->deps = (int*)calloc((size_t)g->cells * g->fanIn + 1, sizeof(int));
+    g->func = (signed char*)calloc((size_t)g->cells, 1);
+    g->value = (double*)calloc((size_t)g->cells, sizeof(double));
+    g->done = (volatile LONG*)calloc((size_t)g->cells, sizeof(LONG));
+    g->pending = (volatile LONG*)calloc((size_t)g->cells, sizeof(LONG));
+    g->parkHead = (volatile LONG*)calloc((size_t)g->cells, sizeof(LONG));
+    g->parkNext = (int*)calloc((size_t)g->cells, sizeof(int));
+    g->ns = (ULONGLONG*)calloc((size_t)g->cells, sizeof(ULONGLONG));
+    if (!g->prec || !g->depStart || !g->deps || !g->func || !g->value || !g->done
+        || !g->pending || !g->parkHead || !g->parkNext || !g->ns)
+        return 0;
+
+    // Cells are numbered level by level, so every precedent has a lower number
+    for (c = 0; c < g->cells; c++)
+    {
+        level = (int)(c / perLevel);
+        if (level >= g_opt.depth)
+            level = g_opt.depth - 1;
+        g->parkHead[c] = PARK_EMPTY;
+        if (level == 0)
+        {
+            g->func[c] = -1;
+            g->value[c] = 1.0 + (double)RandBelow(100);
+            continue;
+        }
+        g->func[c] = (signed char)PickFunc();
+        for (j = 0; j < g->fanIn; j++)
+        {
+            long lo = (long)(level - 1) * perLevel, span = perLevel;
+            if (RandUnit() >= g_opt.locality)
+            {
+                lo = 0;
+                span = (long)level * perLevel;
+            }
+            g->prec[c * g->fanIn + j] = (int)(lo + RandBelow(span));
+            g->depStart[g->prec[c * g->fanIn + j] + 1]++;
+        }
+        g->pending[c] = g->fanIn;
+    }
+
+    for (c = 0; c < g->cells; c++)
+        g->depStart[c + 1] += g->depStart[c];
+    edges = g->depStart[g->cells];
+    {
+        long* fill = (long*)calloc((size_t)g->cells, sizeof(long));
+        if (!fill)
+            return 0;
+        for (c = g->constants; c < g->cells; c++)
+        {
+            for (j = 0; j < g->fanIn; j++)
+            {
+                k = g->prec[c * g->fanIn + j];
+                g->deps[g->depStart[k] + fill[k]++] = (int)c;
+            }
+        }
+        free(fill);
+    }
+    return edges >= 0;
+}
+
+/*
+** Queue
+*/
+static void QueueInit(long capacity)
+{
+    g_queue.items = (int*)malloc((size_t)capacity * sizeof(int));
+    g_queue.capacity = capacity;
+    g_queue.head = 0;
+    g_queue.count = 0;
+    pthread_mutex_init(&g_queue.lock, NULL);
+    pthread_cond_init(&g_queue.cond, NULL);
+}
+
+static void QueuePushLocked(int cell)
+{
+    g_queue.items[(g_queue.head + g_queue.count) % g_queue.capacity] = cell;
+    g_queue.count++;
+}
+
+static void QueuePush(int cell)
+{
+    pthread_mutex_lock(&g_queue.lock);
+    QueuePushLocked(cell);
+    pthread_cond_signal(&g_queue.cond);
+    pthread_mutex_unlock(&g_queue.lock);
+}
+
+// Next cell in chain order, or -1 once every cell is calculated
+static int QueuePop(void)
+{
+    int cell = -1;
+    pthread_mutex_lock(&g_queue.lock);
+    while (g_queue.count == 0 && g_queue.remaining > 0)
+        pthread_cond_wait(&g_queue.cond, &g_queue.lock);
+    if (g_queue.count > 0)
+    {
+        cell = g_queue.items[g_queue.head];
+        g_queue.head = (g_queue.head + 1) % g_queue.capacity;
+        g_queue.count--;
+    }
+    pthread_mutex_unlock(&g_queue.lock);
+    return cell;
+}
+
+static void CellFinished(void)
+{
+    pthread_mutex_lock(&g_queue.lock);
+    if (--g_queue.remaining == 0)
+        pthread_cond_broadcast(&g_queue.cond);
+    pthread_mutex_unlock(&g_queue.lock);
+}
+
+/*
+** Evaluation
+*/
+static void Evaluate(int c)
+{
+    SimGraph* g = &g_graph;
+    SimFunc* m = &g_mix[(int)g->func[c]];
+    const XlHostFunc* f = m->func;
+    XLOPER12 argv[XLHOST_MAX_ARGS], res;
+    LPXLOPER12 args[XLHOST_MAX_ARGS];
+    double sums[XLHOST_MAX_ARGS];
+    int a = f->argCount, j;
+    ULONGLONG t0, t1;
+
+    for (j = 0; j < a; j++)
+        sums[j] = j < g->fanIn ? 0.0 : 1.0;
+    for (j = 0; j < g->fanIn; j++)
+        sums[j % a] += g->value[g->prec[c * g->fanIn + j]];
+    for (j = 0; j < a; j++)
+    {
+        double v = fmod(fabs(sums[j]), 1000.0);
+        XlHostSetNum(&argv[j], isfinite(v) ? v : 0.0);
+        args[j] = &argv[j];
+    }
+
+    t0 = XlHostNowNs();
+    XlHostCall(f, a, args, &res);
+    t1 = XlHostNowNs();
+    g->value[c] = (res.xltype & xltypeNum) ? res.val.num : 0.0;
+    XlHostFreeResult(&res);
+    g->ns[c] = t1 - t0;
+}
+
+// A calculated cell releases the cells waiting on it
+static void Complete(int c)
+{
+    SimGraph* g = &g_graph;
+    long k;
+
+    WriteRelease(&g->done[c], 1);
+    if (g_opt.topo)
+    {
+        for (k = g->depStart[c]; k < g->depStart[c + 1]; k++)
+            if (InterlockedDecrement(&g->pending[g->deps[k]]) == 0)
+                QueuePush(g->deps[k]);
+    }
+    else
+    {
+        // Closing the list makes later parkers see the cell as calculated
+        LONG parked = InterlockedExchange(&g->parkHead[c], PARK_CLOSED);
+        while (parked >= 0)
+        {
+            int next = g->parkNext[parked];
+            QueuePush((int)parked);
+            parked = next;
+        }
+    }
+    CellFinished();
+}
+
+// chain: parks c behind its first uncalculated precedent; 0 if every precedent is calculated
+static int ParkIfBlocked(int c)
+{
+    SimGraph* g = &g_graph;
+    int j;
+
+    for (j = 0; j < g->fanIn; j++)
+    {
+        int p = g->prec[c * g->fanIn + j];
+        LONG head;
+        if (ReadAcquire(&g->done[p]))
+            continue;
+        for (;;)
+        {
+            head = ReadAcquire(&g->parkHead[p]);
+            if (head == PARK_CLOSED)
+                break;                  // Calculated meanwhile: check the next precedent
+            g->parkNext[c] = (int)head;
+            if (InterlockedCompareExchange(&g->parkHead[p], c, head) == head)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static void* WorkerMain(void* arg)
+{
+    SimWorker* w = (SimWorker*)arg;
+    int c;
+
+    XlHostResetThreadStats();
+    while ((c = QueuePop()) >= 0)
+    {
+        if (g_graph.func[c] < 0)
+        {
+            Complete(c);
+            continue;
+        }
+        if (!g_opt.topo && ParkIfBlocked(c))
+        {
+            w->moves++;
+            continue;
+        }
+        Evaluate(c);
+        w->cells++;
+        Complete(c);
+    }
+    w->stats = *XlHostThreadStats();
+    return NULL;
+}
+
+/*
+** Report
+*/
+static void Report(ULONGLONG wallNs, const SimWorker* workers)
+{
+    SimGraph* g = &g_graph;
+    ULONGLONG* finish = (ULONGLONG*)calloc((size_t)g->cells, sizeof(ULONGLONG));
+    int* length = (int*)calloc((size_t)g->cells, sizeof(int));
+    ULONGLONG work = 0, critical = 0;
+    XlHostStats total;
+    long c, cells = 0, moves = 0;
+    int j, t, chain = 0;
+
+    // Critical path: cells are numbered in topological order
+    for (c = 0; c < g->cells; c++)
+    {
+        ULONGLONG before = 0;
+        int steps = 0;
+        if (g->func[c] >= 0)
+        {
+            for (j = 0; j < g->fanIn; j++)
+            {
+                int p = g->prec[c * g->fanIn + j];
+                if (finish[p] > before)
+                    before = finish[p];
+                if (length[p] > steps)
+                    steps = length[p];
+            }
+            steps++;
+            g_mix[(int)g->func[c]].cells++;
+            g_mix[(int)g->func[c]].ns += g->ns[c];
+        }
+        finish[c] = before + g->ns[c];
+        length[c] = steps;
+        work += g->ns[c];
+        if (finish[c] > critical)
+        {
+            critical = finish[c];
+            chain = steps;
+        }
+    }
+    free(finish);
+    free(length);
+
+    memset(&total, 0, sizeof(total));
+    for (t = 0; t < g_opt.threads; t++)
+    {
+        cells += workers[t].cells;
+        moves += workers[t].moves;
+        XlHostAddStats(&total, &workers[t].stats);
+    }
+
+    printf("\n  recalc wall       %10.1f ms\n", (double)wallNs / 1e6);
+    printf("  total work        %10.1f ms   (%ld formula cells, %.1f us each)\n",
+        (double)work / 1e6, cells, cells ? (double)work / 1e3 / (double)cells : 0.0);
+    printf("  critical path     %10.1f ms   (%d formulas long)\n", (double)critical / 1e6, chain);
+    printf("  parallelism       %10.2f      achieved (work / wall), %.1f%% of %d threads\n",
+        (double)work / (double)wallNs, 100.0 * (double)work / (double)wallNs / g_opt.threads, g_opt.threads);
+    printf("  parallelism bound %10.2f      (work / critical path)\n", critical ? (double)work / (double)critical : 0.0);
+    if (!g_opt.topo)
+        printf("  chain moves       %10ld      (%.2f per formula)\n", moves, cells ? (double)moves / (double)cells : 0.0);
+    printf("  callbacks         %10.2f      per formula, %.1f ms inside Excel callbacks\n",
+        cells ? (double)total.callbackCalls / (double)cells : 0.0, (double)total.callbackNs / 1e6);
+    printf("  sleep             %10.1f ms   asked for by the kernels\n", (double)total.sleepNs / 1e6);
+
+    printf("\n  %-52s %8s %10s %10s\n", "function", "cells", "mean_us", "work%");
+    for (j = 0; j < g_mixCount; j++)
+    {
+        const SimFunc* m = &g_mix[j];
+        const char* path = XlHostModulePath(m->func->module);
+        const char* base = strrchr(path, '/');
+        char label[128];
+        snprintf(label, sizeof(label), "%.80ls (%.40s)", m->func->name, base ? base + 1 : path);
+        printf("  %-52s %8ld %10.1f %9.1f%%\n", label, m->cells,
+            m->cells ? (double)m->ns / 1e3 / (double)m->cells : 0.0,
+            work ? 100.0 * (double)m->ns / (double)work : 0.0);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    SimWorker workers[MAX_THREADS];
+    ULONGLONG t0, t1;
+    long c;
+    int a, t, loaded = 0;
+
+    g_opt.cells = 100000;
+    g_opt.depth = 50;
+    g_opt.fanIn = 2;
+    g_opt.locality = 0.8;
+    g_opt.threads = 8;
+    g_opt.sleepScale = 0.001;
+    g_opt.seed = 1;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--cells") && a + 1 < argc) g_opt.cells = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--depth") && a + 1 < argc) g_opt.depth = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--fan-in") && a + 1 < argc) g_opt.fanIn = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--locality") && a + 1 < argc) g_opt.locality = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--mix") && a + 1 < argc) g_opt.mix = argv[++a];
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc) g_opt.threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--scheduler") && a + 1 < argc) g_opt.topo = !strcmp(argv[++a], "topo");
+        else if (!strcmp(argv[a], "--shuffle")) g_opt.shuffle = 1;
+        else if (!strcmp(argv[a], "--sleep-scale") && a + 1 < argc) g_opt.sleepScale = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--seed") && a + 1 < argc) g_opt.seed = strtoull(argv[++a], NULL, 10);
+        else
+        {
+            fprintf(stderr, "RecalcSim: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a >= argc)
+    {
+        fprintf(stderr, "usage: RecalcSim [--cells N] [--depth D] [--fan-in F] [--locality P] [--mix NAME[:W],...]\n"
+                        "                 [--threads T] [--scheduler chain|topo] [--shuffle] [--sleep-scale S]\n"
+                        "                 [--seed N] xll.so...\n");
+        return 2;
+    }
+    if (g_opt.threads < 1) g_opt.threads = 1;
+    if (g_opt.threads > MAX_THREADS) g_opt.threads = MAX_THREADS;
+    if (g_opt.depth < 2) g_opt.depth = 2;
+    if (g_opt.fanIn < 1) g_opt.fanIn = 1;
+    if (g_opt.cells < g_opt.depth) g_opt.cells = g_opt.depth;
+    g_rng = g_opt.seed ? g_opt.seed : 1;
+
+    g_xlHostConfig.sleepScale = g_opt.sleepScale;
+    g_xlHostConfig.multiThreadedCalc = 1;
+    for (; a < argc; a++)
+        if (XlHostLoad(argv[a]) >= 0)
+            loaded++;
+    if (!loaded || !BuildMix(g_opt.mix))
+    {
+        fprintf(stderr, "RecalcSim: no functions to call\n");
+        return 1;
+    }
+    if (!BuildGraph())
+    {
+        fprintf(stderr, "RecalcSim: out of memory for %ld cells\n", g_opt.cells);
+        return 1;
+    }
+
+    // The initial chain: entry order (level by level), or shuffled; topo starts from the constants
+    QueueInit(g_graph.cells);
+    g_queue.remaining = g_graph.cells;
+    if (g_opt.topo)
+    {
+        for (c = 0; c < g_graph.constants; c++)
+            QueuePushLocked((int)c);
+    }
+    else
+    {
+        for (c = 0; c < g_graph.cells; c++)
+            QueuePushLocked((int)c);
+        for (c = g_graph.cells - 1; g_opt.shuffle && c > 0; c--)
+        {
+            long k = RandBelow(c + 1);
+            int tmp = g_queue.items[c];
+            g_queue.items[c] = g_queue.items[k];
+            g_queue.items[k] = tmp;
+        }
+    }
+
+    printf("RecalcSim: %ld cells (%ld constants), %d levels, fan-in %d, locality %.2f, %d functions\n",
+        g_graph.cells, g_graph.constants, g_opt.depth, g_opt.fanIn, g_opt.locality, g_mixCount);
+    printf("           %d threads, %s scheduler%s, sleep scale %g\n", g_opt.threads,
+        g_opt.topo ? "topological" : "calc chain", g_opt.shuffle && !g_opt.topo ? " (shuffled)" : "", g_opt.sleepScale);
+    fflush(stdout);
+
+    memset(workers, 0, sizeof(workers));
+    t0 = XlHostNowNs();
+    for (t = 0; t < g_opt.threads; t++)
+    {
+        workers[t].index = t;
+        pthread_create(&workers[t].thread, NULL, WorkerMain, &workers[t]);
+    }
+    for (t = 0; t < g_opt.threads; t++)
+        pthread_join(workers[t].thread, NULL);
+    t1 = XlHostNowNs();
+    XlHostFireEvent(xleventCalculationEnded);
+
+    Report(t1 - t0, workers);
+    XlHostUnloadAll();
+    return 0;
+}
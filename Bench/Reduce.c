@@ -0,0 +1,372 @@
+/*
+**  Reduce
+**
+**  Measures the reduction UDFs (Common/Reduce.c) on a --rows x 1 range.
+**  Numbers are 1e6 plus a fraction, and one cell in a hundred is blank. The
+**  stand-in host has no worksheet functions, so the baselines are scalar
+**  loops over the XLOPER12 cells that compute SUM, VAR.S, MIN/MAX,
+**  PERCENTILE.INC (sorting a copy) and FREQUENCY (a binary search per
+**  value). Each thread count in --threads runs in a forked process with
+**  XLL_REDUCE_THREADS set to it, calling:
+**    cReduce(range, "sum" / "var" / "min")
+**    cPercentile(range, {0.5; 0.9; 0.99})
+**    cHistogram(range, --bins edges)
+**  The output gives ms per call, million cells per second for the sum, and
+**  whether every result is bit-identical to the first thread count. The
+**  relative errors of the sums against a long double reference show what
+**  compensation buys.
+**
+**  Usage: Reduce [options] ThreadSafeC.so
+**    --rows R           cells in the range (default 1000000)
+**    --threads A,B,..   XLL_REDUCE_THREADS values to compare (default 1,2,4)
+**    --calls N          calls per measurement (default 20)
+**    --bins N           histogram edges (default 99)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "XlHost.h"
+
+#define MAX_CONFIGS 8
+#define RESULTS     8       // sum, var, min, three percentiles, two histogram bins
+
+typedef struct ReduceOptions
+{
+    const char* xll;
+    int    rows;
+    int    threads[MAX_CONFIGS];
+    int    configs;
+    int    calls;
+    int    bins;
+} ReduceOptions;
+
+// What one configuration reports back through its pipe
+typedef struct ReduceReport
+{
+    double ms[5];           // sum, var, min, percentile, histogram
+    double results[RESULTS];
+    double parallel;        // cReduceStats ParallelCalls
+} ReduceReport;
+
+static const double g_p[3] = { 0.5, 0.9, 0.99 };
+
+static void Fill(LPXLOPER12 cells, int rows)
+{
+    int i;
+
+    srand(12345);
+    for (i = 0; i < rows; i++)
+    {
+        if (i % 100 == 99)
+        {
+            cells[i].xltype = xltypeNil;
+            continue;
+        }
+        cells[i].xltype = xltypeNum;
+        cells[i].val.num = 1e6 + (double)rand() / RAND_MAX;
+    }
+}
+
+static void SetEdges(LPXLOPER12 edges, int bins)
+{
+    int i;
+
+    for (i = 0; i < bins; i++)
+        XlHostSetNum(&edges->val.array.lparray[i], 1e6 + (double)(i + 1) / (bins + 1));
+}
+
+// ms per call of func(args), the last result in *res (freed by the caller)
+static double Time(const XlHostFunc* func, int count, LPXLOPER12* args, int calls, LPXLOPER12 res)
+{
+    ULONGLONG t0 = XlHostNowNs();
+    int c;
+
+    for (c = 0; c < calls; c++)
+    {
+        if (c)
+            XlHostFreeResult(res);
+        XlHostCall(func, count, args, res);
+    }
+    return (double)(XlHostNowNs() - t0) / 1e6 / calls;
+}
+
+static double Num(const XLOPER12* x)
+{
+    return (x->xltype & xltypeNum) == xltypeNum ? x->val.num : NAN;
+}
+
+static double ReduceCounter(int module, const WCHAR* name)
+{
+    const XlHostFunc* stats = XlHostFindFunc(module, L"cReduceStats");
+    XLOPER12 res;
+    double value = 0.0;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 2)
+    {
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * 2];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(name)
+                && wcsncmp(&key->val.str[1], name, key->val.str[0]) == 0)
+                value = res.val.array.lparray[r * 2 + 1].val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+// One configuration, in the child process
+static int RunConfig(const ReduceOptions* opt, LPXLOPER12 range, ReduceReport* report)
+{
+    XLOPER12 stat, p, pv[3], edges, res;
+    LPXLOPER12 args[2] = { range, &stat };
+    const XlHostFunc *reduce, *percentile, *histogram;
+    static const WCHAR* stats[3] = { L"sum", L"var", L"min" };
+    int module = XlHostLoad(opt->xll), i;
+
+    if (module < 0)
+        return 0;
+    reduce = XlHostFindFunc(module, L"cReduce");
+    percentile = XlHostFindFunc(module, L"cPercentile");
+    histogram = XlHostFindFunc(module, L"cHistogram");
+    if (!reduce || !percentile || !histogram)
+    {
+        fprintf(stderr, "Reduce: %s does not register cReduce, cPercentile and cHistogram\n", opt->xll);
+        return 0;
+    }
+    for (i = 0; i < 3; i++)
+    {
+        XlHostSetStr(&stat, stats[i]);
+        report->ms[i] = Time(reduce, 2, args, opt->calls, &res);
+        report->results[i] = Num(&res);
+        XlHostFreeResult(&res);
+        XlHostFreeResult(&stat);
+    }
+
+    p.xltype = xltypeMulti;
+    p.val.array.rows = 3;
+    p.val.array.columns = 1;
+    p.val.array.lparray = pv;
+    for (i = 0; i < 3; i++)
+        XlHostSetNum(&pv[i], g_p[i]);
+    args[1] = &p;
+    report->ms[3] = Time(percentile, 2, args, opt->calls, &res);
+    for (i = 0; i < 3; i++)
+        report->results[3 + i] = (res.xltype & xltypeMulti) ? Num(&res.val.array.lparray[i]) : NAN;
+    XlHostFreeResult(&res);
+
+    edges.xltype = xltypeMulti;
+    edges.val.array.rows = opt->bins;
+    edges.val.array.columns = 1;
+    edges.val.array.lparray = (LPXLOPER12)calloc((size_t)opt->bins, sizeof(XLOPER12));
+    SetEdges(&edges, opt->bins);
+    args[1] = &edges;
+    report->ms[4] = Time(histogram, 2, args, opt->calls, &res);
+    report->results[6] = (res.xltype & xltypeMulti) ? Num(&res.val.array.lparray[0]) : NAN;
+    report->results[7] = (res.xltype & xltypeMulti) ? Num(&res.val.array.lparray[opt->bins / 2]) : NAN;
+    XlHostFreeResult(&res);
+    free(edges.val.array.lparray);
+
+    report->parallel = ReduceCounter(module, L"ParallelCalls");
+    XlHostUnloadAll();
+    return 1;
+}
+
+static int CompareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Scalar loops over the cells: what a UDF without this library does
+static void RunScalar(const ReduceOptions* opt, LPXLOPER12 range, double* ms, double* sum)
+{
+    const XLOPER12* cells = range->val.array.lparray;
+    double* copy = (double*)malloc((size_t)opt->rows * sizeof(double));
+    double* edges = (double*)malloc((size_t)opt->bins * sizeof(double));
+    long long* counts = (long long*)calloc((size_t)opt->bins + 1, sizeof(long long));
+    volatile double sink = 0.0;
+    ULONGLONG t0;
+    int c, i, n;
+
+    for (i = 0; i < opt->bins; i++)
+        edges[i] = 1e6 + (double)(i + 1) / (opt->bins + 1);
+    memset(ms, 0, 5 * sizeof(double));
+    for (c = 0; c < opt->calls; c++)
+    {
+        double s = 0.0, mean, q = 0.0, lo = INFINITY;
+        int count = 0;
+
+        t0 = XlHostNowNs();
+        for (i = 0; i < opt->rows; i++)
+            if (cells[i].xltype == xltypeNum)
+            {
+                s += cells[i].val.num;
+                count++;
+            }
+        ms[0] += (double)(XlHostNowNs() - t0) / 1e6;
+        *sum = s;
+
+        t0 = XlHostNowNs();
+        s = 0.0;
+        count = 0;
+        for (i = 0; i < opt->rows; i++)
+            if (cells[i].xltype == xltypeNum)
+            {
+                s += cells[i].val.num;
+                count++;
+            }
+        mean = s / count;
+        for (i = 0; i < opt->rows; i++)
+            if (cells[i].xltype == xltypeNum)
+                q += (cells[i].val.num - mean) * (cells[i].val.num - mean);
+        sink = q / (count - 1);
+        ms[1] += (double)(XlHostNowNs() - t0) / 1e6;
+
+        t0 = XlHostNowNs();
+        for (i = 0; i < opt->rows; i++)
+            if (cells[i].xltype == xltypeNum && cells[i].val.num < lo)
+                lo = cells[i].val.num;
+        sink = lo;
+        ms[2] += (double)(XlHostNowNs() - t0) / 1e6;
+
+        t0 = XlHostNowNs();
+        for (i = n = 0; i < opt->rows; i++)
+            if (cells[i].xltype == xltypeNum)
+                copy[n++] = cells[i].val.num;
+        qsort(copy, (size_t)n, sizeof(double), CompareDoubles);
+        for (i = 0; i < 3; i++)
+        {
+            double h = g_p[i] * (n - 1);
+            int k = (int)h;
+            sink = copy[k] + (h - k) * (k + 1 < n ? copy[k + 1] - copy[k] : 0.0);
+        }
+        ms[3] += (double)(XlHostNowNs() - t0) / 1e6;
+
+        t0 = XlHostNowNs();
+        for (i = 0; i < opt->rows; i++)
+            if (cells[i].xltype == xltypeNum)
+            {
+                int lo2 = 0, hi = opt->bins;
+                while (lo2 < hi)
+                {
+                    int mid = (lo2 + hi) / 2;
+                    if (edges[mid] < cells[i].val.num) lo2 = mid + 1; else hi = mid;
+                }
+                counts[lo2]++;
+            }
+        ms[4] += (double)(XlHostNowNs() - t0) / 1e6;
+    }
+    (void)sink;
+    for (i = 0; i < 5; i++)
+        ms[i] /= opt->calls;
+    free(copy);
+    free(edges);
+    free(counts);
+}
+
+int main(int argc, char** argv)
+{
+    ReduceOptions opt = { NULL, 1000000, { 1, 2, 4 }, 3, 20, 99 };
+    ReduceReport reports[MAX_CONFIGS];
+    XLOPER12 range;
+    long double exact = 0.0L;
+    double scalar[5], naive;
+    int a, c, i;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--rows") && a + 1 < argc) opt.rows = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc)
+        {
+            char* p = argv[++a];
+            for (opt.configs = 0; *p && opt.configs < MAX_CONFIGS; )
+            {
+                opt.threads[opt.configs++] = (int)strtol(p, &p, 10);
+                if (*p == ',')
+                    p++;
+            }
+        }
+        else if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--bins") && a + 1 < argc) opt.bins = atoi(argv[++a]);
+        else
+        {
+            fprintf(stderr, "Reduce: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: Reduce [--rows R] [--threads A,B,..] [--calls N] [--bins N] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.rows < 1) opt.rows = 1;
+    if (opt.calls < 1) opt.calls = 1;
+    if (opt.bins < 1) opt.bins = 1;
+
+    range.xltype = xltypeMulti;
+    range.val.array.rows = opt.rows;
+    range.val.array.columns = 1;
+    range.val.array.lparray = (LPXLOPER12)calloc((size_t)opt.rows, sizeof(XLOPER12));
+    Fill(range.val.array.lparray, opt.rows);
+    for (i = 0; i < opt.rows; i++)
+        if (range.val.array.lparray[i].xltype == xltypeNum)
+            exact += range.val.array.lparray[i].val.num;
+
+    for (c = 0; c < opt.configs; c++)
+    {
+        int fds[2], status;
+        pid_t pid;
+
+        memset(&reports[c], 0, sizeof(reports[c]));
+        if (pipe(fds) != 0)
+            return 1;
+        pid = fork();
+        if (pid == 0)
+        {
+            char n[16];
+            ReduceReport report;
+            memset(&report, 0, sizeof(report));
+            close(fds[0]);
+            snprintf(n, sizeof(n), "%d", opt.threads[c]);
+            setenv("XLL_REDUCE_THREADS", n, 1);
+            status = RunConfig(&opt, &range, &report);
+            if (write(fds[1], &report, sizeof(report)) != (ssize_t)sizeof(report))
+                status = 0;
+            _exit(status ? 0 : 1);
+        }
+        close(fds[1]);
+        if (read(fds[0], &reports[c], sizeof(reports[c])) != (ssize_t)sizeof(reports[c]))
+            reports[c].ms[0] = NAN;
+        close(fds[0]);
+        waitpid(pid, &status, 0);
+    }
+    RunScalar(&opt, &range, scalar, &naive);
+
+    printf("%d cells, %d calls each, %d histogram edges\n", opt.rows, opt.calls, opt.bins);
+    printf("%8s %9s %9s %9s %9s %9s %10s %9s %10s\n", "threads", "sum_ms", "var_ms", "min_ms", "pct_ms", "hist_ms",
+        "sum_Mc/s", "parallel", "identical");
+    printf("%8s %9.3f %9.3f %9.3f %9.3f %9.3f %10.1f %9s %10s\n", "scalar", scalar[0], scalar[1], scalar[2], scalar[3],
+        scalar[4], opt.rows / scalar[0] / 1e3, "-", "-");
+    for (c = 0; c < opt.configs; c++)
+    {
+        int same = memcmp(reports[c].results, reports[0].results, sizeof(reports[c].results)) == 0;
+        printf("%8d %9.3f %9.3f %9.3f %9.3f %9.3f %10.1f %9.0f %10s\n", opt.threads[c], reports[c].ms[0],
+            reports[c].ms[1], reports[c].ms[2], reports[c].ms[3], reports[c].ms[4], opt.rows / reports[c].ms[0] / 1e3,
+            reports[c].parallel, same ? "yes" : "NO");
+    }
+    printf("sum relative error vs long double: scalar %.2e, cReduce %.2e\n",
+        (double)fabsl(((long double)naive - exact) / exact), (double)fabsl(((long double)reports[0].results[0] - exact) / exact));
+    free(range.val.array.lparray);
+    return 0;
+}
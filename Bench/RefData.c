@@ -0,0 +1,514 @@
+/*
+**  RefData
+**
+**  Compares reference data mapped from a file (Common/RefData.h, cRefData)
+**  with the same data held in the process heap as a sheet-style table
+**  behind a lookup index (Common/Lookup.h, cLookup). It writes an instrument
+**  master of --rows rows as CSV (isin, issuer, ccy, coupon, maturity,
+**  notional), packs it with RefDataPack (from the directory this bench runs
+**  from), and then measures each store in a forked process of its own, so
+**  resident memory is the store's alone:
+**
+**    mapped    drops the file from the page cache, loads the XLL with
+**              XLL_REFDATA naming it, and times the load and the open
+**    heap      builds the table as XLOPERs (no CSV parsing, so its load time
+**              is a lower bound) and indexes it with cLookupIndex
+**
+**  Both then look up --lookups keys (about one in eleven missing) for their
+**  coupon: a cold pass, the first touch of every page, and a warm pass over
+**  the same keys, each giving the per-call p50, p99 and mean; then the same
+**  keys spread over --threads threads. Resident memory is read from
+**  /proc/self/status after the load and after the passes, split into anon
+**  (private heap) and file (pages shared with the page cache and with every
+**  other process mapping the file). Every coupon found is checked.
+**
+**  The mapped store also maps a second dataset of CHECK_ROWS instruments and
+**  looks up one array of eight keys per row in a single call, more keys than
+**  the dataset has index slots; every one must be found with its coupon.
+**
+**  Usage: RefData [options] ThreadSafeC.so
+**    --rows N        instruments (default 1000000)
+**    --lookups N     keys per pass (default 200000)
+**    --threads T     threads for the last pass (default 4)
+**    --dir DIR       where the CSV and the packed file go (default /tmp)
+**    --keep          leave them there
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 64
+#define COUPON_COLUMN 4
+#define CHECK_ROWS 100
+
+typedef struct RefDataOptions
+{
+    const char* xll;
+    int  rows;
+    int  lookups;
+    int  threads;
+    const char* dir;
+    int  keep;
+} RefDataOptions;
+
+typedef struct PassThread
+{
+    pthread_t thread;
+    int first;
+    int last;
+    long found;
+    long wrong;
+} PassThread;
+
+static const RefDataOptions* g_opt;
+static const XlHostFunc* g_lookup;
+static XLOPER12 g_source;               // Dataset name, or index handle
+static int g_mapped;
+static double* g_latencyNs;
+static const char* g_checkXrd;          // The CHECK_ROWS dataset
+
+static UINT64 Next(UINT64* state)
+{
+    UINT64 x = (*state += 0x9E3779B97F4A7C15ull);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static double Coupon(long id)
+{
+    return 0.125 * (double)(id % 64);
+}
+
+// Instrument id of lookup i: ids up to 10% past the table miss
+static long LookupId(int i)
+{
+    UINT64 state = (UINT64)i * 7919u + 1;
+    return (long)(Next(&state) % (UINT64)(g_opt->rows + g_opt->rows / 10));
+}
+
+static void SetIsin(LPXLOPER12 x, long id)
+{
+    WCHAR text[16];
+
+    swprintf(text, 16, L"XS%010ld", id);
+    XlHostSetStr(x, text);
+}
+
+static void WriteCsv(const char* path, int rows)
+{
+    static const char* ccys[8] = { "USD", "EUR", "GBP", "JPY", "CHF", "CAD", "AUD", "SEK" };
+    FILE* f = fopen(path, "w");
+    long id;
+
+    if (!f)
+    {
+        fprintf(stderr, "RefData: cannot write %s\n", path);
+        exit(1);
+    }
+    fprintf(f, "isin:str,issuer:str,ccy:str,coupon:num,maturity:int,notional:num\n");
+    for (id = 0; id < rows; id++)
+        fprintf(f, "XS%010ld,Issuer %ld,%s,%g,%ld,%ld\n", id, id % 5000, ccys[id % 8], Coupon(id),
+            20270101l + (id % 30) * 10000l, (1 + id % 100) * 1000000l);
+    fclose(f);
+}
+
+// Runs the sibling RefDataPack on csv; 0 on success
+static int Pack(const char* self, const char* csv, const char* xrd)
+{
+    char pack[4096], copy[4096];
+    pid_t pid;
+    int status = -1;
+
+    snprintf(copy, sizeof(copy), "%s", self);
+    snprintf(pack, sizeof(pack), "%s/RefDataPack", dirname(copy));
+    pid = fork();
+    if (pid == 0)
+    {
+        execl(pack, pack, csv, xrd, (char*)NULL);
+        fprintf(stderr, "RefData: cannot run %s\n", pack);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// RssAnon and RssFile of this process, in MB
+static void ReadRss(double* anon, double* file)
+{
+    FILE* f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb;
+
+    *anon = *file = 0.0;
+    while (f && fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "RssAnon: %ld", &kb) == 1)
+            *anon = kb / 1024.0;
+        else if (sscanf(line, "RssFile: %ld", &kb) == 1)
+            *file = kb / 1024.0;
+    }
+    if (f)
+        fclose(f);
+}
+
+// The coupon of lookup i through the store under test
+static void LookupOne(int i, LPXLOPER12 res)
+{
+    XLOPER12 key, a[2];
+
+    SetIsin(&key, LookupId(i));
+    XlHostSetNum(&a[0], COUPON_COLUMN);
+    if (g_mapped)
+    {
+        LPXLOPER12 args[3] = { &g_source, &key, &a[0] };
+        XlHostCall(g_lookup, 3, args, res);
+    }
+    else
+    {
+        LPXLOPER12 args[4] = { &key, &g_source, &a[0], &a[1] };
+        XlHostSetNum(&a[1], 0.0);
+        XlHostCall(g_lookup, 4, args, res);
+    }
+    XlHostFreeResult(&key);
+}
+
+static void* PassMain(void* arg)
+{
+    PassThread* t = (PassThread*)arg;
+    XLOPER12 res;
+    int i;
+
+    for (i = t->first; i < t->last; i++)
+    {
+        ULONGLONG t0 = XlHostNowNs();
+        long id = LookupId(i);
+        LookupOne(i, &res);
+        if (g_latencyNs)
+            g_latencyNs[i] = (double)(XlHostNowNs() - t0);
+        if ((res.xltype & xltypeNum) == xltypeNum)
+        {
+            t->found++;
+            if (id >= g_opt->rows || res.val.num != Coupon(id))
+                t->wrong++;
+        }
+        else if (id < g_opt->rows)
+            t->wrong++;
+        XlHostFreeResult(&res);
+    }
+    return NULL;
+}
+
+static int CompareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// One pass of every lookup on 'threads' threads; prints a row
+static void Pass(const char* label, int threads)
+{
+    PassThread t[MAX_THREADS];
+    double anon, file, mean = 0.0;
+    long found = 0, wrong = 0;
+    ULONGLONG t0, t1;
+    int i;
+
+    memset(t, 0, sizeof(t));
+    g_latencyNs = threads == 1 ? (double*)calloc(g_opt->lookups, sizeof(double)) : NULL;
+    t0 = XlHostNowNs();
+    for (i = 0; i < threads; i++)
+    {
+        t[i].first = (int)((long long)g_opt->lookups * i / threads);
+        t[i].last = (int)((long long)g_opt->lookups * (i + 1) / threads);
+        pthread_create(&t[i].thread, NULL, PassMain, &t[i]);
+    }
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(t[i].thread, NULL);
+        found += t[i].found;
+        wrong += t[i].wrong;
+    }
+    t1 = XlHostNowNs();
+    ReadRss(&anon, &file);
+    printf("  %-12s %10.0f", label, (double)g_opt->lookups * 1e9 / (double)(t1 - t0));
+    if (g_latencyNs)
+    {
+        for (i = 0; i < g_opt->lookups; i++)
+            mean += g_latencyNs[i] / g_opt->lookups;
+        qsort(g_latencyNs, g_opt->lookups, sizeof(double), CompareDouble);
+        printf(" %8.0f %8.0f %8.0f", g_latencyNs[g_opt->lookups / 2], g_latencyNs[g_opt->lookups * 99 / 100], mean);
+    }
+    else
+        printf(" %8s %8s %8s", "-", "-", "-");
+    printf(" %9.1f %9.1f %6.1f%% %6ld\n", anon, file, 100.0 * found / g_opt->lookups, wrong);
+    fflush(stdout);
+    free(g_latencyNs);
+    g_latencyNs = NULL;
+}
+
+static void PassHeader(void)
+{
+    printf("  %-12s %10s %8s %8s %8s %9s %9s %7s %6s\n", "pass", "lookups/s", "p50_ns", "p99_ns", "mean_ns",
+        "anon_MB", "file_MB", "found", "wrong");
+}
+
+// One row of a two-column stats table by name
+static double Counter(int module, const WCHAR* func, const WCHAR* name)
+{
+    const XlHostFunc* stats = XlHostFindFunc(module, func);
+    XLOPER12 res;
+    double value = -1.0;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 2)
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * 2];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(name)
+                && wcsncmp(&key->val.str[1], name, key->val.str[0]) == 0)
+                value = res.val.array.lparray[r * 2 + 1].val.num;
+        }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+static void Passes(void)
+{
+    PassHeader();
+    Pass("cold", 1);
+    Pass("warm", 1);
+    if (g_opt->threads > 1)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "%d threads", g_opt->threads);
+        Pass(label, g_opt->threads);
+    }
+}
+
+// One cRefData call over an array of keys cycling through the check dataset
+static void ArrayCheck(void)
+{
+    XLOPER12 set, keys, column, res;
+    LPXLOPER12 args[3] = { &set, &keys, &column };
+    int n = CHECK_ROWS * 8, i, found = 0, wrong = 0;
+
+    XlHostSetStr(&set, L"arraycheck");
+    XlHostSetNum(&column, COUPON_COLUMN);
+    keys.xltype = xltypeMulti;
+    keys.val.array.rows = n;
+    keys.val.array.columns = 1;
+    keys.val.array.lparray = (LPXLOPER12)calloc((size_t)n, sizeof(XLOPER12));
+    for (i = 0; i < n; i++)
+        SetIsin(&keys.val.array.lparray[i], i % CHECK_ROWS);
+    if (XlHostCall(g_lookup, 3, args, &res) == xlretSuccess)
+    {
+        if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.rows * res.val.array.columns == n)
+            for (i = 0; i < n; i++)
+            {
+                const XLOPER12* v = &res.val.array.lparray[i];
+                if ((v->xltype & 0x0FFF) != xltypeNum)
+                    continue;
+                found++;
+                if (v->val.num != Coupon(i % CHECK_ROWS))
+                    wrong++;
+            }
+        XlHostFreeResult(&res);
+    }
+    printf("  array check: %d keys over %d rows in one call, found %d, wrong %d\n", n, CHECK_ROWS, found, wrong);
+    for (i = 0; i < n; i++)
+        XlHostFreeResult(&keys.val.array.lparray[i]);
+    free(keys.val.array.lparray);
+    XlHostFreeResult(&set);
+}
+
+// Child process: the mapped store
+static int RunMapped(const char* xrd)
+{
+    double anon0, file0, anon1, file1;
+    ULONGLONG t0, t1;
+    char sets[8192];
+    int fd, module;
+
+    fd = open(xrd, O_RDONLY);
+    if (fd >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    snprintf(sets, sizeof(sets), "%s;%s", xrd, g_checkXrd);
+    setenv("XLL_REFDATA", sets, 1);
+    ReadRss(&anon0, &file0);
+    t0 = XlHostNowNs();
+    module = XlHostLoad(g_opt->xll);
+    t1 = XlHostNowNs();
+    if (module < 0)
+        return 1;
+    g_lookup = XlHostFindFunc(module, L"cRefData");
+    if (!g_lookup || Counter(module, L"cRefDataStats", L"Datasets") != 2.0)
+    {
+        fprintf(stderr, "RefData: %s did not map %s\n", g_opt->xll, xrd);
+        return 1;
+    }
+    ReadRss(&anon1, &file1);
+    g_mapped = 1;
+    XlHostSetStr(&g_source, L"instruments");
+    printf("mapped: load %.1f ms (open %.3f ms), +%.1f MB anon, +%.1f MB file\n", (double)(t1 - t0) / 1e6,
+        Counter(module, L"cRefDataStats", L"OpenMs"), anon1 - anon0, file1 - file0);
+    Passes();
+    printf("  probes per key %.2f\n", Counter(module, L"cRefDataStats", L"ProbesPerKey"));
+    ArrayCheck();
+    printf("\n");
+    fflush(stdout);
+    XlHostFreeResult(&g_source);
+    XlHostUnloadAll();
+    return 0;
+}
+
+// Child process: the same data as an XLOPER table behind cLookupIndex
+static int RunHeap(void)
+{
+    static const WCHAR* ccys[8] = { L"USD", L"EUR", L"GBP", L"JPY", L"CHF", L"CAD", L"AUD", L"SEK" };
+    const XlHostFunc* build;
+    XLOPER12 table;
+    LPXLOPER12 cells, args[1] = { &table };
+    double anon0, file0, anon1, file1;
+    ULONGLONG t0, t1, t2;
+    WCHAR text[32];
+    long id;
+    int module;
+
+    unsetenv("XLL_REFDATA");
+    module = XlHostLoad(g_opt->xll);
+    if (module < 0)
+        return 1;
+    build = XlHostFindFunc(module, L"cLookupIndex");
+    g_lookup = XlHostFindFunc(module, L"cLookup");
+    if (!build || !g_lookup)
+        return 1;
+    ReadRss(&anon0, &file0);
+    t0 = XlHostNowNs();
+    cells = (LPXLOPER12)calloc((size_t)g_opt->rows * 6, sizeof(XLOPER12));
+    for (id = 0; id < g_opt->rows; id++)
+    {
+        LPXLOPER12 row = &cells[id * 6];
+        SetIsin(&row[0], id);
+        swprintf(text, 32, L"Issuer %ld", id % 5000);
+        XlHostSetStr(&row[1], text);
+        XlHostSetStr(&row[2], ccys[id % 8]);
+        XlHostSetNum(&row[3], Coupon(id));
+        XlHostSetNum(&row[4], (double)(20270101l + (id % 30) * 10000l));
+        XlHostSetNum(&row[5], (double)((1 + id % 100) * 1000000l));
+    }
+    table.xltype = xltypeMulti;
+    table.val.array.rows = g_opt->rows;
+    table.val.array.columns = 6;
+    table.val.array.lparray = cells;
+    t1 = XlHostNowNs();
+    XlHostCall(build, 1, args, &g_source);
+    t2 = XlHostNowNs();
+    ReadRss(&anon1, &file1);
+    printf("heap: table %.1f ms + index %.1f ms, +%.1f MB anon, +%.1f MB file\n", (double)(t1 - t0) / 1e6,
+        (double)(t2 - t1) / 1e6, anon1 - anon0, file1 - file0);
+    g_mapped = 0;
+    Passes();
+    printf("\n");
+    fflush(stdout);
+    XlHostFreeResult(&g_source);
+    XlHostUnloadAll();
+    return 0;
+}
+
+static void Spawn(const char* xrd)
+{
+    pid_t pid = fork();
+    int status = 0;
+
+    if (pid == 0)
+        _exit(xrd ? RunMapped(xrd) : RunHeap());
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "RefData: the %s store failed (status %d)\n", xrd ? "mapped" : "heap", status);
+}
+
+int main(int argc, char** argv)
+{
+    RefDataOptions opt = { NULL, 1000000, 200000, 4, "/tmp", 0 };
+    char csv[4096], xrd[4096], checkCsv[4096], checkXrd[4096];
+    ULONGLONG t0, t1, t2;
+    struct stat st;
+    int a;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--rows") && a + 1 < argc) opt.rows = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--lookups") && a + 1 < argc) opt.lookups = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--dir") && a + 1 < argc) opt.dir = argv[++a];
+        else if (!strcmp(argv[a], "--keep")) opt.keep = 1;
+        else
+        {
+            fprintf(stderr, "RefData: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: RefData [--rows N] [--lookups N] [--threads T] [--dir DIR] [--keep] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.rows < 1) opt.rows = 1;
+    if (opt.lookups < 1) opt.lookups = 1;
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+    g_opt = &opt;
+
+    snprintf(csv, sizeof(csv), "%s/instruments.csv", opt.dir);
+    snprintf(xrd, sizeof(xrd), "%s/instruments.xrd", opt.dir);
+    t0 = XlHostNowNs();
+    WriteCsv(csv, opt.rows);
+    t1 = XlHostNowNs();
+    if (Pack(argv[0], csv, xrd) != 0 || stat(xrd, &st) != 0)
+    {
+        fprintf(stderr, "RefData: RefDataPack failed\n");
+        return 1;
+    }
+    t2 = XlHostNowNs();
+    snprintf(checkCsv, sizeof(checkCsv), "%s/arraycheck.csv", opt.dir);
+    snprintf(checkXrd, sizeof(checkXrd), "%s/arraycheck.xrd", opt.dir);
+    WriteCsv(checkCsv, CHECK_ROWS);
+    if (Pack(argv[0], checkCsv, checkXrd) != 0)
+    {
+        fprintf(stderr, "RefData: RefDataPack failed\n");
+        return 1;
+    }
+    g_checkXrd = checkXrd;
+    printf("%d instruments: csv %.0f ms, pack %.0f ms, %.1f MB mapped file; %d lookups per pass\n\n", opt.rows,
+        (double)(t1 - t0) / 1e6, (double)(t2 - t1) / 1e6, st.st_size / 1048576.0, opt.lookups);
+    fflush(stdout);
+
+    Spawn(xrd);
+    Spawn(NULL);
+    if (!opt.keep)
+    {
+        unlink(csv);
+        unlink(xrd);
+        unlink(checkCsv);
+        unlink(checkXrd);
+    }
+    return 0;
+}
@@ -0,0 +1,439 @@
+/*
+**  RefDataPack
+**
+**  Writes a reference data file (Common/RefData.h) from a CSV, for XLL_REFDATA
+**  to map. The first line names the columns, each as name:type, where type
+**  is num (a double), int (a 64-bit integer) or str (text, kept once in the
+**  file's string dictionary however many rows hold it); a name without a type
+**  is num. Fields are separated by commas and may be quoted, with "" for a
+**  quote inside one. Text is UTF-8 and kept as UTF-16, at most
+**  REFDATA_MAX_STRING code units a value. An empty num is NaN, an empty int 0
+**  and an empty str no string; all three come back from cRefData as #N/A,
+**  except the int.
+**
+**  The key column (--key, default the first) is indexed: a hash table of at
+**  least twice as many slots as rows, so a lookup usually reads one slot.
+**  Rows with an empty key are not indexed, and of rows with the same key the
+**  first is.
+**
+**  Usage: RefDataPack [--key NAME] input.csv output.xrd
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "RefData.h"
+
+typedef struct PackColumn
+{
+    char name[REFDATA_NAME];
+    UINT32 type;
+    void* values;                   // double, INT64 or UINT32 per row
+} PackColumn;
+
+typedef struct PackStrings
+{
+    UINT16* pool;                   // Each string: its length, then its code units
+    UINT64 poolUnits;
+    UINT64 poolCap;
+    UINT64* offsets;                // Of each id, in code units from the start of the pool
+    UINT32 count;
+    UINT32 cap;
+    UINT32* table;                  // id + 1, 0 for an empty slot
+    UINT64 tableMask;
+} PackStrings;
+
+static PackColumn g_columns[1024];
+static UINT32 g_columnCount = 0;
+static UINT32 g_rows = 0;
+static UINT32 g_rowCap = 0;
+static PackStrings g_strings;
+
+static void* Grow(void* p, UINT64 bytes)
+{
+    void* q = realloc(p, (size_t)bytes);
+    if (!q)
+    {
+        fprintf(stderr, "RefDataPack: out of memory\n");
+        exit(1);
+    }
+    return q;
+}
+
+// UTF-8 field to at most REFDATA_MAX_STRING UTF-16 code units; returns the count
+static UINT32 ToUtf16(const char* s, size_t n, UINT16* out)
+{
+    const unsigned char* p = (const unsigned char*)s;
+    const unsigned char* end = p + n;
+    UINT32 units = 0;
+
+    while (p < end && units < REFDATA_MAX_STRING)
+    {
+        UINT32 c = *p++;
+        int more = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+        if (more)
+            c &= 0x3F >> more;
+        while (more-- > 0 && p < end)
+            c = (c << 6) | (*p++ & 0x3F);
+        if (c >= 0x10000)
+        {
+            if (units + 2 > REFDATA_MAX_STRING)
+                break;
+            c -= 0x10000;
+            out[units++] = (UINT16)(0xD800 + (c >> 10));
+            out[units++] = (UINT16)(0xDC00 + (c & 0x3FF));
+        }
+        else
+            out[units++] = (UINT16)c;
+    }
+    return units;
+}
+
+static UINT64 HashUnits(const UINT16* units, UINT32 n)
+{
+    UINT64 h = REFDATA_HASH_SEED;
+    UINT32 i;
+
+    for (i = 0; i < n; i++)
+        h = RefDataHashStep(h, units[i]);
+    return RefDataMix(h);
+}
+
+// Dictionary id of a string, adding it the first time it is seen (exact, not case-folded)
+static UINT32 Intern(const UINT16* units, UINT32 n)
+{
+    PackStrings* d = &g_strings;
+    UINT64 h = HashUnits(units, n), i;
+    UINT32 id;
+
+    if ((UINT64)(d->count + 1) * 2 > d->tableMask + 1)
+    {
+        UINT64 slots = d->tableMask ? (d->tableMask + 1) * 2 : 1024, k;
+        UINT32* table = (UINT32*)Grow(NULL, slots * sizeof(UINT32));
+        memset(table, 0, (size_t)(slots * sizeof(UINT32)));
+        for (k = 0; k <= d->tableMask && d->table; k++)
+            if (d->table[k])
+            {
+                const UINT16* s = d->pool + d->offsets[d->table[k] - 1];
+                for (i = HashUnits(s + 1, s[0]) & (slots - 1); table[i]; i = (i + 1) & (slots - 1))
+                    ;
+                table[i] = d->table[k];
+            }
+        free(d->table);
+        d->table = table;
+        d->tableMask = slots - 1;
+    }
+    for (i = h & d->tableMask; d->table[i]; i = (i + 1) & d->tableMask)
+    {
+        const UINT16* s = d->pool + d->offsets[d->table[i] - 1];
+        if (s[0] == n && memcmp(s + 1, units, n * sizeof(UINT16)) == 0)
+            return d->table[i] - 1;
+    }
+    if (d->count == d->cap)
+    {
+        d->cap = d->cap ? d->cap * 2 : 1024;
+        d->offsets = (UINT64*)Grow(d->offsets, (UINT64)d->cap * sizeof(UINT64));
+    }
+    while (d->poolUnits + n + 1 > d->poolCap)
+    {
+        d->poolCap = d->poolCap ? d->poolCap * 2 : 65536;
+        d->pool = (UINT16*)Grow(d->pool, d->poolCap * sizeof(UINT16));
+    }
+    id = d->count++;
+    d->offsets[id] = d->poolUnits;
+    d->pool[d->poolUnits] = (UINT16)n;
+    memcpy(d->pool + d->poolUnits + 1, units, n * sizeof(UINT16));
+    d->poolUnits += n + 1;
+    d->table[i] = id + 1;
+    return id;
+}
+
+// Splits line into fields in place; returns the field count
+static int SplitCsv(char* line, char** fields, size_t* lengths, int max)
+{
+    char* p = line;
+    int n = 0;
+
+    while (n < max)
+    {
+        char* out = p;
+        fields[n] = p;
+        if (*p == '"')
+        {
+            char* in = p + 1;
+            fields[n] = out;
+            while (*in && !(*in == '"' && in[1] != '"'))
+            {
+                if (*in == '"')
+                    in++;
+                *out++ = *in++;
+            }
+            if (*in == '"')
+                in++;
+            lengths[n] = (size_t)(out - fields[n]);
+            p = in;
+            while (*p && *p != ',')
+                p++;
+        }
+        else
+        {
+            while (*p && *p != ',' && *p != '\r' && *p != '\n')
+                p++;
+            lengths[n] = (size_t)(p - fields[n]);
+        }
+        n++;
+        if (*p != ',')
+            break;
+        p++;
+    }
+    return n;
+}
+
+static void AddRow(char** fields, size_t* lengths, int count)
+{
+    UINT16 units[REFDATA_MAX_STRING];
+    char text[64];
+    UINT32 c;
+
+    if (g_rows == g_rowCap)
+    {
+        g_rowCap = g_rowCap ? g_rowCap * 2 : 65536;
+        for (c = 0; c < g_columnCount; c++)
+            g_columns[c].values = Grow(g_columns[c].values, (UINT64)g_rowCap * 8);
+    }
+    for (c = 0; c < g_columnCount; c++)
+    {
+        PackColumn* col = &g_columns[c];
+        size_t n = (int)c < count ? lengths[c] : 0;
+        const char* field = (int)c < count ? fields[c] : "";
+
+        if (col->type == REFDATA_STR)
+        {
+            UINT32 len = ToUtf16(field, n, units);
+            ((UINT32*)col->values)[g_rows] = len ? Intern(units, len) : REFDATA_NO_STRING;
+            continue;
+        }
+        if (n >= sizeof(text))
+            n = sizeof(text) - 1;
+        memcpy(text, field, n);
+        text[n] = 0;
+        if (col->type == REFDATA_I64)
+            ((INT64*)col->values)[g_rows] = n ? strtoll(text, NULL, 10) : 0;
+        else
+            ((double*)col->values)[g_rows] = n ? strtod(text, NULL) : NAN;
+    }
+    g_rows++;
+}
+
+static BOOL SameKey(const PackColumn* key, UINT32 a, UINT32 b)
+{
+    if (key->type == REFDATA_STR)
+    {
+        const UINT16* s = g_strings.pool + g_strings.offsets[((UINT32*)key->values)[a]];
+        const UINT16* t = g_strings.pool + g_strings.offsets[((UINT32*)key->values)[b]];
+        UINT32 i;
+        if (s[0] != t[0])
+            return FALSE;
+        for (i = 1; i <= s[0]; i++)
+            if (RefDataFold(s[i]) != RefDataFold(t[i]))
+                return FALSE;
+        return TRUE;
+    }
+    if (key->type == REFDATA_I64)
+        return (double)((INT64*)key->values)[a] == (double)((INT64*)key->values)[b];
+    return ((double*)key->values)[a] == ((double*)key->values)[b];
+}
+
+// The index over the key column; returns the rows indexed
+static UINT32 BuildIndex(const PackColumn* key, RefDataSlot* slots, UINT64 mask)
+{
+    UINT32 r, indexed = 0;
+
+    for (r = 0; r < g_rows; r++)
+    {
+        UINT64 h, i;
+        if (key->type == REFDATA_STR)
+        {
+            UINT32 id = ((UINT32*)key->values)[r];
+            if (id == REFDATA_NO_STRING)
+                continue;
+            h = HashUnits(g_strings.pool + g_strings.offsets[id] + 1, g_strings.pool[g_strings.offsets[id]]);
+        }
+        else
+        {
+            double v = key->type == REFDATA_I64 ? (double)((INT64*)key->values)[r] : ((double*)key->values)[r];
+            if (isnan(v))
+                continue;
+            h = RefDataHashNum(v);
+        }
+        for (i = h & mask; slots[i].row; i = (i + 1) & mask)
+            if (slots[i].hash == (UINT32)(h >> 32) && SameKey(key, slots[i].row - 1, r))
+                break;
+        if (slots[i].row)
+            continue;               // The first row with the key keeps it
+        slots[i].hash = (UINT32)(h >> 32);
+        slots[i].row = r + 1;
+        indexed++;
+    }
+    return indexed;
+}
+
+static UINT64 AlignUp(UINT64 x, UINT64 a)
+{
+    return (x + a - 1) & ~(a - 1);
+}
+
+static void WriteAt(FILE* f, UINT64 offset, const void* data, UINT64 bytes)
+{
+    static const char zeros[REFDATA_ALIGN] = { 0 };
+    long at = ftell(f);
+
+    while ((UINT64)at < offset)
+    {
+        UINT64 pad = offset - (UINT64)at > sizeof(zeros) ? sizeof(zeros) : offset - (UINT64)at;
+        fwrite(zeros, 1, (size_t)pad, f);
+        at += (long)pad;
+    }
+    fwrite(data, 1, (size_t)bytes, f);
+}
+
+int main(int argc, char** argv)
+{
+    const char* keyName = NULL;
+    BOOL keyFound = FALSE;
+    const char* input = NULL;
+    const char* output = NULL;
+    char* line = NULL;
+    size_t lineCap = 0;
+    char* fields[1024];
+    size_t lengths[1024];
+    RefDataHeader header;
+    RefDataColumn* columns;
+    RefDataSlot* slots;
+    UINT64* dictionary;
+    UINT64 at;
+    UINT32 c, indexed;
+    FILE* in;
+    FILE* out;
+    int a, n;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--key") && a + 1 < argc) keyName = argv[++a];
+        else
+        {
+            fprintf(stderr, "RefDataPack: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a + 1 < argc)
+    {
+        input = argv[a];
+        output = argv[a + 1];
+    }
+    if (!input)
+    {
+        fprintf(stderr, "usage: RefDataPack [--key NAME] input.csv output.xrd\n");
+        return 2;
+    }
+    in = fopen(input, "rb");
+    if (!in || getline(&line, &lineCap, in) <= 0)
+    {
+        fprintf(stderr, "RefDataPack: cannot read %s\n", input);
+        return 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    n = SplitCsv(line, fields, lengths, (int)_countof(fields));
+    for (a = 0; a < n; a++)
+    {
+        PackColumn* col = &g_columns[g_columnCount++];
+        char* type = memchr(fields[a], ':', lengths[a]);
+        size_t nameLen = type ? (size_t)(type - fields[a]) : lengths[a];
+        size_t typeLen = type ? lengths[a] - nameLen - 1 : 0;
+
+        if (nameLen >= REFDATA_NAME)
+            nameLen = REFDATA_NAME - 1;
+        memcpy(col->name, fields[a], nameLen);
+        col->name[nameLen] = 0;
+        col->type = typeLen == 3 && !strncmp(type + 1, "str", 3) ? REFDATA_STR
+            : typeLen == 3 && !strncmp(type + 1, "int", 3) ? REFDATA_I64 : REFDATA_F64;
+        if (keyName && !keyFound && !strcmp(keyName, col->name))
+        {
+            header.keyColumn = g_columnCount - 1;
+            keyFound = TRUE;
+        }
+    }
+    if (keyName && !keyFound)
+    {
+        fprintf(stderr, "RefDataPack: %s has no column %s\n", input, keyName);
+        return 1;
+    }
+    while (getline(&line, &lineCap, in) > 0)
+    {
+        if (line[0] == '\n' || line[0] == '\r')
+            continue;
+        n = SplitCsv(line, fields, lengths, (int)_countof(fields));
+        AddRow(fields, lengths, n);
+    }
+    fclose(in);
+    free(line);
+
+    // Layout: header, columns, each column on REFDATA_ALIGN, dictionary, pool, index
+    header.magic = REFDATA_MAGIC;
+    header.version = REFDATA_VERSION;
+    header.rows = g_rows;
+    header.columns = g_columnCount;
+    header.strings = g_strings.count;
+    columns = (RefDataColumn*)calloc(g_columnCount, sizeof(RefDataColumn));
+    at = sizeof(RefDataHeader) + (UINT64)g_columnCount * sizeof(RefDataColumn);
+    for (c = 0; c < g_columnCount; c++)
+    {
+        UINT32 i;
+        for (i = 0; g_columns[c].name[i]; i++)
+            columns[c].name[i] = (UINT16)(unsigned char)g_columns[c].name[i];
+        columns[c].type = g_columns[c].type;
+        columns[c].width = g_columns[c].type == REFDATA_STR ? sizeof(UINT32) : sizeof(double);
+        columns[c].offset = AlignUp(at, REFDATA_ALIGN);
+        at = columns[c].offset + (UINT64)g_rows * columns[c].width;
+    }
+    header.dictionaryOffset = AlignUp(at, REFDATA_ALIGN);
+    header.poolOffset = header.dictionaryOffset + (UINT64)g_strings.count * sizeof(UINT64);
+    header.poolBytes = g_strings.poolUnits * sizeof(UINT16);
+    header.indexOffset = AlignUp(header.poolOffset + header.poolBytes, REFDATA_ALIGN);
+    for (header.indexSlots = 8; header.indexSlots < (UINT64)g_rows * 2; header.indexSlots *= 2)
+        ;
+    header.fileBytes = header.indexOffset + header.indexSlots * sizeof(RefDataSlot);
+
+    dictionary = (UINT64*)malloc((size_t)(g_strings.count + 1) * sizeof(UINT64));
+    for (c = 0; c < g_strings.count; c++)
+        dictionary[c] = header.poolOffset + g_strings.offsets[c] * sizeof(UINT16);
+    slots = (RefDataSlot*)calloc((size_t)header.indexSlots, sizeof(RefDataSlot));
+    indexed = BuildIndex(&g_columns[header.keyColumn], slots, header.indexSlots - 1);
+
+    out = fopen(output, "wb");
+    if (!out || !columns || !dictionary || !slots)
+    {
+        fprintf(stderr, "RefDataPack: cannot write %s\n", output);
+        return 1;
+    }
+    WriteAt(out, 0, &header, sizeof(header));
+    WriteAt(out, sizeof(header), columns, (UINT64)g_columnCount * sizeof(RefDataColumn));
+    for (c = 0; c < g_columnCount; c++)
+        WriteAt(out, columns[c].offset, g_columns[c].values, (UINT64)g_rows * columns[c].width);
+    WriteAt(out, header.dictionaryOffset, dictionary, (UINT64)g_strings.count * sizeof(UINT64));
+    WriteAt(out, header.poolOffset, g_strings.pool, header.poolBytes);
+    WriteAt(out, header.indexOffset, slots, header.indexSlots * sizeof(RefDataSlot));
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "RefDataPack: cannot write %s\n", output);
+        return 1;
+    }
+    printf("RefDataPack: %s: %u rows, %u columns, key %s (%u indexed), %u strings, %llu bytes\n", output,
+        g_rows, g_columnCount, g_columns[header.keyColumn].name, indexed, g_strings.count,
+        (unsigned long long)header.fileBytes);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+**  Rundll
+**
+**  Stand-in for rundll32.exe, started by the host's CreateProcessW for
+**  command lines of the form
+**      rundll32.exe "<dll>",<entry> <arguments>
+**  As rundll32 does, it loads the DLL (DllMain process attach, but no
+**  xlAutoOpen: the process is not Excel), looks up <entry>W and then <entry>,
+**  and calls it as
+**      void CALLBACK entry(HWND hwnd, HINSTANCE hinst, LPWSTR cmdLine, int show)
+**  with the rest of the command line. It exits with 0 when the entry returns.
+**
+**  Usage (normally only through CreateProcessW):
+**      Rundll <dll>,<entry> "<arguments>"
+**  XLHOST_SLEEP_SCALE carries the parent's Sleep() scaling.
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include "XlHost.h"
+
+typedef void (*RundllEntryW)(HWND, HINSTANCE, LPWSTR, int);
+
+int main(int argc, char** argv)
+{
+    char path[1024], name[160];
+    WCHAR cmdLine[2048];
+    char* comma;
+    void* handle;
+    int (*dllMain)(HINSTANCE, DWORD, LPVOID);
+    RundllEntryW entry;
+
+    if (argc < 2 || !(comma = strrchr(argv[1], ',')))
+    {
+        fprintf(stderr, "usage: Rundll <dll>,<entry> [arguments]\n");
+        return 2;
+    }
+    snprintf(path, sizeof(path), "%.*s", (int)(comma - argv[1]), argv[1]);
+    if (getenv("XLHOST_SLEEP_SCALE"))
+        g_xlHostConfig.sleepScale = atof(getenv("XLHOST_SLEEP_SCALE"));
+    if (mbstowcs(cmdLine, argc > 2 ? argv[2] : "", 2048) >= 2048)
+        return 2;
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        fprintf(stderr, "[Rundll] %s\n", dlerror());
+        return 1;
+    }
+    dllMain = (int (*)(HINSTANCE, DWORD, LPVOID))dlsym(handle, "DllMain");
+    if (dllMain && !dllMain(handle, DLL_PROCESS_ATTACH, NULL))
+        return 1;
+
+    snprintf(name, sizeof(name), "%sW", comma + 1);
+    entry = (RundllEntryW)dlsym(handle, name);
+    if (!entry)
+        entry = (RundllEntryW)dlsym(handle, comma + 1);
+    if (!entry)
+    {
+        fprintf(stderr, "[Rundll] %s does not export %s\n", path, comma + 1);
+        return 1;
+    }
+    entry(NULL, handle, cmdLine, 0);
+
+    if (dllMain)
+        dllMain(handle, DLL_PROCESS_DETACH, NULL);
+    return 0;
+}
@@ -0,0 +1,505 @@
+/*
+**  ScalingSweep
+**
+**  Runs every thread-safe function registered by the given XLLs at 1..N
+**  threads against the XlHost stand-in and reports, per function:
+**    - wall time, throughput, speedup and parallel efficiency vs 1 thread
+**    - share of thread time spent in the allocator, the callback and locks
+**  After the sweep it lists cache lines in the XLLs' writable data that were
+**  modified while several threads were running, with the globals on each line
+**  (read from the ELF symbol table), flagging lines shared by several symbols
+**  as false-sharing candidates.
+**
+**  Usage: ScalingSweep [options] ThreadSafeC.so MultithreadCrash.so
+**    --threads N            highest thread count (default: online CPUs, min 4)
+**    --calls K              calls per function per run, split across threads (default 20000)
+**    --sleep-scale S        multiplier for Sleep() inside UDFs (default 0.01)
+**    --callback-ns NS       extra cost of every Excel callback (default 0)
+**    --serialise-callbacks  run callbacks under one process-wide lock
+**    --filter TEXT          only functions whose name contains TEXT
+**    --csv FILE             also write the scaling table as CSV
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 256
+#define MAX_SEGMENTS 8
+#define MAX_LINES 4096
+
+typedef struct SweepOptions
+{
+    int    maxThreads;
+    long   calls;
+    const char* filter;
+    const char* csvPath;
+} SweepOptions;
+
+typedef struct SweepWorker
+{
+    pthread_t thread;
+    const XlHostFunc* func;
+    long calls;
+    int index;
+    pthread_barrier_t* barrier;
+    ULONGLONG startNs;
+    ULONGLONG endNs;
+    XlHostStats stats;
+} SweepWorker;
+
+typedef struct SweepRow
+{
+    int threads;
+    double wallMs;
+    double callsPerSec;
+    double speedup;
+    double efficiency;
+    double allocPct;
+    double callbackPct;
+    double lockPct;
+    double sleepPct;
+    XlHostStats stats;
+} SweepRow;
+
+// Writable segment of a module, snapshotted around multi-threaded runs
+typedef struct Segment
+{
+    unsigned char* addr;
+    size_t size;
+    unsigned char* snapshot;
+} Segment;
+
+typedef struct ModuleLayout
+{
+    Segment segs[MAX_SEGMENTS];
+    int segCount;
+    size_t lineSize;
+    unsigned char* written;     // One flag per cache line across all segments
+    size_t lineCount;
+    WCHAR  writers[MAX_LINES][48];  // First function seen writing each line
+} ModuleLayout;
+
+static ModuleLayout g_layouts[XLHOST_MAX_MODULES];
+
+/*
+** Argument generation: B -> number, Q/U -> string for string kernels, number otherwise
+*/
+static void BuildArgs(const XlHostFunc* f, XLOPER12* storage, LPXLOPER12* args, int seed)
+{
+    int wantsString = wcsstr(f->name, L"String") != NULL;
+    for (int i = 0; i < f->argCount; i++)
+    {
+        if ((f->argTypes[i] == 'Q' || f->argTypes[i] == 'U') && wantsString)
+            XlHostSetStr(&storage[i], i == 0 ? L"scaling-sweep" : L"-payload");
+        else
+            XlHostSetNum(&storage[i], (double)(seed % 97) + 0.5 * (i + 1));
+        args[i] = &storage[i];
+    }
+}
+
+static void* WorkerMain(void* arg)
+{
+    SweepWorker* w = (SweepWorker*)arg;
+    XLOPER12 storage[XLHOST_MAX_ARGS];
+    LPXLOPER12 args[XLHOST_MAX_ARGS];
+    XLOPER12 res;
+
+    BuildArgs(w->func, storage, args, w->index);
+    XlHostResetThreadStats();
+    pthread_barrier_wait(w->barrier);
+
+    w->startNs = XlHostNowNs();
+    for (long i = 0; i < w->calls; i++)
+    {
+        if (XlHostCall(w->func, w->func->argCount, args, &res) == xlretSuccess)
+            XlHostFreeResult(&res);
+    }
+    w->endNs = XlHostNowNs();
+
+    w->stats = *XlHostThreadStats();
+    for (int i = 0; i < w->func->argCount; i++)
+        XlHostFreeResult(&storage[i]);
+    return NULL;
+}
+
+static SweepRow RunOnce(const XlHostFunc* f, int threads, long calls)
+{
+    SweepWorker workers[MAX_THREADS];
+    pthread_barrier_t barrier;
+    SweepRow row;
+    memset(&row, 0, sizeof(row));
+
+    pthread_barrier_init(&barrier, NULL, (unsigned)threads + 1);
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t].func = f;
+        workers[t].calls = calls / threads + (t < calls % threads ? 1 : 0);
+        workers[t].index = t;
+        workers[t].barrier = &barrier;
+        pthread_create(&workers[t].thread, NULL, WorkerMain, &workers[t]);
+    }
+
+    // Wall time runs from the first worker starting to the last one finishing
+    pthread_barrier_wait(&barrier);
+    for (int t = 0; t < threads; t++)
+        pthread_join(workers[t].thread, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    // Each run is one recalculation: let the XLLs reclaim what it retired
+    XlHostFireEvent(xleventCalculationEnded);
+
+    ULONGLONG first = workers[0].startNs, last = workers[0].endNs;
+    for (int t = 0; t < threads; t++)
+    {
+        if (workers[t].startNs < first) first = workers[t].startNs;
+        if (workers[t].endNs > last) last = workers[t].endNs;
+        XlHostAddStats(&row.stats, &workers[t].stats);
+    }
+    ULONGLONG wallNs = last > first ? last - first : 1;
+
+    double threadNs = (double)wallNs * threads;
+    row.threads = threads;
+    row.wallMs = (double)wallNs / 1e6;
+    row.callsPerSec = wallNs ? (double)calls * 1e9 / (double)wallNs : 0.0;
+    row.allocPct = 100.0 * (double)row.stats.allocNs / threadNs;
+    row.callbackPct = 100.0 * (double)row.stats.callbackNs / threadNs;
+    row.lockPct = 100.0 * (double)row.stats.lockWaitNs / threadNs;
+    row.sleepPct = 100.0 * (double)row.stats.sleepNs / threadNs;
+    return row;
+}
+
+/*
+** Writable-segment snapshots
+*/
+typedef struct PhdrSearch
+{
+    void* base;
+    ModuleLayout* layout;
+} PhdrSearch;
+
+static int CollectSegments(struct dl_phdr_info* info, size_t size, void* data)
+{
+    PhdrSearch* s = (PhdrSearch*)data;
+    (void)size;
+    if ((void*)info->dlpi_addr != s->base)
+    {
+        // dli_fbase is the lowest mapped address, which equals dlpi_addr for PIC objects
+        return 0;
+    }
+
+    uintptr_t relroStart = 0, relroEnd = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++)
+    {
+        if (info->dlpi_phdr[i].p_type == PT_GNU_RELRO)
+        {
+            relroStart = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+            relroEnd = relroStart + info->dlpi_phdr[i].p_memsz;
+        }
+    }
+
+    for (int i = 0; i < info->dlpi_phnum && s->layout->segCount < MAX_SEGMENTS; i++)
+    {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_W))
+            continue;
+        uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+        uintptr_t end = start + ph->p_memsz;
+        if (relroEnd > start && relroEnd < end)
+            start = relroEnd;   // RELRO part is read-only after relocation
+        else if (relroStart <= start && relroEnd >= end)
+            continue;
+        Segment* seg = &s->layout->segs[s->layout->segCount++];
+        seg->addr = (unsigned char*)start;
+        seg->size = end - start;
+        seg->snapshot = (unsigned char*)malloc(seg->size);
+    }
+    return 1;
+}
+
+static void InitLayout(int module)
+{
+    ModuleLayout* l = &g_layouts[module];
+    PhdrSearch s = { XlHostModuleBase(module), l };
+    long ls = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+
+    l->lineSize = ls > 0 ? (size_t)ls : 64;
+    dl_iterate_phdr(CollectSegments, &s);
+    for (int i = 0; i < l->segCount; i++)
+        l->lineCount += (l->segs[i].size + l->lineSize - 1) / l->lineSize;
+    if (l->lineCount > MAX_LINES)
+        l->lineCount = MAX_LINES;
+    l->written = (unsigned char*)calloc(l->lineCount ? l->lineCount : 1, 1);
+}
+
+static void Snapshot(int module)
+{
+    ModuleLayout* l = &g_layouts[module];
+    for (int i = 0; i < l->segCount; i++)
+        memcpy(l->segs[i].snapshot, l->segs[i].addr, l->segs[i].size);
+}
+
+static int MarkWritten(int module, const WCHAR* writer)
+{
+    ModuleLayout* l = &g_layouts[module];
+    size_t line = 0;
+    int found = 0;
+    for (int i = 0; i < l->segCount; i++)
+    {
+        Segment* seg = &l->segs[i];
+        for (size_t off = 0; off < seg->size; off += l->lineSize, line++)
+        {
+            size_t n = seg->size - off < l->lineSize ? seg->size - off : l->lineSize;
+            if (line >= l->lineCount)
+                return found;
+            if (memcmp(seg->addr + off, seg->snapshot + off, n) != 0)
+            {
+                if (!l->written[line])
+                    wcsncpy(l->writers[line], writer, _countof(l->writers[line]) - 1);
+                l->written[line] = 1;
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+/*
+** ELF symbol table of a module, used to name the globals on each cache line
+*/
+typedef struct DataSymbol
+{
+    uintptr_t addr;
+    size_t size;
+    char name[64];
+} DataSymbol;
+
+static int ReadDataSymbols(int module, DataSymbol* out, int cap)
+{
+    int fd = open(XlHostModulePath(module), O_RDONLY);
+    struct stat st;
+    int n = 0;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    unsigned char* img = (unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED)
+        return 0;
+
+    const ElfW(Ehdr)* eh = (const ElfW(Ehdr)*)img;
+    const ElfW(Shdr)* sh = (const ElfW(Shdr)*)(img + eh->e_shoff);
+    uintptr_t bias = (uintptr_t)XlHostModuleBase(module);
+
+    // Prefer the full symbol table (has static globals); fall back to dynsym
+    int symIndex = -1;
+    for (int i = 0; i < eh->e_shnum; i++)
+        if (sh[i].sh_type == SHT_SYMTAB)
+            symIndex = i;
+    if (symIndex < 0)
+        for (int i = 0; i < eh->e_shnum; i++)
+            if (sh[i].sh_type == SHT_DYNSYM)
+                symIndex = i;
+
+    if (symIndex >= 0)
+    {
+        const ElfW(Sym)* syms = (const ElfW(Sym)*)(img + sh[symIndex].sh_offset);
+        const char* strtab = (const char*)(img + sh[sh[symIndex].sh_link].sh_offset);
+        size_t count = sh[symIndex].sh_size / sizeof(ElfW(Sym));
+        for (size_t i = 0; i < count && n < cap; i++)
+        {
+            if (ELF64_ST_TYPE(syms[i].st_info) != STT_OBJECT || syms[i].st_shndx == SHN_UNDEF)
+                continue;
+            out[n].addr = bias + syms[i].st_value;
+            out[n].size = syms[i].st_size;
+            snprintf(out[n].name, sizeof(out[n].name), "%s", strtab + syms[i].st_name);
+            n++;
+        }
+    }
+    munmap(img, (size_t)st.st_size);
+    return n;
+}
+
+static void ReportSharing(int module)
+{
+    static DataSymbol syms[4096];
+    ModuleLayout* l = &g_layouts[module];
+    int nsyms = ReadDataSymbols(module, syms, (int)_countof(syms));
+    size_t line = 0;
+    int flagged = 0;
+
+    printf("\nShared cache lines in %s (line size %zu)\n", XlHostModulePath(module), l->lineSize);
+    for (int i = 0; i < l->segCount; i++)
+    {
+        Segment* seg = &l->segs[i];
+        for (size_t off = 0; off < seg->size && line < l->lineCount; off += l->lineSize, line++)
+        {
+            uintptr_t lo = (uintptr_t)(seg->addr + off) & ~(uintptr_t)(l->lineSize - 1);
+            uintptr_t hi = lo + l->lineSize;
+            char names[512] = "";
+            int symsOnLine = 0;
+            for (int s = 0; s < nsyms; s++)
+            {
+                uintptr_t end = syms[s].addr + (syms[s].size ? syms[s].size : 1);
+                if (syms[s].addr < hi && end > lo)
+                {
+                    size_t used = strlen(names);
+                    snprintf(names + used, sizeof(names) - used, "%s%s", symsOnLine ? ", " : "", syms[s].name);
+                    symsOnLine++;
+                }
+            }
+            if (!l->written[line])
+                continue;
+            flagged++;
+            printf("  %-14s line %#lx  written during MT run (first by %ls): %s\n",
+                symsOnLine > 1 ? "FALSE-SHARING" : "SHARED-WRITE",
+                (unsigned long)(lo - (uintptr_t)XlHostModuleBase(module)), l->writers[line],
+                symsOnLine ? names : "(no symbol: padding or compiler data)");
+        }
+    }
+    if (!flagged)
+        printf("  no writable line changed while several threads were running\n");
+
+    // Read-mostly globals that share a line with anything else are still worth seeing
+    printf("  Globals sharing a line with another global:\n");
+    for (int s = 0; s < nsyms; s++)
+    {
+        uintptr_t lo = syms[s].addr & ~(uintptr_t)(l->lineSize - 1);
+        int others = 0;
+        for (int t = 0; t < nsyms; t++)
+        {
+            uintptr_t tlo = syms[t].addr & ~(uintptr_t)(l->lineSize - 1);
+            if (t != s && tlo == lo)
+                others++;
+        }
+        if (others && (strncmp(syms[s].name, "g_", 2) == 0 || strstr(syms[s].name, "count") || strstr(syms[s].name, "Count")))
+            printf("    %-32s size %3zu  line %#lx (+%d others)\n", syms[s].name, syms[s].size,
+                (unsigned long)(lo - (uintptr_t)XlHostModuleBase(module)), others);
+    }
+}
+
+/*
+** Driver
+*/
+static void PrintRow(FILE* csv, const XlHostFunc* f, const SweepRow* r)
+{
+    double calls = (double)(r->stats.udfCalls ? r->stats.udfCalls : 1);
+    printf("  %3d  %10.2f  %12.0f  %7.2f  %6.1f%%  %6.1f%%  %6.1f%%  %6.1f%%  %6.1f%%  %8.2f  %8.2f\n",
+        r->threads, r->wallMs, r->callsPerSec, r->speedup, 100.0 * r->efficiency,
+        r->allocPct, r->callbackPct, r->lockPct, r->sleepPct,
+        (double)r->stats.allocCalls / calls, (double)r->stats.callbackCalls / calls);
+    if (csv)
+        fprintf(csv, "%ls,%ls,%d,%.3f,%.0f,%.3f,%.3f,%.2f,%.2f,%.2f,%.2f,%.3f,%.3f\n",
+            f->name, f->category, r->threads, r->wallMs, r->callsPerSec, r->speedup, r->efficiency,
+            r->allocPct, r->callbackPct, r->lockPct, r->sleepPct,
+            (double)r->stats.allocCalls / calls, (double)r->stats.callbackCalls / calls);
+}
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: ScalingSweep [--threads N] [--calls K] [--sleep-scale S] [--callback-ns NS]\n"
+                    "                    [--serialise-callbacks] [--filter TEXT] [--csv FILE] xll.so...\n");
+}
+
+int main(int argc, char** argv)
+{
+    SweepOptions opt = { 0, 20000, NULL, NULL };
+    FILE* csv = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    WCHAR filter[64] = L"";
+
+    g_xlHostConfig.sleepScale = 0.01;
+    opt.maxThreads = cpus > 4 ? (int)cpus : 4;
+
+    int a = 1;
+    for (; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.maxThreads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--sleep-scale") && a + 1 < argc) g_xlHostConfig.sleepScale = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--callback-ns") && a + 1 < argc) g_xlHostConfig.callbackCostNs = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--serialise-callbacks")) g_xlHostConfig.serialiseCallbacks = 1;
+        else if (!strcmp(argv[a], "--filter") && a + 1 < argc) opt.filter = argv[++a];
+        else if (!strcmp(argv[a], "--csv") && a + 1 < argc) opt.csvPath = argv[++a];
+        else { Usage(); return 2; }
+    }
+    if (a >= argc || opt.maxThreads < 1 || opt.calls < 1)
+    {
+        Usage();
+        return 2;
+    }
+    if (opt.maxThreads > MAX_THREADS)
+        opt.maxThreads = MAX_THREADS;
+    if (opt.filter)
+        mbstowcs(filter, opt.filter, _countof(filter) - 1);
+
+    for (; a < argc; a++)
+    {
+        int m = XlHostLoad(argv[a]);
+        if (m < 0)
+            return 1;
+        InitLayout(m);
+    }
+
+    if (opt.csvPath)
+    {
+        csv = fopen(opt.csvPath, "w");
+        if (csv)
+            fprintf(csv, "function,category,threads,wall_ms,calls_per_sec,speedup,efficiency,alloc_pct,callback_pct,lock_pct,sleep_pct,allocs_per_call,callbacks_per_call\n");
+    }
+
+    printf("ScalingSweep: %ld calls per run, 1..%d threads, %ld online CPUs, sleep scale %g, callback cost %ld ns%s\n",
+        opt.calls, opt.maxThreads, cpus, g_xlHostConfig.sleepScale, g_xlHostConfig.callbackCostNs,
+        g_xlHostConfig.serialiseCallbacks ? ", serialised callbacks" : "");
+
+    for (int i = 0; i < XlHostFuncCount(); i++)
+    {
+        const XlHostFunc* f = XlHostFuncAt(i);
+        if (filter[0] && !wcsstr(f->name, filter))
+            continue;
+
+        printf("\n%ls  [%ls] %ls  (%s)\n", f->name, f->typeText, f->category, XlHostModulePath(f->module));
+        if (!f->threadSafe)
+        {
+            printf("  not registered thread-safe ($): Excel runs it on the main thread only, skipped\n");
+            continue;
+        }
+        printf("  thr     wall_ms     calls/sec  speedup  effic.   alloc%%   callb%%   lock%%   sleep%%  allocs/c  callb/c\n");
+
+        double baseMs = 0.0;
+        for (int t = 1; t <= opt.maxThreads; t++)
+        {
+            g_xlHostConfig.multiThreadedCalc = t > 1;
+            if (t > 1)
+                Snapshot(f->module);
+            SweepRow r = RunOnce(f, t, opt.calls);
+            if (t > 1)
+                MarkWritten(f->module, f->name);
+            if (t == 1)
+                baseMs = r.wallMs;
+            r.speedup = r.wallMs > 0.0 ? baseMs / r.wallMs : 0.0;
+            r.efficiency = r.speedup / t;
+            PrintRow(csv, f, &r);
+        }
+        g_xlHostConfig.multiThreadedCalc = 0;
+    }
+
+    for (int m = 0; m < XlHostModuleCount(); m++)
+        ReportSharing(m);
+
+    if (csv)
+        fclose(csv);
+    XlHostUnloadAll();
+    return 0;
+}
@@ -0,0 +1,359 @@
+/*
+**  ThreadUsage
+**
+**  Exercises the calc-thread utilisation tracker (Common/ThreadUsage.c). A
+**  column of --cells cPiSeries cells is recalculated --cycles times on the
+**  same --threads threads, each recalc closed with xleventCalculationEnded. Cell
+**  i costs --terms x (1 + --skew x i / (cells - 1)) terms, so the bottom of
+**  the column is the expensive part. Two ways of sharing out the cells:
+**    static   thread t takes the t-th contiguous slice of the column
+**    shared   threads take the next cell from one counter, as Excel's calc
+**             chain does
+**  Each mode prints the cThreadUsageStats table and writes the CSV to
+**  --csv-dir. The static split should show one thread loaded well above 1
+**  with a long straggler tail, the shared one loads near 1.
+**
+**  Then --overhead-calls of cDoubleInner on one thread are timed with
+**  tracking off and on.
+**
+**  Finally a straggler check runs one recalc in which the thread in the
+**  lowest slot (the main one) starts its call only after another thread has
+**  returned and then returns last. Its tail must be measured from that other
+**  thread's return, not from its own start.
+**
+**  Usage: ThreadUsage [options] ThreadSafeC.so
+**    --threads T          calc threads (default 4)
+**    --cells N            cells per recalc (default 64)
+**    --terms N            terms of the cheapest cell (default 100000)
+**    --skew S             extra cost of the last cell, as a multiple (default 3)
+**    --cycles N           recalcs per mode (default 10)
+**    --csv-dir DIR        where the CSVs go (default /tmp)
+**    --overhead-calls N   calls timed for the overhead (default 1000000)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 64
+
+typedef struct UsageOptions
+{
+    const char* xll;
+    int    threads;
+    int    cells;
+    double terms;
+    double skew;
+    int    cycles;
+    const char* csvDir;
+    int    overheadCalls;
+} UsageOptions;
+
+typedef struct UsageThread
+{
+    pthread_t thread;
+    const UsageOptions* opt;
+    int index;
+    int shared;
+} UsageThread;
+
+static const XlHostFunc* g_series;
+static const XlHostFunc* g_usage;
+static int g_module;
+static volatile LONG g_nextCell;
+static pthread_barrier_t g_start, g_done;   // Around each recalc, with the main thread
+static volatile int g_stop;
+
+static void RunCell(const UsageOptions* opt, int cell)
+{
+    XLOPER12 a[3], res;
+    LPXLOPER12 args[3] = { &a[0], &a[1], &a[2] };
+    double share = opt->cells > 1 ? (double)cell / (opt->cells - 1) : 0.0;
+
+    XlHostSetNum(&a[0], opt->terms * (1.0 + opt->skew * share));
+    XlHostSetNum(&a[1], 0.0);
+    XlHostSetNum(&a[2], 0.0);
+    XlHostCall(g_series, 3, args, &res);
+    XlHostFreeResult(&res);
+}
+
+static void* CalcMain(void* arg)
+{
+    UsageThread* t = (UsageThread*)arg;
+    const UsageOptions* opt = t->opt;
+    int first = (int)((long long)opt->cells * t->index / opt->threads);
+    int last = (int)((long long)opt->cells * (t->index + 1) / opt->threads);
+    int cell;
+
+    for (;;)
+    {
+        pthread_barrier_wait(&g_start);
+        if (g_stop)
+            break;
+        if (t->shared)
+        {
+            while ((cell = (int)__atomic_fetch_add(&g_nextCell, 1, __ATOMIC_RELAXED)) < opt->cells)
+                RunCell(opt, cell);
+        }
+        else
+        {
+            for (cell = first; cell < last; cell++)
+                RunCell(opt, cell);
+        }
+        pthread_barrier_wait(&g_done);
+    }
+    return NULL;
+}
+
+// cThreadUsage(path): starts tracking, or with an empty path stops and returns the CSV rows
+static double Usage(const WCHAR* path)
+{
+    XLOPER12 a, res;
+    LPXLOPER12 args[1] = { &a };
+    double value;
+
+    XlHostSetStr(&a, path);
+    XlHostCall(g_usage, 1, args, &res);
+    value = (res.xltype & xltypeNum) == xltypeNum ? res.val.num : (res.xltype & xltypeBool) ? res.val.xbool : -1.0;
+    XlHostFreeResult(&res);
+    XlHostFreeResult(&a);
+    return value;
+}
+
+static void PrintTable(void)
+{
+    const XlHostFunc* stats = XlHostFindFunc(g_module, L"cThreadUsageStats");
+    XLOPER12 a, res;
+    LPXLOPER12 args[1] = { &a };
+    int r, c;
+
+    XlHostSetNum(&a, 0.0);
+    if (!stats || XlHostCall(stats, 1, args, &res) != xlretSuccess)
+        return;
+    if ((res.xltype & xltypeMulti) == xltypeMulti)
+    {
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            for (c = 0; c < res.val.array.columns; c++)
+            {
+                LPXLOPER12 x = &res.val.array.lparray[r * res.val.array.columns + c];
+                if (x->xltype & xltypeStr)
+                    printf(c == 10 ? " %-16.*ls" : " %11.*ls", (int)x->val.str[0], &x->val.str[1]);
+                else if (c == 0 || c == 1 || c == 2 || c == 11)
+                    printf(" %11.0f", x->val.num);
+                else
+                    printf(c == 10 ? " %-16.3f" : " %11.3f", x->val.num);
+            }
+            printf("\n");
+        }
+    }
+    XlHostFreeResult(&res);
+}
+
+static void RunMode(const UsageOptions* opt, int shared)
+{
+    UsageThread threads[MAX_THREADS];
+    WCHAR path[MAX_PATH];
+    ULONGLONG t0;
+    double rows;
+    int cycle, t;
+
+    swprintf(path, MAX_PATH, L"%s/ThreadUsage-%s.csv", opt->csvDir, shared ? "shared" : "static");
+    Usage(L"");
+    if (Usage(path) != 1.0)
+    {
+        fprintf(stderr, "ThreadUsage: cannot start tracking\n");
+        return;
+    }
+    pthread_barrier_init(&g_start, NULL, (unsigned)opt->threads + 1);
+    pthread_barrier_init(&g_done, NULL, (unsigned)opt->threads + 1);
+    g_stop = 0;
+    for (t = 0; t < opt->threads; t++)
+    {
+        threads[t].opt = opt;
+        threads[t].index = t;
+        threads[t].shared = shared;
+        pthread_create(&threads[t].thread, NULL, CalcMain, &threads[t]);
+    }
+    t0 = XlHostNowNs();
+    for (cycle = 0; cycle < opt->cycles; cycle++)
+    {
+        g_nextCell = 0;
+        pthread_barrier_wait(&g_start);
+        pthread_barrier_wait(&g_done);
+        XlHostFireEvent(xleventCalculationEnded);
+    }
+    g_stop = 1;
+    pthread_barrier_wait(&g_start);
+    for (t = 0; t < opt->threads; t++)
+        pthread_join(threads[t].thread, NULL);
+    pthread_barrier_destroy(&g_start);
+    pthread_barrier_destroy(&g_done);
+    printf("\n%s: %d recalcs in %.1f ms\n", shared ? "shared" : "static", opt->cycles, (double)(XlHostNowNs() - t0) / 1e6);
+    PrintTable();
+    rows = Usage(L"");
+    printf("%.0f CSV rows in %ls\n", rows, path);
+    fflush(stdout);
+}
+
+static void* ShortCallMain(void* arg)
+{
+    ULONGLONG* returned = (ULONGLONG*)arg;
+    XLOPER12 a[3], res;
+    LPXLOPER12 args[3] = { &a[0], &a[1], &a[2] };
+
+    XlHostSetNum(&a[0], 1000.0);
+    XlHostSetNum(&a[1], 0.0);
+    XlHostSetNum(&a[2], 0.0);
+    XlHostCall(g_series, 3, args, &res);
+    *returned = XlHostNowNs();
+    XlHostFreeResult(&res);
+    return NULL;
+}
+
+// The TailMs of the last recalc, from the All row of cThreadUsageStats(1)
+static double LastTailMs(void)
+{
+    const XlHostFunc* stats = XlHostFindFunc(g_module, L"cThreadUsageStats");
+    XLOPER12 a, res;
+    LPXLOPER12 args[1] = { &a };
+    double tail = -1.0;
+    int n;
+
+    XlHostSetNum(&a, 1.0);
+    if (!stats || XlHostCall(stats, 1, args, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti && res.val.array.columns == 13)
+    {
+        n = res.val.array.rows * res.val.array.columns;
+        tail = res.val.array.lparray[n - 1].val.num;
+    }
+    XlHostFreeResult(&res);
+    return tail;
+}
+
+// One recalc: another thread's short call, a pause, then the main thread's long call
+static void StragglerCheck(const UsageOptions* opt)
+{
+    WCHAR path[MAX_PATH];
+    pthread_t other;
+    ULONGLONG otherReturned = 0, mainReturned;
+    XLOPER12 a[3], res;
+    LPXLOPER12 args[3] = { &a[0], &a[1], &a[2] };
+    double tail, expected;
+
+    swprintf(path, MAX_PATH, L"%s/ThreadUsage-straggler.csv", opt->csvDir);
+    Usage(L"");
+    if (Usage(path) != 1.0)
+        return;
+    XlHostSetNum(&a[0], 1000.0);
+    XlHostSetNum(&a[1], 0.0);
+    XlHostSetNum(&a[2], 0.0);
+    XlHostCall(g_series, 3, args, &res);    // Gives the main thread its slot before the other thread
+    XlHostFreeResult(&res);
+    XlHostFireEvent(xleventCalculationEnded);
+
+    pthread_create(&other, NULL, ShortCallMain, &otherReturned);
+    pthread_join(other, NULL);
+    usleep(20000);
+    XlHostSetNum(&a[0], opt->terms * 100.0);
+    XlHostCall(g_series, 3, args, &res);
+    mainReturned = XlHostNowNs();
+    XlHostFreeResult(&res);
+    XlHostFireEvent(xleventCalculationEnded);
+    tail = LastTailMs();
+    expected = (double)(mainReturned - otherReturned) / 1e6;
+    Usage(L"");
+    printf("\nstraggler check: tail %.1f ms, main thread returned %.1f ms after the other, match %s\n", tail,
+        expected, fabs(tail - expected) < 0.05 * expected + 1.0 ? "yes" : "NO");
+}
+
+// ns per cDoubleInner call on one thread
+static double TimeCalls(int calls)
+{
+    const XlHostFunc* inner = XlHostFindFunc(g_module, L"cDoubleInner");
+    XLOPER12 a[2], res;
+    LPXLOPER12 args[2] = { &a[0], &a[1] };
+    ULONGLONG t0;
+    int i;
+
+    if (!inner)
+        return -1.0;
+    XlHostSetNum(&a[0], 1.0);
+    XlHostSetNum(&a[1], 2.0);
+    t0 = XlHostNowNs();
+    for (i = 0; i < calls; i++)
+    {
+        XlHostCall(inner, 2, args, &res);
+        XlHostFreeResult(&res);
+    }
+    return (double)(XlHostNowNs() - t0) / calls;
+}
+
+int main(int argc, char** argv)
+{
+    UsageOptions opt = { NULL, 4, 64, 100000.0, 3.0, 10, "/tmp", 1000000 };
+    double off, on;
+    WCHAR path[MAX_PATH];
+    int a;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--cells") && a + 1 < argc) opt.cells = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--terms") && a + 1 < argc) opt.terms = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--skew") && a + 1 < argc) opt.skew = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--cycles") && a + 1 < argc) opt.cycles = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--csv-dir") && a + 1 < argc) opt.csvDir = argv[++a];
+        else if (!strcmp(argv[a], "--overhead-calls") && a + 1 < argc) opt.overheadCalls = atoi(argv[++a]);
+        else
+        {
+            fprintf(stderr, "ThreadUsage: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: ThreadUsage [--threads T] [--cells N] [--terms N] [--skew S] [--cycles N] [--csv-dir DIR] [--overhead-calls N] ThreadSafeC.so\n");
+        return 2;
+    }
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+    if (opt.cells < 1) opt.cells = 1;
+    if (opt.cycles < 1) opt.cycles = 1;
+    if (opt.overheadCalls < 1) opt.overheadCalls = 1;
+
+    g_module = XlHostLoad(opt.xll);
+    if (g_module < 0)
+        return 1;
+    g_series = XlHostFindFunc(g_module, L"cPiSeries");
+    g_usage = XlHostFindFunc(g_module, L"cThreadUsage");
+    if (!g_series || !g_usage)
+    {
+        fprintf(stderr, "ThreadUsage: %s does not register cPiSeries and cThreadUsage\n", opt.xll);
+        return 1;
+    }
+
+    printf("%d threads, %d cells of %.0f to %.0f terms, %d recalcs\n", opt.threads, opt.cells, opt.terms,
+        opt.terms * (1.0 + opt.skew), opt.cycles);
+    RunMode(&opt, 0);
+    RunMode(&opt, 1);
+
+    swprintf(path, MAX_PATH, L"%s/ThreadUsage-overhead.csv", opt.csvDir);
+    Usage(L"");
+    off = TimeCalls(opt.overheadCalls);
+    Usage(path);
+    on = TimeCalls(opt.overheadCalls);
+    Usage(L"");
+    printf("\ncDoubleInner: %.1f ns/call untracked, %.1f ns/call tracked\n", off, on);
+    StragglerCheck(&opt);
+    XlHostUnloadAll();
+    return 0;
+}
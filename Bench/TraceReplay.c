@@ -0,0 +1,515 @@
+/*
+**  TraceReplay
+**
+**  Re-executes a call trace written by Common/CallTrace.c against the XLLs
+**  loaded in the XlHost stand-in. Only calls Excel made (depth 0) are
+**  replayed; nested xlUDF calls happen again by themselves.
+**
+**  By default every recorded thread gets a replay thread that issues that
+**  thread's calls in recorded order, back to back (or at their recorded start
+**  offsets with --timing). --threads N instead hands the calls, in start
+**  order, to N threads from a shared queue, to see how the same workload
+**  would behave with a different calc thread count.
+**
+**  Usage: TraceReplay [options] TRACE.xltrace ThreadSafeC.so [MultithreadCrash.so]
+**    --threads N        replay on N threads from a shared queue (default: as recorded)
+**    --timing           keep recorded start offsets (per-thread mode only)
+**    --sleep-scale S    multiplier for Sleep() inside UDFs (default 1.0)
+**    --repeat R         replay R times (default 1)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "XlHost.h"
+#include "../Common/CallTrace.h"
+
+#define MAX_THREADS   256
+#define MAX_FUNCS     256
+
+typedef struct ReplayCall
+{
+    UINT32 thread;
+    int    fn;
+    UINT64 start;               // Recorded ticks since trace start
+    UINT64 end;
+    int    argCount;
+    LPXLOPER12 args;
+} ReplayCall;
+
+typedef struct ReplayTrace
+{
+    double ticksPerSecond;
+    WCHAR  module[64];
+    int    funcCount;
+    WCHAR  names[MAX_FUNCS][64];
+    const XlHostFunc* funcs[MAX_FUNCS];
+    ReplayCall* calls;          // Depth-0 calls sorted by start
+    long   callCount;
+    long   nestedCount;
+} ReplayTrace;
+
+typedef struct FuncTotals
+{
+    ULONGLONG calls;
+    ULONGLONG replayNs;
+    double    recordedNs;
+} FuncTotals;
+
+typedef struct ReplayWorker
+{
+    pthread_t thread;
+    const ReplayTrace* trace;
+    UINT32 recordedThread;      // Per-thread mode: calls of this recorded thread
+    int    timing;
+    volatile long* next;        // Shared-queue mode: next call index
+    ULONGLONG startNs;
+    FuncTotals totals[MAX_FUNCS];
+} ReplayWorker;
+
+/*
+** Trace file reading
+*/
+typedef struct Reader
+{
+    const BYTE* p;
+    const BYTE* end;
+    int bad;
+} Reader;
+
+static void Get(Reader* r, void* out, size_t bytes)
+{
+    if (r->bad || (size_t)(r->end - r->p) < bytes)
+    {
+        r->bad = 1;
+        memset(out, 0, bytes);
+        return;
+    }
+    memcpy(out, r->p, bytes);
+    r->p += bytes;
+}
+
+static void GetString(Reader* r, WCHAR* out, size_t capacity)
+{
+    UINT16 n, c, i;
+    Get(r, &n, sizeof(n));
+    for (i = 0; i < n; i++)
+    {
+        Get(r, &c, sizeof(c));
+        if (i + 1u < capacity)
+            out[i] = (WCHAR)c;
+    }
+    out[n < capacity ? n : capacity - 1] = 0;
+}
+
+static void ReadArg(Reader* r, LPXLOPER12 x, int allowMulti)
+{
+    BYTE tag = 0;
+    Get(r, &tag, 1);
+    switch (tag)
+    {
+    case CALLTRACE_ARG_NUM:
+        XlHostSetNum(x, 0.0);
+        Get(r, &x->val.num, sizeof(double));
+        break;
+    case CALLTRACE_ARG_BOOL:
+        {
+            UINT8 b;
+            Get(r, &b, 1);
+            x->xltype = xltypeBool;
+            x->val.xbool = b;
+        }
+        break;
+    case CALLTRACE_ARG_ERR:
+        {
+            INT32 e;
+            Get(r, &e, sizeof(e));
+            x->xltype = xltypeErr;
+            x->val.err = e;
+        }
+        break;
+    case CALLTRACE_ARG_STR:
+        {
+            UINT16 n, c, i;
+            WCHAR* s;
+            Get(r, &n, sizeof(n));
+            s = (WCHAR*)malloc((n + 1) * sizeof(WCHAR));
+            for (i = 0; i < n; i++)
+            {
+                Get(r, &c, sizeof(c));
+                s[i] = (WCHAR)c;
+            }
+            s[n] = 0;
+            XlHostSetStr(x, s);
+            free(s);
+        }
+        break;
+    case CALLTRACE_ARG_NIL:
+        x->xltype = xltypeNil;
+        break;
+    case CALLTRACE_ARG_MULTI:
+        if (allowMulti)
+        {
+            UINT32 rows, columns, i;
+            Get(r, &rows, sizeof(rows));
+            Get(r, &columns, sizeof(columns));
+            if (r->bad || (UINT64)rows * columns > (UINT64)(r->end - r->p))
+            {
+                r->bad = 1;
+                x->xltype = xltypeMissing;
+                break;
+            }
+            x->xltype = xltypeMulti;
+            x->val.array.rows = (int)rows;
+            x->val.array.columns = (int)columns;
+            x->val.array.lparray = (LPXLOPER12)calloc((size_t)rows * columns + 1, sizeof(XLOPER12));
+            for (i = 0; i < rows * columns; i++)
+                ReadArg(r, &x->val.array.lparray[i], 0);
+            break;
+        }
+        r->bad = 1;
+        x->xltype = xltypeMissing;
+        break;
+    case CALLTRACE_ARG_MISSING:
+    case CALLTRACE_ARG_OTHER:
+        x->xltype = xltypeMissing;
+        break;
+    default:
+        r->bad = 1;
+        x->xltype = xltypeMissing;
+        break;
+    }
+}
+
+static int CompareStart(const void* a, const void* b)
+{
+    const ReplayCall* x = (const ReplayCall*)a;
+    const ReplayCall* y = (const ReplayCall*)b;
+    return x->start < y->start ? -1 : x->start > y->start ? 1 : 0;
+}
+
+static int LoadTrace(const char* path, ReplayTrace* t)
+{
+    FILE* f = fopen(path, "rb");
+    BYTE* data;
+    long size, capacity = 1024;
+    Reader r;
+    UINT32 magic, version, count;
+    UINT64 ticksPerSecond, startTicks;
+    WCHAR type[32];
+    int i;
+
+    if (!f)
+    {
+        fprintf(stderr, "TraceReplay: cannot open %s\n", path);
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (BYTE*)malloc(size ? size : 1);
+    if (fread(data, 1, size, f) != (size_t)size)
+        size = 0;
+    fclose(f);
+
+    r.p = data;
+    r.end = data + size;
+    r.bad = 0;
+    Get(&r, &magic, sizeof(magic));
+    Get(&r, &version, sizeof(version));
+    if (magic != CALLTRACE_MAGIC || version != CALLTRACE_VERSION)
+    {
+        fprintf(stderr, "TraceReplay: %s is not a version %d call trace\n", path, CALLTRACE_VERSION);
+        return 0;
+    }
+    Get(&r, &ticksPerSecond, sizeof(ticksPerSecond));
+    Get(&r, &startTicks, sizeof(startTicks));
+    Get(&r, &count, sizeof(count));
+    GetString(&r, t->module, _countof(t->module));
+    t->ticksPerSecond = ticksPerSecond ? (double)ticksPerSecond : 1.0;
+    t->funcCount = count < MAX_FUNCS ? (int)count : MAX_FUNCS;
+    for (i = 0; i < (int)count; i++)
+    {
+        if (i < MAX_FUNCS)
+            GetString(&r, t->names[i], _countof(t->names[i]));
+        else
+            GetString(&r, type, _countof(type));
+        GetString(&r, type, _countof(type));
+    }
+
+    t->calls = (ReplayCall*)malloc(capacity * sizeof(ReplayCall));
+    t->callCount = 0;
+    t->nestedCount = 0;
+    while (!r.bad && r.p < r.end)
+    {
+        UINT32 bytes;
+        Reader chunk;
+        Get(&r, &bytes, sizeof(bytes));
+        if (r.bad || bytes > (size_t)(r.end - r.p))
+            break;
+        chunk.p = r.p;
+        chunk.end = r.p + bytes;
+        chunk.bad = 0;
+        r.p += bytes;
+
+        while (!chunk.bad && chunk.p < chunk.end)
+        {
+            CallTraceEntry rec;
+            ReplayCall call;
+            Get(&chunk, &rec, sizeof(rec));
+            call.thread = rec.thread;
+            call.fn = rec.fn;
+            call.start = rec.start;
+            call.end = rec.end;
+            call.argCount = rec.argCount;
+            call.args = (LPXLOPER12)calloc(rec.argCount + 1, sizeof(XLOPER12));
+            for (i = 0; i < rec.argCount; i++)
+                ReadArg(&chunk, &call.args[i], 1);
+            if (chunk.bad)
+                break;
+            if (rec.depth != 0 || rec.fn >= t->funcCount)
+            {
+                t->nestedCount++;
+                continue;
+            }
+            if (t->callCount == capacity)
+            {
+                capacity *= 2;
+                t->calls = (ReplayCall*)realloc(t->calls, capacity * sizeof(ReplayCall));
+            }
+            t->calls[t->callCount++] = call;
+        }
+        if (chunk.bad)
+            fprintf(stderr, "TraceReplay: truncated record in %s, ignoring the rest of its chunk\n", path);
+    }
+    free(data);
+    qsort(t->calls, t->callCount, sizeof(ReplayCall), CompareStart);
+    return 1;
+}
+
+/*
+** Replay
+*/
+static void ReplayOne(ReplayWorker* w, const ReplayCall* call)
+{
+    const XlHostFunc* func = w->trace->funcs[call->fn];
+    LPXLOPER12 args[XLHOST_MAX_ARGS];
+    XLOPER12 res;
+    ULONGLONG t0;
+    int i, n = call->argCount < XLHOST_MAX_ARGS ? call->argCount : XLHOST_MAX_ARGS;
+
+    if (!func)
+        return;
+    if (n > func->argCount)
+        n = func->argCount;
+    for (i = 0; i < n; i++)
+        args[i] = &call->args[i];
+
+    t0 = XlHostNowNs();
+    XlHostCall(func, n, args, &res);
+    w->totals[call->fn].replayNs += XlHostNowNs() - t0;
+    w->totals[call->fn].calls++;
+    w->totals[call->fn].recordedNs += (double)(call->end - call->start) * 1e9 / w->trace->ticksPerSecond;
+    XlHostFreeResult(&res);
+}
+
+static void* WorkerMain(void* arg)
+{
+    ReplayWorker* w = (ReplayWorker*)arg;
+    const ReplayTrace* t = w->trace;
+    long i;
+
+    if (w->next)
+    {
+        while ((i = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) < t->callCount)
+            ReplayOne(w, &t->calls[i]);
+        return NULL;
+    }
+
+    for (i = 0; i < t->callCount; i++)
+    {
+        const ReplayCall* call = &t->calls[i];
+        if (call->thread != w->recordedThread)
+            continue;
+        if (w->timing)
+        {
+            ULONGLONG due = w->startNs + (ULONGLONG)((double)call->start * 1e9 / t->ticksPerSecond);
+            ULONGLONG now = XlHostNowNs();
+            if (due > now)
+                usleep((useconds_t)((due - now) / 1000));
+        }
+        ReplayOne(w, call);
+    }
+    return NULL;
+}
+
+// Returns the replay wall time in ns and adds per-function totals into sum
+static ULONGLONG ReplayOnce(const ReplayTrace* t, int threads, int timing, FuncTotals* sum)
+{
+    static ReplayWorker workers[MAX_THREADS];
+    UINT32 recorded[MAX_THREADS];
+    volatile long next = 0;
+    int count = 0, w, f;
+    long i;
+    ULONGLONG t0, t1;
+
+    if (threads > 0)
+    {
+        count = threads;
+    }
+    else
+    {
+        for (i = 0; i < t->callCount; i++)
+        {
+            for (w = 0; w < count && recorded[w] != t->calls[i].thread; w++)
+                ;
+            if (w == count && count < MAX_THREADS)
+                recorded[count++] = t->calls[i].thread;
+        }
+    }
+
+    t0 = XlHostNowNs();
+    for (w = 0; w < count; w++)
+    {
+        memset(&workers[w], 0, sizeof(workers[w]));
+        workers[w].trace = t;
+        workers[w].timing = timing;
+        workers[w].next = threads > 0 ? &next : NULL;
+        workers[w].recordedThread = threads > 0 ? 0 : recorded[w];
+        workers[w].startNs = t0;
+        pthread_create(&workers[w].thread, NULL, WorkerMain, &workers[w]);
+    }
+    for (w = 0; w < count; w++)
+        pthread_join(workers[w].thread, NULL);
+    t1 = XlHostNowNs();
+    XlHostFireEvent(xleventCalculationEnded);
+
+    for (w = 0; w < count; w++)
+    {
+        for (f = 0; f < t->funcCount; f++)
+        {
+            sum[f].calls += workers[w].totals[f].calls;
+            sum[f].replayNs += workers[w].totals[f].replayNs;
+            sum[f].recordedNs += workers[w].totals[f].recordedNs;
+        }
+    }
+    return t1 - t0;
+}
+
+static int RecordedThreadCount(const ReplayTrace* t)
+{
+    UINT32 seen[MAX_THREADS];
+    int count = 0, w;
+    long i;
+    for (i = 0; i < t->callCount; i++)
+    {
+        for (w = 0; w < count && seen[w] != t->calls[i].thread; w++)
+            ;
+        if (w == count && count < MAX_THREADS)
+            seen[count++] = t->calls[i].thread;
+    }
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    static ReplayTrace trace;
+    static FuncTotals totals[MAX_FUNCS];
+    const char* tracePath = NULL;
+    char moduleName[64];
+    int threads = 0, timing = 0, repeat = 1, a, m, f, rep, missingFuncs = 0;
+    double sleepScale = 1.0, spanNs, busyNs = 0.0;
+    UINT64 maxEnd = 0;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--threads") && a + 1 < argc) threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--timing")) timing = 1;
+        else if (!strcmp(argv[a], "--sleep-scale") && a + 1 < argc) sleepScale = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--repeat") && a + 1 < argc) repeat = atoi(argv[++a]);
+        else
+        {
+            fprintf(stderr, "TraceReplay: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (argc - a < 2)
+    {
+        fprintf(stderr, "usage: TraceReplay [--threads N] [--timing] [--sleep-scale S] [--repeat R]\n"
+                        "                   TRACE.xltrace XLL.so [XLL.so ...]\n");
+        return 2;
+    }
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (repeat < 1) repeat = 1;
+
+    tracePath = argv[a++];
+    if (!LoadTrace(tracePath, &trace))
+        return 1;
+
+    // Replaying must not record a new trace over the one being read
+    unsetenv("XLL_CALL_TRACE");
+    g_xlHostConfig.sleepScale = sleepScale;
+    for (; a < argc; a++)
+        XlHostLoad(argv[a]);
+
+    // Resolve functions in the module the trace came from (cDoubleInner is in both XLLs)
+    wcstombs(moduleName, trace.module, sizeof(moduleName));
+    moduleName[sizeof(moduleName) - 1] = 0;
+    for (m = 0; m < XlHostModuleCount() && !strstr(XlHostModulePath(m), moduleName); m++)
+        ;
+    if (m == XlHostModuleCount())
+    {
+        fprintf(stderr, "TraceReplay: trace was recorded in %s, which is not loaded\n", moduleName);
+        return 1;
+    }
+    for (f = 0; f < trace.funcCount; f++)
+    {
+        trace.funcs[f] = XlHostFindFunc(m, trace.names[f]);
+        if (trace.funcs[f] && trace.funcs[f]->module != m)
+            trace.funcs[f] = NULL;
+    }
+
+    for (long i = 0; i < trace.callCount; i++)
+    {
+        if (trace.calls[i].end > maxEnd)
+            maxEnd = trace.calls[i].end;
+        busyNs += (double)(trace.calls[i].end - trace.calls[i].start) * 1e9 / trace.ticksPerSecond;
+        if (!trace.funcs[trace.calls[i].fn])
+            missingFuncs++;
+    }
+    spanNs = trace.callCount ? (double)(maxEnd - trace.calls[0].start) * 1e9 / trace.ticksPerSecond : 0.0;
+
+    printf("%s: %ls, %ld calls from Excel (%ld nested skipped) on %d threads\n",
+        tracePath, trace.module, trace.callCount, trace.nestedCount, RecordedThreadCount(&trace));
+    printf("recorded  span %10.2f ms   busy %10.2f ms\n", spanNs / 1e6, busyNs / 1e6);
+    if (missingFuncs)
+        printf("warning: %d calls name functions %s does not register; they are skipped\n", missingFuncs, moduleName);
+
+    for (rep = 0; rep < repeat; rep++)
+    {
+        ULONGLONG wallNs = ReplayOnce(&trace, threads, timing && threads == 0, totals);
+        if (threads > 0)
+            printf("replay %d  wall %10.2f ms   %d threads, shared queue\n", rep + 1, (double)wallNs / 1e6, threads);
+        else
+            printf("replay %d  wall %10.2f ms   as recorded%s\n", rep + 1, (double)wallNs / 1e6, timing ? ", recorded start times" : "");
+        fflush(stdout);
+    }
+
+    printf("\n%-32s %10s %14s %14s %8s\n", "function", "calls", "recorded_us", "replay_us", "ratio");
+    for (f = 0; f < trace.funcCount; f++)
+    {
+        double recordedUs, replayUs;
+        if (!totals[f].calls)
+            continue;
+        recordedUs = totals[f].recordedNs / (double)totals[f].calls / 1e3;
+        replayUs = (double)totals[f].replayNs / (double)totals[f].calls / 1e3;
+        printf("%-32ls %10llu %14.2f %14.2f %8.2f\n", trace.names[f], totals[f].calls / repeat,
+            recordedUs, replayUs, recordedUs > 0.0 ? replayUs / recordedUs : 0.0);
+    }
+
+    XlHostUnloadAll();
+    return 0;
+}
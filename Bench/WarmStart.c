@@ -0,0 +1,224 @@
+/*
+**  WarmStart
+**
+**  Measures what the persistent result cache (Common/ResultCache.c) saves on
+**  restart. Each phase runs in a fresh process, as a restarted Excel would:
+**    no-cache  XLL_RESULT_CACHE unset, every call computes
+**    cold      cache file deleted first, every distinct call computes and stores
+**    warm      same file again, xlAutoOpen maps and pre-faults it, calls hit
+**  A phase loads the XLL (timing xlAutoOpen), then "recalculates": the calls
+**  are split across threads and cycle through a fixed set of argument pairs.
+**
+**  Usage: WarmStart [options] MultithreadCrash.so
+**    --function NAME    UDF to call, two number arguments (default cDoubleInner)
+**    --calls N          calls per recalc (default 2000)
+**    --distinct D       distinct argument pairs (default 500)
+**    --threads T        recalc threads (default 4)
+**    --sleep-scale S    multiplier for Sleep() inside UDFs (default 0.01)
+**    --cache FILE       cache file (default /tmp/XllResultCache.bin)
+**    --restarts R       warm phases to run (default 1)
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 64
+
+typedef struct WarmOptions
+{
+    const char* xll;
+    const char* function;
+    const char* cache;
+    long   calls;
+    long   distinct;
+    int    threads;
+    int    restarts;
+    double sleepScale;
+} WarmOptions;
+
+typedef struct WarmWorker
+{
+    pthread_t thread;
+    const XlHostFunc* func;
+    const WarmOptions* opt;
+    int index;
+} WarmWorker;
+
+static void* WorkerMain(void* arg)
+{
+    WarmWorker* w = (WarmWorker*)arg;
+    long i;
+
+    for (i = w->index; i < w->opt->calls; i += w->opt->threads)
+    {
+        XLOPER12 x, y, res;
+        LPXLOPER12 args[2] = { &x, &y };
+        long k = i % w->opt->distinct;
+        XlHostSetNum(&x, (double)k);
+        XlHostSetNum(&y, 0.5);
+        XlHostCall(w->func, 2, args, &res);
+        XlHostFreeResult(&res);
+    }
+    return NULL;
+}
+
+// Reads one counter from the mcResultCacheStats table, -1 if unavailable
+static double CacheCounter(int module, const WCHAR* name)
+{
+    const XlHostFunc* stats = XlHostFindFunc(module, L"mcResultCacheStats");
+    XLOPER12 res;
+    double value = -1.0;
+    int r;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return value;
+    if ((res.xltype & xltypeMulti) == xltypeMulti)
+    {
+        for (r = 0; r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * 2];
+            LPXLOPER12 val = &res.val.array.lparray[r * 2 + 1];
+            if ((key->xltype & xltypeStr) && (size_t)key->val.str[0] == wcslen(name)
+                && wcsncmp(&key->val.str[1], name, key->val.str[0]) == 0 && (val->xltype & xltypeNum))
+                value = val->val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+// Runs inside the child process: load, recalc, print one result line
+static int RunPhase(const WarmOptions* opt, const char* phase)
+{
+    WarmWorker workers[MAX_THREADS];
+    WCHAR name[64];
+    const XlHostFunc* func;
+    ULONGLONG t0, t1, t2;
+    int module, t;
+
+    g_xlHostConfig.sleepScale = opt->sleepScale;
+    t0 = XlHostNowNs();
+    module = XlHostLoad(opt->xll);
+    t1 = XlHostNowNs();
+    if (module < 0)
+        return 1;
+
+    mbstowcs(name, opt->function, _countof(name));
+    func = XlHostFindFunc(module, name);
+    if (!func || func->argCount != 2)
+    {
+        fprintf(stderr, "WarmStart: %s does not register a two-argument %s\n", opt->xll, opt->function);
+        return 1;
+    }
+
+    for (t = 0; t < opt->threads; t++)
+    {
+        workers[t].func = func;
+        workers[t].opt = opt;
+        workers[t].index = t;
+        pthread_create(&workers[t].thread, NULL, WorkerMain, &workers[t]);
+    }
+    for (t = 0; t < opt->threads; t++)
+        pthread_join(workers[t].thread, NULL);
+    t2 = XlHostNowNs();
+    XlHostFireEvent(xleventCalculationEnded);
+
+    printf("%-9s %9.2f %10.1f %7ld %7.0f %7.0f %7.0f %8.0f\n", phase,
+        (double)(t1 - t0) / 1e6, (double)(t2 - t1) / 1e6, opt->calls,
+        CacheCounter(module, L"Hits"), CacheCounter(module, L"Misses"),
+        CacheCounter(module, L"Stores"), CacheCounter(module, L"WarmEntries"));
+    fflush(stdout);
+    XlHostUnloadAll();
+    return 0;
+}
+
+// Re-runs this executable for one phase so each phase is a separate process
+static void SpawnPhase(char** argv, const WarmOptions* opt, const char* phase)
+{
+    pid_t pid = fork();
+    int status = 0;
+
+    if (pid == 0)
+    {
+        if (strcmp(phase, "no-cache") == 0)
+            unsetenv("XLL_RESULT_CACHE");
+        else
+            setenv("XLL_RESULT_CACHE", opt->cache, 1);
+        execl("/proc/self/exe", argv[0], "--phase", phase, NULL);
+        _exit(127);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "WarmStart: %s phase failed (status %d)\n", phase, status);
+}
+
+int main(int argc, char** argv)
+{
+    WarmOptions opt = { NULL, "cDoubleInner", "/tmp/XllResultCache.bin", 2000, 500, 4, 1, 0.01 };
+    const char* phase = NULL;
+    char buf[32];
+    int a, r;
+
+    // Child processes get the options through the environment
+    if (getenv("WARMSTART_OPTS"))
+    {
+        sscanf(getenv("WARMSTART_OPTS"), "%ld %ld %d %lf", &opt.calls, &opt.distinct, &opt.threads, &opt.sleepScale);
+        opt.function = getenv("WARMSTART_FUNC");
+        opt.xll = getenv("WARMSTART_XLL");
+    }
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--function") && a + 1 < argc) opt.function = argv[++a];
+        else if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--distinct") && a + 1 < argc) opt.distinct = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--sleep-scale") && a + 1 < argc) opt.sleepScale = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--cache") && a + 1 < argc) opt.cache = argv[++a];
+        else if (!strcmp(argv[a], "--restarts") && a + 1 < argc) opt.restarts = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--phase") && a + 1 < argc) phase = argv[++a];
+        else
+        {
+            fprintf(stderr, "WarmStart: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+    if (opt.distinct < 1) opt.distinct = 1;
+
+    if (phase)
+        return RunPhase(&opt, phase);
+
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: WarmStart [--function NAME] [--calls N] [--distinct D] [--threads T]\n"
+                        "                 [--sleep-scale S] [--cache FILE] [--restarts R] MultithreadCrash.so\n");
+        return 2;
+    }
+
+    snprintf(buf, sizeof(buf), "%ld %ld %d %g", opt.calls, opt.distinct, opt.threads, opt.sleepScale);
+    setenv("WARMSTART_OPTS", buf, 1);
+    setenv("WARMSTART_FUNC", opt.function, 1);
+    setenv("WARMSTART_XLL", opt.xll, 1);
+    unlink(opt.cache);
+
+    printf("%s: %ld calls over %ld distinct arguments, %d threads, sleep scale %g\n",
+        opt.function, opt.calls, opt.distinct, opt.threads, opt.sleepScale);
+    printf("%-9s %9s %10s %7s %7s %7s %7s %8s\n", "phase", "open_ms", "recalc_ms", "calls", "hits", "misses", "stores", "warmed");
+    fflush(stdout);
+
+    SpawnPhase(argv, &opt, "no-cache");
+    SpawnPhase(argv, &opt, "cold");
+    for (r = 0; r < opt.restarts; r++)
+        SpawnPhase(argv, &opt, "warm");
+    return 0;
+}
@@ -0,0 +1,354 @@
+/*
+**  Workers
+**
+**  Compares calls of a remote function (Common/WorkerPool.c) computed in
+**  Excel's process with the same calls forwarded to worker processes. Each
+**  configuration runs in a forked process that loads the XLL fresh, once for
+**  in-process calls (XLL_WORKERS unset) and once per worker count in
+**  --workers, in two modes:
+**    latency      one thread, Sleep() scaled to 0, so a call costs only its
+**                 trip through the ring; per-call p50 and p99
+**    throughput   --threads threads with the kernel sleeping, so workers are
+**                 the limit; calls per second
+**  Coalescing and the result cache are off, and every call has its own
+**  arguments. --kill-ms kills a worker process at that interval during the
+**  throughput run, to measure restarts: calls in flight on the killed worker
+**  compute in process instead, so every call must still be right.
+**
+**  Usage: Workers [options] MultithreadCrash.so
+**    --function NAME    remote UDF to call, two number arguments (default cDoubleInner)
+**    --workers A,B,..   worker counts to compare with in-process calls (default 1,2,4)
+**    --threads T        throughput threads (default 8)
+**    --calls K          throughput calls (default 2000)
+**    --latency-calls K  latency calls (default 20000)
+**    --sleep-scale S    multiplier for Sleep() in the throughput run (default 0.01)
+**    --kill-ms MS       kill a worker every MS ms during the throughput run
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "XlHost.h"
+
+#define MAX_THREADS 64
+#define MAX_CONFIGS 8
+
+typedef struct WorkersOptions
+{
+    const char* xll;
+    const char* function;
+    int    workers[MAX_CONFIGS];
+    int    configs;
+    int    threads;
+    long   calls;
+    long   latencyCalls;
+    double sleepScale;
+    long   killMs;
+} WorkersOptions;
+
+typedef struct WorkersThread
+{
+    pthread_t thread;
+    const XlHostFunc* func;
+    long   calls;               // Latency mode: calls made by this thread
+    double* latencyNs;          // Latency mode: one per call
+    long   wrong;
+    long   nan;
+} WorkersThread;
+
+static volatile LONG g_nextCall = 0;
+static volatile LONG g_running = 0;
+static long g_callLimit = 0;
+
+static int CallOnce(const XlHostFunc* func, long i, WorkersThread* w)
+{
+    XLOPER12 x, y, res;
+    LPXLOPER12 args[2] = { &x, &y };
+    XlHostSetNum(&x, (double)i);
+    XlHostSetNum(&y, 0.5);
+    if (XlHostCall(func, 2, args, &res) != xlretSuccess)
+        return 0;
+    if ((res.xltype & xltypeNum) != xltypeNum || isnan(res.val.num))
+        w->nan++;               // The host returns #NUM! for NaN
+    else if (res.val.num != (double)i + 0.5)
+        w->wrong++;
+    XlHostFreeResult(&res);
+    return 1;
+}
+
+static void* ThroughputMain(void* arg)
+{
+    WorkersThread* w = (WorkersThread*)arg;
+    long i;
+
+    while ((i = InterlockedIncrement(&g_nextCall) - 1) < g_callLimit)
+        CallOnce(w->func, i, w);
+    return NULL;
+}
+
+// Reads one column of mcWorkerStats for worker 'row' (or summed over workers if row < 0)
+static double WorkerCounter(int module, const WCHAR* column, int row)
+{
+    const XlHostFunc* stats = XlHostFindFunc(module, L"mcWorkerStats");
+    XLOPER12 res;
+    double value = 0.0;
+    int r, c, cols;
+
+    if (!stats || XlHostCall(stats, 0, NULL, &res) != xlretSuccess)
+        return -1.0;
+    if ((res.xltype & xltypeMulti) == xltypeMulti)
+    {
+        cols = res.val.array.columns;
+        for (c = 0; c < cols; c++)
+        {
+            LPXLOPER12 head = &res.val.array.lparray[c];
+            if ((head->xltype & xltypeStr) && (size_t)head->val.str[0] == wcslen(column)
+                && wcsncmp(&head->val.str[1], column, head->val.str[0]) == 0)
+                break;
+        }
+        for (r = 1; c < cols && r < res.val.array.rows; r++)
+        {
+            LPXLOPER12 key = &res.val.array.lparray[r * cols];
+            LPXLOPER12 val = &res.val.array.lparray[r * cols + c];
+            if (!(key->xltype & xltypeNum) || !(val->xltype & xltypeNum))
+                continue;       // The in-process row
+            if (row < 0 || (int)key->val.num == row)
+                value += val->val.num;
+        }
+    }
+    XlHostFreeResult(&res);
+    return value;
+}
+
+// Kills worker processes in turn until the throughput run ends
+typedef struct Killer
+{
+    pthread_t thread;
+    int module;
+    int workers;
+    long intervalMs;
+    long kills;
+} Killer;
+
+static void* KillerMain(void* arg)
+{
+    Killer* k = (Killer*)arg;
+    struct timespec interval = { k->intervalMs / 1000, (k->intervalMs % 1000) * 1000000l };
+    int next = 0;
+
+    while (ReadAcquire(&g_running))
+    {
+        nanosleep(&interval, NULL);
+        if (!ReadAcquire(&g_running))
+            break;
+        double pid = WorkerCounter(k->module, L"Pid", next);
+        if (pid > 0 && kill((pid_t)pid, SIGKILL) == 0)
+            k->kills++;
+        next = (next + 1) % k->workers;
+    }
+    return NULL;
+}
+
+static int CompareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Runs inside the child process: load, run one mode, print one result line
+static int RunConfig(const WorkersOptions* opt, int workers, int latency)
+{
+    WorkersThread threads[MAX_THREADS];
+    WCHAR name[64];
+    const XlHostFunc* func;
+    Killer killer;
+    ULONGLONG t0, t1;
+    long wrong = 0, nans = 0, calls;
+    int module, t, count = latency ? 1 : opt->threads;
+    double batches, served, restarts;
+    char label[32];
+
+    g_xlHostConfig.sleepScale = latency ? 0.0 : opt->sleepScale;
+    module = XlHostLoad(opt->xll);
+    if (module < 0)
+        return 1;
+    mbstowcs(name, opt->function, _countof(name));
+    func = XlHostFindFunc(module, name);
+    if (!func || func->argCount != 2)
+    {
+        fprintf(stderr, "Workers: %s does not register a two-argument %s\n", opt->xll, opt->function);
+        return 1;
+    }
+    memset(threads, 0, sizeof(threads));
+    memset(&killer, 0, sizeof(killer));
+
+    if (latency)
+    {
+        calls = opt->latencyCalls;
+        threads[0].func = func;
+        threads[0].latencyNs = (double*)malloc(calls * sizeof(double));
+        for (long i = 0; i < 64 && i < calls; i++)     // Workers started and rings warm
+            CallOnce(func, i, &threads[0]);
+        threads[0].wrong = threads[0].nan = 0;
+        t0 = XlHostNowNs();
+        for (long i = 0; i < calls; i++)
+        {
+            ULONGLONG c0 = XlHostNowNs();
+            CallOnce(func, i, &threads[0]);
+            threads[0].latencyNs[i] = (double)(XlHostNowNs() - c0);
+        }
+        t1 = XlHostNowNs();
+    }
+    else
+    {
+        calls = opt->calls;
+        g_callLimit = calls;
+        g_nextCall = 0;
+        WriteRelease(&g_running, 1);
+        if (opt->killMs > 0 && workers > 0)
+        {
+            killer.module = module;
+            killer.workers = workers;
+            killer.intervalMs = opt->killMs;
+            pthread_create(&killer.thread, NULL, KillerMain, &killer);
+        }
+        t0 = XlHostNowNs();
+        for (t = 0; t < count; t++)
+        {
+            threads[t].func = func;
+            pthread_create(&threads[t].thread, NULL, ThroughputMain, &threads[t]);
+        }
+        for (t = 0; t < count; t++)
+            pthread_join(threads[t].thread, NULL);
+        t1 = XlHostNowNs();
+        WriteRelease(&g_running, 0);
+        if (killer.workers)
+            pthread_join(killer.thread, NULL);
+    }
+    XlHostFireEvent(xleventCalculationEnded);
+
+    for (t = 0; t < count; t++)
+    {
+        wrong += threads[t].wrong;
+        nans += threads[t].nan;
+    }
+    served = workers ? WorkerCounter(module, L"Served", -1) : 0.0;
+    batches = workers ? WorkerCounter(module, L"Batches", -1) : 0.0;
+    restarts = workers ? WorkerCounter(module, L"Restarts", -1) : 0.0;
+    if (workers)
+        snprintf(label, sizeof(label), "%d worker%s", workers, workers == 1 ? "" : "s");
+    else
+        snprintf(label, sizeof(label), "in-process");
+
+    if (latency)
+    {
+        qsort(threads[0].latencyNs, calls, sizeof(double), CompareDouble);
+        printf("%-11s %-10s %7ld %9.1f %9.2f %9.2f %11.0f %7.2f %8s %6ld %5ld\n", label, "latency", calls,
+            (double)(t1 - t0) / 1e6, threads[0].latencyNs[calls / 2] / 1e3, threads[0].latencyNs[calls * 99 / 100] / 1e3,
+            (double)calls * 1e9 / (double)(t1 - t0), batches > 0 ? served / batches : 0.0, "-", nans, wrong);
+        free(threads[0].latencyNs);
+    }
+    else
+    {
+        printf("%-11s %-10s %7ld %9.1f %9s %9s %11.0f %7.2f %8.0f %6ld %5ld\n", label, "throughput", calls,
+            (double)(t1 - t0) / 1e6, "-", "-", (double)calls * 1e9 / (double)(t1 - t0),
+            batches > 0 ? served / batches : 0.0, restarts, nans, wrong);
+        if (killer.kills)
+            printf("%-11s %ld workers killed\n", "", killer.kills);
+    }
+    fflush(stdout);
+    XlHostUnloadAll();
+    return 0;
+}
+
+// Forks so each configuration loads the XLL (and starts its workers) in a fresh process
+static void SpawnConfig(const WorkersOptions* opt, int workers, int latency)
+{
+    pid_t pid = fork();
+    int status = 0;
+
+    if (pid == 0)
+    {
+        char n[16];
+        unsetenv("XLL_RESULT_CACHE");
+        setenv("XLL_SINGLEFLIGHT", "0", 1);
+        if (workers)
+        {
+            snprintf(n, sizeof(n), "%d", workers);
+            setenv("XLL_WORKERS", n, 1);
+        }
+        else
+        {
+            unsetenv("XLL_WORKERS");
+        }
+        _exit(RunConfig(opt, workers, latency));
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "Workers: %d workers, %s failed (status %d)\n", workers, latency ? "latency" : "throughput", status);
+}
+
+int main(int argc, char** argv)
+{
+    WorkersOptions opt = { NULL, "cDoubleInner", { 1, 2, 4 }, 3, 8, 2000, 20000, 0.01, 0 };
+    int a, c;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--function") && a + 1 < argc) opt.function = argv[++a];
+        else if (!strcmp(argv[a], "--workers") && a + 1 < argc)
+        {
+            char* p = argv[++a];
+            for (opt.configs = 0; *p && opt.configs < MAX_CONFIGS; )
+            {
+                opt.workers[opt.configs++] = (int)strtol(p, &p, 10);
+                if (*p == ',')
+                    p++;
+            }
+        }
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc) opt.threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--calls") && a + 1 < argc) opt.calls = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--latency-calls") && a + 1 < argc) opt.latencyCalls = atol(argv[++a]);
+        else if (!strcmp(argv[a], "--sleep-scale") && a + 1 < argc) opt.sleepScale = atof(argv[++a]);
+        else if (!strcmp(argv[a], "--kill-ms") && a + 1 < argc) opt.killMs = atol(argv[++a]);
+        else
+        {
+            fprintf(stderr, "Workers: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.xll = argv[a];
+    if (!opt.xll)
+    {
+        fprintf(stderr, "usage: Workers [--function NAME] [--workers A,B,..] [--threads T] [--calls K]\n"
+                        "               [--latency-calls K] [--sleep-scale S] [--kill-ms MS] MultithreadCrash.so\n");
+        return 2;
+    }
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+    if (opt.latencyCalls < 1) opt.latencyCalls = 1;
+
+    printf("%s: %ld latency calls; %ld throughput calls on %d threads, sleep scale %g%s\n",
+        opt.function, opt.latencyCalls, opt.calls, opt.threads, opt.sleepScale,
+        opt.killMs > 0 ? ", killing workers" : "");
+    printf("%-11s %-10s %7s %9s %9s %9s %11s %7s %8s %6s %5s\n",
+        "config", "mode", "calls", "wall_ms", "p50_us", "p99_us", "calls/s", "batch", "restarts", "nan", "wrong");
+    fflush(stdout);
+
+    for (c = -1; c < opt.configs; c++)
+    {
+        int workers = c < 0 ? 0 : opt.workers[c];
+        if (c >= 0 && workers <= 0)
+            continue;
+        SpawnConfig(&opt, workers, 1);
+        SpawnConfig(&opt, workers, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,1660 @@
+/*
+**  XlHost
+**
+**  Linux stand-in for Excel's side of the C API. See XlHost.h.
+**
+**  Calls into UDFs rely on the SysV (x86-64 and AArch64) calling convention:
+**  integer/pointer and floating-point arguments are assigned to separate
+**  register files in declaration order, so any proc with at most 6 pointer-class
+**  and 8 double-class arguments can be invoked through one pointer type by
+**  passing the pointer arguments first and the doubles after.
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <FRAMEWRK.H>
+#include <stdlib.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "XlHost.h"
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#error "XlHost dispatch assumes the SysV x86-64 or AArch64 register calling convention"
+#endif
+
+typedef struct XlHostModule
+{
+    char   path[512];
+    void*  handle;
+    void*  base;
+    void   (*autoFree12)(LPXLOPER12);
+    int    (*autoClose)(void);
+    int    (*dllMain)(HINSTANCE, DWORD, LPVOID);
+} XlHostModule;
+
+XlHostConfig g_xlHostConfig = { 1.0, 0, 0, 0, 0, 0, 0 };
+
+static XlHostModule g_modules[XLHOST_MAX_MODULES];
+static int g_moduleCount = 0;
+static XlHostFunc g_funcs[XLHOST_MAX_FUNCS];
+static int g_funcCount = 0;
+static pthread_mutex_t g_registerLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Handlers registered with xlEventRegister
+typedef struct HostEvent
+{
+    int   module;
+    int   event;
+    WCHAR name[64];
+} HostEvent;
+
+static HostEvent g_events[XLHOST_MAX_MODULES * 4];
+static int g_eventCount = 0;
+static pthread_mutex_t g_callbackLock = PTHREAD_MUTEX_INITIALIZER;
+static int g_loadingModule = -1;
+
+static __thread XlHostStats t_stats;
+static __thread int t_udfDepth = 0;
+static __thread DWORD t_tid = 0;
+static __thread int t_attachedModules = 0;  // Modules whose DllMain has seen this thread
+static __thread int t_callerRow = -1;      // Cell reported by xlfCaller, none while negative
+static __thread int t_callerColumn = 0;
+static __thread int t_callerSheet = 1;     // Sheet being calculated on this thread: "Sheet<n>"
+static pthread_key_t g_detachKey;
+static pthread_once_t g_detachOnce = PTHREAD_ONCE_INIT;
+
+// Framework temp memory: TempStr12/TempNum12 results live until the next Excel12f returns
+#define XLHOST_MAX_TEMP 64
+static __thread LPXLOPER12 t_temp[XLHOST_MAX_TEMP];
+static __thread int t_tempCount = 0;
+
+typedef double (*XlHostDblProc)(void*, void*, void*, void*, void*, void*,
+    double, double, double, double, double, double, double, double);
+typedef void* (*XlHostPtrProc)(void*, void*, void*, void*, void*, void*,
+    double, double, double, double, double, double, double, double);
+
+static int HostDispatch(int xlfn, int count, LPXLOPER12* opers, LPXLOPER12 operRes, void* caller);
+
+/*
+** Timing
+*/
+ULONGLONG XlHostNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000000000ull + (ULONGLONG)ts.tv_nsec;
+}
+
+void XlHostSpinNs(ULONGLONG ns)
+{
+    ULONGLONG end = XlHostNowNs() + ns;
+    while (XlHostNowNs() < end)
+        YieldProcessor();
+}
+
+XlHostStats* XlHostThreadStats(void)
+{
+    return &t_stats;
+}
+
+void XlHostResetThreadStats(void)
+{
+    memset(&t_stats, 0, sizeof(t_stats));
+}
+
+void XlHostAddStats(XlHostStats* total, const XlHostStats* part)
+{
+    ULONGLONG* t = (ULONGLONG*)total;
+    const ULONGLONG* p = (const ULONGLONG*)part;
+    for (size_t i = 0; i < sizeof(XlHostStats) / sizeof(ULONGLONG); i++)
+        t[i] += p[i];
+}
+
+/*
+** Win32 subset (see compat/windows.h)
+*/
+typedef struct HostAllocHeader
+{
+    size_t size;
+    size_t pad;
+} HostAllocHeader;
+
+HGLOBAL GlobalAlloc(UINT uFlags, SIZE_T dwBytes)
+{
+    ULONGLONG t0 = XlHostNowNs();
+    HostAllocHeader* h = (HostAllocHeader*)malloc(sizeof(HostAllocHeader) + dwBytes);
+    if (h)
+    {
+        h->size = dwBytes;
+        if (uFlags & GMEM_ZEROINIT)
+            memset(h + 1, 0, dwBytes);
+    }
+    t_stats.allocCalls++;
+    t_stats.allocBytes += dwBytes;
+    t_stats.allocNs += XlHostNowNs() - t0;
+    return h ? (HGLOBAL)(h + 1) : NULL;
+}
+
+HGLOBAL GlobalFree(HGLOBAL hMem)
+{
+    ULONGLONG t0 = XlHostNowNs();
+    if (hMem)
+        free((HostAllocHeader*)hMem - 1);
+    t_stats.freeCalls++;
+    t_stats.allocNs += XlHostNowNs() - t0;
+    return NULL;
+}
+
+SIZE_T GlobalSize(HGLOBAL hMem)
+{
+    return hMem ? ((HostAllocHeader*)hMem - 1)->size : 0;
+}
+
+void Sleep(DWORD dwMilliseconds)
+{
+    ULONGLONG ns = (ULONGLONG)((double)dwMilliseconds * 1e6 * g_xlHostConfig.sleepScale);
+    struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+    t_stats.sleepNs += ns;
+    if (ns)
+        nanosleep(&ts, NULL);
+    else
+        sched_yield();
+}
+
+DWORD GetCurrentThreadId(void)
+{
+    if (!t_tid)
+        t_tid = (DWORD)syscall(SYS_gettid);
+    return t_tid;
+}
+
+DWORD GetTickCount(void)
+{
+    return (DWORD)(XlHostNowNs() / 1000000ull);
+}
+
+void OutputDebugStringW(LPCWSTR lpOutputString)
+{
+    t_stats.debugStrings++;
+    if (g_xlHostConfig.debugOutput)
+        fprintf(stderr, "%ls", lpOutputString);
+}
+
+void OutputDebugStringA(LPCSTR lpOutputString)
+{
+    t_stats.debugStrings++;
+    if (g_xlHostConfig.debugOutput)
+        fputs(lpOutputString, stderr);
+}
+
+HMODULE GetModuleHandleA(LPCSTR lpModuleName)
+{
+    // Only the process image itself is asked for (to find MdCallBack12)
+    return dlopen(lpModuleName, RTLD_LAZY | RTLD_NOLOAD);
+}
+
+FARPROC GetProcAddress(HMODULE hModule, LPCSTR lpProcName)
+{
+    return (FARPROC)dlsym(hModule, lpProcName);
+}
+
+int QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount)
+{
+    lpPerformanceCount->QuadPart = (long long)XlHostNowNs();
+    return 1;
+}
+
+int QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency)
+{
+    lpFrequency->QuadPart = 1000000000ll;
+    return 1;
+}
+
+static void HostLockMutex(pthread_mutex_t* m, ULONGLONG* waitNs)
+{
+    if (pthread_mutex_trylock(m) == 0)
+        return;
+    ULONGLONG t0 = XlHostNowNs();
+    pthread_mutex_lock(m);
+    *waitNs += XlHostNowNs() - t0;
+    t_stats.lockWaits++;
+}
+
+void InitializeCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutex_t* m = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    cs->impl = m;
+}
+
+void DeleteCriticalSection(LPCRITICAL_SECTION cs)
+{
+    if (cs->impl)
+    {
+        pthread_mutex_destroy((pthread_mutex_t*)cs->impl);
+        free(cs->impl);
+        cs->impl = NULL;
+    }
+}
+
+void EnterCriticalSection(LPCRITICAL_SECTION cs)
+{
+    HostLockMutex((pthread_mutex_t*)cs->impl, &t_stats.lockWaitNs);
+}
+
+void LeaveCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)cs->impl);
+}
+
+// SRWLOCK may be statically initialised to zero, so the rwlock is created on first use
+static pthread_rwlock_t* HostRwLock(PSRWLOCK lock)
+{
+    pthread_rwlock_t* rw = (pthread_rwlock_t*)__atomic_load_n(&lock->impl, __ATOMIC_ACQUIRE);
+    if (rw)
+        return rw;
+    rw = (pthread_rwlock_t*)malloc(sizeof(pthread_rwlock_t));
+    pthread_rwlock_init(rw, NULL);
+    void* expected = NULL;
+    if (!__atomic_compare_exchange_n(&lock->impl, &expected, rw, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        pthread_rwlock_destroy(rw);
+        free(rw);
+        rw = (pthread_rwlock_t*)expected;
+    }
+    return rw;
+}
+
+void InitializeSRWLock(PSRWLOCK lock)
+{
+    lock->impl = NULL;
+}
+
+void AcquireSRWLockExclusive(PSRWLOCK lock)
+{
+    pthread_rwlock_t* rw = HostRwLock(lock);
+    if (pthread_rwlock_trywrlock(rw) == 0)
+        return;
+    ULONGLONG t0 = XlHostNowNs();
+    pthread_rwlock_wrlock(rw);
+    t_stats.lockWaitNs += XlHostNowNs() - t0;
+    t_stats.lockWaits++;
+}
+
+void ReleaseSRWLockExclusive(PSRWLOCK lock)
+{
+    pthread_rwlock_unlock(HostRwLock(lock));
+}
+
+void AcquireSRWLockShared(PSRWLOCK lock)
+{
+    pthread_rwlock_t* rw = HostRwLock(lock);
+    if (pthread_rwlock_tryrdlock(rw) == 0)
+        return;
+    ULONGLONG t0 = XlHostNowNs();
+    pthread_rwlock_rdlock(rw);
+    t_stats.lockWaitNs += XlHostNowNs() - t0;
+    t_stats.lockWaits++;
+}
+
+void ReleaseSRWLockShared(PSRWLOCK lock)
+{
+    pthread_rwlock_unlock(HostRwLock(lock));
+}
+
+// The futex covers the low 32 bits of the word (little-endian), which is the whole
+// of a Windows LONG; wider values are compared in full before waiting
+int WaitOnAddress(volatile void* address, PVOID compare, SIZE_T size, DWORD milliseconds)
+{
+    struct timespec ts, *timeout = NULL;
+    unsigned int low;
+
+    if (size != 1 && size != 2 && size != 4 && size != 8)
+        return FALSE;
+    if (memcmp((const void*)address, compare, size) != 0)
+        return TRUE;
+    if (size < 4)
+    {
+        // Sub-word waits are rare enough to poll
+        Sleep(0);
+        return TRUE;
+    }
+    if (milliseconds != INFINITE)
+    {
+        ts.tv_sec = (time_t)(milliseconds / 1000);
+        ts.tv_nsec = (long)(milliseconds % 1000) * 1000000l;
+        timeout = &ts;
+    }
+    memcpy(&low, compare, sizeof(low));
+    ULONGLONG t0 = XlHostNowNs();
+    long rc = syscall(SYS_futex, (unsigned int*)address, FUTEX_WAIT_PRIVATE, low, timeout, NULL, 0);
+    t_stats.lockWaitNs += XlHostNowNs() - t0;
+    t_stats.lockWaits++;
+    return rc == 0 || errno != ETIMEDOUT;
+}
+
+void WakeByAddressSingle(PVOID address)
+{
+    syscall(SYS_futex, (unsigned int*)address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void WakeByAddressAll(PVOID address)
+{
+    syscall(SYS_futex, (unsigned int*)address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+** Named semaphores and worker processes. A semaphore is a shared count in a
+** small file under /dev/shm, named after the Windows object, so a process that
+** opens the same name shares it; waits are shared (not private) futex waits.
+** The creator removes the file when it closes its handle.
+*/
+typedef struct HostSemaphore
+{
+    int   kind;                 // COMPAT_KIND_SEMAPHORE: first, as in COMPAT_MAPPING
+    int   creator;
+    char  path[256];
+    volatile int* word;         // word[0] count, word[1] maximum
+} HostSemaphore;
+
+typedef struct HostProcess
+{
+    int   kind;                 // COMPAT_KIND_PROCESS
+    pid_t pid;
+    int   child;                // Started by CreateProcessW, so waitpid can reap it
+    int   exited;
+    DWORD exitCode;
+} HostProcess;
+
+typedef struct HostThread
+{
+    int   kind;                 // COMPAT_KIND_THREAD
+    pthread_t thread;
+    LPTHREAD_START_ROUTINE start;
+    LPVOID parameter;
+    volatile int exited;
+    int   joined;
+    DWORD threadId;
+    volatile int started;
+} HostThread;
+
+static void* HostThreadMain(void* arg)
+{
+    HostThread* t = (HostThread*)arg;
+
+    __atomic_store_n(&t->threadId, GetCurrentThreadId(), __ATOMIC_RELAXED);
+    __atomic_store_n(&t->started, 1, __ATOMIC_RELEASE);
+    t->start(t->parameter);
+    __atomic_store_n(&t->exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+HANDLE CreateThread(void* security, SIZE_T stackSize, LPTHREAD_START_ROUTINE start, LPVOID parameter,
+                    DWORD creationFlags, DWORD* threadId)
+{
+    HostThread* t = (HostThread*)calloc(1, sizeof(*t));
+    pthread_attr_t attr;
+    (void)security;
+    (void)creationFlags;        // CREATE_SUSPENDED is not supported
+
+    if (!t || !start)
+    {
+        free(t);
+        return NULL;
+    }
+    t->kind = COMPAT_KIND_THREAD;
+    t->start = start;
+    t->parameter = parameter;
+    pthread_attr_init(&attr);
+    if (stackSize)
+        pthread_attr_setstacksize(&attr, stackSize < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : stackSize);
+    if (pthread_create(&t->thread, &attr, HostThreadMain, t) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        free(t);
+        return NULL;
+    }
+    pthread_attr_destroy(&attr);
+    if (threadId)
+    {
+        while (!__atomic_load_n(&t->started, __ATOMIC_ACQUIRE))
+            sched_yield();
+        *threadId = t->threadId;
+    }
+    return (HANDLE)t;
+}
+
+static DWORD HostWaitThread(HostThread* t, DWORD milliseconds)
+{
+    ULONGLONG deadline = XlHostNowNs() + (ULONGLONG)milliseconds * 1000000ull;
+    struct timespec poll = { 0, 100000 };
+
+    if (milliseconds == INFINITE && !t->joined)
+    {
+        pthread_join(t->thread, NULL);
+        t->joined = 1;
+        return WAIT_OBJECT_0;
+    }
+    while (!__atomic_load_n(&t->exited, __ATOMIC_ACQUIRE))
+    {
+        if (milliseconds != INFINITE && XlHostNowNs() >= deadline)
+            return WAIT_TIMEOUT;
+        nanosleep(&poll, NULL);
+    }
+    return WAIT_OBJECT_0;
+}
+
+HANDLE CreateSemaphoreW(void* security, LONG initialCount, LONG maximumCount, LPCWSTR name)
+{
+    HostSemaphore* s;
+    char utf[200];
+    int fd, creator = 1;
+    (void)security;
+
+    if (!name || wcstombs(utf, name, sizeof(utf)) >= sizeof(utf))
+        return NULL;            // Anonymous semaphores are not needed by the XLLs
+    for (char* c = utf; *c; c++)
+        if (*c == '/' || *c == '\\' || *c == ':')
+            *c = '_';
+    s = (HostSemaphore*)calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    snprintf(s->path, sizeof(s->path), "/dev/shm/xlhost-%s", utf);
+    fd = open(s->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        creator = 0;
+        fd = open(s->path, O_RDWR);
+    }
+    if (fd < 0 || ftruncate(fd, 64) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        free(s);
+        return NULL;
+    }
+    s->word = (volatile int*)mmap(NULL, 64, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->word == (volatile int*)MAP_FAILED)
+    {
+        free(s);
+        return NULL;
+    }
+    if (creator)
+    {
+        s->word[1] = (int)maximumCount;
+        __atomic_store_n(&s->word[0], (int)initialCount, __ATOMIC_RELEASE);
+    }
+    s->kind = COMPAT_KIND_SEMAPHORE;
+    s->creator = creator;
+    return (HANDLE)s;
+}
+
+int ReleaseSemaphore(HANDLE semaphore, LONG releaseCount, LONG* previousCount)
+{
+    HostSemaphore* s = (HostSemaphore*)semaphore;
+    int v, next;
+
+    if (!s || s->kind != COMPAT_KIND_SEMAPHORE || releaseCount <= 0)
+        return FALSE;
+    v = __atomic_load_n(&s->word[0], __ATOMIC_RELAXED);
+    do
+    {
+        if (v + releaseCount > s->word[1])
+            return FALSE;
+        next = v + (int)releaseCount;
+    } while (!__atomic_compare_exchange_n(&s->word[0], &v, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (previousCount)
+        *previousCount = v;
+    syscall(SYS_futex, (unsigned int*)s->word, FUTEX_WAKE, (int)releaseCount, NULL, NULL, 0);
+    return TRUE;
+}
+
+static DWORD HostWaitSemaphore(HostSemaphore* s, DWORD milliseconds)
+{
+    ULONGLONG deadline = XlHostNowNs() + (ULONGLONG)milliseconds * 1000000ull;
+    ULONGLONG t0 = 0;
+    int v;
+
+    for (;;)
+    {
+        v = __atomic_load_n(&s->word[0], __ATOMIC_ACQUIRE);
+        if (v > 0)
+        {
+            if (__atomic_compare_exchange_n(&s->word[0], &v, v - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
+            continue;
+        }
+        if (milliseconds == 0)
+            return WAIT_TIMEOUT;
+        if (!t0)
+            t0 = XlHostNowNs();
+        struct timespec ts, *timeout = NULL;
+        if (milliseconds != INFINITE)
+        {
+            ULONGLONG now = XlHostNowNs();
+            if (now >= deadline)
+            {
+                t_stats.lockWaitNs += now - t0;
+                t_stats.lockWaits++;
+                return WAIT_TIMEOUT;
+            }
+            ts.tv_sec = (time_t)((deadline - now) / 1000000000ull);
+            ts.tv_nsec = (long)((deadline - now) % 1000000000ull);
+            timeout = &ts;
+        }
+        syscall(SYS_futex, (unsigned int*)s->word, FUTEX_WAIT, 0, timeout, NULL, 0);
+    }
+    if (t0)
+    {
+        t_stats.lockWaitNs += XlHostNowNs() - t0;
+        t_stats.lockWaits++;
+    }
+    return WAIT_OBJECT_0;
+}
+
+// Windows reports a crashed process by its exception code
+static DWORD HostExitCode(int status)
+{
+    if (WIFEXITED(status))
+        return (DWORD)WEXITSTATUS(status);
+    switch (WTERMSIG(status))
+    {
+    case SIGSEGV: return 0xC0000005ul;     // EXCEPTION_ACCESS_VIOLATION
+    case SIGFPE:  return 0xC0000094ul;     // EXCEPTION_INT_DIVIDE_BY_ZERO
+    case SIGILL:  return 0xC000001Dul;     // EXCEPTION_ILLEGAL_INSTRUCTION
+    default:      return 1;                // As TerminateProcess(h, 1)
+    }
+}
+
+static int HostProcessExited(HostProcess* p)
+{
+    int status;
+
+    if (p->exited)
+        return TRUE;
+    if (p->child)
+    {
+        if (waitpid(p->pid, &status, WNOHANG) != p->pid)
+            return FALSE;
+        p->exitCode = HostExitCode(status);
+    }
+    else
+    {
+        if (kill(p->pid, 0) == 0 || errno != ESRCH)
+            return FALSE;
+        p->exitCode = 0;
+    }
+    p->exited = TRUE;
+    return TRUE;
+}
+
+static DWORD HostWaitProcess(HostProcess* p, DWORD milliseconds)
+{
+    ULONGLONG deadline = XlHostNowNs() + (ULONGLONG)milliseconds * 1000000ull;
+    struct timespec poll = { 0, 1000000 };
+
+    while (!HostProcessExited(p))
+    {
+        if (milliseconds != INFINITE && XlHostNowNs() >= deadline)
+            return WAIT_TIMEOUT;
+        nanosleep(&poll, NULL);
+    }
+    return WAIT_OBJECT_0;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds)
+{
+    if (!handle || (intptr_t)handle < 65536)
+        return WAIT_FAILED;
+    switch (((COMPAT_MAPPING*)handle)->kind)
+    {
+    case COMPAT_KIND_SEMAPHORE: return HostWaitSemaphore((HostSemaphore*)handle, milliseconds);
+    case COMPAT_KIND_PROCESS:   return HostWaitProcess((HostProcess*)handle, milliseconds);
+    case COMPAT_KIND_THREAD:    return HostWaitThread((HostThread*)handle, milliseconds);
+    default:                    return WAIT_FAILED;
+    }
+}
+
+// Next token of a command line: quoted or up to the next space, or the given separator
+static const WCHAR* HostNextToken(const WCHAR* s, WCHAR separator, char* out, size_t cap)
+{
+    WCHAR token[1024];
+    size_t n = 0;
+
+    while (*s == L' ')
+        s++;
+    if (*s == L'"')
+    {
+        for (s++; *s && *s != L'"' && n < 1023; s++)
+            token[n++] = *s;
+        if (*s == L'"')
+            s++;
+    }
+    else
+    {
+        for (; *s && *s != L' ' && *s != separator && n < 1023; s++)
+            token[n++] = *s;
+    }
+    token[n] = 0;
+    if (wcstombs(out, token, cap) >= cap)
+        out[0] = 0;
+    return s;
+}
+
+int CreateProcessW(LPCWSTR application, LPWSTR commandLine, void* processAttributes, void* threadAttributes,
+                   int inheritHandles, DWORD creationFlags, void* environment, LPCWSTR currentDirectory,
+                   LPSTARTUPINFOW startupInfo, LPPROCESS_INFORMATION processInformation)
+{
+    extern char** environ;
+    char program[1024], dll[1024], entry[128], exe[1024], rundll[1100], dllEntry[1200], args[2048], scale[64];
+    const WCHAR* s;
+    char* argv[4];
+    char** envp;
+    size_t envCount = 0;
+    HostProcess* p;
+    pid_t pid;
+    ssize_t len;
+    int rc;
+    (void)processAttributes; (void)threadAttributes; (void)inheritHandles; (void)creationFlags;
+    (void)startupInfo;
+
+    if (application || environment || currentDirectory || !commandLine || !processInformation)
+        return FALSE;
+
+    // rundll32.exe "<dll>",<entry> <arguments>
+    s = HostNextToken(commandLine, 0, program, sizeof(program));
+    len = (ssize_t)strlen(program);
+    if (len < 8 || (strcasecmp(program + len - 8, "rundll32") != 0 &&
+                    (len < 12 || strcasecmp(program + len - 12, "rundll32.exe") != 0)))
+        return FALSE;
+    s = HostNextToken(s, L',', dll, sizeof(dll));
+    if (*s != L',')
+        return FALSE;
+    s = HostNextToken(s + 1, 0, entry, sizeof(entry));
+    while (*s == L' ')
+        s++;
+    if (!dll[0] || !entry[0] || wcstombs(args, s, sizeof(args)) >= sizeof(args))
+        return FALSE;
+
+    // The stand-in sits next to the benchmark binaries
+    len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len <= 0)
+        return FALSE;
+    exe[len] = 0;
+    if (strrchr(exe, '/'))
+        *strrchr(exe, '/') = 0;
+    snprintf(rundll, sizeof(rundll), "%s/Rundll", getenv("XLHOST_RUNDLL_DIR") ? getenv("XLHOST_RUNDLL_DIR") : exe);
+    snprintf(dllEntry, sizeof(dllEntry), "%s,%s", dll, entry);
+    argv[0] = rundll;
+    argv[1] = dllEntry;
+    argv[2] = args;
+    argv[3] = NULL;
+
+    // The child inherits the environment, plus this host's Sleep scaling
+    while (environ[envCount])
+        envCount++;
+    envp = (char**)calloc(envCount + 2, sizeof(char*));
+    if (!envp)
+        return FALSE;
+    envCount = 0;
+    for (char** e = environ; *e; e++)
+        if (strncmp(*e, "XLHOST_SLEEP_SCALE=", 19) != 0)
+            envp[envCount++] = *e;
+    snprintf(scale, sizeof(scale), "XLHOST_SLEEP_SCALE=%.17g", g_xlHostConfig.sleepScale);
+    envp[envCount++] = scale;
+
+    rc = posix_spawn(&pid, rundll, NULL, NULL, argv, envp);
+    free(envp);
+    if (rc != 0)
+        return FALSE;
+    p = (HostProcess*)calloc(1, sizeof(*p));
+    if (!p)
+        return FALSE;
+    p->kind = COMPAT_KIND_PROCESS;
+    p->pid = pid;
+    p->child = TRUE;
+    processInformation->hProcess = (HANDLE)p;
+    processInformation->hThread = NULL;
+    processInformation->dwProcessId = (DWORD)pid;
+    processInformation->dwThreadId = (DWORD)pid;
+    return TRUE;
+}
+
+HANDLE OpenProcess(DWORD access, int inheritHandle, DWORD processId)
+{
+    HostProcess* p;
+    (void)access; (void)inheritHandle;
+
+    if (kill((pid_t)processId, 0) != 0 && errno == ESRCH)
+        return NULL;
+    p = (HostProcess*)calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->kind = COMPAT_KIND_PROCESS;
+    p->pid = (pid_t)processId;
+    return (HANDLE)p;
+}
+
+int GetExitCodeProcess(HANDLE process, DWORD* exitCode)
+{
+    HostProcess* p = (HostProcess*)process;
+
+    if (!p || (intptr_t)p < 65536 || p->kind != COMPAT_KIND_PROCESS || !exitCode)
+        return FALSE;
+    *exitCode = HostProcessExited(p) ? p->exitCode : STILL_ACTIVE;
+    return TRUE;
+}
+
+int TerminateProcess(HANDLE process, UINT exitCode)
+{
+    HostProcess* p = (HostProcess*)process;
+    (void)exitCode;
+
+    if (!p || (intptr_t)p < 65536 || p->kind != COMPAT_KIND_PROCESS)
+        return FALSE;
+    return p->exited || kill(p->pid, SIGKILL) == 0;
+}
+
+int XlHostCloseObject(HANDLE h)
+{
+    switch (((COMPAT_MAPPING*)h)->kind)
+    {
+    case COMPAT_KIND_SEMAPHORE:
+    {
+        HostSemaphore* s = (HostSemaphore*)h;
+        munmap((void*)s->word, 64);
+        if (s->creator)
+            unlink(s->path);
+        break;
+    }
+    case COMPAT_KIND_PROCESS:
+        // As on Windows, closing the handle leaves the process running
+        HostProcessExited((HostProcess*)h);
+        break;
+    case COMPAT_KIND_THREAD:
+    {
+        // Likewise a thread keeps running, detached; its small block is then not freed
+        HostThread* t = (HostThread*)h;
+        if (!t->joined)
+        {
+            if (!__atomic_load_n(&t->exited, __ATOMIC_ACQUIRE))
+            {
+                pthread_detach(t->thread);
+                return TRUE;
+            }
+            pthread_join(t->thread, NULL);
+        }
+        break;
+    }
+    default:
+        return FALSE;
+    }
+    free(h);
+    return TRUE;
+}
+
+/*
+** Host-owned XLOPER12 values (flagged xlbitXLFree so xlFree can release them)
+*/
+static WCHAR* HostCopyStr(const WCHAR* src)
+{
+    size_t len = src ? (size_t)src[0] : 0;
+    WCHAR* s = (WCHAR*)malloc((len + 2) * sizeof(WCHAR));
+    s[0] = (WCHAR)len;
+    if (len)
+        memcpy(&s[1], &src[1], len * sizeof(WCHAR));
+    s[len + 1] = L'\0';
+    return s;
+}
+
+static void HostCopyValue(LPXLOPER12 dst, const XLOPER12* src)
+{
+    DWORD type = src->xltype & ~(xlbitDLLFree | xlbitXLFree);
+    *dst = *src;
+    dst->xltype = type;
+    if (type == xltypeStr)
+    {
+        dst->val.str = HostCopyStr(src->val.str);
+        dst->xltype |= xlbitXLFree;
+    }
+    else if (type == xltypeMulti)
+    {
+        size_t n = (size_t)src->val.array.rows * (size_t)src->val.array.columns;
+        dst->val.array.lparray = (LPXLOPER12)malloc((n ? n : 1) * sizeof(XLOPER12));
+        for (size_t i = 0; i < n; i++)
+        {
+            HostCopyValue(&dst->val.array.lparray[i], &src->val.array.lparray[i]);
+            dst->val.array.lparray[i].xltype &= ~xlbitXLFree;
+        }
+        dst->xltype |= xlbitXLFree;
+    }
+}
+
+static void HostFreeValue(LPXLOPER12 x, int top)
+{
+    DWORD type = x->xltype & ~(xlbitDLLFree | xlbitXLFree);
+    if (top && !(x->xltype & xlbitXLFree))
+        return;
+    if (type == xltypeStr && x->val.str)
+    {
+        free(x->val.str);
+        x->val.str = NULL;
+    }
+    else if (type == xltypeMulti && x->val.array.lparray)
+    {
+        size_t n = (size_t)x->val.array.rows * (size_t)x->val.array.columns;
+        for (size_t i = 0; i < n; i++)
+            HostFreeValue(&x->val.array.lparray[i], 0);
+        free(x->val.array.lparray);
+        x->val.array.lparray = NULL;
+    }
+    x->xltype = type;
+}
+
+void XlHostFreeResult(LPXLOPER12 x)
+{
+    if (x)
+        HostFreeValue(x, 1);
+}
+
+void XlHostSetNum(LPXLOPER12 x, double v)
+{
+    x->xltype = xltypeNum;
+    x->val.num = v;
+}
+
+void XlHostSetStr(LPXLOPER12 x, const WCHAR* s)
+{
+    size_t len = wcslen(s);
+    if (len > 32767) len = 32767;
+    x->val.str = (WCHAR*)malloc((len + 2) * sizeof(WCHAR));
+    x->val.str[0] = (WCHAR)len;
+    memcpy(&x->val.str[1], s, len * sizeof(WCHAR));
+    x->val.str[len + 1] = L'\0';
+    x->xltype = xltypeStr | xlbitXLFree;
+}
+
+static void HostSetErr(LPXLOPER12 x, int err)
+{
+    x->xltype = xltypeErr;
+    x->val.err = err;
+}
+
+/*
+** Modules and registration
+*/
+static int HostModuleFromAddress(void* addr)
+{
+    Dl_info info;
+    if (!addr || !dladdr(addr, &info))
+        return -1;
+    for (int m = 0; m < g_moduleCount; m++)
+        if (g_modules[m].base == info.dli_fbase)
+            return m;
+    return -1;
+}
+
+static int HostCallerModule(void* returnAddress)
+{
+    int m = HostModuleFromAddress(returnAddress);
+    return m >= 0 ? m : g_loadingModule;
+}
+
+// Splits a REGISTER type text such as L"QQQ$" into return and argument codes
+static int HostParseTypeText(XlHostFunc* f, const WCHAR* text)
+{
+    int n = 0;
+    f->argCount = 0;
+    f->threadSafe = 0;
+    for (const WCHAR* p = text; *p; p++)
+    {
+        WCHAR c = *p;
+        if (c == L'$')
+        {
+            f->threadSafe = 1;
+            continue;
+        }
+        if (c == L'#' || c == L'!' || c == L'&' || c == L'%')
+            continue;
+        // K%, C% and D% (FP12 array, terminated and counted strings) as arguments only
+        if ((c == L'K' || c == L'C' || c == L'D') && (n == 0 || p[1] != L'%'))
+            return 0;
+        if (c != L'B' && c != L'J' && c != L'Q' && c != L'U' && c != L'K' && c != L'C' && c != L'D')
+            return 0;
+        if (n == 0)
+            f->retType = (char)c;
+        else if (f->argCount < XLHOST_MAX_ARGS)
+            f->argTypes[f->argCount++] = (char)c;
+        else
+            return 0;
+        n++;
+    }
+    return n > 0;
+}
+
+static void HostCopyText(WCHAR* dst, size_t cap, const XLOPER12* x)
+{
+    size_t len = 0;
+    if (x && (x->xltype & ~(xlbitDLLFree | xlbitXLFree)) == xltypeStr && x->val.str)
+    {
+        len = (size_t)x->val.str[0];
+        if (len > cap - 1) len = cap - 1;
+        memcpy(dst, &x->val.str[1], len * sizeof(WCHAR));
+    }
+    dst[len] = L'\0';
+}
+
+static int HostRegister(int module, int count, LPXLOPER12* opers, LPXLOPER12 res)
+{
+    XlHostFunc f;
+    char proc[128];
+    int rc = xlretSuccess;
+
+    memset(&f, 0, sizeof(f));
+    if (module < 0 || count < 4)
+        return xlretInvCount;
+
+    HostCopyText(f.name, _countof(f.name), opers[1]);
+    HostCopyText(f.typeText, _countof(f.typeText), opers[2]);
+    if (count > 6)
+        HostCopyText(f.category, _countof(f.category), opers[6]);
+    wcstombs(proc, f.name, sizeof(proc));
+    proc[sizeof(proc) - 1] = '\0';
+
+    f.module = module;
+    f.proc = dlsym(g_modules[module].handle, proc);
+    if (!f.proc || !HostParseTypeText(&f, f.typeText))
+    {
+        fprintf(stderr, "[XlHost] cannot register %s (%ls) from %s\n", proc, f.typeText, g_modules[module].path);
+        HostSetErr(res, xlerrValue);
+        return xlretSuccess;
+    }
+
+    pthread_mutex_lock(&g_registerLock);
+    if (g_funcCount < XLHOST_MAX_FUNCS)
+    {
+        f.regId = 1000.0 + (double)g_funcCount;
+        g_funcs[g_funcCount++] = f;
+        XlHostSetNum(res, f.regId);
+    }
+    else
+    {
+        rc = xlretFailed;
+    }
+    pthread_mutex_unlock(&g_registerLock);
+    return rc;
+}
+
+int XlHostLoad(const char* path)
+{
+    if (g_moduleCount >= XLHOST_MAX_MODULES)
+        return -1;
+
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        fprintf(stderr, "[XlHost] %s\n", dlerror());
+        return -1;
+    }
+
+    int (*autoOpen)(void) = (int (*)(void))dlsym(handle, "xlAutoOpen");
+    Dl_info info;
+    if (!autoOpen || !dladdr((void*)autoOpen, &info))
+    {
+        fprintf(stderr, "[XlHost] %s does not export xlAutoOpen\n", path);
+        dlclose(handle);
+        return -1;
+    }
+
+    int m = g_moduleCount++;
+    XlHostModule* mod = &g_modules[m];
+    snprintf(mod->path, sizeof(mod->path), "%s", path);
+    mod->handle = handle;
+    mod->base = info.dli_fbase;
+    mod->autoFree12 = (void (*)(LPXLOPER12))dlsym(handle, "xlAutoFree12");
+    mod->autoClose = (int (*)(void))dlsym(handle, "xlAutoClose");
+    mod->dllMain = (int (*)(HINSTANCE, DWORD, LPVOID))dlsym(handle, "DllMain");
+
+    // As LoadLibrary does: the loading thread predates the module, so it gets no thread attach
+    if (mod->dllMain && !mod->dllMain(handle, DLL_PROCESS_ATTACH, NULL))
+    {
+        fprintf(stderr, "[XlHost] %s: DllMain failed process attach\n", path);
+        g_moduleCount--;
+        dlclose(handle);
+        return -1;
+    }
+    t_attachedModules = g_moduleCount;
+
+    g_loadingModule = m;
+    autoOpen();
+    g_loadingModule = -1;
+    return m;
+}
+
+void XlHostUnloadAll(void)
+{
+    for (int m = g_moduleCount - 1; m >= 0; m--)
+    {
+        g_loadingModule = m;
+        if (g_modules[m].autoClose)
+            g_modules[m].autoClose();
+        g_loadingModule = -1;
+        if (g_modules[m].dllMain)
+            g_modules[m].dllMain(g_modules[m].handle, DLL_PROCESS_DETACH, NULL);
+        dlclose(g_modules[m].handle);
+    }
+    g_moduleCount = 0;
+    g_funcCount = 0;
+    g_eventCount = 0;
+    t_attachedModules = 0;
+}
+
+int XlHostModuleCount(void) { return g_moduleCount; }
+const char* XlHostModulePath(int module) { return g_modules[module].path; }
+void* XlHostModuleHandle(int module) { return g_modules[module].handle; }
+void* XlHostModuleBase(int module) { return g_modules[module].base; }
+int XlHostFuncCount(void) { return g_funcCount; }
+const XlHostFunc* XlHostFuncAt(int index) { return &g_funcs[index]; }
+
+const XlHostFunc* XlHostFindFunc(int module, const WCHAR* name)
+{
+    const XlHostFunc* any = NULL;
+    for (int i = 0; i < g_funcCount; i++)
+    {
+        if (wcscmp(g_funcs[i].name, name) != 0)
+            continue;
+        if (g_funcs[i].module == module)
+            return &g_funcs[i];
+        if (!any)
+            any = &g_funcs[i];
+    }
+    return any;
+}
+
+static const XlHostFunc* HostFindById(double regId)
+{
+    int i = (int)(regId - 1000.0);
+    return (i >= 0 && i < g_funcCount) ? &g_funcs[i] : NULL;
+}
+
+/*
+** UDF invocation
+*/
+static int HostArgToDouble(const XLOPER12* x, double* out)
+{
+    switch (x ? (x->xltype & ~(xlbitDLLFree | xlbitXLFree)) : xltypeMissing)
+    {
+    case xltypeNum:     *out = x->val.num; return 1;
+    case xltypeInt:     *out = (double)x->val.w; return 1;
+    case xltypeBool:    *out = x->val.xbool ? 1.0 : 0.0; return 1;
+    case xltypeMissing:
+    case xltypeNil:     *out = 0.0; return 1;
+    default:            return 0;
+    }
+}
+
+// K% argument: a number or an array of numbers as an FP12; NULL (#VALUE!) for anything else
+static FP12* HostArgToFp12(const XLOPER12* x)
+{
+    DWORD type = x->xltype & ~(xlbitDLLFree | xlbitXLFree);
+    int rows = type == xltypeMulti ? x->val.array.rows : 1;
+    int columns = type == xltypeMulti ? x->val.array.columns : 1;
+    FP12* fp;
+
+    if (type != xltypeMulti && type != xltypeNum)
+        return NULL;
+    fp = (FP12*)malloc(sizeof(FP12) + ((size_t)rows * (size_t)columns - 1) * sizeof(double));
+    fp->rows = rows;
+    fp->columns = columns;
+    if (type == xltypeNum)
+    {
+        fp->array[0] = x->val.num;
+        return fp;
+    }
+    for (size_t i = 0; i < (size_t)rows * (size_t)columns; i++)
+    {
+        if (!HostArgToDouble(&x->val.array.lparray[i], &fp->array[i]))
+        {
+            free(fp);
+            return NULL;
+        }
+    }
+    return fp;
+}
+
+// C% (counted 0) or D% (counted 1) argument: text, or a number or boolean as Excel shows it
+static WCHAR* HostArgToText(const XLOPER12* x, int counted)
+{
+    WCHAR buf[64];
+    const WCHAR* text = buf;
+    size_t len;
+    WCHAR* s;
+
+    switch (x->xltype & ~(xlbitDLLFree | xlbitXLFree))
+    {
+    case xltypeStr:     text = x->val.str ? &x->val.str[1] : L""; len = x->val.str ? (size_t)x->val.str[0] : 0; break;
+    case xltypeNum:     len = (size_t)swprintf(buf, _countof(buf), L"%.15g", x->val.num); break;
+    case xltypeBool:    text = x->val.xbool ? L"TRUE" : L"FALSE"; len = wcslen(text); break;
+    case xltypeMissing:
+    case xltypeNil:     text = L""; len = 0; break;
+    default:            return NULL;
+    }
+    s = (WCHAR*)malloc((len + 2) * sizeof(WCHAR));
+    if (counted)
+        s[0] = (WCHAR)len;
+    memcpy(&s[counted], text, len * sizeof(WCHAR));
+    s[counted + len] = L'\0';
+    return s;
+}
+
+/*
+** DllMain thread notifications. Windows sends DLL_THREAD_ATTACH from every
+** thread started after the module loaded and DLL_THREAD_DETACH when a thread
+** exits; here a thread attaches on its first call into the XLLs and detaches
+** from a pthread key destructor.
+*/
+static void HostThreadDetach(void* value)
+{
+    int n = t_attachedModules < g_moduleCount ? t_attachedModules : g_moduleCount;
+    (void)value;
+    for (int m = n - 1; m >= 0; m--)
+        if (g_modules[m].dllMain)
+            g_modules[m].dllMain(g_modules[m].handle, DLL_THREAD_DETACH, NULL);
+    t_attachedModules = 0;
+}
+
+static void HostCreateDetachKey(void)
+{
+    pthread_key_create(&g_detachKey, HostThreadDetach);
+}
+
+static void HostThreadAttach(void)
+{
+    pthread_once(&g_detachOnce, HostCreateDetachKey);
+    pthread_setspecific(g_detachKey, (void*)1);
+    for (int m = t_attachedModules; m < g_moduleCount; m++)
+        if (g_modules[m].dllMain)
+            g_modules[m].dllMain(g_modules[m].handle, DLL_THREAD_ATTACH, NULL);
+    t_attachedModules = g_moduleCount;
+}
+
+int XlHostCall(const XlHostFunc* func, int count, LPXLOPER12* args, LPXLOPER12 res)
+{
+    void* p[XLHOST_MAX_PTR_ARGS] = { 0 };
+    double d[XLHOST_MAX_DBL_ARGS] = { 0 };
+    void* temps[XLHOST_MAX_PTR_ARGS];       // Marshalled arguments, freed after the call
+    XLOPER12 copies[XLHOST_MAX_PTR_ARGS];
+    XLOPER12 missing;
+    int np = 0, nd = 0, nt = 0, nc = 0;
+    int bad = 0;                            // 1: #VALUE!, 2: too many pointer arguments
+
+    missing.xltype = xltypeMissing;
+    if (!func || !func->proc)
+        return xlretInvXlfn;
+    if (t_attachedModules < g_moduleCount)
+        HostThreadAttach();
+    if (count > func->argCount)
+        return xlretInvCount;
+
+    for (int i = 0; i < func->argCount; i++)
+    {
+        LPXLOPER12 a = (i < count && args[i]) ? args[i] : &missing;
+        double v;
+        switch (func->argTypes[i])
+        {
+        case 'B':
+            if (!HostArgToDouble(a, &v) || nd >= XLHOST_MAX_DBL_ARGS)
+                bad = 1;
+            else
+                d[nd++] = v;
+            break;
+        case 'J':
+            if (!HostArgToDouble(a, &v) || np >= XLHOST_MAX_PTR_ARGS)
+                bad = 1;
+            else
+                p[np++] = (void*)(intptr_t)(int)v;
+            break;
+        case 'K':
+        case 'C':
+        case 'D':
+            if (np >= XLHOST_MAX_PTR_ARGS)
+                bad = 2;
+            else if (!(temps[nt] = func->argTypes[i] == 'K' ? (void*)HostArgToFp12(a)
+                                                             : (void*)HostArgToText(a, func->argTypes[i] == 'D')))
+                bad = 1;
+            else
+                p[np++] = temps[nt++];
+            break;
+        default:
+            if (np >= XLHOST_MAX_PTR_ARGS)
+            {
+                bad = 2;
+                break;
+            }
+            if (g_xlHostConfig.copyArguments)
+            {
+                HostCopyValue(&copies[nc], a);
+                a = &copies[nc++];
+            }
+            p[np++] = a;
+            break;
+        }
+        if (bad)
+            break;
+    }
+    if (bad)
+    {
+        while (nt > 0)
+            free(temps[--nt]);
+        while (nc > 0)
+            HostFreeValue(&copies[--nc], 1);
+        if (bad == 2)
+            return xlretInvCount;
+        HostSetErr(res, xlerrValue);
+        return xlretSuccess;
+    }
+
+    ULONGLONG t0 = t_udfDepth == 0 ? XlHostNowNs() : 0;
+    t_udfDepth++;
+    if (func->retType == 'B')
+    {
+        double r = ((XlHostDblProc)func->proc)(p[0], p[1], p[2], p[3], p[4], p[5],
+            d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+        XlHostSetNum(res, r);
+    }
+    else
+    {
+        void* r = ((XlHostPtrProc)func->proc)(p[0], p[1], p[2], p[3], p[4], p[5],
+            d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+        if (func->retType == 'J')
+        {
+            XlHostSetNum(res, (double)(int)(intptr_t)r);
+        }
+        else if (!r)
+        {
+            HostSetErr(res, xlerrNum);
+        }
+        else
+        {
+            LPXLOPER12 x = (LPXLOPER12)r;
+            HostCopyValue(res, x);
+            if ((x->xltype & xlbitDLLFree) && g_modules[func->module].autoFree12)
+                g_modules[func->module].autoFree12(x);
+        }
+    }
+    t_udfDepth--;
+    while (nt > 0)
+        free(temps[--nt]);
+    while (nc > 0)
+        HostFreeValue(&copies[--nc], 1);
+    if (t_udfDepth == 0)
+    {
+        t_stats.udfCalls++;
+        t_stats.udfNs += XlHostNowNs() - t0;
+    }
+    return xlretSuccess;
+}
+
+/*
+** Callback dispatch shared by Excel12, Excel12v, Excel12f and MdCallBack12
+*/
+static int HostUdf(int count, LPXLOPER12* opers, LPXLOPER12 res, int callerModule, ULONGLONG* nestedNs)
+{
+    const XlHostFunc* f = NULL;
+    if (count < 1 || !opers[0])
+        return xlretInvCount;
+
+    DWORD type = opers[0]->xltype & ~(xlbitDLLFree | xlbitXLFree);
+    if (type == xltypeNum)
+    {
+        f = HostFindById(opers[0]->val.num);
+    }
+    else if (type == xltypeStr)
+    {
+        WCHAR name[64];
+        HostCopyText(name, _countof(name), opers[0]);
+        f = XlHostFindFunc(callerModule, name);
+    }
+    if (!f)
+    {
+        HostSetErr(res, xlerrName);
+        return xlretSuccess;
+    }
+    if (g_xlHostConfig.multiThreadedCalc && !f->threadSafe)
+        return xlretNotThreadSafe;
+
+    ULONGLONG t0 = XlHostNowNs();
+    int depth = t_udfDepth;
+    t_udfDepth = depth + 1;     // Nested calls are not counted as outermost UDF time
+    int rc = XlHostCall(f, count - 1, opers + 1, res);
+    t_udfDepth = depth;
+    *nestedNs += XlHostNowNs() - t0;
+    return rc;
+}
+
+static int HostDispatch(int xlfn, int count, LPXLOPER12* opers, LPXLOPER12 operRes, void* caller)
+{
+    ULONGLONG t0 = XlHostNowNs();
+    ULONGLONG nestedNs = 0;
+    XLOPER12 scratch;
+    int rc = xlretSuccess;
+    int module = HostCallerModule(caller);
+
+    if (!operRes)
+        operRes = &scratch;
+
+    t_stats.callbackCalls++;
+    if (g_xlHostConfig.serialiseCallbacks)
+        HostLockMutex(&g_callbackLock, &t_stats.callbackWaitNs);
+    if (g_xlHostConfig.callbackCostNs > 0)
+        XlHostSpinNs((ULONGLONG)g_xlHostConfig.callbackCostNs);
+
+    switch (xlfn)
+    {
+    case xlUDF:
+        if (g_xlHostConfig.serialiseCallbacks)
+            pthread_mutex_unlock(&g_callbackLock);
+        rc = HostUdf(count, opers, operRes, module, &nestedNs);
+        if (g_xlHostConfig.serialiseCallbacks)
+            pthread_mutex_lock(&g_callbackLock);
+        break;
+
+    case xlFree:
+        for (int i = 0; i < count; i++)
+            if (opers[i])
+                HostFreeValue(opers[i], 1);
+        break;
+
+    case xlGetName:
+        if (module < 0)
+        {
+            rc = xlretFailed;
+            break;
+        }
+        {
+            WCHAR path[512];
+            mbstowcs(path, g_modules[module].path, _countof(path));
+            path[_countof(path) - 1] = L'\0';
+            XlHostSetStr(operRes, path);
+        }
+        break;
+
+    case xlfRegister:
+        rc = HostRegister(module, count, opers, operRes);
+        break;
+
+    case xlfEvaluate:
+        if (count >= 1 && opers[0] && (opers[0]->xltype & ~xlbitXLFree) == xltypeStr)
+        {
+            WCHAR name[64];
+            HostCopyText(name, _countof(name), opers[0]);
+            const XlHostFunc* f = XlHostFindFunc(module, name);
+            if (f)
+                XlHostSetNum(operRes, f->regId);
+            else
+                HostSetErr(operRes, xlerrName);
+        }
+        else
+        {
+            rc = xlretInvXloper;
+        }
+        break;
+
+    case xlEventRegister:
+        // Handler name (a command registered by the same XLL) and event code
+        if (module < 0 || count < 2 || !opers[0] || !opers[1])
+        {
+            rc = xlretInvXloper;
+            break;
+        }
+        pthread_mutex_lock(&g_registerLock);
+        if (g_eventCount < (int)_countof(g_events))
+        {
+            HostEvent* e = &g_events[g_eventCount++];
+            double code = 0.0;
+            HostArgToDouble(opers[1], &code);
+            e->module = module;
+            e->event = (int)code;
+            HostCopyText(e->name, _countof(e->name), opers[0]);
+        }
+        pthread_mutex_unlock(&g_registerLock);
+        operRes->xltype = xltypeBool;
+        operRes->val.xbool = 1;
+        break;
+
+    case xlfCaller:
+        if (t_callerRow < 0)
+        {
+            rc = xlretFailed;
+            break;
+        }
+        operRes->xltype = xltypeSRef;
+        operRes->val.sref.count = 1;
+        operRes->val.sref.ref.rwFirst = operRes->val.sref.ref.rwLast = t_callerRow;
+        operRes->val.sref.ref.colFirst = operRes->val.sref.ref.colLast = t_callerColumn;
+        break;
+
+    case xlSheetNm:
+        // A single-cell reference is on the sheet calculating on this thread
+        if (count < 1 || !opers[0])
+        {
+            rc = xlretInvXloper;
+            break;
+        }
+        {
+            DWORD type = opers[0]->xltype & ~(xlbitXLFree | xlbitDLLFree);
+            WCHAR name[64];
+            if (type != xltypeSRef && type != xltypeRef)
+            {
+                rc = xlretInvXloper;
+                break;
+            }
+            swprintf(name, _countof(name), L"[Book1]Sheet%d",
+                type == xltypeSRef ? t_callerSheet : (int)opers[0]->val.mref.idSheet);
+            XlHostSetStr(operRes, name);
+            operRes->xltype |= xlbitXLFree;
+        }
+        break;
+
+    case xlSheetId:
+        // "[Book1]Sheet<n>" or "Sheet<n>" is sheet n, as an xltypeRef with no areas
+        if (count < 1 || !opers[0] || (opers[0]->xltype & ~xlbitXLFree) != xltypeStr)
+        {
+            rc = xlretInvXloper;
+            break;
+        }
+        {
+            WCHAR name[64];
+            const WCHAR* p;
+            int sheet = 0;
+            HostCopyText(name, _countof(name), opers[0]);
+            p = wcschr(name, L']');
+            p = p ? p + 1 : name;
+            if (swscanf(p, L"Sheet%d", &sheet) != 1 || sheet < 1)
+            {
+                rc = xlretInvXloper;
+                break;
+            }
+            operRes->xltype = xltypeRef;
+            operRes->val.mref.lpmref = NULL;
+            operRes->val.mref.idSheet = (IDSHEET)sheet;
+        }
+        break;
+
+    case xlfSetName:
+        operRes->xltype = xltypeBool;
+        operRes->val.xbool = 1;
+        break;
+
+    case xlAbort:
+        operRes->xltype = xltypeBool;
+        operRes->val.xbool = g_xlHostConfig.abortRequested ? 1 : 0;
+        // pxRetain FALSE clears the break, as in Excel
+        if (count >= 1 && (opers[0]->xltype & xltypeBool) && !opers[0]->val.xbool)
+            g_xlHostConfig.abortRequested = 0;
+        break;
+
+    default:
+        rc = xlretInvXlfn;
+        break;
+    }
+
+    if (g_xlHostConfig.serialiseCallbacks)
+        pthread_mutex_unlock(&g_callbackLock);
+    t_stats.callbackNs += XlHostNowNs() - t0 - nestedNs;
+    return rc;
+}
+
+void XlHostSetCaller(int row, int column)
+{
+    t_callerRow = row;
+    t_callerColumn = column;
+}
+
+void XlHostSetCallerSheet(int sheet)
+{
+    t_callerSheet = sheet;
+}
+
+int XlHostFireEvent(int event)
+{
+    int fired = 0;
+    for (int i = 0; i < g_eventCount; i++)
+    {
+        const XlHostFunc* f;
+        if (g_events[i].event != event)
+            continue;
+        f = XlHostFindFunc(g_events[i].module, g_events[i].name);
+        if (f && f->module == g_events[i].module && f->proc)
+        {
+            ((int (*)(void))f->proc)();
+            fired++;
+        }
+    }
+    return fired;
+}
+
+/*
+** Excel entry points the XLLs link against
+*/
+__attribute__((visibility("default"), noinline))
+int MdCallBack12(int xlfn, int count, LPXLOPER12* opers, LPXLOPER12 operRes)
+{
+    return HostDispatch(xlfn, count, opers, operRes, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"), noinline))
+int Excel12v(int xlfn, LPXLOPER12 operRes, int count, LPXLOPER12 opers[])
+{
+    return HostDispatch(xlfn, count, opers, operRes, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"), noinline))
+int Excel12(int xlfn, LPXLOPER12 operRes, int count, ...)
+{
+    LPXLOPER12 opers[256];
+    va_list args;
+    if (count < 0 || count > 255)
+        return xlretInvCount;
+    va_start(args, count);
+    for (int i = 0; i < count; i++)
+        opers[i] = va_arg(args, LPXLOPER12);
+    va_end(args);
+    return HostDispatch(xlfn, count, opers, operRes, __builtin_return_address(0));
+}
+
+static void HostFreeTemp(void)
+{
+    for (int i = 0; i < t_tempCount; i++)
+    {
+        HostFreeValue(t_temp[i], 1);
+        free(t_temp[i]);
+    }
+    t_tempCount = 0;
+}
+
+__attribute__((visibility("default"), noinline))
+int Excel12f(int xlfn, LPXLOPER12 pxResult, int count, ...)
+{
+    LPXLOPER12 opers[256];
+    va_list args;
+    if (count < 0 || count > 255)
+        return xlretInvCount;
+    va_start(args, count);
+    for (int i = 0; i < count; i++)
+        opers[i] = va_arg(args, LPXLOPER12);
+    va_end(args);
+    int rc = HostDispatch(xlfn, count, opers, pxResult, __builtin_return_address(0));
+    HostFreeTemp();
+    return rc;
+}
+
+static LPXLOPER12 HostTemp(void)
+{
+    LPXLOPER12 x = (LPXLOPER12)calloc(1, sizeof(XLOPER12));
+    if (t_tempCount == XLHOST_MAX_TEMP)
+        HostFreeTemp();
+    t_temp[t_tempCount++] = x;
+    return x;
+}
+
+LPXLOPER12 TempNum12(double d)
+{
+    LPXLOPER12 x = HostTemp();
+    XlHostSetNum(x, d);
+    return x;
+}
+
+LPXLOPER12 TempStr12(const XCHAR* lpstr)
+{
+    LPXLOPER12 x = HostTemp();
+    XlHostSetStr(x, lpstr ? lpstr : L"");
+    return x;
+}
+
+LPXLOPER12 TempInt12(int i)
+{
+    LPXLOPER12 x = HostTemp();
+    x->xltype = xltypeInt;
+    x->val.w = i;
+    return x;
+}
+
+LPXLOPER12 TempBool12(BOOL b)
+{
+    LPXLOPER12 x = HostTemp();
+    x->xltype = xltypeBool;
+    x->val.xbool = b ? 1 : 0;
+    return x;
+}
+
+LPXLOPER12 TempErr12(int i)
+{
+    LPXLOPER12 x = HostTemp();
+    HostSetErr(x, i);
+    return x;
+}
+
+LPXLOPER12 TempMissing12(void)
+{
+    LPXLOPER12 x = HostTemp();
+    x->xltype = xltypeMissing;
+    return x;
+}
@@ -0,0 +1,117 @@
+/*
+**  XlHost
+**
+**  Stand-in for the Excel C API callback so the XLLs can be loaded and driven
+**  on Linux without Excel. The host dlopens each XLL built as a shared object,
+**  runs xlAutoOpen, records what it registers through xlfRegister and then
+**  dispatches xlUDF calls (by name or by register id) to the exported procs.
+**
+**  It also implements the Win32 subset declared in compat/windows.h, timing
+**  the pieces a scaling run cares about: allocator, callback and locks.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include <XLCALL.H>
+
+#define XLHOST_MAX_MODULES   8
+#define XLHOST_MAX_FUNCS     512
+#define XLHOST_MAX_ARGS      14   /* 6 pointer-class + 8 double-class arguments */
+#define XLHOST_MAX_PTR_ARGS  6
+#define XLHOST_MAX_DBL_ARGS  8
+
+/*
+** Host behaviour knobs, set by the benchmark before loading or between runs
+*/
+typedef struct XlHostConfig
+{
+    double sleepScale;          // Multiplier applied to Sleep() inside UDFs (1.0 = real time)
+    long   callbackCostNs;      // Busy-wait added to every callback, models Excel's own work
+    int    serialiseCallbacks;  // Take one process-wide lock around callbacks
+    int    multiThreadedCalc;   // Reject xlUDF to non-$ functions, as Excel does during MTR
+    int    abortRequested;      // Value reported by xlAbort
+    int    debugOutput;         // Echo OutputDebugString to stderr
+    int    copyArguments;       // Pass Q and U arguments as fresh copies, as Excel builds them from cells
+} XlHostConfig;
+
+/*
+** Per-thread counters. Every field is written only by its own thread; the
+** benchmark reads them after joining the worker.
+*/
+typedef struct XlHostStats
+{
+    ULONGLONG allocCalls;
+    ULONGLONG allocBytes;
+    ULONGLONG allocNs;          // Time inside GlobalAlloc/GlobalFree
+    ULONGLONG freeCalls;
+    ULONGLONG callbackCalls;
+    ULONGLONG callbackNs;       // Time inside Excel12*/MdCallBack12, nested UDF time excluded
+    ULONGLONG callbackWaitNs;   // Part of callbackNs spent waiting for the serialisation lock
+    ULONGLONG lockWaits;
+    ULONGLONG lockWaitNs;       // Time blocked in CRITICAL_SECTION/SRWLOCK owned by the XLL
+    ULONGLONG sleepNs;          // Time the UDF asked to sleep (after scaling)
+    ULONGLONG udfCalls;
+    ULONGLONG udfNs;            // Time inside outermost UDF calls made through XlHostCall
+    ULONGLONG debugStrings;
+} XlHostStats;
+
+/*
+** One row registered via xlfRegister
+*/
+typedef struct XlHostFunc
+{
+    int    module;
+    void*  proc;
+    double regId;
+    int    argCount;
+    int    threadSafe;
+    char   retType;              // 'B', 'J', 'Q' or 'U'
+    char   argTypes[XLHOST_MAX_ARGS];   // Also 'K', 'C' and 'D' for K%, C% and D%
+    WCHAR  name[64];
+    WCHAR  typeText[32];
+    WCHAR  category[64];
+} XlHostFunc;
+
+extern XlHostConfig g_xlHostConfig;
+
+// Modules
+int         XlHostLoad(const char* path);
+void        XlHostUnloadAll(void);
+int         XlHostModuleCount(void);
+const char* XlHostModulePath(int module);
+void*       XlHostModuleHandle(int module);
+void*       XlHostModuleBase(int module);
+
+// Registered functions
+int               XlHostFuncCount(void);
+const XlHostFunc* XlHostFuncAt(int index);
+const XlHostFunc* XlHostFindFunc(int module, const WCHAR* name);
+
+// Calls a registered function the way Excel does for a worksheet cell: the
+// result is a host-owned copy which must be released with XlHostFreeResult.
+int  XlHostCall(const XlHostFunc* func, int count, LPXLOPER12* args, LPXLOPER12 res);
+void XlHostFreeResult(LPXLOPER12 x);
+
+// Cell that xlfCaller reports (as an xltypeSRef) to UDFs called on this thread; a negative
+// row means no cell, and xlfCaller then fails as it does outside a worksheet formula
+void XlHostSetCaller(int row, int column);
+
+// Sheet calculating on this thread (1 until set), which xlSheetNm reports for an
+// xltypeSRef as "[Book1]Sheet<n>"; xlSheetId turns that name back into sheet n
+void XlHostSetCallerSheet(int sheet);
+
+// Runs the handlers registered with xlEventRegister for event (xleventCalculationEnded, ...)
+// on the calling thread, as Excel does at the end of a recalculation; returns how many ran
+int  XlHostFireEvent(int event);
+
+// XLOPER12 helpers for callers; strings are host-owned (release with XlHostFreeResult)
+void XlHostSetNum(LPXLOPER12 x, double v);
+void XlHostSetStr(LPXLOPER12 x, const WCHAR* s);
+
+// Statistics and timing
+XlHostStats* XlHostThreadStats(void);
+void         XlHostResetThreadStats(void);
+void         XlHostAddStats(XlHostStats* total, const XlHostStats* part);
+ULONGLONG    XlHostNowNs(void);
+void         XlHostSpinNs(ULONGLONG ns);
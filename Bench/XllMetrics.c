@@ -0,0 +1,234 @@
+/*
+**  XllMetrics
+**
+**  Reads the shared-memory metrics segment of a running XLL (Common/Metrics.h)
+**  without loading the XLL or touching Excel. Start Excel, or a bench, with
+**  XLL_METRICS set to a directory and point this at the .metrics file that
+**  appears there. Every --interval milliseconds it maps the segment
+**  read-only, copies a consistent snapshot out of it and prints:
+**    functions   calls, calls per second since the last sample, mean, p50,
+**                p99 and longest call, bytes allocated and still live
+**    callbacks   Excel callbacks by entry point, with their mean time
+**    counters    the module tables (result cache, handles, lookups, ...)
+**  Functions never called and zero counters are left out unless --all is
+**  given. With --csv each sample is one CSV block of the same figures.
+**
+**  A snapshot is taken under the segment's seqlock: the sequence is read,
+**  the segment copied and the sequence read again, and the copy is kept only
+**  if both reads are the same even number. The reader never writes to the
+**  segment, so any number of readers can watch one XLL. Percentiles come
+**  from the power-of-two latency buckets, interpolated within the bucket.
+**  The reader stops after --samples samples, or when the XLL closes.
+**
+**  Usage: XllMetrics [options] dir/Module-pid.metrics
+**    --interval MS    between samples (default: the segment's own interval)
+**    --samples N      samples to print, 0 until the XLL closes (default 0)
+**    --csv            CSV instead of tables
+**    --all            include idle functions and zero counters
+*/
+
+#define _GNU_SOURCE
+#include <windows.h>
+#include <XLCALL.H>
+#include <stdlib.h>
+#include <string.h>
+#include "UdfHooks.h"
+#include "Metrics.h"
+
+#define SNAPSHOT_TRIES 1000
+
+typedef struct MetricsOptions
+{
+    const char* path;
+    int intervalMs;
+    int samples;
+    int csv;
+    int all;
+} MetricsOptions;
+
+static const char* g_vias[METRICS_VIAS] = { "Excel12f", "Excel12", "Excel12Direct" };
+
+// Copies a consistent snapshot of view into copy; FALSE if the writer kept it busy throughout
+static BOOL Snapshot(const MetricsHeader* view, MetricsHeader* copy, SIZE_T bytes)
+{
+    int tries;
+
+    for (tries = 0; tries < SNAPSHOT_TRIES; tries++)
+    {
+        LONGLONG before = ReadAcquire64(&view->sequence);
+        if (before & 1)
+        {
+            Sleep(0);
+            continue;
+        }
+        memcpy(copy, view, bytes);
+        MemoryBarrier();
+        if (ReadAcquire64(&view->sequence) == before)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Latency at quantile q of a function's buckets, in microseconds
+static double Percentile(const MetricsFunction* f, int buckets, double q)
+{
+    double target = q * (double)f->calls, seen = 0.0;
+    int b;
+
+    if (f->calls <= 0)
+        return 0.0;
+    for (b = 0; b < buckets; b++)
+    {
+        double n = (double)f->buckets[b];
+        if (n > 0.0 && seen + n >= target)
+        {
+            double lo = b == 0 ? 0.0 : (double)(1ull << (b - 1));
+            double hi = (double)(1ull << b);
+            if (b == buckets - 1)
+                return lo;          // Open-ended: all we know is the lower bound
+            return lo + (hi - lo) * (target - seen) / n;
+        }
+        seen += n;
+    }
+    return (double)f->maxNs / 1000.0;
+}
+
+static void PrintSample(const MetricsOptions* opt, const MetricsHeader* h, const MetricsHeader* last, int sample)
+{
+    double seconds = last ? (double)(h->publishedTick - last->publishedTick) / 1000.0 : 0.0;
+    UINT32 i;
+    int v;
+
+    if (!opt->csv)
+    {
+        printf("\n%ls pid %u  publish %lld  %s  (publish took %llu us)\n", h->module, h->pid, h->publishes,
+            h->state == METRICS_CLOSED ? "closed" : "open", h->publishUs);
+        printf("  %-24s %12s %10s %10s %10s %10s %10s %12s %12s\n", "function", "calls", "calls/s", "mean us",
+            "p50 us", "p99 us", "max us", "alloc bytes", "live bytes");
+    }
+    for (i = 0; i < h->functions; i++)
+    {
+        const MetricsFunction* f = METRICS_FUNCTION(h, i);
+        const MetricsFunction* was = last && i < last->functions ? METRICS_FUNCTION(last, i) : NULL;
+        double rate = was && seconds > 0.0 ? (double)(f->calls - was->calls) / seconds : 0.0;
+        double mean = f->calls ? (double)f->totalNs / (double)f->calls / 1000.0 : 0.0;
+        double p50 = Percentile(f, (int)h->buckets, 0.50), p99 = Percentile(f, (int)h->buckets, 0.99);
+
+        if (!f->calls && !f->allocs && !opt->all)
+            continue;
+        if (opt->csv)
+            printf("%d,%llu,function,%ls,%lld,%.1f,%.3f,%.3f,%.3f,%.3f,%lld,%lld,\n", sample, h->publishedTick,
+                f->name, f->calls, rate, mean, p50, p99, (double)f->maxNs / 1000.0, f->allocBytes, f->liveBytes);
+        else
+            printf("  %-24ls %12lld %10.0f %10.3f %10.3f %10.3f %10.3f %12lld %12lld\n", f->name, f->calls, rate,
+                mean, p50, p99, (double)f->maxNs / 1000.0, f->allocBytes, f->liveBytes);
+    }
+    for (v = 0; v < METRICS_VIAS; v++)
+    {
+        double mean = h->callbacks[v] ? (double)h->callbackNs[v] / (double)h->callbacks[v] / 1000.0 : 0.0;
+        if (!h->callbacks[v] && !opt->all)
+            continue;
+        if (opt->csv)
+            printf("%d,%llu,callback,%s,%lld,,%.3f,,,,,,\n", sample, h->publishedTick, g_vias[v], h->callbacks[v], mean);
+        else
+            printf("  callback %-15s %12lld %10s %10.3f\n", g_vias[v], h->callbacks[v], "", mean);
+    }
+    for (i = 0; i < (UINT32)h->countersUsed && i < h->counters; i++)
+    {
+        const MetricsCounter* c = METRICS_COUNTER(h, i);
+        if (c->value == 0.0 && !opt->all)
+            continue;
+        if (opt->csv)
+            printf("%d,%llu,counter,%ls,,,,,,,,,%.6g\n", sample, h->publishedTick, c->name, c->value);
+        else
+            printf("  %-36ls %14.6g\n", c->name, c->value);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    MetricsOptions opt = { NULL, 0, 0, 0, 0 };
+    MetricsHeader *view, *copy, *last;
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+    SIZE_T bytes;
+    int a, sample;
+
+    for (a = 1; a < argc && strncmp(argv[a], "--", 2) == 0; a++)
+    {
+        if (!strcmp(argv[a], "--interval") && a + 1 < argc) opt.intervalMs = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--samples") && a + 1 < argc) opt.samples = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--csv")) opt.csv = 1;
+        else if (!strcmp(argv[a], "--all")) opt.all = 1;
+        else
+        {
+            fprintf(stderr, "XllMetrics: unknown option %s\n", argv[a]);
+            return 2;
+        }
+    }
+    if (a < argc)
+        opt.path = argv[a];
+    if (!opt.path)
+    {
+        fprintf(stderr, "usage: XllMetrics [--interval MS] [--samples N] [--csv] [--all] dir/Module-pid.metrics\n");
+        return 2;
+    }
+
+    {
+        WCHAR path[MAX_PATH];
+        mbstowcs(path, opt.path, MAX_PATH);
+        file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)sizeof(MetricsHeader))
+    {
+        fprintf(stderr, "XllMetrics: cannot open %s\n", opt.path);
+        return 1;
+    }
+    bytes = (SIZE_T)size.QuadPart;
+    mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    view = mapping ? (MetricsHeader*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, bytes) : NULL;
+    copy = (MetricsHeader*)malloc(bytes);
+    last = (MetricsHeader*)malloc(bytes);
+    if (!view || !copy || !last)
+    {
+        fprintf(stderr, "XllMetrics: cannot map %s\n", opt.path);
+        return 1;
+    }
+
+    if (!Snapshot(view, copy, bytes) || copy->magic != METRICS_MAGIC || copy->version != METRICS_VERSION
+        || copy->headerBytes + (SIZE_T)copy->functions * copy->functionBytes + (SIZE_T)copy->counters * copy->counterBytes > bytes)
+    {
+        fprintf(stderr, "XllMetrics: %s is not a version %d metrics segment\n", opt.path, METRICS_VERSION);
+        return 1;
+    }
+    if (opt.intervalMs <= 0)
+        opt.intervalMs = (int)copy->intervalMs;
+    if (opt.csv)
+        printf("sample,tick,kind,name,calls,callsPerSec,meanUs,p50Us,p99Us,maxUs,allocBytes,liveBytes,value\n");
+
+    for (sample = 0; opt.samples <= 0 || sample < opt.samples; sample++)
+    {
+        if (sample > 0)
+        {
+            Sleep((DWORD)opt.intervalMs);
+            memcpy(last, copy, bytes);
+            if (!Snapshot(view, copy, bytes))
+            {
+                fprintf(stderr, "XllMetrics: no consistent snapshot after %d tries\n", SNAPSHOT_TRIES);
+                continue;
+            }
+        }
+        PrintSample(&opt, copy, sample > 0 ? last : NULL, sample);
+        if (copy->state == METRICS_CLOSED)
+            break;
+    }
+
+    UnmapViewOfFile(view);
+    CloseHandle(mapping);
+    CloseHandle(file);
+    free(copy);
+    free(last);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Builds the XLLs as Linux shared objects plus the stand-in host benchmarks.
+# Output goes to Bench/out (override with OUT=dir).
+set -e
+cd "$(dirname "$0")"
+OUT=${OUT:-out}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O2 -g -Wall"}
+mkdir -p "$OUT"
+
+for XLL in ThreadSafeC MultithreadCrash; do
+    $CC $CFLAGS -pthread -fPIC -shared -fvisibility=hidden -Icompat -I../$XLL/SDK/include -I../Common \
+        ../$XLL/$XLL.c ../Common/*.c -o "$OUT/$XLL.so" -lm
+done
+
+HOST="-Icompat -I../ThreadSafeC/SDK/include XlHost.c"
+$CC $CFLAGS -pthread -rdynamic $HOST ScalingSweep.c -o "$OUT/ScalingSweep" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST WarmStart.c -o "$OUT/WarmStart" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST TraceReplay.c -o "$OUT/TraceReplay" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST FanIn.c -o "$OUT/FanIn" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST RecalcSim.c -o "$OUT/RecalcSim" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST CallPaths.c -o "$OUT/CallPaths" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST Rundll.c -o "$OUT/Rundll" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST Workers.c -o "$OUT/Workers" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST Handles.c -o "$OUT/Handles" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST Cancel.c -o "$OUT/Cancel" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST RangeAgg.c -o "$OUT/RangeAgg" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST ThreadUsage.c -o "$OUT/ThreadUsage" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST Reduce.c -o "$OUT/Reduce" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST Lookup.c -o "$OUT/Lookup" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic -I../Common $HOST XllMetrics.c -o "$OUT/XllMetrics" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST MonteCarlo.c -o "$OUT/MonteCarlo" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic -I../Common $HOST BatchServer.c -o "$OUT/BatchServer" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic -I../Common $HOST Batching.c -o "$OUT/Batching" -ldl -lm
+$CC $CFLAGS -Icompat -I../ThreadSafeC/SDK/include -I../Common RefDataPack.c -o "$OUT/RefDataPack" -lm
+$CC $CFLAGS -pthread -rdynamic $HOST RefData.c -o "$OUT/RefData" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST Marshal.c -o "$OUT/Marshal" -ldl -lm
+$CC $CFLAGS -pthread -rdynamic $HOST NestProbe.c -o "$OUT/NestProbe" -ldl -lm
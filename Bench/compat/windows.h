@@ -0,0 +1,440 @@
+/*
+**  Bench compat: windows.h
+**
+**  Minimal Win32 subset used by the XLL sources, so that ThreadSafeC.c and
+**  MultithreadCrash.c compile unchanged on Linux against the stand-in Excel
+**  host (XlHost.c). Everything that has observable cost (allocation, sleeping,
+**  locking, the callback itself) is implemented by the host executable so it
+**  can be timed; the .so files resolve these symbols from the host at load.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <wchar.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Calling conventions and storage classes are no-ops on the SysV ABI */
+#define WINAPI
+#define CALLBACK
+#define APIENTRY
+#define pascal
+#define _cdecl
+#define __cdecl
+#define cdecl
+#define __stdcall
+#define far
+#define near
+
+#define __declspec(x) __declspec_##x
+#define __declspec_dllexport __attribute__((visibility("default")))
+#define __declspec_dllimport
+#define __declspec_thread __thread
+#define __declspec_noinline __attribute__((noinline))
+#define __declspec_align(n) __attribute__((aligned(n)))
+
+#define __forceinline inline __attribute__((always_inline))
+
+/* Basic types (LP64: DWORD stays unsigned long so %lu format strings match) */
+typedef unsigned char UINT8;
+typedef short INT16;
+typedef unsigned short UINT16;
+typedef int INT32;
+typedef unsigned int UINT32;
+typedef long long INT64;
+typedef unsigned long long UINT64;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef unsigned long DWORD;
+typedef unsigned long ULONG;
+typedef long LONG;
+typedef unsigned short WORD;
+typedef unsigned char BYTE;
+typedef unsigned int UINT;
+typedef int INT;
+typedef wchar_t WCHAR;
+typedef char CHAR;
+typedef void VOID;
+typedef void* PVOID;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+typedef void* HANDLE;
+typedef void* HMODULE;
+typedef void* HINSTANCE;
+typedef void* HGLOBAL;
+typedef void* HWND;
+typedef uintptr_t DWORD_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef uintptr_t SIZE_T;
+typedef intptr_t INT_PTR;
+typedef intptr_t LONG_PTR;
+typedef char* LPSTR;
+typedef const char* LPCSTR;
+typedef wchar_t* LPWSTR;
+typedef const wchar_t* LPCWSTR;
+typedef int errno_t;
+typedef intptr_t (*FARPROC)(void);
+typedef struct tagPOINT { LONG x; LONG y; } POINT;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+#ifndef NOMINMAX
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#define _TRUNCATE ((size_t)-1)
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#define CopyMemory(d, s, n) memcpy((d), (s), (n))
+
+#define GMEM_FIXED    0x0000
+#define GMEM_ZEROINIT 0x0040
+#define GPTR          (GMEM_FIXED | GMEM_ZEROINIT)
+
+#define INFINITE 0xFFFFFFFFul
+#define MAX_PATH 260
+#define MAXLONGLONG 0x7FFFFFFFFFFFFFFFll
+
+/* Process, thread and timing (implemented by XlHost.c) */
+HGLOBAL GlobalAlloc(UINT uFlags, SIZE_T dwBytes);
+HGLOBAL GlobalFree(HGLOBAL hMem);
+SIZE_T  GlobalSize(HGLOBAL hMem);
+void    Sleep(DWORD dwMilliseconds);
+DWORD   GetCurrentThreadId(void);
+DWORD   GetTickCount(void);
+void    OutputDebugStringW(LPCWSTR lpOutputString);
+void    OutputDebugStringA(LPCSTR lpOutputString);
+HMODULE GetModuleHandleA(LPCSTR lpModuleName);
+FARPROC GetProcAddress(HMODULE hModule, LPCSTR lpProcName);
+
+#define DLL_PROCESS_DETACH    0
+#define DLL_PROCESS_ATTACH    1
+#define DLL_THREAD_ATTACH     2
+#define DLL_THREAD_DETACH     3
+#define ALL_PROCESSOR_GROUPS  0xffff
+
+/* The loader entry point: XlHost finds it by name, so it must stay visible (BOOL is int) */
+int DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) __attribute__((visibility("default")));
+
+static inline DWORD GetActiveProcessorCount(WORD groupNumber)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    (void)groupNumber;
+    return n > 0 ? (DWORD)n : 1;
+}
+
+static inline ULONGLONG GetTickCount64(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000ull + (ULONGLONG)ts.tv_nsec / 1000000ull;
+}
+
+static inline DWORD GetEnvironmentVariableW(LPCWSTR name, LPWSTR buffer, DWORD size)
+{
+    char narrow[256];
+    const char* value;
+    size_t n;
+    if (wcstombs(narrow, name, sizeof(narrow)) >= sizeof(narrow)) return 0;
+    value = getenv(narrow);
+    if (!value) return 0;
+    n = mbstowcs(NULL, value, 0);
+    if (n == (size_t)-1) return 0;
+    if (n + 1 > size) return (DWORD)(n + 1);
+    mbstowcs(buffer, value, size);
+    return (DWORD)n;
+}
+
+typedef union _LARGE_INTEGER { long long QuadPart; } LARGE_INTEGER;
+int QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount);
+int QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency);
+
+static inline DWORD GetCurrentProcessId(void)
+{
+    return (DWORD)getpid();
+}
+
+/* Files and file mappings: enough for one shared view of a whole file, read-write or read-only */
+#define INVALID_HANDLE_VALUE   ((HANDLE)(intptr_t)-1)
+#define GENERIC_READ           0x80000000ul
+#define GENERIC_WRITE          0x40000000ul
+#define FILE_SHARE_READ        0x1
+#define FILE_SHARE_WRITE       0x2
+#define FILE_SHARE_DELETE      0x4
+#define OPEN_EXISTING          3
+#define OPEN_ALWAYS            4
+#define FILE_ATTRIBUTE_NORMAL  0x80
+#define PAGE_READONLY          0x02
+#define PAGE_READWRITE         0x04
+#define FILE_MAP_READ          0x0004
+#define FILE_MAP_ALL_ACCESS    0xF001F
+
+/* Handles above 65535 point at a kernel object; the kind tells CloseHandle what it is */
+#define COMPAT_KIND_MAPPING    1
+#define COMPAT_KIND_SEMAPHORE  2
+#define COMPAT_KIND_PROCESS    3
+#define COMPAT_KIND_THREAD     4
+
+typedef struct _COMPAT_MAPPING { int kind; int fd; size_t bytes; } COMPAT_MAPPING;
+
+int XlHostCloseObject(HANDLE h);    /* Semaphores, processes and threads (XlHost.c) */
+
+static inline HANDLE CreateFileW(LPCWSTR path, DWORD access, DWORD share, void* security,
+    DWORD disposition, DWORD flags, HANDLE templ)
+{
+    char p[1024];
+    int fd;
+    (void)share; (void)security; (void)flags; (void)templ;
+    if (wcstombs(p, path, sizeof(p)) >= sizeof(p)) return INVALID_HANDLE_VALUE;
+    fd = open(p, ((access & GENERIC_WRITE) ? O_RDWR : O_RDONLY) | (disposition == OPEN_EXISTING ? 0 : O_CREAT), 0666);
+    return fd < 0 ? INVALID_HANDLE_VALUE : (HANDLE)(intptr_t)(fd + 1);
+}
+
+static inline int GetFileSizeEx(HANDLE file, LARGE_INTEGER* size)
+{
+    struct stat st;
+    if (fstat((int)(intptr_t)file - 1, &st) != 0) return FALSE;
+    size->QuadPart = (long long)st.st_size;
+    return TRUE;
+}
+
+static inline HANDLE CreateFileMappingW(HANDLE file, void* security, DWORD protect,
+    DWORD sizeHigh, DWORD sizeLow, LPCWSTR name)
+{
+    COMPAT_MAPPING* m;
+    struct stat st;
+    int fd = (int)(intptr_t)file - 1;
+    size_t bytes = ((size_t)sizeHigh << 32) | (size_t)sizeLow;
+    (void)security; (void)protect; (void)name;
+    if (fstat(fd, &st) != 0) return NULL;
+    if ((size_t)st.st_size < bytes && ftruncate(fd, (off_t)bytes) != 0) return NULL;
+    m = (COMPAT_MAPPING*)malloc(sizeof(*m));
+    if (!m) return NULL;
+    m->kind = COMPAT_KIND_MAPPING;
+    m->fd = dup(fd);
+    m->bytes = bytes ? bytes : (size_t)st.st_size;
+    return (HANDLE)m;
+}
+
+static inline LPVOID MapViewOfFile(HANDLE mapping, DWORD access, DWORD offHigh, DWORD offLow, SIZE_T bytes)
+{
+    COMPAT_MAPPING* m = (COMPAT_MAPPING*)mapping;
+    size_t* view;
+    void* p;
+    int prot = access == FILE_MAP_READ ? PROT_READ : PROT_READ | PROT_WRITE;
+    (void)offHigh; (void)offLow;
+    if (!bytes) bytes = m->bytes;
+    /* One extra page in front remembers the length for UnmapViewOfFile */
+    p = mmap(NULL, bytes + 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    if (mmap((char*)p + 4096, bytes, prot, MAP_SHARED | MAP_FIXED, m->fd, 0) == MAP_FAILED
+        || mprotect(p, 4096, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(p, bytes + 4096);
+        return NULL;
+    }
+    view = (size_t*)p;
+    *view = bytes;
+    return (char*)p + 4096;
+}
+
+static inline int UnmapViewOfFile(LPCVOID address)
+{
+    size_t* view = (size_t*)((char*)address - 4096);
+    return munmap(view, *view + 4096) == 0;
+}
+
+static inline int CloseHandle(HANDLE h)
+{
+    if (!h || h == INVALID_HANDLE_VALUE) return FALSE;
+    if ((intptr_t)h < 65536)    /* file handle: fd + 1 */
+        return close((int)(intptr_t)h - 1) == 0;
+    if (((COMPAT_MAPPING*)h)->kind != COMPAT_KIND_MAPPING)
+        return XlHostCloseObject(h);
+    close(((COMPAT_MAPPING*)h)->fd);
+    free(h);
+    return TRUE;
+}
+
+static inline DWORD GetTempPathW(DWORD size, LPWSTR buffer)
+{
+    const char* dir = getenv("TMPDIR");
+    size_t n;
+    if (!dir || !*dir) dir = "/tmp";
+    n = mbstowcs(NULL, dir, 0);
+    if (n == (size_t)-1 || n + 2 > size) return (DWORD)(n + 2);
+    mbstowcs(buffer, dir, size);
+    if (buffer[n - 1] != L'/') { buffer[n++] = L'/'; buffer[n] = 0; }
+    return (DWORD)n;
+}
+
+static inline int DeleteFileW(LPCWSTR path)
+{
+    char p[1024];
+    if (wcstombs(p, path, sizeof(p)) >= sizeof(p)) return FALSE;
+    return unlink(p) == 0;
+}
+
+/* Named semaphores and processes (implemented by XlHost.c). A semaphore lives in
+   a small shared file under /dev/shm, so two processes opening the same name share
+   it as on Windows; waits and releases are futex operations on its count. */
+#define WAIT_OBJECT_0          0x00000000ul
+#define WAIT_TIMEOUT           0x00000102ul
+#define WAIT_FAILED            0xFFFFFFFFul
+#define STILL_ACTIVE           259
+#define CREATE_NO_WINDOW       0x08000000ul
+#define SYNCHRONIZE            0x00100000ul
+#define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+
+typedef struct _STARTUPINFOW { DWORD cb; DWORD dwFlags; WORD wShowWindow; } STARTUPINFOW, *LPSTARTUPINFOW;
+typedef struct _PROCESS_INFORMATION
+{
+    HANDLE hProcess;
+    HANDLE hThread;
+    DWORD dwProcessId;
+    DWORD dwThreadId;
+} PROCESS_INFORMATION, *LPPROCESS_INFORMATION;
+
+/* Threads run on pthreads; WaitForSingleObject waits for the thread to return */
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID parameter);
+HANDLE CreateThread(void* security, SIZE_T stackSize, LPTHREAD_START_ROUTINE start, LPVOID parameter,
+                    DWORD creationFlags, DWORD* threadId);
+
+HANDLE CreateSemaphoreW(void* security, LONG initialCount, LONG maximumCount, LPCWSTR name);
+int    ReleaseSemaphore(HANDLE semaphore, LONG releaseCount, LONG* previousCount);
+DWORD  WaitForSingleObject(HANDLE handle, DWORD milliseconds);
+
+/* rundll32 command lines run the host's stand-in (Bench/out/Rundll); nothing else is supported */
+int    CreateProcessW(LPCWSTR application, LPWSTR commandLine, void* processAttributes, void* threadAttributes,
+                      int inheritHandles, DWORD creationFlags, void* environment, LPCWSTR currentDirectory,
+                      LPSTARTUPINFOW startupInfo, LPPROCESS_INFORMATION processInformation);
+HANDLE OpenProcess(DWORD access, int inheritHandle, DWORD processId);
+int    GetExitCodeProcess(HANDLE process, DWORD* exitCode);
+int    TerminateProcess(HANDLE process, UINT exitCode);
+
+/* Locks: instrumented by the host so the sweep can report lock wait time */
+typedef struct _CRITICAL_SECTION { void* impl; } CRITICAL_SECTION, *LPCRITICAL_SECTION;
+void InitializeCriticalSection(LPCRITICAL_SECTION cs);
+void DeleteCriticalSection(LPCRITICAL_SECTION cs);
+void EnterCriticalSection(LPCRITICAL_SECTION cs);
+void LeaveCriticalSection(LPCRITICAL_SECTION cs);
+
+typedef struct _SRWLOCK { void* impl; } SRWLOCK, *PSRWLOCK;
+#define SRWLOCK_INIT { 0 }
+void InitializeSRWLock(PSRWLOCK lock);
+void AcquireSRWLockExclusive(PSRWLOCK lock);
+void ReleaseSRWLockExclusive(PSRWLOCK lock);
+void AcquireSRWLockShared(PSRWLOCK lock);
+void ReleaseSRWLockShared(PSRWLOCK lock);
+
+/* WaitOnAddress family (futex based; time blocked is reported as lock wait) */
+int  WaitOnAddress(volatile void* address, PVOID compare, SIZE_T size, DWORD milliseconds);
+void WakeByAddressSingle(PVOID address);
+void WakeByAddressAll(PVOID address);
+
+/* Interlocked family maps directly onto the GCC builtins */
+#define InterlockedIncrement(p)            __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)            __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p)          __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(p)          __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)       __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(p, v)     __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v)          __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(p, v)        __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(p, v)   __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOr(p, v)                __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(p, v)               __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, x, c)        __sync_val_compare_and_swap((p), (c), (x))
+#define InterlockedCompareExchange64(p, x, c)      __sync_val_compare_and_swap((p), (c), (x))
+#define InterlockedCompareExchangePointer(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#define MemoryBarrier()                    __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ReadAcquire(p)                     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define WriteRelease(p, v)                 __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ReadAcquire64(p)                   __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define WriteRelease64(p, v)               __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor()                   __builtin_ia32_pause()
+#else
+#define YieldProcessor()                   __asm__ __volatile__("yield")
+#endif
+
+/* Secure CRT subset */
+static inline int _vsnwprintf_s(wchar_t* buf, size_t size, size_t count, const wchar_t* fmt, va_list args)
+{
+    (void)count;
+    int n = vswprintf(buf, size, fmt, args);
+    if (n < 0 && size > 0) buf[size - 1] = L'\0';
+    return n;
+}
+
+#define swprintf_s swprintf
+#define _snwprintf_s(buf, size, count, ...) swprintf((buf), (size), __VA_ARGS__)
+#define sprintf_s snprintf
+#define _wcsicmp wcscasecmp
+#define _snprintf_s(buf, size, count, ...) snprintf((buf), (size), __VA_ARGS__)
+
+static inline errno_t wcsncpy_s(wchar_t* dest, size_t destsz, const wchar_t* src, size_t count)
+{
+    size_t n = 0;
+    if (!dest || destsz == 0) return EINVAL;
+    while (n < count && n + 1 < destsz && src[n]) { dest[n] = src[n]; n++; }
+    dest[n] = L'\0';
+    return 0;
+}
+
+static inline errno_t wcscpy_s(wchar_t* dest, size_t destsz, const wchar_t* src)
+{
+    return wcsncpy_s(dest, destsz, src, (size_t)-1);
+}
+
+static inline errno_t wcsncat_s(wchar_t* dest, size_t destsz, const wchar_t* src, size_t count)
+{
+    size_t d = 0;
+    if (!dest || destsz == 0) return EINVAL;
+    while (d < destsz && dest[d]) d++;
+    if (d == destsz) return EINVAL;
+    return wcsncpy_s(dest + d, destsz - d, src, count);
+}
+
+static inline errno_t wcscat_s(wchar_t* dest, size_t destsz, const wchar_t* src)
+{
+    return wcsncat_s(dest, destsz, src, (size_t)-1);
+}
+
+static inline errno_t _wfopen_s(FILE** file, const wchar_t* path, const wchar_t* mode)
+{
+    char p[1024], m[16];
+    if (wcstombs(p, path, sizeof(p)) >= sizeof(p) || wcstombs(m, mode, sizeof(m)) >= sizeof(m))
+        return EINVAL;
+    *file = fopen(p, m);
+    return *file ? 0 : errno;
+}
+
+static inline errno_t strcpy_s(char* dest, size_t destsz, const char* src)
+{
+    if (!dest || destsz == 0) return EINVAL;
+    snprintf(dest, destsz, "%s", src);
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,3 @@
+/* Bench compat: lower-case include name used by ThreadSafeC.c */
+#pragma once
+#include <XLCALL.H>
@@ -0,0 +1,381 @@
+/*
+**  AllocTrack
+**
+**  Per-function, per-thread allocation accounting. See AllocTrack.h.
+**
+**  Counters live in one slot per thread, so the allocating thread is their
+**  only writer and no interlocked operation is needed on the hot path. Each
+**  function gets its own 64-byte counter block inside the slot. A block freed
+**  by another thread is charged to the allocating thread's slot through its
+**  remote counters, which only take interlocked adds. Threads beyond
+**  ALLOCTRACK_MAX_THREADS share an overflow slot updated with interlocked adds.
+**  Readers sum the slots without locking; on x64 the 64-bit counters cannot
+**  tear, so a snapshot is at worst a few operations stale.
+**
+**  Only GMEM_FIXED memory is supported (the header sits in front of the block).
+*/
+
+#define ALLOCTRACK_IMPL
+#include <windows.h>
+#include <stdio.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+#include "XlHelpers.h"
+#include "AllocTrack.h"
+
+#define ALLOC_FUNCS      (UDF_MAX_FUNCS + 1)     // index 0 = outside any UDF
+#define ALLOC_COLUMNS    9
+
+typedef struct AllocHeader
+{
+    SIZE_T size;
+    WORD   fn;
+    WORD   reserved;
+    LONG   slot;        // Allocating thread's slot; ALLOCTRACK_MAX_THREADS: the overflow slot
+} AllocHeader;
+
+// One cache line per function so a thread's hot counters never straddle two
+typedef struct AllocCounters
+{
+    LONGLONG allocs;
+    LONGLONG frees;             // Frees on the allocating thread
+    LONGLONG allocBytes;
+    LONGLONG freeBytes;
+    LONGLONG peak;
+    LONGLONG autoFrees;         // xlAutoFree12 calls on this thread
+    LONGLONG remoteFrees;       // Frees on other threads: interlocked only
+    LONGLONG remoteFreeBytes;
+} AllocCounters;
+
+typedef struct AllocThreadSlot
+{
+    AllocCounters fn[ALLOC_FUNCS];
+    DWORD     threadId;
+    LONG      index;
+    int       shared;
+    ULONGLONG firstTick;
+} AllocThreadSlot;
+
+static AllocThreadSlot* g_allocSlots[ALLOCTRACK_MAX_THREADS];
+static volatile LONG g_allocSlotCount = 0;
+static ULONGLONG g_allocStartTick = 0;
+static __declspec(align(64)) AllocThreadSlot g_allocOverflow;
+static __declspec(thread) AllocThreadSlot* tls_allocSlot = NULL;
+
+static AllocThreadSlot* AllocSlot(void)
+{
+    AllocThreadSlot* slot = tls_allocSlot;
+    LONG index;
+    BYTE* raw;
+
+    if (slot)
+        return slot;
+
+    if (!g_allocStartTick)
+        g_allocStartTick = GetTickCount64();
+
+    index = InterlockedIncrement(&g_allocSlotCount) - 1;
+    raw = index < ALLOCTRACK_MAX_THREADS
+        ? (BYTE*)GlobalAlloc(GMEM_FIXED | GMEM_ZEROINIT, sizeof(AllocThreadSlot) + 64)
+        : NULL;
+    if (raw)
+    {
+        // Slots are never freed: a thread's history stays reportable after it exits
+        slot = (AllocThreadSlot*)(((ULONG_PTR)raw + 63) & ~(ULONG_PTR)63);
+        slot->threadId = GetCurrentThreadId();
+        slot->index = index;
+        slot->firstTick = GetTickCount64();
+        (void)InterlockedExchangePointer((PVOID*)&g_allocSlots[index], slot);
+    }
+    else
+    {
+        slot = &g_allocOverflow;
+        slot->index = ALLOCTRACK_MAX_THREADS;
+        slot->shared = 1;
+        if (!slot->firstTick)
+            slot->firstTick = GetTickCount64();
+    }
+    tls_allocSlot = slot;
+    return slot;
+}
+
+static __forceinline void AllocAdd(const AllocThreadSlot* slot, LONGLONG* field, LONGLONG value)
+{
+    if (slot->shared)
+        InterlockedExchangeAdd64(field, value);
+    else
+        *field += value;
+}
+
+static __forceinline AllocThreadSlot* AllocSlotAt(LONG index)
+{
+    return index < ALLOCTRACK_MAX_THREADS ? g_allocSlots[index] : &g_allocOverflow;
+}
+
+static __forceinline LONGLONG AllocLive(const AllocCounters* c)
+{
+    return c->allocBytes - c->freeBytes - c->remoteFreeBytes;
+}
+
+static __forceinline int AllocFunctionIndex(void)
+{
+    int fn = tls_udfCurrent;
+    return (fn >= 0 && fn < UDF_MAX_FUNCS) ? fn + 1 : 0;
+}
+
+HGLOBAL AllocTrackAlloc(UINT flags, SIZE_T bytes)
+{
+    AllocHeader* h = (AllocHeader*)GlobalAlloc(flags, sizeof(AllocHeader) + bytes);
+    AllocThreadSlot* slot;
+    AllocCounters* c;
+    int fn;
+
+    if (!h)
+        return NULL;
+
+    fn = AllocFunctionIndex();
+    slot = AllocSlot();
+    h->size = bytes;
+    h->fn = (WORD)fn;
+    h->reserved = 0;
+    h->slot = slot->index;
+
+    c = &slot->fn[fn];
+    AllocAdd(slot, &c->allocs, 1);
+    AllocAdd(slot, &c->allocBytes, (LONGLONG)bytes);
+    if (AllocLive(c) > c->peak)
+        c->peak = AllocLive(c);
+    return (HGLOBAL)(h + 1);
+}
+
+HGLOBAL AllocTrackFree(HGLOBAL mem)
+{
+    AllocHeader* h;
+    AllocThreadSlot* owner;
+    AllocCounters* c;
+
+    if (!mem)
+        return NULL;
+
+    // Every block freed here came from AllocTrackAlloc (see AllocTrack.h)
+    h = (AllocHeader*)mem - 1;
+    owner = AllocSlotAt(h->slot);
+    c = &owner->fn[h->fn];
+    if (owner == tls_allocSlot && !owner->shared)
+    {
+        c->frees++;
+        c->freeBytes += (LONGLONG)h->size;
+    }
+    else
+    {
+        InterlockedExchangeAdd64(&c->remoteFrees, 1);
+        InterlockedExchangeAdd64(&c->remoteFreeBytes, (LONGLONG)h->size);
+    }
+    return GlobalFree(h);
+}
+
+void AllocTrackAutoFree(LPXLOPER12 result)
+{
+#ifndef ALLOCTRACK_DISABLED
+    AllocHeader* h;
+    AllocThreadSlot* slot;
+
+    if (!result)
+        return;
+    h = (AllocHeader*)result - 1;
+    slot = AllocSlot();
+    AllocAdd(slot, &slot->fn[h->fn].autoFrees, 1);
+#else
+    (void)result;
+#endif
+}
+
+/*
+** Reporting
+*/
+typedef struct AllocRow
+{
+    int       fn;
+    DWORD     threadId;
+    ULONGLONG sinceTick;
+    AllocCounters c;
+} AllocRow;
+
+static void AllocAccumulate(AllocCounters* total, const AllocCounters* c)
+{
+    total->allocs += c->allocs;
+    total->frees += c->frees + c->remoteFrees;
+    total->allocBytes += c->allocBytes;
+    total->freeBytes += c->freeBytes + c->remoteFreeBytes;
+    total->peak += c->peak;     // Sum of per-thread peaks: an upper bound on the true peak
+    total->autoFrees += c->autoFrees;
+}
+
+static int AllocSlotCount(void)
+{
+    LONG n = g_allocSlotCount;
+    return n < ALLOCTRACK_MAX_THREADS ? (int)n : ALLOCTRACK_MAX_THREADS;
+}
+
+// Fills rows (if given) and returns how many there are
+static int AllocCollect(int detail, AllocRow* rows, int capacity)
+{
+    int count = 0, fn, s, slots = AllocSlotCount();
+    int fnCount = UdfFunctionCount() + 1;
+    AllocThreadSlot* overflow = g_allocOverflow.shared ? &g_allocOverflow : NULL;
+
+    for (fn = 0; fn < fnCount; fn++)
+    {
+        AllocRow total;
+        ZeroMemory(&total, sizeof(total));
+        total.fn = fn;
+        total.sinceTick = g_allocStartTick;
+
+        for (s = 0; s <= slots; s++)
+        {
+            AllocThreadSlot* slot = s < slots ? g_allocSlots[s] : overflow;
+            if (!slot || (slot->fn[fn].allocs == 0 && slot->fn[fn].autoFrees == 0))
+                continue;
+            if (detail)
+            {
+                if (rows && count < capacity)
+                {
+                    AllocRow* r = &rows[count];
+                    ZeroMemory(r, sizeof(*r));
+                    r->fn = fn;
+                    r->threadId = slot->shared ? 0 : slot->threadId;
+                    r->sinceTick = slot->firstTick;
+                    AllocAccumulate(&r->c, &slot->fn[fn]);
+                }
+                count++;
+            }
+            else
+            {
+                AllocAccumulate(&total.c, &slot->fn[fn]);
+            }
+        }
+        if (!detail)
+        {
+            if (rows && count < capacity)
+                rows[count] = total;
+            count++;
+        }
+    }
+    return count;
+}
+
+void AllocTrackTotals(int fn, LONGLONG* allocs, LONGLONG* allocBytes, LONGLONG* liveBytes)
+{
+    int index = (fn >= 0 && fn < UDF_MAX_FUNCS) ? fn + 1 : 0, s, slots = AllocSlotCount();
+    AllocThreadSlot* overflow = g_allocOverflow.shared ? &g_allocOverflow : NULL;
+
+    *allocs = *allocBytes = *liveBytes = 0;
+    for (s = 0; s <= slots; s++)
+    {
+        AllocThreadSlot* slot = s < slots ? g_allocSlots[s] : overflow;
+        if (!slot)
+            continue;
+        *allocs += slot->fn[index].allocs;
+        *allocBytes += slot->fn[index].allocBytes;
+        *liveBytes += AllocLive(&slot->fn[index]);
+    }
+}
+
+static double AllocRate(const AllocRow* r, ULONGLONG now)
+{
+    double seconds = r->sinceTick && now > r->sinceTick ? (double)(now - r->sinceTick) / 1000.0 : 0.0;
+    return seconds > 0.0 ? (double)r->c.allocBytes / seconds : 0.0;
+}
+
+LPXLOPER12 AllocTrackTable(int detail)
+{
+    static const wchar_t* header[ALLOC_COLUMNS] = {
+        L"Function", L"Thread", L"Allocs", L"Frees", L"AllocBytes",
+        L"LiveBytes", L"PeakBytes", L"BytesPerSec", L"AutoFree"
+    };
+    int count = AllocCollect(detail, NULL, 0);
+    AllocRow* rows = (AllocRow*)GlobalAlloc(GMEM_FIXED, (size_t)(count ? count : 1) * sizeof(AllocRow));
+    ULONGLONG now = GetTickCount64();
+    LPXLOPER12 table;
+    int i, j;
+
+    if (!rows)
+        return XlNewErr(xlerrNA);
+    count = AllocCollect(detail, rows, count);
+
+    table = XlNewMulti(count + 1, ALLOC_COLUMNS);
+    if (!table)
+    {
+        GlobalFree(rows);
+        return XlNewErr(xlerrNA);
+    }
+
+    for (j = 0; j < ALLOC_COLUMNS; j++)
+        XlSetStr(&table->val.array.lparray[j], header[j]);
+
+    for (i = 0; i < count; i++)
+    {
+        const AllocRow* r = &rows[i];
+        LPXLOPER12 cell = &table->val.array.lparray[(i + 1) * ALLOC_COLUMNS];
+        XlSetStr(&cell[0], UdfFunctionName(r->fn - 1));
+        if (detail)
+            XlSetNum(&cell[1], (double)r->threadId);
+        else
+            XlSetStr(&cell[1], L"all");
+        XlSetNum(&cell[2], (double)r->c.allocs);
+        XlSetNum(&cell[3], (double)r->c.frees);
+        XlSetNum(&cell[4], (double)r->c.allocBytes);
+        XlSetNum(&cell[5], (double)(r->c.allocBytes - r->c.freeBytes));
+        XlSetNum(&cell[6], (double)r->c.peak);
+        XlSetNum(&cell[7], AllocRate(r, now));
+        XlSetNum(&cell[8], (double)r->c.autoFrees);
+    }
+
+    GlobalFree(rows);
+    return table;
+}
+
+int AllocTrackDump(const wchar_t* path)
+{
+    wchar_t defaultPath[MAX_PATH];
+    ULONGLONG now = GetTickCount64();
+    AllocRow* rows;
+    FILE* f = NULL;
+    int count, i;
+
+    // No path: use %XLL_ALLOC_DUMP%\<module>-alloc.csv if the variable is set
+    if (!path || !path[0])
+    {
+        wchar_t dir[MAX_PATH - 64];
+        DWORD n = GetEnvironmentVariableW(L"XLL_ALLOC_DUMP", dir, (DWORD)_countof(dir));
+        if (n == 0 || n >= _countof(dir))
+            return -1;
+        swprintf_s(defaultPath, MAX_PATH, L"%ls/%ls-alloc.csv", dir, UdfModuleName());
+        path = defaultPath;
+    }
+
+    count = AllocCollect(1, NULL, 0);
+    rows = (AllocRow*)GlobalAlloc(GMEM_FIXED, (size_t)(count ? count : 1) * sizeof(AllocRow));
+    if (!rows)
+        return -1;
+    count = AllocCollect(1, rows, count);
+
+    if (_wfopen_s(&f, path, L"w") != 0 || !f)
+    {
+        GlobalFree(rows);
+        return -1;
+    }
+    fprintf(f, "module,function,thread,allocs,frees,alloc_bytes,live_bytes,peak_bytes,bytes_per_sec,auto_frees\n");
+    for (i = 0; i < count; i++)
+    {
+        const AllocRow* r = &rows[i];
+        fprintf(f, "%ls,%ls,%lu,%lld,%lld,%lld,%lld,%lld,%.0f,%lld\n",
+            UdfModuleName(), UdfFunctionName(r->fn - 1), r->threadId,
+            r->c.allocs, r->c.frees, r->c.allocBytes, r->c.allocBytes - r->c.freeBytes,
+            r->c.peak, AllocRate(r, now), r->c.autoFrees);
+    }
+    fclose(f);
+    GlobalFree(rows);
+    return count;
+}
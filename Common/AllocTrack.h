@@ -0,0 +1,50 @@
+/*
+**  AllocTrack
+**
+**  Allocation accounting for the XLLs. Including this header after windows.h
+**  routes GlobalAlloc/GlobalFree through wrappers that attribute every block
+**  to the UDF running on the calling thread (see UdfHooks.h) and count it in
+**  a per-thread slot, so the hot path is a TLS load and a few plain adds.
+**
+**  Each block carries a 16-byte header with its size, owning function and
+**  allocating thread's slot, so a free (including the ones done by
+**  xlAutoFree12 or by epoch reclamation on another thread) is charged back to
+**  the function and thread that allocated it. Live bytes, allocation rate and
+**  per-thread peak are reported per function, and per function and thread,
+**  through AllocTrackTable (for a UDF) and AllocTrackDump (CSV file).
+**
+**  The free wrapper trusts the header, so every source file of an XLL that
+**  calls GlobalFree must include this header: a block reaching it must have
+**  come from the tracked GlobalAlloc. Blocks that are never freed (the
+**  CallTrace and Timeline buffers) may come straight from GlobalAlloc.
+**
+**  Define ALLOCTRACK_DISABLED to compile the wrappers out.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define ALLOCTRACK_MAX_THREADS 256
+
+HGLOBAL AllocTrackAlloc(UINT flags, SIZE_T bytes);
+HGLOBAL AllocTrackFree(HGLOBAL mem);
+
+// Counts a result handed back by Excel to xlAutoFree12 against its function
+void AllocTrackAutoFree(LPXLOPER12 result);
+
+// detail = 0: one row per registered function; detail != 0: one row per function and thread
+LPXLOPER12 AllocTrackTable(int detail);
+
+// Allocations, bytes allocated and bytes still live for one function (UDF_NONE: outside
+// any UDF), summed over threads without locking
+void AllocTrackTotals(int fn, LONGLONG* allocs, LONGLONG* allocBytes, LONGLONG* liveBytes);
+
+// Writes the per function and thread table as CSV; returns rows written or -1
+int AllocTrackDump(const wchar_t* path);
+
+#if !defined(ALLOCTRACK_DISABLED) && !defined(ALLOCTRACK_IMPL)
+#define GlobalAlloc(flags, bytes)   AllocTrackAlloc((flags), (bytes))
+#define GlobalFree(mem)             AllocTrackFree(mem)
+#endif
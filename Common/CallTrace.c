@@ -0,0 +1,398 @@
+/*
+**  CallTrace
+**
+**  Binary UDF call recorder. See CallTrace.h for the file format.
+**
+**  Each thread appends to its own buffer; a full buffer is written to the
+**  file under g_traceLock. Stopping clears 'active', waits until no thread is
+**  inside CallTraceRecord (the per-buffer 'busy' flag) and then flushes every
+**  buffer, so no record is lost or torn. Trace buffers come straight from
+**  GlobalAlloc and are not charged to any UDF by AllocTrack.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+#include "CallTrace.h"
+
+#define TRACE_BUFFER_BYTES  (256 * 1024)
+#define TRACE_MAX_RECORD    (64 * 1024)
+#define TRACE_MAX_THREADS   256
+#define TRACE_MAX_TYPES     32
+
+typedef struct TraceBuffer
+{
+    volatile LONG busy;
+    LONGLONG records;
+    SIZE_T used;
+    BYTE data[TRACE_BUFFER_BYTES];
+} TraceBuffer;
+
+static CRITICAL_SECTION g_traceLock;
+static volatile LONG g_traceLockInit = 0;   // 0 none, 1 initialising, 2 ready
+static volatile LONG g_traceState = 0;      // 0 idle, 1 starting or stopping, 2 recording
+static volatile LONG g_traceActive = 0;
+static FILE* g_traceFile = NULL;
+static LONGLONG g_traceStart = 0;
+static LONGLONG g_traceFlushedRecords = 0;
+static TraceBuffer* g_traceBuffers[TRACE_MAX_THREADS];
+static volatile LONG g_traceBufferCount = 0;
+static __declspec(thread) TraceBuffer* tls_traceBuffer = NULL;
+
+static void TraceLockInit(void)
+{
+    if (InterlockedCompareExchange(&g_traceLockInit, 1, 0) == 0)
+    {
+        InitializeCriticalSection(&g_traceLock);
+        InterlockedExchange(&g_traceLockInit, 2);
+    }
+    while (ReadAcquire(&g_traceLockInit) != 2)
+        YieldProcessor();
+}
+
+static TraceBuffer* TraceThreadBuffer(void)
+{
+    TraceBuffer* buf = tls_traceBuffer;
+    LONG index;
+
+    if (buf)
+        return buf;
+    index = InterlockedIncrement(&g_traceBufferCount) - 1;
+    if (index >= TRACE_MAX_THREADS)
+        return NULL;    // Threads past the cap are not recorded
+    buf = (TraceBuffer*)GlobalAlloc(GMEM_FIXED | GMEM_ZEROINIT, sizeof(TraceBuffer));
+    g_traceBuffers[index] = buf;
+    tls_traceBuffer = buf;
+    return buf;
+}
+
+static void TraceFlush(TraceBuffer* buf)
+{
+    UINT32 bytes = (UINT32)buf->used;
+    if (!bytes)
+        return;
+    EnterCriticalSection(&g_traceLock);
+    if (g_traceFile)
+    {
+        fwrite(&bytes, sizeof(bytes), 1, g_traceFile);
+        fwrite(buf->data, 1, bytes, g_traceFile);
+        g_traceFlushedRecords += buf->records;
+    }
+    LeaveCriticalSection(&g_traceLock);
+    buf->used = 0;
+    buf->records = 0;
+}
+
+/*
+** Serialisation
+*/
+typedef struct TraceWriter
+{
+    BYTE* p;
+    BYTE* end;
+    int overflow;
+} TraceWriter;
+
+static void TracePut(TraceWriter* w, const void* data, SIZE_T bytes)
+{
+    if (w->overflow || (SIZE_T)(w->end - w->p) < bytes)
+    {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->p, data, bytes);
+    w->p += bytes;
+}
+
+static void TracePutTag(TraceWriter* w, BYTE tag)
+{
+    TracePut(w, &tag, 1);
+}
+
+static void TracePutNum(TraceWriter* w, double value)
+{
+    TracePutTag(w, CALLTRACE_ARG_NUM);
+    TracePut(w, &value, sizeof(value));
+}
+
+// Strings are stored as UTF-16 code units whatever the size of wchar_t
+static void TracePutStr(TraceWriter* w, const XCHAR* chars, SIZE_T len)
+{
+    UINT16 n = (UINT16)(len > 0xFFFF ? 0xFFFF : len);
+    UINT16 i;
+    TracePutTag(w, CALLTRACE_ARG_STR);
+    TracePut(w, &n, sizeof(n));
+    for (i = 0; i < n && !w->overflow; i++)
+    {
+        UINT16 c = (UINT16)chars[i];
+        TracePut(w, &c, sizeof(c));
+    }
+}
+
+static void TracePutOper(TraceWriter* w, const XLOPER12* x, int allowMulti)
+{
+    if (!x)
+    {
+        TracePutTag(w, CALLTRACE_ARG_MISSING);
+        return;
+    }
+    switch (x->xltype & ~(xlbitDLLFree | xlbitXLFree))
+    {
+    case xltypeNum:
+        TracePutNum(w, x->val.num);
+        break;
+    case xltypeInt:
+        TracePutNum(w, (double)x->val.w);
+        break;
+    case xltypeBool:
+        {
+            UINT8 b = x->val.xbool ? 1 : 0;
+            TracePutTag(w, CALLTRACE_ARG_BOOL);
+            TracePut(w, &b, 1);
+        }
+        break;
+    case xltypeErr:
+        {
+            INT32 e = (INT32)x->val.err;
+            TracePutTag(w, CALLTRACE_ARG_ERR);
+            TracePut(w, &e, sizeof(e));
+        }
+        break;
+    case xltypeStr:
+        if (x->val.str)
+            TracePutStr(w, &x->val.str[1], (SIZE_T)x->val.str[0]);
+        else
+            TracePutStr(w, NULL, 0);
+        break;
+    case xltypeMissing:
+        TracePutTag(w, CALLTRACE_ARG_MISSING);
+        break;
+    case xltypeNil:
+        TracePutTag(w, CALLTRACE_ARG_NIL);
+        break;
+    case xltypeMulti:
+        if (allowMulti && x->val.array.lparray)
+        {
+            UINT32 rows = (UINT32)x->val.array.rows, columns = (UINT32)x->val.array.columns, i;
+            TracePutTag(w, CALLTRACE_ARG_MULTI);
+            TracePut(w, &rows, sizeof(rows));
+            TracePut(w, &columns, sizeof(columns));
+            for (i = 0; i < rows * columns && !w->overflow; i++)
+                TracePutOper(w, &x->val.array.lparray[i], 0);
+            break;
+        }
+        TracePutTag(w, CALLTRACE_ARG_OTHER);
+        break;
+    default:
+        TracePutTag(w, CALLTRACE_ARG_OTHER);
+        break;
+    }
+}
+
+// Splits rgFuncs type text into codes ("B", "Q", "C%", ...); returns the count, return type first
+static int TraceTypeCodes(const wchar_t* text, wchar_t codes[][3], int max)
+{
+    int n = 0;
+    for (; text && *text && n < max; text++)
+    {
+        if ((*text >= L'A' && *text <= L'Z') || (*text >= L'a' && *text <= L'z'))
+        {
+            codes[n][0] = *text;
+            codes[n][1] = codes[n][2] = 0;
+            n++;
+        }
+        else if (*text == L'%' && n > 0)
+        {
+            codes[n - 1][1] = L'%';
+        }
+    }
+    return n;
+}
+
+static void TracePutArg(TraceWriter* w, const wchar_t* code, const void* arg)
+{
+    if (!arg)
+        TracePutTag(w, CALLTRACE_ARG_MISSING);
+    else if (code[0] == L'B' && !code[1])
+        TracePutNum(w, *(const double*)arg);
+    else if (code[0] == L'J' && !code[1])
+        TracePutNum(w, (double)*(const int*)arg);
+    else if ((code[0] == L'Q' || code[0] == L'U') && !code[1])
+        TracePutOper(w, *(const XLOPER12* const*)arg, 1);
+    else if (code[0] == L'C' && code[1] == L'%')
+    {
+        const XCHAR* s = *(const XCHAR* const*)arg;
+        TracePutStr(w, s, s ? wcslen(s) : 0);
+    }
+    else if (code[0] == L'D' && code[1] == L'%')
+    {
+        const XCHAR* s = *(const XCHAR* const*)arg;
+        TracePutStr(w, s ? s + 1 : NULL, s ? (SIZE_T)s[0] : 0);
+    }
+    else
+        TracePutTag(w, CALLTRACE_ARG_OTHER);
+}
+
+void CallTraceRecord(const UdfFrame* frame, LONGLONG endTicks)
+{
+    TraceBuffer* buf = TraceThreadBuffer();
+    wchar_t codes[TRACE_MAX_TYPES][3];
+    CallTraceEntry rec;
+    TraceWriter w;
+    int i, typeCount;
+
+    if (!buf)
+        return;
+    InterlockedExchange(&buf->busy, 1);
+    if (!ReadAcquire(&g_traceActive))
+    {
+        InterlockedExchange(&buf->busy, 0);
+        return;
+    }
+
+    if (TRACE_BUFFER_BYTES - buf->used < TRACE_MAX_RECORD)
+        TraceFlush(buf);
+
+    rec.thread = (UINT32)GetCurrentThreadId();
+    rec.fn = (UINT16)frame->fn;
+    rec.depth = (UINT8)(frame->depth > 255 ? 255 : frame->depth);
+    rec.argCount = (UINT8)frame->argCount;
+    rec.start = (UINT64)(frame->start > g_traceStart ? frame->start - g_traceStart : 0);
+    rec.end = (UINT64)(endTicks > g_traceStart ? endTicks - g_traceStart : 0);
+
+    w.p = buf->data + buf->used;
+    w.end = w.p + TRACE_MAX_RECORD;
+    w.overflow = 0;
+    TracePut(&w, &rec, sizeof(rec));
+
+    // Arguments that do not fit the record limit are stored as CALLTRACE_ARG_OTHER
+    typeCount = TraceTypeCodes(UdfFunctionType(frame->fn), codes, TRACE_MAX_TYPES);
+    for (i = 0; i < frame->argCount; i++)
+    {
+        BYTE* mark = w.p;
+        TracePutArg(&w, i + 1 < typeCount ? codes[i + 1] : L"", frame->args[i]);
+        if (w.overflow)
+        {
+            w.p = mark;
+            w.overflow = 0;
+            w.end = mark + 1;
+            TracePutTag(&w, CALLTRACE_ARG_OTHER);
+        }
+    }
+
+    buf->used = (SIZE_T)(w.p - buf->data);
+    buf->records++;
+    InterlockedExchange(&buf->busy, 0);
+}
+
+/*
+** Control
+*/
+static void TraceWriteString(FILE* f, const wchar_t* s)
+{
+    UINT16 n = (UINT16)(s ? wcslen(s) : 0), i;
+    fwrite(&n, sizeof(n), 1, f);
+    for (i = 0; i < n; i++)
+    {
+        UINT16 c = (UINT16)s[i];
+        fwrite(&c, sizeof(c), 1, f);
+    }
+}
+
+int CallTraceStart(const wchar_t* path)
+{
+    wchar_t defaultPath[MAX_PATH];
+    LARGE_INTEGER freq, now;
+    UINT32 magic = CALLTRACE_MAGIC, version = CALLTRACE_VERSION, count;
+    UINT64 ticksPerSecond, startTicks;
+    FILE* f = NULL;
+    int fn;
+
+    if (InterlockedCompareExchange(&g_traceState, 1, 0) != 0)
+        return ReadAcquire(&g_traceState) == 2;
+
+    if (!path || !path[0])
+    {
+        wchar_t dir[MAX_PATH - 64];
+        DWORD n = GetEnvironmentVariableW(L"XLL_CALL_TRACE", dir, (DWORD)_countof(dir));
+        if (n == 0 || n >= _countof(dir))
+        {
+            InterlockedExchange(&g_traceState, 0);
+            return 0;
+        }
+        swprintf_s(defaultPath, MAX_PATH, L"%ls/%ls-%lu.xltrace", dir, UdfModuleName(), (unsigned long)GetCurrentProcessId());
+        path = defaultPath;
+    }
+    if (_wfopen_s(&f, path, L"wb") != 0 || !f)
+    {
+        InterlockedExchange(&g_traceState, 0);
+        return 0;
+    }
+
+    TraceLockInit();
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    ticksPerSecond = (UINT64)freq.QuadPart;
+    startTicks = (UINT64)now.QuadPart;
+    count = (UINT32)UdfFunctionCount();
+
+    fwrite(&magic, sizeof(magic), 1, f);
+    fwrite(&version, sizeof(version), 1, f);
+    fwrite(&ticksPerSecond, sizeof(ticksPerSecond), 1, f);
+    fwrite(&startTicks, sizeof(startTicks), 1, f);
+    fwrite(&count, sizeof(count), 1, f);
+    TraceWriteString(f, UdfModuleName());
+    for (fn = 0; fn < (int)count; fn++)
+    {
+        TraceWriteString(f, UdfFunctionName(fn));
+        TraceWriteString(f, UdfFunctionType(fn));
+    }
+
+    EnterCriticalSection(&g_traceLock);
+    g_traceFile = f;
+    g_traceStart = now.QuadPart;
+    g_traceFlushedRecords = 0;
+    LeaveCriticalSection(&g_traceLock);
+
+    InterlockedExchange(&g_traceActive, 1);
+    InterlockedOr(&g_udfHooks, UDF_HOOK_TRACE);
+    InterlockedExchange(&g_traceState, 2);
+    return 1;
+}
+
+LONGLONG CallTraceStop(void)
+{
+    LONGLONG records;
+    LONG i, count;
+
+    if (InterlockedCompareExchange(&g_traceState, 1, 2) != 2)
+        return 0;
+
+    InterlockedAnd(&g_udfHooks, ~UDF_HOOK_TRACE);
+    InterlockedExchange(&g_traceActive, 0);
+
+    // Wait out records in progress, then write what every thread has buffered
+    count = ReadAcquire(&g_traceBufferCount);
+    if (count > TRACE_MAX_THREADS)
+        count = TRACE_MAX_THREADS;
+    for (i = 0; i < count; i++)
+    {
+        TraceBuffer* buf = g_traceBuffers[i];
+        if (!buf)
+            continue;
+        while (ReadAcquire(&buf->busy))
+            Sleep(0);
+        TraceFlush(buf);
+    }
+
+    EnterCriticalSection(&g_traceLock);
+    fclose(g_traceFile);
+    g_traceFile = NULL;
+    records = g_traceFlushedRecords;
+    LeaveCriticalSection(&g_traceLock);
+
+    InterlockedExchange(&g_traceState, 0);
+    return records;
+}
@@ -0,0 +1,63 @@
+/*
+**  CallTrace
+**
+**  Binary recorder of UDF invocations. While recording, every UDF that opens
+**  with UDF_ENTER/UDF_ENTER_ARGS appends one record on return: function id,
+**  nesting depth, thread, start and end QueryPerformanceCounter ticks and its
+**  arguments, serialised using the function's rgFuncs type text. Records go to
+**  a per-thread buffer and reach the file a buffer at a time, so the cost on
+**  the calc thread is two counter reads and a memcpy.
+**
+**  Bench/TraceReplay re-executes a trace against the XLL, at the recorded
+**  concurrency or at a chosen thread count.
+**
+**  File format (little-endian, fixed-width fields):
+**      header:  UINT32 magic, UINT32 version, UINT64 ticksPerSecond,
+**               UINT64 startTicks, UINT32 functionCount,
+**               string module, then per function: string name, string type
+**      chunks:  UINT32 bytes, then that many bytes of records
+**      record:  CallTraceEntry, then argCount serialised arguments
+**      string:  UINT16 length, then length UTF-16 code units
+**      argument: one tag byte (CALLTRACE_ARG_*), then
+**               NUM: double  BOOL: UINT8  ERR: INT32  STR: string
+**               MULTI: UINT32 rows, UINT32 columns, rows*columns scalar arguments
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "UdfHooks.h"
+
+#define CALLTRACE_MAGIC         0x52544C58u    // "XLTR"
+#define CALLTRACE_VERSION       1
+
+#define CALLTRACE_ARG_NUM       'n'
+#define CALLTRACE_ARG_BOOL      'b'
+#define CALLTRACE_ARG_ERR       'e'
+#define CALLTRACE_ARG_STR       's'
+#define CALLTRACE_ARG_MISSING   'm'
+#define CALLTRACE_ARG_NIL       'z'
+#define CALLTRACE_ARG_MULTI     'a'
+#define CALLTRACE_ARG_OTHER     '?'     // Type not recorded (or too large); replays as missing
+
+#pragma pack(push, 1)
+typedef struct CallTraceEntry
+{
+    UINT32 thread;
+    UINT16 fn;
+    UINT8  depth;
+    UINT8  argCount;
+    UINT64 start;       // Ticks since the header's startTicks
+    UINT64 end;
+} CallTraceEntry;
+#pragma pack(pop)
+
+// Starts recording to path (NULL or empty: %XLL_CALL_TRACE%/<module>-<pid>.xltrace,
+// if that is set); returns 1 if recording
+int  CallTraceStart(const wchar_t* path);
+
+// Stops recording, flushes every thread's buffer and returns the records written
+LONGLONG CallTraceStop(void);
+
+// Called from UdfHooksLeave for frames opened while recording
+void CallTraceRecord(const UdfFrame* frame, LONGLONG endTicks);
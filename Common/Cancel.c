@@ -0,0 +1,186 @@
+/*
+**  Cancel
+**
+**  Tokens, the shared xlAbort gate and counters. See Cancel.h.
+**
+**  The gate is the earliest time the next xlAbort call may be made. A slow
+**  check past it moves it one slice on with a compare-exchange, and only the
+**  thread that moved it calls xlAbort, so N calc threads polling together
+**  still call it about once per slice.
+*/
+
+#include <windows.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "XlHelpers.h"
+#include "Cancel.h"
+
+typedef struct CancelConfig
+{
+    volatile LONG ready;
+    LONGLONG freq;                  // QueryPerformanceCounter ticks per second
+    LONGLONG sliceTicks;            // XLL_CANCEL_SLICE_US
+    double budgetMs;                // XLL_CALL_BUDGET_MS, 0: none
+} CancelConfig;
+
+typedef struct __declspec(align(64)) CancelState
+{
+    // Read by every slow check
+    volatile LONGLONG nextAbortCheck;
+    volatile LONG aborted;          // xlAbort reported a break since the last reset
+
+    // Counters, added once per call
+    __declspec(align(64)) volatile LONGLONG calls;
+    volatile LONGLONG stoppedAbort;
+    volatile LONGLONG stoppedDeadline;
+    volatile LONGLONG checks;
+    volatile LONGLONG abortCalls;
+    volatile LONGLONG breaks;       // xlAbort calls that reported a break
+} CancelState;
+
+static CancelConfig g_cancelConfig;
+static CancelState g_cancel;
+
+static double CancelEnvNumber(const wchar_t* name, double fallback)
+{
+    wchar_t env[32];
+
+    if (!GetEnvironmentVariableW(name, env, (DWORD)_countof(env)) || !env[0])
+        return fallback;
+    return wcstod(env, NULL);
+}
+
+static const CancelConfig* CancelConfigGet(void)
+{
+    LARGE_INTEGER freq;
+    double sliceUs, budgetMs;
+
+    if (ReadAcquire(&g_cancelConfig.ready))
+        return &g_cancelConfig;
+    // Racing first calls compute the same values
+    QueryPerformanceFrequency(&freq);
+    sliceUs = CancelEnvNumber(L"XLL_CANCEL_SLICE_US", CANCEL_SLICE_US);
+    budgetMs = CancelEnvNumber(L"XLL_CALL_BUDGET_MS", 0.0);
+    g_cancelConfig.freq = freq.QuadPart;
+    g_cancelConfig.sliceTicks = sliceUs > 0.0 ? (LONGLONG)(sliceUs * 1e-6 * (double)freq.QuadPart) : 0;
+    g_cancelConfig.budgetMs = budgetMs > 0.0 ? budgetMs : 0.0;
+    WriteRelease(&g_cancelConfig.ready, 1);
+    return &g_cancelConfig;
+}
+
+void CancelBegin(CancelToken* t, double budgetMs)
+{
+    const CancelConfig* cfg = CancelConfigGet();
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    if (budgetMs <= 0.0)
+        budgetMs = cfg->budgetMs;
+    t->reason = CANCEL_NONE;
+    t->stride = cfg->sliceTicks ? 64 : 1;
+    t->countdown = t->stride;
+    t->start = now.QuadPart;
+    t->lastCheck = now.QuadPart;
+    t->deadline = budgetMs > 0.0 ? now.QuadPart + (LONGLONG)(budgetMs * 1e-3 * (double)cfg->freq) : 0;
+    t->checks = 0;
+}
+
+// Asks Excel whether the user pressed Esc, leaving the break pending
+static BOOL CancelAskExcel(void)
+{
+    XLOPER12 retain, res;
+
+    retain.xltype = xltypeBool;
+    retain.val.xbool = TRUE;
+    InterlockedIncrement64(&g_cancel.abortCalls);
+    if (Excel12(xlAbort, &res, 1, &retain) != xlretSuccess || (res.xltype & xltypeBool) != xltypeBool)
+        return FALSE;
+    return res.val.xbool != 0;
+}
+
+BOOL CancelCheck(CancelToken* t)
+{
+    const CancelConfig* cfg = &g_cancelConfig;
+    LARGE_INTEGER now;
+    LONGLONG elapsed, gate;
+
+    QueryPerformanceCounter(&now);
+    t->checks++;
+
+    // Keep slow checks about one slice apart
+    elapsed = now.QuadPart - t->lastCheck;
+    if (elapsed < cfg->sliceTicks / 2 && t->stride < CANCEL_MAX_STRIDE)
+        t->stride *= 2;
+    else if (elapsed > cfg->sliceTicks * 2 && t->stride > 1)
+        t->stride /= 2;
+    t->countdown = t->stride;
+    t->lastCheck = now.QuadPart;
+
+    if (t->deadline && now.QuadPart >= t->deadline)
+    {
+        t->reason = CANCEL_DEADLINE;
+        return TRUE;
+    }
+    if (ReadAcquire(&g_cancel.aborted))
+    {
+        t->reason = CANCEL_ABORT;
+        return TRUE;
+    }
+    gate = ReadAcquire64(&g_cancel.nextAbortCheck);
+    if (now.QuadPart < gate
+        || InterlockedCompareExchange64(&g_cancel.nextAbortCheck, now.QuadPart + cfg->sliceTicks, gate) != gate)
+        return FALSE;
+    if (!CancelAskExcel())
+        return FALSE;
+    InterlockedIncrement64(&g_cancel.breaks);
+    WriteRelease(&g_cancel.aborted, 1);
+    t->reason = CANCEL_ABORT;
+    return TRUE;
+}
+
+void CancelEnd(CancelToken* t)
+{
+    InterlockedIncrement64(&g_cancel.calls);
+    if (t->checks)
+        InterlockedExchangeAdd64(&g_cancel.checks, t->checks);
+    if (t->reason == CANCEL_ABORT)
+        InterlockedIncrement64(&g_cancel.stoppedAbort);
+    else if (t->reason == CANCEL_DEADLINE)
+        InterlockedIncrement64(&g_cancel.stoppedDeadline);
+}
+
+void CancelReset(void)
+{
+    WriteRelease(&g_cancel.aborted, 0);
+    WriteRelease64(&g_cancel.nextAbortCheck, 0);
+}
+
+LPXLOPER12 CancelTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Calls", L"StoppedByBreak", L"StoppedByDeadline", L"SlowChecks",
+        L"AbortCalls", L"Breaks", L"SliceUs", L"BudgetMs"
+    };
+    const CancelConfig* cfg = CancelConfigGet();
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    values[0] = (double)ReadAcquire64(&g_cancel.calls);
+    values[1] = (double)ReadAcquire64(&g_cancel.stoppedAbort);
+    values[2] = (double)ReadAcquire64(&g_cancel.stoppedDeadline);
+    values[3] = (double)ReadAcquire64(&g_cancel.checks);
+    values[4] = (double)ReadAcquire64(&g_cancel.abortCalls);
+    values[5] = (double)ReadAcquire64(&g_cancel.breaks);
+    values[6] = (double)cfg->sliceTicks * 1e6 / (double)cfg->freq;
+    values[7] = cfg->budgetMs;
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
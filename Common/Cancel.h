@@ -0,0 +1,69 @@
+/*
+**  Cancel
+**
+**  Cooperative cancellation for long-running UDF loops. A UDF starts a token
+**  with an optional budget in milliseconds and polls it from its loops:
+**
+**      CancelToken t;
+**      CancelBegin(&t, maxMs);             // <= 0: XLL_CALL_BUDGET_MS, or none
+**      for (i = 0; i < n; i++)
+**      {
+**          if (CANCEL_POLL(&t))
+**              break;                      // t.reason says why
+**          ...
+**      }
+**      CancelEnd(&t);
+**
+**  CANCEL_POLL is a decrement and a compare. Every 'stride' iterations it
+**  makes a slow check: the deadline against QueryPerformanceCounter and, at
+**  most once per slice across all threads, xlAbort (the user pressed Esc).
+**  The stride adapts so that slow checks come about once per slice
+**  (XLL_CANCEL_SLICE_US, default 1000 µs) whatever one iteration costs; a
+**  slice of 0 checks and calls xlAbort on every iteration.
+**
+**  xlAbort is called with pxRetain TRUE, so the break stays pending for
+**  Excel. Once it reports a break, every token stops at its next slow check
+**  without calling it again, until the calculation event handlers call
+**  CancelReset.
+**
+**  What a cancelled call returns is the UDF's choice: a partial result where
+**  one makes sense, or CANCEL_ERROR (#N/A) otherwise.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define CANCEL_NONE         0
+#define CANCEL_ABORT        1       // xlAbort reported a break
+#define CANCEL_DEADLINE     2       // The call ran past its budget
+
+#define CANCEL_ERROR        xlerrNA // Result of a call stopped without a partial result
+
+#define CANCEL_SLICE_US     1000    // Default of XLL_CANCEL_SLICE_US
+#define CANCEL_MAX_STRIDE   (1 << 20)
+
+typedef struct CancelToken
+{
+    UINT32 countdown;               // Iterations left until the next slow check
+    UINT32 stride;                  // Iterations between slow checks
+    int reason;
+    LONGLONG start;                 // QueryPerformanceCounter ticks
+    LONGLONG deadline;              // 0: none
+    LONGLONG lastCheck;
+    LONGLONG checks;                // Slow checks made
+} CancelToken;
+
+void CancelBegin(CancelToken* t, double budgetMs);
+BOOL CancelCheck(CancelToken* t);
+void CancelEnd(CancelToken* t);
+
+// TRUE once the call should stop; the slow check runs every t->stride calls
+#define CANCEL_POLL(t) ((t)->reason != CANCEL_NONE || (--(t)->countdown == 0 && CancelCheck(t)))
+
+// Clears a break seen through xlAbort; called from the calculation event handlers
+void CancelReset(void);
+
+// Calls, calls stopped by break and by deadline, slow checks and xlAbort calls
+LPXLOPER12 CancelTable(void);
@@ -0,0 +1,187 @@
+/*
+**  Epoch
+**
+**  Thread slots, retire lists and the reclaimer. See Epoch.h.
+**
+**  Each thread pushes retired objects onto the list in its own slot, so
+**  retiring does not contend across threads. EpochReclaim bumps the global
+**  epoch, takes the oldest epoch still announced by another thread, then
+**  detaches every slot's list and frees the nodes retired before it. Nodes
+**  that are still visible wait on a list private to the reclaimer.
+*/
+
+#include <windows.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "Epoch.h"
+
+__declspec(thread) EpochThread* tls_epochThread = NULL;
+volatile LONGLONG g_epochGlobal = 1;
+
+static __declspec(align(64)) EpochThread g_epochThreads[EPOCH_MAX_THREADS];
+static __declspec(align(64)) EpochThread g_epochOverflow;
+static volatile LONG g_epochThreadCount = 0;
+static volatile LONG g_epochReclaiming = 0;
+static EpochNode* g_epochDeferred = NULL;          // Owned by the reclaimer
+
+static volatile LONGLONG g_epochReclaimed = 0;
+static volatile LONGLONG g_epochReclaimRuns = 0;
+static volatile LONGLONG g_epochUnretired = 0;     // Retire calls that could not get a node (object leaked)
+
+EpochThread* EpochRegisterThread(void)
+{
+    LONG index = InterlockedIncrement(&g_epochThreadCount) - 1;
+    EpochThread* t;
+
+    if (index < EPOCH_MAX_THREADS)
+    {
+        // Slots are never reused: an exited thread's slot stays quiescent (epoch 0)
+        t = &g_epochThreads[index];
+        t->threadId = GetCurrentThreadId();
+    }
+    else
+    {
+        t = &g_epochOverflow;
+        t->shared = 1;
+    }
+    tls_epochThread = t;
+    return t;
+}
+
+void EpochRetire(void* p, EpochFreeFn freeFn)
+{
+    EpochThread* t = tls_epochThread;
+    EpochNode* node;
+    EpochNode* head;
+
+    if (!p)
+        return;
+    if (!t)
+        t = EpochRegisterThread();
+    node = (EpochNode*)GlobalAlloc(GMEM_FIXED, sizeof(EpochNode));
+    if (!node)
+    {
+        InterlockedIncrement64(&g_epochUnretired);
+        return;
+    }
+    node->p = p;
+    node->free = freeFn;
+    node->epoch = ReadAcquire64(&g_epochGlobal);
+
+    // Only the reclaimer competes for this list, so the CAS rarely retries
+    do
+    {
+        head = t->retired;
+        node->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*)&t->retired, node, head) != head);
+    if (t->shared)
+        InterlockedIncrement64(&t->retiredCount);
+    else
+        t->retiredCount++;
+}
+
+static EpochNode* EpochFreeBefore(EpochNode* list, LONGLONG oldest, int* freed)
+{
+    EpochNode* keep = NULL;
+    while (list)
+    {
+        EpochNode* next = list->next;
+        if (list->epoch < oldest)
+        {
+            if (list->free)
+                list->free(list->p);
+            else
+                GlobalFree(list->p);
+            GlobalFree(list);
+            (*freed)++;
+        }
+        else
+        {
+            list->next = keep;
+            keep = list;
+        }
+        list = next;
+    }
+    return keep;
+}
+
+int EpochReclaim(void)
+{
+    EpochThread* self = tls_epochThread;
+    LONGLONG now, oldest, e;
+    LONG i, count;
+    int freed = 0;
+
+    if (InterlockedCompareExchange(&g_epochReclaiming, 1, 0) != 0)
+        return 0;
+
+    // Objects retired from here on carry the new epoch and wait for the next run
+    now = InterlockedIncrement64(&g_epochGlobal);
+    oldest = now;
+    count = ReadAcquire(&g_epochThreadCount);
+    if (count > EPOCH_MAX_THREADS)
+        count = EPOCH_MAX_THREADS;
+    for (i = 0; i < count; i++)
+    {
+        if (&g_epochThreads[i] == self)
+            continue;
+        e = ReadAcquire64(&g_epochThreads[i].epoch);
+        if (e && e < oldest)
+            oldest = e;
+    }
+    // Threads in the overflow slot do not announce an epoch: free nothing while one is inside
+    if (ReadAcquire64(&g_epochOverflow.epoch) && self != &g_epochOverflow)
+        oldest = 0;
+
+    g_epochDeferred = EpochFreeBefore(g_epochDeferred, oldest, &freed);
+    for (i = 0; i <= count; i++)
+    {
+        EpochThread* t = i < count ? &g_epochThreads[i] : &g_epochOverflow;
+        EpochNode* list = (EpochNode*)InterlockedExchangePointer((PVOID volatile*)&t->retired, NULL);
+        EpochNode* keep = EpochFreeBefore(list, oldest, &freed);
+        while (keep)
+        {
+            EpochNode* next = keep->next;
+            keep->next = g_epochDeferred;
+            g_epochDeferred = keep;
+            keep = next;
+        }
+    }
+
+    InterlockedExchangeAdd64(&g_epochReclaimed, freed);
+    InterlockedIncrement64(&g_epochReclaimRuns);
+    InterlockedExchange(&g_epochReclaiming, 0);
+    return freed;
+}
+
+LPXLOPER12 EpochTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Epoch", L"Threads", L"Retired", L"Reclaimed", L"Pending", L"ReclaimRuns", L"Leaked"
+    };
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    LONGLONG retired = g_epochOverflow.retiredCount, reclaimed = ReadAcquire64(&g_epochReclaimed);
+    LONG count = ReadAcquire(&g_epochThreadCount);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    for (i = 0; i < count && i < EPOCH_MAX_THREADS; i++)
+        retired += g_epochThreads[i].retiredCount;
+    values[0] = (double)ReadAcquire64(&g_epochGlobal);
+    values[1] = (double)count;
+    values[2] = (double)retired;
+    values[3] = (double)reclaimed;
+    values[4] = (double)(retired - reclaimed);
+    values[5] = (double)ReadAcquire64(&g_epochReclaimRuns);
+    values[6] = (double)ReadAcquire64(&g_epochUnretired);
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
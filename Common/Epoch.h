@@ -0,0 +1,81 @@
+/*
+**  Epoch
+**
+**  Epoch-based reclamation for state that calc threads read without locks
+**  (register-id tables, caches, handle stores). A writer unlinks an object
+**  and hands it to EpochRetire instead of freeing it; the object is freed by
+**  a later EpochReclaim once no thread can still be reading it.
+**
+**  Every outermost UDF call is a read-side critical section: UDF_ENTER
+**  announces the global epoch in the thread's own cache line and UDF_RETURN
+**  clears it, so readers pay one exchange on an unshared line and no
+**  hazard-pointer bookkeeping. Nested xlUDF calls stay inside the outer one.
+**
+**  Both XLLs reclaim from their xleventCalculationEnded and
+**  xleventCalculationCanceled handlers, when the calc threads are normally
+**  idle, so retired objects go in one batch per recalculation.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define EPOCH_MAX_THREADS   256
+
+typedef void (*EpochFreeFn)(void* p);
+
+typedef struct EpochNode
+{
+    struct EpochNode* next;
+    void* p;
+    EpochFreeFn free;
+    LONGLONG epoch;             // Global epoch when retired
+} EpochNode;
+
+// One cache line per thread: written by its owner on every outermost UDF call
+typedef struct EpochThread
+{
+    volatile LONGLONG epoch;    // Announced epoch, 0 while outside any UDF (active count if shared)
+    EpochNode* volatile retired;
+    LONGLONG retiredCount;
+    DWORD threadId;
+    int shared;                 // Overflow slot used by threads past EPOCH_MAX_THREADS
+    BYTE pad[64 - 3 * sizeof(LONGLONG) - sizeof(DWORD) - sizeof(int)];
+} EpochThread;
+
+extern __declspec(thread) EpochThread* tls_epochThread;
+extern volatile LONGLONG g_epochGlobal;
+
+EpochThread* EpochRegisterThread(void);
+
+static __forceinline void EpochEnter(void)
+{
+    EpochThread* t = tls_epochThread;
+    if (!t)
+        t = EpochRegisterThread();
+    // Full barrier: the announcement is visible before any shared pointer is loaded
+    if (t->shared)
+        InterlockedIncrement64(&t->epoch);
+    else
+        InterlockedExchange64(&t->epoch, ReadAcquire64(&g_epochGlobal));
+}
+
+static __forceinline void EpochLeave(void)
+{
+    EpochThread* t = tls_epochThread;
+    if (t->shared)
+        InterlockedDecrement64(&t->epoch);
+    else
+        WriteRelease64(&t->epoch, 0);
+}
+
+// Frees p with freeFn (GlobalFree when NULL) once every reader that might hold it has left
+void EpochRetire(void* p, EpochFreeFn freeFn);
+
+// Starts a new epoch and frees what no running UDF can still see; returns the count freed.
+// Called from the calculation event handlers; the calling thread's own epoch is ignored.
+int  EpochReclaim(void);
+
+// Epoch, retired / reclaimed / pending counts and reclaim runs as a two-column table
+LPXLOPER12 EpochTable(void);
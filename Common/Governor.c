@@ -0,0 +1,276 @@
+/*
+**  Governor
+**
+**  Admission, waiting and the AIMD controller. See Governor.h.
+**
+**  Admission is a CAS on 'active' against 'limit'. A caller turned away
+**  spins, then counts itself in 'waiting' and sleeps on 'wakeSeq'; it reads
+**  the sequence before retrying, so a release between the retry and the wait
+**  changes the word and the wait returns at once. Releases only touch
+**  'wakeSeq' while someone is waiting.
+**
+**  Every release adds its latency to the current window. The release that
+**  completes a window takes the 'tuning' flag and runs one controller step;
+**  the others carry on without waiting for it.
+*/
+
+#include <windows.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+#include "XlHelpers.h"
+#include "Governor.h"
+
+#define GOVERNOR_COLUMNS    14
+
+Governor* g_governors[UDF_MAX_FUNCS];
+
+static Governor g_governorStore[UDF_MAX_FUNCS];
+static int g_governorOn = 0;
+static __declspec(thread) int tls_governorHeld = 0;
+
+// Parses L"", L"<n>", L"auto" or L"auto:<min>-<max>"; returns 0 when not governed
+static int GovernorParse(const wchar_t* spec, Governor* g)
+{
+    wchar_t* end;
+
+    if (!spec || !spec[0])
+        return 0;
+    if (wcsncmp(spec, L"auto", 4) == 0)
+    {
+        g->adaptive = 1;
+        g->minLimit = 1;
+        g->maxLimit = GOVERNOR_MAX_AUTO;
+        if (spec[4] == L':')
+        {
+            g->minLimit = wcstol(spec + 5, &end, 10);
+            if (*end == L'-')
+                g->maxLimit = wcstol(end + 1, NULL, 10);
+        }
+        if (g->minLimit < 1)
+            g->minLimit = 1;
+        if (g->maxLimit < g->minLimit)
+            g->maxLimit = g->minLimit;
+        g->limit = g->minLimit;
+        g->slowStart = 1;
+        return 1;
+    }
+    g->limit = wcstol(spec, NULL, 10);
+    if (g->limit < 1)
+        return 0;
+    g->minLimit = g->maxLimit = g->limit;
+    return 1;
+}
+
+int GovernorInit(const LPWSTR* rgFuncs, int rows, int columns)
+{
+    wchar_t env[8];
+    int i, governed = 0;
+
+    // Governing is off unless XLL_GOVERN is set (to anything but 0)
+    g_governorOn = GetEnvironmentVariableW(L"XLL_GOVERN", env, (DWORD)_countof(env)) && wcscmp(env, L"0") != 0;
+    if (!g_governorOn || columns <= GOVERNOR_COLUMN)
+        return 0;
+    if (rows > UDF_MAX_FUNCS)
+        rows = UDF_MAX_FUNCS;
+    for (i = 0; i < rows; i++)
+    {
+        Governor* g = &g_governorStore[i];
+        ZeroMemory(g, sizeof(Governor));
+        g->fn = i;
+        g_governors[i] = GovernorParse(rgFuncs[i * columns + GOVERNOR_COLUMN], g) ? g : NULL;
+        if (g_governors[i])
+            governed++;
+    }
+    return governed;
+}
+
+static int GovernorTryAcquire(Governor* g)
+{
+    LONG active = ReadAcquire(&g->active);
+    while (active < ReadAcquire(&g->limit))
+    {
+        LONG seen = InterlockedCompareExchange(&g->active, active + 1, active);
+        if (seen == active)
+        {
+            // Lost updates only blur the statistics
+            if (active + 1 > g->windowPeak)
+                g->windowPeak = active + 1;
+            if (active + 1 > g->peakActive)
+                g->peakActive = active + 1;
+            return 1;
+        }
+        active = seen;
+    }
+    return 0;
+}
+
+static void GovernorWake(Governor* g, int all)
+{
+    InterlockedIncrement(&g->wakeSeq);
+    if (all)
+        WakeByAddressAll((PVOID)&g->wakeSeq);
+    else
+        WakeByAddressSingle((PVOID)&g->wakeSeq);
+}
+
+LONGLONG GovernorAcquire(Governor* g)
+{
+    LARGE_INTEGER start, now;
+    int spin;
+
+    if (tls_governorHeld)
+        return 0;
+    if (GovernorTryAcquire(g))
+    {
+        QueryPerformanceCounter(&now);
+    }
+    else
+    {
+        QueryPerformanceCounter(&start);
+        if (!g->saturated)
+            g->saturated = 1;
+        for (spin = 0; spin < GOVERNOR_SPIN && !GovernorTryAcquire(g); spin++)
+            YieldProcessor();
+        if (spin == GOVERNOR_SPIN)
+        {
+            InterlockedIncrement(&g->waiting);
+            for (;;)
+            {
+                LONG seq = ReadAcquire(&g->wakeSeq);
+                if (GovernorTryAcquire(g))
+                    break;
+                WaitOnAddress(&g->wakeSeq, &seq, sizeof(seq), INFINITE);
+            }
+            InterlockedDecrement(&g->waiting);
+        }
+        QueryPerformanceCounter(&now);
+        InterlockedIncrement64(&g->waits);
+        InterlockedExchangeAdd64(&g->waitTicks, now.QuadPart - start.QuadPart);
+    }
+    tls_governorHeld = 1;
+    return now.QuadPart ? now.QuadPart : 1;
+}
+
+// One AIMD step over the window just completed
+static void GovernorTune(Governor* g)
+{
+    LONG calls = InterlockedExchange(&g->windowCalls, 0);
+    LONGLONG ticks = InterlockedExchange64(&g->windowTicks, 0);
+    LONG saturated = InterlockedExchange(&g->saturated, 0);
+    LONG peak = InterlockedExchange(&g->windowPeak, 0);
+    LONG limit = g->limit, next = limit;
+    double latency;
+
+    if (calls <= 0)
+        return;
+    latency = (double)ticks / (double)calls;
+    g->lastLatency = latency;
+    if (g->baseline <= 0 || latency < g->baseline)
+        g->baseline = latency;
+    else
+        g->baseline += (latency - g->baseline) / 32;   // A lasting change in the inputs re-baselines
+
+    if (latency > g->baseline * GOVERNOR_TOLERANCE)
+    {
+        // Back off from what actually ran, not from a limit that was never reached
+        LONG base = min(limit, max(peak, 1));
+        next = max(g->minLimit, base - max(1, base / 4));
+        g->slowStart = 0;
+    }
+    else if (saturated && limit < g->maxLimit)
+    {
+        next = g->slowStart ? min(g->maxLimit, limit * 2) : limit + 1;
+    }
+    if (next == limit)
+        return;
+
+    InterlockedExchange(&g->limit, next);
+    if (next > limit)
+    {
+        g->increases++;
+        if (ReadAcquire(&g->waiting))
+            GovernorWake(g, 1);
+    }
+    else
+    {
+        g->decreases++;     // Callers already admitted finish; new ones see the lower limit
+    }
+}
+
+void GovernorRelease(Governor* g, LONGLONG admitted)
+{
+    LARGE_INTEGER now;
+    LONG n;
+
+    if (!admitted)
+        return;
+    QueryPerformanceCounter(&now);
+    tls_governorHeld = 0;
+    InterlockedDecrement(&g->active);
+    if (ReadAcquire(&g->waiting))
+        GovernorWake(g, 0);
+    InterlockedIncrement64(&g->calls);
+    if (!g->adaptive)
+        return;
+
+    InterlockedExchangeAdd64(&g->windowTicks, now.QuadPart - admitted);
+    n = InterlockedIncrement(&g->windowCalls);
+    if (n >= GOVERNOR_WINDOW && n >= 2 * ReadAcquire(&g->limit)
+        && InterlockedCompareExchange(&g->tuning, 1, 0) == 0)
+    {
+        GovernorTune(g);
+        InterlockedExchange(&g->tuning, 0);
+    }
+}
+
+LPXLOPER12 GovernorTable(void)
+{
+    static const wchar_t* header[GOVERNOR_COLUMNS] = {
+        L"Function", L"Mode", L"Limit", L"Min", L"Max", L"Active", L"PeakActive",
+        L"Calls", L"Waits", L"AvgWaitMs", L"LatencyMs", L"BaselineMs", L"Increases", L"Decreases"
+    };
+    LARGE_INTEGER freq;
+    double msPerTick;
+    LPXLOPER12 table;
+    int i, j, rows = 0, row = 1;
+
+    if (!g_governorOn)
+        return XlNewStr(L"Governors off (set XLL_GOVERN=1)");
+    for (i = 0; i < UDF_MAX_FUNCS; i++)
+        if (g_governors[i])
+            rows++;
+    table = XlNewMulti(rows + 1, GOVERNOR_COLUMNS);
+    if (!table)
+        return XlNewErr(xlerrNA);
+    QueryPerformanceFrequency(&freq);
+    msPerTick = 1000.0 / (double)freq.QuadPart;
+    for (j = 0; j < GOVERNOR_COLUMNS; j++)
+        XlSetStr(&table->val.array.lparray[j], header[j]);
+
+    for (i = 0; i < UDF_MAX_FUNCS; i++)
+    {
+        const Governor* g = g_governors[i];
+        LPXLOPER12 cells;
+        LONGLONG waits;
+        if (!g)
+            continue;
+        cells = &table->val.array.lparray[row++ * GOVERNOR_COLUMNS];
+        waits = ReadAcquire64(&g->waits);
+        XlSetStr(&cells[0], UdfFunctionName(g->fn));
+        XlSetStr(&cells[1], g->adaptive ? L"auto" : L"fixed");
+        XlSetNum(&cells[2], (double)ReadAcquire(&g->limit));
+        XlSetNum(&cells[3], (double)g->minLimit);
+        XlSetNum(&cells[4], (double)g->maxLimit);
+        XlSetNum(&cells[5], (double)ReadAcquire(&g->active));
+        XlSetNum(&cells[6], (double)g->peakActive);
+        XlSetNum(&cells[7], (double)ReadAcquire64(&g->calls));
+        XlSetNum(&cells[8], (double)waits);
+        XlSetNum(&cells[9], waits ? (double)ReadAcquire64(&g->waitTicks) * msPerTick / (double)waits : 0.0);
+        XlSetNum(&cells[10], g->lastLatency * msPerTick);
+        XlSetNum(&cells[11], g->baseline * msPerTick);
+        XlSetNum(&cells[12], (double)g->increases);
+        XlSetNum(&cells[13], (double)g->decreases);
+    }
+    return table;
+}
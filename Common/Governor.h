@@ -0,0 +1,97 @@
+/*
+**  Governor
+**
+**  Per-function concurrency limits. When every calc thread runs a
+**  memory-bandwidth-bound kernel at once, each call slows down by more than
+**  the extra threads add and throughput falls below what fewer threads
+**  achieve. A governed function admits at most 'limit' calls at a time; the
+**  rest spin briefly and then sleep on a wake word (WaitOnAddress), so a
+**  waiting calc thread costs no CPU.
+**
+**  The limit is either fixed or tuned with AIMD from measured latency. Each
+**  window of completed calls is compared with the function's baseline (the
+**  best window latency seen, drifting slowly upwards): while latency stays
+**  within GOVERNOR_TOLERANCE of it and the limit was reached, the limit grows
+**  by one; once latency inflates past it, the limit is cut to three quarters
+**  of the concurrency the window actually reached. A tuned limit starts at
+**  its minimum and doubles until the first cut (slow start), so the baseline
+**  is measured before calls contend with each other.
+**  Latency is measured from admission to return, so time spent queueing at
+**  the governor does not count as slowdown.
+**
+**  Governing is off unless XLL_GOVERN is set to anything but 0; a fresh
+**  process then runs every function ungoverned. With it set, limits come
+**  from column GOVERNOR_COLUMN of the module's rgFuncs table:
+**      L""             not governed
+**      L"4"            at most 4 concurrent calls
+**      L"auto"         tuned between 1 and GOVERNOR_MAX_AUTO
+**      L"auto:2-8"     tuned between 2 and 8
+**  Flags for other modules may follow the limit after a comma, e.g.
+**  L"auto,pure" (SingleFlight.h).
+**
+**  UDF_ENTER admits and UDF_RETURN releases. Calls made while the thread
+**  already holds an admission (nested xlUDF calls) are not governed, so a
+**  caller and a governed callee can never wait on each other.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define GOVERNOR_COLUMN     7       // rgFuncs column holding the limit spec
+#define GOVERNOR_WINDOW     16      // Minimum completed calls per controller step
+#define GOVERNOR_TOLERANCE  1.5     // Window latency over baseline that counts as contention
+#define GOVERNOR_SPIN       256     // Pause iterations before a caller waits
+#define GOVERNOR_MAX_AUTO   64      // Default ceiling of "auto": not the processor count,
+                                    // since sleeping or waiting calls do not contend
+
+typedef struct __declspec(align(64)) Governor
+{
+    // Admission: written by every governed call
+    volatile LONG active;
+    volatile LONG limit;
+    volatile LONG waiting;
+    volatile LONG wakeSeq;          // Bumped to wake waiters; they wait on its address
+    volatile LONG windowCalls;
+    volatile LONG saturated;        // The limit turned a caller away during this window
+    volatile LONG windowPeak;       // Most calls admitted at once during this window
+    volatile LONGLONG windowTicks;
+
+    // Configuration
+    int fn;
+    int adaptive;
+    int deferred;                   // Admitted by SingleFlight's leader, not by UDF_ENTER
+    LONG minLimit;
+    LONG maxLimit;
+
+    // Controller: only touched by the thread that closes a window
+    volatile LONG tuning;
+    int slowStart;                  // Doubling until latency first inflates
+    double baseline;                // Ticks per call
+    double lastLatency;
+
+    // Reporting
+    volatile LONGLONG calls;
+    volatile LONGLONG waits;
+    volatile LONGLONG waitTicks;
+    volatile LONG peakActive;
+    LONG increases;
+    LONG decreases;
+} Governor;
+
+// Governor of each function id, NULL when the function is not governed
+extern Governor* g_governors[];
+
+// Reads the limit specs from column GOVERNOR_COLUMN of rgFuncs when XLL_GOVERN is set (call
+// after UdfHooksInit); returns the number of governed functions
+int  GovernorInit(const LPWSTR* rgFuncs, int rows, int columns);
+
+// Admits the caller, waiting while the function is at its limit. Returns the admission
+// time to hand back to GovernorRelease, or 0 for a nested call that was not governed.
+LONGLONG GovernorAcquire(Governor* g);
+void GovernorRelease(Governor* g, LONGLONG admitted);
+
+// One row per governed function: mode, current / min / max limit, active and peak
+// callers, calls, waits, average wait, last window and baseline latency, limit changes
+LPXLOPER12 GovernorTable(void);
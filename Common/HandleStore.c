@@ -0,0 +1,466 @@
+/*
+**  HandleStore
+**
+**  Slots, references and the recalculation sweep. See HandleStore.h.
+**
+**  Each slot's word holds the generation in its high 32 bits and the
+**  reference count in its low 32 bits. A slot is live while the count is
+**  non-zero; the release that takes it to zero frees the object, moves the
+**  slot to the next generation and returns it to the free list. Readers
+**  never lock: the free list and the statistics of publish and free take one
+**  SRW lock, and slots themselves are never freed.
+**
+**  Owned references live in a table of cells, hashed by cell into buckets
+**  of entries chained by index, under a lock of its own. An entry holds one
+**  reference to its slot, so the slot cannot be reused while a cell shows
+**  its handle. A cell that publishes again releases its entries from
+**  earlier recalcs; entries from the current one stay, since one formula
+**  may hold several producers whose handles its outer call still has to
+**  read.
+*/
+
+#include <windows.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "HandleStore.h"
+
+#define HANDLE_REFS_MASK    0xFFFFFFFFll
+#define HANDLE_MAX_TEXT     64
+#define HANDLE_OWNER_BUCKETS 4096
+#define HANDLE_OWNER_ENTRIES (2 * HANDLE_STORE_SLOTS)   // Cells can share an object
+
+typedef struct __declspec(align(64)) HandleSlot
+{
+    volatile LONGLONG word;         // Generation << 32 | references
+    HandleObject* object;
+    volatile LONGLONG lastCalc;     // Recalculation in which it was last published or read
+    volatile LONG stored;           // The store still holds its reference
+    LONG nextFree;
+} HandleSlot;
+
+// Publish and free: written under the lock, on lines apart from the readers' counters
+typedef struct __declspec(align(64)) HandleStats
+{
+    SRWLOCK lock;
+    LONG free;                      // Head of the free slots
+    LONG unused;                    // Slots never used yet
+    LONGLONG live;
+    LONGLONG liveBytes;
+    LONGLONG peak;
+    LONGLONG peakBytes;
+    LONGLONG published;
+    LONGLONG freed;
+    LONGLONG full;                  // Publishes refused: no free slot
+
+    __declspec(align(64)) volatile LONGLONG acquired;
+    volatile LONGLONG stale;        // Handles whose object had been dropped
+    volatile LONGLONG dropped;      // Store references released by the sweep
+} HandleStats;
+
+// One cell's reference to an object whose handle it shows
+typedef struct HandleOwner
+{
+    IDSHEET sheet;
+    RW row;
+    COL column;
+    LONG slot;
+    LONG next;                      // Entry + 1 of the next in the bucket or free list, 0 at the end
+    LONGLONG calc;                  // Recalculation that published or reused it
+} HandleOwner;
+
+typedef struct __declspec(align(64)) HandleOwners
+{
+    SRWLOCK lock;
+    LONG free;                      // Entry + 1 of the first free one, 0 when none
+    LONG unused;                    // Entries never used yet
+    LONG cells;                     // Entries in use
+    LONGLONG replaced;              // References released because their cell published again
+    LONGLONG full;                  // References left to the sweep: no free entry
+    LONG buckets[HANDLE_OWNER_BUCKETS];     // Entry + 1 of each chain's first, 0 when empty
+    HandleOwner entries[HANDLE_OWNER_ENTRIES];
+} HandleOwners;
+
+static HandleSlot g_handleSlots[HANDLE_STORE_SLOTS];
+static HandleOwners g_handleOwners = { SRWLOCK_INIT };
+static HandleStats g_handleStats = { SRWLOCK_INIT, -1, 0 };
+static __declspec(align(64)) volatile LONGLONG g_handleCalc = 0;    // Read by every acquire
+static LONG g_handleKeep = -1;
+
+HandleObject* HandleNewBlock(int rows, int columns, SIZE_T payload)
+{
+    HandleObject* obj;
+    SIZE_T bytes;
+
+    if (rows <= 0 || columns <= 0 || payload > ((SIZE_T)1 << 34))
+        return NULL;
+    bytes = sizeof(HandleObject) + 15 + payload;
+    obj = (HandleObject*)GlobalAlloc(GMEM_FIXED, bytes);
+    if (!obj)
+        return NULL;
+    obj->rows = rows;
+    obj->columns = columns;
+    obj->slot = -1;
+    obj->bytes = bytes;
+    obj->kind = NULL;
+    obj->values = (double*)(((ULONG_PTR)(obj + 1) + 15) & ~(ULONG_PTR)15);
+    return obj;
+}
+
+HandleObject* HandleNewMatrix(int rows, int columns)
+{
+    if (rows <= 0 || columns <= 0 || (ULONGLONG)rows * (ULONGLONG)columns > (1ull << 28))
+        return NULL;
+    return HandleNewBlock(rows, columns, (SIZE_T)rows * (SIZE_T)columns * sizeof(double));
+}
+
+void HandleDiscard(HandleObject* obj)
+{
+    if (obj)
+        GlobalFree(obj);
+}
+
+static UINT32 HandleOwnerBucket(IDSHEET sheet, RW row, COL column)
+{
+    UINT64 h = ((UINT64)sheet * 0x9E3779B97F4A7C15ull) ^ ((UINT64)(UINT32)row << 20) ^ (UINT64)(UINT32)column;
+    return (UINT32)((h * 0x9E3779B97F4A7C15ull) >> 52) & (HANDLE_OWNER_BUCKETS - 1);
+}
+
+// Hands the caller's reference to 'slot' to the calling cell, and releases the cell's
+// references from earlier recalcs. FALSE, with the reference still the caller's, when
+// there is no calling cell or no free entry.
+static BOOL HandleOwnSlot(LONG slot)
+{
+    IDSHEET sheet;
+    RW row;
+    COL column;
+    LONGLONG calc = ReadAcquire64(&g_handleCalc);
+    LONG *bucket, *link, entry, dead = 0, owned = 0;
+    HandleOwner* e;
+
+    if (!XlCallerCell(&sheet, &row, &column))
+        return FALSE;
+    bucket = &g_handleOwners.buckets[HandleOwnerBucket(sheet, row, column)];
+    AcquireSRWLockExclusive(&g_handleOwners.lock);
+    link = bucket;
+    while ((entry = *link) != 0)
+    {
+        e = &g_handleOwners.entries[entry - 1];
+        if (e->sheet != sheet || e->row != row || e->column != column || e->calc == calc)
+        {
+            owned |= e->sheet == sheet && e->row == row && e->column == column && e->calc == calc && e->slot == slot;
+            link = &e->next;
+            continue;
+        }
+        // Published by this cell in an earlier recalc, and no longer shown by it
+        *link = e->next;
+        e->next = dead;
+        dead = entry;
+        g_handleOwners.cells--;
+        g_handleOwners.replaced++;
+    }
+    entry = 0;
+    if (!owned)
+    {
+        if (g_handleOwners.free)
+        {
+            entry = g_handleOwners.free;
+            g_handleOwners.free = g_handleOwners.entries[entry - 1].next;
+        }
+        else if (g_handleOwners.unused < HANDLE_OWNER_ENTRIES)
+        {
+            entry = ++g_handleOwners.unused;
+        }
+        else
+        {
+            g_handleOwners.full++;
+        }
+    }
+    if (entry)
+    {
+        e = &g_handleOwners.entries[entry - 1];
+        e->sheet = sheet;
+        e->row = row;
+        e->column = column;
+        e->slot = slot;
+        e->calc = calc;
+        e->next = *bucket;
+        *bucket = entry;
+        g_handleOwners.cells++;
+    }
+    ReleaseSRWLockExclusive(&g_handleOwners.lock);
+
+    // Released outside the lock: the last release frees the object
+    if (dead)
+    {
+        LONG last = dead, d;
+        for (d = dead; d; d = g_handleOwners.entries[d - 1].next)
+        {
+            last = d;
+            HandleRelease(g_handleSlots[g_handleOwners.entries[d - 1].slot].object);
+        }
+        AcquireSRWLockExclusive(&g_handleOwners.lock);
+        g_handleOwners.entries[last - 1].next = g_handleOwners.free;
+        g_handleOwners.free = dead;
+        ReleaseSRWLockExclusive(&g_handleOwners.lock);
+    }
+    if (owned)
+        HandleRelease(g_handleSlots[slot].object);     // The cell holds one already
+    return owned || entry != 0;
+}
+
+LPXLOPER12 HandlePublish(HandleObject* obj, const wchar_t* kind)
+{
+    wchar_t text[HANDLE_MAX_TEXT];
+    HandleSlot* s;
+    LONG slot;
+    LONGLONG generation;
+
+    if (!obj)
+        return XlNewErr(xlerrNum);
+    AcquireSRWLockExclusive(&g_handleStats.lock);
+    slot = g_handleStats.free;
+    if (slot >= 0)
+        g_handleStats.free = g_handleSlots[slot].nextFree;
+    else if (g_handleStats.unused < HANDLE_STORE_SLOTS)
+        slot = g_handleStats.unused++;
+    if (slot >= 0)
+    {
+        g_handleStats.published++;
+        g_handleStats.live++;
+        g_handleStats.liveBytes += (LONGLONG)obj->bytes;
+        if (g_handleStats.live > g_handleStats.peak)
+            g_handleStats.peak = g_handleStats.live;
+        if (g_handleStats.liveBytes > g_handleStats.peakBytes)
+            g_handleStats.peakBytes = g_handleStats.liveBytes;
+    }
+    else
+    {
+        g_handleStats.full++;
+    }
+    ReleaseSRWLockExclusive(&g_handleStats.lock);
+    if (slot < 0)
+    {
+        HandleDiscard(obj);
+        return XlNewErr(xlerrNum);
+    }
+
+    // The object is in place before the word makes the slot live
+    s = &g_handleSlots[slot];
+    obj->slot = slot;
+    obj->kind = kind ? kind : L"Object";
+    s->object = obj;
+    s->lastCalc = ReadAcquire64(&g_handleCalc);
+    generation = ReadAcquire64(&s->word) >> 32;
+    swprintf_s(text, _countof(text), L"%ls[%dx%d]#%ld.%lu",
+        obj->kind, obj->rows, obj->columns, (long)slot, (unsigned long)(UINT32)generation);
+    WriteRelease64(&s->word, (generation << 32) | 1);
+    if (!HandleOwnSlot(slot))
+        WriteRelease(&s->stored, 1);        // No cell: the sweep may release the reference from now on
+    return XlNewStr(text);
+}
+
+// Slot and generation from "<kind>[<rows>x<columns>]#<slot>.<generation>"
+static BOOL HandleParse(const XLOPER12* handle, LONG* slot, UINT32* generation)
+{
+    const XCHAR* chars;
+    size_t n = XlCellStr(handle, &chars), i;
+    ULONGLONG s = 0, g = 0;
+
+    for (i = n; i > 0 && chars[i - 1] != L'#'; i--)
+        ;
+    if (i == 0 || n - i < 3 || n > HANDLE_MAX_TEXT)
+        return FALSE;
+    for (; i < n && chars[i] >= L'0' && chars[i] <= L'9'; i++)
+        s = s * 10 + (chars[i] - L'0');
+    if (i >= n || chars[i++] != L'.' || i >= n || s >= HANDLE_STORE_SLOTS)
+        return FALSE;
+    for (; i < n && chars[i] >= L'0' && chars[i] <= L'9'; i++)
+        g = g * 10 + (chars[i] - L'0');
+    if (i != n || g > 0xFFFFFFFFull)
+        return FALSE;
+    *slot = (LONG)s;
+    *generation = (UINT32)g;
+    return TRUE;
+}
+
+const HandleObject* HandleAcquire(const XLOPER12* handle)
+{
+    HandleSlot* s;
+    LONGLONG w, seen;
+    LONG slot;
+    UINT32 generation;
+
+    if (!HandleParse(handle, &slot, &generation))
+        return NULL;
+    s = &g_handleSlots[slot];
+    w = ReadAcquire64(&s->word);
+    for (;;)
+    {
+        if ((UINT32)(w >> 32) != generation || (w & HANDLE_REFS_MASK) == 0)
+        {
+            InterlockedIncrement64(&g_handleStats.stale);
+            return NULL;
+        }
+        seen = InterlockedCompareExchange64(&s->word, w + 1, w);
+        if (seen == w)
+            break;
+        w = seen;
+    }
+    InterlockedIncrement64(&g_handleStats.acquired);
+    if (ReadAcquire64(&s->lastCalc) != ReadAcquire64(&g_handleCalc))
+        WriteRelease64(&s->lastCalc, ReadAcquire64(&g_handleCalc));
+    return s->object;
+}
+
+const HandleObject* HandleAcquireKind(const XLOPER12* handle, const wchar_t* kind)
+{
+    const HandleObject* obj = HandleAcquire(handle);
+
+    if (obj && wcscmp(obj->kind, kind) != 0)
+    {
+        HandleRelease(obj);
+        return NULL;
+    }
+    return obj;
+}
+
+void HandleOwn(const HandleObject* obj)
+{
+    if (!obj || obj->slot < 0)
+        return;
+    InterlockedIncrement64(&g_handleSlots[obj->slot].word);    // The caller's reference keeps it live
+    if (!HandleOwnSlot(obj->slot))
+        HandleRelease(obj);
+}
+
+void HandleRelease(const HandleObject* obj)
+{
+    HandleSlot* s;
+    HandleObject* dead;
+    LONGLONG w;
+
+    if (!obj || obj->slot < 0)
+        return;
+    s = &g_handleSlots[obj->slot];
+    w = InterlockedDecrement64(&s->word);
+    if ((w & HANDLE_REFS_MASK) != 0)
+        return;
+
+    // Last reference: nobody can acquire a slot whose count is zero
+    dead = s->object;
+    s->object = NULL;
+    WriteRelease64(&s->word, (LONGLONG)(((ULONGLONG)(UINT32)((w >> 32) + 1)) << 32));
+    AcquireSRWLockExclusive(&g_handleStats.lock);
+    s->nextFree = g_handleStats.free;
+    g_handleStats.free = obj->slot;
+    g_handleStats.live--;
+    g_handleStats.liveBytes -= (LONGLONG)dead->bytes;
+    g_handleStats.freed++;
+    ReleaseSRWLockExclusive(&g_handleStats.lock);
+    GlobalFree(dead);
+}
+
+static LONG HandleKeep(void)
+{
+    wchar_t env[16];
+
+    if (g_handleKeep < 0)
+    {
+        LONG keep = HANDLE_KEEP_CALCS;
+        if (GetEnvironmentVariableW(L"XLL_HANDLE_KEEP", env, (DWORD)_countof(env)))
+            keep = (LONG)wcstol(env, NULL, 10);
+        g_handleKeep = keep < 1 ? 1 : keep;
+    }
+    return g_handleKeep;
+}
+
+// Releases the store's reference to every object last used in or before recalc 'olderThan'
+static int HandleDropWhere(LONGLONG olderThan)
+{
+    LONG used, i;
+    int dropped = 0;
+
+    AcquireSRWLockShared(&g_handleStats.lock);
+    used = g_handleStats.unused;
+    ReleaseSRWLockShared(&g_handleStats.lock);
+    for (i = 0; i < used; i++)
+    {
+        HandleSlot* s = &g_handleSlots[i];
+        if (!ReadAcquire(&s->stored) || ReadAcquire64(&s->lastCalc) > olderThan)
+            continue;
+        if (InterlockedCompareExchange(&s->stored, 0, 1) != 1)
+            continue;
+        // The store's reference is ours now, so the object stays put until released
+        InterlockedIncrement64(&g_handleStats.dropped);
+        HandleRelease(s->object);
+        dropped++;
+    }
+    return dropped;
+}
+
+int HandleSweep(void)
+{
+    LONGLONG calc = InterlockedIncrement64(&g_handleCalc);
+    return HandleDropWhere(calc - HandleKeep() - 1);
+}
+
+void HandleStoreClose(void)
+{
+    LONG i, entry;
+
+    AcquireSRWLockExclusive(&g_handleOwners.lock);
+    for (i = 0; i < HANDLE_OWNER_BUCKETS; i++)
+    {
+        for (entry = g_handleOwners.buckets[i]; entry; entry = g_handleOwners.entries[entry - 1].next)
+            HandleRelease(g_handleSlots[g_handleOwners.entries[entry - 1].slot].object);
+        g_handleOwners.buckets[i] = 0;
+    }
+    g_handleOwners.free = 0;
+    g_handleOwners.unused = 0;
+    g_handleOwners.cells = 0;
+    ReleaseSRWLockExclusive(&g_handleOwners.lock);
+    HandleDropWhere(MAXLONGLONG);
+}
+
+LPXLOPER12 HandleTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Live", L"LiveBytes", L"Peak", L"PeakBytes", L"Published", L"Acquired",
+        L"Stale", L"Dropped", L"Freed", L"Full", L"Recalcs", L"KeepRecalcs",
+        L"Cells", L"Replaced", L"CellsFull"
+    };
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    AcquireSRWLockShared(&g_handleStats.lock);
+    values[0] = (double)g_handleStats.live;
+    values[1] = (double)g_handleStats.liveBytes;
+    values[2] = (double)g_handleStats.peak;
+    values[3] = (double)g_handleStats.peakBytes;
+    values[4] = (double)g_handleStats.published;
+    values[9] = (double)g_handleStats.full;
+    values[8] = (double)g_handleStats.freed;
+    ReleaseSRWLockShared(&g_handleStats.lock);
+    values[5] = (double)ReadAcquire64(&g_handleStats.acquired);
+    values[6] = (double)ReadAcquire64(&g_handleStats.stale);
+    values[7] = (double)ReadAcquire64(&g_handleStats.dropped);
+    values[10] = (double)ReadAcquire64(&g_handleCalc);
+    values[11] = (double)HandleKeep();
+    AcquireSRWLockShared(&g_handleOwners.lock);
+    values[12] = (double)g_handleOwners.cells;
+    values[13] = (double)g_handleOwners.replaced;
+    values[14] = (double)g_handleOwners.full;
+    ReleaseSRWLockShared(&g_handleOwners.lock);
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
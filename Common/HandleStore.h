@@ -0,0 +1,93 @@
+/*
+**  HandleStore
+**
+**  Keeps large intermediate results inside the XLL. A UDF publishes a native
+**  object (a dense matrix of doubles, rows by columns; a column is one column
+**  wide) and returns a short handle string such as L"Matrix[1000x8]#17.3"
+**  instead of the values. A UDF that receives the handle reads the object in
+**  place, so the values never pass through worksheet cells. Other kinds of
+**  object (a lookup index, Common/Lookup.h) take a block of payload bytes
+**  instead of a matrix, and their readers acquire them by kind.
+**
+**  The handle names a slot (17) and its generation (3). A slot's generation
+**  and reference count share one 64-bit word, so an acquire checks both with
+**  a single compare-exchange, and a stale handle (its object dropped and the
+**  slot reused) fails instead of reading someone else's object. The store
+**  holds references on behalf of cells (below); every acquire holds another
+**  until the matching release, and the object is freed by the last release.
+**
+**  An object lives as long as a cell shows its handle. HandlePublish holds
+**  one reference for the calling cell (xlfCaller, with its sheet, so A1 on
+**  two sheets is two cells), and HandleOwn adds the calling cell to an
+**  object already published (a second cell reusing an index). When a cell
+**  publishes again in a later recalculation, the references it held from
+**  earlier ones are released. Smart recalc may leave a producer alone for
+**  any number of recalculations, and its object stays for as long. Only
+**  objects published outside a cell (from VBA) fall to HandleSweep, run from
+**  the calculation event handlers: it releases the store's reference to
+**  those that no UDF has published or read during the last XLL_HANDLE_KEEP
+**  recalculations (default 2). An object whose cell is cleared, or whose
+**  formula no longer calls a producer, stays until xlAutoClose.
+**
+**  Usage, inside UDFs:
+**      HandleObject* out = HandleNewMatrix(rows, columns);
+**      ... fill out->values (row-major) ...
+**      result = HandlePublish(out, L"Matrix");     // The handle string
+**
+**      const HandleObject* in = HandleAcquire(arg);  // NULL: not a live handle
+**      ... read in->values ...
+**      HandleRelease(in);
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define HANDLE_STORE_SLOTS  4096
+#define HANDLE_KEEP_CALCS   2       // Default of XLL_HANDLE_KEEP
+
+typedef struct HandleObject
+{
+    int rows;
+    int columns;
+    LONG slot;                      // Set by HandlePublish
+    SIZE_T bytes;                   // Whole block, header included
+    const wchar_t* kind;            // Set by HandlePublish
+    double* values;                 // rows * columns, row-major, in the same block
+} HandleObject;
+
+// Allocates an unpublished matrix (values uninitialised); NULL if too large
+HandleObject* HandleNewMatrix(int rows, int columns);
+
+// Allocates an unpublished object with 'payload' bytes at values, 16-byte aligned
+// and uninitialised; rows and columns only describe it in the handle string
+HandleObject* HandleNewBlock(int rows, int columns, SIZE_T payload);
+
+// Stores obj and returns its handle string ('kind', a literal, prefixes it); frees
+// obj and returns #NUM! when every slot is in use
+LPXLOPER12 HandlePublish(HandleObject* obj, const wchar_t* kind);
+
+// Holds a reference to a published object for the calling cell, as HandlePublish does,
+// for a UDF that returns an existing handle (the caller keeps its own reference)
+void HandleOwn(const HandleObject* obj);
+
+// Frees an object that was never published
+void HandleDiscard(HandleObject* obj);
+
+// The live object named by a handle string, with a reference the caller must release
+const HandleObject* HandleAcquire(const XLOPER12* handle);
+// The same, but NULL unless the object was published as 'kind'
+const HandleObject* HandleAcquireKind(const XLOPER12* handle, const wchar_t* kind);
+void HandleRelease(const HandleObject* obj);
+
+// Ends a recalculation: drops objects without a cell that went unused for the configured
+// number of recalcs. Called from the calculation event handlers; returns the number dropped.
+int  HandleSweep(void);
+
+// Drops every object (xlAutoClose)
+void HandleStoreClose(void);
+
+// Live objects and bytes, peaks, publishes, acquires, stale handles and drops, and the
+// cells holding references
+LPXLOPER12 HandleTable(void);
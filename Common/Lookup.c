@@ -0,0 +1,687 @@
+/*
+**  Lookup
+**
+**  Fingerprints, index builds and the two kinds of search. See Lookup.h.
+**
+**  An index is one handle store block: the LookupIndex header, a copy of
+**  the table's cells, the hash slots, the keys in order, and the characters
+**  of every string in the table. A slot holds a key's 32-bit hash beside its
+**  row, so a probe reads one cache line before the cell it checks. A sorted
+**  key holds an order-preserving prefix of the key (all of a number, the
+**  first eight characters of a string), so sorting and binary search rarely
+**  leave the array. Nothing in the block changes after HandlePublish. Readers hold only the handle store's
+**  reference, and the last release frees the block in one GlobalFree.
+*/
+
+#include <windows.h>
+#include <wchar.h>
+#include <wctype.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "HandleStore.h"
+#include "Lookup.h"
+
+#define LOOKUP_HANDLE_MAX   64
+#define LOOKUP_MIX          0x9E3779B97F4A7C15ull
+#define LOOKUP_MIX1         0xBF58476D1CE4E5B9ull
+#define LOOKUP_MIX2         0x94D049BB133111EBull
+
+// Key classes, in the order approximate matches sort them; 0 is never found
+#define LOOKUP_NONE         0
+#define LOOKUP_NUM          1
+#define LOOKUP_STR          2
+#define LOOKUP_BOOL         3
+
+typedef struct LookupSlot
+{
+    UINT32 hash;
+    int row;                    // Row + 1; 0 while the slot is empty
+} LookupSlot;
+
+typedef struct LookupKey
+{
+    UINT64 order[2];            // Numbers: sortable bits; strings: eight folded characters; booleans: 0 or 1
+    const XCHAR* str;           // Strings: the counted characters, compared when the prefixes tie
+    int cls;
+    int row;
+} LookupKey;
+
+typedef struct LookupIndex
+{
+    int rows;
+    int columns;
+    UINT64 fingerprint;
+    int keys;                   // Rows whose first cell is a number, string or boolean
+    UINT32 mask;                // Hash slots - 1
+    const XLOPER12* cells;      // rows * columns, row-major; strings point into text
+    const LookupSlot* slots;
+    const LookupKey* sorted;    // The keyed rows, by key and then by row
+} LookupIndex;
+
+// One remembered build: the fingerprint and shape, and the handle of its index
+typedef struct LookupCacheSlot
+{
+    UINT64 fingerprint;
+    int rows;
+    int columns;
+    XCHAR handle[LOOKUP_HANDLE_MAX + 2];    // Counted and terminated
+} LookupCacheSlot;
+
+typedef struct __declspec(align(64)) LookupStats
+{
+    volatile LONGLONG builds;
+    volatile LONGLONG reused;           // Builds answered by a live index with the same content
+    volatile LONGLONG collisions;       // Same fingerprint and shape, different content
+    volatile LONGLONG indexedCells;
+    volatile LONGLONG finds;            // LookupFind calls
+    volatile LONGLONG keys;
+    volatile LONGLONG found;
+    volatile LONGLONG scans;            // LookupScan calls
+    volatile LONGLONG scannedRows;
+} LookupStats;
+
+static LookupStats g_lookupStats;
+static LookupCacheSlot g_lookupCache[LOOKUP_CACHE_SLOTS];
+static SRWLOCK g_lookupCacheLock = SRWLOCK_INIT;
+
+static __forceinline UINT64 LookupMix(UINT64 x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static __forceinline WCHAR LookupFold(WCHAR c)
+{
+    if (c < 0x80)
+        return (c >= L'A' && c <= L'Z') ? (WCHAR)(c + (L'a' - L'A')) : c;
+    return (WCHAR)towlower(c);
+}
+
+// The type a copied cell keeps: numbers, strings, booleans and errors; anything else is blank
+static __forceinline DWORD LookupType(const XLOPER12* x)
+{
+    DWORD type = x->xltype & 0x0FFF;
+    return (type == xltypeNum || type == xltypeStr || type == xltypeBool || type == xltypeErr) ? type : xltypeNil;
+}
+
+static __forceinline int LookupClass(const XLOPER12* x)
+{
+    switch (x->xltype & 0x0FFF)
+    {
+    case xltypeNum:  return LOOKUP_NUM;
+    case xltypeStr:  return LOOKUP_STR;
+    case xltypeBool: return LOOKUP_BOOL;
+    default:         return LOOKUP_NONE;
+    }
+}
+
+// Hash of a key, equal for keys that match (-0 and 0, strings of either case)
+static UINT32 LookupHash(const XLOPER12* x, int cls)
+{
+    UINT64 h;
+
+    if (cls == LOOKUP_NUM)
+    {
+        double v = x->val.num == 0.0 ? 0.0 : x->val.num;
+        memcpy(&h, &v, sizeof(h));
+    }
+    else if (cls == LOOKUP_STR)
+    {
+        int i, n = x->val.str[0];
+        h = 0xCBF29CE484222325ull;
+        for (i = 1; i <= n; i++)
+            h = (h ^ LookupFold(x->val.str[i])) * 0x100000001B3ull;
+    }
+    else
+    {
+        h = (UINT64)(x->val.xbool != 0);
+    }
+    return (UINT32)(LookupMix(h ^ ((UINT64)cls << 60)) >> 32);
+}
+
+// Orders two counted strings by folded code unit
+static int LookupCompareStr(const XCHAR* a, const XCHAR* b)
+{
+    int na = a[0], nb = b[0], n = na < nb ? na : nb, i;
+
+    for (i = 1; i <= n; i++)
+    {
+        WCHAR fa = LookupFold(a[i]), fb = LookupFold(b[i]);
+        if (fa != fb)
+            return fa < fb ? -1 : 1;
+    }
+    return na < nb ? -1 : na > nb ? 1 : 0;
+}
+
+// Orders two keys of any class; 0 when they match
+static int LookupCompare(const XLOPER12* a, int ca, const XLOPER12* b, int cb)
+{
+    if (ca != cb)
+        return ca < cb ? -1 : 1;
+    if (ca == LOOKUP_NUM)
+        return a->val.num < b->val.num ? -1 : a->val.num > b->val.num ? 1 : 0;
+    if (ca == LOOKUP_STR)
+        return LookupCompareStr(a->val.str, b->val.str);
+    return (a->val.xbool != 0) - (b->val.xbool != 0);
+}
+
+static LookupKey LookupKeyOf(const XLOPER12* x, int cls, int row)
+{
+    LookupKey k;
+
+    k.cls = cls;
+    k.row = row;
+    k.str = NULL;
+    k.order[0] = k.order[1] = 0;
+    if (cls == LOOKUP_NUM)
+    {
+        double v = x->val.num == 0.0 ? 0.0 : x->val.num;
+        UINT64 bits;
+        memcpy(&bits, &v, sizeof(bits));
+        k.order[0] = (bits >> 63) ? ~bits : bits | (1ull << 63);
+    }
+    else if (cls == LOOKUP_STR)
+    {
+        int i, n = x->val.str[0];
+        k.str = x->val.str;
+        for (i = 0; i < 8; i++)
+            k.order[i / 4] = (k.order[i / 4] << 16) | (i < n ? (UINT64)LookupFold(x->val.str[i + 1]) : 0);
+    }
+    else
+    {
+        k.order[0] = (UINT64)(x->val.xbool != 0);
+    }
+    return k;
+}
+
+static __forceinline int LookupKeyCompare(const LookupKey* a, const LookupKey* b)
+{
+    if (a->cls != b->cls)
+        return a->cls < b->cls ? -1 : 1;
+    if (a->order[0] != b->order[0])
+        return a->order[0] < b->order[0] ? -1 : 1;
+    if (a->order[1] != b->order[1])
+        return a->order[1] < b->order[1] ? -1 : 1;
+    return a->cls == LOOKUP_STR ? LookupCompareStr(a->str, b->str) : 0;
+}
+
+// Position-sensitive hash of the cells' types and values, string characters included.
+// Each cell's word is salted with its position and mixed on its own before it is summed,
+// as in RangeAgg, so swapped cells or edits whose changes cancel still change the sum.
+static UINT64 LookupFingerprint(const XLOPER12* cells, int rows, int columns, size_t* chars)
+{
+    UINT64 a = 0;
+    size_t total = 0;
+    int i, n = rows * columns;
+
+    for (i = 0; i < n; i++)
+    {
+        DWORD type = LookupType(&cells[i]);
+        UINT64 w = 0;
+        if (type == xltypeNum)
+            memcpy(&w, &cells[i].val.num, sizeof(w));
+        else if (type == xltypeStr)
+        {
+            int k, len = cells[i].val.str[0];
+            w = 0xCBF29CE484222325ull;
+            for (k = 0; k <= len; k++)
+                w = (w ^ cells[i].val.str[k]) * 0x100000001B3ull;
+            total += (size_t)len + 2;
+        }
+        else if (type == xltypeBool)
+            w = (UINT64)(cells[i].val.xbool != 0);
+        else if (type == xltypeErr)
+            w = (UINT64)cells[i].val.err;
+        w = (w ^ ((UINT64)type << 48)) + (UINT64)i * LOOKUP_MIX;
+        w = (w ^ (w >> 31)) * LOOKUP_MIX1;
+        w = (w ^ (w >> 29)) * LOOKUP_MIX2;
+        a += w ^ (w >> 32);
+    }
+    *chars = total;
+    return a ^ (((UINT64)rows << 32) | (UINT64)columns);
+}
+
+// The cells are exactly those of an index (the check behind a fingerprint match)
+static BOOL LookupSameCells(const XLOPER12* index, const XLOPER12* cells, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        DWORD type = LookupType(&cells[i]);
+        if (type != (index[i].xltype & 0x0FFF))
+            return FALSE;
+        if (type == xltypeNum && memcmp(&index[i].val.num, &cells[i].val.num, sizeof(double)) != 0)
+            return FALSE;
+        if (type == xltypeStr && memcmp(index[i].val.str, cells[i].val.str, ((size_t)cells[i].val.str[0] + 1) * sizeof(XCHAR)) != 0)
+            return FALSE;
+        if (type == xltypeBool && (index[i].val.xbool != 0) != (cells[i].val.xbool != 0))
+            return FALSE;
+        if (type == xltypeErr && index[i].val.err != cells[i].val.err)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// A table's cells: the array of a range, or the value itself as a 1 x 1 table
+static const XLOPER12* LookupCells(const XLOPER12* table, int* rows, int* columns)
+{
+    if (!table)
+        return NULL;
+    if ((table->xltype & xltypeMulti) == xltypeMulti)
+    {
+        *rows = table->val.array.rows;
+        *columns = table->val.array.columns;
+        return *rows > 0 && *columns > 0 ? table->val.array.lparray : NULL;
+    }
+    *rows = *columns = 1;
+    return table;
+}
+
+// Stable bottom-up merge sort of the keys
+static void LookupSort(LookupKey* keys, LookupKey* scratch, int n)
+{
+    LookupKey* src = keys;
+    LookupKey* dst = scratch;
+    int width, i;
+
+    for (width = 1; width < n; width *= 2)
+    {
+        for (i = 0; i < n; i += 2 * width)
+        {
+            int mid = i + width < n ? i + width : n, end = i + 2 * width < n ? i + 2 * width : n;
+            int l = i, r = mid, o = i;
+            while (l < mid && r < end)
+                dst[o++] = LookupKeyCompare(&src[l], &src[r]) <= 0 ? src[l++] : src[r++];
+            while (l < mid)
+                dst[o++] = src[l++];
+            while (r < end)
+                dst[o++] = src[r++];
+        }
+        src = dst;
+        dst = src == keys ? scratch : keys;
+    }
+    if (src != keys)
+        memcpy(keys, src, (size_t)n * sizeof(LookupKey));
+}
+
+// Copies the table into a new block and builds its indexes; NULL without memory
+static HandleObject* LookupNewIndex(const XLOPER12* cells, int rows, int columns, UINT64 fingerprint, size_t chars)
+{
+    HandleObject* obj;
+    LookupIndex* ix;
+    XLOPER12* copy;
+    LookupSlot* slots;
+    LookupKey* sorted;
+    LookupKey* scratch;
+    XCHAR* text;
+    UINT32 capacity = 16;
+    SIZE_T payload;
+    int n = rows * columns, keys = 0, r, i;
+
+    while (capacity < 2u * (UINT32)rows)
+        capacity *= 2;
+    payload = ((sizeof(LookupIndex) + 15) & ~(SIZE_T)15)
+        + (SIZE_T)n * sizeof(XLOPER12)
+        + (SIZE_T)capacity * sizeof(LookupSlot)
+        + (SIZE_T)rows * sizeof(LookupKey)
+        + chars * sizeof(XCHAR);
+    obj = HandleNewBlock(rows, columns, payload);
+    if (!obj)
+        return NULL;
+    scratch = (LookupKey*)GlobalAlloc(GMEM_FIXED, (SIZE_T)rows * sizeof(LookupKey));
+    if (!scratch)
+    {
+        HandleDiscard(obj);
+        return NULL;
+    }
+    ix = (LookupIndex*)obj->values;
+    copy = (XLOPER12*)((BYTE*)ix + ((sizeof(LookupIndex) + 15) & ~(SIZE_T)15));
+    slots = (LookupSlot*)(copy + n);
+    sorted = (LookupKey*)(slots + capacity);
+    text = (XCHAR*)(sorted + rows);
+
+    for (i = 0; i < n; i++)
+    {
+        DWORD type = LookupType(&cells[i]);
+        copy[i].xltype = type;
+        if (type == xltypeStr)
+        {
+            size_t len = (size_t)cells[i].val.str[0];
+            memcpy(text, cells[i].val.str, (len + 1) * sizeof(XCHAR));
+            text[len + 1] = 0;
+            copy[i].val.str = text;
+            text += len + 2;
+        }
+        else if (type == xltypeNum)
+            copy[i].val.num = cells[i].val.num;
+        else if (type == xltypeBool)
+            copy[i].val.xbool = cells[i].val.xbool != 0;
+        else if (type == xltypeErr)
+            copy[i].val.err = cells[i].val.err;
+    }
+
+    // Hash: the first row with each key owns its slot, as an exact MATCH finds it first
+    memset(slots, 0, (size_t)capacity * sizeof(LookupSlot));
+    for (r = 0; r < rows; r++)
+    {
+        const XLOPER12* key = &copy[(size_t)r * columns];
+        int cls = LookupClass(key), other;
+        UINT32 h, s;
+        if (cls == LOOKUP_NONE)
+            continue;
+        sorted[keys++] = LookupKeyOf(key, cls, r);
+        h = LookupHash(key, cls);
+        for (s = h & (capacity - 1); (other = slots[s].row) != 0; s = (s + 1) & (capacity - 1))
+            if (slots[s].hash == h && LookupCompare(&copy[(size_t)(other - 1) * columns], cls, key, cls) == 0)
+                break;
+        if (other == 0)
+        {
+            slots[s].hash = h;
+            slots[s].row = r + 1;
+        }
+    }
+    LookupSort(sorted, scratch, keys);
+    GlobalFree(scratch);
+
+    ix->rows = rows;
+    ix->columns = columns;
+    ix->fingerprint = fingerprint;
+    ix->keys = keys;
+    ix->mask = capacity - 1;
+    ix->cells = copy;
+    ix->slots = slots;
+    ix->sorted = sorted;
+    return obj;
+}
+
+LPXLOPER12 LookupIndexBuild(const XLOPER12* table)
+{
+    LookupCacheSlot* slot;
+    XCHAR handle[LOOKUP_HANDLE_MAX + 2];
+    HandleObject* obj;
+    LPXLOPER12 result;
+    const XLOPER12* cells;
+    UINT64 fingerprint;
+    size_t chars;
+    int rows, columns;
+
+    cells = LookupCells(table, &rows, &columns);
+    if (!cells)
+        return XlNewErr(xlerrValue);
+    if ((ULONGLONG)rows * (ULONGLONG)columns > LOOKUP_MAX_CELLS)
+        return XlNewErr(xlerrNum);
+    fingerprint = LookupFingerprint(cells, rows, columns, &chars);
+    slot = &g_lookupCache[fingerprint & (LOOKUP_CACHE_SLOTS - 1)];
+
+    handle[0] = 0;
+    AcquireSRWLockShared(&g_lookupCacheLock);
+    if (slot->fingerprint == fingerprint && slot->rows == rows && slot->columns == columns)
+        memcpy(handle, slot->handle, sizeof(handle));
+    ReleaseSRWLockShared(&g_lookupCacheLock);
+    if (handle[0])
+    {
+        XLOPER12 h;
+        const HandleObject* live;
+        h.xltype = xltypeStr;
+        h.val.str = handle;
+        live = HandleAcquireKind(&h, LOOKUP_KIND);
+        if (live)
+        {
+            const LookupIndex* ix = (const LookupIndex*)live->values;
+            BOOL same = ix->fingerprint == fingerprint && ix->rows == rows && ix->columns == columns
+                && LookupSameCells(ix->cells, cells, rows * columns);
+            if (same)
+                HandleOwn(live);        // This cell shows it too
+            HandleRelease(live);
+            if (same)
+            {
+                InterlockedIncrement64(&g_lookupStats.reused);
+                return XlNewStr(&handle[1]);
+            }
+            InterlockedIncrement64(&g_lookupStats.collisions);
+        }
+    }
+
+    obj = LookupNewIndex(cells, rows, columns, fingerprint, chars);
+    if (!obj)
+        return XlNewErr(xlerrNum);
+    result = HandlePublish(obj, LOOKUP_KIND);
+    if (!result || (result->xltype & xltypeStr) != xltypeStr)
+        return result;
+    InterlockedIncrement64(&g_lookupStats.builds);
+    InterlockedExchangeAdd64(&g_lookupStats.indexedCells, (LONGLONG)rows * columns);
+    if (result->val.str[0] <= LOOKUP_HANDLE_MAX)
+    {
+        AcquireSRWLockExclusive(&g_lookupCacheLock);
+        slot->fingerprint = fingerprint;
+        slot->rows = rows;
+        slot->columns = columns;
+        memcpy(slot->handle, result->val.str, ((size_t)result->val.str[0] + 1) * sizeof(XCHAR));
+        slot->handle[result->val.str[0] + 1] = 0;
+        ReleaseSRWLockExclusive(&g_lookupCacheLock);
+    }
+    return result;
+}
+
+// Row of key through an index, or -1
+static int LookupIndexRow(const void* source, const XLOPER12* key, int cls, int mode)
+{
+    const LookupIndex* ix = (const LookupIndex*)source;
+    LookupKey k;
+    int lo = 0, hi = ix->keys, row;
+
+    if (mode == LOOKUP_EXACT)
+    {
+        UINT32 h = LookupHash(key, cls), s;
+        for (s = h & ix->mask; (row = ix->slots[s].row) != 0; s = (s + 1) & ix->mask)
+            if (ix->slots[s].hash == h && LookupCompare(&ix->cells[(size_t)(row - 1) * ix->columns], cls, key, cls) == 0)
+                return row - 1;
+        return -1;
+    }
+    // First position past the key (NOT_ABOVE) or at it (NOT_BELOW)
+    k = LookupKeyOf(key, cls, 0);
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        int c = LookupKeyCompare(&ix->sorted[mid], &k);
+        if (c < 0 || (c == 0 && mode == LOOKUP_NOT_ABOVE))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (mode == LOOKUP_NOT_ABOVE)
+        lo--;
+    if (lo < 0 || lo >= ix->keys)
+        return -1;
+    return ix->sorted[lo].cls == cls ? ix->sorted[lo].row : -1;
+}
+
+// A scanned table, as the source of LookupScanRow
+typedef struct LookupScanSource
+{
+    const XLOPER12* cells;
+    int rows;
+    int columns;
+} LookupScanSource;
+
+// Row of key by reading every row of the table, or -1
+static int LookupScanRow(const void* source, const XLOPER12* key, int cls, int mode)
+{
+    const LookupScanSource* t = (const LookupScanSource*)source;
+    const XLOPER12* best = NULL;
+    int r, found = -1;
+
+    for (r = 0; r < t->rows; r++)
+    {
+        const XLOPER12* x = &t->cells[(size_t)r * t->columns];
+        int c;
+        if (LookupClass(x) != cls)
+            continue;
+        c = LookupCompare(x, cls, key, cls);
+        if (mode == LOOKUP_EXACT)
+        {
+            if (c == 0)
+                return r;
+        }
+        else if (mode == LOOKUP_NOT_ABOVE ? c <= 0 && (!best || LookupCompare(x, cls, best, cls) >= 0)
+                                          : c >= 0 && (!best || LookupCompare(x, cls, best, cls) < 0))
+        {
+            best = x;
+            found = r;
+        }
+    }
+    return found;
+}
+
+typedef int (*LookupRowFn)(const void* source, const XLOPER12* key, int cls, int mode);
+
+// Sets e to the answer for key: its row number, a cell of its row, or an error
+static BOOL LookupAnswer(LPXLOPER12 e, const XLOPER12* key, LookupRowFn rowOf, const void* source,
+    const XLOPER12* cells, int columns, int column, int mode)
+{
+    const XLOPER12* x;
+    int cls = LookupClass(key), row;
+
+    if ((key->xltype & 0x0FFF) == xltypeErr)
+    {
+        e->xltype = xltypeErr;
+        e->val.err = key->val.err;
+        return FALSE;
+    }
+    row = cls == LOOKUP_NONE ? -1 : rowOf(source, key, cls, mode);
+    if (row < 0)
+    {
+        e->xltype = xltypeErr;
+        e->val.err = xlerrNA;
+        return FALSE;
+    }
+    if (column == 0)
+    {
+        XlSetNum(e, (double)(row + 1));
+        return TRUE;
+    }
+    x = &cells[(size_t)row * columns + (column - 1)];
+    switch (x->xltype & 0x0FFF)
+    {
+    case xltypeStr:
+        XlSetStrN(e, &x->val.str[1], (size_t)x->val.str[0]);
+        break;
+    case xltypeBool:
+        e->xltype = xltypeBool;
+        e->val.xbool = x->val.xbool != 0;
+        break;
+    case xltypeErr:
+        e->xltype = xltypeErr;
+        e->val.err = x->val.err;
+        break;
+    case xltypeNum:
+        XlSetNum(e, x->val.num);
+        break;
+    default:
+        XlSetNum(e, 0.0);           // A blank cell reads as 0, as in VLOOKUP
+        break;
+    }
+    return TRUE;
+}
+
+// Answers every key (one, or an array giving the result its shape)
+static LPXLOPER12 LookupRun(const XLOPER12* key, LookupRowFn rowOf, const void* source,
+    const XLOPER12* cells, int columns, int column, int mode)
+{
+    LPXLOPER12 result;
+    LONGLONG found = 0;
+    int i, n;
+
+    if (!key || column < 0)
+        return XlNewErr(xlerrValue);
+    if (column > columns)
+        return XlNewErr(xlerrRef);
+    mode = mode > 0 ? LOOKUP_NOT_ABOVE : mode < 0 ? LOOKUP_NOT_BELOW : LOOKUP_EXACT;
+    if ((key->xltype & xltypeMulti) != xltypeMulti)
+    {
+        result = XlNewNum(0.0);
+        if (!result)
+            return NULL;
+        found = LookupAnswer(result, key, rowOf, source, cells, columns, column, mode);
+        result->xltype |= xlbitDLLFree;
+        n = 1;
+    }
+    else
+    {
+        n = key->val.array.rows * key->val.array.columns;
+        result = XlNewMulti(key->val.array.rows, key->val.array.columns);
+        if (!result)
+            return XlNewErr(xlerrNum);
+        for (i = 0; i < n; i++)
+            found += LookupAnswer(&result->val.array.lparray[i], &key->val.array.lparray[i],
+                rowOf, source, cells, columns, column, mode);
+    }
+    InterlockedExchangeAdd64(&g_lookupStats.keys, n);
+    InterlockedExchangeAdd64(&g_lookupStats.found, found);
+    return result;
+}
+
+LPXLOPER12 LookupFind(const XLOPER12* key, const XLOPER12* index, int column, int mode)
+{
+    const HandleObject* obj = HandleAcquireKind(index, LOOKUP_KIND);
+    const LookupIndex* ix;
+    LPXLOPER12 result;
+
+    if (!obj)
+        return XlNewErr(xlerrValue);
+    ix = (const LookupIndex*)obj->values;
+    InterlockedIncrement64(&g_lookupStats.finds);
+    result = LookupRun(key, LookupIndexRow, ix, ix->cells, ix->columns, column, mode);
+    HandleRelease(obj);
+    return result;
+}
+
+LPXLOPER12 LookupScan(const XLOPER12* key, const XLOPER12* table, int column, int mode)
+{
+    LookupScanSource t;
+    LPXLOPER12 result;
+
+    t.cells = LookupCells(table, &t.rows, &t.columns);
+    if (!t.cells)
+        return XlNewErr(xlerrValue);
+    InterlockedIncrement64(&g_lookupStats.scans);
+    result = LookupRun(key, LookupScanRow, &t, t.cells, t.columns, column, mode);
+    InterlockedExchangeAdd64(&g_lookupStats.scannedRows, (LONGLONG)t.rows * (key && (key->xltype & xltypeMulti) == xltypeMulti
+        ? (LONGLONG)key->val.array.rows * key->val.array.columns : 1));
+    return result;
+}
+
+LPXLOPER12 LookupTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Builds", L"Reused", L"Collisions", L"IndexedCells", L"Finds", L"Keys", L"Found",
+        L"Scans", L"ScannedRows"
+    };
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    values[0] = (double)ReadAcquire64(&g_lookupStats.builds);
+    values[1] = (double)ReadAcquire64(&g_lookupStats.reused);
+    values[2] = (double)ReadAcquire64(&g_lookupStats.collisions);
+    values[3] = (double)ReadAcquire64(&g_lookupStats.indexedCells);
+    values[4] = (double)ReadAcquire64(&g_lookupStats.finds);
+    values[5] = (double)ReadAcquire64(&g_lookupStats.keys);
+    values[6] = (double)ReadAcquire64(&g_lookupStats.found);
+    values[7] = (double)ReadAcquire64(&g_lookupStats.scans);
+    values[8] = (double)ReadAcquire64(&g_lookupStats.scannedRows);
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
@@ -0,0 +1,68 @@
+/*
+**  Lookup
+**
+**  Lookup indexes over large tables. LookupIndexBuild copies a table into
+**  one block in the handle store (Common/HandleStore.h) and builds two
+**  indexes over its first column there: an open-addressing hash table for
+**  exact matches, and the rows sorted by key for approximate ones. It
+**  returns a handle such as L"Index[500000x3]#17.3". LookupFind then finds a
+**  key through the handle in O(1) expected (exact) or O(log n) (approximate)
+**  time. It does not scan the table again, so thousands of cells can look up
+**  the same 500k rows for little more than the cost of their own keys. An
+**  index is read-only once published, so every calc thread shares it
+**  without locks.
+**
+**  Indexes are keyed by a 64-bit fingerprint of the table's content: the
+**  type and value of every cell, with the characters of strings, by
+**  position. A build whose table has a live index with the same fingerprint
+**  and shape compares the cells and returns that index's handle. Two cells
+**  indexing the same range, or one cell recalculated with its range
+**  unchanged, therefore share one index. When the range changes, the
+**  fingerprint changes, and the build makes a new index under a new handle,
+**  so every cell looking through it recalculates. Each cell that built or
+**  reused an index holds it in the handle store, so an index stays while
+**  any cell shows its handle and goes once the last of them has moved on.
+**
+**  Keys match as in MATCH and VLOOKUP: numbers by value, strings without
+**  regard to case, booleans by value. Blanks and errors in the key column
+**  are never found. An exact match returns the first row with the key.
+**  Approximate matches look for the largest key not above the one given
+**  (mode 1), or the smallest not below it (mode -1), among keys of the same
+**  type. Numbers sort before strings and strings before booleans, and
+**  strings compare by case-folded code unit. Unlike VLOOKUP, the table does
+**  not have to be sorted. Among equal keys, mode 1 takes the last row and
+**  mode -1 the first.
+**
+**  LookupScan does the same lookups by scanning the table on every call.
+**  It is the baseline the indexes are measured against, and it suits small
+**  tables.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define LOOKUP_KIND         L"Index"        // Handle store kind
+#define LOOKUP_CACHE_SLOTS  64              // Fingerprints remembered, direct-mapped
+#define LOOKUP_MAX_CELLS    (1 << 26)
+
+#define LOOKUP_EXACT        0
+#define LOOKUP_NOT_ABOVE    1               // Largest key <= the one given
+#define LOOKUP_NOT_BELOW    (-1)            // Smallest key >= the one given
+
+// The handle of an index over table (a range or array), reusing a live index with
+// the same content; #VALUE! for an empty table, #NUM! when it cannot be stored
+LPXLOPER12 LookupIndexBuild(const XLOPER12* table);
+
+// Looks up key (or each key of an array; the result has its shape) through an index
+// handle. column 1.. returns that column of the row found, 0 its 1-based row number.
+// #N/A when a key is not found, #REF! for a column outside the table, #VALUE! for
+// a handle that is not a live index.
+LPXLOPER12 LookupFind(const XLOPER12* key, const XLOPER12* index, int column, int mode);
+
+// The same answers by a linear scan of table on every call
+LPXLOPER12 LookupScan(const XLOPER12* key, const XLOPER12* table, int column, int mode);
+
+// Builds, fingerprint reuses and collisions, keys looked up and found, rows scanned
+LPXLOPER12 LookupTable(void);
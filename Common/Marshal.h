@@ -0,0 +1,109 @@
+/*
+**  Marshal
+**
+**  Kernels for measuring what each registration type code costs per call.
+**  Every kernel in a family does the same work on the same logical input and
+**  returns the same checksum; only the type code its arguments are
+**  registered with differs, and so only the form Excel hands them over in:
+**
+**      Num     a number            B (double), Q and U (XLOPER12)
+**      Str     text                Q and U (XLOPER12 counted string), C% (null
+**                                  terminated XCHAR*), D% (counted XCHAR*)
+**      Arr     an array of numbers K% (FP12), Q and U (xltypeMulti)
+**
+**  Each family and code is registered with one and with four arguments
+**  (cMarshalNumB1, cMarshalStrD4, cMarshalArrK4, ...), all returning B, so
+**  the difference between two rows is the marshalling and the reading of
+**  the argument alone. The checksum reads every element of the argument, as
+**  a kernel would: the sum of the numbers, or of the code units of the text.
+**  Non-numeric cells in an array count as 0.
+**
+**  MARSHAL_KERNELS lists the families and codes; the XLL expands it into the
+**  exported kernels, their FN_ ids and their rgFuncs rows. Bench/Marshal
+**  times them.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+// X(family, code, type text, C type, reader)
+#define MARSHAL_KERNELS(X) \
+    X(Num, B, L"B",  double,         MarshalNumB) \
+    X(Num, Q, L"Q",  LPXLOPER12,     MarshalNumQ) \
+    X(Num, U, L"U",  LPXLOPER12,     MarshalNumQ) \
+    X(Str, Q, L"Q",  LPXLOPER12,     MarshalStrQ) \
+    X(Str, U, L"U",  LPXLOPER12,     MarshalStrQ) \
+    X(Str, C, L"C%", const XCHAR*,   MarshalStrC) \
+    X(Str, D, L"D%", const XCHAR*,   MarshalStrD) \
+    X(Arr, K, L"K%", const FP12*,    MarshalArrK) \
+    X(Arr, Q, L"Q",  LPXLOPER12,     MarshalArrQ) \
+    X(Arr, U, L"U",  LPXLOPER12,     MarshalArrQ)
+
+static __forceinline double MarshalNumB(double x)
+{
+    return x;
+}
+
+static __forceinline double MarshalNumQ(const XLOPER12* x)
+{
+    return x && (x->xltype & xltypeNum) == xltypeNum ? x->val.num : 0.0;
+}
+
+static __forceinline double MarshalUnits(const XCHAR* s, size_t n)
+{
+    UINT64 sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        sum += (UINT32)s[i];
+    return (double)sum;
+}
+
+static __forceinline double MarshalStrQ(const XLOPER12* x)
+{
+    if (!x || (x->xltype & xltypeStr) != xltypeStr || !x->val.str)
+        return 0.0;
+    return MarshalUnits(&x->val.str[1], (size_t)x->val.str[0]);
+}
+
+static __forceinline double MarshalStrC(const XCHAR* s)
+{
+    UINT64 sum = 0;
+
+    for (; s && *s; s++)
+        sum += (UINT32)*s;
+    return (double)sum;
+}
+
+static __forceinline double MarshalStrD(const XCHAR* s)
+{
+    return s ? MarshalUnits(&s[1], (size_t)s[0]) : 0.0;
+}
+
+static __forceinline double MarshalArrK(const FP12* a)
+{
+    double sum = 0.0;
+    INT32 i, n;
+
+    if (!a)
+        return 0.0;
+    n = a->rows * a->columns;
+    for (i = 0; i < n; i++)
+        sum += a->array[i];
+    return sum;
+}
+
+static __forceinline double MarshalArrQ(const XLOPER12* x)
+{
+    double sum = 0.0;
+    INT32 i, n;
+
+    if (!x || (x->xltype & xltypeMulti) != xltypeMulti)
+        return MarshalNumQ(x);
+    n = x->val.array.rows * x->val.array.columns;
+    for (i = 0; i < n; i++)
+        sum += MarshalNumQ(&x->val.array.lparray[i]);
+    return sum;
+}
@@ -0,0 +1,425 @@
+/*
+**  Metrics
+**
+**  Per-thread counters, the publisher thread and the segment. See Metrics.h.
+**
+**  A thread's first frame claims one of METRICS_MAX_THREADS slots. Threads
+**  past the table share an overflow slot with interlocked adds. The slots
+**  are allocated by the first MetricsOpen and never freed, so a frame still
+**  open across MetricsClose writes to memory that is still there. The
+**  publisher reads the slots without locking: a 64-bit counter cannot tear
+**  on x64, so a sum is at worst a few calls behind. Sums and module tables
+**  are gathered into the publisher's own buffers first, so the odd sequence
+**  only covers the copy into the segment.
+*/
+
+#include <windows.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "XlHelpers.h"
+#include "AllocTrack.h"
+#include "UdfHooks.h"
+#include "Metrics.h"
+#include "ResultCache.h"
+#include "HandleStore.h"
+#include "Lookup.h"
+#include "Reduce.h"
+#include "RangeAgg.h"
+#include "Cancel.h"
+#include "Epoch.h"
+#include "ThreadContext.h"
+#include "MonteCarlo.h"
+#include "MicroBatch.h"
+#include "RefData.h"
+
+#define METRICS_MAX_THREADS 64
+
+typedef struct MetricsCalls
+{
+    LONGLONG calls;
+    LONGLONG ticks;
+    LONGLONG maxTicks;
+    LONGLONG buckets[METRICS_BUCKETS];
+} MetricsCalls;
+
+typedef struct __declspec(align(64)) MetricsSlot
+{
+    MetricsCalls fn[UDF_MAX_FUNCS];
+    LONGLONG callbacks[METRICS_VIAS];
+    LONGLONG callbackTicks[METRICS_VIAS];
+    int shared;                     // The overflow slot: interlocked adds
+} MetricsSlot;
+
+// Name/value tables copied into the counters, under "<prefix>.<row>"
+typedef struct MetricsSource
+{
+    const wchar_t* prefix;
+    LPXLOPER12 (*table)(void);
+} MetricsSource;
+
+static const MetricsSource g_metricsSources[] = {
+    { L"ResultCache", ResultCacheTable },
+    { L"Handles", HandleTable },
+    { L"Lookup", LookupTable },
+    { L"Reduce", ReduceTable },
+    { L"RangeAgg", RangeAggTable },
+    { L"Cancel", CancelTable },
+    { L"Epoch", EpochTable },
+    { L"ThreadContext", ThreadContextTable },
+    { L"MonteCarlo", McTable },
+    { L"MicroBatch", MicroBatchTable },
+    { L"RefData", RefDataTable },
+};
+
+static MetricsSlot* g_metricsSlots = NULL;       // METRICS_MAX_THREADS, 64-byte aligned
+static MetricsSlot g_metricsOverflow = { { { 0 } }, { 0 }, { 0 }, 1 };
+static volatile LONG g_metricsSlotCount = 0;
+static __declspec(thread) MetricsSlot* tls_metricsSlot = NULL;
+
+static volatile LONG g_metricsState = 0;        // 0 off, 1 changing, 2 publishing
+static volatile LONG g_metricsStop = 0;
+static HANDLE g_metricsThread = NULL;
+static HANDLE g_metricsFile = INVALID_HANDLE_VALUE;
+static HANDLE g_metricsMapping = NULL;
+static MetricsHeader* g_metricsView = NULL;
+static SIZE_T g_metricsBytes = 0;
+static wchar_t g_metricsPath[MAX_PATH];
+static DWORD g_metricsIntervalMs = METRICS_INTERVAL_MS;
+static double g_metricsNsPerTick = 1.0;
+
+// The publisher's buffers: the next snapshot, built before the sequence goes odd
+static MetricsFunction g_metricsFunctions[UDF_MAX_FUNCS];
+static MetricsCounter g_metricsCounters[METRICS_COUNTERS];
+
+static MetricsSlot* MetricsSlotGet(void)
+{
+    MetricsSlot* s = tls_metricsSlot;
+    LONG index;
+
+    if (s)
+        return s;
+    index = InterlockedIncrement(&g_metricsSlotCount) - 1;
+    s = index < METRICS_MAX_THREADS ? &g_metricsSlots[index] : &g_metricsOverflow;
+    tls_metricsSlot = s;
+    return s;
+}
+
+static __forceinline void MetricsAdd(const MetricsSlot* s, LONGLONG* field, LONGLONG value)
+{
+    if (s->shared)
+        InterlockedExchangeAdd64(field, value);
+    else
+        *field += value;
+}
+
+void MetricsLeave(const UdfFrame* frame, LONGLONG endTicks)
+{
+    MetricsSlot* s;
+    MetricsCalls* c;
+    LONGLONG ticks = endTicks - frame->start;
+    ULONGLONG us;
+    int bucket = 0;
+
+    if (frame->fn < 0 || frame->fn >= UDF_MAX_FUNCS)
+        return;
+    s = MetricsSlotGet();
+    c = &s->fn[frame->fn];
+    for (us = (ULONGLONG)((double)ticks * g_metricsNsPerTick) / 1000; us && bucket < METRICS_BUCKETS - 1; us >>= 1)
+        bucket++;
+    MetricsAdd(s, &c->calls, 1);
+    MetricsAdd(s, &c->ticks, ticks);
+    MetricsAdd(s, &c->buckets[bucket], 1);
+    if (ticks > c->maxTicks)
+        c->maxTicks = ticks;        // Shared slot: a lost maximum is harmless
+}
+
+void MetricsCallback(int via, LONGLONG ticks)
+{
+    MetricsSlot* s;
+
+    if (via < 0 || via >= METRICS_VIAS)
+        return;
+    s = MetricsSlotGet();
+    MetricsAdd(s, &s->callbacks[via], 1);
+    MetricsAdd(s, &s->callbackTicks[via], ticks);
+}
+
+static int MetricsSlotsUsed(void)
+{
+    LONG n = ReadAcquire(&g_metricsSlotCount);
+    return n < METRICS_MAX_THREADS ? (int)n : METRICS_MAX_THREADS;
+}
+
+// Sums the slots into the function buffer; callbacks and their ticks into the arrays given
+static void MetricsGatherCalls(int functions, LONGLONG* callbacks, LONGLONG* callbackTicks)
+{
+    int slots = MetricsSlotsUsed(), fn, s, b, v;
+
+    ZeroMemory(callbacks, METRICS_VIAS * sizeof(LONGLONG));
+    ZeroMemory(callbackTicks, METRICS_VIAS * sizeof(LONGLONG));
+    for (fn = 0; fn < functions; fn++)
+    {
+        MetricsFunction* f = &g_metricsFunctions[fn];
+        LONGLONG ticks = 0, maxTicks = 0;
+
+        ZeroMemory(f, sizeof(*f));
+        wcsncpy_s(f->name, METRICS_NAME, UdfFunctionName(fn), _TRUNCATE);
+        for (s = 0; s <= slots; s++)
+        {
+            const MetricsCalls* c = s < slots ? &g_metricsSlots[s].fn[fn] : &g_metricsOverflow.fn[fn];
+            f->calls += c->calls;
+            ticks += c->ticks;
+            if (c->maxTicks > maxTicks)
+                maxTicks = c->maxTicks;
+            for (b = 0; b < METRICS_BUCKETS; b++)
+                f->buckets[b] += c->buckets[b];
+        }
+        f->totalNs = (LONGLONG)((double)ticks * g_metricsNsPerTick);
+        f->maxNs = (LONGLONG)((double)maxTicks * g_metricsNsPerTick);
+        AllocTrackTotals(fn, &f->allocs, &f->allocBytes, &f->liveBytes);
+    }
+    for (s = 0; s <= slots; s++)
+    {
+        const MetricsSlot* slot = s < slots ? &g_metricsSlots[s] : &g_metricsOverflow;
+        for (v = 0; v < METRICS_VIAS; v++)
+        {
+            callbacks[v] += slot->callbacks[v];
+            callbackTicks[v] += slot->callbackTicks[v];
+        }
+    }
+}
+
+static void MetricsSetCounter(int* used, const wchar_t* prefix, const wchar_t* name, double value)
+{
+    MetricsCounter* c;
+
+    if (*used >= METRICS_COUNTERS)
+        return;
+    c = &g_metricsCounters[(*used)++];
+    swprintf_s(c->name, METRICS_NAME, L"%ls.%ls", prefix, name);
+    c->value = value;
+}
+
+// Copies the numeric rows of every module table; a table with Hits and Misses also gets a HitRate
+static int MetricsGatherCounters(void)
+{
+    int used = 0, i, r;
+
+    for (i = 0; i < (int)_countof(g_metricsSources); i++)
+    {
+        LPXLOPER12 table = g_metricsSources[i].table();
+        double hits = -1.0, misses = -1.0;
+
+        if (!table)
+            continue;
+        if ((table->xltype & xltypeMulti) == xltypeMulti && table->val.array.columns == 2)
+        {
+            for (r = 0; r < table->val.array.rows; r++)
+            {
+                const XLOPER12* name = &table->val.array.lparray[r * 2];
+                const XLOPER12* value = &table->val.array.lparray[r * 2 + 1];
+                wchar_t text[METRICS_NAME];
+                int len;
+                if ((name->xltype & xltypeStr) != xltypeStr || (value->xltype & xltypeNum) != xltypeNum)
+                    continue;
+                len = name->val.str[0] < METRICS_NAME - 1 ? name->val.str[0] : METRICS_NAME - 1;
+                wmemcpy(text, name->val.str + 1, len);
+                text[len] = 0;
+                MetricsSetCounter(&used, g_metricsSources[i].prefix, text, value->val.num);
+                if (wcscmp(text, L"Hits") == 0)
+                    hits = value->val.num;
+                else if (wcscmp(text, L"Misses") == 0)
+                    misses = value->val.num;
+            }
+        }
+        if (hits >= 0.0 && misses >= 0.0)
+            MetricsSetCounter(&used, g_metricsSources[i].prefix, L"HitRate", hits + misses > 0.0 ? hits / (hits + misses) : 0.0);
+        XlFreeResult(table);
+        GlobalFree(table);
+    }
+    return used;
+}
+
+static void MetricsPublish(LONGLONG state)
+{
+    MetricsHeader* h = g_metricsView;
+    LONGLONG callbacks[METRICS_VIAS], callbackTicks[METRICS_VIAS];
+    LARGE_INTEGER t0, t1;
+    LONGLONG sequence;
+    int used, v;
+
+    QueryPerformanceCounter(&t0);
+    MetricsGatherCalls((int)h->functions, callbacks, callbackTicks);
+    used = MetricsGatherCounters();
+
+    // Single writer: odd while the segment is inconsistent, even again when it is not
+    sequence = h->sequence;
+    InterlockedExchange64(&h->sequence, sequence + 1);
+    memcpy(METRICS_FUNCTION(h, 0), g_metricsFunctions, h->functions * sizeof(MetricsFunction));
+    memcpy(METRICS_COUNTER(h, 0), g_metricsCounters, (SIZE_T)used * sizeof(MetricsCounter));
+    h->countersUsed = used;
+    for (v = 0; v < METRICS_VIAS; v++)
+    {
+        h->callbacks[v] = callbacks[v];
+        h->callbackNs[v] = (LONGLONG)((double)callbackTicks[v] * g_metricsNsPerTick);
+    }
+    h->state = state;
+    h->publishes++;
+    h->publishedTick = GetTickCount64();
+    QueryPerformanceCounter(&t1);
+    h->publishUs = (ULONGLONG)((double)(t1.QuadPart - t0.QuadPart) * g_metricsNsPerTick / 1000.0);
+    WriteRelease64(&h->sequence, sequence + 2);
+}
+
+static DWORD WINAPI MetricsPublisherMain(LPVOID parameter)
+{
+    LONG running = 0;
+
+    (void)parameter;
+    while (!ReadAcquire(&g_metricsStop))
+    {
+        MetricsPublish(METRICS_OPEN);
+        WaitOnAddress(&g_metricsStop, &running, sizeof(running), g_metricsIntervalMs);
+    }
+    return 0;
+}
+
+static void MetricsUnmap(void)
+{
+    if (g_metricsView)
+        UnmapViewOfFile(g_metricsView);
+    if (g_metricsMapping)
+        CloseHandle(g_metricsMapping);
+    if (g_metricsFile != INVALID_HANDLE_VALUE)
+        CloseHandle(g_metricsFile);
+    g_metricsView = NULL;
+    g_metricsMapping = NULL;
+    g_metricsFile = INVALID_HANDLE_VALUE;
+}
+
+BOOL MetricsOpen(void)
+{
+    wchar_t dir[MAX_PATH - 64], env[16], name[96];
+    LARGE_INTEGER freq;
+    MetricsHeader* h;
+    DWORD n;
+    int functions = UdfFunctionCount();
+
+    if (InterlockedCompareExchange(&g_metricsState, 1, 0) != 0)
+        return FALSE;
+    n = GetEnvironmentVariableW(L"XLL_METRICS", dir, (DWORD)_countof(dir));
+    if (n == 0 || n >= _countof(dir))
+    {
+        InterlockedExchange(&g_metricsState, 0);
+        return FALSE;
+    }
+    if (GetEnvironmentVariableW(L"XLL_METRICS_MS", env, (DWORD)_countof(env)))
+        g_metricsIntervalMs = (DWORD)wcstol(env, NULL, 10);
+    if (g_metricsIntervalMs < 10)
+        g_metricsIntervalMs = 10;
+    if (!g_metricsSlots)
+    {
+        BYTE* block = (BYTE*)GlobalAlloc(GPTR, METRICS_MAX_THREADS * sizeof(MetricsSlot) + 64);
+        if (!block)
+        {
+            InterlockedExchange(&g_metricsState, 0);
+            return FALSE;
+        }
+        g_metricsSlots = (MetricsSlot*)(((ULONG_PTR)block + 63) & ~(ULONG_PTR)63);
+    }
+    QueryPerformanceFrequency(&freq);
+    g_metricsNsPerTick = 1e9 / (double)freq.QuadPart;
+
+    swprintf_s(g_metricsPath, MAX_PATH, L"%ls/%ls-%lu.metrics", dir, UdfModuleName(), (unsigned long)GetCurrentProcessId());
+    swprintf_s(name, _countof(name), L"Local\\XllMetrics-%ls-%lu", UdfModuleName(), (unsigned long)GetCurrentProcessId());
+    g_metricsBytes = ((sizeof(MetricsHeader) + 63) & ~(SIZE_T)63)
+        + (SIZE_T)functions * sizeof(MetricsFunction) + METRICS_COUNTERS * sizeof(MetricsCounter);
+    g_metricsFile = CreateFileW(g_metricsPath, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g_metricsFile != INVALID_HANDLE_VALUE)
+        g_metricsMapping = CreateFileMappingW(g_metricsFile, NULL, PAGE_READWRITE, 0, (DWORD)g_metricsBytes, name);
+    if (g_metricsMapping)
+        g_metricsView = (MetricsHeader*)MapViewOfFile(g_metricsMapping, FILE_MAP_ALL_ACCESS, 0, 0, g_metricsBytes);
+    if (!g_metricsView)
+    {
+        MetricsUnmap();
+        InterlockedExchange(&g_metricsState, 0);
+        return FALSE;
+    }
+
+    // The layout first, under an odd sequence: a reader sees nothing until the first publish
+    h = g_metricsView;
+    ZeroMemory(h, g_metricsBytes);
+    h->sequence = 1;
+    h->magic = METRICS_MAGIC;
+    h->version = METRICS_VERSION;
+    h->headerBytes = (UINT32)((sizeof(MetricsHeader) + 63) & ~(SIZE_T)63);
+    h->functionBytes = (UINT32)sizeof(MetricsFunction);
+    h->counterBytes = (UINT32)sizeof(MetricsCounter);
+    h->functions = (UINT32)functions;
+    h->counters = METRICS_COUNTERS;
+    h->buckets = METRICS_BUCKETS;
+    h->pid = (UINT32)GetCurrentProcessId();
+    h->intervalMs = g_metricsIntervalMs;
+    wcsncpy_s(h->module, METRICS_NAME, UdfModuleName(), _TRUNCATE);
+    WriteRelease64(&h->sequence, 2);
+
+    InterlockedOr(&g_udfHooks, UDF_HOOK_METRICS);
+    InterlockedExchange(&g_metricsStop, 0);
+    g_metricsThread = CreateThread(NULL, 64 * 1024, MetricsPublisherMain, NULL, 0, NULL);
+    InterlockedExchange(&g_metricsState, 2);
+    return TRUE;
+}
+
+void MetricsClose(void)
+{
+    if (InterlockedCompareExchange(&g_metricsState, 1, 2) != 2)
+        return;
+    InterlockedAnd(&g_udfHooks, ~UDF_HOOK_METRICS);
+    InterlockedExchange(&g_metricsStop, 1);
+    WakeByAddressAll((PVOID)&g_metricsStop);
+    if (g_metricsThread)
+    {
+        WaitForSingleObject(g_metricsThread, INFINITE);
+        CloseHandle(g_metricsThread);
+        g_metricsThread = NULL;
+    }
+    MetricsPublish(METRICS_CLOSED);
+    MetricsUnmap();
+    DeleteFileW(g_metricsPath);
+    InterlockedExchange(&g_metricsState, 0);
+}
+
+LPXLOPER12 MetricsTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Publishes", L"IntervalMs", L"PublishUs", L"Functions", L"Counters", L"Threads", L"SegmentBytes"
+    };
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    LPXLOPER12 table;
+    MetricsHeader* h;
+    int i;
+
+    if (ReadAcquire(&g_metricsState) != 2)
+        return XlNewStr(L"Metrics off (set XLL_METRICS to a directory)");
+    table = XlNewMulti(rows + 1, 2);
+    if (!table)
+        return XlNewErr(xlerrNA);
+    h = g_metricsView;
+    values[0] = (double)ReadAcquire64(&h->publishes);
+    values[1] = (double)h->intervalMs;
+    values[2] = (double)ReadAcquire64((volatile LONGLONG*)&h->publishUs);
+    values[3] = (double)h->functions;
+    values[4] = (double)ReadAcquire64(&h->countersUsed);
+    values[5] = (double)ReadAcquire(&g_metricsSlotCount);
+    values[6] = (double)g_metricsBytes;
+    XlSetStr(&table->val.array.lparray[0], L"Segment");
+    XlSetStr(&table->val.array.lparray[1], g_metricsPath);
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[(i + 1) * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[(i + 1) * 2 + 1], values[i]);
+    }
+    return table;
+}
@@ -0,0 +1,112 @@
+/*
+**  Metrics
+**
+**  Live counters in a shared-memory segment, so dashboards can watch an XLL
+**  without opening Excel. With XLL_METRICS set to a directory, xlAutoOpen
+**  maps <directory>/<module>-<pid>.metrics. On Windows the mapping is also
+**  named Local\XllMetrics-<module>-<pid>. A reader maps either one read-only
+**  and copies snapshots out of it (see Bench/XllMetrics.c).
+**
+**  Calc threads never write to the segment. With metrics on, every UDF frame
+**  and Excel callback adds its duration to counters in its own thread's slot
+**  (UDF_HOOK_METRICS). Those are plain adds on a line that no other thread
+**  writes, as in AllocTrack. Every XLL_METRICS_MS milliseconds (default
+**  1000) a publisher thread sums the slots and writes the segment. It
+**  copies in the per-function calls, latency buckets and allocation
+**  counters, the callback counts, and the name/value tables of the
+**  modules: result cache, handle store, lookups, reductions and so on.
+**
+**  The segment has a single writer, so a seqlock versions it. The publisher
+**  makes 'sequence' odd, writes, then makes it even again. A reader copies
+**  the segment between two reads of 'sequence' and keeps the copy only if
+**  both reads are the same even number. The reader retries instead of ever
+**  blocking the publisher. On close the publisher writes a last snapshot,
+**  sets 'state' to METRICS_CLOSED and deletes the file.
+**
+**  The layout below is the format: a fixed header, 'functions' function
+**  records, then 'counters' counter records. A reader must check 'magic'
+**  and 'version', and take the record sizes from the header.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+
+#define METRICS_MAGIC       0x544D4C58u     // "XLMT"
+#define METRICS_VERSION     1
+#define METRICS_NAME        32              // Characters in names, terminator included
+#define METRICS_BUCKETS     20              // Latency buckets
+#define METRICS_COUNTERS    192             // Counter records
+#define METRICS_INTERVAL_MS 1000            // Default of XLL_METRICS_MS
+
+#define METRICS_OPEN        1
+#define METRICS_CLOSED      2
+
+// Callback counters, by UdfHooks entry point (UDF_VIA_*)
+#define METRICS_VIAS        3
+
+typedef struct MetricsHeader
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT32 headerBytes;
+    UINT32 functionBytes;           // Size of one MetricsFunction
+    UINT32 counterBytes;            // Size of one MetricsCounter
+    UINT32 functions;               // Function records after the header
+    UINT32 counters;                // Counter records after the functions
+    UINT32 buckets;                 // METRICS_BUCKETS
+    UINT32 pid;
+    UINT32 intervalMs;
+    WCHAR module[METRICS_NAME];
+
+    volatile LONGLONG sequence;     // Seqlock: odd while a snapshot is written
+    LONGLONG state;                 // METRICS_OPEN or METRICS_CLOSED
+    LONGLONG publishes;
+    ULONGLONG publishedTick;        // GetTickCount64 at the last publish
+    ULONGLONG publishUs;            // Time the last publish took
+    LONGLONG countersUsed;          // Counter records filled
+    LONGLONG callbacks[METRICS_VIAS];
+    LONGLONG callbackNs[METRICS_VIAS];
+} MetricsHeader;
+
+// Bucket 0 counts calls under 1 us, bucket b calls from 2^(b-1) us up to 2^b us,
+// and the last bucket everything longer
+typedef struct MetricsFunction
+{
+    WCHAR name[METRICS_NAME];
+    LONGLONG calls;
+    LONGLONG totalNs;
+    LONGLONG maxNs;
+    LONGLONG buckets[METRICS_BUCKETS];
+    LONGLONG allocs;
+    LONGLONG allocBytes;
+    LONGLONG liveBytes;
+} MetricsFunction;
+
+// One row of a module's table, named "<Module>.<Row>"
+typedef struct MetricsCounter
+{
+    WCHAR name[METRICS_NAME];
+    double value;
+} MetricsCounter;
+
+// Records of a mapped (or copied) segment
+#define METRICS_FUNCTION(h, i)  ((MetricsFunction*)((BYTE*)(h) + (h)->headerBytes + (SIZE_T)(i) * (h)->functionBytes))
+#define METRICS_COUNTER(h, i)   ((MetricsCounter*)((BYTE*)(h) + (h)->headerBytes \
+                                    + (SIZE_T)(h)->functions * (h)->functionBytes + (SIZE_T)(i) * (h)->counterBytes))
+
+// Maps the segment and starts the publisher if XLL_METRICS names a directory (xlAutoOpen);
+// returns FALSE when metrics stay off
+BOOL MetricsOpen(void);
+
+// Publishes a last snapshot, stops the publisher and removes the segment (xlAutoClose)
+void MetricsClose(void);
+
+// From UdfHooksLeave and UdfHooksCallbackEnd while UDF_HOOK_METRICS is on
+void MetricsLeave(const UdfFrame* frame, LONGLONG endTicks);
+void MetricsCallback(int via, LONGLONG ticks);
+
+// Segment path, publishes, interval and the time the last publish took
+LPXLOPER12 MetricsTable(void);
@@ -0,0 +1,492 @@
+/*
+**  MicroBatch
+**
+**  Open batches, their leaders and the server connections. See MicroBatch.h.
+**
+**  Each batched function has a queue holding at most one open batch, under
+**  an SRW lock that is only held to add a call or close the batch. A caller
+**  copies its arguments in under the lock, so once the leader has closed
+**  the batch every argument it sends is in place. A batch is reference
+**  counted like a SingleFlight call: whoever leaves it last frees it, and
+**  the leader never waits for its followers to wake up.
+**
+**  The quiet gap follows the arrivals: every call updates the queue's moving
+**  average of the time since the previous call, so the gap is short while
+**  calls pour in and a slow trickle does not hold a batch back.
+**
+**  A connection is a channel of the server segment, claimed with a compare
+**  and exchange on its state so that several Excel processes can share one
+**  server. Callers waiting for a connection sleep on g_batchReleased, bumped
+**  whenever this process frees one, and look again every millisecond for
+**  connections freed by other processes.
+*/
+
+#include <windows.h>
+#include <string.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "UdfHooks.h"
+#include "Governor.h"
+#include "XlHelpers.h"
+#include "MicroBatch.h"
+
+#define MICROBATCH_GAP_SHIFT    3       // Moving average of arrival gaps over about 8 calls
+#define MICROBATCH_GAP_FACTOR   4       // Quiet gap, in mean arrival gaps
+
+typedef struct MicroBatchCalls
+{
+    volatile LONG calls;            // Under the queue lock; read by the leader without it
+    volatile LONG done;             // Results written; followers wait on its address
+    volatile LONG refs;
+    volatile LONG failed;           // No answer (server gone): every caller computes locally
+    int argCount;
+    LONGLONG opened;                // Tick of the first call
+    double args[MICROBATCH_MAX_CALLS * MICROBATCH_MAX_ARGS];
+    double results[MICROBATCH_MAX_CALLS];
+} MicroBatchCalls;
+
+typedef struct __declspec(align(64)) MicroBatchQueue
+{
+    SRWLOCK lock;
+    MicroBatchCalls* open;
+    LONGLONG lastArrival;
+    volatile LONGLONG gapTicks;     // Mean time between calls
+} MicroBatchQueue;
+
+typedef struct MicroBatchStats
+{
+    volatile LONGLONG calls;
+    volatile LONGLONG trips;        // Requests sent, batched or not
+    volatile LONGLONG sent;         // Calls in them
+    volatile LONGLONG tripTicks;
+    volatile LONGLONG openTicks;    // From a batch's first call to sending it
+    volatile LONGLONG closedFull;
+    volatile LONGLONG closedQuiet;
+    volatile LONGLONG closedWindow;
+    volatile LONGLONG connectionWaits;
+    volatile LONGLONG local;
+    volatile LONGLONG failed;
+    volatile LONG maxBatch;
+} MicroBatchStats;
+
+static MicroBatchQueue g_batchQueues[UDF_MAX_FUNCS];
+static BYTE g_batchFlag[UDF_MAX_FUNCS];
+static WCHAR g_batchNames[UDF_MAX_FUNCS][MICROBATCH_NAME];
+static MicroBatchStats g_batchStats;
+static int g_batchChannels = 0;
+static volatile LONG g_batchDown = 0;
+static volatile LONG g_batchReleased = 0;
+static volatile LONG g_batchNext = 0;
+static LONGLONG g_batchWindowUs = MICROBATCH_WINDOW_US;
+static LONGLONG g_batchWindowTicks = 0;
+static LONGLONG g_batchMinGapTicks = 0;
+static double g_batchUsPerTick = 0.0;
+static HANDLE g_batchRequest[MICROBATCH_MAX_CHANNELS];
+static HANDLE g_batchReply[MICROBATCH_MAX_CHANNELS];
+static HANDLE g_batchProcess = NULL;
+static HANDLE g_batchFile = INVALID_HANDLE_VALUE;
+static HANDLE g_batchMapping = NULL;
+static MicroBatchServer* g_batchServer = NULL;
+
+static HANDLE MicroBatchSemaphore(UINT32 serverPid, int channel, const wchar_t* role)
+{
+    wchar_t name[96];
+    swprintf_s(name, _countof(name), MICROBATCH_SEMAPHORE, serverPid, channel, role);
+    return CreateSemaphoreW(NULL, 0, 0x10000, name);
+}
+
+static LONGLONG MicroBatchNow(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static void MicroBatchUnmap(void)
+{
+    int i;
+
+    for (i = 0; i < MICROBATCH_MAX_CHANNELS; i++)
+    {
+        if (g_batchRequest[i])
+            CloseHandle(g_batchRequest[i]);
+        if (g_batchReply[i])
+            CloseHandle(g_batchReply[i]);
+        g_batchRequest[i] = g_batchReply[i] = NULL;
+    }
+    if (g_batchProcess)
+        CloseHandle(g_batchProcess);
+    if (g_batchServer)
+        UnmapViewOfFile(g_batchServer);
+    if (g_batchMapping)
+        CloseHandle(g_batchMapping);
+    if (g_batchFile != INVALID_HANDLE_VALUE)
+        CloseHandle(g_batchFile);
+    g_batchProcess = NULL;
+    g_batchServer = NULL;
+    g_batchMapping = NULL;
+    g_batchFile = INVALID_HANDLE_VALUE;
+}
+
+// Maps the server's segment and opens its semaphores; returns its channel count, 0 if it is not there
+static int MicroBatchConnect(const wchar_t* path)
+{
+    LARGE_INTEGER size;
+    const MicroBatchServer* s;
+    int i, channels;
+
+    g_batchFile = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g_batchFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(g_batchFile, &size)
+        || size.QuadPart < (LONGLONG)sizeof(MicroBatchServer))
+        return 0;
+    g_batchMapping = CreateFileMappingW(g_batchFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+    if (g_batchMapping)
+        g_batchServer = (MicroBatchServer*)MapViewOfFile(g_batchMapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size.QuadPart);
+    s = g_batchServer;
+    if (!s || ReadAcquire(&s->magic) != MICROBATCH_MAGIC || s->version != MICROBATCH_VERSION
+        || s->channels == 0 || s->maxCalls != MICROBATCH_MAX_CALLS || s->maxArgs != MICROBATCH_MAX_ARGS
+        || MICROBATCH_SEGMENT_BYTES(s->channels) > (SIZE_T)size.QuadPart)
+        return 0;
+    channels = s->channels < MICROBATCH_MAX_CHANNELS ? (int)s->channels : MICROBATCH_MAX_CHANNELS;
+    g_batchProcess = OpenProcess(SYNCHRONIZE, FALSE, s->pid);
+    if (!g_batchProcess)
+        return 0;
+    for (i = 0; i < channels; i++)
+    {
+        g_batchRequest[i] = MicroBatchSemaphore(s->pid, i, L"request");
+        g_batchReply[i] = MicroBatchSemaphore(s->pid, i, L"reply");
+        if (!g_batchRequest[i] || !g_batchReply[i])
+            return 0;
+    }
+    return channels;
+}
+
+int MicroBatchInit(const LPWSTR* rgFuncs, int rows, int columns)
+{
+    wchar_t env[16], path[MAX_PATH];
+    LARGE_INTEGER freq;
+    int i, batched = 0;
+
+    if (g_batchChannels || columns <= GOVERNOR_COLUMN)
+        return g_batchChannels;
+    if (!GetEnvironmentVariableW(L"XLL_BATCH_SERVER", path, (DWORD)_countof(path)) || !path[0])
+        return 0;
+    if (rows > UDF_MAX_FUNCS)
+        rows = UDF_MAX_FUNCS;
+    for (i = 0; i < rows; i++)
+    {
+        const wchar_t* spec = rgFuncs[i * columns + GOVERNOR_COLUMN];
+        g_batchFlag[i] = (BYTE)(spec && wcsstr(spec, L"batch") != NULL);
+        if (!g_batchFlag[i])
+            continue;
+        wcsncpy_s(g_batchNames[i], MICROBATCH_NAME, rgFuncs[i * columns], _TRUNCATE);
+        InitializeSRWLock(&g_batchQueues[i].lock);
+        g_batchQueues[i].open = NULL;
+        g_batchQueues[i].lastArrival = 0;
+        g_batchQueues[i].gapTicks = 0;
+        batched++;
+    }
+    if (!batched)
+        return 0;
+
+    // XLL_BATCH_WINDOW_US=0 sends every call on its own
+    if (GetEnvironmentVariableW(L"XLL_BATCH_WINDOW_US", env, (DWORD)_countof(env)))
+        g_batchWindowUs = wcstol(env, NULL, 10) < 0 ? 0 : wcstol(env, NULL, 10);
+    QueryPerformanceFrequency(&freq);
+    g_batchUsPerTick = 1e6 / (double)freq.QuadPart;
+    g_batchWindowTicks = g_batchWindowUs * freq.QuadPart / 1000000;
+    g_batchMinGapTicks = MICROBATCH_MIN_GAP_US * freq.QuadPart / 1000000;
+    if (g_batchWindowUs > 0 && g_batchWindowTicks < 1)
+        g_batchWindowTicks = 1;
+
+    ZeroMemory(&g_batchStats, sizeof(g_batchStats));
+    g_batchDown = 0;
+    g_batchChannels = MicroBatchConnect(path);
+    if (!g_batchChannels)
+        MicroBatchUnmap();
+    return g_batchChannels;
+}
+
+void MicroBatchClose(void)
+{
+    if (!g_batchChannels)
+        return;
+    g_batchChannels = 0;
+    MicroBatchUnmap();
+}
+
+static BOOL MicroBatchServerGone(void)
+{
+    if (ReadAcquire(&g_batchDown))
+        return TRUE;
+    if (ReadAcquire(&g_batchServer->stop) || WaitForSingleObject(g_batchProcess, 0) == WAIT_OBJECT_0)
+    {
+        InterlockedExchange(&g_batchDown, 1);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Claims a free connection, waiting for one if all are busy; -1 once the server has gone
+static int MicroBatchClaim(void)
+{
+    int start = (int)((ULONG)InterlockedIncrement(&g_batchNext) % (ULONG)g_batchChannels);
+    BOOL counted = FALSE;
+    int k;
+
+    for (;;)
+    {
+        LONG seen = ReadAcquire(&g_batchReleased);
+        for (k = 0; k < g_batchChannels; k++)
+        {
+            int i = (start + k) % g_batchChannels;
+            MicroBatchChannel* c = MICROBATCH_CHANNEL(g_batchServer, i);
+            if (ReadAcquire(&c->state) == MICROBATCH_FREE
+                && InterlockedCompareExchange(&c->state, MICROBATCH_CLAIMED, MICROBATCH_FREE) == MICROBATCH_FREE)
+                return i;
+        }
+        if (MicroBatchServerGone())
+            return -1;
+        if (!counted)
+        {
+            InterlockedIncrement64(&g_batchStats.connectionWaits);
+            counted = TRUE;
+        }
+        WaitOnAddress(&g_batchReleased, &seen, sizeof(LONG), 1);
+    }
+}
+
+static void MicroBatchRelease(int channel)
+{
+    WriteRelease(&MICROBATCH_CHANNEL(g_batchServer, channel)->state, MICROBATCH_FREE);
+    InterlockedIncrement(&g_batchReleased);
+    WakeByAddressSingle((PVOID)&g_batchReleased);
+}
+
+// One request on a claimed connection: calls x argCount arguments in, calls results out.
+// This is the only code that talks to the server; FALSE (no results) if it died.
+static BOOL MicroBatchRoundTrip(int channel, int fn, int argCount, const double* args, int calls, double* results)
+{
+    MicroBatchChannel* c = MICROBATCH_CHANNEL(g_batchServer, channel);
+    LONGLONG start = MicroBatchNow();
+
+    c->calls = calls;
+    c->argCount = argCount;
+    wmemcpy(c->name, g_batchNames[fn], MICROBATCH_NAME);
+    memcpy(c->args, args, (SIZE_T)calls * argCount * sizeof(double));
+    WriteRelease(&c->state, MICROBATCH_REQUEST);
+    ReleaseSemaphore(g_batchRequest[channel], 1, NULL);
+
+    while (ReadAcquire(&c->state) != MICROBATCH_REPLY)
+    {
+        WaitForSingleObject(g_batchReply[channel], MICROBATCH_POLL_MS);
+        if (ReadAcquire(&c->state) != MICROBATCH_REPLY && MicroBatchServerGone())
+        {
+            InterlockedExchangeAdd64(&g_batchStats.failed, calls);
+            return FALSE;       // The connection stays claimed: nothing will answer on it
+        }
+    }
+    memcpy(results, c->results, (SIZE_T)calls * sizeof(double));
+    MicroBatchRelease(channel);
+
+    InterlockedIncrement64(&g_batchStats.trips);
+    InterlockedExchangeAdd64(&g_batchStats.sent, calls);
+    InterlockedExchangeAdd64(&g_batchStats.tripTicks, MicroBatchNow() - start);
+    for (LONG peak = ReadAcquire(&g_batchStats.maxBatch); calls > peak; peak = ReadAcquire(&g_batchStats.maxBatch))
+        if (InterlockedCompareExchange(&g_batchStats.maxBatch, calls, peak) == peak)
+            break;
+    return TRUE;
+}
+
+// One call on its own connection: the unbatched path; 0 when the server is gone
+static int MicroBatchAlone(int fn, const double* args, int count, double* result)
+{
+    int channel = MicroBatchClaim();
+    if (channel < 0)
+    {
+        InterlockedIncrement64(&g_batchStats.failed);
+        return 0;
+    }
+    return MicroBatchRoundTrip(channel, fn, count, args, 1, result);
+}
+
+static LONGLONG MicroBatchQuietGap(const MicroBatchQueue* q)
+{
+    LONGLONG gap = ReadAcquire64(&q->gapTicks) * MICROBATCH_GAP_FACTOR;
+    return gap < g_batchMinGapTicks ? g_batchMinGapTicks : gap > g_batchWindowTicks ? g_batchWindowTicks : gap;
+}
+
+// The leader: takes a connection, lets calls join until the batch is closed, sends it and wakes the rest
+static void MicroBatchLead(MicroBatchQueue* q, int fn, MicroBatchCalls* b)
+{
+    int channel = MicroBatchClaim();
+    LONG seen = 0, calls;
+    LONGLONG now = MicroBatchNow(), last = b->opened;
+    volatile LONGLONG* reason = &g_batchStats.closedWindow;
+
+    while (channel >= 0)
+    {
+        calls = ReadAcquire(&b->calls);
+        if (calls != seen)
+        {
+            seen = calls;
+            last = now;
+        }
+        if (calls >= MICROBATCH_MAX_CALLS)
+        {
+            reason = &g_batchStats.closedFull;
+            break;
+        }
+        if (now - last >= MicroBatchQuietGap(q))
+        {
+            reason = &g_batchStats.closedQuiet;
+            break;
+        }
+        if (now - b->opened >= g_batchWindowTicks)
+            break;
+        Sleep(0);
+        now = MicroBatchNow();
+    }
+
+    AcquireSRWLockExclusive(&q->lock);
+    if (q->open == b)
+        q->open = NULL;
+    calls = b->calls;
+    ReleaseSRWLockExclusive(&q->lock);
+
+    if (channel >= 0)
+    {
+        InterlockedIncrement64(reason);
+        InterlockedExchangeAdd64(&g_batchStats.openTicks, MicroBatchNow() - b->opened);
+        if (!MicroBatchRoundTrip(channel, fn, b->argCount, b->args, calls, b->results))
+            b->failed = 1;
+    }
+    else
+    {
+        b->failed = 1;
+        InterlockedExchangeAdd64(&g_batchStats.failed, calls);
+    }
+    WriteRelease(&b->done, 1);
+    WakeByAddressAll((PVOID)&b->done);
+}
+
+int MicroBatchCallNum(int fn, const double* args, int count, double* result)
+{
+    MicroBatchQueue* q;
+    MicroBatchCalls* b;
+    LONGLONG now, gap;
+    LONG index, notDone = 0;
+    BOOL leader = FALSE;
+    int answered;
+
+    if (!g_batchChannels || fn < 0 || fn >= UDF_MAX_FUNCS || !g_batchFlag[fn] || count < 0 || count > MICROBATCH_MAX_ARGS)
+        return 0;
+    if (ReadAcquire(&g_batchDown))
+    {
+        InterlockedIncrement64(&g_batchStats.local);
+        return 0;
+    }
+    InterlockedIncrement64(&g_batchStats.calls);
+    if (!g_batchWindowTicks)
+        return MicroBatchAlone(fn, args, count, result);
+
+    q = &g_batchQueues[fn];
+    now = MicroBatchNow();
+    AcquireSRWLockExclusive(&q->lock);
+    gap = q->lastArrival ? now - q->lastArrival : g_batchWindowTicks;
+    if (gap > g_batchWindowTicks)
+        gap = g_batchWindowTicks;
+    q->gapTicks += (gap - q->gapTicks) >> MICROBATCH_GAP_SHIFT;
+    q->lastArrival = now;
+
+    b = q->open;
+    if (b && b->argCount != count)
+        b = NULL;               // Registered with a different argument count: send it alone
+    else if (!b)
+    {
+        b = (MicroBatchCalls*)GlobalAlloc(GMEM_FIXED, sizeof(MicroBatchCalls));
+        if (b)
+        {
+            b->calls = 0;
+            b->done = 0;
+            b->refs = 0;
+            b->failed = 0;
+            b->argCount = count;
+            b->opened = now;
+            q->open = b;
+            leader = TRUE;
+        }
+    }
+    if (!b)
+    {
+        ReleaseSRWLockExclusive(&q->lock);
+        return MicroBatchAlone(fn, args, count, result);
+    }
+    index = b->calls;
+    memcpy(&b->args[index * count], args, count * sizeof(double));
+    InterlockedIncrement(&b->refs);
+    WriteRelease(&b->calls, index + 1);
+    if (index + 1 == MICROBATCH_MAX_CALLS)
+        q->open = NULL;         // Full: the next call opens another
+    ReleaseSRWLockExclusive(&q->lock);
+
+    if (leader)
+        MicroBatchLead(q, fn, b);
+    else
+        while (!ReadAcquire(&b->done))
+            WaitOnAddress(&b->done, &notDone, sizeof(LONG), INFINITE);
+    answered = !b->failed;
+    if (answered)
+        *result = b->results[index];
+    if (InterlockedDecrement(&b->refs) == 0)
+        GlobalFree(b);
+    return answered;
+}
+
+LPXLOPER12 MicroBatchTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Calls", L"RoundTrips", L"MeanBatch", L"MaxBatch", L"ClosedFull", L"ClosedQuiet", L"ClosedWindow",
+        L"MeanOpenUs", L"MeanTripMs", L"WindowUs", L"QuietGapUs", L"Connections", L"ConnectionWaits", L"Local", L"Failed"
+    };
+    const MicroBatchStats* s = &g_batchStats;
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    double trips = (double)ReadAcquire64(&s->trips), sent = (double)ReadAcquire64(&s->sent);
+    double batches = (double)(ReadAcquire64(&s->closedFull) + ReadAcquire64(&s->closedQuiet) + ReadAcquire64(&s->closedWindow));
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    LONGLONG gap = 0;
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+
+    // The quiet gap of the busiest batched function, the one with the shortest gap
+    for (i = 0; g_batchChannels && g_batchWindowTicks && i < UDF_MAX_FUNCS; i++)
+        if (g_batchFlag[i] && g_batchQueues[i].lastArrival && (!gap || MicroBatchQuietGap(&g_batchQueues[i]) < gap))
+            gap = MicroBatchQuietGap(&g_batchQueues[i]);
+
+    values[0] = (double)ReadAcquire64(&s->calls);
+    values[1] = trips;
+    values[2] = trips > 0.0 ? sent / trips : 0.0;
+    values[3] = (double)ReadAcquire(&s->maxBatch);
+    values[4] = (double)ReadAcquire64(&s->closedFull);
+    values[5] = (double)ReadAcquire64(&s->closedQuiet);
+    values[6] = (double)ReadAcquire64(&s->closedWindow);
+    values[7] = batches > 0.0 ? (double)ReadAcquire64(&s->openTicks) * g_batchUsPerTick / batches : 0.0;
+    values[8] = trips > 0.0 ? (double)ReadAcquire64(&s->tripTicks) * g_batchUsPerTick / 1000.0 / trips : 0.0;
+    values[9] = (double)g_batchWindowUs;
+    values[10] = (double)gap * g_batchUsPerTick;
+    values[11] = (double)g_batchChannels;
+    values[12] = (double)ReadAcquire64(&s->connectionWaits);
+    values[13] = (double)ReadAcquire64(&s->local);
+    values[14] = (double)ReadAcquire64(&s->failed);
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
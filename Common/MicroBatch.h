@@ -0,0 +1,110 @@
+/*
+**  MicroBatch
+**
+**  Collects concurrent calls of a function that asks a backend service for
+**  each result, and sends them in one request. When a sheet of cells that
+**  each price through a service recalculates, every calc thread makes its
+**  own round trip, and the service's connection limit turns 5000 cells into
+**  5000 trips queued a few at a time. Batched, the calls that arrive while a
+**  trip is being made share the next one.
+**
+**  The first caller to find no batch open starts one and leads it; callers
+**  that arrive while it is open add their arguments and wait on its done
+**  word (WaitOnAddress). The leader first takes a connection to the server,
+**  so calls keep joining while every connection is busy, and then closes the
+**  batch when the first of these happens:
+**      the batch holds MICROBATCH_MAX_CALLS calls
+**      no call has joined for the quiet gap, four times the recent mean gap
+**      between arrivals (at least MICROBATCH_MIN_GAP_US), so a lone call or
+**      the tail of a burst goes at once
+**      XLL_BATCH_WINDOW_US (default MICROBATCH_WINDOW_US) has passed since
+**      the batch opened
+**  It sends the batch, writes each caller's result into the batch and wakes
+**  them all. XLL_BATCH_WINDOW_US=0 sends every call on its own: the
+**  unbatched path, over the same connections, for comparison.
+**
+**  The backend here is a server process that maps the segment laid out
+**  below (Bench/BatchServer.c stands in for a pricing service), found
+**  through XLL_BATCH_SERVER, the path of its segment file. Each channel is
+**  one connection: a request and a reply area and two named semaphores. A
+**  real service client replaces MicroBatchRoundTrip in MicroBatch.c and
+**  keeps the batching. Without XLL_BATCH_SERVER, or once the server has
+**  died, calls return 0 and compute locally. So do calls that were in
+**  flight when it died: a lost trip costs them the wait, not their result.
+**
+**  Functions are batched when their rgFuncs policy column (GOVERNOR_COLUMN)
+**  has the "batch" flag, e.g. L"auto,pure,remote,batch". Only numeric
+**  calls (doubles in, double out) can be batched.
+**
+**  Usage, inside a UDF:
+**      double args[2] = { x, y }, result;
+**      if (!MicroBatchCallNum(FN_cDoubleInner, args, 2, &result))
+**          result = ...;                   // No server: compute here
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define MICROBATCH_MAGIC        0x48435442u     // "BTCH"
+#define MICROBATCH_VERSION      1
+#define MICROBATCH_MAX_CHANNELS 64
+#define MICROBATCH_MAX_CALLS    256     // Calls in one batch
+#define MICROBATCH_MAX_ARGS     8
+#define MICROBATCH_NAME         32      // Function name in a request, with its terminator
+#define MICROBATCH_WINDOW_US    2000    // Default XLL_BATCH_WINDOW_US
+#define MICROBATCH_MIN_GAP_US   50
+#define MICROBATCH_POLL_MS      20      // How often a waiting leader checks the server is alive
+
+// Channel states
+#define MICROBATCH_FREE         0
+#define MICROBATCH_CLAIMED      1       // A client is writing a request
+#define MICROBATCH_REQUEST      2       // Ready for the server
+#define MICROBATCH_REPLY        3       // Results written, for the client that claimed it
+
+// Server segment: this header, then 'channels' MicroBatchChannel
+typedef struct __declspec(align(64)) MicroBatchServer
+{
+    UINT32 magic;                   // Written last by the server
+    UINT32 version;
+    UINT32 channels;                // Connections: requests the server handles at once
+    UINT32 pid;                     // Server process; names the semaphores
+    UINT32 maxCalls;
+    UINT32 maxArgs;
+    volatile LONG stop;
+} MicroBatchServer;
+
+typedef struct __declspec(align(64)) MicroBatchChannel
+{
+    volatile LONG state;
+    INT32 calls;
+    INT32 argCount;
+    WCHAR name[MICROBATCH_NAME];
+    volatile LONGLONG requests;     // Written by the server
+    volatile LONGLONG served;
+    double args[MICROBATCH_MAX_CALLS * MICROBATCH_MAX_ARGS];   // Call i's arguments at i * argCount
+    double results[MICROBATCH_MAX_CALLS];
+} MicroBatchChannel;
+
+#define MICROBATCH_CHANNEL(server, i) \
+    ((MicroBatchChannel*)((BYTE*)(server) + sizeof(MicroBatchServer)) + (i))
+#define MICROBATCH_SEGMENT_BYTES(channels) \
+    (sizeof(MicroBatchServer) + (SIZE_T)(channels) * sizeof(MicroBatchChannel))
+
+// Name of a channel's semaphore, from the server pid, the channel and L"request" or L"reply"
+#define MICROBATCH_SEMAPHORE    L"Local\\XllBatch-%u-%d-%ls"
+
+// Reads the "batch" flags and connects to XLL_BATCH_SERVER; returns its connection
+// count, 0 when nothing is batched
+int  MicroBatchInit(const LPWSTR* rgFuncs, int rows, int columns);
+void MicroBatchClose(void);
+
+// Returns 1 with *result set when the server answered the call; 0 when the caller must
+// compute locally (no server, or it died before answering)
+int  MicroBatchCallNum(int fn, const double* args, int count, double* result);
+
+// Calls, batches, mean and largest batch, the window and current quiet gap,
+// connection waits, calls computed locally, and calls whose trip the server's death cut
+// short (computed locally as well)
+LPXLOPER12 MicroBatchTable(void);
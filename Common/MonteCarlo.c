@@ -0,0 +1,345 @@
+/*
+**  MonteCarlo
+**
+**  Counter-based generators in SSE2 and the batched path engine. See
+**  MonteCarlo.h.
+**
+**  Both generators take MC_LANES consecutive counters at a time. Philox keeps
+**  each of its four 32-bit counter words for all lanes in one register, and
+**  makes its 32x32->64 multiplies from two _mm_mul_epu32, one for the even
+**  lanes and one for the odd. Threefry's 64-bit words fit two lanes per
+**  register. Path p draws step pair j from counter (p, j). The uniform
+**  stream draws block b from counter (b, MC_STREAM), which no path reaches.
+*/
+
+#include <windows.h>
+#include <emmintrin.h>
+#include <math.h>
+#include <string.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "Reduce.h"
+#include "MonteCarlo.h"
+
+#define MC_STREAM       (~0ull)
+
+// Random123 constants
+#define PHILOX_M0       0xD2511F53u
+#define PHILOX_M1       0xCD9E8D57u
+#define PHILOX_W0       0x9E3779B9u
+#define PHILOX_W1       0xBB67AE85u
+#define PHILOX_ROUNDS   10
+#define THREEFRY_PARITY 0x1BD11BDAA9FC1A22ull
+#define THREEFRY_ROUNDS 20
+
+// Payoff sums of one batch, in path order
+typedef struct McPart
+{
+    double sum;
+    double sumSq;
+} McPart;
+
+typedef struct McJob
+{
+    const McModel* model;
+    double logSpot;
+    double drift;                   // Per step, log space
+    double diffusion;               // vol x sqrt(dt)
+    double discount;
+    McPart* parts;                  // One per batch
+} McJob;
+
+typedef struct __declspec(align(64)) McStats
+{
+    volatile LONGLONG calls;
+    volatile LONGLONG paths;
+    volatile LONGLONG pathSteps;
+    volatile LONGLONG batches;
+    volatile LONGLONG uniforms;
+} McStats;
+
+static McStats g_mcStats;
+
+int McGeneratorFromName(const XLOPER12* name)
+{
+    static const wchar_t* names[] = { L"philox", L"threefry" };
+    wchar_t text[16];
+    int i;
+
+    if (!XlArgStr(name, text, _countof(text)))
+        return MC_PHILOX;
+    for (i = 0; i < (int)_countof(names); i++)
+        if (_wcsicmp(text, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// High and low halves of the 32x32-bit products of a's four lanes and m
+static __forceinline void McMulHiLo(__m128i a, __m128i m, __m128i* hi, __m128i* lo)
+{
+    __m128i even = _mm_mul_epu32(a, m);                         // Lanes 0 and 2
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);      // Lanes 1 and 3
+    *lo = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(2, 0, 2, 0)),
+        _mm_shuffle_epi32(odd, _MM_SHUFFLE(2, 0, 2, 0)));
+    *hi = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(3, 1, 3, 1)),
+        _mm_shuffle_epi32(odd, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+// Philox4x32-10 of counters (first + lane, j) under the seed; two 64-bit words per lane
+static void McPhilox(ULONGLONG seed, ULONGLONG first, ULONGLONG j, ULONGLONG out[2][MC_LANES])
+{
+    const __m128i m0 = _mm_set1_epi32((int)PHILOX_M0), m1 = _mm_set1_epi32((int)PHILOX_M1);
+    const __m128i w0 = _mm_set1_epi32((int)PHILOX_W0), w1 = _mm_set1_epi32((int)PHILOX_W1);
+    __m128i c0, c1, c2, c3, k0, k1, hi0, lo0, hi1, lo1;
+    UINT32 words[4][MC_LANES];
+    int r, l;
+
+    c0 = _mm_setr_epi32((int)(UINT32)first, (int)(UINT32)(first + 1), (int)(UINT32)(first + 2), (int)(UINT32)(first + 3));
+    c1 = _mm_setr_epi32((int)(UINT32)(first >> 32), (int)(UINT32)((first + 1) >> 32),
+        (int)(UINT32)((first + 2) >> 32), (int)(UINT32)((first + 3) >> 32));
+    c2 = _mm_set1_epi32((int)(UINT32)j);
+    c3 = _mm_set1_epi32((int)(UINT32)(j >> 32));
+    k0 = _mm_set1_epi32((int)(UINT32)seed);
+    k1 = _mm_set1_epi32((int)(UINT32)(seed >> 32));
+    for (r = 0; r < PHILOX_ROUNDS; r++)
+    {
+        if (r)
+        {
+            k0 = _mm_add_epi32(k0, w0);
+            k1 = _mm_add_epi32(k1, w1);
+        }
+        McMulHiLo(c0, m0, &hi0, &lo0);
+        McMulHiLo(c2, m1, &hi1, &lo1);
+        c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1), k0);
+        c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3), k1);
+        c1 = lo1;
+        c3 = lo0;
+    }
+    _mm_storeu_si128((__m128i*)words[0], c0);
+    _mm_storeu_si128((__m128i*)words[1], c1);
+    _mm_storeu_si128((__m128i*)words[2], c2);
+    _mm_storeu_si128((__m128i*)words[3], c3);
+    for (l = 0; l < MC_LANES; l++)
+    {
+        out[0][l] = ((ULONGLONG)words[0][l] << 32) | words[1][l];
+        out[1][l] = ((ULONGLONG)words[2][l] << 32) | words[3][l];
+    }
+}
+
+// One Threefry round: mix, rotate by a constant, xor
+#define MC_THREEFRY_ROUND(x0, x1, bits) \
+    x0 = _mm_add_epi64(x0, x1); \
+    x1 = _mm_xor_si128(_mm_or_si128(_mm_slli_epi64(x1, bits), _mm_srli_epi64(x1, 64 - (bits))), x0)
+
+// Threefry2x64-20 of counters (first + lane, j) under the key (seed, 0)
+static void McThreefry(ULONGLONG seed, ULONGLONG first, ULONGLONG j, ULONGLONG out[2][MC_LANES])
+{
+    const ULONGLONG ks[3] = { seed, 0, THREEFRY_PARITY ^ seed };
+    ULONGLONG words[2][2];
+    __m128i x0, x1;
+    int half, i;
+
+    for (half = 0; half < MC_LANES / 2; half++)
+    {
+        x0 = _mm_set_epi64x((LONGLONG)(first + half * 2 + 1 + ks[0]), (LONGLONG)(first + half * 2 + ks[0]));
+        x1 = _mm_set1_epi64x((LONGLONG)(j + ks[1]));
+
+        // Five groups of four rounds, rotations 16 42 12 31 then 16 32 24 21, a key injection after each
+        for (i = 1; i <= THREEFRY_ROUNDS / 4; i++)
+        {
+            if (i & 1)
+            {
+                MC_THREEFRY_ROUND(x0, x1, 16);
+                MC_THREEFRY_ROUND(x0, x1, 42);
+                MC_THREEFRY_ROUND(x0, x1, 12);
+                MC_THREEFRY_ROUND(x0, x1, 31);
+            }
+            else
+            {
+                MC_THREEFRY_ROUND(x0, x1, 16);
+                MC_THREEFRY_ROUND(x0, x1, 32);
+                MC_THREEFRY_ROUND(x0, x1, 24);
+                MC_THREEFRY_ROUND(x0, x1, 21);
+            }
+            x0 = _mm_add_epi64(x0, _mm_set1_epi64x((LONGLONG)ks[i % 3]));
+            x1 = _mm_add_epi64(x1, _mm_set1_epi64x((LONGLONG)(ks[(i + 1) % 3] + (ULONGLONG)i)));
+        }
+        _mm_storeu_si128((__m128i*)words[0], x0);
+        _mm_storeu_si128((__m128i*)words[1], x1);
+        out[0][half * 2] = words[0][0];
+        out[0][half * 2 + 1] = words[0][1];
+        out[1][half * 2] = words[1][0];
+        out[1][half * 2 + 1] = words[1][1];
+    }
+}
+
+static __forceinline void McBlock(int generator, ULONGLONG seed, ULONGLONG first, ULONGLONG j, ULONGLONG out[2][MC_LANES])
+{
+    if (generator == MC_THREEFRY)
+        McThreefry(seed, first, j, out);
+    else
+        McPhilox(seed, first, j, out);
+}
+
+// The top 53 bits, centred in their interval: never 0 or 1
+static __forceinline double McUniform(ULONGLONG bits)
+{
+    return ((double)(bits >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+static void McRunBatch(void* context, LONG b)
+{
+    const McJob* job = (const McJob*)context;
+    const McModel* m = job->model;
+    LONGLONG first = (LONGLONG)b * MC_BATCH;
+    LONGLONG end = m->paths - first < MC_BATCH ? m->paths : first + MC_BATCH;
+    ULONGLONG bits[2][MC_LANES];
+    double logS[MC_LANES], total[MC_LANES], z0[MC_LANES], z1[MC_LANES];
+    McPart part = { 0.0, 0.0 };
+    LONGLONG p;
+    int s, l, lanes;
+
+    for (p = first; p < end; p += MC_LANES)
+    {
+        for (l = 0; l < MC_LANES; l++)
+        {
+            logS[l] = job->logSpot;
+            total[l] = 0.0;
+        }
+        for (s = 0; s < m->steps; s += 2)
+        {
+            McBlock(m->generator, m->seed, (ULONGLONG)p, (ULONGLONG)(s / 2), bits);
+            for (l = 0; l < MC_LANES; l++)
+            {
+                double radius = sqrt(-2.0 * log(McUniform(bits[0][l])));
+                double angle = 6.283185307179586 * McUniform(bits[1][l]);
+                z0[l] = radius * cos(angle);
+                z1[l] = radius * sin(angle);
+            }
+            for (l = 0; l < MC_LANES; l++)
+            {
+                logS[l] += job->drift + job->diffusion * z0[l];
+                total[l] += exp(logS[l]);
+            }
+            if (s + 1 < m->steps)
+                for (l = 0; l < MC_LANES; l++)
+                {
+                    logS[l] += job->drift + job->diffusion * z1[l];
+                    total[l] += exp(logS[l]);
+                }
+        }
+
+        // The last group of a run can hang over its end: those lanes are not counted
+        lanes = end - p < MC_LANES ? (int)(end - p) : MC_LANES;
+        for (l = 0; l < lanes; l++)
+        {
+            double payoff = total[l] / m->steps - m->strike;
+            payoff = payoff > 0.0 ? payoff * job->discount : 0.0;
+            part.sum += payoff;
+            part.sumSq += payoff * payoff;
+        }
+    }
+    job->parts[b] = part;
+}
+
+LPXLOPER12 McPrice(const McModel* model, int threads)
+{
+    McJob job;
+    LONG batches, b;
+    double sum = 0.0, sumSq = 0.0, n, mean, var, dt;
+    LPXLOPER12 result;
+
+    if (!(model->spot > 0.0) || !(model->strike >= 0.0) || !(model->vol >= 0.0) || !(model->maturity > 0.0)
+        || model->steps < 1 || model->steps > MC_MAX_STEPS || model->paths < 1 || model->paths > MC_MAX_PATHS
+        || (model->generator != MC_PHILOX && model->generator != MC_THREEFRY))
+        return XlNewErr(xlerrNum);
+
+    batches = (LONG)((model->paths + MC_BATCH - 1) / MC_BATCH);
+    dt = model->maturity / model->steps;
+    job.model = model;
+    job.logSpot = log(model->spot);
+    job.drift = (model->rate - 0.5 * model->vol * model->vol) * dt;
+    job.diffusion = model->vol * sqrt(dt);
+    job.discount = exp(-model->rate * model->maturity);
+    job.parts = (McPart*)GlobalAlloc(GMEM_FIXED, (SIZE_T)batches * sizeof(McPart));
+    if (!job.parts)
+        return XlNewErr(xlerrNA);
+    ReduceForEach(batches, McRunBatch, &job, threads);
+
+    // Batch order, not completion order: the sums do not depend on the threads
+    for (b = 0; b < batches; b++)
+    {
+        sum += job.parts[b].sum;
+        sumSq += job.parts[b].sumSq;
+    }
+    GlobalFree(job.parts);
+
+    InterlockedIncrement64(&g_mcStats.calls);
+    InterlockedExchangeAdd64(&g_mcStats.paths, model->paths);
+    InterlockedExchangeAdd64(&g_mcStats.pathSteps, model->paths * model->steps);
+    InterlockedExchangeAdd64(&g_mcStats.batches, batches);
+    InterlockedExchangeAdd64(&g_mcStats.uniforms, model->paths * ((model->steps + 1) / 2) * 2);
+
+    n = (double)model->paths;
+    mean = sum / n;
+    var = n > 1.0 ? (sumSq - sum * mean) / (n - 1.0) : 0.0;
+    result = XlNewMulti(1, 2);
+    if (!result)
+        return XlNewErr(xlerrNA);
+    XlSetNum(&result->val.array.lparray[0], mean);
+    XlSetNum(&result->val.array.lparray[1], var > 0.0 ? sqrt(var / n) : 0.0);
+    return result;
+}
+
+LPXLOPER12 McUniforms(ULONGLONG seed, ULONGLONG first, int count, int generator)
+{
+    ULONGLONG bits[2][MC_LANES], group = ~0ull, pos;
+    LPXLOPER12 result;
+    int i, k;
+
+    if (count < 1 || count > MC_MAX_UNIFORMS || (generator != MC_PHILOX && generator != MC_THREEFRY))
+        return XlNewErr(xlerrNum);
+    result = XlNewMulti(count, 1);
+    if (!result)
+        return XlNewErr(xlerrNA);
+
+    // One generator call makes 2 x MC_LANES uniforms: lane k / 2, word k % 2
+    for (i = 0; i < count; i++)
+    {
+        pos = first + (ULONGLONG)i;
+        if (pos / (2 * MC_LANES) != group)
+        {
+            group = pos / (2 * MC_LANES);
+            McBlock(generator, seed, group * MC_LANES, MC_STREAM, bits);
+        }
+        k = (int)(pos % (2 * MC_LANES));
+        XlSetNum(&result->val.array.lparray[i], McUniform(bits[k % 2][k / 2]));
+    }
+    InterlockedExchangeAdd64(&g_mcStats.uniforms, count);
+    return result;
+}
+
+LPXLOPER12 McTable(void)
+{
+    static const wchar_t* names[] = { L"Calls", L"Paths", L"PathSteps", L"Batches", L"Uniforms", L"BatchPaths" };
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    values[0] = (double)ReadAcquire64(&g_mcStats.calls);
+    values[1] = (double)ReadAcquire64(&g_mcStats.paths);
+    values[2] = (double)ReadAcquire64(&g_mcStats.pathSteps);
+    values[3] = (double)ReadAcquire64(&g_mcStats.batches);
+    values[4] = (double)ReadAcquire64(&g_mcStats.uniforms);
+    values[5] = (double)MC_BATCH;
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
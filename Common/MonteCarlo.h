@@ -0,0 +1,67 @@
+/*
+**  MonteCarlo
+**
+**  Monte Carlo on counter-based generators. Philox4x32-10 and
+**  Threefry2x64-20 (Salmon et al., Random123) turn a counter and a key into
+**  random bits with no state in between. Here the key is the seed, and the
+**  counter is the path and the step. Every normal a path draws is therefore
+**  a pure function of (seed, path, step), whichever thread runs the path and
+**  in whatever order.
+**
+**  McPrice simulates geometric Brownian motion under the risk-neutral
+**  measure and prices an arithmetic-average Asian call on the 'steps'
+**  fixings, discounted. With one step that is a European call, which the
+**  Black-Scholes formula checks. Paths are cut into batches of MC_BATCH, the
+**  unit of parallel work, and run on the reduction helpers (Reduce.h,
+**  XLL_REDUCE_THREADS). Within a batch the generator runs on MC_LANES paths
+**  at once with SSE2, one counter word per register, and the paths advance
+**  in lockstep. Each batch leaves the sum and the sum of squares of its
+**  payoffs, added in path order. The batch sums are added in batch order, so
+**  the price is the same to the bit on one thread or sixteen. It can differ
+**  between builds whose math libraries round log, sin and cos differently.
+**
+**  Normals come from pairs of uniforms by Box-Muller. One generator call
+**  makes two 64-bit words, two uniforms in (0, 1) at 53 bits, so one call
+**  covers two steps of a path. McUniforms returns the raw stream, from a
+**  counter range that paths never reach.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define MC_PHILOX       0           // Philox4x32-10
+#define MC_THREEFRY     1           // Threefry2x64-20
+
+#define MC_LANES        4           // Paths generated together
+#define MC_BATCH        4096        // Paths per unit of parallel work
+#define MC_MAX_STEPS    100000
+#define MC_MAX_PATHS    (1LL << 40)
+#define MC_MAX_UNIFORMS (1 << 20)   // Uniforms returned by one McUniforms call
+
+typedef struct McModel
+{
+    double spot;
+    double strike;
+    double rate;                    // Continuously compounded
+    double vol;
+    double maturity;                // Years
+    int steps;                      // Equally spaced fixings
+    LONGLONG paths;
+    ULONGLONG seed;
+    int generator;                  // MC_PHILOX or MC_THREEFRY
+} McModel;
+
+// Generator named by L"philox" or L"threefry" (a missing name is Philox); -1 if unknown
+int McGeneratorFromName(const XLOPER12* name);
+
+// Price and standard error, as a 1x2 row. At most threads threads (0: all) share the
+// paths; the result does not depend on how many. #NUM! for a model out of range.
+LPXLOPER12 McPrice(const McModel* model, int threads);
+
+// A column of count uniforms, number first onwards of the seed's stream
+LPXLOPER12 McUniforms(ULONGLONG seed, ULONGLONG first, int count, int generator);
+
+// Calls, paths, path steps, batches and uniforms drawn
+LPXLOPER12 McTable(void);
@@ -0,0 +1,295 @@
+/*
+**  RangeAgg
+**
+**  Block fingerprints, partial aggregates and the snapshot table. See
+**  RangeAgg.h.
+**
+**  A snapshot slot is locked exclusively for the whole call. Two cells
+**  aggregating the same range hash to different slots (the caller is part of
+**  the key), so they only wait on each other on a collision.
+*/
+
+#include <windows.h>
+#include <math.h>
+#include <string.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "RangeAgg.h"
+
+#define RANGEAGG_MIX        0x9E3779B97F4A7C15ull
+#define RANGEAGG_MIX1       0xBF58476D1CE4E5B9ull
+#define RANGEAGG_MIX2       0x94D049BB133111EBull
+
+// Partial aggregate of the numbers in one block
+typedef struct RangeAggPart
+{
+    double count;
+    double mean;
+    double m2;                      // Sum of squared deviations from the mean
+    double sum;
+    double min;
+    double max;
+} RangeAggPart;
+
+typedef struct __declspec(align(64)) RangeAggSnapshot
+{
+    SRWLOCK lock;
+    UINT64 key;
+    int rows;
+    int columns;
+    int blocks;
+    UINT64* fingerprints;           // blocks of them, then the parts, in one block
+    RangeAggPart* parts;
+} RangeAggSnapshot;
+
+typedef struct __declspec(align(64)) RangeAggStats
+{
+    volatile LONGLONG calls;
+    volatile LONGLONG hits;         // Calls that found their snapshot
+    volatile LONGLONG rebuilds;     // Snapshots (re)built for a new key or shape
+    volatile LONGLONG fullCalls;    // Calls asked to recompute every block
+    volatile LONGLONG blocks;       // Blocks fingerprinted
+    volatile LONGLONG recomputed;   // Blocks whose partial aggregate was recomputed
+} RangeAggStats;
+
+static RangeAggSnapshot g_rangeAggSlots[RANGEAGG_SLOTS];
+static RangeAggStats g_rangeAggStats;
+
+int RangeAggStatFromName(const XLOPER12* name)
+{
+    static const wchar_t* names[] = { L"count", L"sum", L"mean", L"var", L"stdev", L"min", L"max" };
+    wchar_t text[16];
+    int i;
+
+    if (!XlArgStr(name, text, _countof(text)))
+        return RANGEAGG_SUM;
+    for (i = 0; i < (int)_countof(names); i++)
+        if (_wcsicmp(text, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// The calling cell, as a key; 0 when Excel cannot say (called from VBA, or by the host)
+static UINT64 RangeAggCallerKey(void)
+{
+    IDSHEET sheet;
+    RW row;
+    COL column;
+
+    if (!XlCallerCell(&sheet, &row, &column))
+        return 0;
+    return ((UINT64)sheet << 40) ^ ((UINT64)row << 16) ^ (UINT64)column;
+}
+
+// Position-sensitive hash of a block's cells. Each cell becomes one word (type, plus
+// value for numbers, booleans and errors) without branches, salted with its position
+// and mixed on its own (multiply, xor-shift, twice) before it is summed: a plain sum of
+// the words, even weighted by position, lets edits whose changes cancel go unseen.
+static UINT64 RangeAggFingerprint(const XLOPER12* cells, int n)
+{
+    UINT64 a = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        UINT64 type = (UINT64)(cells[i].xltype & 0x0FFF);
+        UINT64 bits, keep, w;
+        memcpy(&bits, &cells[i].val, sizeof(bits));
+        keep = (0 - (UINT64)(type == xltypeNum)) | ((0 - (UINT64)((type & (xltypeBool | xltypeErr)) != 0)) & 0xFFFFFFFFull);
+        w = ((bits & keep) ^ (type << 56)) + (UINT64)i * RANGEAGG_MIX;
+        w = (w ^ (w >> 31)) * RANGEAGG_MIX1;
+        w = (w ^ (w >> 29)) * RANGEAGG_MIX2;
+        a += w ^ (w >> 32);
+    }
+    return a;
+}
+
+static void RangeAggPartCompute(RangeAggPart* p, const XLOPER12* cells, int n)
+{
+    int i;
+
+    p->count = p->mean = p->m2 = p->sum = 0.0;
+    p->min = INFINITY;
+    p->max = -INFINITY;
+    for (i = 0; i < n; i++)
+    {
+        double x, delta;
+        if ((cells[i].xltype & 0x0FFF) != xltypeNum)
+            continue;
+        x = cells[i].val.num;
+        p->count += 1.0;
+        delta = x - p->mean;
+        p->mean += delta / p->count;
+        p->m2 += delta * (x - p->mean);
+        p->sum += x;
+        if (x < p->min) p->min = x;
+        if (x > p->max) p->max = x;
+    }
+}
+
+// Chan et al.: folds part b into a
+static void RangeAggMerge(RangeAggPart* a, const RangeAggPart* b)
+{
+    double n, delta;
+
+    if (b->count == 0.0)
+        return;
+    if (a->count == 0.0)
+    {
+        *a = *b;
+        return;
+    }
+    n = a->count + b->count;
+    delta = b->mean - a->mean;
+    a->mean += delta * b->count / n;
+    a->m2 += b->m2 + delta * delta * a->count * b->count / n;
+    a->count = n;
+    a->sum += b->sum;
+    if (b->min < a->min) a->min = b->min;
+    if (b->max > a->max) a->max = b->max;
+}
+
+static LPXLOPER12 RangeAggResult(const RangeAggPart* p, int stat)
+{
+    switch (stat)
+    {
+    case RANGEAGG_COUNT:    return XlNewNum(p->count);
+    case RANGEAGG_SUM:      return XlNewNum(p->sum);
+    case RANGEAGG_MEAN:     return p->count > 0.0 ? XlNewNum(p->mean) : XlNewErr(xlerrDiv0);
+    case RANGEAGG_VAR:      return p->count > 1.0 ? XlNewNum(p->m2 / (p->count - 1.0)) : XlNewErr(xlerrDiv0);
+    case RANGEAGG_STDEV:    return p->count > 1.0 ? XlNewNum(sqrt(p->m2 / (p->count - 1.0))) : XlNewErr(xlerrDiv0);
+    case RANGEAGG_MIN:      return XlNewNum(p->count > 0.0 ? p->min : 0.0);    // As MIN: 0 without numbers
+    case RANGEAGG_MAX:      return XlNewNum(p->count > 0.0 ? p->max : 0.0);
+    }
+    return XlNewErr(xlerrValue);
+}
+
+// Sizes a slot for a new key or shape; FALSE if the memory is not there
+static BOOL RangeAggRebuild(RangeAggSnapshot* s, UINT64 key, int rows, int columns, int blocks)
+{
+    void* block;
+
+    if (s->fingerprints)
+        GlobalFree(s->fingerprints);
+    s->fingerprints = NULL;
+    s->parts = NULL;
+    s->key = 0;
+    block = GlobalAlloc(GMEM_FIXED, (SIZE_T)blocks * (sizeof(UINT64) + sizeof(RangeAggPart)));
+    if (!block)
+        return FALSE;
+    s->fingerprints = (UINT64*)block;
+    s->parts = (RangeAggPart*)(s->fingerprints + blocks);
+    s->key = key;
+    s->rows = rows;
+    s->columns = columns;
+    s->blocks = blocks;
+    return TRUE;
+}
+
+LPXLOPER12 RangeAggCompute(const XLOPER12* range, int stat, BOOL full)
+{
+    const XLOPER12* cells;
+    RangeAggSnapshot* s;
+    RangeAggPart total, part;
+    UINT64 key;
+    LONGLONG recomputed = 0;
+    int rows, columns, blocks, b, n;
+    BOOL kept;
+
+    if (stat < 0 || !range)
+        return XlNewErr(xlerrValue);
+    if ((range->xltype & xltypeMulti) != xltypeMulti)
+    {
+        // A single value: nothing worth keeping
+        RangeAggPartCompute(&total, range, 1);
+        return RangeAggResult(&total, stat);
+    }
+    rows = range->val.array.rows;
+    columns = range->val.array.columns;
+    cells = range->val.array.lparray;
+    n = rows * columns;
+    blocks = (n + RANGEAGG_BLOCK - 1) / RANGEAGG_BLOCK;
+
+    key = (RangeAggCallerKey() ^ ((UINT64)rows << 32) ^ (UINT64)columns) * RANGEAGG_MIX;
+    key |= 1;                       // 0 marks an empty slot
+    s = &g_rangeAggSlots[(key >> 32) % RANGEAGG_SLOTS];
+
+    AcquireSRWLockExclusive(&s->lock);
+    if (s->key == key && s->rows == rows && s->columns == columns)
+    {
+        InterlockedIncrement64(&g_rangeAggStats.hits);
+        kept = TRUE;
+    }
+    else
+    {
+        InterlockedIncrement64(&g_rangeAggStats.rebuilds);
+        kept = RangeAggRebuild(s, key, rows, columns, blocks);
+        full = TRUE;
+    }
+    memset(&total, 0, sizeof(total));
+    for (b = 0; b < blocks; b++)
+    {
+        int first = b * RANGEAGG_BLOCK;
+        int count = n - first < RANGEAGG_BLOCK ? n - first : RANGEAGG_BLOCK;
+        if (!kept)
+        {
+            // No snapshot: aggregate in full
+            RangeAggPartCompute(&part, cells + first, count);
+            RangeAggMerge(&total, &part);
+            continue;
+        }
+        if (!full)
+        {
+            UINT64 fp = RangeAggFingerprint(cells + first, count);
+            if (fp == s->fingerprints[b])
+            {
+                RangeAggMerge(&total, &s->parts[b]);
+                continue;
+            }
+            s->fingerprints[b] = fp;
+        }
+        else
+        {
+            s->fingerprints[b] = RangeAggFingerprint(cells + first, count);
+        }
+        RangeAggPartCompute(&s->parts[b], cells + first, count);
+        RangeAggMerge(&total, &s->parts[b]);
+        recomputed++;
+    }
+    ReleaseSRWLockExclusive(&s->lock);
+
+    InterlockedIncrement64(&g_rangeAggStats.calls);
+    if (full)
+        InterlockedIncrement64(&g_rangeAggStats.fullCalls);
+    InterlockedExchangeAdd64(&g_rangeAggStats.blocks, blocks);
+    InterlockedExchangeAdd64(&g_rangeAggStats.recomputed, kept ? recomputed : blocks);
+    return RangeAggResult(&total, stat);
+}
+
+LPXLOPER12 RangeAggTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Calls", L"SnapshotHits", L"Rebuilds", L"FullCalls", L"Blocks", L"BlocksRecomputed", L"BlockCells"
+    };
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    values[0] = (double)ReadAcquire64(&g_rangeAggStats.calls);
+    values[1] = (double)ReadAcquire64(&g_rangeAggStats.hits);
+    values[2] = (double)ReadAcquire64(&g_rangeAggStats.rebuilds);
+    values[3] = (double)ReadAcquire64(&g_rangeAggStats.fullCalls);
+    values[4] = (double)ReadAcquire64(&g_rangeAggStats.blocks);
+    values[5] = (double)ReadAcquire64(&g_rangeAggStats.recomputed);
+    values[6] = (double)RANGEAGG_BLOCK;
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
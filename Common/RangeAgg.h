@@ -0,0 +1,51 @@
+/*
+**  RangeAgg
+**
+**  Incremental statistics over large ranges. A range is split into blocks of
+**  RANGEAGG_BLOCK cells (row-major, as in the xltypeMulti array). For each
+**  range the module keeps a snapshot holding, per block, a 64-bit
+**  fingerprint of the cells and the block's partial aggregate: count, sum,
+**  mean, sum of squared deviations, minimum and maximum of its numbers.
+**
+**  On each call every block is fingerprinted again. This is one pass over
+**  the cells, with no branches, that mixes each cell's word on its own
+**  (multiplies and xor-shifts) and sums the results. Only blocks whose fingerprint changed have their partial
+**  aggregate recomputed, and the partials are then merged (Chan's pairwise
+**  formula for the variance). Excel still hands over the whole range, so
+**  reading it stays proportional to its size, but the statistics work
+**  follows the number of changed blocks.
+**
+**  A fingerprint covers each cell's type and, for numbers, booleans and
+**  errors, its value. Strings count by type only, since Excel passes a fresh
+**  copy each time; like SUM, the statistics skip everything but numbers.
+**
+**  Snapshots are kept in a direct-mapped table keyed by the calling cell
+**  (xlfCaller) and the range's shape. A key collision or a new shape
+**  rebuilds the slot. Results never depend on the key, only the work saved.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define RANGEAGG_BLOCK      1024    // Cells per block
+#define RANGEAGG_SLOTS      256     // Snapshots kept
+
+#define RANGEAGG_COUNT      0
+#define RANGEAGG_SUM        1
+#define RANGEAGG_MEAN       2
+#define RANGEAGG_VAR        3       // Sample variance
+#define RANGEAGG_STDEV      4
+#define RANGEAGG_MIN        5
+#define RANGEAGG_MAX        6
+
+// Statistic named by L"count", L"sum", L"mean", L"var", L"stdev", L"min" or L"max"; -1 if unknown
+int RangeAggStatFromName(const XLOPER12* name);
+
+// The statistic over range. full<>0 recomputes every block, refreshing the snapshot.
+// Returns #DIV/0! for mean, var or stdev without enough numbers.
+LPXLOPER12 RangeAggCompute(const XLOPER12* range, int stat, BOOL full);
+
+// Calls, snapshot hits and rebuilds, blocks checked and recomputed
+LPXLOPER12 RangeAggTable(void);
@@ -0,0 +1,647 @@
+/*
+**  Reduce
+**
+**  Chunked reductions and the helper threads that share them. See Reduce.h.
+**
+**  A job lives on the caller's stack. Helpers find it through g_reduceJob
+**  and hold g_reduceRefs while they use it. After the last chunk is done the
+**  caller unpublishes the job and waits for the references to drain before
+**  returning, so a helper that woke late never touches a dead job.
+*/
+
+#include <windows.h>
+#include <emmintrin.h>
+#include <math.h>
+#include <string.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "Reduce.h"
+
+#define REDUCE_JOB_STATS        0
+#define REDUCE_JOB_GATHER       1
+#define REDUCE_JOB_HISTOGRAM    2
+#define REDUCE_JOB_CALLBACK     3
+
+#define REDUCE_STACK_BYTES      (64 * 1024)
+
+// Partial aggregate of the numbers in a block, a chunk or the whole range
+typedef struct ReducePart
+{
+    double count;
+    double sum;                     // sum + comp is the compensated total
+    double comp;
+    double mean;
+    double m2;                      // Sum of squared deviations from the mean
+    double min;
+    double max;
+} ReducePart;
+
+typedef struct ReduceJob
+{
+    int kind;
+    BOOL spread;                    // Stats: var or stdev, so the deviations are needed
+    const XLOPER12* cells;
+    int n;
+    LONG chunks;
+    volatile LONG next;             // Next chunk to take
+    volatile LONG done;             // Chunks finished
+    ReducePart* parts;              // Stats: one per chunk
+    double* values;                 // Gather: REDUCE_CHUNK slots per chunk
+    int* counts;                    //   numbers gathered in each chunk
+    const double* edges;            // Histogram: ascending edges
+    int bins;                       //   edges + 1
+    LONGLONG* histogram;            //   bins counts per chunk
+    void (*run)(void*, LONG);       // Callback: run(context, chunk)
+    void* context;
+    LONG maxHelpers;                // Helpers that may join
+    volatile LONG helpers;          // Helpers that tried to
+} ReduceJob;
+
+typedef struct __declspec(align(64)) ReduceStats
+{
+    volatile LONGLONG calls;
+    volatile LONGLONG cells;
+    volatile LONGLONG parallel;     // Calls shared with the helpers
+    volatile LONGLONG busy;         // Large calls that found the helpers taken
+    volatile LONGLONG chunks;
+    volatile LONGLONG helperChunks; // Chunks run by helpers
+} ReduceStats;
+
+static ReduceStats g_reduceStats;
+
+static volatile LONG g_reduceState = 0;     // 0 not started, 1 changing, 2 helpers running, 3 no helpers
+static HANDLE g_reduceThreads[REDUCE_MAX_THREADS];
+static int g_reduceHelpers = 0;
+static ReduceJob* volatile g_reduceJob = NULL;
+static volatile LONG g_reduceGeneration = 0;    // Bumped to wake the helpers
+static volatile LONG g_reduceRefs = 0;          // Helpers looking at g_reduceJob
+static volatile LONG g_reduceStop = 0;
+
+int ReduceStatFromName(const XLOPER12* name)
+{
+    static const wchar_t* names[] = { L"count", L"sum", L"mean", L"var", L"stdev", L"min", L"max" };
+    wchar_t text[16];
+    int i;
+
+    if (!XlArgStr(name, text, _countof(text)))
+        return REDUCE_SUM;
+    for (i = 0; i < (int)_countof(names); i++)
+        if (_wcsicmp(text, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// Copies the numbers among n cells to out, in order; returns how many. out[k] is
+// written for every cell and only kept for numbers, so there is no branch.
+static int ReduceGather(double* out, const XLOPER12* cells, int n)
+{
+    int i, k = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        out[k] = cells[i].val.num;
+        k += (cells[i].xltype & 0x0FFF) == xltypeNum;
+    }
+    return k;
+}
+
+// Neumaier: adds b, and the compensation it carries, to a compensated sum
+static void ReduceAdd(double* sum, double* comp, double b, double bcomp)
+{
+    double t = *sum + b;
+
+    if (fabs(*sum) >= fabs(b))
+        *comp += (*sum - t) + b;
+    else
+        *comp += (b - t) + *sum;
+    *sum = t;
+    *comp += bcomp;
+}
+
+// Chan et al.: folds part b into a
+static void ReduceMerge(ReducePart* a, const ReducePart* b)
+{
+    double n, delta;
+
+    if (b->count == 0.0)
+        return;
+    if (a->count == 0.0)
+    {
+        *a = *b;
+        return;
+    }
+    n = a->count + b->count;
+    delta = b->mean - a->mean;
+    a->mean += delta * b->count / n;
+    a->m2 += b->m2 + delta * delta * a->count * b->count / n;
+    a->count = n;
+    ReduceAdd(&a->sum, &a->comp, b->sum, b->comp);
+    if (b->min < a->min) a->min = b->min;
+    if (b->max > a->max) a->max = b->max;
+}
+
+// Two passes over n > 0 gathered numbers, four SSE2 lanes each; the second, for the
+// squared deviations, only when spread is wanted
+static void ReduceBlock(ReducePart* p, const double* x, int n, BOOL spread)
+{
+    __m128d s0 = _mm_setzero_pd(), s1 = s0, c0 = s0, c1 = s0, q0 = s0, q1 = s0, e0 = s0, e1 = s0;
+    __m128d lo0 = _mm_set1_pd(INFINITY), lo1 = lo0, hi0 = _mm_set1_pd(-INFINITY), hi1 = hi0, m;
+    double lane[4], carry[4], sum = 0.0, comp = 0.0, q = 0.0, e = 0.0, mean;
+    int i, j;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m128d a = _mm_loadu_pd(x + i), b = _mm_loadu_pd(x + i + 2);
+        __m128d ya = _mm_sub_pd(a, c0), yb = _mm_sub_pd(b, c1);
+        __m128d ta = _mm_add_pd(s0, ya), tb = _mm_add_pd(s1, yb);
+        c0 = _mm_sub_pd(_mm_sub_pd(ta, s0), ya);    // Kahan: what the add lost, to take off next time
+        c1 = _mm_sub_pd(_mm_sub_pd(tb, s1), yb);
+        s0 = ta;
+        s1 = tb;
+        lo0 = _mm_min_pd(lo0, a);
+        lo1 = _mm_min_pd(lo1, b);
+        hi0 = _mm_max_pd(hi0, a);
+        hi1 = _mm_max_pd(hi1, b);
+    }
+    // The lanes, then the tail, always in the same order
+    _mm_storeu_pd(lane, s0);
+    _mm_storeu_pd(lane + 2, s1);
+    _mm_storeu_pd(carry, c0);
+    _mm_storeu_pd(carry + 2, c1);
+    for (j = 0; j < 4; j++)
+        ReduceAdd(&sum, &comp, lane[j], -carry[j]);
+    _mm_storeu_pd(lane, _mm_min_pd(lo0, lo1));
+    p->min = lane[0] < lane[1] ? lane[0] : lane[1];
+    _mm_storeu_pd(lane, _mm_max_pd(hi0, hi1));
+    p->max = lane[0] > lane[1] ? lane[0] : lane[1];
+    for (j = i; j < n; j++)
+    {
+        ReduceAdd(&sum, &comp, x[j], 0.0);
+        if (x[j] < p->min) p->min = x[j];
+        if (x[j] > p->max) p->max = x[j];
+    }
+    mean = (sum + comp) / n;
+    p->count = (double)n;
+    p->sum = sum;
+    p->comp = comp;
+    p->mean = mean;
+    p->m2 = 0.0;
+    if (!spread)
+        return;
+
+    // Squared deviations from the mean, corrected by what the deviations sum to
+    m = _mm_set1_pd(mean);
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m128d da = _mm_sub_pd(_mm_loadu_pd(x + i), m), db = _mm_sub_pd(_mm_loadu_pd(x + i + 2), m);
+        q0 = _mm_add_pd(q0, _mm_mul_pd(da, da));
+        q1 = _mm_add_pd(q1, _mm_mul_pd(db, db));
+        e0 = _mm_add_pd(e0, da);
+        e1 = _mm_add_pd(e1, db);
+    }
+    _mm_storeu_pd(lane, _mm_add_pd(q0, q1));
+    _mm_storeu_pd(carry, _mm_add_pd(e0, e1));
+    q = lane[0] + lane[1];
+    e = carry[0] + carry[1];
+    for (j = i; j < n; j++)
+    {
+        double d = x[j] - mean;
+        q += d * d;
+        e += d;
+    }
+    p->m2 = q - e * e / n;
+}
+
+// Number of edges below x: the bin x falls in. The halving compiles to a conditional
+// move, so random values cost no mispredicted branches.
+static int ReduceBin(const double* edges, int count, double x)
+{
+    const double* base = edges;
+    int n = count;
+
+    if (n == 0)
+        return 0;
+    while (n > 1)
+    {
+        int half = n >> 1;
+        base = base[half] < x ? base + half : base;
+        n -= half;
+    }
+    return (int)(base - edges) + (*base < x);
+}
+
+static void ReduceChunk(ReduceJob* job, LONG c)
+{
+    double buffer[REDUCE_BLOCK];
+    int first = c * REDUCE_CHUNK;
+    int end = job->n - first < REDUCE_CHUNK ? job->n : first + REDUCE_CHUNK;
+    ReducePart part, block;
+    LONGLONG* counts;
+    int i, j, k;
+
+    switch (job->kind)
+    {
+    case REDUCE_JOB_STATS:
+        memset(&part, 0, sizeof(part));
+        for (i = first; i < end; i += REDUCE_BLOCK)
+        {
+            k = ReduceGather(buffer, job->cells + i, end - i < REDUCE_BLOCK ? end - i : REDUCE_BLOCK);
+            if (k == 0)
+                continue;
+            ReduceBlock(&block, buffer, k, job->spread);
+            ReduceMerge(&part, &block);
+        }
+        job->parts[c] = part;
+        break;
+
+    case REDUCE_JOB_GATHER:
+        job->counts[c] = ReduceGather(job->values + first, job->cells + first, end - first);
+        break;
+
+    case REDUCE_JOB_HISTOGRAM:
+        counts = job->histogram + (SIZE_T)c * job->bins;
+        for (i = first; i < end; i += REDUCE_BLOCK)
+        {
+            k = ReduceGather(buffer, job->cells + i, end - i < REDUCE_BLOCK ? end - i : REDUCE_BLOCK);
+            for (j = 0; j < k; j++)
+                counts[ReduceBin(job->edges, job->bins - 1, buffer[j])]++;
+        }
+        break;
+
+    case REDUCE_JOB_CALLBACK:
+        job->run(job->context, c);
+        break;
+    }
+}
+
+// Takes chunks until none are left; returns how many this thread ran
+static LONG ReduceRunChunks(ReduceJob* job)
+{
+    LONG c, ran = 0;
+
+    while ((c = InterlockedIncrement(&job->next) - 1) < job->chunks)
+    {
+        ReduceChunk(job, c);
+        ran++;
+        if (InterlockedIncrement(&job->done) == job->chunks)
+            WakeByAddressSingle((PVOID)&job->done);
+    }
+    return ran;
+}
+
+static DWORD WINAPI ReduceHelperMain(LPVOID parameter)
+{
+    LONG seen = 0, generation, ran;
+    ReduceJob* job;
+    (void)parameter;
+
+    for (;;)
+    {
+        while ((generation = ReadAcquire(&g_reduceGeneration)) == seen)
+            WaitOnAddress(&g_reduceGeneration, &seen, sizeof(seen), INFINITE);
+        seen = generation;
+        if (ReadAcquire(&g_reduceStop))
+            break;
+        InterlockedIncrement(&g_reduceRefs);
+        job = (ReduceJob*)InterlockedCompareExchangePointer((PVOID volatile*)&g_reduceJob, NULL, NULL);
+        if (job && InterlockedIncrement(&job->helpers) <= job->maxHelpers && (ran = ReduceRunChunks(job)) > 0)
+            InterlockedExchangeAdd64(&g_reduceStats.helperChunks, ran);
+        InterlockedDecrement(&g_reduceRefs);
+    }
+    return 0;
+}
+
+// Starts the helpers on first use; TRUE if there are any
+static BOOL ReduceHelpersReady(void)
+{
+    LONG state = ReadAcquire(&g_reduceState);
+    wchar_t env[16];
+    int threads, i;
+
+    if (state != 0 || InterlockedCompareExchange(&g_reduceState, 1, 0) != 0)
+        return state == 2;
+
+    threads = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    if (GetEnvironmentVariableW(L"XLL_REDUCE_THREADS", env, (DWORD)_countof(env)))
+        threads = (int)wcstol(env, NULL, 10);
+    if (threads > REDUCE_MAX_THREADS)
+        threads = REDUCE_MAX_THREADS;
+    g_reduceStop = 0;
+    g_reduceHelpers = 0;
+    for (i = 0; i < threads - 1; i++)
+    {
+        g_reduceThreads[i] = CreateThread(NULL, REDUCE_STACK_BYTES, ReduceHelperMain, NULL, 0, NULL);
+        if (!g_reduceThreads[i])
+            break;
+        g_reduceHelpers++;
+    }
+    state = g_reduceHelpers ? 2 : 3;
+    InterlockedExchange(&g_reduceState, state);
+    return state == 2;
+}
+
+void ReduceClose(void)
+{
+    int i;
+
+    if (InterlockedCompareExchange(&g_reduceState, 1, 2) != 2)
+    {
+        InterlockedCompareExchange(&g_reduceState, 0, 3);
+        return;
+    }
+    InterlockedExchange(&g_reduceStop, 1);
+    InterlockedIncrement(&g_reduceGeneration);
+    WakeByAddressAll((PVOID)&g_reduceGeneration);
+    for (i = 0; i < g_reduceHelpers; i++)
+    {
+        WaitForSingleObject(g_reduceThreads[i], INFINITE);
+        CloseHandle(g_reduceThreads[i]);
+    }
+    g_reduceHelpers = 0;
+    InterlockedExchange(&g_reduceState, 0);
+}
+
+// Points the job at range's cells (a scalar is one cell) and counts its chunks
+static void ReduceInit(ReduceJob* job, int kind, const XLOPER12* range)
+{
+    memset(job, 0, sizeof(*job));
+    job->kind = kind;
+    if ((range->xltype & xltypeMulti) == xltypeMulti)
+    {
+        job->cells = range->val.array.lparray;
+        job->n = range->val.array.rows * range->val.array.columns;
+    }
+    else
+    {
+        job->cells = range;
+        job->n = 1;
+    }
+    job->chunks = (job->n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+    job->maxHelpers = REDUCE_MAX_THREADS;
+}
+
+// Runs every chunk of the job, with the helpers when the range is large and they are free
+static void ReduceRun(ReduceJob* job)
+{
+    LONG done;
+
+    InterlockedIncrement64(&g_reduceStats.calls);
+    InterlockedExchangeAdd64(&g_reduceStats.cells, job->n);
+    InterlockedExchangeAdd64(&g_reduceStats.chunks, job->chunks);
+    if ((job->kind == REDUCE_JOB_CALLBACK ? job->chunks < 2 || job->maxHelpers < 1 : job->n < REDUCE_PARALLEL_MIN)
+        || !ReduceHelpersReady())
+    {
+        ReduceRunChunks(job);
+        return;
+    }
+    if (InterlockedCompareExchangePointer((PVOID volatile*)&g_reduceJob, job, NULL) != NULL)
+    {
+        InterlockedIncrement64(&g_reduceStats.busy);
+        ReduceRunChunks(job);
+        return;
+    }
+    InterlockedIncrement64(&g_reduceStats.parallel);
+    InterlockedIncrement(&g_reduceGeneration);
+    WakeByAddressAll((PVOID)&g_reduceGeneration);
+    ReduceRunChunks(job);
+    while ((done = ReadAcquire(&job->done)) < job->chunks)
+        WaitOnAddress(&job->done, &done, sizeof(done), INFINITE);
+    (void)InterlockedExchangePointer((PVOID volatile*)&g_reduceJob, NULL);
+    while (ReadAcquire(&g_reduceRefs) != 0)
+        Sleep(0);
+}
+
+void ReduceForEach(LONG chunks, void (*run)(void* context, LONG chunk), void* context, int threads)
+{
+    ReduceJob job;
+
+    memset(&job, 0, sizeof(job));
+    job.kind = REDUCE_JOB_CALLBACK;
+    job.chunks = chunks > 0 ? chunks : 0;
+    job.run = run;
+    job.context = context;
+    job.maxHelpers = threads > 0 ? threads - 1 : REDUCE_MAX_THREADS;
+    ReduceRun(&job);
+}
+
+LPXLOPER12 ReduceStat(const XLOPER12* range, int stat)
+{
+    ReduceJob job;
+    ReducePart total;
+    double sum;
+    LONG c;
+
+    if (stat < 0 || !range)
+        return XlNewErr(xlerrValue);
+    ReduceInit(&job, REDUCE_JOB_STATS, range);
+    job.spread = stat == REDUCE_VAR || stat == REDUCE_STDEV;
+    job.parts = (ReducePart*)GlobalAlloc(GMEM_FIXED, (SIZE_T)job.chunks * sizeof(ReducePart));
+    if (!job.parts)
+        return XlNewErr(xlerrNA);
+    ReduceRun(&job);
+    memset(&total, 0, sizeof(total));
+    for (c = 0; c < job.chunks; c++)
+        ReduceMerge(&total, &job.parts[c]);
+    GlobalFree(job.parts);
+
+    sum = total.sum + total.comp;
+    switch (stat)
+    {
+    case REDUCE_COUNT:  return XlNewNum(total.count);
+    case REDUCE_SUM:    return XlNewNum(sum);
+    case REDUCE_MEAN:   return total.count > 0.0 ? XlNewNum(sum / total.count) : XlNewErr(xlerrDiv0);
+    case REDUCE_VAR:    return total.count > 1.0 ? XlNewNum(total.m2 / (total.count - 1.0)) : XlNewErr(xlerrDiv0);
+    case REDUCE_STDEV:  return total.count > 1.0 ? XlNewNum(sqrt(total.m2 / (total.count - 1.0))) : XlNewErr(xlerrDiv0);
+    case REDUCE_MIN:    return XlNewNum(total.count > 0.0 ? total.min : 0.0);  // As MIN: 0 without numbers
+    case REDUCE_MAX:    return XlNewNum(total.count > 0.0 ? total.max : 0.0);
+    }
+    return XlNewErr(xlerrValue);
+}
+
+// Hoare quickselect: leaves the k-th smallest of x[0..n) at x[k], nothing larger before
+// it and nothing smaller after it
+static double ReduceSelect(double* x, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+
+    while (lo < hi)
+    {
+        double a = x[lo], b = x[lo + (hi - lo) / 2], c = x[hi], pivot, t;
+        int i = lo, j = hi;
+        pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+        while (i <= j)
+        {
+            while (x[i] < pivot) i++;
+            while (x[j] > pivot) j--;
+            if (i <= j)
+            {
+                t = x[i]; x[i] = x[j]; x[j] = t;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return x[k];
+}
+
+// PERCENTILE.INC of the n numbers in x (reordered)
+static double ReducePercentileOf(double* x, int n, double p)
+{
+    double h = p * (n - 1), v, next;
+    int k = (int)floor(h), i;
+
+    v = ReduceSelect(x, n, k);
+    if (h == k)
+        return v;
+    next = x[k + 1];
+    for (i = k + 2; i < n; i++)
+        if (x[i] < next)
+            next = x[i];
+    return v + (h - k) * (next - v);
+}
+
+LPXLOPER12 ReducePercentile(const XLOPER12* range, const XLOPER12* p)
+{
+    ReduceJob job;
+    LPXLOPER12 result;
+    int rows, columns, n = 0, i;
+    LONG c;
+
+    if (!range || !p)
+        return XlNewErr(xlerrValue);
+    ReduceInit(&job, REDUCE_JOB_GATHER, range);
+    job.values = (double*)GlobalAlloc(GMEM_FIXED, (SIZE_T)job.n * sizeof(double) + (SIZE_T)job.chunks * sizeof(int));
+    if (!job.values)
+        return XlNewErr(xlerrNA);
+    job.counts = (int*)(job.values + job.n);
+    ReduceRun(&job);
+    for (c = 0; c < job.chunks; c++)
+    {
+        memmove(job.values + n, job.values + (SIZE_T)c * REDUCE_CHUNK, (SIZE_T)job.counts[c] * sizeof(double));
+        n += job.counts[c];
+    }
+
+    rows = XlArgRows(p);
+    columns = XlArgColumns(p);
+    result = (p->xltype & xltypeMulti) == xltypeMulti ? XlNewMulti(rows, columns) : NULL;
+    for (i = 0; i < rows * columns; i++)
+    {
+        const XLOPER12* cell = XlArgCell(p, i / columns, i % columns);
+        int err = 0;
+        double v = 0.0;
+
+        if (!cell || (cell->xltype & 0x0FFF) != xltypeNum)
+            err = xlerrValue;
+        else if (n == 0 || cell->val.num < 0.0 || cell->val.num > 1.0)
+            err = xlerrNum;
+        else
+            v = ReducePercentileOf(job.values, n, cell->val.num);
+        if (!result)
+        {
+            result = err ? XlNewErr(err) : XlNewNum(v);
+            break;
+        }
+        if (err)
+        {
+            result->val.array.lparray[i].xltype = xltypeErr;
+            result->val.array.lparray[i].val.err = err;
+        }
+        else
+        {
+            XlSetNum(&result->val.array.lparray[i], v);
+        }
+    }
+    GlobalFree(job.values);
+    return result ? result : XlNewErr(xlerrNA);
+}
+
+LPXLOPER12 ReduceHistogram(const XLOPER12* range, const XLOPER12* edges)
+{
+    ReduceJob job;
+    LPXLOPER12 result;
+    double* list;
+    int rows, columns, count = 0, i, b;
+    LONG c;
+
+    if (!range || !edges)
+        return XlNewErr(xlerrValue);
+    rows = XlArgRows(edges);
+    columns = XlArgColumns(edges);
+    if ((LONGLONG)rows * columns >= REDUCE_MAX_BINS)
+        return XlNewErr(xlerrValue);
+    list = (double*)GlobalAlloc(GMEM_FIXED, (SIZE_T)(rows * columns + 1) * sizeof(double));
+    if (!list)
+        return XlNewErr(xlerrNA);
+    // As FREQUENCY, edges that are not numbers are ignored
+    for (i = 0; i < rows * columns; i++)
+    {
+        const XLOPER12* cell = XlArgCell(edges, i / columns, i % columns);
+        if (!cell || (cell->xltype & 0x0FFF) != xltypeNum)
+            continue;
+        if (count > 0 && cell->val.num < list[count - 1])
+        {
+            GlobalFree(list);
+            return XlNewErr(xlerrValue);
+        }
+        list[count++] = cell->val.num;
+    }
+
+    ReduceInit(&job, REDUCE_JOB_HISTOGRAM, range);
+    job.edges = list;
+    job.bins = count + 1;
+    job.histogram = (LONGLONG*)GlobalAlloc(GMEM_FIXED | GMEM_ZEROINIT, (SIZE_T)job.chunks * job.bins * sizeof(LONGLONG));
+    result = job.histogram ? XlNewMulti(job.bins, 1) : NULL;
+    if (!result)
+    {
+        if (job.histogram)
+            GlobalFree(job.histogram);
+        GlobalFree(list);
+        return XlNewErr(xlerrNA);
+    }
+    ReduceRun(&job);
+    for (b = 0; b < job.bins; b++)
+    {
+        LONGLONG total = 0;
+        for (c = 0; c < job.chunks; c++)
+            total += job.histogram[(SIZE_T)c * job.bins + b];
+        XlSetNum(&result->val.array.lparray[b], (double)total);
+    }
+    GlobalFree(job.histogram);
+    GlobalFree(list);
+    return result;
+}
+
+LPXLOPER12 ReduceTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Calls", L"Cells", L"ParallelCalls", L"HelpersBusy", L"Chunks", L"HelperChunks", L"Threads", L"ChunkCells"
+    };
+    const int rows = (int)_countof(names);
+    double values[_countof(names)];
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    values[0] = (double)ReadAcquire64(&g_reduceStats.calls);
+    values[1] = (double)ReadAcquire64(&g_reduceStats.cells);
+    values[2] = (double)ReadAcquire64(&g_reduceStats.parallel);
+    values[3] = (double)ReadAcquire64(&g_reduceStats.busy);
+    values[4] = (double)ReadAcquire64(&g_reduceStats.chunks);
+    values[5] = (double)ReadAcquire64(&g_reduceStats.helperChunks);
+    values[6] = ReadAcquire(&g_reduceState) == 2 ? (double)(g_reduceHelpers + 1) : 1.0;
+    values[7] = (double)REDUCE_CHUNK;
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
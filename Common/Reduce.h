@@ -0,0 +1,77 @@
+/*
+**  Reduce
+**
+**  Reductions over large ranges: count, sum, mean, var, stdev, min and max,
+**  percentiles and histograms.
+**
+**  A range is cut into chunks of REDUCE_CHUNK cells, the unit of parallel
+**  work. Within a chunk, blocks of REDUCE_BLOCK cells have their numbers
+**  gathered into a buffer on the stack with a branch-free compaction of the
+**  XLOPER12 array. Each block is then reduced with SSE2 over four lanes. The
+**  first pass makes Kahan-compensated sums, minimum and maximum. The second
+**  pass adds the squared deviations from the block mean. Block and chunk
+**  partials are merged strictly in order: sums keep their compensation term,
+**  and variances use Chan's formula. The result depends on the range alone,
+**  so it is the same to the bit on one thread or sixteen.
+**
+**  A range of REDUCE_PARALLEL_MIN cells or more is shared with helper
+**  threads, which start on first use. The calling thread posts the job and
+**  takes chunks from the same counter as the helpers. Only one job runs at a
+**  time. A call that finds the helpers busy (another calc thread reducing)
+**  works through its chunks alone. It gets the same result, and it does not
+**  oversubscribe cores that Excel is already using. XLL_REDUCE_THREADS sets
+**  the threads per job, the caller included; the default is the processor
+**  count, and 1 means no helpers.
+**
+**  ReduceForEach lends the same helpers to other chunked work, such as the
+**  Monte Carlo batches (MonteCarlo.h), under the same rules.
+**
+**  As in RangeAgg, only numbers count: text, booleans, blanks and errors are
+**  skipped. Percentiles interpolate like PERCENTILE.INC, over all the numbers
+**  gathered once and selected in place. Histograms count like FREQUENCY, with
+**  ascending edges: bin i holds the values above edge i-1 and up to edge i,
+**  and a last bin holds the values above the last edge.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define REDUCE_BLOCK        1024            // Cells gathered at a time, on the stack
+#define REDUCE_CHUNK        32768           // Cells per unit of parallel work
+#define REDUCE_PARALLEL_MIN (4 * REDUCE_CHUNK)
+#define REDUCE_MAX_THREADS  64
+#define REDUCE_MAX_BINS     4096
+
+#define REDUCE_COUNT        0
+#define REDUCE_SUM          1
+#define REDUCE_MEAN         2
+#define REDUCE_VAR          3               // Sample variance
+#define REDUCE_STDEV        4
+#define REDUCE_MIN          5
+#define REDUCE_MAX          6
+
+// Statistic named by L"count", L"sum", L"mean", L"var", L"stdev", L"min" or L"max"; -1 if unknown
+int ReduceStatFromName(const XLOPER12* name);
+
+// The statistic over range; #DIV/0! for mean, var or stdev without enough numbers
+LPXLOPER12 ReduceStat(const XLOPER12* range, int stat);
+
+// PERCENTILE.INC of range at p, a number or an array (the result has its shape);
+// #NUM! without numbers or for p outside [0, 1]
+LPXLOPER12 ReducePercentile(const XLOPER12* range, const XLOPER12* p);
+
+// Counts per bin as a column, one more than there are edges; #VALUE! unless the edges ascend
+LPXLOPER12 ReduceHistogram(const XLOPER12* range, const XLOPER12* edges);
+
+// Runs run(context, c) for every chunk c in [0, chunks), sharing the chunks with the
+// helpers when they are free. At most threads threads take part, the caller included
+// (0: all). Each chunk runs once, on some thread, in no particular order.
+void ReduceForEach(LONG chunks, void (*run)(void* context, LONG chunk), void* context, int threads);
+
+// Stops the helper threads; from xlAutoClose
+void ReduceClose(void);
+
+// Calls, cells, parallel calls, chunks run by helpers, helpers busy, threads per job
+LPXLOPER12 ReduceTable(void);
@@ -0,0 +1,515 @@
+/*
+**  RefData
+**
+**  Mapped datasets and their lookups. See RefData.h.
+**
+**  Datasets are opened by xlAutoOpen and closed by xlAutoClose, when no
+**  calc thread is running, so the table of them needs no lock. Opening
+**  checks that every region the header describes lies inside the file;
+**  after that a lookup only checks the values it reads (a row from the
+**  index, a string id, a string's length), so a damaged file can give
+**  wrong answers or errors but never makes a read outside the mapping.
+*/
+
+#include <windows.h>
+#include <math.h>
+#include <string.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "XlHelpers.h"
+#include "RefData.h"
+
+#define REFDATA_MAX_COLUMNS 1024
+#define REFDATA_INFO_COLUMNS 7
+
+typedef struct RefDataSet
+{
+    wchar_t name[REFDATA_NAME];
+    wchar_t path[MAX_PATH];
+    HANDLE file;
+    HANDLE mapping;
+    const BYTE* view;
+    UINT64 bytes;
+    const RefDataHeader* header;
+    const RefDataColumn* columns;
+    const UINT64* dictionary;
+    const RefDataSlot* slots;
+    UINT64 mask;
+    double openMs;
+} RefDataSet;
+
+typedef struct RefDataStats
+{
+    volatile LONGLONG lookups;
+    volatile LONGLONG keys;
+    volatile LONGLONG found;
+    volatile LONGLONG probes;
+} RefDataStats;
+
+static RefDataSet g_refSets[REFDATA_MAX_SETS];
+static int g_refSetCount = 0;
+static int g_refConfigured = 0;
+static RefDataStats g_refStats;
+
+static BOOL RefDataInside(const RefDataSet* s, UINT64 offset, UINT64 bytes)
+{
+    return offset <= s->bytes && bytes <= s->bytes - offset;
+}
+
+// Checks the header and that every region lies inside the file, reading nothing else
+static BOOL RefDataValid(RefDataSet* s)
+{
+    const RefDataHeader* h = (const RefDataHeader*)s->view;
+    UINT32 c;
+
+    if (s->bytes < sizeof(RefDataHeader) || h->magic != REFDATA_MAGIC || h->version != REFDATA_VERSION
+        || h->fileBytes != s->bytes || h->columns == 0 || h->columns > REFDATA_MAX_COLUMNS || h->keyColumn >= h->columns
+        || !RefDataInside(s, sizeof(RefDataHeader), (UINT64)h->columns * sizeof(RefDataColumn)))
+        return FALSE;
+    s->header = h;
+    s->columns = (const RefDataColumn*)(s->view + sizeof(RefDataHeader));
+    for (c = 0; c < h->columns; c++)
+    {
+        const RefDataColumn* col = &s->columns[c];
+        UINT32 width = col->type == REFDATA_STR ? sizeof(UINT32) : sizeof(double);
+        if ((col->type != REFDATA_F64 && col->type != REFDATA_I64 && col->type != REFDATA_STR) || col->width != width
+            || col->offset % REFDATA_ALIGN != 0 || !RefDataInside(s, col->offset, (UINT64)h->rows * width))
+            return FALSE;
+    }
+    if (h->dictionaryOffset % sizeof(UINT64) != 0 || !RefDataInside(s, h->dictionaryOffset, (UINT64)h->strings * sizeof(UINT64))
+        || !RefDataInside(s, h->poolOffset, h->poolBytes))
+        return FALSE;
+    if (h->indexSlots == 0 || h->indexSlots < h->rows || (h->indexSlots & (h->indexSlots - 1)) != 0 || h->indexOffset % sizeof(UINT64) != 0
+        || h->indexSlots > s->bytes / sizeof(RefDataSlot) || !RefDataInside(s, h->indexOffset, h->indexSlots * sizeof(RefDataSlot)))
+        return FALSE;
+    s->dictionary = (const UINT64*)(s->view + h->dictionaryOffset);
+    s->slots = (const RefDataSlot*)(s->view + h->indexOffset);
+    s->mask = h->indexSlots - 1;
+    return TRUE;
+}
+
+static void RefDataUnmap(RefDataSet* s)
+{
+    if (s->view)
+        UnmapViewOfFile((LPVOID)s->view);
+    if (s->mapping)
+        CloseHandle(s->mapping);
+    if (s->file && s->file != INVALID_HANDLE_VALUE)
+        CloseHandle(s->file);
+    s->view = NULL;
+    s->mapping = NULL;
+    s->file = NULL;
+}
+
+// The dataset's name: the file name without directory and extension
+static void RefDataNameOf(RefDataSet* s)
+{
+    const wchar_t* start = s->path;
+    const wchar_t* p;
+    size_t n;
+
+    for (p = s->path; *p; p++)
+        if (*p == L'\\' || *p == L'/')
+            start = p + 1;
+    p = wcsrchr(start, L'.');
+    n = p ? (size_t)(p - start) : wcslen(start);
+    if (n >= REFDATA_NAME)
+        n = REFDATA_NAME - 1;
+    wmemcpy(s->name, start, n);
+    s->name[n] = 0;
+}
+
+static BOOL RefDataMap(RefDataSet* s)
+{
+    LARGE_INTEGER size, t0, t1, freq;
+
+    QueryPerformanceCounter(&t0);
+    s->file = CreateFileW(s->path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (s->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(s->file, &size) || size.QuadPart < (LONGLONG)sizeof(RefDataHeader))
+        return FALSE;
+    s->bytes = (UINT64)size.QuadPart;
+    s->mapping = CreateFileMappingW(s->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (s->mapping)
+        s->view = (const BYTE*)MapViewOfFile(s->mapping, FILE_MAP_READ, 0, 0, (SIZE_T)s->bytes);
+    if (!s->view || !RefDataValid(s))
+        return FALSE;
+    QueryPerformanceCounter(&t1);
+    QueryPerformanceFrequency(&freq);
+    s->openMs = (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / (double)freq.QuadPart;
+    RefDataNameOf(s);
+    return TRUE;
+}
+
+int RefDataOpen(void)
+{
+    wchar_t list[4096];
+    wchar_t* p;
+    DWORD n;
+
+    if (g_refConfigured)
+        return g_refSetCount;
+    n = GetEnvironmentVariableW(L"XLL_REFDATA", list, (DWORD)_countof(list));
+    if (n == 0 || n >= _countof(list))
+        return -1;
+    g_refConfigured = 1;
+    ZeroMemory(&g_refStats, sizeof(g_refStats));
+
+    for (p = list; *p && g_refSetCount < REFDATA_MAX_SETS; )
+    {
+        wchar_t* end = wcschr(p, L';');
+        size_t len = end ? (size_t)(end - p) : wcslen(p);
+        RefDataSet* s = &g_refSets[g_refSetCount];
+
+        ZeroMemory(s, sizeof(RefDataSet));
+        if (len > 0 && len < MAX_PATH)
+        {
+            wmemcpy(s->path, p, len);
+            s->path[len] = 0;
+            if (RefDataMap(s))
+                g_refSetCount++;
+            else
+                RefDataUnmap(s);
+        }
+        p += len;
+        if (*p == L';')
+            p++;
+    }
+    return g_refSetCount;
+}
+
+void RefDataClose(void)
+{
+    int i;
+
+    for (i = 0; i < g_refSetCount; i++)
+        RefDataUnmap(&g_refSets[i]);
+    g_refSetCount = 0;
+    g_refConfigured = 0;
+}
+
+// Compares a counted key with a name of ASCII-folded code units
+static BOOL RefDataSameName(const XCHAR* key, int n, const wchar_t* name)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (!name[i] || RefDataFold((UINT32)key[i]) != RefDataFold((UINT32)name[i]))
+            return FALSE;
+    return name[n] == 0;
+}
+
+static const RefDataSet* RefDataFind(const XLOPER12* dataset)
+{
+    const XCHAR* chars;
+    size_t n = XlCellStr(dataset, &chars);
+    int i;
+
+    for (i = 0; n && i < g_refSetCount; i++)
+        if (RefDataSameName(chars, (int)n, g_refSets[i].name))
+            return &g_refSets[i];
+    return NULL;
+}
+
+// 0-based column, REFDATA_ROW_COLUMN for the row number, -1 if there is no such column
+#define REFDATA_ROW_COLUMN  (-2)
+static int RefDataColumnOf(const RefDataSet* s, const XLOPER12* column)
+{
+    const XCHAR* chars;
+    size_t n;
+    UINT32 c, i;
+
+    if (column && (column->xltype & xltypeNum) == xltypeNum)
+    {
+        double v = column->val.num;
+        if (v == 0.0)
+            return REFDATA_ROW_COLUMN;
+        return v >= 1.0 && v <= (double)s->header->columns && v == floor(v) ? (int)v - 1 : -1;
+    }
+    n = XlCellStr(column, &chars);
+    for (c = 0; n && n < REFDATA_NAME && c < s->header->columns; c++)
+    {
+        const UINT16* name = s->columns[c].name;
+        for (i = 0; i < n && name[i] && RefDataFold(name[i]) == RefDataFold((UINT32)chars[i]); i++)
+            ;
+        if (i == n && name[n] == 0)
+            return (int)c;
+    }
+    return -1;
+}
+
+// String id's code units and length; FALSE for an empty value or an id outside the dictionary
+static BOOL RefDataString(const RefDataSet* s, UINT32 id, const UINT16** units, UINT32* len)
+{
+    const RefDataHeader* h = s->header;
+    UINT64 offset;
+
+    if (id >= h->strings)
+        return FALSE;
+    offset = s->dictionary[id];
+    if (offset < h->poolOffset || offset % sizeof(UINT16) != 0 || !RefDataInside(s, offset, sizeof(UINT16)))
+        return FALSE;
+    *len = *(const UINT16*)(s->view + offset);
+    if (offset + sizeof(UINT16) + (UINT64)*len * sizeof(UINT16) > h->poolOffset + h->poolBytes)
+        return FALSE;
+    *units = (const UINT16*)(s->view + offset + sizeof(UINT16));
+    return TRUE;
+}
+
+// Whether row's key equals the lookup key (class already matched by the caller)
+static BOOL RefDataKeyAt(const RefDataSet* s, UINT32 row, const XLOPER12* key)
+{
+    const RefDataColumn* col = &s->columns[s->header->keyColumn];
+    const BYTE* values = s->view + col->offset;
+
+    if (col->type == REFDATA_STR)
+    {
+        const UINT16* units;
+        UINT32 len, i;
+        if (!RefDataString(s, ((const UINT32*)values)[row], &units, &len) || len != (UINT32)key->val.str[0])
+            return FALSE;
+        for (i = 0; i < len; i++)
+            if (RefDataFold(units[i]) != RefDataFold((UINT32)key->val.str[i + 1]))
+                return FALSE;
+        return TRUE;
+    }
+    if (col->type == REFDATA_I64)
+        return (double)((const INT64*)values)[row] == key->val.num;
+    return ((const double*)values)[row] == key->val.num;
+}
+
+// 0-based row of key, or -1; adds the slots probed to *probes
+static LONGLONG RefDataRow(const RefDataSet* s, const XLOPER12* key, LONGLONG* probes)
+{
+    UINT32 keyType = s->columns[s->header->keyColumn].type;
+    UINT64 h, i;
+    UINT32 tag;
+    LONGLONG probed = 0;
+
+    if ((key->xltype & 0x0FFF) == xltypeStr && key->val.str && keyType == REFDATA_STR)
+    {
+        int k, n = key->val.str[0];
+        h = REFDATA_HASH_SEED;
+        for (k = 1; k <= n; k++)
+            h = RefDataHashStep(h, (UINT32)key->val.str[k]);
+        h = RefDataMix(h);
+    }
+    else if ((key->xltype & 0x0FFF) == xltypeNum && keyType != REFDATA_STR)
+        h = RefDataHashNum(key->val.num);
+    else
+        return -1;
+
+    tag = (UINT32)(h >> 32);
+    for (i = h & s->mask; ; i = (i + 1) & s->mask)
+    {
+        const RefDataSlot* slot = &s->slots[i];
+        probed++;
+        if (slot->row == 0 || slot->row > s->header->rows || probed > (LONGLONG)s->header->indexSlots)
+            break;
+        if (slot->hash == tag && RefDataKeyAt(s, slot->row - 1, key))
+        {
+            *probes += probed;
+            return (LONGLONG)slot->row - 1;
+        }
+    }
+    *probes += probed;
+    return -1;
+}
+
+// Writes column 'column' of 'row' into out (an array element, or a result before xlbitDLLFree)
+static void RefDataValue(const RefDataSet* s, UINT32 row, int column, LPXLOPER12 out)
+{
+    const RefDataColumn* col;
+    const BYTE* values;
+
+    if (column == REFDATA_ROW_COLUMN)
+    {
+        XlSetNum(out, (double)row + 1.0);
+        return;
+    }
+    col = &s->columns[column];
+    values = s->view + col->offset;
+    if (col->type == REFDATA_F64)
+    {
+        double v = ((const double*)values)[row];
+        if (isnan(v))
+        {
+            out->xltype = xltypeErr;
+            out->val.err = xlerrNA;
+        }
+        else
+            XlSetNum(out, v);
+    }
+    else if (col->type == REFDATA_I64)
+        XlSetNum(out, (double)((const INT64*)values)[row]);
+    else
+    {
+        wchar_t text[REFDATA_MAX_STRING];
+        const UINT16* units;
+        UINT32 len, i;
+        if (!RefDataString(s, ((const UINT32*)values)[row], &units, &len) || len == 0)
+        {
+            out->xltype = xltypeErr;
+            out->val.err = xlerrNA;
+            return;
+        }
+        if (len > REFDATA_MAX_STRING)
+            len = REFDATA_MAX_STRING;
+        for (i = 0; i < len; i++)
+            text[i] = (wchar_t)units[i];
+        XlSetStrN(out, text, len);
+    }
+}
+
+// Looks one key up into out; 1 if found
+static int RefDataAnswer(const RefDataSet* s, const XLOPER12* key, int column, LPXLOPER12 out, LONGLONG* probes)
+{
+    LONGLONG row = RefDataRow(s, key, probes);
+
+    if (row < 0)
+    {
+        out->xltype = xltypeErr;
+        out->val.err = xlerrNA;
+        return 0;
+    }
+    RefDataValue(s, (UINT32)row, column, out);
+    return 1;
+}
+
+LPXLOPER12 RefDataLookup(const XLOPER12* dataset, const XLOPER12* key, const XLOPER12* column)
+{
+    const RefDataSet* s = RefDataFind(dataset);
+    LPXLOPER12 result;
+    LONGLONG found = 0, probes = 0;
+    int c, i, n;
+
+    if (!s || !key)
+        return XlNewErr(xlerrValue);
+    c = RefDataColumnOf(s, column);
+    if (c == -1)
+        return XlNewErr(xlerrRef);
+    if ((key->xltype & xltypeMulti) != xltypeMulti)
+    {
+        result = XlNewNum(0.0);
+        if (!result)
+            return NULL;
+        found = RefDataAnswer(s, key, c, result, &probes);
+        result->xltype |= xlbitDLLFree;
+        n = 1;
+    }
+    else
+    {
+        n = key->val.array.rows * key->val.array.columns;
+        result = XlNewMulti(key->val.array.rows, key->val.array.columns);
+        if (!result)
+            return XlNewErr(xlerrNum);
+        for (i = 0; i < n; i++)
+            found += RefDataAnswer(s, &key->val.array.lparray[i], c, &result->val.array.lparray[i], &probes);
+    }
+    InterlockedIncrement64(&g_refStats.lookups);
+    InterlockedExchangeAdd64(&g_refStats.keys, n);
+    InterlockedExchangeAdd64(&g_refStats.found, found);
+    InterlockedExchangeAdd64(&g_refStats.probes, probes);
+    return result;
+}
+
+static void RefDataSetName(LPXLOPER12 out, const UINT16* name)
+{
+    wchar_t text[REFDATA_NAME];
+    int i;
+
+    for (i = 0; i < REFDATA_NAME - 1 && name[i]; i++)
+        text[i] = (wchar_t)name[i];
+    XlSetStrN(out, text, i);
+}
+
+LPXLOPER12 RefDataInfo(const XLOPER12* dataset)
+{
+    static const wchar_t* setHeader[REFDATA_INFO_COLUMNS] = {
+        L"Dataset", L"Rows", L"Columns", L"Strings", L"Bytes", L"OpenMs", L"Path"
+    };
+    static const wchar_t* types[4] = { L"", L"number", L"integer", L"string" };
+    const RefDataSet* s;
+    const XCHAR* chars;
+    LPXLOPER12 table, cells;
+    UINT32 c;
+    int i, j;
+
+    if (XlCellStr(dataset, &chars) == 0)
+    {
+        table = XlNewMulti(g_refSetCount + 1, REFDATA_INFO_COLUMNS);
+        if (!table)
+            return XlNewErr(xlerrNA);
+        for (j = 0; j < REFDATA_INFO_COLUMNS; j++)
+            XlSetStr(&table->val.array.lparray[j], setHeader[j]);
+        for (i = 0; i < g_refSetCount; i++)
+        {
+            s = &g_refSets[i];
+            cells = &table->val.array.lparray[(i + 1) * REFDATA_INFO_COLUMNS];
+            XlSetStr(&cells[0], s->name);
+            XlSetNum(&cells[1], (double)s->header->rows);
+            XlSetNum(&cells[2], (double)s->header->columns);
+            XlSetNum(&cells[3], (double)s->header->strings);
+            XlSetNum(&cells[4], (double)s->bytes);
+            XlSetNum(&cells[5], s->openMs);
+            XlSetStr(&cells[6], s->path);
+        }
+        return table;
+    }
+
+    s = RefDataFind(dataset);
+    if (!s)
+        return XlNewErr(xlerrValue);
+    table = XlNewMulti((int)s->header->columns + 1, 4);
+    if (!table)
+        return XlNewErr(xlerrNA);
+    XlSetStr(&table->val.array.lparray[0], L"Column");
+    XlSetStr(&table->val.array.lparray[1], L"Type");
+    XlSetStr(&table->val.array.lparray[2], L"Bytes");
+    XlSetStr(&table->val.array.lparray[3], L"Key");
+    for (c = 0; c < s->header->columns; c++)
+    {
+        const RefDataColumn* col = &s->columns[c];
+        cells = &table->val.array.lparray[(c + 1) * 4];
+        RefDataSetName(&cells[0], col->name);
+        XlSetStr(&cells[1], types[col->type]);
+        XlSetNum(&cells[2], (double)col->width * s->header->rows);
+        cells[3].xltype = xltypeBool;
+        cells[3].val.xbool = c == s->header->keyColumn;
+    }
+    return table;
+}
+
+LPXLOPER12 RefDataTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Datasets", L"MappedBytes", L"OpenMs", L"Lookups", L"Keys", L"Found", L"Probes", L"ProbesPerKey"
+    };
+    const int rows = (int)_countof(names);
+    double values[_countof(names)], bytes = 0.0, openMs = 0.0, keys;
+    LPXLOPER12 table = XlNewMulti(rows, 2);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    for (i = 0; i < g_refSetCount; i++)
+    {
+        bytes += (double)g_refSets[i].bytes;
+        openMs += g_refSets[i].openMs;
+    }
+    keys = (double)ReadAcquire64(&g_refStats.keys);
+    values[0] = (double)g_refSetCount;
+    values[1] = bytes;
+    values[2] = openMs;
+    values[3] = (double)ReadAcquire64(&g_refStats.lookups);
+    values[4] = keys;
+    values[5] = (double)ReadAcquire64(&g_refStats.found);
+    values[6] = (double)ReadAcquire64(&g_refStats.probes);
+    values[7] = keys > 0.0 ? values[6] / keys : 0.0;
+    for (i = 0; i < rows; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
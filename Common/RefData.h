@@ -0,0 +1,133 @@
+/*
+**  RefData
+**
+**  Read-only reference data (curves, instrument masters) mapped from files
+**  in a columnar format, instead of being loaded into each process's heap.
+**  RefDataOpen maps every file named in XLL_REFDATA (paths separated by
+**  ';') read-only at xlAutoOpen. Opening checks the header and the bounds of
+**  every region and reads nothing else, so it costs the same for ten rows as
+**  for ten million. Pages come in from the file cache as lookups touch
+**  them. Every Excel process that maps the file shares those pages, and the
+**  system can drop them again under memory pressure without writing
+**  anything. A dataset is named after its file, without directory and
+**  extension: C:\data\instruments.xrd is "instruments".
+**
+**  Datasets never change once open, so calc threads read them in place with
+**  no lock and nothing copied but the values a call returns. RefDataLookup
+**  finds a key through the file's own hash index (one or two probes, each
+**  one cache line) and reads the column asked for at that row.
+**
+**  The file, written by Bench/RefDataPack from a CSV, is:
+**      RefDataHeader
+**      RefDataColumn[columns]
+**      each column: rows values, starting on a REFDATA_ALIGN boundary
+**          REFDATA_F64     double
+**          REFDATA_I64     INT64 (returned as a number)
+**          REFDATA_STR     UINT32 id into the dictionary, REFDATA_NO_STRING if empty
+**      dictionary: UINT64 offsets[strings], each to a UINT16 length and then
+**          that many UTF-16 code units, in the string pool that follows
+**      index: indexSlots RefDataSlot, a power of two, linear probing
+**  All offsets are from the start of the file, and all values are little
+**  endian. The index holds the first row of each key in the key column.
+**  Keys match as in MATCH: numbers by value, strings regardless of case
+**  (ASCII letters; other characters exactly). Integer keys are compared as
+**  numbers, so they must be below 2^53 to be told apart. An empty F64 value
+**  is NaN, and it and an empty string come back as #N/A.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include <string.h>
+#include "XLCALL.H"
+
+#define REFDATA_MAGIC       0x31445258u     // "XRD1"
+#define REFDATA_VERSION     1
+#define REFDATA_ALIGN       64
+#define REFDATA_NAME        32              // Column and dataset names, in code units with the terminator
+#define REFDATA_MAX_SETS    16
+#define REFDATA_NO_STRING   0xFFFFFFFFu
+#define REFDATA_MAX_STRING  255             // Code units kept of a string value
+
+// Column types
+#define REFDATA_F64         1
+#define REFDATA_I64         2
+#define REFDATA_STR         3
+
+typedef struct __declspec(align(64)) RefDataHeader
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT64 fileBytes;
+    UINT32 rows;
+    UINT32 columns;
+    UINT32 keyColumn;
+    UINT32 strings;                 // Dictionary entries
+    UINT64 dictionaryOffset;        // UINT64 offsets[strings]
+    UINT64 poolOffset;
+    UINT64 poolBytes;
+    UINT64 indexOffset;
+    UINT64 indexSlots;
+} RefDataHeader;
+
+typedef struct RefDataColumn
+{
+    UINT16 name[REFDATA_NAME];
+    UINT32 type;
+    UINT32 width;                   // Bytes per value
+    UINT64 offset;
+} RefDataColumn;
+
+typedef struct RefDataSlot
+{
+    UINT32 hash;                    // High half of the key's hash; the slot is empty when row is 0
+    UINT32 row;                     // 1-based
+} RefDataSlot;
+
+// Key hashes, shared by the writer and the readers: numbers by value (-0 is 0),
+// strings by their code units with ASCII letters folded to lower case
+static __forceinline UINT64 RefDataMix(UINT64 x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static __forceinline UINT32 RefDataFold(UINT32 c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static __forceinline UINT64 RefDataHashNum(double v)
+{
+    UINT64 bits;
+    if (v == 0.0)
+        v = 0.0;
+    memcpy(&bits, &v, sizeof(bits));
+    return RefDataMix(bits ^ 0x6E756D0000000000ull);
+}
+
+static __forceinline UINT64 RefDataHashStep(UINT64 h, UINT32 c)
+{
+    return (h ^ RefDataFold(c)) * 0x100000001B3ull;
+}
+
+#define REFDATA_HASH_SEED   0xCBF29CE484222325ull   // Start of a string hash; finish it with RefDataMix
+
+// Maps the XLL_REFDATA files; returns the number of datasets opened, or -1 if it is unset
+int  RefDataOpen(void);
+void RefDataClose(void);
+
+// column (a name, or a 1-based number; 0 for the 1-based row number) of the row whose
+// key is 'key', or of each key of an array (the result has its shape). #N/A for a
+// key not found, #REF! for an unknown column, #VALUE! for an unknown dataset.
+LPXLOPER12 RefDataLookup(const XLOPER12* dataset, const XLOPER12* key, const XLOPER12* column);
+
+// The columns of a dataset (name, type, bytes), or with no dataset one row per
+// dataset (name, rows, columns, strings, bytes, open time, path)
+LPXLOPER12 RefDataInfo(const XLOPER12* dataset);
+
+// Datasets, bytes mapped, open time, lookups, keys found and index probes
+LPXLOPER12 RefDataTable(void);
@@ -0,0 +1,720 @@
+/*
+**  ResultCache
+**
+**  Memory-mapped, cross-process result cache. See ResultCache.h.
+**
+**  File layout:
+**      CacheFile header (one page)
+**      region 0 | region 1, each: CacheRegion, CacheSlot[slotCount], log
+**
+**  Publication order inside a region: record bytes, then slot offset, then
+**  slot hash (release), then logHead (release). A reader that sees a slot
+**  hash therefore sees the record behind it. Compaction bumps the generation
+**  before it starts rewriting the inactive region and again after flipping
+**  'active', so a reader whose generation moved by more than one may have
+**  read a region that was being rewritten and treats the lookup as a miss.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "ResultCache.h"
+
+#define CACHE_MAGIC         0x43525858  // "XXRC"
+#define CACHE_VERSION       1
+#define CACHE_HEADER_BYTES  4096
+#define CACHE_KEY_BYTES     1024
+#define CACHE_LEASE_MS      5000        // Writer lock held longer than this is presumed dead
+#define CACHE_OPEN_WAIT_MS  5000
+
+#define CACHE_VALUE_NUM     1
+#define CACHE_VALUE_STR     2
+#define CACHE_VALUE_BOOL    3
+#define CACHE_VALUE_ERR     4
+
+typedef struct CacheFile
+{
+    DWORD magic;
+    DWORD version;
+    LONGLONG fileBytes;
+    LONGLONG regionBytes;
+    volatile LONG state;            // 0 new, 1 initialising, 2 ready
+    volatile LONG active;           // Region readers should use
+    volatile LONG generation;       // Odd while the inactive region is being rewritten
+    volatile LONG writer;           // Thread id of the writer, 0 when free
+    volatile LONGLONG writerTick;   // GetTickCount64 at acquisition, 0 until set
+    volatile LONGLONG compactions;
+} CacheFile;
+
+typedef struct CacheRegion
+{
+    volatile LONGLONG logHead;      // Bytes of log in use
+    volatile LONG count;
+    LONG slotCount;                 // Power of two
+    LONGLONG logBytes;
+    LONGLONG reserved[4];
+} CacheRegion;
+
+typedef struct CacheSlot
+{
+    volatile LONGLONG hash;         // 0 = empty
+    volatile LONGLONG offset;       // Record offset within the log
+} CacheSlot;
+
+// Followed by keyBytes of key and valueBytes of value, padded to 8 bytes
+typedef struct CacheRecord
+{
+    ULONGLONG hash;
+    DWORD keyBytes;
+    DWORD valueBytes;
+    DWORD valueType;
+    DWORD reserved;
+} CacheRecord;
+
+typedef struct CacheKey
+{
+    BYTE  bytes[CACHE_KEY_BYTES];
+    DWORD len;
+    ULONGLONG hash;
+} CacheKey;
+
+// Per-process counters, kept off the lines the mapping pointers live on
+typedef struct CacheCounters
+{
+    volatile LONGLONG hits;
+    volatile LONGLONG misses;
+    volatile LONGLONG stores;
+    volatile LONGLONG writerBusy;
+    volatile LONGLONG uncacheable;
+    volatile LONGLONG retries;
+} CacheCounters;
+
+static HANDLE g_cacheFileHandle = INVALID_HANDLE_VALUE;
+static HANDLE g_cacheMapping = NULL;
+static BYTE* g_cacheView = NULL;
+static wchar_t g_cachePath[MAX_PATH];
+static int g_cacheWarmEntries = -1;
+static double g_cacheWarmMs = 0.0;
+static __declspec(align(64)) CacheCounters g_cacheCounters;
+
+static CacheFile* CacheHeader(void)
+{
+    return (CacheFile*)g_cacheView;
+}
+
+static BYTE* CacheRegionBase(int region)
+{
+    return g_cacheView + CACHE_HEADER_BYTES + (SIZE_T)region * (SIZE_T)CacheHeader()->regionBytes;
+}
+
+static CacheSlot* CacheSlots(BYTE* region)
+{
+    return (CacheSlot*)(region + sizeof(CacheRegion));
+}
+
+static BYTE* CacheLog(BYTE* region)
+{
+    return region + sizeof(CacheRegion) + (SIZE_T)((CacheRegion*)region)->slotCount * sizeof(CacheSlot);
+}
+
+static void CacheInitRegion(BYTE* region, LONGLONG regionBytes)
+{
+    CacheRegion* r = (CacheRegion*)region;
+    LONG slots = 64;
+
+    // Index takes about an eighth of the region
+    while ((LONGLONG)slots * 2 * (LONGLONG)sizeof(CacheSlot) <= regionBytes / 8)
+        slots *= 2;
+    ZeroMemory(region, sizeof(CacheRegion) + (SIZE_T)slots * sizeof(CacheSlot));
+    r->slotCount = slots;
+    r->logBytes = regionBytes - (LONGLONG)sizeof(CacheRegion) - (LONGLONG)slots * (LONGLONG)sizeof(CacheSlot);
+}
+
+/*
+** Keys
+*/
+static void CacheKeyAdd(CacheKey* key, const void* data, DWORD bytes)
+{
+    if (key->len + bytes > CACHE_KEY_BYTES)
+    {
+        key->len = CACHE_KEY_BYTES + 1;     // Marks the key as too long to cache
+        return;
+    }
+    memcpy(key->bytes + key->len, data, bytes);
+    key->len += bytes;
+}
+
+static void CacheKeyAddTag(CacheKey* key, BYTE tag)
+{
+    CacheKeyAdd(key, &tag, 1);
+}
+
+static void CacheKeyBegin(CacheKey* key, int fn)
+{
+    const wchar_t* module = UdfModuleName();
+    const wchar_t* name = UdfFunctionName(fn);
+    key->len = 0;
+    CacheKeyAdd(key, module, (DWORD)(wcslen(module) * sizeof(wchar_t)));
+    CacheKeyAddTag(key, '!');
+    CacheKeyAdd(key, name, (DWORD)(wcslen(name) * sizeof(wchar_t)));
+    CacheKeyAddTag(key, '(');
+}
+
+static void CacheKeyAddNum(CacheKey* key, double value)
+{
+    CacheKeyAddTag(key, 'n');
+    CacheKeyAdd(key, &value, sizeof(value));
+}
+
+// Returns 0 if the argument type cannot be part of a key
+static int CacheKeyAddArg(CacheKey* key, const XLOPER12* x)
+{
+    switch (x ? x->xltype & ~(xlbitDLLFree | xlbitXLFree) : xltypeMissing)
+    {
+    case xltypeNum:
+        CacheKeyAddNum(key, x->val.num);
+        return 1;
+    case xltypeInt:
+        CacheKeyAddNum(key, (double)x->val.w);     // Same key as the equal number
+        return 1;
+    case xltypeBool:
+        CacheKeyAddTag(key, 'b');
+        CacheKeyAddTag(key, x->val.xbool ? 1 : 0);
+        return 1;
+    case xltypeErr:
+        CacheKeyAddTag(key, 'e');
+        CacheKeyAdd(key, &x->val.err, sizeof(x->val.err));
+        return 1;
+    case xltypeStr:
+        CacheKeyAddTag(key, 's');
+        CacheKeyAdd(key, x->val.str, (DWORD)(((DWORD)x->val.str[0] + 1) * sizeof(XCHAR)));
+        return 1;
+    case xltypeMissing:
+    case xltypeNil:
+        CacheKeyAddTag(key, 'm');
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// FNV-1a: stable across processes, builds and restarts
+static int CacheKeyEnd(CacheKey* key)
+{
+    ULONGLONG h = 14695981039346656037ull;
+    DWORD i;
+
+    if (key->len > CACHE_KEY_BYTES)
+        return 0;
+    for (i = 0; i < key->len; i++)
+    {
+        h ^= key->bytes[i];
+        h *= 1099511628211ull;
+    }
+    key->hash = h ? h : 1;
+    return 1;
+}
+
+/*
+** Lookup (lock-free)
+*/
+static const CacheRecord* CacheFind(BYTE* region, const CacheKey* key)
+{
+    CacheRegion* r = (CacheRegion*)region;
+    CacheSlot* slots = CacheSlots(region);
+    LONGLONG logBytes = r->logBytes;
+    LONG slotCount = r->slotCount;
+    LONG mask = slotCount - 1, i = (LONG)(key->hash & (ULONGLONG)mask), probe;
+    BYTE* log = CacheLog(region);
+
+    for (probe = 0; probe < slotCount; probe++, i = (i + 1) & mask)
+    {
+        LONGLONG h = ReadAcquire64(&slots[i].hash);
+        LONGLONG offset;
+        const CacheRecord* rec;
+
+        if (h == 0)
+            return NULL;
+        if ((ULONGLONG)h != key->hash)
+            continue;
+
+        // Bounds-check everything: a racing compaction may leave us reading garbage
+        offset = slots[i].offset;
+        if (offset < 0 || offset + (LONGLONG)sizeof(CacheRecord) > logBytes)
+            return NULL;
+        rec = (const CacheRecord*)(log + offset);
+        if (rec->hash == key->hash && rec->keyBytes == key->len
+            && offset + (LONGLONG)sizeof(CacheRecord) + rec->keyBytes + rec->valueBytes <= logBytes
+            && memcmp(rec + 1, key->bytes, key->len) == 0)
+            return rec;
+    }
+    return NULL;
+}
+
+static int CacheReadValue(const CacheRecord* rec, LPXLOPER12 value)
+{
+    const BYTE* payload = (const BYTE*)(rec + 1) + rec->keyBytes;
+
+    switch (rec->valueType)
+    {
+    case CACHE_VALUE_NUM:
+        if (rec->valueBytes != sizeof(double)) return 0;
+        value->xltype = xltypeNum;
+        memcpy(&value->val.num, payload, sizeof(double));
+        return 1;
+    case CACHE_VALUE_BOOL:
+        if (rec->valueBytes != 1) return 0;
+        value->xltype = xltypeBool;
+        value->val.xbool = payload[0] != 0;
+        return 1;
+    case CACHE_VALUE_ERR:
+        if (rec->valueBytes != sizeof(int)) return 0;
+        value->xltype = xltypeErr;
+        memcpy(&value->val.err, payload, sizeof(int));
+        return 1;
+    case CACHE_VALUE_STR:
+        if (rec->valueBytes % sizeof(XCHAR) != 0) return 0;
+        return XlSetStrN(value, (const wchar_t*)payload, rec->valueBytes / sizeof(XCHAR));
+    default:
+        return 0;
+    }
+}
+
+static void CacheDropValue(LPXLOPER12 value)
+{
+    if (value->xltype == xltypeStr)
+        XlFreeResult(value);
+    value->xltype = xltypeNil;
+}
+
+static int CacheGetKey(const CacheKey* key, LPXLOPER12 value)
+{
+    CacheFile* f = CacheHeader();
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        LONG g1 = ReadAcquire(&f->generation);
+        LONG active = ReadAcquire(&f->active) & 1;
+        const CacheRecord* rec = CacheFind(CacheRegionBase(active), key);
+        int found = rec && CacheReadValue(rec, value);
+        LONG g2 = ReadAcquire(&f->generation);
+
+        if (g2 - g1 <= 1)
+            return found;
+        if (found)
+            CacheDropValue(value);
+        InterlockedIncrement64(&g_cacheCounters.retries);
+    }
+    return 0;
+}
+
+/*
+** Writer
+*/
+static int CacheLock(void)
+{
+    CacheFile* f = CacheHeader();
+    LONG me = (LONG)GetCurrentThreadId();
+    LONG owner = InterlockedCompareExchange(&f->writer, me, 0);
+
+    if (owner != 0)
+    {
+        // Take over only from a writer that has held the lock past its lease
+        LONGLONG tick = ReadAcquire64(&f->writerTick);
+        if (owner == me || tick == 0 || GetTickCount64() - (ULONGLONG)tick < CACHE_LEASE_MS)
+            return 0;
+        if (InterlockedCompareExchange(&f->writer, me, owner) != owner)
+            return 0;
+    }
+    WriteRelease64(&f->writerTick, (LONGLONG)GetTickCount64());
+    return 1;
+}
+
+static void CacheUnlock(void)
+{
+    CacheFile* f = CacheHeader();
+    WriteRelease64(&f->writerTick, 0);
+    InterlockedExchange(&f->writer, 0);
+}
+
+static LONGLONG CacheRecordBytes(DWORD keyBytes, DWORD valueBytes)
+{
+    return ((LONGLONG)sizeof(CacheRecord) + keyBytes + valueBytes + 7) & ~(LONGLONG)7;
+}
+
+static int CacheFits(BYTE* region, LONGLONG bytes)
+{
+    CacheRegion* r = (CacheRegion*)region;
+    return r->logHead + bytes <= r->logBytes && (r->count + 1) * 2 <= r->slotCount;
+}
+
+// Appends a record to a region the caller owns for writing
+static void CacheAppend(BYTE* region, ULONGLONG hash, const void* key, DWORD keyBytes,
+    DWORD valueType, const void* value, DWORD valueBytes)
+{
+    CacheRegion* r = (CacheRegion*)region;
+    CacheSlot* slots = CacheSlots(region);
+    LONGLONG offset = r->logHead;
+    CacheRecord* rec = (CacheRecord*)(CacheLog(region) + offset);
+    LONG mask = r->slotCount - 1, i = (LONG)(hash & (ULONGLONG)mask);
+
+    rec->hash = hash;
+    rec->keyBytes = keyBytes;
+    rec->valueBytes = valueBytes;
+    rec->valueType = valueType;
+    rec->reserved = 0;
+    memcpy(rec + 1, key, keyBytes);
+    memcpy((BYTE*)(rec + 1) + keyBytes, value, valueBytes);
+
+    while (slots[i].hash != 0)
+        i = (i + 1) & mask;
+    slots[i].offset = offset;
+    WriteRelease64(&slots[i].hash, (LONGLONG)hash);
+    r->count++;
+    WriteRelease64(&r->logHead, offset + CacheRecordBytes(keyBytes, valueBytes));
+}
+
+// Copies the newest records that fill at most half of the other region, then flips to it
+static void CacheCompact(void)
+{
+    CacheFile* f = CacheHeader();
+    LONG from = f->active & 1;
+    BYTE* src = CacheRegionBase(from);
+    BYTE* dst = CacheRegionBase(1 - from);
+    CacheRegion* rs = (CacheRegion*)src;
+    BYTE* log = CacheLog(src);
+    LONGLONG head = rs->logHead, offset, keepFrom, used;
+    LONG count = 0, dropped = 0;
+    LONG keepCount;
+
+    InterlockedIncrement(&f->generation);
+    CacheInitRegion(dst, f->regionBytes);
+    keepCount = ((CacheRegion*)dst)->slotCount / 4;
+
+    // Find the oldest record to keep: the suffix must fit half the log and a quarter of the index
+    for (offset = 0; offset < head; count++)
+    {
+        const CacheRecord* rec = (const CacheRecord*)(log + offset);
+        offset += CacheRecordBytes(rec->keyBytes, rec->valueBytes);
+    }
+    offset = 0;
+    used = head;
+    while (offset < head && (used > ((CacheRegion*)dst)->logBytes / 2 || count - dropped > keepCount))
+    {
+        const CacheRecord* rec = (const CacheRecord*)(log + offset);
+        LONGLONG bytes = CacheRecordBytes(rec->keyBytes, rec->valueBytes);
+        used -= bytes;
+        offset += bytes;
+        dropped++;
+    }
+    keepFrom = offset;
+
+    for (offset = keepFrom; offset < head; )
+    {
+        const CacheRecord* rec = (const CacheRecord*)(log + offset);
+        CacheAppend(dst, rec->hash, rec + 1, rec->keyBytes, rec->valueType,
+            (const BYTE*)(rec + 1) + rec->keyBytes, rec->valueBytes);
+        offset += CacheRecordBytes(rec->keyBytes, rec->valueBytes);
+    }
+
+    InterlockedExchange(&f->active, 1 - from);
+    InterlockedIncrement(&f->generation);
+    InterlockedIncrement64(&f->compactions);
+}
+
+static int CachePutKey(const CacheKey* key, DWORD valueType, const void* value, DWORD valueBytes)
+{
+    CacheFile* f = CacheHeader();
+    LONGLONG bytes = CacheRecordBytes(key->len, valueBytes);
+    BYTE* region;
+    int stored = 0;
+
+    if (!CacheLock())
+    {
+        InterlockedIncrement64(&g_cacheCounters.writerBusy);
+        return 0;
+    }
+
+    region = CacheRegionBase(f->active & 1);
+    if (CacheFind(region, key))
+    {
+        stored = 1;     // Another process got there first
+    }
+    else
+    {
+        if (!CacheFits(region, bytes))
+        {
+            CacheCompact();
+            region = CacheRegionBase(f->active & 1);
+        }
+        if (CacheFits(region, bytes))
+        {
+            CacheAppend(region, key->hash, key->bytes, key->len, valueType, value, valueBytes);
+            InterlockedIncrement64(&g_cacheCounters.stores);
+            stored = 1;
+        }
+    }
+    CacheUnlock();
+    return stored;
+}
+
+/*
+** Open / close
+*/
+static int CacheAttach(SIZE_T bytes)
+{
+    CacheFile* f = CacheHeader();
+    ULONGLONG start = GetTickCount64();
+
+    if (InterlockedCompareExchange(&f->state, 1, 0) == 0)
+    {
+        f->magic = CACHE_MAGIC;
+        f->version = CACHE_VERSION;
+        f->fileBytes = (LONGLONG)bytes;
+        f->regionBytes = ((LONGLONG)bytes - CACHE_HEADER_BYTES) / 2 & ~(LONGLONG)63;
+        f->active = 0;
+        f->generation = 0;
+        f->writer = 0;
+        f->writerTick = 0;
+        f->compactions = 0;
+        CacheInitRegion(CacheRegionBase(0), f->regionBytes);
+        CacheInitRegion(CacheRegionBase(1), f->regionBytes);
+        InterlockedExchange(&f->state, 2);
+    }
+
+    // Another process is creating the file
+    while (ReadAcquire(&f->state) != 2)
+    {
+        if (GetTickCount64() - start > CACHE_OPEN_WAIT_MS)
+            return 0;
+        Sleep(1);
+    }
+    return f->magic == CACHE_MAGIC && f->version == CACHE_VERSION && f->fileBytes == (LONGLONG)bytes;
+}
+
+// Touches every page of the live index and log so first lookups do not fault
+static int CacheWarm(void)
+{
+    CacheFile* f = CacheHeader();
+    BYTE* region = CacheRegionBase(f->active & 1);
+    CacheRegion* r = (CacheRegion*)region;
+    BYTE* end = CacheLog(region) + r->logHead;
+    volatile BYTE sink = 0;
+    BYTE* p;
+
+    for (p = region; p < end; p += 4096)
+        sink ^= *p;
+    (void)sink;
+    return (int)r->count;
+}
+
+int ResultCacheOpen(SIZE_T bytes)
+{
+    LARGE_INTEGER size;
+    LARGE_INTEGER t0, t1, freq;
+    DWORD n;
+
+    if (g_cacheView)
+        return g_cacheWarmEntries;
+
+    n = GetEnvironmentVariableW(L"XLL_RESULT_CACHE", g_cachePath, (DWORD)_countof(g_cachePath));
+    if (n == 0 || n >= _countof(g_cachePath))
+        return -1;
+    if (bytes < 2 * 1024 * 1024)
+        bytes = 2 * 1024 * 1024;
+    QueryPerformanceCounter(&t0);
+
+    g_cacheFileHandle = CreateFileW(g_cachePath, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g_cacheFileHandle == INVALID_HANDLE_VALUE)
+        return -1;
+
+    // An existing file keeps its size
+    if (GetFileSizeEx(g_cacheFileHandle, &size) && size.QuadPart > CACHE_HEADER_BYTES)
+        bytes = (SIZE_T)size.QuadPart;
+
+    g_cacheMapping = CreateFileMappingW(g_cacheFileHandle, NULL, PAGE_READWRITE,
+        (DWORD)((ULONGLONG)bytes >> 32), (DWORD)((ULONGLONG)bytes & 0xFFFFFFFF), NULL);
+    if (g_cacheMapping)
+        g_cacheView = (BYTE*)MapViewOfFile(g_cacheMapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+    if (!g_cacheView || !CacheAttach(bytes))
+    {
+        ResultCacheClose();
+        return -1;
+    }
+
+    g_cacheWarmEntries = CacheWarm();
+    QueryPerformanceCounter(&t1);
+    QueryPerformanceFrequency(&freq);
+    g_cacheWarmMs = (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / (double)freq.QuadPart;
+    return g_cacheWarmEntries;
+}
+
+void ResultCacheClose(void)
+{
+    if (g_cacheView)
+        UnmapViewOfFile(g_cacheView);
+    if (g_cacheMapping)
+        CloseHandle(g_cacheMapping);
+    if (g_cacheFileHandle != INVALID_HANDLE_VALUE)
+        CloseHandle(g_cacheFileHandle);
+    g_cacheView = NULL;
+    g_cacheMapping = NULL;
+    g_cacheFileHandle = INVALID_HANDLE_VALUE;
+    g_cacheWarmEntries = -1;
+}
+
+/*
+** Public lookups and stores
+*/
+static int CacheBuildKey(CacheKey* key, int fn, const XLOPER12* const* args, int count)
+{
+    int i;
+    CacheKeyBegin(key, fn);
+    for (i = 0; i < count; i++)
+    {
+        if (!CacheKeyAddArg(key, args[i]))
+            return 0;
+    }
+    return CacheKeyEnd(key);
+}
+
+static int CacheBuildKeyNum(CacheKey* key, int fn, const double* args, int count)
+{
+    int i;
+    CacheKeyBegin(key, fn);
+    for (i = 0; i < count; i++)
+        CacheKeyAddNum(key, args[i]);
+    return CacheKeyEnd(key);
+}
+
+static int CacheCountLookup(int hit)
+{
+    InterlockedIncrement64(hit ? &g_cacheCounters.hits : &g_cacheCounters.misses);
+    return hit;
+}
+
+int ResultCacheGet(int fn, const XLOPER12* const* args, int count, LPXLOPER12 value)
+{
+    CacheKey key;
+    if (!g_cacheView)
+        return 0;
+    if (!CacheBuildKey(&key, fn, args, count))
+    {
+        InterlockedIncrement64(&g_cacheCounters.uncacheable);
+        return 0;
+    }
+    return CacheCountLookup(CacheGetKey(&key, value));
+}
+
+int ResultCacheGetNum(int fn, const double* args, int count, double* value)
+{
+    CacheKey key;
+    XLOPER12 x;
+    int hit;
+
+    if (!g_cacheView || !CacheBuildKeyNum(&key, fn, args, count))
+        return 0;
+    hit = CacheGetKey(&key, &x);
+    if (hit && x.xltype != xltypeNum)
+    {
+        CacheDropValue(&x);
+        hit = 0;
+    }
+    if (hit)
+        *value = x.val.num;
+    return CacheCountLookup(hit);
+}
+
+int ResultCachePut(int fn, const XLOPER12* const* args, int count, const XLOPER12* value)
+{
+    CacheKey key;
+    BYTE flag;
+
+    if (!g_cacheView || !value)
+        return 0;
+    if (!CacheBuildKey(&key, fn, args, count))
+    {
+        InterlockedIncrement64(&g_cacheCounters.uncacheable);
+        return 0;
+    }
+
+    switch (value->xltype & ~(xlbitDLLFree | xlbitXLFree))
+    {
+    case xltypeNum:
+        return CachePutKey(&key, CACHE_VALUE_NUM, &value->val.num, sizeof(double));
+    case xltypeBool:
+        flag = value->val.xbool ? 1 : 0;
+        return CachePutKey(&key, CACHE_VALUE_BOOL, &flag, 1);
+    case xltypeErr:
+        return CachePutKey(&key, CACHE_VALUE_ERR, &value->val.err, sizeof(int));
+    case xltypeStr:
+        if (!value->val.str)
+            return 0;
+        return CachePutKey(&key, CACHE_VALUE_STR, &value->val.str[1], (DWORD)value->val.str[0] * sizeof(XCHAR));
+    default:
+        InterlockedIncrement64(&g_cacheCounters.uncacheable);
+        return 0;
+    }
+}
+
+int ResultCachePutNum(int fn, const double* args, int count, double value)
+{
+    CacheKey key;
+    if (!g_cacheView || !CacheBuildKeyNum(&key, fn, args, count))
+        return 0;
+    return CachePutKey(&key, CACHE_VALUE_NUM, &value, sizeof(double));
+}
+
+LPXLOPER12 ResultCacheTable(void)
+{
+    static const wchar_t* names[] = {
+        L"Entries", L"LogBytes", L"LogCapacity", L"IndexSlots", L"Generation", L"Compactions",
+        L"Hits", L"Misses", L"Stores", L"WriterBusy", L"Uncacheable", L"Retries",
+        L"WarmEntries", L"WarmMs"
+    };
+    const int rows = (int)_countof(names);
+    LPXLOPER12 table;
+    int i;
+
+    if (!g_cacheView)
+        return XlNewStr(L"Result cache off (set XLL_RESULT_CACHE to a file path)");
+
+    table = XlNewMulti(rows + 1, 2);
+    if (!table)
+        return XlNewErr(xlerrNA);
+    {
+        CacheFile* f = CacheHeader();
+        CacheRegion* r = (CacheRegion*)CacheRegionBase(f->active & 1);
+        double values[_countof(names)];
+
+        values[0] = (double)r->count;
+        values[1] = (double)r->logHead;
+        values[2] = (double)r->logBytes;
+        values[3] = (double)r->slotCount;
+        values[4] = (double)f->generation;
+        values[5] = (double)f->compactions;
+        values[6] = (double)g_cacheCounters.hits;
+        values[7] = (double)g_cacheCounters.misses;
+        values[8] = (double)g_cacheCounters.stores;
+        values[9] = (double)g_cacheCounters.writerBusy;
+        values[10] = (double)g_cacheCounters.uncacheable;
+        values[11] = (double)g_cacheCounters.retries;
+        values[12] = (double)g_cacheWarmEntries;
+        values[13] = g_cacheWarmMs;
+
+        XlSetStr(&table->val.array.lparray[0], L"File");
+        XlSetStr(&table->val.array.lparray[1], g_cachePath);
+        for (i = 0; i < rows; i++)
+        {
+            XlSetStr(&table->val.array.lparray[(i + 1) * 2], names[i]);
+            XlSetNum(&table->val.array.lparray[(i + 1) * 2 + 1], values[i]);
+        }
+    }
+    return table;
+}
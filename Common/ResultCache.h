@@ -0,0 +1,42 @@
+/*
+**  ResultCache
+**
+**  Persistent result cache shared by every process and XLL that maps the same
+**  file. Entries are keyed by a stable 64-bit hash of module name, function
+**  name and the serialised arguments, so a kernel computed by one Excel
+**  instance (or before a restart) is a lookup for the next one.
+**
+**  The file holds two regions, each an open-addressed index followed by an
+**  append-only log of records. Readers never lock: they probe the active
+**  region and validate against a generation counter. One writer at a time
+**  (a lock word in the file, stolen after a lease if its owner died) appends
+**  to the log; when the log or index fills it compacts the newest records
+**  into the other region and flips the active one.
+**
+**  The cache is off unless XLL_RESULT_CACHE names the file to use; only
+**  scalar arguments and results (number, string, boolean, error) are cached.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define RESULTCACHE_DEFAULT_BYTES   (64 * 1024 * 1024)
+
+// Maps the file named by XLL_RESULT_CACHE (created with the given size if new)
+// and pre-faults the live region; returns the number of entries or -1 if off
+int  ResultCacheOpen(SIZE_T bytes);
+void ResultCacheClose(void);
+
+// Lookups return 1 on a hit; a string result is allocated with GlobalAlloc
+int  ResultCacheGet(int fn, const XLOPER12* const* args, int count, LPXLOPER12 value);
+int  ResultCacheGetNum(int fn, const double* args, int count, double* value);
+
+// Stores return 1 if the entry is in the cache afterwards. They never wait:
+// if another thread or process holds the writer lock the result is dropped.
+int  ResultCachePut(int fn, const XLOPER12* const* args, int count, const XLOPER12* value);
+int  ResultCachePutNum(int fn, const double* args, int count, double value);
+
+// Two-column table of cache and per-process counters
+LPXLOPER12 ResultCacheTable(void);
@@ -0,0 +1,263 @@
+/*
+**  SingleFlight
+**
+**  Calls in flight and their waiters. See SingleFlight.h.
+**
+**  Calls are hashed onto lock stripes, each a list of the flights in progress
+**  under an SRW lock that is only held to search, link or unlink. A flight is
+**  reference counted: the leader holds one reference and each follower takes
+**  one under the stripe lock, so whoever leaves last frees it, and the
+**  leader never waits for its followers to wake up.
+*/
+
+#include <windows.h>
+#include <string.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "UdfHooks.h"
+#include "XlHelpers.h"
+#include "SingleFlight.h"
+
+#define SINGLEFLIGHT_COLUMNS    6
+#define SINGLEFLIGHT_SPIN       64
+
+struct SingleFlightCall
+{
+    SingleFlightCall* next;
+    UINT64 hash;
+    int fn;
+    int argCount;
+    double args[SINGLEFLIGHT_MAX_ARGS];
+    DWORD leader;
+    volatile LONG done;
+    volatile LONG refs;
+    LONG followers;             // Under the stripe lock
+    double result;
+};
+
+typedef struct __declspec(align(64)) SingleFlightStripe
+{
+    SRWLOCK lock;
+    SingleFlightCall* calls;
+} SingleFlightStripe;
+
+typedef struct SingleFlightStats
+{
+    volatile LONGLONG computed;
+    volatile LONGLONG coalesced;
+    volatile LONGLONG waitTicks;
+    volatile LONG peakFanIn;    // Most callers served by one computation
+} SingleFlightStats;
+
+static SingleFlightStripe g_singleFlightStripes[SINGLEFLIGHT_STRIPES];
+static SingleFlightStats g_singleFlightStats[UDF_MAX_FUNCS];
+static BYTE g_singleFlightPure[UDF_MAX_FUNCS];
+static int g_singleFlightOn = 0;
+
+int SingleFlightInit(const LPWSTR* rgFuncs, int rows, int columns)
+{
+    wchar_t env[8];
+    int i, pure = 0;
+
+    // Coalescing is off unless XLL_SINGLEFLIGHT is set (to anything but 0)
+    g_singleFlightOn = GetEnvironmentVariableW(L"XLL_SINGLEFLIGHT", env, (DWORD)_countof(env)) && wcscmp(env, L"0") != 0;
+    if (!g_singleFlightOn || columns <= GOVERNOR_COLUMN)
+        return 0;
+    if (rows > UDF_MAX_FUNCS)
+        rows = UDF_MAX_FUNCS;
+    for (i = 0; i < SINGLEFLIGHT_STRIPES; i++)
+        InitializeSRWLock(&g_singleFlightStripes[i].lock);
+    for (i = 0; i < rows; i++)
+    {
+        const wchar_t* spec = rgFuncs[i * columns + GOVERNOR_COLUMN];
+        g_singleFlightPure[i] = (BYTE)(spec && wcsstr(spec, L"pure") != NULL);
+        ZeroMemory(&g_singleFlightStats[i], sizeof(SingleFlightStats));
+        if (!g_singleFlightPure[i])
+            continue;
+        if (g_governors[i])
+            g_governors[i]->deferred = 1;   // Admitted by the leader in SingleFlightBeginNum
+        pure++;
+    }
+    return pure;
+}
+
+// FNV-1a over the function id and the argument bits
+static UINT64 SingleFlightHash(int fn, const double* args, int count)
+{
+    UINT64 h = 14695981039346656037ull;
+    const BYTE* p = (const BYTE*)args;
+    size_t i, n = (size_t)count * sizeof(double);
+
+    h = (h ^ (UINT64)(UINT32)fn) * 1099511628211ull;
+    for (i = 0; i < n; i++)
+        h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+static void SingleFlightRelease(SingleFlightCall* call)
+{
+    if (InterlockedDecrement(&call->refs) == 0)
+        GlobalFree(call);
+}
+
+static void SingleFlightAdmit(UdfFrame* frame)
+{
+    if (frame->governor && frame->governor->deferred)
+        frame->admitted = GovernorAcquire(frame->governor);
+}
+
+static double SingleFlightWait(SingleFlightCall* call)
+{
+    LONG zero = 0;
+    int spin;
+
+    for (spin = 0; spin < SINGLEFLIGHT_SPIN && !ReadAcquire(&call->done); spin++)
+        YieldProcessor();
+    while (!ReadAcquire(&call->done))
+        WaitOnAddress(&call->done, &zero, sizeof(zero), INFINITE);
+    return call->result;
+}
+
+int SingleFlightBeginNum(SingleFlight* sf, UdfFrame* frame, const double* args, int count, double* result)
+{
+    SingleFlightStripe* stripe;
+    SingleFlightCall* call;
+    SingleFlightStats* stats;
+    DWORD self = GetCurrentThreadId();
+    UINT64 hash;
+
+    sf->call = NULL;
+    sf->fn = frame->fn;
+    if (frame->fn < 0 || frame->fn >= UDF_MAX_FUNCS || !g_singleFlightPure[frame->fn])
+        return 0;
+    stats = &g_singleFlightStats[frame->fn];
+    if (count > SINGLEFLIGHT_MAX_ARGS)
+    {
+        SingleFlightAdmit(frame);
+        return 0;
+    }
+
+    hash = SingleFlightHash(frame->fn, args, count);
+    stripe = &g_singleFlightStripes[hash % SINGLEFLIGHT_STRIPES];
+    AcquireSRWLockExclusive(&stripe->lock);
+    for (call = stripe->calls; call; call = call->next)
+    {
+        if (call->hash == hash && call->fn == frame->fn && call->argCount == count
+            && memcmp(call->args, args, count * sizeof(double)) == 0 && call->leader != self)
+            break;
+    }
+    if (call)
+    {
+        LARGE_INTEGER start, end;
+        LONG fanIn;
+
+        InterlockedIncrement(&call->refs);
+        fanIn = ++call->followers + 1;
+        ReleaseSRWLockExclusive(&stripe->lock);
+        if (fanIn > stats->peakFanIn)
+            stats->peakFanIn = fanIn;   // Reporting only
+
+        QueryPerformanceCounter(&start);
+        *result = SingleFlightWait(call);
+        QueryPerformanceCounter(&end);
+        SingleFlightRelease(call);
+        InterlockedIncrement64(&stats->coalesced);
+        InterlockedExchangeAdd64(&stats->waitTicks, end.QuadPart - start.QuadPart);
+        return 1;
+    }
+
+    // Lead a new flight; without memory for one the call simply is not shared
+    call = (SingleFlightCall*)GlobalAlloc(GMEM_FIXED, sizeof(SingleFlightCall));
+    if (call)
+    {
+        call->hash = hash;
+        call->fn = frame->fn;
+        call->argCount = count;
+        memcpy(call->args, args, count * sizeof(double));
+        call->leader = self;
+        call->done = 0;
+        call->refs = 1;
+        call->followers = 0;
+        call->next = stripe->calls;
+        stripe->calls = call;
+    }
+    ReleaseSRWLockExclusive(&stripe->lock);
+    sf->call = call;
+    SingleFlightAdmit(frame);   // Callers arriving while this waits for a slot join the flight
+    return 0;
+}
+
+void SingleFlightEndNum(SingleFlight* sf, double result)
+{
+    SingleFlightCall* call = sf->call;
+    SingleFlightStripe* stripe;
+    SingleFlightCall** link;
+
+    if (sf->fn >= 0 && sf->fn < UDF_MAX_FUNCS && g_singleFlightPure[sf->fn])
+        InterlockedIncrement64(&g_singleFlightStats[sf->fn].computed);
+    if (!call)
+        return;
+
+    stripe = &g_singleFlightStripes[call->hash % SINGLEFLIGHT_STRIPES];
+    AcquireSRWLockExclusive(&stripe->lock);
+    for (link = &stripe->calls; *link; link = &(*link)->next)
+    {
+        if (*link == call)
+        {
+            *link = call->next;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&stripe->lock);
+
+    // Unlinked first: a caller arriving now starts a new flight rather than joining a finished one
+    call->result = result;
+    WriteRelease(&call->done, 1);
+    WakeByAddressAll((PVOID)&call->done);
+    SingleFlightRelease(call);
+    sf->call = NULL;
+}
+
+LPXLOPER12 SingleFlightTable(void)
+{
+    static const wchar_t* header[SINGLEFLIGHT_COLUMNS] = {
+        L"Function", L"Computed", L"Coalesced", L"AvoidedPct", L"AvgWaitMs", L"PeakFanIn"
+    };
+    LARGE_INTEGER freq;
+    double msPerTick;
+    LPXLOPER12 table;
+    int i, j, rows = 0, row = 1;
+
+    if (!g_singleFlightOn)
+        return XlNewStr(L"Single-flight off (set XLL_SINGLEFLIGHT=1)");
+    for (i = 0; i < UDF_MAX_FUNCS; i++)
+        if (g_singleFlightPure[i])
+            rows++;
+    table = XlNewMulti(rows + 1, SINGLEFLIGHT_COLUMNS);
+    if (!table)
+        return XlNewErr(xlerrNA);
+    QueryPerformanceFrequency(&freq);
+    msPerTick = 1000.0 / (double)freq.QuadPart;
+    for (j = 0; j < SINGLEFLIGHT_COLUMNS; j++)
+        XlSetStr(&table->val.array.lparray[j], header[j]);
+
+    for (i = 0; i < UDF_MAX_FUNCS; i++)
+    {
+        const SingleFlightStats* s = &g_singleFlightStats[i];
+        LPXLOPER12 cells;
+        double computed, coalesced;
+        if (!g_singleFlightPure[i])
+            continue;
+        cells = &table->val.array.lparray[row++ * SINGLEFLIGHT_COLUMNS];
+        computed = (double)ReadAcquire64(&s->computed);
+        coalesced = (double)ReadAcquire64(&s->coalesced);
+        XlSetStr(&cells[0], UdfFunctionName(i));
+        XlSetNum(&cells[1], computed);
+        XlSetNum(&cells[2], coalesced);
+        XlSetNum(&cells[3], computed + coalesced > 0 ? 100.0 * coalesced / (computed + coalesced) : 0.0);
+        XlSetNum(&cells[4], coalesced > 0 ? (double)ReadAcquire64(&s->waitTicks) * msPerTick / coalesced : 0.0);
+        XlSetNum(&cells[5], (double)s->peakFanIn);
+    }
+    return table;
+}
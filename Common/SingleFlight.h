@@ -0,0 +1,57 @@
+/*
+**  SingleFlight
+**
+**  Coalesces identical calls that are in flight at the same time. During a
+**  multithreaded recalc many cells often call one expensive pure function
+**  with the same arguments at once; the first caller (the leader) computes
+**  and every caller that arrives with equal arguments before it finishes
+**  waits for that result instead of computing it again. Nothing outlives
+**  the call, so unlike ResultCache there is nothing to invalidate.
+**
+**  Coalescing is off unless XLL_SINGLEFLIGHT is set to anything but 0, as
+**  the result cache is off unless XLL_RESULT_CACHE is set. With it on, only
+**  functions flagged "pure" in their rgFuncs policy column (after the
+**  concurrency limit, e.g. L"auto,pure") are coalesced. A governed pure
+**  function is admitted by its leader rather than by UDF_ENTER, so waiting
+**  followers never hold one of the governor's slots.
+**
+**  Usage, inside a UDF opened with UDF_ENTER:
+**      double result;
+**      SingleFlight sf;
+**      if (SingleFlightBeginNum(&sf, &udfFrame, args, count, &result))
+**          UDF_RETURN(result);             // Shared from the call in flight
+**      result = ...;
+**      SingleFlightEndNum(&sf, result);    // Always, once Begin returned 0
+**
+**  Arguments are compared bit for bit. A thread never waits for a flight it
+**  leads itself (a recursive call through xlUDF computes on its own).
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+
+#define SINGLEFLIGHT_MAX_ARGS   8
+#define SINGLEFLIGHT_STRIPES    64      // Lock stripes over the calls in flight
+
+typedef struct SingleFlightCall SingleFlightCall;
+
+typedef struct SingleFlight
+{
+    SingleFlightCall* call;     // The flight this caller leads, or NULL
+    int fn;
+} SingleFlight;
+
+// Reads the "pure" flags from rgFuncs (call after GovernorInit); returns the number of pure functions
+int  SingleFlightInit(const LPWSTR* rgFuncs, int rows, int columns);
+
+// Returns 1 with *result set when an identical call supplied it; 0 when the caller
+// leads and must compute the result and pass it to SingleFlightEndNum
+int  SingleFlightBeginNum(SingleFlight* sf, UdfFrame* frame, const double* args, int count, double* result);
+void SingleFlightEndNum(SingleFlight* sf, double result);
+
+// One row per pure function: calls computed, calls coalesced, share of work avoided,
+// average wait of a coalesced call and the largest number of callers sharing one flight
+LPXLOPER12 SingleFlightTable(void);
@@ -0,0 +1,246 @@
+/*
+**  ThreadContext
+**
+**  Registry of per-thread contexts. See ThreadContext.h.
+**
+**  Contexts in use are linked in a list and spare ones in a pool, both under
+**  one SRW lock; it is only taken when a thread attaches or detaches, never
+**  on the call path. The contexts allocated at process attach share one
+**  block and return to the pool when their thread exits; contexts allocated
+**  later, for threads past the pool, are freed when their thread exits.
+**  A thread whose context cannot be allocated uses a fallback in its own TLS,
+**  unregistered and taken afresh on each call until an allocation succeeds.
+*/
+
+#include <windows.h>
+#include <string.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "ThreadContext.h"
+
+#define THREAD_CONTEXT_COUNTERS 7
+
+__declspec(thread) ThreadContext* tls_threadContext = NULL;
+static __declspec(thread) ThreadContext tls_threadContextFallback;    // Only when allocation fails; never registered
+
+typedef struct ThreadContextStats
+{
+    LONGLONG attached;
+    LONGLONG detached;
+    LONGLONG allocated;         // Contexts allocated past the pool
+    LONGLONG freed;
+} ThreadContextStats;
+
+static SRWLOCK g_threadContextLock = SRWLOCK_INIT;
+static ThreadContext* g_threadContextLive = NULL;
+static ThreadContext* g_threadContextPool = NULL;
+static void* g_threadContextBlock = NULL;          // The contexts allocated at process attach
+static LONG g_threadContextLiveCount = 0;
+static LONG g_threadContextPoolCount = 0;
+static LONG g_threadContextPrewarmed = 0;
+static ThreadContextStats g_threadContextStats;    // Under the lock
+
+static ThreadContext* ThreadContextAlign(void* block)
+{
+    return (ThreadContext*)(((ULONG_PTR)block + 63) & ~(ULONG_PTR)63);
+}
+
+static void ThreadContextReset(ThreadContext* c)
+{
+    int i;
+    for (i = 0; i < THREAD_CONTEXT_NUMS; i++)
+    {
+        c->num[i].xltype = xltypeNum;
+        c->num[i].val.num = 0.0;
+    }
+    c->nameText[0] = 0;
+    c->name.xltype = xltypeStr;
+    c->name.val.str = c->nameText;
+    c->nameSource = NULL;
+    c->next = NULL;
+    c->prev = NULL;
+    c->threadId = 0;
+}
+
+BOOL ThreadContextProcessAttach(int prewarm)
+{
+    ThreadContext* contexts;
+    int i;
+
+    if (prewarm <= 0)
+        prewarm = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS) + 1;   // Calc threads and the main thread
+    g_threadContextBlock = GlobalAlloc(GMEM_FIXED, prewarm * sizeof(ThreadContext) + 63);
+    if (!g_threadContextBlock)
+        return TRUE;            // Every thread allocates its own context instead
+    contexts = ThreadContextAlign(g_threadContextBlock);
+
+    // Written through now, so the first recalc finds them initialised and resident
+    for (i = prewarm - 1; i >= 0; i--)
+    {
+        ZeroMemory(&contexts[i], sizeof(ThreadContext));
+        ThreadContextReset(&contexts[i]);
+        contexts[i].pooled = 1;
+        contexts[i].next = g_threadContextPool;
+        g_threadContextPool = &contexts[i];
+    }
+    g_threadContextPoolCount = prewarm;
+    g_threadContextPrewarmed = prewarm;
+    return TRUE;
+}
+
+static ThreadContext* ThreadContextTake(void)
+{
+    ThreadContext* c;
+    void* block = NULL;
+
+    AcquireSRWLockExclusive(&g_threadContextLock);
+    c = g_threadContextPool;
+    if (c)
+    {
+        g_threadContextPool = c->next;
+        g_threadContextPoolCount--;
+    }
+    ReleaseSRWLockExclusive(&g_threadContextLock);
+
+    if (!c)
+    {
+        block = GlobalAlloc(GMEM_FIXED, sizeof(ThreadContext) + 63);
+        if (!block)
+        {
+            ThreadContextReset(&tls_threadContextFallback);
+            return &tls_threadContextFallback;
+        }
+        c = ThreadContextAlign(block);
+        ZeroMemory(c, sizeof(ThreadContext));
+    }
+    ThreadContextReset(c);
+    c->block = block;
+    c->pooled = block == NULL;
+    c->threadId = GetCurrentThreadId();
+
+    AcquireSRWLockExclusive(&g_threadContextLock);
+    c->next = g_threadContextLive;
+    if (g_threadContextLive)
+        g_threadContextLive->prev = c;
+    g_threadContextLive = c;
+    g_threadContextLiveCount++;
+    if (block)
+        g_threadContextStats.allocated++;
+    g_threadContextStats.attached++;
+    ReleaseSRWLockExclusive(&g_threadContextLock);
+
+    tls_threadContext = c;
+    return c;
+}
+
+ThreadContext* ThreadContextAttach(void)
+{
+    return tls_threadContext ? tls_threadContext : ThreadContextTake();
+}
+
+void ThreadContextThreadDetach(void)
+{
+    ThreadContext* c = tls_threadContext;
+    void* block;
+
+    if (!c || (!c->pooled && !c->block))
+        return;                 // Never attached
+    tls_threadContext = NULL;
+
+    AcquireSRWLockExclusive(&g_threadContextLock);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        g_threadContextLive = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    g_threadContextLiveCount--;
+    g_threadContextStats.detached++;
+    block = c->block;
+    if (c->pooled)
+    {
+        c->prev = NULL;
+        c->next = g_threadContextPool;
+        g_threadContextPool = c;
+        g_threadContextPoolCount++;
+    }
+    else
+    {
+        g_threadContextStats.freed++;
+    }
+    ReleaseSRWLockExclusive(&g_threadContextLock);
+
+    if (block)
+        GlobalFree(block);
+}
+
+void ThreadContextProcessDetach(void)
+{
+    ThreadContext* c;
+    ThreadContext* next;
+
+    // Threads still running keep their pointers only until the module is unmapped
+    AcquireSRWLockExclusive(&g_threadContextLock);
+    for (c = g_threadContextLive; c; c = next)
+    {
+        next = c->next;
+        if (c->block)
+        {
+            GlobalFree(c->block);
+            g_threadContextStats.freed++;
+        }
+    }
+    g_threadContextLive = NULL;
+    g_threadContextPool = NULL;
+    g_threadContextLiveCount = 0;
+    g_threadContextPoolCount = 0;
+    if (g_threadContextBlock)
+        GlobalFree(g_threadContextBlock);
+    g_threadContextBlock = NULL;
+    ReleaseSRWLockExclusive(&g_threadContextLock);
+    tls_threadContext = NULL;
+}
+
+LPXLOPER12 ThreadContextName(ThreadContext* ctx, const XCHAR* name)
+{
+    if (ctx->nameSource != name)
+    {
+        size_t n = wcslen(name);
+        if (n > THREAD_CONTEXT_NAME - 1)
+            n = THREAD_CONTEXT_NAME - 1;
+        ctx->nameText[0] = (XCHAR)n;
+        wmemcpy(&ctx->nameText[1], name, n);
+        ctx->nameSource = name;
+    }
+    return &ctx->name;
+}
+
+LPXLOPER12 ThreadContextTable(void)
+{
+    static const wchar_t* names[THREAD_CONTEXT_COUNTERS] = {
+        L"Live", L"Pooled", L"Prewarmed", L"Attached", L"Detached", L"Allocated", L"Freed"
+    };
+    double values[THREAD_CONTEXT_COUNTERS];
+    LPXLOPER12 table = XlNewMulti(THREAD_CONTEXT_COUNTERS, 2);
+    int i;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    AcquireSRWLockShared(&g_threadContextLock);
+    values[0] = (double)g_threadContextLiveCount;
+    values[1] = (double)g_threadContextPoolCount;
+    values[2] = (double)g_threadContextPrewarmed;
+    values[3] = (double)g_threadContextStats.attached;
+    values[4] = (double)g_threadContextStats.detached;
+    values[5] = (double)g_threadContextStats.allocated;
+    values[6] = (double)g_threadContextStats.freed;
+    ReleaseSRWLockShared(&g_threadContextLock);
+    for (i = 0; i < THREAD_CONTEXT_COUNTERS; i++)
+    {
+        XlSetStr(&table->val.array.lparray[i * 2], names[i]);
+        XlSetNum(&table->val.array.lparray[i * 2 + 1], values[i]);
+    }
+    return table;
+}
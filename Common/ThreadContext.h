@@ -0,0 +1,72 @@
+/*
+**  ThreadContext
+**
+**  Per-thread state of the calling UDFs (the argument XLOPERs handed to
+**  xlUDF), owned by a registry instead of lazy __declspec(thread) pointers.
+**  Each context is one cache-line aligned block, reached from a UDF with a
+**  single TLS load (ThreadContextGet).
+**
+**  The registry follows the thread lifecycle through DllMain:
+**    DLL_PROCESS_ATTACH   contexts for every processor are allocated and
+**                         initialised up front, so the first call on a calc
+**                         thread does not allocate
+**    DLL_THREAD_DETACH    the context goes back to the pool (or is freed when
+**                         it was allocated past the pool), so threads that
+**                         Excel recycles do not leak their state
+**    DLL_PROCESS_DETACH   everything is freed
+**  A thread takes its pooled context on its first call, not at
+**  DLL_THREAD_ATTACH: every thread the process starts (COM, thread pool)
+**  gets that notification, and would use up the pool before the calc
+**  threads, which usually predate the XLL, ever call.
+**
+**  Usage, inside a UDF:
+**      ThreadContext* ctx = ThreadContextGet();
+**      ctx->num[0].val.num = x;
+**      Excel12f(xlUDF, &ret, 3, ThreadContextName(ctx, L"cDoubleInner"), &ctx->num[0], &ctx->num[1]);
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define THREAD_CONTEXT_NUMS     4       // Number argument XLOPERs per thread
+#define THREAD_CONTEXT_NAME     32      // Characters of the function name, length prefix included
+
+typedef struct __declspec(align(64)) ThreadContext
+{
+    // Hot: written by the owning thread on every call
+    XLOPER12 num[THREAD_CONTEXT_NUMS];  // xltypeNum, ready to pass to xlUDF
+    XLOPER12 name;                      // xltypeStr over nameText
+    XCHAR nameText[THREAD_CONTEXT_NAME];
+    const XCHAR* nameSource;            // Name last copied into nameText
+
+    // Registry: under the registry lock
+    struct ThreadContext* next;
+    struct ThreadContext* prev;
+    DWORD threadId;
+    int pooled;                         // Part of the block allocated at process attach
+    void* block;                        // GlobalAlloc block of an unpooled context
+} ThreadContext;
+
+extern __declspec(thread) ThreadContext* tls_threadContext;
+
+ThreadContext* ThreadContextAttach(void);
+
+// The calling thread's context, attached on its first use
+static __forceinline ThreadContext* ThreadContextGet(void)
+{
+    ThreadContext* c = tls_threadContext;
+    return c ? c : ThreadContextAttach();
+}
+
+// DllMain notifications; ProcessAttach allocates 'prewarm' contexts (0: one per processor, plus one)
+BOOL ThreadContextProcessAttach(int prewarm);
+void ThreadContextThreadDetach(void);
+void ThreadContextProcessDetach(void);
+
+// Points ctx->name at 'name' (copied once per change of name) and returns it for xlUDF
+LPXLOPER12 ThreadContextName(ThreadContext* ctx, const XCHAR* name);
+
+// Live, pooled and prewarmed contexts; attaches (first uses), detaches, allocations and frees
+LPXLOPER12 ThreadContextTable(void);
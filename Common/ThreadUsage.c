@@ -0,0 +1,422 @@
+/*
+**  ThreadUsage
+**
+**  Per-thread cycle counters and the history of closed cycles. See
+**  ThreadUsage.h.
+**
+**  Each thread owns one slot and is its only writer, at each call's return.
+**  A slot's counters belong to the cycle recorded in it: the first return in
+**  a new cycle finds an older one there and resets them, so closing a cycle
+**  never writes to the slots. Excel raises the calculation events with the
+**  calc threads idle, so the closer reads settled counters. A call entered
+**  before its cycle opened is dropped, which includes the event handler
+**  that closed the previous one.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "UdfHooks.h"
+#include "XlHelpers.h"
+#include "ThreadUsage.h"
+
+#define USAGE_COLUMNS   13
+
+// One thread's share of a cycle
+typedef struct UsageRow
+{
+    DWORD threadId;
+    int longestFn;
+    LONGLONG calls;
+    LONGLONG busy;                  // QueryPerformanceCounter ticks
+    LONGLONG gaps;
+    LONGLONG maxGap;
+    LONGLONG first;                 // First entry
+    LONGLONG last;                  // Last return
+    LONGLONG longest;
+} UsageRow;
+
+typedef struct __declspec(align(64)) UsageSlot
+{
+    LONGLONG cycle;                 // Cycle the row belongs to
+    UsageRow row;
+} UsageSlot;
+
+typedef struct UsageCycle
+{
+    LONGLONG id;
+    LONGLONG first;                 // Window: first entry and last return on any thread
+    LONGLONG last;
+    LONGLONG tail;                  // Time the straggler ran alone at the end
+    int straggler;                  // Row of the thread that returned last
+    int rows;
+    UsageRow row[1];
+} UsageCycle;
+
+static UsageSlot g_usageSlots[USAGE_MAX_THREADS];
+static UsageSlot g_usageOverflow;               // Threads past the table share it, unreported
+static volatile LONG g_usageSlotCount = 0;
+static __declspec(thread) UsageSlot* tls_usageSlot = NULL;
+
+static volatile LONGLONG g_usageCycle = 1;
+static volatile LONGLONG g_usageCycleStart = 0;  // QueryPerformanceCounter when it opened
+static volatile LONG g_usageState = 0;          // 0 off, 1 changing, 2 tracking
+static wchar_t g_usagePath[MAX_PATH];
+static LONGLONG g_usageFreq = 1;
+
+static SRWLOCK g_usageLock = SRWLOCK_INIT;      // The history
+static UsageCycle* g_usageHistory[USAGE_HISTORY];
+static LONGLONG g_usageClosed = 0;              // Cycles closed since the start
+
+static UsageSlot* UsageSlotGet(void)
+{
+    UsageSlot* s = tls_usageSlot;
+    LONG index;
+
+    if (s)
+        return s;
+    index = InterlockedIncrement(&g_usageSlotCount) - 1;
+    if (index < USAGE_MAX_THREADS)
+    {
+        s = &g_usageSlots[index];
+        s->row.threadId = GetCurrentThreadId();
+    }
+    else
+    {
+        s = &g_usageOverflow;
+    }
+    tls_usageSlot = s;
+    return s;
+}
+
+void ThreadUsageLeave(const UdfFrame* frame, LONGLONG now)
+{
+    UsageSlot* s;
+    LONGLONG cycle = ReadAcquire64(&g_usageCycle);
+    LONGLONG took = now - frame->start;
+    UsageRow* r;
+
+    if (frame->start < ReadAcquire64(&g_usageCycleStart))
+        return;                     // Entered before the cycle began, e.g. the handler that closed it
+    s = UsageSlotGet();
+    r = &s->row;
+    if (s->cycle != cycle)
+    {
+        DWORD threadId = r->threadId;
+        memset(r, 0, sizeof(*r));
+        r->threadId = threadId;
+        r->first = frame->start;
+        s->cycle = cycle;
+    }
+    else
+    {
+        LONGLONG gap = frame->start - r->last;
+        r->gaps += gap;
+        if (gap > r->maxGap)
+            r->maxGap = gap;
+    }
+    r->calls++;
+    r->busy += took;
+    r->last = now;
+    if (took > r->longest)
+    {
+        r->longest = took;
+        r->longestFn = frame->fn;
+    }
+}
+
+// Opens the next cycle: calls entered before now are not counted in it
+static void UsageOpen(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    InterlockedExchange64(&g_usageCycleStart, now.QuadPart);
+    InterlockedIncrement64(&g_usageCycle);
+}
+
+// Moves the open cycle into the history, if any UDF ran in it
+static void UsageClose(void)
+{
+    LONGLONG cycle = ReadAcquire64(&g_usageCycle);
+    LONG count = ReadAcquire(&g_usageSlotCount), i;
+    LONGLONG runnerUp = 0;          // Latest return of any thread but the straggler
+    UsageCycle* c;
+    int rows = 0;
+
+    if (count > USAGE_MAX_THREADS)
+        count = USAGE_MAX_THREADS;
+    for (i = 0; i < count; i++)
+        if (g_usageSlots[i].cycle == cycle && g_usageSlots[i].row.calls)
+            rows++;
+    if (rows == 0)
+        return;
+    c = (UsageCycle*)GlobalAlloc(GMEM_FIXED | GMEM_ZEROINIT, sizeof(UsageCycle) + (SIZE_T)(rows - 1) * sizeof(UsageRow));
+    UsageOpen();
+    if (!c)
+        return;
+    c->id = cycle;
+    for (i = 0; i < count; i++)
+    {
+        const UsageRow* r = &g_usageSlots[i].row;
+        if (g_usageSlots[i].cycle != cycle || !r->calls)
+            continue;
+        c->row[c->rows] = *r;
+        if (c->rows == 0 || r->first < c->first)
+            c->first = r->first;
+        if (c->rows == 0 || r->last > c->last)
+        {
+            runnerUp = c->rows ? c->last : 0;
+            c->last = r->last;
+            c->straggler = c->rows;
+        }
+        else if (r->last > runnerUp)
+        {
+            runnerUp = r->last;
+        }
+        c->rows++;
+    }
+    // With one thread there is nobody to wait for
+    c->tail = c->rows > 1 ? c->last - runnerUp : 0;
+
+    AcquireSRWLockExclusive(&g_usageLock);
+    i = (LONG)(g_usageClosed % USAGE_HISTORY);
+    if (g_usageHistory[i])
+        GlobalFree(g_usageHistory[i]);
+    g_usageHistory[i] = c;
+    g_usageClosed++;
+    ReleaseSRWLockExclusive(&g_usageLock);
+}
+
+void ThreadUsageCycleEnd(void)
+{
+    if (ReadAcquire(&g_usageState) == 2)
+        UsageClose();
+}
+
+int ThreadUsageStart(const wchar_t* path)
+{
+    LARGE_INTEGER freq;
+    int i;
+
+    if (InterlockedCompareExchange(&g_usageState, 1, 0) != 0)
+        return ReadAcquire(&g_usageState) == 2;
+
+    g_usagePath[0] = 0;
+    if (!path || !path[0])
+    {
+        wchar_t dir[MAX_PATH - 64];
+        DWORD n = GetEnvironmentVariableW(L"XLL_THREAD_USAGE", dir, (DWORD)_countof(dir));
+        if (path == NULL && (n == 0 || n >= _countof(dir)))
+        {
+            InterlockedExchange(&g_usageState, 0);
+            return 0;               // Start at load only when asked to
+        }
+        if (n && n < _countof(dir))
+            swprintf_s(g_usagePath, MAX_PATH, L"%ls/%ls-usage.csv", dir, UdfModuleName());
+    }
+    else
+    {
+        wcsncpy_s(g_usagePath, MAX_PATH, path, _TRUNCATE);
+    }
+
+    QueryPerformanceFrequency(&freq);
+    g_usageFreq = freq.QuadPart;
+    AcquireSRWLockExclusive(&g_usageLock);
+    for (i = 0; i < USAGE_HISTORY; i++)
+    {
+        if (g_usageHistory[i])
+            GlobalFree(g_usageHistory[i]);
+        g_usageHistory[i] = NULL;
+    }
+    g_usageClosed = 0;
+    ReleaseSRWLockExclusive(&g_usageLock);
+
+    // Counters left from an earlier run belong to an older cycle from here on
+    UsageOpen();
+    InterlockedOr(&g_udfHooks, UDF_HOOK_USAGE);
+    InterlockedExchange(&g_usageState, 2);
+    return 1;
+}
+
+int ThreadUsageStop(void)
+{
+    FILE* f = NULL;
+    double ms = 1000.0 / (double)g_usageFreq;
+    LONGLONG k, from;
+    int rows = 0, i;
+
+    if (InterlockedCompareExchange(&g_usageState, 1, 2) != 2)
+        return 0;
+    InterlockedAnd(&g_udfHooks, ~UDF_HOOK_USAGE);
+    UsageClose();
+
+    if (g_usagePath[0])
+    {
+        if (_wfopen_s(&f, g_usagePath, L"w") != 0 || !f)
+        {
+            InterlockedExchange(&g_usageState, 0);
+            return -1;
+        }
+        fprintf(f, "module,cycle,thread,calls,busy_ms,window_ms,utilisation,gap_ms,max_gap_ms,longest_ms,longest_function,straggler,tail_ms\n");
+        AcquireSRWLockShared(&g_usageLock);
+        from = g_usageClosed > USAGE_HISTORY ? g_usageClosed - USAGE_HISTORY : 0;
+        for (k = from; k < g_usageClosed; k++)
+        {
+            const UsageCycle* c = g_usageHistory[k % USAGE_HISTORY];
+            double window = (double)(c->last - c->first) * ms;
+            for (i = 0; i < c->rows; i++)
+            {
+                const UsageRow* r = &c->row[i];
+                fprintf(f, "%ls,%lld,%lu,%lld,%.3f,%.3f,%.4f,%.3f,%.3f,%.3f,%ls,%d,%.3f\n",
+                    UdfModuleName(), k + 1, (unsigned long)r->threadId, r->calls, (double)r->busy * ms, window,
+                    window > 0.0 ? (double)r->busy * ms / window : 0.0, (double)r->gaps * ms, (double)r->maxGap * ms,
+                    (double)r->longest * ms, UdfFunctionName(r->longestFn), i == c->straggler,
+                    i == c->straggler ? (double)c->tail * ms : 0.0);
+                rows++;
+            }
+        }
+        ReleaseSRWLockShared(&g_usageLock);
+        fclose(f);
+    }
+    InterlockedExchange(&g_usageState, 0);
+    return rows;
+}
+
+// Per-thread sums over a run of cycles
+typedef struct UsageTotal
+{
+    DWORD threadId;
+    int longestFn;
+    LONGLONG cycles;
+    LONGLONG calls;
+    LONGLONG busy;
+    LONGLONG gaps;
+    LONGLONG maxGap;
+    LONGLONG longest;
+    LONGLONG stragglers;
+    LONGLONG tail;
+} UsageTotal;
+
+static void UsageAdd(UsageTotal* t, const UsageRow* r, int straggler, LONGLONG tail)
+{
+    t->cycles++;
+    t->calls += r->calls;
+    t->busy += r->busy;
+    t->gaps += r->gaps;
+    if (r->maxGap > t->maxGap)
+        t->maxGap = r->maxGap;
+    if (r->longest > t->longest)
+    {
+        t->longest = r->longest;
+        t->longestFn = r->longestFn;
+    }
+    if (straggler && tail > 0)
+    {
+        t->stragglers++;
+        t->tail += tail;
+    }
+}
+
+static void UsageSetRow(LPXLOPER12 cells, const UsageTotal* t, LONGLONG window, double utilisation, double load, double ms)
+{
+    XlSetNum(&cells[1], (double)t->cycles);
+    XlSetNum(&cells[2], (double)t->calls);
+    XlSetNum(&cells[3], (double)t->busy * ms);
+    XlSetNum(&cells[4], (double)window * ms);
+    XlSetNum(&cells[5], utilisation);
+    XlSetNum(&cells[6], load);
+    XlSetNum(&cells[7], (double)t->gaps * ms);
+    XlSetNum(&cells[8], (double)t->maxGap * ms);
+    XlSetNum(&cells[9], (double)t->longest * ms);
+    XlSetStr(&cells[10], t->longest ? UdfFunctionName(t->longestFn) : L"");
+    XlSetNum(&cells[11], (double)t->stragglers);
+    XlSetNum(&cells[12], (double)t->tail * ms);
+}
+
+LPXLOPER12 ThreadUsageTable(int cycles)
+{
+    static const wchar_t* header[USAGE_COLUMNS] = {
+        L"Thread", L"Cycles", L"Calls", L"BusyMs", L"WindowMs", L"Utilisation", L"Load",
+        L"GapMs", L"MaxGapMs", L"LongestMs", L"LongestFunction", L"StragglerCycles", L"TailMs"
+    };
+    UsageTotal* totals;
+    UsageTotal all;
+    LPXLOPER12 table;
+    LONGLONG k, from, window = 0;
+    double ms = 1000.0 / (double)g_usageFreq, meanBusy, maxLoad = 0.0;
+    int threads = 0, i, j;
+
+    totals = (UsageTotal*)GlobalAlloc(GMEM_FIXED | GMEM_ZEROINIT, USAGE_MAX_THREADS * sizeof(UsageTotal));
+    if (!totals)
+        return XlNewErr(xlerrNA);
+    memset(&all, 0, sizeof(all));
+    all.longestFn = UDF_NONE;
+
+    AcquireSRWLockShared(&g_usageLock);
+    from = g_usageClosed > USAGE_HISTORY ? g_usageClosed - USAGE_HISTORY : 0;
+    if (cycles > 0 && g_usageClosed - cycles > from)
+        from = g_usageClosed - cycles;
+    for (k = from; k < g_usageClosed; k++)
+    {
+        const UsageCycle* c = g_usageHistory[k % USAGE_HISTORY];
+        window += c->last - c->first;
+        all.cycles++;
+        if (c->tail > 0)
+        {
+            all.stragglers++;
+            all.tail += c->tail;
+        }
+        for (i = 0; i < c->rows; i++)
+        {
+            const UsageRow* r = &c->row[i];
+            for (j = 0; j < threads && totals[j].threadId != r->threadId; j++)
+                ;
+            if (j == threads)
+            {
+                if (threads == USAGE_MAX_THREADS)
+                    continue;
+                totals[threads].threadId = r->threadId;
+                totals[threads++].longestFn = UDF_NONE;
+            }
+            UsageAdd(&totals[j], r, i == c->straggler, c->tail);
+            all.calls += r->calls;
+            all.busy += r->busy;
+            all.gaps += r->gaps;
+            if (r->maxGap > all.maxGap)
+                all.maxGap = r->maxGap;
+            if (r->longest > all.longest)
+            {
+                all.longest = r->longest;
+                all.longestFn = r->longestFn;
+            }
+        }
+    }
+    ReleaseSRWLockShared(&g_usageLock);
+
+    table = XlNewMulti(threads + 2, USAGE_COLUMNS);
+    if (!table)
+    {
+        GlobalFree(totals);
+        return XlNewErr(xlerrNA);
+    }
+    for (j = 0; j < USAGE_COLUMNS; j++)
+        XlSetStr(&table->val.array.lparray[j], header[j]);
+    meanBusy = threads ? (double)all.busy / threads : 0.0;
+    for (i = 0; i < threads; i++)
+    {
+        LPXLOPER12 cells = &table->val.array.lparray[(i + 1) * USAGE_COLUMNS];
+        double load = meanBusy > 0.0 ? (double)totals[i].busy / meanBusy : 0.0;
+        if (load > maxLoad)
+            maxLoad = load;
+        XlSetNum(&cells[0], (double)totals[i].threadId);
+        UsageSetRow(cells, &totals[i], window, window ? (double)totals[i].busy / (double)window : 0.0, load, ms);
+    }
+    // All threads: mean utilisation, and the busiest thread's load (1 = balanced)
+    XlSetStr(&table->val.array.lparray[(threads + 1) * USAGE_COLUMNS], L"All");
+    UsageSetRow(&table->val.array.lparray[(threads + 1) * USAGE_COLUMNS], &all, window,
+        window && threads ? (double)all.busy / ((double)window * threads) : 0.0, maxLoad, ms);
+    GlobalFree(totals);
+    return table;
+}
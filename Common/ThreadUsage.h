@@ -0,0 +1,47 @@
+/*
+**  ThreadUsage
+**
+**  Calc-thread utilisation per calculation cycle. While tracking, every
+**  outermost UDF call (UdfHooks.h) on a thread adds to that thread's slot for
+**  the current cycle:
+**    calls, busy time (entry to return), gaps (from the previous return to
+**    this entry), the longest gap, and the longest call with its function
+**  A cycle ends in the calculation event handlers (ThreadUsageCycleEnd). Its
+**  window runs from the first entry to the last return on any thread. Each
+**  thread's utilisation is its busy time over that window. The straggler is
+**  the thread that returned last, and its tail is how long it ran after the
+**  next-to-last thread returned.
+**
+**  ThreadUsageTable sums the last N cycles per thread; ThreadUsageStop writes
+**  one CSV row per thread and cycle. Only time inside this XLL's UDFs counts
+**  as busy: time a thread spends in Excel or in other add-ins is a gap.
+**
+**  Tracking costs two QueryPerformanceCounter reads per outermost call and is
+**  off until ThreadUsageStart. XLL_THREAD_USAGE set to a directory starts it
+**  at load, and the CSV goes to that directory.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+
+#define USAGE_MAX_THREADS   64      // Threads tracked; later ones are counted but not reported
+#define USAGE_HISTORY       256     // Cycles kept for the table and the CSV
+
+// Starts tracking; the CSV goes to path when tracking stops (NULL or empty:
+// %XLL_THREAD_USAGE%/<module>-usage.csv, or nowhere). Returns 1 if tracking.
+int  ThreadUsageStart(const wchar_t* path);
+
+// Stops tracking and writes the CSV; returns the rows written, 0 without a path, -1 on error
+int  ThreadUsageStop(void);
+
+// Closes the current cycle; called from the calculation event handlers
+void ThreadUsageCycleEnd(void);
+
+// UdfHooks slow path, at the return of outermost frames
+void ThreadUsageLeave(const UdfFrame* frame, LONGLONG now);
+
+// Header, then one row per thread over the last 'cycles' cycles (0: all kept), then an "All" row
+LPXLOPER12 ThreadUsageTable(int cycles);
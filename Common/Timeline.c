@@ -0,0 +1,260 @@
+/*
+**  Timeline
+**
+**  Per-thread event buffers and the Chrome trace writer. See Timeline.h.
+**
+**  Recording uses the same handshake as CallTrace: a thread sets its buffer's
+**  'busy' flag, checks 'active' and appends; stopping clears 'active' and
+**  waits for every 'busy' flag before reading the buffers.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+#include "Timeline.h"
+
+#define TIMELINE_MAX_THREADS    256
+#define TIMELINE_END_RESERVE    256     // Slots kept for end events of calls already open
+
+#define TIMELINE_UDF            0
+#define TIMELINE_CALLBACK       1
+
+typedef struct TimelineEvent
+{
+    LONGLONG ticks;
+    INT32 id;                   // Function id, or xlfn for callbacks
+    UINT8 kind;                 // TIMELINE_UDF or TIMELINE_CALLBACK
+    UINT8 phase;                // 'B' or 'E'
+    UINT8 via;                  // UDF_VIA_* for callbacks
+    UINT8 depth;
+} TimelineEvent;
+
+typedef struct TimelineBuffer
+{
+    volatile LONG busy;
+    DWORD thread;
+    LONG count;
+    LONG dropped;
+    TimelineEvent events[TIMELINE_EVENTS_PER_THREAD];
+} TimelineBuffer;
+
+static volatile LONG g_timelineState = 0;       // 0 idle, 1 starting or stopping, 2 recording
+static volatile LONG g_timelineActive = 0;
+static wchar_t g_timelinePath[MAX_PATH];
+static TimelineBuffer* g_timelineBuffers[TIMELINE_MAX_THREADS];
+static volatile LONG g_timelineBufferCount = 0;
+static __declspec(thread) TimelineBuffer* tls_timelineBuffer = NULL;
+
+static TimelineBuffer* TimelineThreadBuffer(void)
+{
+    TimelineBuffer* buf = tls_timelineBuffer;
+    LONG index;
+
+    if (buf)
+        return buf;
+    index = InterlockedIncrement(&g_timelineBufferCount) - 1;
+    if (index >= TIMELINE_MAX_THREADS)
+        return NULL;
+    buf = (TimelineBuffer*)GlobalAlloc(GMEM_FIXED | GMEM_ZEROINIT, sizeof(TimelineBuffer));
+    if (buf)
+        buf->thread = GetCurrentThreadId();
+    g_timelineBuffers[index] = buf;
+    tls_timelineBuffer = buf;
+    return buf;
+}
+
+static int TimelineAppend(int kind, int phase, int id, int via, int depth, LONGLONG ticks)
+{
+    TimelineBuffer* buf = TimelineThreadBuffer();
+    LONG limit = phase == 'B' ? TIMELINE_EVENTS_PER_THREAD - TIMELINE_END_RESERVE : TIMELINE_EVENTS_PER_THREAD;
+    int recorded = 0;
+
+    if (!buf)
+        return 0;
+    InterlockedExchange(&buf->busy, 1);
+    if (ReadAcquire(&g_timelineActive) && buf->count < limit)
+    {
+        TimelineEvent* e = &buf->events[buf->count++];
+        e->ticks = ticks;
+        e->id = id;
+        e->kind = (UINT8)kind;
+        e->phase = (UINT8)phase;
+        e->via = (UINT8)via;
+        e->depth = (UINT8)(depth > 255 ? 255 : depth);
+        recorded = 1;
+    }
+    else if (phase == 'B')
+    {
+        buf->dropped++;
+    }
+    InterlockedExchange(&buf->busy, 0);
+    return recorded;
+}
+
+int TimelineUdfBegin(const UdfFrame* frame)
+{
+    return TimelineAppend(TIMELINE_UDF, 'B', frame->fn, 0, frame->depth, frame->start);
+}
+
+void TimelineUdfEnd(const UdfFrame* frame, LONGLONG endTicks)
+{
+    TimelineAppend(TIMELINE_UDF, 'E', frame->fn, 0, frame->depth, endTicks);
+}
+
+int TimelineCallbackBegin(const UdfCallback* cb)
+{
+    return TimelineAppend(TIMELINE_CALLBACK, 'B', cb->xlfn, cb->via, tls_udfDepth, cb->start);
+}
+
+void TimelineCallbackEnd(const UdfCallback* cb, LONGLONG endTicks)
+{
+    TimelineAppend(TIMELINE_CALLBACK, 'E', cb->xlfn, cb->via, tls_udfDepth, endTicks);
+}
+
+/*
+** Control
+*/
+int TimelineStart(const wchar_t* path)
+{
+    LONG i, count;
+
+    if (InterlockedCompareExchange(&g_timelineState, 1, 0) != 0)
+        return ReadAcquire(&g_timelineState) == 2;
+
+    if (!path || !path[0])
+    {
+        wchar_t dir[MAX_PATH - 64];
+        DWORD n = GetEnvironmentVariableW(L"XLL_TIMELINE", dir, (DWORD)_countof(dir));
+        if (n == 0 || n >= _countof(dir))
+        {
+            InterlockedExchange(&g_timelineState, 0);
+            return 0;
+        }
+        swprintf_s(g_timelinePath, MAX_PATH, L"%ls/%ls-%lu.trace.json", dir, UdfModuleName(), (unsigned long)GetCurrentProcessId());
+    }
+    else
+    {
+        wcsncpy_s(g_timelinePath, MAX_PATH, path, _TRUNCATE);
+    }
+
+    // Nothing appends while idle, so the buffers can be reset in place
+    count = ReadAcquire(&g_timelineBufferCount);
+    for (i = 0; i < count && i < TIMELINE_MAX_THREADS; i++)
+    {
+        if (g_timelineBuffers[i])
+        {
+            g_timelineBuffers[i]->count = 0;
+            g_timelineBuffers[i]->dropped = 0;
+        }
+    }
+
+    InterlockedExchange(&g_timelineActive, 1);
+    InterlockedOr(&g_udfHooks, UDF_HOOK_TIMELINE);
+    InterlockedExchange(&g_timelineState, 2);
+    return 1;
+}
+
+static const char* TimelineViaName(int via)
+{
+    switch (via)
+    {
+    case UDF_VIA_EXCEL12F:      return "Excel12f";
+    case UDF_VIA_EXCEL12:       return "Excel12";
+    case UDF_VIA_EXCEL12DIRECT: return "Excel12Direct";
+    default:                    return "callback";
+    }
+}
+
+static const char* TimelineXlfnName(int xlfn, char* buffer, size_t capacity)
+{
+    switch (xlfn)
+    {
+    case xlUDF:         return "xlUDF";
+    case xlFree:        return "xlFree";
+    case xlAbort:       return "xlAbort";
+    case xlCoerce:      return "xlCoerce";
+    case xlGetName:     return "xlGetName";
+    case xlfEvaluate:   return "xlfEvaluate";
+    case xlfRegister:   return "xlfRegister";
+    }
+    sprintf_s(buffer, capacity, "xlfn %d", xlfn);
+    return buffer;
+}
+
+static LONGLONG TimelineWrite(FILE* f, LONG bufferCount)
+{
+    LARGE_INTEGER freq;
+    double usPerTick;
+    DWORD pid = GetCurrentProcessId();
+    LONGLONG written = 0, dropped = 0;
+    char xlfnName[32];
+    LONG b, i;
+
+    QueryPerformanceFrequency(&freq);
+    usPerTick = 1e6 / (double)freq.QuadPart;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":0,\"args\":{\"name\":\"%ls\"}}",
+        (unsigned long)pid, UdfModuleName());
+
+    for (b = 0; b < bufferCount; b++)
+    {
+        const TimelineBuffer* buf = g_timelineBuffers[b];
+        if (!buf || (!buf->count && !buf->dropped))
+            continue;
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"thread %lu\"}}",
+            (unsigned long)pid, (unsigned long)buf->thread, (unsigned long)buf->thread);
+        for (i = 0; i < buf->count; i++)
+        {
+            const TimelineEvent* e = &buf->events[i];
+            double ts = (double)e->ticks * usPerTick;
+            if (e->kind == TIMELINE_UDF)
+                fprintf(f, ",\n{\"name\":\"%ls\",\"cat\":\"udf\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu,\"args\":{\"depth\":%d}}",
+                    UdfFunctionName(e->id), e->phase, ts, (unsigned long)pid, (unsigned long)buf->thread, e->depth);
+            else
+                fprintf(f, ",\n{\"name\":\"%s %s\",\"cat\":\"callback\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu}",
+                    TimelineViaName(e->via), TimelineXlfnName(e->id, xlfnName, sizeof(xlfnName)), e->phase, ts,
+                    (unsigned long)pid, (unsigned long)buf->thread);
+        }
+        written += buf->count;
+        dropped += buf->dropped;
+    }
+    fprintf(f, "\n],\"otherData\":{\"module\":\"%ls\",\"events\":%lld,\"droppedCalls\":%lld}}\n",
+        UdfModuleName(), written, dropped);
+    return written;
+}
+
+LONGLONG TimelineStop(void)
+{
+    FILE* f = NULL;
+    LONGLONG written = -1;
+    LONG i, count;
+
+    if (InterlockedCompareExchange(&g_timelineState, 1, 2) != 2)
+        return 0;
+
+    InterlockedAnd(&g_udfHooks, ~UDF_HOOK_TIMELINE);
+    InterlockedExchange(&g_timelineActive, 0);
+
+    count = ReadAcquire(&g_timelineBufferCount);
+    if (count > TIMELINE_MAX_THREADS)
+        count = TIMELINE_MAX_THREADS;
+    for (i = 0; i < count; i++)
+    {
+        if (!g_timelineBuffers[i])
+            continue;
+        while (ReadAcquire(&g_timelineBuffers[i]->busy))
+            Sleep(0);
+    }
+
+    if (_wfopen_s(&f, g_timelinePath, L"w") == 0 && f)
+    {
+        written = TimelineWrite(f, count);
+        fclose(f);
+    }
+
+    InterlockedExchange(&g_timelineState, 0);
+    return written;
+}
@@ -0,0 +1,37 @@
+/*
+**  Timeline
+**
+**  Begin/end events for every UDF and every Excel callback made through
+**  UdfCallbackBegin/End (Excel12f, Excel12, Excel12Direct), exported as
+**  Chrome trace JSON (chrome://tracing, https://ui.perfetto.dev). One track
+**  per thread shows how nested xlUDF calls interleave across calc threads,
+**  where a thread waits inside the callback and how evenly work is spread.
+**
+**  Events go to a fixed buffer per thread; once it fills, further calls on
+**  that thread are dropped (and counted) while end events for calls already
+**  open are still kept, so every recorded begin has its end.
+**
+**  Timestamps are absolute QueryPerformanceCounter readings in microseconds,
+**  so files written by both XLLs in one process line up.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "UdfHooks.h"
+
+#define TIMELINE_EVENTS_PER_THREAD  65536
+
+// Starts recording; the JSON goes to path when recording stops (NULL or empty:
+// %XLL_TIMELINE%/<module>-<pid>.trace.json, if that is set). Returns 1 if recording.
+int  TimelineStart(const wchar_t* path);
+
+// Stops recording, writes the JSON and returns the number of events written (-1 if
+// the file could not be written, 0 if not recording)
+LONGLONG TimelineStop(void);
+
+// Called from UdfHooks; Begin returns 0 when the event was dropped
+int  TimelineUdfBegin(const UdfFrame* frame);
+void TimelineUdfEnd(const UdfFrame* frame, LONGLONG endTicks);
+int  TimelineCallbackBegin(const UdfCallback* cb);
+void TimelineCallbackEnd(const UdfCallback* cb, LONGLONG endTicks);
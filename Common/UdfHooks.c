@@ -0,0 +1,101 @@
+/*
+**  UdfHooks
+**
+**  Function id bookkeeping shared by the instrumentation modules.
+*/
+
+#include <windows.h>
+#include "UdfHooks.h"
+#include "CallTrace.h"
+#include "Timeline.h"
+#include "ThreadUsage.h"
+#include "Metrics.h"
+
+__declspec(thread) int tls_udfCurrent = UDF_NONE;
+__declspec(thread) int tls_udfDepth = 0;
+volatile LONG g_udfHooks = 0;
+
+static const wchar_t* g_udfModule = L"";
+static const wchar_t* g_udfNames[UDF_MAX_FUNCS];
+static const wchar_t* g_udfTypes[UDF_MAX_FUNCS];
+static int g_udfCount = 0;
+
+void UdfHooksInit(const wchar_t* module, const LPWSTR* rgFuncs, int rows, int columns)
+{
+    int i;
+    if (rows > UDF_MAX_FUNCS)
+        rows = UDF_MAX_FUNCS;
+    for (i = 0; i < rows; i++)
+    {
+        g_udfNames[i] = rgFuncs[i * columns];
+        g_udfTypes[i] = columns > 1 ? rgFuncs[i * columns + 1] : L"";
+    }
+    g_udfModule = module;
+    g_udfCount = rows;
+}
+
+const wchar_t* UdfModuleName(void)
+{
+    return g_udfModule;
+}
+
+const wchar_t* UdfFunctionName(int fn)
+{
+    if (fn >= 0 && fn < g_udfCount && g_udfNames[fn])
+        return g_udfNames[fn];
+    return L"(none)";
+}
+
+const wchar_t* UdfFunctionType(int fn)
+{
+    if (fn >= 0 && fn < g_udfCount && g_udfTypes[fn])
+        return g_udfTypes[fn];
+    return L"";
+}
+
+int UdfFunctionCount(void)
+{
+    return g_udfCount;
+}
+
+void UdfHooksEnter(UdfFrame* frame)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    frame->start = now.QuadPart;
+    if ((frame->hooks & UDF_HOOK_TIMELINE) && !TimelineUdfBegin(frame))
+        frame->hooks &= ~UDF_HOOK_TIMELINE;     // Not recorded, so no end event either
+}
+
+void UdfHooksLeave(UdfFrame* frame)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if (frame->hooks & UDF_HOOK_TRACE)
+        CallTraceRecord(frame, now.QuadPart);
+    if (frame->hooks & UDF_HOOK_TIMELINE)
+        TimelineUdfEnd(frame, now.QuadPart);
+    if ((frame->hooks & UDF_HOOK_USAGE) && frame->depth == 0)
+        ThreadUsageLeave(frame, now.QuadPart);
+    if (frame->hooks & UDF_HOOK_METRICS)
+        MetricsLeave(frame, now.QuadPart);
+}
+
+void UdfHooksCallbackBegin(UdfCallback* cb)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    cb->start = now.QuadPart;
+    if ((cb->hooks & UDF_HOOK_TIMELINE) && !TimelineCallbackBegin(cb))
+        cb->hooks &= ~UDF_HOOK_TIMELINE;
+}
+
+void UdfHooksCallbackEnd(UdfCallback* cb)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if (cb->hooks & UDF_HOOK_TIMELINE)
+        TimelineCallbackEnd(cb, now.QuadPart);
+    if (cb->hooks & UDF_HOOK_METRICS)
+        MetricsCallback(cb->via, now.QuadPart - cb->start);
+}
@@ -0,0 +1,145 @@
+/*
+**  UdfHooks
+**
+**  Per-call bookkeeping shared by both XLLs. Every exported UDF opens with
+**  UDF_ENTER(FN_name) and leaves through UDF_RETURN(value), which keeps the
+**  "function currently running on this thread" accurate across nested xlUDF
+**  calls. Instrumentation (allocation accounting and friends) reads it from
+**  there instead of each UDF passing its identity around.
+**
+**  Function ids are the row numbers of the module's rgFuncs table.
+**
+**  Per-call instrumentation (UdfHooksEnter/Leave) costs one flag test unless
+**  something has switched it on through g_udfHooks. The outermost frame on a
+**  thread also brackets an epoch (Epoch.h), so shared state retired while the
+**  UDF runs is not freed under it. Functions with a concurrency limit in
+**  rgFuncs (Governor.h) are admitted after the frame opens and release their
+**  slot before it closes, so recorded call times include any wait.
+**
+**  UDF_RETURN closes the frame before evaluating its argument, so return a
+**  local rather than a call whose work should be charged to the function.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "Epoch.h"
+#include "Governor.h"
+
+#define UDF_NONE        (-1)
+#define UDF_MAX_FUNCS   128
+
+// Bits of g_udfHooks: which instrumentation wants to see every call
+#define UDF_HOOK_TRACE      0x1     // CallTrace recorder
+#define UDF_HOOK_TIMELINE   0x2     // Timeline (Chrome trace) recorder
+#define UDF_HOOK_USAGE      0x4     // ThreadUsage, outermost calls only
+#define UDF_HOOK_METRICS    0x8     // Shared-memory metrics, every frame and callback
+
+// Entry point an Excel callback went through
+#define UDF_VIA_EXCEL12F        0   // Framework Excel12f
+#define UDF_VIA_EXCEL12         1   // SDK Excel12
+#define UDF_VIA_EXCEL12DIRECT   2   // MdCallBack12 called directly
+
+typedef struct UdfFrame
+{
+    int fn;
+    int prevFn;
+    int depth;                  // 0 for a call made by Excel, 1+ for nested xlUDF calls
+    int hooks;                  // g_udfHooks when the frame was opened
+    LONGLONG start;             // QueryPerformanceCounter at entry, when hooks are on
+    const void* const* args;    // Addresses of the UDF's parameters, in rgFuncs type order
+    int argCount;
+    Governor* governor;         // Concurrency governor of fn, if any
+    LONGLONG admitted;          // GovernorAcquire result (0: not governed)
+} UdfFrame;
+
+typedef struct UdfCallback
+{
+    int via;                    // UDF_VIA_*
+    int xlfn;
+    int hooks;
+    LONGLONG start;
+} UdfCallback;
+
+// Id of the UDF running on this thread (UDF_NONE outside any UDF)
+extern __declspec(thread) int tls_udfCurrent;
+extern __declspec(thread) int tls_udfDepth;
+extern volatile LONG g_udfHooks;
+
+// Records the module name and the rgFuncs table so ids can be turned into names
+void UdfHooksInit(const wchar_t* module, const LPWSTR* rgFuncs, int rows, int columns);
+const wchar_t* UdfModuleName(void);
+const wchar_t* UdfFunctionName(int fn);
+const wchar_t* UdfFunctionType(int fn);     // rgFuncs type text, e.g. L"BBB$"
+int UdfFunctionCount(void);
+
+// Slow paths, only taken while some instrumentation is switched on
+void UdfHooksEnter(UdfFrame* frame);
+void UdfHooksLeave(UdfFrame* frame);
+void UdfHooksCallbackBegin(UdfCallback* cb);
+void UdfHooksCallbackEnd(UdfCallback* cb);
+
+static __forceinline void UdfEnterArgs(UdfFrame* frame, int fn, const void* const* args, int argCount)
+{
+    frame->fn = fn;
+    frame->prevFn = tls_udfCurrent;
+    frame->depth = tls_udfDepth++;
+    if (frame->depth == 0)
+        EpochEnter();
+    frame->hooks = g_udfHooks;
+    frame->args = args;
+    frame->argCount = argCount;
+    tls_udfCurrent = fn;
+    if (frame->hooks)
+        UdfHooksEnter(frame);
+    frame->governor = g_governors[fn];
+    frame->admitted = frame->governor && !frame->governor->deferred ? GovernorAcquire(frame->governor) : 0;
+}
+
+static __forceinline void UdfEnter(UdfFrame* frame, int fn)
+{
+    UdfEnterArgs(frame, fn, NULL, 0);
+}
+
+static __forceinline void UdfLeave(UdfFrame* frame)
+{
+    if (frame->admitted)
+        GovernorRelease(frame->governor, frame->admitted);
+    if (frame->hooks)
+        UdfHooksLeave(frame);
+    tls_udfCurrent = frame->prevFn;
+    tls_udfDepth = frame->depth;
+    if (frame->depth == 0)
+        EpochLeave();
+}
+
+// Bracket a callback into Excel made from a UDF:
+//     UdfCallback cb; UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
+//     rc = Excel12f(xlUDF, ...);
+//     UdfCallbackEnd(&cb);
+static __forceinline void UdfCallbackBegin(UdfCallback* cb, int via, int xlfn)
+{
+    cb->via = via;
+    cb->xlfn = xlfn;
+    cb->hooks = g_udfHooks;
+    if (cb->hooks)
+        UdfHooksCallbackBegin(cb);
+}
+
+static __forceinline void UdfCallbackEnd(UdfCallback* cb)
+{
+    if (cb->hooks)
+        UdfHooksCallbackEnd(cb);
+}
+
+// UDF_RETURN leaves the frame before its return statement, so value must already be computed: a
+// local (or a field of one) or a constant, never a call such as XlNewErr(...), which would then
+// allocate outside the function's frame
+#define UDF_ENTER(fn)       UdfFrame udfFrame; UdfEnter(&udfFrame, (fn))
+#define UDF_RETURN(value)   do { UdfLeave(&udfFrame); return (value); } while (0)
+
+// UDF_ENTER for functions with parameters: pass their addresses, e.g. UDF_ENTER_ARGS(FN_f, &x, &y),
+// so recorders can serialise them using the function's rgFuncs type text
+#define UDF_ENTER_ARGS(fn, ...) \
+    const void* const udfArgs[] = { __VA_ARGS__ }; \
+    UdfFrame udfFrame; UdfEnterArgs(&udfFrame, (fn), udfArgs, (int)(sizeof(udfArgs) / sizeof(udfArgs[0])))
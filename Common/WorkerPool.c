@@ -0,0 +1,535 @@
+/*
+**  WorkerPool
+**
+**  Worker processes and their request rings. See WorkerPool.h.
+**
+**  The segment holds a header, one control block per worker and then the
+**  rings. Callers claim a position with one interlocked add on the ring's
+**  head, so any number of calc threads share a ring without a lock; only the
+**  worker advances the tail. Everything else a caller needs (the process
+**  handle, the semaphores, the restart state) stays in this process.
+**
+**  A restart is done by the first caller that finds the worker process gone:
+**  it marks the worker restarting, waits for the other callers to leave (each
+**  of them notices within WORKERPOOL_POLL_MS and fails its call), resets the
+**  ring and starts a new process on it.
+*/
+
+#include <windows.h>
+#include <math.h>
+#include <string.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "UdfHooks.h"
+#include "Governor.h"
+#include "XlHelpers.h"
+#include "WorkerPool.h"
+
+#define WORKERPOOL_MAGIC        0x4B524F57u     // "WORK"
+#define WORKERPOOL_COLUMNS      9
+#define WORKERPOOL_IDLE_MS      100             // A sleeping worker checks Excel is still running
+
+#define WORKER_STOPPED          0
+#define WORKER_RUNNING          1
+#define WORKER_RESTARTING       2
+
+#define WORKER_OK               0
+#define WORKER_DIED             1
+
+typedef struct __declspec(align(64)) WorkerSegment
+{
+    UINT32 magic;
+    UINT32 workers;
+    UINT32 cells;
+    UINT32 hostPid;
+} WorkerSegment;
+
+// One request: written by the caller, answered in place by the worker
+typedef struct __declspec(align(64)) WorkerCell
+{
+    volatile LONGLONG seq;
+    INT32 fn;
+    INT32 count;
+    double args[WORKERPOOL_MAX_ARGS];
+    double result;
+} WorkerCell;
+
+typedef struct __declspec(align(64)) WorkerControl
+{
+    volatile LONGLONG head;         // Next position claimed by a caller
+    BYTE callerLine[56];
+
+    // Written by the worker
+    volatile LONGLONG tail;         // Next position it serves
+    volatile LONGLONG served;
+    volatile LONGLONG batches;
+    volatile LONG sleeping;         // Waiting on the doorbell
+    volatile LONG waiters;          // Callers waiting on the done semaphore
+    volatile LONG stop;             // Set by WorkerPoolClose
+    UINT32 pid;
+} WorkerControl;
+
+// This process's view of one worker
+typedef struct __declspec(align(64)) WorkerSlot
+{
+    volatile LONG state;
+    volatile LONG users;            // Callers between checking the state and leaving
+    HANDLE process;
+    HANDLE doorbell;
+    HANDLE done;
+    DWORD pid;
+    volatile LONGLONG calls;
+    volatile LONGLONG failed;       // In flight when the worker died
+    LONGLONG restarts;
+    LONGLONG servedBefore;          // By earlier processes of this worker
+    LONGLONG batchesBefore;
+} WorkerSlot;
+
+static WorkerSlot g_workerSlots[WORKERPOOL_MAX_WORKERS];
+static int g_workerCount = 0;
+static volatile LONG g_workerNext = 0;
+static volatile LONGLONG g_workerLocal = 0;    // Remote calls computed here, no worker running
+static BYTE g_workerRemote[UDF_MAX_FUNCS];
+static wchar_t g_workerSegmentPath[MAX_PATH];
+static wchar_t g_workerCommand[2 * MAX_PATH + 128];     // With %d for the worker index
+static HANDLE g_workerFile = INVALID_HANDLE_VALUE;
+static HANDLE g_workerMapping = NULL;
+static BYTE* g_workerView = NULL;
+static SIZE_T g_workerViewBytes = 0;
+
+static WorkerControl* WorkerControlAt(int i)
+{
+    return (WorkerControl*)(g_workerView + sizeof(WorkerSegment)) + i;
+}
+
+static WorkerCell* WorkerRing(int i)
+{
+    const WorkerSegment* s = (const WorkerSegment*)g_workerView;
+    WorkerCell* rings = (WorkerCell*)(g_workerView + sizeof(WorkerSegment) + s->workers * sizeof(WorkerControl));
+    return rings + (SIZE_T)i * s->cells;
+}
+
+static SIZE_T WorkerSegmentBytes(int workers)
+{
+    return sizeof(WorkerSegment) + workers * (sizeof(WorkerControl) + WORKERPOOL_RING_CELLS * sizeof(WorkerCell));
+}
+
+// Semaphores are named after Excel's process id, so a worker finds them from the segment header
+static HANDLE WorkerSemaphore(UINT32 hostPid, int i, const wchar_t* role)
+{
+    wchar_t name[96];
+    swprintf_s(name, _countof(name), L"Local\\XllWorkers-%u-%d-%ls", hostPid, i, role);
+    return CreateSemaphoreW(NULL, 0, 0x10000, name);
+}
+
+static BOOL WorkerMap(DWORD disposition, SIZE_T bytes)
+{
+    LARGE_INTEGER size;
+
+    g_workerFile = CreateFileW(g_workerSegmentPath, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g_workerFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    if (!bytes && GetFileSizeEx(g_workerFile, &size))
+        bytes = (SIZE_T)size.QuadPart;
+    if (bytes < sizeof(WorkerSegment))
+        return FALSE;
+    g_workerMapping = CreateFileMappingW(g_workerFile, NULL, PAGE_READWRITE,
+        (DWORD)((ULONGLONG)bytes >> 32), (DWORD)((ULONGLONG)bytes & 0xFFFFFFFF), NULL);
+    if (g_workerMapping)
+        g_workerView = (BYTE*)MapViewOfFile(g_workerMapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+    g_workerViewBytes = bytes;
+    return g_workerView != NULL;
+}
+
+static void WorkerUnmap(void)
+{
+    if (g_workerView)
+        UnmapViewOfFile(g_workerView);
+    if (g_workerMapping)
+        CloseHandle(g_workerMapping);
+    if (g_workerFile != INVALID_HANDLE_VALUE)
+        CloseHandle(g_workerFile);
+    g_workerView = NULL;
+    g_workerMapping = NULL;
+    g_workerFile = INVALID_HANDLE_VALUE;
+}
+
+// Empties worker i's ring; only while no caller and no process uses it
+static void WorkerReset(int i)
+{
+    WorkerControl* c = WorkerControlAt(i);
+    WorkerCell* ring = WorkerRing(i);
+    int k;
+
+    ZeroMemory(c, sizeof(WorkerControl));
+    for (k = 0; k < WORKERPOOL_RING_CELLS; k++)
+        ring[k].seq = k;
+    MemoryBarrier();
+}
+
+static BOOL WorkerStart(int i)
+{
+    WorkerSlot* w = &g_workerSlots[i];
+    wchar_t command[_countof(g_workerCommand) + 16];
+    STARTUPINFOW si;
+    PROCESS_INFORMATION pi;
+
+    swprintf_s(command, _countof(command), g_workerCommand, i);
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    if (!CreateProcessW(NULL, command, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi))
+        return FALSE;
+    if (pi.hThread)
+        CloseHandle(pi.hThread);
+    w->process = pi.hProcess;
+    w->pid = pi.dwProcessId;
+    return TRUE;
+}
+
+static BOOL WorkerDead(WorkerSlot* w)
+{
+    return ReadAcquire(&w->state) != WORKER_RUNNING || WaitForSingleObject(w->process, 0) == WAIT_OBJECT_0;
+}
+
+// Called by the caller that found worker i dead, after it left the worker
+static void WorkerRestart(int i)
+{
+    WorkerSlot* w = &g_workerSlots[i];
+    WorkerControl* c = WorkerControlAt(i);
+
+    if (InterlockedCompareExchange(&w->state, WORKER_RESTARTING, WORKER_RUNNING) != WORKER_RUNNING)
+        return;                 // Another caller is restarting it, or the pool is closing
+    while (ReadAcquire(&w->users) != 0)
+        Sleep(0);
+
+    TerminateProcess(w->process, 1);    // In case it only stopped answering
+    CloseHandle(w->process);
+    w->process = NULL;
+    w->servedBefore += c->served;
+    w->batchesBefore += c->batches;
+    w->restarts++;
+    WorkerReset(i);
+    WriteRelease(&w->state, WorkerStart(i) ? WORKER_RUNNING : WORKER_STOPPED);
+}
+
+int WorkerPoolInit(const LPWSTR* rgFuncs, int rows, int columns, const XCHAR* xllPath, const wchar_t* entry)
+{
+    WorkerSegment* s;
+    wchar_t env[16], temp[MAX_PATH], dll[MAX_PATH];
+    int i, count, remote = 0;
+    DWORD pid = GetCurrentProcessId();
+
+    if (g_workerCount || !xllPath || columns <= GOVERNOR_COLUMN)
+        return g_workerCount;
+    if (!GetEnvironmentVariableW(L"XLL_WORKERS", env, (DWORD)_countof(env)))
+        return 0;
+    count = (int)wcstol(env, NULL, 10);
+    if (count <= 0)
+        return 0;
+    if (count > WORKERPOOL_MAX_WORKERS)
+        count = WORKERPOOL_MAX_WORKERS;
+    if (rows > UDF_MAX_FUNCS)
+        rows = UDF_MAX_FUNCS;
+    for (i = 0; i < rows; i++)
+    {
+        const wchar_t* spec = rgFuncs[i * columns + GOVERNOR_COLUMN];
+        g_workerRemote[i] = (BYTE)(spec && wcsstr(spec, L"remote") != NULL);
+        remote += g_workerRemote[i];
+    }
+    if (!remote)
+        return 0;
+
+    // The segment lives in a temp file named after this process
+    if (!GetTempPathW((DWORD)_countof(temp), temp) || xllPath[0] >= _countof(dll))
+        return 0;
+    wmemcpy(dll, &xllPath[1], xllPath[0]);
+    dll[xllPath[0]] = 0;
+    swprintf_s(g_workerSegmentPath, _countof(g_workerSegmentPath), L"%lsXllWorkers-%lu.bin", temp, (unsigned long)pid);
+    swprintf_s(g_workerCommand, _countof(g_workerCommand), L"rundll32.exe \"%ls\",%ls \"%ls\" %%d",
+        dll, entry, g_workerSegmentPath);
+    if (!WorkerMap(OPEN_ALWAYS, WorkerSegmentBytes(count)))
+    {
+        WorkerUnmap();
+        return 0;
+    }
+    s = (WorkerSegment*)g_workerView;
+    s->workers = (UINT32)count;
+    s->cells = WORKERPOOL_RING_CELLS;
+    s->hostPid = (UINT32)pid;
+    WriteRelease(&s->magic, WORKERPOOL_MAGIC);
+
+    for (i = 0; i < count; i++)
+    {
+        WorkerSlot* w = &g_workerSlots[i];
+        ZeroMemory(w, sizeof(WorkerSlot));
+        WorkerReset(i);
+        w->doorbell = WorkerSemaphore((UINT32)pid, i, L"doorbell");
+        w->done = WorkerSemaphore((UINT32)pid, i, L"done");
+        if (w->doorbell && w->done && WorkerStart(i))
+            w->state = WORKER_RUNNING;
+    }
+    g_workerCount = count;
+    return count;
+}
+
+void WorkerPoolClose(void)
+{
+    int i, count = g_workerCount;
+
+    if (!count)
+        return;
+    for (i = 0; i < count; i++)
+        InterlockedExchange(&g_workerSlots[i].state, WORKER_STOPPED);
+    for (i = 0; i < count; i++)
+    {
+        WorkerSlot* w = &g_workerSlots[i];
+        while (ReadAcquire(&w->users) != 0)
+            Sleep(0);
+        if (w->process)
+        {
+            InterlockedExchange(&WorkerControlAt(i)->stop, 1);
+            ReleaseSemaphore(w->doorbell, 1, NULL);
+            if (WaitForSingleObject(w->process, 1000) != WAIT_OBJECT_0)
+                TerminateProcess(w->process, 1);
+            CloseHandle(w->process);
+            w->process = NULL;
+        }
+        if (w->doorbell)
+            CloseHandle(w->doorbell);
+        if (w->done)
+            CloseHandle(w->done);
+        w->doorbell = NULL;
+        w->done = NULL;
+    }
+    g_workerCount = 0;
+    WorkerUnmap();
+    DeleteFileW(g_workerSegmentPath);
+}
+
+static int WorkerCall(int i, int fn, const double* args, int count, double* result)
+{
+    WorkerSlot* w = &g_workerSlots[i];
+    WorkerControl* c = WorkerControlAt(i);
+    LONGLONG pos = InterlockedExchangeAdd64(&c->head, 1);
+    WorkerCell* cell = &WorkerRing(i)[pos & (WORKERPOOL_RING_CELLS - 1)];
+    int spin;
+
+    // A full ring: the caller a lap ahead has not collected its result yet
+    while (ReadAcquire64(&cell->seq) != pos)
+    {
+        if (WorkerDead(w))
+            return WORKER_DIED;
+        Sleep(0);
+    }
+    cell->fn = fn;
+    cell->count = count;
+    memcpy(cell->args, args, count * sizeof(double));
+    WriteRelease64(&cell->seq, pos + 1);
+
+    // Ring the doorbell only if the worker went to sleep before seeing the request
+    MemoryBarrier();
+    if (ReadAcquire(&c->sleeping))
+        ReleaseSemaphore(w->doorbell, 1, NULL);
+
+    for (spin = 0; spin < WORKERPOOL_SPIN && ReadAcquire64(&cell->seq) != pos + 2; spin++)
+        YieldProcessor();
+    while (ReadAcquire64(&cell->seq) != pos + 2)
+    {
+        InterlockedIncrement(&c->waiters);
+        if (ReadAcquire64(&cell->seq) != pos + 2)
+            WaitForSingleObject(w->done, WORKERPOOL_POLL_MS);
+        InterlockedDecrement(&c->waiters);
+        if (ReadAcquire64(&cell->seq) != pos + 2 && WorkerDead(w))
+            return WORKER_DIED;
+    }
+    *result = cell->result;
+    WriteRelease64(&cell->seq, pos + WORKERPOOL_RING_CELLS);
+    return WORKER_OK;
+}
+
+int WorkerPoolCallNum(int fn, const double* args, int count, double* result)
+{
+    int i, k, start;
+
+    if (!g_workerCount || fn < 0 || fn >= UDF_MAX_FUNCS || !g_workerRemote[fn] || count > WORKERPOOL_MAX_ARGS)
+        return 0;
+
+    // Calls are dealt round the workers; one that is restarting is skipped
+    start = (int)((ULONG)InterlockedIncrement(&g_workerNext) % (ULONG)g_workerCount);
+    for (k = 0; k < g_workerCount; k++)
+    {
+        WorkerSlot* w;
+        int rc;
+
+        i = (start + k) % g_workerCount;
+        w = &g_workerSlots[i];
+        InterlockedIncrement(&w->users);
+        if (ReadAcquire(&w->state) != WORKER_RUNNING)
+        {
+            InterlockedDecrement(&w->users);
+            continue;
+        }
+        InterlockedIncrement64(&w->calls);
+        rc = WorkerCall(i, fn, args, count, result);
+        InterlockedDecrement(&w->users);
+        if (rc == WORKER_DIED)
+        {
+            InterlockedIncrement64(&w->failed);
+            WorkerRestart(i);
+            return 0;       // No answer: the caller computes it here instead
+        }
+        return 1;
+    }
+    InterlockedIncrement64(&g_workerLocal);
+    return 0;
+}
+
+/*
+** Worker process side
+*/
+static BOOL WorkerParseCommand(const wchar_t* cmdLine, int* index)
+{
+    const wchar_t* p = cmdLine;
+    size_t n = 0;
+
+    while (*p == L' ')
+        p++;
+    if (*p++ != L'"')
+        return FALSE;
+    while (*p && *p != L'"' && n < _countof(g_workerSegmentPath) - 1)
+        g_workerSegmentPath[n++] = *p++;
+    g_workerSegmentPath[n] = 0;
+    if (*p++ != L'"')
+        return FALSE;
+    *index = (int)wcstol(p, NULL, 10);
+    return n > 0;
+}
+
+int WorkerPoolServe(const wchar_t* cmdLine, WorkerKernel kernel)
+{
+    WorkerSegment* s;
+    WorkerControl* c;
+    WorkerCell* ring;
+    HANDLE doorbell, done, host;
+    LONGLONG tail;
+    int index, idle = 0;
+
+    if (!cmdLine || !WorkerParseCommand(cmdLine, &index) || !WorkerMap(OPEN_ALWAYS, 0))
+        return 0;
+    s = (WorkerSegment*)g_workerView;
+    if (ReadAcquire(&s->magic) != WORKERPOOL_MAGIC || index < 0 || index >= (int)s->workers ||
+        WorkerSegmentBytes((int)s->workers) > g_workerViewBytes)
+    {
+        WorkerUnmap();
+        return 0;
+    }
+    c = WorkerControlAt(index);
+    ring = WorkerRing(index);
+    doorbell = WorkerSemaphore(s->hostPid, index, L"doorbell");
+    done = WorkerSemaphore(s->hostPid, index, L"done");
+    host = OpenProcess(SYNCHRONIZE, FALSE, s->hostPid);
+    c->pid = (UINT32)GetCurrentProcessId();
+    tail = c->tail;
+
+    while (doorbell && done && host)
+    {
+        WorkerCell* cell = &ring[tail & (WORKERPOOL_RING_CELLS - 1)];
+        LONG waiters;
+        LONGLONG n = 0;
+
+        // Serve every request that is ready, then wake the callers once
+        while (ReadAcquire64(&cell->seq) == tail + 1)
+        {
+            int count = cell->count < 0 ? 0 : cell->count > WORKERPOOL_MAX_ARGS ? WORKERPOOL_MAX_ARGS : cell->count;
+            double result;
+            if (!kernel(cell->fn, cell->args, count, &result))
+                result = NAN;
+            cell->result = result;
+            WriteRelease64(&cell->seq, tail + 2);
+            tail++;
+            n++;
+            cell = &ring[tail & (WORKERPOOL_RING_CELLS - 1)];
+        }
+        if (n)
+        {
+            WriteRelease64(&c->tail, tail);
+            WriteRelease64(&c->served, c->served + n);
+            WriteRelease64(&c->batches, c->batches + 1);
+            waiters = ReadAcquire(&c->waiters);
+            if (waiters > 0)
+                ReleaseSemaphore(done, waiters, NULL);
+            idle = 0;
+            continue;
+        }
+        if (ReadAcquire(&c->stop))
+            break;
+        if (++idle < WORKERPOOL_SPIN)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        // Callers see 'sleeping' before they decide not to ring
+        InterlockedExchange(&c->sleeping, 1);
+        if (ReadAcquire64(&cell->seq) != tail + 1 && !ReadAcquire(&c->stop) &&
+            WaitForSingleObject(doorbell, WORKERPOOL_IDLE_MS) == WAIT_TIMEOUT &&
+            WaitForSingleObject(host, 0) == WAIT_OBJECT_0)
+            break;              // Excel has gone
+        WriteRelease(&c->sleeping, 0);
+        idle = 0;
+    }
+
+    if (host)
+        CloseHandle(host);
+    if (doorbell)
+        CloseHandle(doorbell);
+    if (done)
+        CloseHandle(done);
+    WorkerUnmap();
+    return 1;
+}
+
+LPXLOPER12 WorkerPoolTable(void)
+{
+    static const wchar_t* header[WORKERPOOL_COLUMNS] = {
+        L"Worker", L"Pid", L"State", L"Calls", L"Served", L"Batches", L"MeanBatch", L"Restarts", L"Failed"
+    };
+    static const wchar_t* states[3] = { L"stopped", L"running", L"restarting" };
+    LPXLOPER12 table = XlNewMulti(g_workerCount + 2, WORKERPOOL_COLUMNS);
+    LPXLOPER12 cells;
+    int i, j;
+
+    if (!table)
+        return XlNewErr(xlerrNA);
+    for (j = 0; j < WORKERPOOL_COLUMNS; j++)
+        XlSetStr(&table->val.array.lparray[j], header[j]);
+    for (i = 0; i < g_workerCount; i++)
+    {
+        const WorkerSlot* w = &g_workerSlots[i];
+        const WorkerControl* c = WorkerControlAt(i);
+        LONG state = ReadAcquire(&w->state);
+        double served = (double)(w->servedBefore + ReadAcquire64(&c->served));
+        double batches = (double)(w->batchesBefore + ReadAcquire64(&c->batches));
+        cells = &table->val.array.lparray[(i + 1) * WORKERPOOL_COLUMNS];
+        XlSetNum(&cells[0], (double)i);
+        XlSetNum(&cells[1], (double)w->pid);
+        XlSetStr(&cells[2], states[state >= 0 && state <= 2 ? state : 0]);
+        XlSetNum(&cells[3], (double)ReadAcquire64(&w->calls));
+        XlSetNum(&cells[4], served);
+        XlSetNum(&cells[5], batches);
+        XlSetNum(&cells[6], batches > 0.0 ? served / batches : 0.0);
+        XlSetNum(&cells[7], (double)w->restarts);
+        XlSetNum(&cells[8], (double)ReadAcquire64(&w->failed));
+    }
+
+    // Remote calls that found no worker running and computed in Excel
+    cells = &table->val.array.lparray[(g_workerCount + 1) * WORKERPOOL_COLUMNS];
+    XlSetStr(&cells[0], L"InProcess");
+    XlSetStr(&cells[1], L"");
+    XlSetStr(&cells[2], L"");
+    XlSetNum(&cells[3], (double)ReadAcquire64(&g_workerLocal));
+    for (j = 4; j < WORKERPOOL_COLUMNS; j++)
+        XlSetStr(&cells[j], L"");
+    return table;
+}
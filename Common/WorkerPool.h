@@ -0,0 +1,68 @@
+/*
+**  WorkerPool
+**
+**  Runs selected kernels in worker processes instead of on Excel's calc
+**  threads. A crash or leak in a kernel then takes down a worker, not Excel,
+**  and the worker is restarted on the next call.
+**
+**  Each worker is a rundll32 process running the XLL's worker entry point
+**      rundll32.exe "<xll>",<entry> "<segment>" <index>
+**  which calls WorkerPoolServe. The XLL and its workers share one mapped
+**  segment (a file in the temp directory). Every worker has a ring of request
+**  cells there, and calc threads write their arguments straight into a cell.
+**  The worker writes the result back into the same cell, so nothing is copied
+**  through a second buffer. Each cell's sequence number says whose turn it is:
+**      pos                  free for the caller that claimed position pos
+**      pos + 1              request ready for the worker
+**      pos + 2              result ready for the caller
+**      pos + capacity       released by the caller, free for the next lap
+**  A worker drains every ready cell before it signals completion, so a burst
+**  of calls costs one wake-up (a batch). Between bursts it sleeps on a
+**  doorbell semaphore, which callers only ring while it is asleep.
+**
+**  When a worker process has died, the caller that notices restarts it. The
+**  calls that were in flight on it return 0 and compute locally, as do calls
+**  made while no worker is running, so a dead worker costs time, not results.
+**
+**  Functions are forwarded when their rgFuncs policy column (GOVERNOR_COLUMN)
+**  has the "remote" flag, e.g. L"auto,pure,remote", and XLL_WORKERS gives the
+**  number of workers. Without XLL_WORKERS everything runs in process.
+**  Only numeric kernels (doubles in, double out) can be forwarded.
+**
+**  Usage, inside a UDF:
+**      double args[2] = { x, y }, result;
+**      if (!WorkerPoolCallNum(FN_cDoubleInner, args, 2, &result))
+**          result = ...;                   // Not forwarded: compute here
+**  and in the worker entry point:
+**      WorkerPoolServe(lpszCmdLine, Kernel);   // Kernel(fn, args, count, &result)
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define WORKERPOOL_MAX_WORKERS  16
+#define WORKERPOOL_MAX_ARGS     8
+#define WORKERPOOL_RING_CELLS   256     // Request cells per worker (a power of two)
+#define WORKERPOOL_SPIN         2000    // Polls before a caller or an idle worker sleeps
+#define WORKERPOOL_POLL_MS      20      // How often a sleeping caller checks its worker is alive
+
+// Computes fn(args) in a worker; returns 0 if fn is not a kernel of this XLL
+typedef int (*WorkerKernel)(int fn, const double* args, int count, double* result);
+
+// Reads the "remote" flags and starts XLL_WORKERS workers running 'entry' of the XLL at
+// 'xllPath' (length-prefixed, as from xlGetName); returns the number of workers started
+int  WorkerPoolInit(const LPWSTR* rgFuncs, int rows, int columns, const XCHAR* xllPath, const wchar_t* entry);
+void WorkerPoolClose(void);
+
+// Returns 1 with *result set when a worker ran the call; 0 when the caller must compute
+// locally (not forwarded, or the worker died before answering)
+int  WorkerPoolCallNum(int fn, const double* args, int count, double* result);
+
+// Worker process side: serves the ring named by the command line until the XLL
+// closes the pool or its process exits
+int  WorkerPoolServe(const wchar_t* cmdLine, WorkerKernel kernel);
+
+// One row per worker: process id, state, calls, batches, mean batch, restarts and failed calls
+LPXLOPER12 WorkerPoolTable(void);
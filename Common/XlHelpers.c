@@ -0,0 +1,331 @@
+/*
+**  XlHelpers
+**
+**  XLOPER12 result builders shared by both XLLs.
+*/
+
+#include <windows.h>
+#include <wchar.h>
+#include "XLCALL.H"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define XL_HAVE_SSE2 1
+#endif
+
+static LPXLOPER12 XlNewOper(DWORD type)
+{
+    LPXLOPER12 x = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
+    if (x)
+        x->xltype = type | xlbitDLLFree;
+    return x;
+}
+
+LPXLOPER12 XlNewNum(double value)
+{
+    LPXLOPER12 x = XlNewOper(xltypeNum);
+    if (x)
+        x->val.num = value;
+    return x;
+}
+
+LPXLOPER12 XlNewStr(const wchar_t* text)
+{
+    LPXLOPER12 x = XlNewOper(xltypeStr);
+    if (!x)
+        return NULL;
+    if (!XlSetStr(x, text))
+    {
+        GlobalFree(x);
+        return NULL;
+    }
+    x->xltype |= xlbitDLLFree;
+    return x;
+}
+
+LPXLOPER12 XlNewErr(int err)
+{
+    LPXLOPER12 x = XlNewOper(xltypeErr);
+    if (x)
+        x->val.err = err;
+    return x;
+}
+
+LPXLOPER12 XlNewBool(BOOL value)
+{
+    LPXLOPER12 x = XlNewOper(xltypeBool);
+    if (x)
+        x->val.xbool = value ? TRUE : FALSE;
+    return x;
+}
+
+LPXLOPER12 XlNewMulti(int rows, int columns)
+{
+    LPXLOPER12 x;
+    int i, n = rows * columns;
+
+    if (rows < 1 || columns < 1)
+        return NULL;
+    x = XlNewOper(xltypeMulti);
+    if (!x)
+        return NULL;
+    x->val.array.lparray = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, (size_t)n * sizeof(XLOPER12));
+    if (!x->val.array.lparray)
+    {
+        GlobalFree(x);
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+        x->val.array.lparray[i].xltype = xltypeNil;
+    x->val.array.rows = rows;
+    x->val.array.columns = columns;
+    return x;
+}
+
+LPXLOPER12 XlNewPackedMulti(int rows, int columns, size_t chars)
+{
+    LPXLOPER12 x;
+    int i, n = rows * columns;
+
+    if (rows < 1 || columns < 1)
+        return NULL;
+    x = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, (size_t)(n + 1) * sizeof(XLOPER12) + chars * sizeof(XCHAR));
+    if (!x)
+        return NULL;
+    x->xltype = xltypeMulti | xlbitDLLFree;
+    x->val.array.lparray = x + 1;
+    x->val.array.rows = rows;
+    x->val.array.columns = columns;
+    for (i = 0; i < n; i++)
+        x->val.array.lparray[i].xltype = xltypeNil;
+    return x;
+}
+
+int XlIsPacked(const XLOPER12* x)
+{
+    return (x->xltype & ~(xlbitDLLFree | xlbitXLFree)) == xltypeMulti && x->val.array.lparray == x + 1;
+}
+
+XCHAR* XlPackedArena(LPXLOPER12 x)
+{
+    return (XCHAR*)(x->val.array.lparray + x->val.array.rows * x->val.array.columns);
+}
+
+// Writes a + b (cut at XL_MAX_STR) at *arena and advances it past the terminator
+void XlSetPackedStr2(LPXLOPER12 e, XCHAR** arena, const XCHAR* a, size_t alen, const XCHAR* b, size_t blen)
+{
+    XCHAR* s = *arena;
+    if (alen > XL_MAX_STR)
+        alen = XL_MAX_STR;
+    if (blen > XL_MAX_STR - alen)
+        blen = XL_MAX_STR - alen;
+    s[0] = (XCHAR)(alen + blen);
+    XlCopyChars(&s[1], a, alen);
+    XlCopyChars(&s[1 + alen], b, blen);
+    s[1 + alen + blen] = 0;
+    e->xltype = xltypeStr;
+    e->val.str = s;
+    *arena = s + alen + blen + 2;
+}
+
+void XlCopyChars(XCHAR* dst, const XCHAR* src, size_t n)
+{
+    BYTE* d = (BYTE*)dst;
+    const BYTE* s = (const BYTE*)src;
+    size_t bytes = n * sizeof(XCHAR), i;
+
+#ifdef XL_HAVE_SSE2
+    // Typical cell strings: unaligned 16-byte moves, the last one overlapping,
+    // without a call into the CRT; long strings go to memcpy
+    if (bytes >= 16 && bytes <= 4096)
+    {
+        for (i = 0; i + 16 <= bytes; i += 16)
+            _mm_storeu_si128((__m128i*)(d + i), _mm_loadu_si128((const __m128i*)(s + i)));
+        if (i < bytes)
+            _mm_storeu_si128((__m128i*)(d + bytes - 16), _mm_loadu_si128((const __m128i*)(s + bytes - 16)));
+        return;
+    }
+#endif
+    if (bytes < 16)
+    {
+        for (i = 0; i < n; i++)
+            dst[i] = src[i];
+        return;
+    }
+    memcpy(d, s, bytes);
+}
+
+void XlSetNum(LPXLOPER12 x, double value)
+{
+    x->xltype = xltypeNum;
+    x->val.num = value;
+}
+
+int XlSetStrN(LPXLOPER12 x, const wchar_t* text, size_t len)
+{
+    wchar_t* s;
+    if (len > XL_MAX_STR)
+        len = XL_MAX_STR;
+    s = (wchar_t*)GlobalAlloc(GMEM_FIXED, (len + 2) * sizeof(wchar_t));
+    if (!s)
+    {
+        x->xltype = xltypeErr;
+        x->val.err = xlerrNA;
+        return 0;
+    }
+    s[0] = (wchar_t)len;
+    if (len)
+        memcpy(&s[1], text, len * sizeof(wchar_t));
+    s[len + 1] = L'\0';
+    x->xltype = xltypeStr;
+    x->val.str = s;
+    return 1;
+}
+
+int XlSetStr(LPXLOPER12 x, const wchar_t* text)
+{
+    return XlSetStrN(x, text ? text : L"", text ? wcslen(text) : 0);
+}
+
+double XlArgNum(const XLOPER12* x, double fallback)
+{
+    if (!x)
+        return fallback;
+    if ((x->xltype & xltypeNum) == xltypeNum)
+        return x->val.num;
+    if ((x->xltype & xltypeInt) == xltypeInt)
+        return (double)x->val.w;
+    if ((x->xltype & xltypeBool) == xltypeBool)
+        return x->val.xbool ? 1.0 : 0.0;
+    return fallback;
+}
+
+size_t XlArgStr(const XLOPER12* x, wchar_t* buffer, size_t capacity)
+{
+    size_t len = 0;
+    if (capacity == 0)
+        return 0;
+    if (x && (x->xltype & xltypeStr) == xltypeStr && x->val.str)
+    {
+        len = (size_t)x->val.str[0];
+        if (len > capacity - 1)
+            len = capacity - 1;
+        memcpy(buffer, &x->val.str[1], len * sizeof(wchar_t));
+    }
+    buffer[len] = L'\0';
+    return len;
+}
+
+static int XlIsMulti(const XLOPER12* x)
+{
+    return x && (x->xltype & ~(xlbitDLLFree | xlbitXLFree)) == xltypeMulti && x->val.array.lparray;
+}
+
+int XlArgRows(const XLOPER12* x)
+{
+    return XlIsMulti(x) ? x->val.array.rows : 1;
+}
+
+int XlArgColumns(const XLOPER12* x)
+{
+    return XlIsMulti(x) ? x->val.array.columns : 1;
+}
+
+const XLOPER12* XlArgCell(const XLOPER12* x, int row, int column)
+{
+    if (!XlIsMulti(x))
+        return x;
+    if (x->val.array.rows == 1 && x->val.array.columns == 1)
+        return &x->val.array.lparray[0];
+    if (row >= x->val.array.rows || column >= x->val.array.columns)
+        return NULL;
+    return &x->val.array.lparray[row * x->val.array.columns + column];
+}
+
+size_t XlCellStr(const XLOPER12* x, const XCHAR** chars)
+{
+    if (x && (x->xltype & xltypeStr) == xltypeStr && x->val.str)
+    {
+        *chars = &x->val.str[1];
+        return (size_t)x->val.str[0];
+    }
+    *chars = L"";
+    return 0;
+}
+
+BOOL XlCallerCell(IDSHEET* sheet, RW* row, COL* column)
+{
+    XLOPER12 caller;
+    BOOL found = FALSE;
+
+    if (Excel12(xlfCaller, &caller, 0) != xlretSuccess)
+        return FALSE;
+    if ((caller.xltype & xltypeSRef) == xltypeSRef)
+    {
+        XLOPER12 name, id;
+
+        // A single-cell reference is on the sheet being calculated: name it, then look the name up
+        *sheet = 0;
+        if (Excel12(xlSheetNm, &name, 1, &caller) == xlretSuccess)
+        {
+            if (Excel12(xlSheetId, &id, 1, &name) == xlretSuccess)
+            {
+                if ((id.xltype & xltypeRef) == xltypeRef)
+                    *sheet = id.val.mref.idSheet;
+                Excel12(xlFree, 0, 1, &id);
+            }
+            Excel12(xlFree, 0, 1, &name);
+        }
+        *row = caller.val.sref.ref.rwFirst;
+        *column = caller.val.sref.ref.colFirst;
+        found = TRUE;
+    }
+    else if ((caller.xltype & xltypeRef) == xltypeRef && caller.val.mref.lpmref && caller.val.mref.lpmref->count > 0)
+    {
+        *sheet = caller.val.mref.idSheet;
+        *row = caller.val.mref.lpmref->reftbl[0].rwFirst;
+        *column = caller.val.mref.lpmref->reftbl[0].colFirst;
+        found = TRUE;
+    }
+    Excel12(xlFree, 0, 1, &caller);
+    return found;
+}
+
+void XlFreeResult(LPXLOPER12 x)
+{
+    switch (x->xltype & ~(xlbitDLLFree | xlbitXLFree))
+    {
+    case xltypeStr:
+        if (x->val.str)
+        {
+            GlobalFree(x->val.str);
+            x->val.str = NULL;
+        }
+        break;
+
+    case xltypeMulti:
+        if (XlIsPacked(x))
+        {
+            // Elements and strings live in the same block as x
+            break;
+        }
+        if (x->val.array.lparray)
+        {
+            int i, n = x->val.array.rows * x->val.array.columns;
+            for (i = 0; i < n; i++)
+            {
+                LPXLOPER12 e = &x->val.array.lparray[i];
+                if ((e->xltype & ~xlbitDLLFree) == xltypeStr && e->val.str)
+                    GlobalFree(e->val.str);
+            }
+            GlobalFree(x->val.array.lparray);
+            x->val.array.lparray = NULL;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
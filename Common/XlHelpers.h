@@ -0,0 +1,57 @@
+/*
+**  XlHelpers
+**
+**  Small builders for XLOPER12 results returned to Excel with xlbitDLLFree.
+**  All memory comes from GlobalAlloc, matching the hand-written UDFs, so
+**  xlAutoFree12 releases it the same way: the string or array payload first,
+**  then (in XlFreeResult) the strings held by array elements.
+*/
+
+#pragma once
+
+#include <windows.h>
+#include "XLCALL.H"
+
+#define XL_MAX_STR 32767    // Longest string Excel holds in a cell
+
+// Top-level results (xlbitDLLFree set)
+LPXLOPER12 XlNewNum(double value);
+LPXLOPER12 XlNewStr(const wchar_t* text);
+LPXLOPER12 XlNewErr(int err);
+LPXLOPER12 XlNewBool(BOOL value);
+LPXLOPER12 XlNewMulti(int rows, int columns);
+
+// Packed arrays: header, elements and every element string in one GlobalAlloc block,
+// so xlAutoFree12 releases the whole result with a single GlobalFree. chars is the
+// arena size in XCHARs; each string set with XlSetPackedStr2 takes its length + 2.
+LPXLOPER12 XlNewPackedMulti(int rows, int columns, size_t chars);
+int        XlIsPacked(const XLOPER12* x);
+XCHAR*     XlPackedArena(LPXLOPER12 x);
+void       XlSetPackedStr2(LPXLOPER12 e, XCHAR** arena, const XCHAR* a, size_t alen, const XCHAR* b, size_t blen);
+
+// Copies n characters, using SSE2 for short and medium strings
+void XlCopyChars(XCHAR* dst, const XCHAR* src, size_t n);
+
+// Array elements (owned by the enclosing xltypeMulti)
+void XlSetNum(LPXLOPER12 x, double value);
+int  XlSetStr(LPXLOPER12 x, const wchar_t* text);
+int  XlSetStrN(LPXLOPER12 x, const wchar_t* text, size_t len);
+
+// Reading arguments
+double XlArgNum(const XLOPER12* x, double fallback);
+size_t XlArgStr(const XLOPER12* x, wchar_t* buffer, size_t capacity);
+
+// Range arguments: 'Q' passes a range as xltypeMulti and a single value as itself
+int    XlArgRows(const XLOPER12* x);
+int    XlArgColumns(const XLOPER12* x);
+const XLOPER12* XlArgCell(const XLOPER12* x, int row, int column);  // Scalars repeat; NULL outside
+size_t XlCellStr(const XLOPER12* x, const XCHAR** chars);           // 0 and L"" unless a string
+
+// The cell whose formula is calculating (top left of an array formula), from xlfCaller;
+// FALSE when Excel cannot say (called from VBA or a command). A single-cell reference
+// carries no sheet, so its sheet comes from xlSheetNm and xlSheetId (0 if those fail).
+BOOL   XlCallerCell(IDSHEET* sheet, RW* row, COL* column);
+
+// Releases the payload of a result built above; the XLOPER12 itself is left to the caller
+// (for a packed array that single free releases everything)
+void XlFreeResult(LPXLOPER12 x);
@@ -5,6 +5,18 @@
 #include "XLCALL.H"
 #include "FRAMEWRK.H"
 #include <stdarg.h>
+#include "UdfHooks.h"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "ResultCache.h"
+#include "CallTrace.h"
+#include "Timeline.h"
+#include "SingleFlight.h"
+#include "ThreadContext.h"
+#include "WorkerPool.h"
+#include "ThreadUsage.h"
+#include "Metrics.h"
+#include "MicroBatch.h"
 
 // Debug output helper: writes formatted wide string to debugger output
 static void DebugPrintW(const wchar_t* fmt, ...)
@@ -17,24 +29,87 @@ static void DebugPrintW(const wchar_t* fmt, ...)
     OutputDebugStringW(buffer);
 }
 
-// Functions (thread-safe)
-#define rgFuncsRows 12
-static const LPWSTR rgFuncs[rgFuncsRows][7] = {
-    {(LPWSTR)L"cDoubleInner",  (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleInner",  (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Inner add: returns x+y"},
-    {(LPWSTR)L"cDoubleCaller", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCaller", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by name (leaks name XLOPER)"},
-    {(LPWSTR)L"cDoubleCallerById", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerById", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by register id"},
-    {(LPWSTR)L"cDoubleCallerDirect", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerDirect", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by name, w/out framework"},
-    {(LPWSTR)L"cDoubleCallerDirectById", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerDirectById", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by register id, w/out framework"},
+// Functions (thread-safe): REGISTER arguments, then the call policy: concurrency limit
+// (Common/Governor.h), "pure" for coalescing identical calls (Common/SingleFlight.h),
+// "remote" for running in worker processes (Common/WorkerPool.h) and "batch" for
+// sending concurrent calls to a backend server together (Common/MicroBatch.h)
+#define rgFuncsRows 29
+
+// Function ids used by UDF_ENTER: must match the row order of rgFuncs
+enum
+{
+    FN_cDoubleInner,
+    FN_cDoubleCaller,
+    FN_cDoubleCallerById,
+    FN_cDoubleCallerDirect,
+    FN_cDoubleCallerDirectById,
+    FN_cDoubleCallerExcel12Direct,
+    FN_cDoubleCallerExcel12DirectById,
+    FN_cStringsInner,
+    FN_cStringsCaller,
+    FN_cStringsCallerDirectById,
+    FN_cStringsFreeInner,
+    FN_cStringsFreeDirectById,
+    FN_mcAllocStats,
+    FN_mcAllocStatsDump,
+    FN_mcResultCacheStats,
+    FN_mcCallTrace,
+    FN_mcTimeline,
+    FN_cStringsColumn,
+    FN_mcEpochStats,
+    FN_mcCalcEnded,
+    FN_mcCalcCanceled,
+    FN_mcGovernorStats,
+    FN_mcSingleFlightStats,
+    FN_mcThreadContextStats,
+    FN_mcWorkerStats,
+    FN_mcThreadUsage,
+    FN_mcThreadUsageStats,
+    FN_mcMetricsStats,
+    FN_mcBatchStats
+};
+static const LPWSTR rgFuncs[rgFuncsRows][8] = {
+    {(LPWSTR)L"cDoubleInner",  (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleInner",  (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Inner add: returns x+y", (LPWSTR)L"auto,pure,remote,batch"},
+    {(LPWSTR)L"cDoubleCaller", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCaller", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by name (new name XLOPER per call, freed after recalc)", (LPWSTR)L""},
+    {(LPWSTR)L"cDoubleCallerById", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerById", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by register id", (LPWSTR)L""},
+    {(LPWSTR)L"cDoubleCallerDirect", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerDirect", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by name, w/out framework", (LPWSTR)L""},
+    {(LPWSTR)L"cDoubleCallerDirectById", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerDirectById", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by register id, w/out framework", (LPWSTR)L""},
     // Excel12Direct test functions: direct MdCallBack12 calls
-    {(LPWSTR)L"cDoubleCallerExcel12Direct", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerExcel12Direct", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Direct MdCallBack12: calls by name"},
-    {(LPWSTR)L"cDoubleCallerExcel12DirectById", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerExcel12DirectById", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Direct MdCallBack12: calls by register id"},
+    {(LPWSTR)L"cDoubleCallerExcel12Direct", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerExcel12Direct", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Direct MdCallBack12: calls by name", (LPWSTR)L""},
+    {(LPWSTR)L"cDoubleCallerExcel12DirectById", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerExcel12DirectById", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Direct MdCallBack12: calls by register id", (LPWSTR)L""},
     // XLOPER12 string functions: return Q, take two Q args; thread-safe ($)
-    {(LPWSTR)L"cStringsInner", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsInner", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Inner concat: returns str1+str2"},
-    {(LPWSTR)L"cStringsCaller", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsCaller", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by name, w/out framework"},
-    {(LPWSTR)L"cStringsCallerDirectById", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsCallerDirectById", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by register id, w/out framework"},
+    {(LPWSTR)L"cStringsInner", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsInner", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Inner concat: returns str1+str2", (LPWSTR)L""},
+    {(LPWSTR)L"cStringsCaller", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsCaller", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by name, w/out framework", (LPWSTR)L""},
+    {(LPWSTR)L"cStringsCallerDirectById", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsCallerDirectById", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: calls by register id, w/out framework", (LPWSTR)L""},
     // Memory-managed variants
-    {(LPWSTR)L"cStringsFreeInner", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsFreeInner", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Inner concat: returns str1+str2 (DLLFree)"},
-    {(LPWSTR)L"cStringsFreeDirectById", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsFreeDirectById", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: by register id (managed)"}
+    {(LPWSTR)L"cStringsFreeInner", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsFreeInner", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Inner concat: returns str1+str2 (DLLFree)", (LPWSTR)L""},
+    {(LPWSTR)L"cStringsFreeDirectById", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsFreeDirectById", (LPWSTR)L"str1,str2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Caller: by register id (managed)", (LPWSTR)L""},
+    // Allocation accounting (Common/AllocTrack.c)
+    {(LPWSTR)L"mcAllocStats", (LPWSTR)L"QB$", (LPWSTR)L"mcAllocStats", (LPWSTR)L"detail", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Allocation counts, live bytes and peak per function (detail<>0: per thread)", (LPWSTR)L""},
+    {(LPWSTR)L"mcAllocStatsDump", (LPWSTR)L"QQ$", (LPWSTR)L"mcAllocStatsDump", (LPWSTR)L"path", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Writes the per function and thread allocation table as CSV", (LPWSTR)L""},
+    // Persistent result cache (Common/ResultCache.c)
+    {(LPWSTR)L"mcResultCacheStats", (LPWSTR)L"Q$", (LPWSTR)L"mcResultCacheStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Shared result cache size and hit counters", (LPWSTR)L""},
+    {(LPWSTR)L"mcCallTrace", (LPWSTR)L"QQ$", (LPWSTR)L"mcCallTrace", (LPWSTR)L"path", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Starts recording UDF calls to path, or stops when path is empty", (LPWSTR)L""},
+    {(LPWSTR)L"mcTimeline", (LPWSTR)L"QQ$", (LPWSTR)L"mcTimeline", (LPWSTR)L"path", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Starts a Chrome trace timeline written to path, or stops and writes it when path is empty", (LPWSTR)L""},
+    // Column-wide string kernel: one packed allocation per result
+    {(LPWSTR)L"cStringsColumn", (LPWSTR)L"QQQ$", (LPWSTR)L"cStringsColumn", (LPWSTR)L"range1,range2", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"cStringsInner over whole ranges: str1+str2 per cell, one allocation", (LPWSTR)L"auto"},
+    // Epoch reclamation (Common/Epoch.c) and the calculation events that drive it
+    {(LPWSTR)L"mcEpochStats", (LPWSTR)L"Q$", (LPWSTR)L"mcEpochStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Epoch reclamation counters: retired, reclaimed and pending objects", (LPWSTR)L""},
+    {(LPWSTR)L"mcCalcEnded", (LPWSTR)L"J", (LPWSTR)L"mcCalcEnded", (LPWSTR)L"", (LPWSTR)L"2", (LPWSTR)L"Multithread Crash", (LPWSTR)L"xleventCalculationEnded handler", (LPWSTR)L""},
+    {(LPWSTR)L"mcCalcCanceled", (LPWSTR)L"J", (LPWSTR)L"mcCalcCanceled", (LPWSTR)L"", (LPWSTR)L"2", (LPWSTR)L"Multithread Crash", (LPWSTR)L"xleventCalculationCanceled handler", (LPWSTR)L""},
+    // Concurrency governors (Common/Governor.c): limits come from the last column above
+    {(LPWSTR)L"mcGovernorStats", (LPWSTR)L"Q$", (LPWSTR)L"mcGovernorStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Concurrency limits of governed functions: current, tuned range, waits and latency", (LPWSTR)L""},
+    {(LPWSTR)L"mcSingleFlightStats", (LPWSTR)L"Q$", (LPWSTR)L"mcSingleFlightStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Pure functions: calls computed and identical concurrent calls that shared a result", (LPWSTR)L""},
+    // Per-thread contexts (Common/ThreadContext.c), managed from DllMain
+    {(LPWSTR)L"mcThreadContextStats", (LPWSTR)L"Q$", (LPWSTR)L"mcThreadContextStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Per-thread contexts: live, pooled, attached and detached", (LPWSTR)L""},
+    // Worker processes (Common/WorkerPool.c), started when XLL_WORKERS is set
+    {(LPWSTR)L"mcWorkerStats", (LPWSTR)L"Q$", (LPWSTR)L"mcWorkerStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Worker processes: calls, batches and restarts", (LPWSTR)L""},
+    // Calc-thread utilisation per calculation cycle (Common/ThreadUsage.c)
+    {(LPWSTR)L"mcThreadUsage", (LPWSTR)L"QQ$", (LPWSTR)L"mcThreadUsage", (LPWSTR)L"path", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Starts tracking calc-thread utilisation, or stops and writes the CSV to the path given at start when path is empty", (LPWSTR)L""},
+    {(LPWSTR)L"mcThreadUsageStats", (LPWSTR)L"QB$", (LPWSTR)L"mcThreadUsageStats", (LPWSTR)L"cycles", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Per calc thread over the last cycles (0: all kept): busy time, utilisation, load, gaps, longest call, straggler tail", (LPWSTR)L""},
+    {(LPWSTR)L"mcMetricsStats", (LPWSTR)L"Q$", (LPWSTR)L"mcMetricsStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Metrics segment: path, publishes, interval and publish time", (LPWSTR)L""},
+    // Request batching for backend calls (Common/MicroBatch.c), when XLL_BATCH_SERVER is set
+    {(LPWSTR)L"mcBatchStats", (LPWSTR)L"Q$", (LPWSTR)L"mcBatchStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Multithread Crash", (LPWSTR)L"Request batching: calls, round trips, batch sizes, why batches closed and the adaptive quiet gap", (LPWSTR)L""}
 };
 
 // Register id captured for cDoubleInner and cStringsInner
@@ -107,30 +182,60 @@ static int _cdecl Excel12Direct(int xlfn, LPXLOPER12 operRes, int count, ...)
 
     // Call MdCallBack12 directly with the signature we determined:
     // int MdCallBack12(int xlfn, int count, LPXLOPER12 *opers, LPXLOPER12 operRes)
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12DIRECT, xlfn);
     int result = g_pMdCallBack12(xlfn, count, opers, operRes);
+    UdfCallbackEnd(&cb);
 
     DebugPrintW(L"[MultithreadCrash] Thread %lu: Excel12Direct returned %d\n", tid, result);
     return result;
 }
 
-// cDoubleInner: returns x+y
-__declspec(dllexport) double WINAPI cDoubleInner(double x, double y)
+// cDoubleInnerKernel: the work of cDoubleInner, in Excel or in a worker process
+static double cDoubleInnerKernel(double x, double y)
 {
 	// Sleep this thread for 100 ms to simulate some work using the Windows API
 	Sleep(100);
     return x + y;
 }
 
+// cDoubleInner: returns x+y
+// Results are served from the shared result cache when XLL_RESULT_CACHE is set
+// At most the governor's tuned limit of calls run at once when XLL_GOVERN is set,
+// calls with the same x and y while one is running share its result when
+// XLL_SINGLEFLIGHT is set, concurrent calls go to the backend server together when
+// XLL_BATCH_SERVER is set, and otherwise the kernel runs in a worker process when
+// XLL_WORKERS is set (rgFuncs: "auto,pure,remote,batch")
+__declspec(dllexport) double WINAPI cDoubleInner(double x, double y)
+{
+    UDF_ENTER_ARGS(FN_cDoubleInner, &x, &y);
+    double args[2] = { x, y };
+    double result;
+    SingleFlight sf;
+    if (ResultCacheGetNum(FN_cDoubleInner, args, 2, &result))
+        UDF_RETURN(result);
+    if (SingleFlightBeginNum(&sf, &udfFrame, args, 2, &result))
+        UDF_RETURN(result);
+
+    // A server or worker that dies mid-call leaves it to the kernel here, so no cell sees #NUM!
+    if (!MicroBatchCallNum(FN_cDoubleInner, args, 2, &result) && !WorkerPoolCallNum(FN_cDoubleInner, args, 2, &result))
+        result = cDoubleInnerKernel(x, y);
+    ResultCachePutNum(FN_cDoubleInner, args, 2, result);
+    SingleFlightEndNum(&sf, result);
+    UDF_RETURN(result);
+}
+
 // cStringsInner: concatenates two strings
 __declspec(dllexport) LPXLOPER12 WINAPI cStringsInner(LPXLOPER12 str1, LPXLOPER12 str2)
 {
+    UDF_ENTER_ARGS(FN_cStringsInner, &str1, &str2);
     // Sleep this thread for 50 ms to simulate some work
     // Sleep(50);
     
     // Allocate result XLOPER12 on the heap (intentionally not freed)
     LPXLOPER12 result = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
     if (!result)
-        return NULL;
+        UDF_RETURN(NULL);
     
     // Check if both inputs are strings
     if ((str1->xltype & xltypeStr) != xltypeStr || (str2->xltype & xltypeStr) != xltypeStr)
@@ -143,7 +248,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsInner(LPXLOPER12 str1, LPXLOPER1
             result->val.str[0] = 0; // Length 0
             result->val.str[1] = L'\0';
         }
-        return result;
+        UDF_RETURN(result);
     }
     
     // Get string lengths (first character is length for Excel strings)
@@ -159,7 +264,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsInner(LPXLOPER12 str1, LPXLOPER1
     if (!result->val.str)
     {
         GlobalFree(result);
-        return NULL;
+        UDF_RETURN(NULL);
     }
     
     // Set length prefix
@@ -179,12 +284,13 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsInner(LPXLOPER12 str1, LPXLOPER1
     // Null terminate
     result->val.str[totalLen + 1] = L'\0';
     
-    return result;
+    UDF_RETURN(result);
 }
 
 // cStringsFreeInner: concatenates two strings and returns a value that Excel will free via xlAutoFree12
 __declspec(dllexport) LPXLOPER12 WINAPI cStringsFreeInner(LPXLOPER12 str1, LPXLOPER12 str2)
 {
+    UDF_ENTER_ARGS(FN_cStringsFreeInner, &str1, &str2);
     DWORD tid = GetCurrentThreadId();
     DebugPrintW(L"[MultithreadCrash] Thread %lu: cStringsFreeInner called\n", tid);
 
@@ -201,14 +307,14 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsFreeInner(LPXLOPER12 str1, LPXLO
     // Allocate result XLOPER12 and its string; Excel will later call xlAutoFree12 to free
     LPXLOPER12 result = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
     if (!result)
-        return NULL;
+        UDF_RETURN(NULL);
 
     result->xltype = xltypeStr | xlbitDLLFree;
     result->val.str = (XCHAR*)GlobalAlloc(GMEM_FIXED, (totalLen + 2) * sizeof(XCHAR));
     if (!result->val.str)
     {
         GlobalFree(result);
-        return NULL;
+        UDF_RETURN(NULL);
     }
 
     // Build the result string
@@ -223,31 +329,27 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsFreeInner(LPXLOPER12 str1, LPXLO
         wcsncpy_s(&result->val.str[1 + copyLen1], totalLen + 1 - copyLen1, &str2->val.str[1], copyLen2);
 
     result->val.str[totalLen + 1] = L'\0';
-    return result;
+    UDF_RETURN(result);
 }
 
-// cDoubleCaller: calls by NAME using a newly allocated XLOPER string (intentionally leaked). TLS numeric args; no Temp helpers.
-__declspec(dllexport) double WINAPI cDoubleCaller(double x, double y)
+// Frees a heap XLOPER12 string and its characters once it has been retired
+static void FreeNameOper(void* p)
 {
-    static __declspec(thread) int tls_init = 0;
-    static __declspec(thread) LPXLOPER12 tls_x = NULL;
-    static __declspec(thread) LPXLOPER12 tls_y = NULL;
-
-    if (!tls_init)
-    {
-        DWORD tid = GetCurrentThreadId();
-        DebugPrintW(L"[MultithreadCrash] Thread %lu: init TLS numeric args\n", tid);
-        tls_x = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        tls_y = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        if (tls_x) { tls_x->xltype = xltypeNum; tls_x->val.num = 0.0; }
-        if (tls_y) { tls_y->xltype = xltypeNum; tls_y->val.num = 0.0; }
-        tls_init = 1;
-    }
+    LPXLOPER12 x = (LPXLOPER12)p;
+    GlobalFree(x->val.str);
+    GlobalFree(x);
+}
 
-    if (tls_x) tls_x->val.num = x;
-    if (tls_y) tls_y->val.num = y;
+// cDoubleCaller: calls by NAME using a newly allocated XLOPER string (retired, freed at calc end).
+// Numeric args live in the thread's context (Common/ThreadContext.h); no Temp helpers.
+__declspec(dllexport) double WINAPI cDoubleCaller(double x, double y)
+{
+    UDF_ENTER_ARGS(FN_cDoubleCaller, &x, &y);
+    ThreadContext* ctx = ThreadContextGet();
+    ctx->num[0].val.num = x;
+    ctx->num[1].val.num = y;
 
-    // Allocate a fresh function name XLOPER12 on the heap and DO NOT FREE (intentional leak for test)
+    // Allocate a fresh function name XLOPER12 on the heap for every call (retired below, not freed here)
     LPXLOPER12 fnArg = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
     LPWSTR fnStr = (LPWSTR)GlobalAlloc(GMEM_FIXED, 32 * sizeof(wchar_t));
     if (fnArg && fnStr)
@@ -259,21 +361,33 @@ __declspec(dllexport) double WINAPI cDoubleCaller(double x, double y)
         fnArg->xltype = xltypeStr;
         fnArg->val.str = fnStr;
     }
-    // Note: fnArg and fnStr are intentionally not freed to avoid any cross-thread reuse — this leaks memory by design for this test.
+    // fnArg and fnStr are never reused or freed while any calc thread may still hold them:
+    // they are retired after the call and freed when the recalculation ends (Common/Epoch.h)
 
     XLOPER12 ret;
-    int rc = Excel12f(xlUDF, &ret, 3, fnArg, tls_x, tls_y);
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
+    int rc = Excel12f(xlUDF, &ret, 3, fnArg, &ctx->num[0], &ctx->num[1]);
+    UdfCallbackEnd(&cb);
+    if (fnArg && fnStr)
+        EpochRetire(fnArg, FreeNameOper);
+    else
+    {
+        EpochRetire(fnArg, NULL);
+        EpochRetire(fnStr, NULL);
+    }
     if (rc == xlretSuccess && (ret.xltype & xltypeNum) == xltypeNum)
-        return ret.val.num;
-    return 0.0;
+        UDF_RETURN(ret.val.num);
+    UDF_RETURN(0.0);
 }
 
 __declspec(dllexport) double WINAPI cDoubleCallerDirect(double x, double y)
 {
+    UDF_ENTER_ARGS(FN_cDoubleCallerDirect, &x, &y);
     // Allocate an array of XLOPER12s on the heap
     LPXLOPER12 args = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, 3 * sizeof(XLOPER12));
     if (!args)
-        return 0.0; // Allocation failed
+        UDF_RETURN(0.0); // Allocation failed
 
     // Initialize the first argument: function name
     args[0].xltype = xltypeStr;
@@ -281,7 +395,7 @@ __declspec(dllexport) double WINAPI cDoubleCallerDirect(double x, double y)
     if (!args[0].val.str)
     {
         GlobalFree(args);
-        return 0.0; // Allocation failed
+        UDF_RETURN(0.0); // Allocation failed
     }
     args[0].val.str[0] = 12; // Length prefix
     wcscpy_s(&args[0].val.str[1], 13, L"cDoubleInner");
@@ -299,7 +413,10 @@ __declspec(dllexport) double WINAPI cDoubleCallerDirect(double x, double y)
     ZeroMemory(&result, sizeof(XLOPER12));
 
     // Call Excel12 directly
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12, xlUDF);
     int rc = Excel12(xlUDF, &result, 3, &args[0], &args[1], &args[2]);
+    UdfCallbackEnd(&cb);
 
     // // Free allocated memory for arguments
     // GlobalFree(args[0].val.str);
@@ -310,48 +427,41 @@ __declspec(dllexport) double WINAPI cDoubleCallerDirect(double x, double y)
     {
         double returnValue = result.val.num;
 
-        return returnValue;
+        UDF_RETURN(returnValue);
     }
 
-    return 0.0; // Default return value on failure
+    UDF_RETURN(0.0); // Default return value on failure
 }
 
-// cDoubleCallerById: calls by REGISTER ID (g_reg_cDoubleInner) and TLS numeric args. No Temp helpers.
+// cDoubleCallerById: calls by REGISTER ID (g_reg_cDoubleInner) with the thread context's numeric args. No Temp helpers.
 __declspec(dllexport) double WINAPI cDoubleCallerById(double x, double y)
 {
-    static __declspec(thread) int tls_init = 0;
-    static __declspec(thread) LPXLOPER12 tls_x = NULL;
-    static __declspec(thread) LPXLOPER12 tls_y = NULL;
-
-    if (!tls_init)
-    {
-        tls_x = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        tls_y = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        if (tls_x) { tls_x->xltype = xltypeNum; tls_x->val.num = 0.0; }
-        if (tls_y) { tls_y->xltype = xltypeNum; tls_y->val.num = 0.0; }
-        tls_init = 1;
-    }
-
-    if (tls_x) tls_x->val.num = x;
-    if (tls_y) tls_y->val.num = y;
+    UDF_ENTER_ARGS(FN_cDoubleCallerById, &x, &y);
+    ThreadContext* ctx = ThreadContextGet();
+    ctx->num[0].val.num = x;
+    ctx->num[1].val.num = y;
 
     if ((g_reg_cDoubleInner.xltype & xltypeNum) != xltypeNum)
-        return 0.0; // ID not available
+        UDF_RETURN(0.0); // ID not available
 
     XLOPER12 ret;
-    int rc = Excel12f(xlUDF, &ret, 3, (LPXLOPER12)&g_reg_cDoubleInner, tls_x, tls_y);
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
+    int rc = Excel12f(xlUDF, &ret, 3, (LPXLOPER12)&g_reg_cDoubleInner, &ctx->num[0], &ctx->num[1]);
+    UdfCallbackEnd(&cb);
     if (rc == xlretSuccess && (ret.xltype & xltypeNum) == xltypeNum)
-        return ret.val.num;
-    return 0.0;
+        UDF_RETURN(ret.val.num);
+    UDF_RETURN(0.0);
 }
 
 // cDoubleCallerDirectById: calls cDoubleInner using its registration ID directly
 __declspec(dllexport) double WINAPI cDoubleCallerDirectById(double x, double y)
 {
+    UDF_ENTER_ARGS(FN_cDoubleCallerDirectById, &x, &y);
     // Allocate an array of XLOPER12s on the heap
     LPXLOPER12 args = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, 2 * sizeof(XLOPER12));
     if (!args)
-        return 0.0; // Allocation failed
+        UDF_RETURN(0.0); // Allocation failed
 
     // Initialize the first argument: x
     args[0].xltype = xltypeNum;
@@ -366,7 +476,10 @@ __declspec(dllexport) double WINAPI cDoubleCallerDirectById(double x, double y)
     ZeroMemory(&result, sizeof(XLOPER12));
 
     // Call Excel12 directly using the registration ID
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12, xlUDF);
     int rc = Excel12(xlUDF, &result, 3, (LPXLOPER12)&g_reg_cDoubleInner, &args[0], &args[1]);
+    UdfCallbackEnd(&cb);
 
     // Free allocated memory for arguments
     GlobalFree(args);
@@ -380,15 +493,16 @@ __declspec(dllexport) double WINAPI cDoubleCallerDirectById(double x, double y)
         if (result.xltype & xlbitXLFree)
             Excel12(xlFree, 0, 1, &result);
 
-        return returnValue;
+        UDF_RETURN(returnValue);
     }
 
-    return 0.0; // Default return value on failure
+    UDF_RETURN(0.0); // Default return value on failure
 }
 
 // cStringsCaller: calls cStringsInner by NAME, allocating a new name XLOPER12 each call (no frees)
 __declspec(dllexport) LPXLOPER12 WINAPI cStringsCaller(LPXLOPER12 str1, LPXLOPER12 str2)
 {
+    UDF_ENTER_ARGS(FN_cStringsCaller, &str1, &str2);
     // Allocate and build function name XLOPER12 (intentional leak per call)
     LPXLOPER12 fnArg = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
     const wchar_t* fname = L"cStringsInner";
@@ -405,7 +519,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsCaller(LPXLOPER12 str1, LPXLOPER
     // Allocate an array of XLOPER12s on the heap for str1 and str2 (intentional leak)
     LPXLOPER12 args = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, 2 * sizeof(XLOPER12));
     if (!args)
-        return NULL;
+        UDF_RETURN(NULL);
 
     // Initialize the first argument: str1 (copy or empty)
     args[0].xltype = xltypeStr;
@@ -458,7 +572,10 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsCaller(LPXLOPER12 str1, LPXLOPER
     ZeroMemory(&result, sizeof(XLOPER12));
 
     // Call Excel12 using function name and two string arguments
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12, xlUDF);
     int rc = Excel12(xlUDF, &result, 3, fnArg, &args[0], &args[1]);
+    UdfCallbackEnd(&cb);
 
     // On success, copy result to a freshly allocated return object (intentional leak)
     if (rc == xlretSuccess && (result.xltype & xltypeStr) == xltypeStr)
@@ -476,7 +593,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsCaller(LPXLOPER12 str1, LPXLOPER
                 returnValue->val.str[resultLen + 1] = L'\0';
             }
         }
-        return returnValue;
+        UDF_RETURN(returnValue);
     }
 
     // Failure case: return empty string (intentional leak)
@@ -491,12 +608,13 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsCaller(LPXLOPER12 str1, LPXLOPER
             emptyResult->val.str[1] = L'\0';
         }
     }
-    return emptyResult;
+    UDF_RETURN(emptyResult);
 }
 
 // cStringsCallerDirectById: calls cStringsInner using its registration ID directly
 __declspec(dllexport) LPXLOPER12 WINAPI cStringsCallerDirectById(LPXLOPER12 str1, LPXLOPER12 str2)
 {
+    UDF_ENTER_ARGS(FN_cStringsCallerDirectById, &str1, &str2);
 	// Write Debug info with thread ID
 	DWORD tid = GetCurrentThreadId();
 	DebugPrintW(L"[MultithreadCrash] Thread %lu: cStringsCallerDirectById called\n", tid);
@@ -504,7 +622,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsCallerDirectById(LPXLOPER12 str1
     // Allocate an array of XLOPER12s on the heap
     LPXLOPER12 args = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, 2 * sizeof(XLOPER12));
     if (!args)
-        return NULL; // Allocation failed
+        UDF_RETURN(NULL); // Allocation failed
 
     // Initialize the first argument: str1
     args[0].xltype = xltypeStr;
@@ -559,7 +677,10 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsCallerDirectById(LPXLOPER12 str1
     ZeroMemory(&result, sizeof(XLOPER12));
 
     // Call Excel12 directly using the registration ID
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12, xlUDF);
     int rc = Excel12(xlUDF, &result, 3, (LPXLOPER12)&g_reg_cStringsInner, &args[0], &args[1]);
+    UdfCallbackEnd(&cb);
 
     // Note: args and arg strings are intentionally not freed (memory leak by design for test)
 
@@ -585,7 +706,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsCallerDirectById(LPXLOPER12 str1
         if (result.xltype & xlbitXLFree)
             Excel12(xlFree, 0, 1, &result);
 
-        return returnValue;
+        UDF_RETURN(returnValue);
     }
 
     // Return empty string on failure
@@ -600,19 +721,20 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsCallerDirectById(LPXLOPER12 str1
             emptyResult->val.str[1] = L'\0';
         }
     }
-    return emptyResult;
+    UDF_RETURN(emptyResult);
 }
 
 // cStringsFreeDirectById: calls cStringsFreeInner using its registration ID directly and manages memory
 __declspec(dllexport) LPXLOPER12 WINAPI cStringsFreeDirectById(LPXLOPER12 str1, LPXLOPER12 str2)
 {
+    UDF_ENTER_ARGS(FN_cStringsFreeDirectById, &str1, &str2);
     DWORD tid = GetCurrentThreadId();
     DebugPrintW(L"[MultithreadCrash] Thread %lu: cStringsFreeDirectById called\n", tid);
 
     // Allocate an array of XLOPER12s on the heap for two string args
     LPXLOPER12 args = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, 2 * sizeof(XLOPER12));
     if (!args)
-        return NULL; // Allocation failed
+        UDF_RETURN(NULL); // Allocation failed
 
     // Helper lambda-like macros for cleanup
 #define FREE_ARG_STR(i) do { if (args[i].xltype == xltypeStr && args[i].val.str) { GlobalFree(args[i].val.str); args[i].val.str = NULL; } } while(0)
@@ -697,7 +819,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsFreeDirectById(LPXLOPER12 str1,
         if (result.xltype & xlbitXLFree)
             Excel12(xlFree, 0, 1, &result);
 
-        return retp;
+        UDF_RETURN(retp);
     }
 
     // Failure: free Excel-allocated memory if present and return empty string (managed)
@@ -715,7 +837,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsFreeDirectById(LPXLOPER12 str1,
             emptyRet->val.str[1] = L'\0';
         }
     }
-    return emptyRet;
+    UDF_RETURN(emptyRet);
 }
 
 // Test functions using Excel12Direct (bypassing framework)
@@ -723,25 +845,13 @@ __declspec(dllexport) LPXLOPER12 WINAPI cStringsFreeDirectById(LPXLOPER12 str1,
 // cDoubleCallerExcel12Direct: calls cDoubleInner by name using Excel12Direct
 __declspec(dllexport) double WINAPI cDoubleCallerExcel12Direct(double x, double y)
 {
-    static __declspec(thread) int tls_init = 0;
-    static __declspec(thread) LPXLOPER12 tls_x = NULL;
-    static __declspec(thread) LPXLOPER12 tls_y = NULL;
-
+    UDF_ENTER_ARGS(FN_cDoubleCallerExcel12Direct, &x, &y);
     DWORD tid = GetCurrentThreadId();
     DebugPrintW(L"[MultithreadCrash] Thread %lu: cDoubleCallerExcel12Direct called\n", tid);
 
-    if (!tls_init)
-    {
-        DebugPrintW(L"[MultithreadCrash] Thread %lu: init TLS numeric args\n", tid);
-        tls_x = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        tls_y = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        if (tls_x) { tls_x->xltype = xltypeNum; tls_x->val.num = 0.0; }
-        if (tls_y) { tls_y->xltype = xltypeNum; tls_y->val.num = 0.0; }
-        tls_init = 1;
-    }
-
-    if (tls_x) tls_x->val.num = x;
-    if (tls_y) tls_y->val.num = y;
+    ThreadContext* ctx = ThreadContextGet();
+    ctx->num[0].val.num = x;
+    ctx->num[1].val.num = y;
 
     // Allocate a fresh function name XLOPER12 on the heap
     LPXLOPER12 fnArg = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
@@ -757,60 +867,329 @@ __declspec(dllexport) double WINAPI cDoubleCallerExcel12Direct(double x, double
     }
 
     XLOPER12 ret;
-    int rc = Excel12Direct(xlUDF, &ret, 3, fnArg, tls_x, tls_y);
+    int rc = Excel12Direct(xlUDF, &ret, 3, fnArg, &ctx->num[0], &ctx->num[1]);
     
     DebugPrintW(L"[MultithreadCrash] Thread %lu: Excel12Direct returned %d\n", tid, rc);
     
     if (rc == xlretSuccess && (ret.xltype & xltypeNum) == xltypeNum)
-        return ret.val.num;
-    return 0.0;
+        UDF_RETURN(ret.val.num);
+    UDF_RETURN(0.0);
 }
 
 // cDoubleCallerExcel12DirectById: calls cDoubleInner by ID using Excel12Direct
 __declspec(dllexport) double WINAPI cDoubleCallerExcel12DirectById(double x, double y)
 {
-    static __declspec(thread) int tls_init = 0;
-    static __declspec(thread) LPXLOPER12 tls_x = NULL;
-    static __declspec(thread) LPXLOPER12 tls_y = NULL;
-
+    UDF_ENTER_ARGS(FN_cDoubleCallerExcel12DirectById, &x, &y);
     DWORD tid = GetCurrentThreadId();
     DebugPrintW(L"[MultithreadCrash] Thread %lu: cDoubleCallerExcel12DirectById called\n", tid);
 
-    if (!tls_init)
-    {
-        DebugPrintW(L"[MultithreadCrash] Thread %lu: init TLS numeric args\n", tid);
-        tls_x = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        tls_y = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        if (tls_x) { tls_x->xltype = xltypeNum; tls_x->val.num = 0.0; }
-        if (tls_y) { tls_y->xltype = xltypeNum; tls_y->val.num = 0.0; }
-        tls_init = 1;
-    }
-
-    if (tls_x) tls_x->val.num = x;
-    if (tls_y) tls_y->val.num = y;
+    ThreadContext* ctx = ThreadContextGet();
+    ctx->num[0].val.num = x;
+    ctx->num[1].val.num = y;
 
     if ((g_reg_cDoubleInner.xltype & xltypeNum) != xltypeNum)
     {
         DebugPrintW(L"[MultithreadCrash] Thread %lu: Registration ID not available\n", tid);
-        return 0.0; // ID not available
+        UDF_RETURN(0.0); // ID not available
     }
 
     XLOPER12 ret;
-    int rc = Excel12Direct(xlUDF, &ret, 3, (LPXLOPER12)&g_reg_cDoubleInner, tls_x, tls_y);
+    int rc = Excel12Direct(xlUDF, &ret, 3, (LPXLOPER12)&g_reg_cDoubleInner, &ctx->num[0], &ctx->num[1]);
     
     DebugPrintW(L"[MultithreadCrash] Thread %lu: Excel12Direct returned %d\n", tid, rc);
     
     if (rc == xlretSuccess && (ret.xltype & xltypeNum) == xltypeNum)
-        return ret.val.num;
-    return 0.0;
+        UDF_RETURN(ret.val.num);
+    UDF_RETURN(0.0);
+}
+
+// cStringsColumn: cStringsInner over whole ranges, range1 + range2 cell by cell.
+// A single cell pairs with every cell of the other range; cells outside a smaller
+// range give #N/A. The result, its elements and every string are one GlobalAlloc
+// block (XlNewPackedMulti), freed by one GlobalFree in xlAutoFree12. Strings keep
+// up to 32767 characters instead of cStringsInner's 255.
+__declspec(dllexport) LPXLOPER12 WINAPI cStringsColumn(LPXLOPER12 range1, LPXLOPER12 range2)
+{
+    UDF_ENTER_ARGS(FN_cStringsColumn, &range1, &range2);
+    int rows = max(XlArgRows(range1), XlArgRows(range2));
+    int columns = max(XlArgColumns(range1), XlArgColumns(range2));
+    size_t chars = 0;
+
+    // First pass sizes the string arena
+    for (int r = 0; r < rows; r++)
+        for (int c = 0; c < columns; c++)
+        {
+            const XLOPER12* a = XlArgCell(range1, r, c);
+            const XLOPER12* b = XlArgCell(range2, r, c);
+            const XCHAR *s1, *s2;
+            if (!a || !b)
+                continue;
+            size_t len = XlCellStr(a, &s1) + XlCellStr(b, &s2);
+            chars += (len > XL_MAX_STR ? XL_MAX_STR : len) + 2;
+        }
+
+    LPXLOPER12 result = XlNewPackedMulti(rows, columns, chars);
+    if (!result)
+        UDF_RETURN(result);
+    XCHAR* arena = XlPackedArena(result);
+    for (int r = 0; r < rows; r++)
+        for (int c = 0; c < columns; c++)
+        {
+            LPXLOPER12 e = &result->val.array.lparray[r * columns + c];
+            const XLOPER12* a = XlArgCell(range1, r, c);
+            const XLOPER12* b = XlArgCell(range2, r, c);
+            const XCHAR *s1, *s2;
+            if (!a || !b)
+            {
+                e->xltype = xltypeErr;
+                e->val.err = xlerrNA;
+                continue;
+            }
+            size_t len1 = XlCellStr(a, &s1);
+            size_t len2 = XlCellStr(b, &s2);
+            XlSetPackedStr2(e, &arena, s1, len1, s2, len2);
+        }
+    UDF_RETURN(result);
+}
+
+// mcAllocStats: allocation accounting table (detail != 0: one row per function and thread)
+__declspec(dllexport) LPXLOPER12 WINAPI mcAllocStats(double detail)
+{
+    UDF_ENTER_ARGS(FN_mcAllocStats, &detail);
+    LPXLOPER12 result = AllocTrackTable(detail != 0.0);
+    UDF_RETURN(result);
+}
+
+// mcAllocStatsDump: writes the allocation table as CSV, returns the row count
+// An empty path uses %XLL_ALLOC_DUMP%/MultithreadCrash-alloc.csv
+__declspec(dllexport) LPXLOPER12 WINAPI mcAllocStatsDump(LPXLOPER12 path)
+{
+    UDF_ENTER_ARGS(FN_mcAllocStatsDump, &path);
+    wchar_t file[MAX_PATH];
+    XlArgStr(path, file, _countof(file));
+    int rows = AllocTrackDump(file);
+    LPXLOPER12 result = rows < 0 ? XlNewErr(xlerrValue) : XlNewNum((double)rows);
+    UDF_RETURN(result);
+}
+
+// mcResultCacheStats: result cache file, entries and this process's hit counters
+__declspec(dllexport) LPXLOPER12 WINAPI mcResultCacheStats(void)
+{
+    UDF_ENTER(FN_mcResultCacheStats);
+    LPXLOPER12 result = ResultCacheTable();
+    UDF_RETURN(result);
+}
+
+// mcCallTrace: starts recording UDF calls to path and returns TRUE (see Common/CallTrace.h);
+// an empty path stops recording and returns the number of calls written
+__declspec(dllexport) LPXLOPER12 WINAPI mcCallTrace(LPXLOPER12 path)
+{
+    UDF_ENTER_ARGS(FN_mcCallTrace, &path);
+    wchar_t file[MAX_PATH];
+    XlArgStr(path, file, _countof(file));
+    LPXLOPER12 result;
+    if (file[0])
+        result = CallTraceStart(file) ? XlNewBool(TRUE) : XlNewErr(xlerrValue);
+    else
+        result = XlNewNum((double)CallTraceStop());
+    UDF_RETURN(result);
+}
+
+// mcTimeline: starts a Chrome trace timeline of UDFs and callbacks to be written to path
+// (see Common/Timeline.h); an empty path stops it, writes the file and returns the event count
+__declspec(dllexport) LPXLOPER12 WINAPI mcTimeline(LPXLOPER12 path)
+{
+    UDF_ENTER_ARGS(FN_mcTimeline, &path);
+    wchar_t file[MAX_PATH];
+    XlArgStr(path, file, _countof(file));
+    LPXLOPER12 result;
+    if (file[0])
+        result = TimelineStart(file) ? XlNewBool(TRUE) : XlNewErr(xlerrValue);
+    else
+    {
+        LONGLONG events = TimelineStop();
+        result = events < 0 ? XlNewErr(xlerrValue) : XlNewNum((double)events);
+    }
+    UDF_RETURN(result);
+}
+
+// mcEpochStats: epoch reclamation counters (see Common/Epoch.h)
+__declspec(dllexport) LPXLOPER12 WINAPI mcEpochStats(void)
+{
+    UDF_ENTER(FN_mcEpochStats);
+    LPXLOPER12 result = EpochTable();
+    UDF_RETURN(result);
+}
+
+// mcGovernorStats: tuned concurrency limits, waits and latency (see Common/Governor.h)
+__declspec(dllexport) LPXLOPER12 WINAPI mcGovernorStats(void)
+{
+    UDF_ENTER(FN_mcGovernorStats);
+    LPXLOPER12 result = GovernorTable();
+    UDF_RETURN(result);
+}
+
+// mcSingleFlightStats: duplicated work avoided by coalescing (see Common/SingleFlight.h)
+__declspec(dllexport) LPXLOPER12 WINAPI mcSingleFlightStats(void)
+{
+    UDF_ENTER(FN_mcSingleFlightStats);
+    LPXLOPER12 result = SingleFlightTable();
+    UDF_RETURN(result);
+}
+
+// mcThreadContextStats: per-thread argument contexts (see Common/ThreadContext.h)
+__declspec(dllexport) LPXLOPER12 WINAPI mcThreadContextStats(void)
+{
+    UDF_ENTER(FN_mcThreadContextStats);
+    LPXLOPER12 result = ThreadContextTable();
+    UDF_RETURN(result);
+}
+
+// mcWorkerStats: worker processes serving remote functions (see Common/WorkerPool.h)
+__declspec(dllexport) LPXLOPER12 WINAPI mcWorkerStats(void)
+{
+    UDF_ENTER(FN_mcWorkerStats);
+    LPXLOPER12 result = WorkerPoolTable();
+    UDF_RETURN(result);
+}
+
+// mcThreadUsage: starts tracking calc-thread utilisation per calculation cycle (see
+// Common/ThreadUsage.h); an empty path stops it, writes the CSV and returns the row count
+__declspec(dllexport) LPXLOPER12 WINAPI mcThreadUsage(LPXLOPER12 path)
+{
+    UDF_ENTER_ARGS(FN_mcThreadUsage, &path);
+    wchar_t file[MAX_PATH];
+    XlArgStr(path, file, _countof(file));
+    LPXLOPER12 result;
+    if (file[0])
+        result = ThreadUsageStart(file) ? XlNewBool(TRUE) : XlNewErr(xlerrValue);
+    else
+    {
+        int rows = ThreadUsageStop();
+        result = rows < 0 ? XlNewErr(xlerrValue) : XlNewNum((double)rows);
+    }
+    UDF_RETURN(result);
+}
+
+// mcThreadUsageStats: per calc thread over the last cycles (0: all kept)
+__declspec(dllexport) LPXLOPER12 WINAPI mcThreadUsageStats(double cycles)
+{
+    UDF_ENTER_ARGS(FN_mcThreadUsageStats, &cycles);
+    LPXLOPER12 result = ThreadUsageTable(cycles > 0.0 ? (int)cycles : 0);
+    UDF_RETURN(result);
+}
+
+// mcMetricsStats: the shared-memory metrics segment read by Bench/XllMetrics (see Common/Metrics.h)
+__declspec(dllexport) LPXLOPER12 WINAPI mcMetricsStats(void)
+{
+    UDF_ENTER(FN_mcMetricsStats);
+    LPXLOPER12 result = MetricsTable();
+    UDF_RETURN(result);
+}
+
+// mcBatchStats: calls batched for the backend server (see Common/MicroBatch.h)
+__declspec(dllexport) LPXLOPER12 WINAPI mcBatchStats(void)
+{
+    UDF_ENTER(FN_mcBatchStats);
+    LPXLOPER12 result = MicroBatchTable();
+    UDF_RETURN(result);
+}
+
+// Kernels of the remote functions, run by the worker processes
+static int WorkerKernels(int fn, const double* args, int count, double* result)
+{
+    switch (fn)
+    {
+    case FN_cDoubleInner:
+        if (count != 2)
+            return 0;
+        *result = cDoubleInnerKernel(args[0], args[1]);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// mcWorkerMain: entry point of a worker process, started by WorkerPoolInit as
+//   rundll32.exe "<this xll>",mcWorkerMain "<segment>" <index>
+// Serves requests until the XLL closes the pool or Excel exits
+__declspec(dllexport) void CALLBACK mcWorkerMainW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nCmdShow)
+{
+    if (!WorkerPoolServe(lpszCmdLine, WorkerKernels))
+        DebugPrintW(L"[MultithreadCrash] Worker: cannot serve '%ls'\n", lpszCmdLine ? lpszCmdLine : L"");
+}
+
+// mcCalcEnded / mcCalcCanceled: calculation event handlers (commands hooked up with
+// xlEventRegister); free everything retired during the recalculation in one batch
+// and close the thread usage cycle
+__declspec(dllexport) int WINAPI mcCalcEnded(void)
+{
+    UDF_ENTER(FN_mcCalcEnded);
+    int freed = EpochReclaim();
+    ThreadUsageCycleEnd();
+    if (freed)
+        DebugPrintW(L"[MultithreadCrash] Calculation ended: reclaimed %d retired objects\n", freed);
+    UDF_RETURN(1);
+}
+
+__declspec(dllexport) int WINAPI mcCalcCanceled(void)
+{
+    UDF_ENTER(FN_mcCalcCanceled);
+    int freed = EpochReclaim();
+    ThreadUsageCycleEnd();
+    if (freed)
+        DebugPrintW(L"[MultithreadCrash] Calculation canceled: reclaimed %d retired objects\n", freed);
+    UDF_RETURN(1);
+}
+
+// DllMain: per-thread contexts are prewarmed at load and reclaimed as threads exit
+// (Common/ThreadContext.h). Runs under the loader lock, so it only allocates.
+BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
+{
+    switch (fdwReason)
+    {
+    case DLL_PROCESS_ATTACH:
+        return ThreadContextProcessAttach(0);
+    case DLL_THREAD_DETACH:
+        ThreadContextThreadDetach();
+        break;
+    case DLL_PROCESS_DETACH:
+        // At process exit (lpvReserved set) the memory goes with the process
+        if (!lpvReserved)
+            ThreadContextProcessDetach();
+        break;
+    }
+    return TRUE;
 }
 
 // Registration
 __declspec(dllexport) int WINAPI xlAutoOpen(void)
 {
     static XLOPER12 xDLL;
+    UdfHooksInit(L"MultithreadCrash", &rgFuncs[0][0], rgFuncsRows, 8);
+    GovernorInit(&rgFuncs[0][0], rgFuncsRows, 8);
+    SingleFlightInit(&rgFuncs[0][0], rgFuncsRows, 8);
+    CallTraceStart(NULL);   // Records from load if XLL_CALL_TRACE names a directory
+    TimelineStart(NULL);    // Likewise XLL_TIMELINE
+    ThreadUsageStart(NULL); // And XLL_THREAD_USAGE
+
+    // Map the shared result cache (if configured) and pre-fault its live entries
+    int cached = ResultCacheOpen(RESULTCACHE_DEFAULT_BYTES);
+    if (cached >= 0)
+        DebugPrintW(L"[MultithreadCrash] Result cache warmed: %d entries\n", cached);
+    MetricsOpen();          // Live counters for XllMetrics, if XLL_METRICS names a directory
     Excel12f(xlGetName, &xDLL, 0);
 
+    // Start the worker processes for remote functions (if XLL_WORKERS is set)
+    int workers = WorkerPoolInit(&rgFuncs[0][0], rgFuncsRows, 8, xDLL.val.str, L"mcWorkerMain");
+    if (workers > 0)
+        DebugPrintW(L"[MultithreadCrash] Started %d worker processes\n", workers);
+
+    // Connect to the backend server of batched functions (if XLL_BATCH_SERVER is set)
+    int connections = MicroBatchInit(&rgFuncs[0][0], rgFuncsRows, 8);
+    if (connections > 0)
+        DebugPrintW(L"[MultithreadCrash] Batching over %d server connections\n", connections);
+
     // Initialize direct MdCallBack12 access
     if (InitMdCallBack12())
     {
@@ -866,6 +1245,10 @@ __declspec(dllexport) int WINAPI xlAutoOpen(void)
         }
     }
 
+    // Reclaim retired objects whenever a recalculation finishes or stops
+    Excel12f(xlEventRegister, 0, 2, TempStr12(L"mcCalcEnded"), TempInt12(xleventCalculationEnded));
+    Excel12f(xlEventRegister, 0, 2, TempStr12(L"mcCalcCanceled"), TempInt12(xleventCalculationCanceled));
+
     Excel12f(xlFree, 0, 1, (LPXLOPER12)&xDLL);
     return 1;
 }
@@ -874,6 +1257,14 @@ __declspec(dllexport) int WINAPI xlAutoClose(void)
 {
     for (int i = 0; i < rgFuncsRows; i++)
         Excel12f(xlfSetName, 0, 1, TempStr12(rgFuncs[i][2]));
+    AllocTrackDump(NULL);   // Final allocation table, if XLL_ALLOC_DUMP is set
+    CallTraceStop();
+    TimelineStop();
+    ThreadUsageStop();
+    MetricsClose();         // Last snapshot while the cache is still mapped
+    ResultCacheClose();
+    MicroBatchClose();
+    WorkerPoolClose();
     return 1;
 }
 
@@ -881,10 +1272,7 @@ __declspec(dllexport) int WINAPI xlAutoClose(void)
 __declspec(dllexport) void WINAPI xlAutoFree12(LPXLOPER12 p)
 {
     if (!p) return;
-    if ((p->xltype & xltypeStr) == xltypeStr)
-    {
-        if (p->val.str)
-            GlobalFree(p->val.str);
-    }
+    AllocTrackAutoFree(p);
+    XlFreeResult(p);    // String payload, or array and its element strings (nothing for packed arrays)
     GlobalFree(p);
 }
@@ -11,6 +11,22 @@
 #include <xlcall.h>
 #include <framewrk.h>
 #include <stdarg.h>
+#include "UdfHooks.h"
+#include "AllocTrack.h"
+#include "XlHelpers.h"
+#include "CallTrace.h"
+#include "Timeline.h"
+#include "ThreadContext.h"
+#include "HandleStore.h"
+#include "Cancel.h"
+#include "RangeAgg.h"
+#include "ThreadUsage.h"
+#include "Reduce.h"
+#include "Lookup.h"
+#include "Metrics.h"
+#include "MonteCarlo.h"
+#include "RefData.h"
+#include "Marshal.h"
 
 // Debug output helper: writes formatted wide string to debugger output
 static void DebugPrintW(const wchar_t* fmt, ...)
@@ -31,30 +47,141 @@ static XLOPER12 g_reg_cDoubleInner = { 0 };
 **
 ** This is a table of all functions exported by this module.
 ** These functions are registered in xlAutoOpen when the XLL loads.
-** Format matches the last 7 arguments to REGISTER function.
-*/
-#define rgFuncsRows 15
-
-static const LPWSTR rgFuncs[rgFuncsRows][7] = {
-    {(LPWSTR)L"ThreadSafeCFunction", (LPWSTR)L"QQ$", (LPWSTR)L"ThreadSafeCFunction", (LPWSTR)L"input", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Thread-safe version using manual allocation"},
-    {(LPWSTR)L"ThreadSafeCalc", (LPWSTR)L"BB$", (LPWSTR)L"ThreadSafeCalc", (LPWSTR)L"number", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Thread-safe calculation with $ flag"},
-    {(LPWSTR)L"ThreadSafeXLOPER", (LPWSTR)L"QQ$", (LPWSTR)L"ThreadSafeXLOPER", (LPWSTR)L"input", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Thread-safe XLOPER12 function"},
-    {(LPWSTR)L"AllocatedMemoryFunction", (LPWSTR)L"QQ$", (LPWSTR)L"AllocatedMemoryFunction", (LPWSTR)L"size", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Returns allocated memory requiring xlFree"},
-    {(LPWSTR)L"ThreadInfoFunction", (LPWSTR)L"Q$", (LPWSTR)L"ThreadInfoFunction", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Returns thread info - thread safe"},
-    {(LPWSTR)L"cInnerThreadInfo", (LPWSTR)L"Q$", (LPWSTR)L"cInnerThreadInfo", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Inner thread info for nested call"},
-    {(LPWSTR)L"cNestedThreadInfo", (LPWSTR)L"Q$", (LPWSTR)L"cNestedThreadInfo", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Outer+Inner thread info via XlCall"},
-    {(LPWSTR)L"cNestedThreadInfoEx", (LPWSTR)L"QB$", (LPWSTR)L"cNestedThreadInfoEx", (LPWSTR)L"external", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Outer+Inner thread info, choose external C# call"},
+** Format matches the last 7 arguments to REGISTER function, followed by the
+** function's concurrency limit (Common/Governor.h; empty: not governed).
+*/
+#define rgFuncsRows 71
+
+// Function ids used by UDF_ENTER: must match the row order of rgFuncs
+enum
+{
+    FN_ThreadSafeCFunction,
+    FN_ThreadSafeCalc,
+    FN_ThreadSafeXLOPER,
+    FN_AllocatedMemoryFunction,
+    FN_ThreadInfoFunction,
+    FN_cInnerThreadInfo,
+    FN_cNestedThreadInfo,
+    FN_cNestedThreadInfoEx,
+    FN_cDoubleInner,
+    FN_cDoubleCaller,
+    FN_cXDoubleInner,
+    FN_cXDoubleCaller,
+    FN_cXStringInner,
+    FN_cXStringCaller,
+    FN_cDoubleCallerTLS,
+    FN_cAllocStats,
+    FN_cAllocStatsDump,
+    FN_cCallTrace,
+    FN_cTimeline,
+    FN_cXStringColumn,
+    FN_cEpochStats,
+    FN_cCalcEnded,
+    FN_cCalcCanceled,
+    FN_cGovernorStats,
+    FN_cThreadContextStats,
+    FN_cArrayFill,
+    FN_cArrayScale,
+    FN_cArraySum,
+    FN_cHandleStats,
+    FN_cPiSeries,
+    FN_cCancelStats,
+    FN_cRangeAgg,
+    FN_cRangeAggStats,
+    FN_cThreadUsage,
+    FN_cThreadUsageStats,
+    FN_cReduce,
+    FN_cPercentile,
+    FN_cHistogram,
+    FN_cReduceStats,
+    FN_cLookupIndex,
+    FN_cLookup,
+    FN_cLookupScan,
+    FN_cLookupStats,
+    FN_cMetricsStats,
+    FN_cMonteCarlo,
+    FN_cRandom,
+    FN_cMonteCarloStats,
+    FN_cRefData,
+    FN_cRefDataInfo,
+    FN_cRefDataStats,
+#define MARSHAL_FN(family, code, type, T, read) FN_cMarshal##family##code##1, FN_cMarshal##family##code##4,
+    MARSHAL_KERNELS(MARSHAL_FN)
+#undef MARSHAL_FN
+    FN_cNestProbe,
+};
+
+static const LPWSTR rgFuncs[rgFuncsRows][8] = {
+    {(LPWSTR)L"ThreadSafeCFunction", (LPWSTR)L"QQ$", (LPWSTR)L"ThreadSafeCFunction", (LPWSTR)L"input", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Thread-safe version using manual allocation", (LPWSTR)L""},
+    {(LPWSTR)L"ThreadSafeCalc", (LPWSTR)L"BB$", (LPWSTR)L"ThreadSafeCalc", (LPWSTR)L"number", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Thread-safe calculation with $ flag", (LPWSTR)L""},
+    {(LPWSTR)L"ThreadSafeXLOPER", (LPWSTR)L"QQ$", (LPWSTR)L"ThreadSafeXLOPER", (LPWSTR)L"input", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Thread-safe XLOPER12 function", (LPWSTR)L""},
+    {(LPWSTR)L"AllocatedMemoryFunction", (LPWSTR)L"QQ$", (LPWSTR)L"AllocatedMemoryFunction", (LPWSTR)L"size", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Returns allocated memory requiring xlFree", (LPWSTR)L""},
+    {(LPWSTR)L"ThreadInfoFunction", (LPWSTR)L"Q$", (LPWSTR)L"ThreadInfoFunction", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Returns thread info - thread safe", (LPWSTR)L""},
+    {(LPWSTR)L"cInnerThreadInfo", (LPWSTR)L"Q$", (LPWSTR)L"cInnerThreadInfo", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Inner thread info for nested call", (LPWSTR)L""},
+    {(LPWSTR)L"cNestedThreadInfo", (LPWSTR)L"Q$", (LPWSTR)L"cNestedThreadInfo", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Outer+Inner thread info via XlCall", (LPWSTR)L""},
+    {(LPWSTR)L"cNestedThreadInfoEx", (LPWSTR)L"QB$", (LPWSTR)L"cNestedThreadInfoEx", (LPWSTR)L"external", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Outer+Inner thread info, choose external C# call", (LPWSTR)L""},
     // Doubles as parameters (no XLOPERs)
-    {(LPWSTR)L"cDoubleInner", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleInner", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Inner double add (no XLOPER)"},
-    {(LPWSTR)L"cDoubleCaller", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCaller", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls cDoubleInner via XlCall (no XLOPER)"},
+    {(LPWSTR)L"cDoubleInner", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleInner", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Inner double add (no XLOPER)", (LPWSTR)L""},
+    {(LPWSTR)L"cDoubleCaller", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCaller", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls cDoubleInner via XlCall (no XLOPER)", (LPWSTR)L""},
     // Doubles wrapped inside XLOPER12
-    {(LPWSTR)L"cXDoubleInner", (LPWSTR)L"QQQ$", (LPWSTR)L"cXDoubleInner", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Inner double add (XLOPER)"},
-    {(LPWSTR)L"cXDoubleCaller", (LPWSTR)L"QQQ$", (LPWSTR)L"cXDoubleCaller", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls cXDoubleInner via XlCall (XLOPER)"},
+    {(LPWSTR)L"cXDoubleInner", (LPWSTR)L"QQQ$", (LPWSTR)L"cXDoubleInner", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Inner double add (XLOPER)", (LPWSTR)L""},
+    {(LPWSTR)L"cXDoubleCaller", (LPWSTR)L"QQQ$", (LPWSTR)L"cXDoubleCaller", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls cXDoubleInner via XlCall (XLOPER)", (LPWSTR)L""},
     // Strings inside XLOPER12
-    {(LPWSTR)L"cXStringInner", (LPWSTR)L"QQ$", (LPWSTR)L"cXStringInner", (LPWSTR)L"text", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Inner string echo (XLOPER)"},
-    {(LPWSTR)L"cXStringCaller", (LPWSTR)L"QQ$", (LPWSTR)L"cXStringCaller", (LPWSTR)L"text", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls cXStringInner via XlCall (XLOPER)"},
+    {(LPWSTR)L"cXStringInner", (LPWSTR)L"QQ$", (LPWSTR)L"cXStringInner", (LPWSTR)L"text", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Inner string echo (XLOPER)", (LPWSTR)L""},
+    {(LPWSTR)L"cXStringCaller", (LPWSTR)L"QQ$", (LPWSTR)L"cXStringCaller", (LPWSTR)L"text", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls cXStringInner via XlCall (XLOPER)", (LPWSTR)L""},
     // Doubles no-Temp helpers (per-thread allocated args)
-    {(LPWSTR)L"cDoubleCallerTLS", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerTLS", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls cDoubleInner via per-thread XLOPERs (no Temp)"}
+    {(LPWSTR)L"cDoubleCallerTLS", (LPWSTR)L"BBB$", (LPWSTR)L"cDoubleCallerTLS", (LPWSTR)L"x,y", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls cDoubleInner via per-thread XLOPERs (no Temp)", (LPWSTR)L""},
+    // Allocation accounting (Common/AllocTrack.c)
+    {(LPWSTR)L"cAllocStats", (LPWSTR)L"QB$", (LPWSTR)L"cAllocStats", (LPWSTR)L"detail", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Allocation counts, live bytes and peak per function (detail<>0: per thread)", (LPWSTR)L""},
+    {(LPWSTR)L"cAllocStatsDump", (LPWSTR)L"QQ$", (LPWSTR)L"cAllocStatsDump", (LPWSTR)L"path", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Writes the per function and thread allocation table as CSV", (LPWSTR)L""},
+    {(LPWSTR)L"cCallTrace", (LPWSTR)L"QQ$", (LPWSTR)L"cCallTrace", (LPWSTR)L"path", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Starts recording UDF calls to path, or stops when path is empty", (LPWSTR)L""},
+    {(LPWSTR)L"cTimeline", (LPWSTR)L"QQ$", (LPWSTR)L"cTimeline", (LPWSTR)L"path", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Starts a Chrome trace timeline written to path, or stops and writes it when path is empty", (LPWSTR)L""},
+    {(LPWSTR)L"cXStringColumn", (LPWSTR)L"QQ$", (LPWSTR)L"cXStringColumn", (LPWSTR)L"range", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"cXStringInner over a whole range: Echo: prefixed copies, one allocation", (LPWSTR)L"auto"},
+    {(LPWSTR)L"cEpochStats", (LPWSTR)L"Q$", (LPWSTR)L"cEpochStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Epoch reclamation counters: retired, reclaimed and pending objects", (LPWSTR)L""},
+    {(LPWSTR)L"cCalcEnded", (LPWSTR)L"J", (LPWSTR)L"cCalcEnded", (LPWSTR)L"", (LPWSTR)L"2", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"xleventCalculationEnded handler", (LPWSTR)L""},
+    {(LPWSTR)L"cCalcCanceled", (LPWSTR)L"J", (LPWSTR)L"cCalcCanceled", (LPWSTR)L"", (LPWSTR)L"2", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"xleventCalculationCanceled handler", (LPWSTR)L""},
+    {(LPWSTR)L"cGovernorStats", (LPWSTR)L"Q$", (LPWSTR)L"cGovernorStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Concurrency limits of governed functions: current, tuned range, waits and latency", (LPWSTR)L""},
+    {(LPWSTR)L"cThreadContextStats", (LPWSTR)L"Q$", (LPWSTR)L"cThreadContextStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Per-thread contexts: live, pooled, attached and detached", (LPWSTR)L""},
+    // Array chain: results as arrays or as handles to matrices kept in the XLL (Common/HandleStore.h)
+    {(LPWSTR)L"cArrayFill", (LPWSTR)L"QBBBB$", (LPWSTR)L"cArrayFill", (LPWSTR)L"rows,columns,seed,handle", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"rows x columns matrix of seed+index; handle<>0 returns a handle instead of the array", (LPWSTR)L""},
+    {(LPWSTR)L"cArrayScale", (LPWSTR)L"QQBB$", (LPWSTR)L"cArrayScale", (LPWSTR)L"source,factor,handle", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Multiplies an array or handle by factor; handle<>0 returns a handle", (LPWSTR)L""},
+    {(LPWSTR)L"cArraySum", (LPWSTR)L"BQ$", (LPWSTR)L"cArraySum", (LPWSTR)L"source", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Sum of an array or handle", (LPWSTR)L""},
+    {(LPWSTR)L"cHandleStats", (LPWSTR)L"Q$", (LPWSTR)L"cHandleStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Handle store: live objects and bytes, acquires, stale handles and drops", (LPWSTR)L""},
+    // Long-running kernel that stops on Esc or past its budget (Common/Cancel.h)
+    {(LPWSTR)L"cPiSeries", (LPWSTR)L"QBBB$", (LPWSTR)L"cPiSeries", (LPWSTR)L"terms,maxMs,partial", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Leibniz series for pi over terms; stops after maxMs (partial<>0: returns the sum so far) or on Esc", (LPWSTR)L""},
+    {(LPWSTR)L"cCancelStats", (LPWSTR)L"Q$", (LPWSTR)L"cCancelStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Cancellation: calls stopped by Esc or deadline, slow checks and xlAbort calls", (LPWSTR)L""},
+    // Incremental statistics over large ranges (Common/RangeAgg.h)
+    {(LPWSTR)L"cRangeAgg", (LPWSTR)L"QQQB$", (LPWSTR)L"cRangeAgg", (LPWSTR)L"range,stat,full", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"count, sum, mean, var, stdev, min or max of range, recomputing only changed blocks (full<>0: all)", (LPWSTR)L""},
+    {(LPWSTR)L"cRangeAggStats", (LPWSTR)L"Q$", (LPWSTR)L"cRangeAggStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Incremental aggregates: calls, snapshot hits and rebuilds, blocks checked and recomputed", (LPWSTR)L""},
+    // Calc-thread utilisation per calculation cycle (Common/ThreadUsage.h)
+    {(LPWSTR)L"cThreadUsage", (LPWSTR)L"QQ$", (LPWSTR)L"cThreadUsage", (LPWSTR)L"path", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Starts tracking calc-thread utilisation, or stops and writes the CSV to the path given at start when path is empty", (LPWSTR)L""},
+    {(LPWSTR)L"cThreadUsageStats", (LPWSTR)L"QB$", (LPWSTR)L"cThreadUsageStats", (LPWSTR)L"cycles", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Per calc thread over the last cycles (0: all kept): busy time, utilisation, load, gaps, longest call, straggler tail", (LPWSTR)L""},
+    // Parallel SIMD reductions over large ranges (Common/Reduce.h)
+    {(LPWSTR)L"cReduce", (LPWSTR)L"QQQ$", (LPWSTR)L"cReduce", (LPWSTR)L"range,stat", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"count, sum, mean, var, stdev, min or max of range: compensated SIMD sums, split across threads", (LPWSTR)L""},
+    {(LPWSTR)L"cPercentile", (LPWSTR)L"QQQ$", (LPWSTR)L"cPercentile", (LPWSTR)L"range,p", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"PERCENTILE.INC of range at p (a number or an array of them)", (LPWSTR)L""},
+    {(LPWSTR)L"cHistogram", (LPWSTR)L"QQQ$", (LPWSTR)L"cHistogram", (LPWSTR)L"range,edges", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"FREQUENCY of range over ascending edges: one count per edge, then the count above the last", (LPWSTR)L""},
+    {(LPWSTR)L"cReduceStats", (LPWSTR)L"Q$", (LPWSTR)L"cReduceStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Reductions: calls, cells, calls shared with helper threads and chunks they ran", (LPWSTR)L""},
+    // Lookups through shared hash and sorted indexes kept in the handle store (Common/Lookup.h)
+    {(LPWSTR)L"cLookupIndex", (LPWSTR)L"QQ$", (LPWSTR)L"cLookupIndex", (LPWSTR)L"table", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Handle of a lookup index over table's first column, shared by every table with the same content", (LPWSTR)L""},
+    {(LPWSTR)L"cLookup", (LPWSTR)L"QQQBB$", (LPWSTR)L"cLookup", (LPWSTR)L"key,index,column,mode", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"column of the row matching key through an index (0: row number); mode 0 exact, 1 largest key <= key, -1 smallest >=", (LPWSTR)L""},
+    {(LPWSTR)L"cLookupScan", (LPWSTR)L"QQQBB$", (LPWSTR)L"cLookupScan", (LPWSTR)L"key,table,column,mode", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"The same as cLookup by scanning table on every call", (LPWSTR)L""},
+    {(LPWSTR)L"cLookupStats", (LPWSTR)L"Q$", (LPWSTR)L"cLookupStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Lookups: index builds and reuses, keys looked up and found, rows scanned", (LPWSTR)L""},
+    {(LPWSTR)L"cMetricsStats", (LPWSTR)L"Q$", (LPWSTR)L"cMetricsStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Metrics segment: path, publishes, interval and publish time", (LPWSTR)L""},
+    {(LPWSTR)L"cMonteCarlo", (LPWSTR)L"QBBBBBBBBQQ$", (LPWSTR)L"cMonteCarlo", (LPWSTR)L"spot,strike,rate,vol,maturity,steps,paths,seed,generator,threads", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Asian call price and standard error by Monte Carlo on philox or threefry; the same to the bit on any number of threads", (LPWSTR)L""},
+    {(LPWSTR)L"cRandom", (LPWSTR)L"QBBBQ$", (LPWSTR)L"cRandom", (LPWSTR)L"seed,first,count,generator", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"count uniforms from number first of the seed's counter-based stream, as a column", (LPWSTR)L""},
+    {(LPWSTR)L"cMonteCarloStats", (LPWSTR)L"Q$", (LPWSTR)L"cMonteCarloStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Monte Carlo: calls, paths, path steps, batches and uniforms drawn", (LPWSTR)L""},
+    // Lookups into reference data files mapped read-only at load (Common/RefData.h)
+    {(LPWSTR)L"cRefData", (LPWSTR)L"QQQQ$", (LPWSTR)L"cRefData", (LPWSTR)L"dataset,key,column", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"column (a name or number; 0: row number) of the row matching key (or each key of an array) in a mapped dataset", (LPWSTR)L""},
+    {(LPWSTR)L"cRefDataInfo", (LPWSTR)L"QQ$", (LPWSTR)L"cRefDataInfo", (LPWSTR)L"dataset", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Columns of a mapped dataset, or with none every dataset's rows, size and open time", (LPWSTR)L""},
+    {(LPWSTR)L"cRefDataStats", (LPWSTR)L"Q$", (LPWSTR)L"cRefDataStats", (LPWSTR)L"", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Reference data: datasets and bytes mapped, open time, keys looked up and found, index probes", (LPWSTR)L""},
+    // The same checksum kernel under every argument type code, one and four arguments (Common/Marshal.h)
+#define MARSHAL_ROWS(family, code, type, T, read) \
+    {(LPWSTR)L"cMarshal" #family #code "1", (LPWSTR)L"B" type L"$", (LPWSTR)L"cMarshal" #family #code "1", (LPWSTR)L"a", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Marshalling probe: checksum of a, the same for every type code", (LPWSTR)L""}, \
+    {(LPWSTR)L"cMarshal" #family #code "4", (LPWSTR)L"B" type type type type L"$", (LPWSTR)L"cMarshal" #family #code "4", (LPWSTR)L"a,b,c,d", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Marshalling probe: checksum of a to d, the same for every type code", (LPWSTR)L""},
+    MARSHAL_KERNELS(MARSHAL_ROWS)
+#undef MARSHAL_ROWS
+    // Nested xlUDF round trips, level by level, optionally alternating with ThreadSafeNet
+    {(LPWSTR)L"cNestProbe", (LPWSTR)L"QBB$", (LPWSTR)L"cNestProbe", (LPWSTR)L"depth,alternate", (LPWSTR)L"1", (LPWSTR)L"Thread Safe Demo", (LPWSTR)L"Calls itself via XlCall depth levels deep (alternate<>0: every other level is .NET csNestProbe); per level: level, add-in, thread, entry and exit us, round trip us", (LPWSTR)L""},
 };
 
 /*
@@ -66,6 +193,7 @@ static const LPWSTR rgFuncs[rgFuncsRows][7] = {
 */
 __declspec(dllexport) LPXLOPER12 WINAPI ThreadSafeCFunction(LPXLOPER12 input)
 {
+    UDF_ENTER_ARGS(FN_ThreadSafeCFunction, &input);
     double inputValue = 0.0;
     DWORD threadId = GetCurrentThreadId();
     LPXLOPER12 result;
@@ -90,7 +218,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI ThreadSafeCFunction(LPXLOPER12 input)
         result->xltype = xltypeNum | xlbitDLLFree;
         result->val.num = value;
     }
-    return result;
+    UDF_RETURN(result);
 }
 
 /*
@@ -101,6 +229,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI ThreadSafeCFunction(LPXLOPER12 input)
 */
 __declspec(dllexport) double WINAPI ThreadSafeCalc(double number)
 {
+    UDF_ENTER_ARGS(FN_ThreadSafeCalc, &number);
     DWORD threadId = GetCurrentThreadId();
     
     // Simulate some calculation work
@@ -109,7 +238,7 @@ __declspec(dllexport) double WINAPI ThreadSafeCalc(double number)
     // Thread-safe calculation using only stack variables
     double result = number * number + sin(number) + (double)threadId;
     
-    return result;
+    UDF_RETURN(result);
 }
 
 /*
@@ -120,6 +249,7 @@ __declspec(dllexport) double WINAPI ThreadSafeCalc(double number)
 */
 __declspec(dllexport) LPXLOPER12 WINAPI ThreadSafeXLOPER(LPXLOPER12 input)
 {
+    UDF_ENTER_ARGS(FN_ThreadSafeXLOPER, &input);
     double inputValue = 0.0;
     DWORD threadId = GetCurrentThreadId();
     LPXLOPER12 result;
@@ -142,7 +272,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI ThreadSafeXLOPER(LPXLOPER12 input)
         result->val.num = inputValue * 2.0 + (double)threadId;
     }
     
-    return result;
+    UDF_RETURN(result);
 }
 
 /*
@@ -153,6 +283,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI ThreadSafeXLOPER(LPXLOPER12 input)
 */
 __declspec(dllexport) LPXLOPER12 WINAPI AllocatedMemoryFunction(LPXLOPER12 sizeInput)
 {
+    UDF_ENTER_ARGS(FN_AllocatedMemoryFunction, &sizeInput);
     int size = 5; // Default size
     LPXLOPER12 result;
     LPXLOPER12 arrayData;
@@ -175,14 +306,14 @@ __declspec(dllexport) LPXLOPER12 WINAPI AllocatedMemoryFunction(LPXLOPER12 sizeI
     
     // Allocate the main XLOPER12
     result = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-    if (!result) return NULL;
+    if (!result) UDF_RETURN(NULL);
     
     // Allocate array data
     arrayData = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, size * sizeof(XLOPER12));
     if (!arrayData)
     {
         GlobalFree(result);
-        return NULL;
+        UDF_RETURN(NULL);
     }
     
     // Fill the array with thread ID + index values
@@ -198,7 +329,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI AllocatedMemoryFunction(LPXLOPER12 sizeI
     result->val.array.rows = size;
     result->val.array.columns = 1;
     
-    return result;
+    UDF_RETURN(result);
 }
 
 /*
@@ -209,6 +340,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI AllocatedMemoryFunction(LPXLOPER12 sizeI
 */
 __declspec(dllexport) LPXLOPER12 WINAPI ThreadInfoFunction(void)
 {
+    UDF_ENTER(FN_ThreadInfoFunction);
     DWORD threadId = GetCurrentThreadId();
     LPXLOPER12 result;
     wchar_t buffer[256];
@@ -239,7 +371,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI ThreadInfoFunction(void)
         }
     }
     
-    return result;
+    UDF_RETURN(result);
 }
 
 /*
@@ -248,6 +380,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI ThreadInfoFunction(void)
 */
 __declspec(dllexport) LPXLOPER12 WINAPI cInnerThreadInfo(void)
 {
+    UDF_ENTER(FN_cInnerThreadInfo);
     DWORD threadId = GetCurrentThreadId();
     LPXLOPER12 result;
     wchar_t buffer[64];
@@ -274,7 +407,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cInnerThreadInfo(void)
             result = NULL;
         }
     }
-    return result;
+    UDF_RETURN(result);
 }
 
 /*
@@ -283,6 +416,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cInnerThreadInfo(void)
 */
 __declspec(dllexport) LPXLOPER12 WINAPI cNestedThreadInfo(void)
 {
+    UDF_ENTER(FN_cNestedThreadInfo);
     DWORD outerThreadId = GetCurrentThreadId();
     XLOPER12 inner;
     int callRes;
@@ -298,7 +432,10 @@ __declspec(dllexport) LPXLOPER12 WINAPI cNestedThreadInfo(void)
     outerLen = wcslen(outerPart);
 
     // Call inner function via Excel
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
     callRes = Excel12f(xlUDF, &inner, 1, TempStr12(L"cInnerThreadInfo"));
+    UdfCallbackEnd(&cb);
     if (callRes == xlretSuccess && (inner.xltype & xltypeStr) == xltypeStr && inner.val.str)
     {
         // inner.val.str is Excel-style Pascal string [len][chars...]
@@ -341,7 +478,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cNestedThreadInfo(void)
         Excel12f(xlFree, 0, 1, (LPXLOPER12)&inner);
     }
 
-    return result;
+    UDF_RETURN(result);
 }
 
 /*
@@ -350,6 +487,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cNestedThreadInfo(void)
 */
 __declspec(dllexport) LPXLOPER12 WINAPI cNestedThreadInfoEx(double external)
 {
+    UDF_ENTER_ARGS(FN_cNestedThreadInfoEx, &external);
     DWORD outerThreadId = GetCurrentThreadId();
     XLOPER12 inner;
     int callRes;
@@ -364,7 +502,10 @@ __declspec(dllexport) LPXLOPER12 WINAPI cNestedThreadInfoEx(double external)
     swprintf_s(outerPart, 64, L"OuterThread:%lu; ", outerThreadId);
     outerLen = wcslen(outerPart);
 
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
     callRes = Excel12f(xlUDF, &inner, 1, TempStr12((LPWSTR)target));
+    UdfCallbackEnd(&cb);
     if (callRes == xlretSuccess && (inner.xltype & xltypeStr) == xltypeStr && inner.val.str)
     {
         innerLen = (size_t)inner.val.str[0];
@@ -403,27 +544,130 @@ __declspec(dllexport) LPXLOPER12 WINAPI cNestedThreadInfoEx(double external)
         Excel12f(xlFree, 0, 1, (LPXLOPER12)&inner);
     }
 
-    return result;
+    UDF_RETURN(result);
+}
+
+/*
+** cNestProbe
+** Nested-call latency probe. Calls itself back through xlUDF until depth levels lie below
+** it (alternate <> 0: every other level is csNestProbe in ThreadSafeNet) and returns one
+** row per level, outermost first: level, add-in (0 C, 1 .NET), thread id, entry and exit
+** time in microseconds of QueryPerformanceCounter, and the level's round trip: its own
+** entry-to-exit time less that of the level below, i.e. what the nested call cost on top
+** of the work it called. The array ends at the first level whose call fails.
+*/
+#define NEST_PROBE_COLUMNS      6
+#define NEST_PROBE_MAX_DEPTH    32
+
+static double NestProbeNowUs(void)
+{
+    static double usPerTick;    // Same value from every thread, so the race is benign
+    LARGE_INTEGER now;
+
+    if (usPerTick == 0.0)
+    {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        usPerTick = 1e6 / (double)freq.QuadPart;
+    }
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * usPerTick;
+}
+
+static double NestProbeCell(const XLOPER12* x)
+{
+    return (x->xltype & ~xlbitXLFree) == xltypeNum ? x->val.num : 0.0;
+}
+
+__declspec(dllexport) LPXLOPER12 WINAPI cNestProbe(double depth, double alternate)
+{
+    UDF_ENTER_ARGS(FN_cNestProbe, &depth, &alternate);
+    double entryUs = NestProbeNowUs(), exitUs, innerUs = 0.0;
+    XLOPER12 inner;
+    int callRes = xlretFailed, innerRows = 0, r, c;
+    LPXLOPER12 result, row;
+
+    if (depth < 0.0 || depth > NEST_PROBE_MAX_DEPTH || depth != floor(depth))
+    {
+        result = XlNewErr(xlerrValue);
+        UDF_RETURN(result);
+    }
+
+    if (depth >= 1.0)
+    {
+        // Arguments on this level's stack: framework temporaries would pile up one set per level
+        const wchar_t* target = alternate != 0.0 ? L"csNestProbe" : L"cNestProbe";
+        XCHAR name[16];
+        XLOPER12 fn, below, alt;
+        UdfCallback cb;
+
+        name[0] = (XCHAR)wcslen(target);
+        wcscpy_s(&name[1], 15, target);
+        fn.xltype = xltypeStr;
+        fn.val.str = name;
+        XlSetNum(&below, depth - 1.0);
+        XlSetNum(&alt, alternate);
+        UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
+        callRes = Excel12f(xlUDF, &inner, 3, &fn, &below, &alt);
+        UdfCallbackEnd(&cb);
+    }
+    exitUs = NestProbeNowUs();
+    if (callRes == xlretSuccess && (inner.xltype & xltypeMulti) == xltypeMulti &&
+        inner.val.array.columns == NEST_PROBE_COLUMNS && inner.val.array.rows <= NEST_PROBE_MAX_DEPTH)
+    {
+        innerRows = inner.val.array.rows;
+        innerUs = NestProbeCell(&inner.val.array.lparray[4]) - NestProbeCell(&inner.val.array.lparray[3]);
+    }
+
+    result = XlNewMulti(1 + innerRows, NEST_PROBE_COLUMNS);
+    if (result)
+    {
+        row = result->val.array.lparray;
+        XlSetNum(&row[0], 0.0);
+        XlSetNum(&row[1], 0.0);
+        XlSetNum(&row[2], (double)GetCurrentThreadId());
+        XlSetNum(&row[3], entryUs);
+        XlSetNum(&row[4], exitUs);
+        XlSetNum(&row[5], exitUs - entryUs - innerUs);
+        for (r = 0; r < innerRows; r++)
+        {
+            row = &result->val.array.lparray[(r + 1) * NEST_PROBE_COLUMNS];
+            for (c = 0; c < NEST_PROBE_COLUMNS; c++)
+                XlSetNum(&row[c], NestProbeCell(&inner.val.array.lparray[r * NEST_PROBE_COLUMNS + c]));
+            XlSetNum(&row[0], row[0].val.num + 1.0);
+        }
+    }
+
+    if (callRes == xlretSuccess)
+        Excel12f(xlFree, 0, 1, (LPXLOPER12)&inner);
+    UDF_RETURN(result);
 }
 
 // ===== Doubles (no XLOPERs) =====
 __declspec(dllexport) double WINAPI cDoubleInner(double x, double y)
 {
-    return x + y;
+    UDF_ENTER_ARGS(FN_cDoubleInner, &x, &y);
+    double result = x + y;
+    UDF_RETURN(result);
 }
 
 __declspec(dllexport) double WINAPI cDoubleCaller(double x, double y)
 {
+    UDF_ENTER_ARGS(FN_cDoubleCaller, &x, &y);
     XLOPER12 ret;
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
     int rc = Excel12f(xlUDF, &ret, 3, TempStr12(L"cDoubleInner"), TempNum12(x), TempNum12(y));
+    UdfCallbackEnd(&cb);
     if (rc == xlretSuccess && (ret.xltype & xltypeNum) == xltypeNum)
-        return ret.val.num;
-    return 0.0;
+        UDF_RETURN(ret.val.num);
+    UDF_RETURN(0.0);
 }
 
 // ===== Doubles inside XLOPERs =====
 __declspec(dllexport) LPXLOPER12 WINAPI cXDoubleInner(LPXLOPER12 x, LPXLOPER12 y)
 {
+    UDF_ENTER_ARGS(FN_cXDoubleInner, &x, &y);
     double xv = 0.0, yv = 0.0;
     if (x)
     {
@@ -441,15 +685,19 @@ __declspec(dllexport) LPXLOPER12 WINAPI cXDoubleInner(LPXLOPER12 x, LPXLOPER12 y
         res->xltype = xltypeNum | xlbitDLLFree;
         res->val.num = xv + yv;
     }
-    return res;
+    UDF_RETURN(res);
 }
 
 __declspec(dllexport) LPXLOPER12 WINAPI cXDoubleCaller(LPXLOPER12 x, LPXLOPER12 y)
 {
+    UDF_ENTER_ARGS(FN_cXDoubleCaller, &x, &y);
     XLOPER12 inner;
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
     int rc = Excel12f(xlUDF, &inner, 3, TempStr12(L"cXDoubleInner"), (LPXLOPER12)x, (LPXLOPER12)y);
+    UdfCallbackEnd(&cb);
     LPXLOPER12 res = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-    if (!res) return NULL;
+    if (!res) UDF_RETURN(NULL);
     if (rc == xlretSuccess && (inner.xltype & xltypeNum) == xltypeNum)
     {
         res->xltype = xltypeNum | xlbitDLLFree;
@@ -460,12 +708,13 @@ __declspec(dllexport) LPXLOPER12 WINAPI cXDoubleCaller(LPXLOPER12 x, LPXLOPER12
         res->xltype = xltypeNum | xlbitDLLFree;
         res->val.num = 0.0;
     }
-    return res;
+    UDF_RETURN(res);
 }
 
 // ===== Strings inside XLOPERs =====
 __declspec(dllexport) LPXLOPER12 WINAPI cXStringInner(LPXLOPER12 s)
 {
+    UDF_ENTER_ARGS(FN_cXStringInner, &s);
     const wchar_t* prefix = L"Echo:";
     size_t plen = wcslen(prefix);
     const wchar_t* in = L"";
@@ -477,27 +726,31 @@ __declspec(dllexport) LPXLOPER12 WINAPI cXStringInner(LPXLOPER12 s)
         in = &s->val.str[1];
     }
     LPXLOPER12 res = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-    if (!res) return NULL;
+    if (!res) UDF_RETURN(NULL);
     wchar_t* out = (wchar_t*)GlobalAlloc(GMEM_FIXED, (plen + ilen + 2) * sizeof(wchar_t));
     if (!out)
     {
         GlobalFree(res);
-        return NULL;
+        UDF_RETURN(NULL);
     }
     out[0] = (wchar_t)(plen + ilen);
     wcscpy_s(&out[1], plen + ilen + 1, prefix);
     wcsncat_s(&out[1], plen + ilen + 1, in, ilen);
     res->xltype = xltypeStr | xlbitDLLFree;
     res->val.str = out;
-    return res;
+    UDF_RETURN(res);
 }
 
 __declspec(dllexport) LPXLOPER12 WINAPI cXStringCaller(LPXLOPER12 s)
 {
+    UDF_ENTER_ARGS(FN_cXStringCaller, &s);
     XLOPER12 inner;
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
     int rc = Excel12f(xlUDF, &inner, 2, TempStr12(L"cXStringInner"), (LPXLOPER12)s);
+    UdfCallbackEnd(&cb);
     LPXLOPER12 res = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-    if (!res) return NULL;
+    if (!res) UDF_RETURN(NULL);
     if (rc == xlretSuccess && (inner.xltype & xltypeStr) == xltypeStr && inner.val.str)
     {
         size_t ilen = (size_t)inner.val.str[0];
@@ -505,7 +758,7 @@ __declspec(dllexport) LPXLOPER12 WINAPI cXStringCaller(LPXLOPER12 s)
         if (!out)
         {
             GlobalFree(res);
-            return NULL;
+            UDF_RETURN(NULL);
         }
         out[0] = (wchar_t)ilen;
         wcsncpy_s(&out[1], ilen + 1, &inner.val.str[1], ilen);
@@ -519,58 +772,33 @@ __declspec(dllexport) LPXLOPER12 WINAPI cXStringCaller(LPXLOPER12 s)
         if (!out)
         {
             GlobalFree(res);
-            return NULL;
+            UDF_RETURN(NULL);
         }
         out[0] = 0;
         out[1] = 0;
         res->xltype = xltypeStr | xlbitDLLFree;
         res->val.str = out;
     }
-    return res;
+    UDF_RETURN(res);
 }
 
 /*
 ** cDoubleCallerTLS
-** Calls cDoubleInner via xlUDF using per-thread allocated XLOPER12 arguments (no Temp helpers)
-** Memory is allocated once per thread and never reclaimed during process lifetime
+** Calls cDoubleInner via xlUDF using the thread's own XLOPER12 arguments (no Temp helpers)
+** The arguments live in the thread's context (Common/ThreadContext.h): prepared before the
+** first recalc and reclaimed when the thread exits
 */
 __declspec(dllexport) double WINAPI cDoubleCallerTLS(double x, double y)
 {
-    static __declspec(thread) int tls_init = 0;
-    static __declspec(thread) LPXLOPER12 tls_fn = NULL;
-    static __declspec(thread) LPWSTR     tls_fn_str = NULL;
-    static __declspec(thread) LPXLOPER12 tls_x = NULL;
-    static __declspec(thread) LPXLOPER12 tls_y = NULL;
-
-    if (!tls_init)
-    {
-		// Debug print the thread ID and initialization
-		DWORD threadId = GetCurrentThreadId();
-        DebugPrintW(L"Thread %lu: Initializing TLS XLOPERs\n", threadId);
-
-        // Allocate numeric argument XLOPER12s (per-thread)
-        tls_x = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-        tls_y = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-
-        if (tls_x)
-        {
-            tls_x->xltype = xltypeNum;
-            tls_x->val.num = 0.0;
-        }
-        if (tls_y)
-        {
-            tls_y->xltype = xltypeNum;
-            tls_y->val.num = 0.0;
-        }
-        tls_init = 1;
-    }
+    UDF_ENTER_ARGS(FN_cDoubleCallerTLS, &x, &y);
+    ThreadContext* ctx = ThreadContextGet();
 
     // Debug print the thread ID and current x,y values
     DWORD threadId = GetCurrentThreadId();
     DebugPrintW(L"Thread %lu: Calling cDoubleInner with x=%f, y=%f\n", threadId, x, y);
 
-    if (tls_x) tls_x->val.num = x; 
-    if (tls_y) tls_y->val.num = y;
+    ctx->num[0].val.num = x;
+    ctx->num[1].val.num = y;
 
     XLOPER12 ret;
     LPXLOPER12 fnArg = NULL;
@@ -580,35 +808,738 @@ __declspec(dllexport) double WINAPI cDoubleCallerTLS(double x, double y)
     }
     else
     {
-        // Fallback to per-thread function name XLOPER if register id is not available
+        // Fallback to the context's function name XLOPER if register id is not available
 		DebugPrintW(L"Thread %lu: Using TLS function name for cDoubleInner\n", threadId);
-        if (!tls_fn)
-        {
-            tls_fn = (LPXLOPER12)GlobalAlloc(GMEM_FIXED, sizeof(XLOPER12));
-            tls_fn_str = (LPWSTR)GlobalAlloc(GMEM_FIXED, 32 * sizeof(wchar_t));
-            if (tls_fn && tls_fn_str)
-            {
-                const wchar_t* name = L"cDoubleInner";
-                size_t nlen = wcslen(name);
-                if (nlen > 30) nlen = 30;
-                tls_fn_str[0] = (wchar_t)nlen;
-                wcsncpy_s(&tls_fn_str[1], 31, name, nlen);
-                tls_fn->xltype = xltypeStr;
-                tls_fn->val.str = tls_fn_str;
-            }
-        }
-        fnArg = tls_fn;
+        fnArg = ThreadContextName(ctx, L"cDoubleInner");
     }
 
-    int rc = Excel12f(xlUDF, &ret, 3, fnArg, tls_x, tls_y);
+    UdfCallback cb;
+    UdfCallbackBegin(&cb, UDF_VIA_EXCEL12F, xlUDF);
+    int rc = Excel12f(xlUDF, &ret, 3, fnArg, &ctx->num[0], &ctx->num[1]);
+    UdfCallbackEnd(&cb);
 
     // Debug print the thread IDm rc value and the address of the result, then in the next line the result value
 	DebugPrintW(L"Thread %lu: Excel12f returned rc = %d, ret addr = %p\n", threadId, rc, (rc == xlretSuccess) ? (void*)&ret : NULL);
 
     if (rc == xlretSuccess && (ret.xltype & xltypeNum) == xltypeNum)
-    	DebugPrintW(L"Thread %lu: cDoubleInner result = %f\n", threadId, (rc == xlretSuccess && (ret.xltype & xltypeNum) == xltypeNum) ? ret.val.num : 0.0);
-        return ret.val.num;
-    return 0.0;
+    {
+        DebugPrintW(L"Thread %lu: cDoubleInner result = %f\n", threadId, ret.val.num);
+        UDF_RETURN(ret.val.num);
+    }
+    UDF_RETURN(0.0);
+}
+
+/*
+** cXStringColumn
+** Array version of cXStringInner: returns "Echo:" + s for every cell of range, in the
+** range's shape. The result header, its elements and all strings share one GlobalAlloc
+** block (XlNewPackedMulti), so a 200k-row column costs one allocation and one free
+** instead of 400k. Strings keep up to 32767 characters.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cXStringColumn(LPXLOPER12 range)
+{
+    UDF_ENTER_ARGS(FN_cXStringColumn, &range);
+    static const XCHAR prefix[] = L"Echo:";
+    const size_t plen = _countof(prefix) - 1;
+    int rows = XlArgRows(range), columns = XlArgColumns(range), r, c;
+    size_t chars = 0, len;
+    const XCHAR* in;
+    LPXLOPER12 result;
+    XCHAR* arena;
+
+    // First pass sizes the string arena, second pass fills it
+    for (r = 0; r < rows; r++)
+        for (c = 0; c < columns; c++)
+        {
+            len = plen + XlCellStr(XlArgCell(range, r, c), &in);
+            chars += (len > XL_MAX_STR ? XL_MAX_STR : len) + 2;
+        }
+
+    result = XlNewPackedMulti(rows, columns, chars);
+    if (!result)
+        UDF_RETURN(result);
+    arena = XlPackedArena(result);
+    for (r = 0; r < rows; r++)
+        for (c = 0; c < columns; c++)
+        {
+            len = XlCellStr(XlArgCell(range, r, c), &in);
+            XlSetPackedStr2(&result->val.array.lparray[r * columns + c], &arena, prefix, plen, in, len);
+        }
+    UDF_RETURN(result);
+}
+
+/*
+** Array chain
+** cArrayFill, cArrayScale and cArraySum pass a matrix down a chain of cells either as
+** an array, which Excel copies into the cells and back into the next call, or as a
+** handle string naming the matrix in the handle store (Common/HandleStore.h), which
+** the next call reads in place. Sources may be either; handle<>0 picks the result.
+*/
+typedef struct ArraySource
+{
+    const HandleObject* matrix;     // Acquired from a handle, or NULL for a range
+    const XLOPER12* range;
+    int rows;
+    int columns;
+} ArraySource;
+
+static BOOL ArraySourceOpen(ArraySource* s, const XLOPER12* arg)
+{
+    s->range = arg;
+    s->matrix = NULL;
+    if (arg && (arg->xltype & xltypeStr) == xltypeStr)
+    {
+        s->matrix = HandleAcquireKind(arg, L"Matrix");
+        if (!s->matrix)
+            return FALSE;       // Not a matrix handle, or dropped since
+        s->rows = s->matrix->rows;
+        s->columns = s->matrix->columns;
+        return TRUE;
+    }
+    s->rows = XlArgRows(arg);
+    s->columns = XlArgColumns(arg);
+    return TRUE;
+}
+
+static __forceinline double ArraySourceAt(const ArraySource* s, int r, int c)
+{
+    return s->matrix ? s->matrix->values[r * s->columns + c] : XlArgNum(XlArgCell(s->range, r, c), 0.0);
+}
+
+static void ArraySourceClose(ArraySource* s)
+{
+    HandleRelease(s->matrix);
+}
+
+// Where an array UDF writes its result: a new matrix for a handle, or an xltypeMulti
+typedef struct ArrayResult
+{
+    HandleObject* matrix;
+    LPXLOPER12 multi;
+    int columns;
+} ArrayResult;
+
+static BOOL ArrayResultOpen(ArrayResult* out, int rows, int columns, BOOL asHandle)
+{
+    out->columns = columns;
+    out->matrix = asHandle ? HandleNewMatrix(rows, columns) : NULL;
+    out->multi = asHandle ? NULL : XlNewMulti(rows, columns);
+    return out->matrix || out->multi;
+}
+
+static __forceinline void ArrayResultSet(ArrayResult* out, int r, int c, double value)
+{
+    if (out->matrix)
+        out->matrix->values[r * out->columns + c] = value;
+    else
+        XlSetNum(&out->multi->val.array.lparray[r * out->columns + c], value);
+}
+
+static LPXLOPER12 ArrayResultClose(ArrayResult* out)
+{
+    return out->matrix ? HandlePublish(out->matrix, L"Matrix") : out->multi;
+}
+
+// Frees a result left unfinished by a cancelled call
+static void ArrayResultDiscard(ArrayResult* out)
+{
+    if (out->matrix)
+        HandleDiscard(out->matrix);
+    else
+    {
+        XlFreeResult(out->multi);
+        GlobalFree(out->multi);
+    }
+}
+
+__declspec(dllexport) LPXLOPER12 WINAPI cArrayFill(double rows, double columns, double seed, double handle)
+{
+    UDF_ENTER_ARGS(FN_cArrayFill, &rows, &columns, &seed, &handle);
+    ArrayResult out;
+    CancelToken cancel;
+    LPXLOPER12 result;
+    int nr = (int)rows, nc = (int)columns, r, c;
+
+    if (nr < 1 || nc < 1 || !ArrayResultOpen(&out, nr, nc, handle != 0.0))
+    {
+        result = XlNewErr(xlerrValue);
+        UDF_RETURN(result);
+    }
+    CancelBegin(&cancel, 0.0);
+    for (r = 0; r < nr && !CANCEL_POLL(&cancel); r++)
+        for (c = 0; c < nc; c++)
+            ArrayResultSet(&out, r, c, seed + (double)(r * nc + c));
+    CancelEnd(&cancel);
+    if (cancel.reason != CANCEL_NONE)
+    {
+        ArrayResultDiscard(&out);
+        result = XlNewErr(CANCEL_ERROR);
+        UDF_RETURN(result);
+    }
+    result = ArrayResultClose(&out);
+    UDF_RETURN(result);
+}
+
+__declspec(dllexport) LPXLOPER12 WINAPI cArrayScale(LPXLOPER12 source, double factor, double handle)
+{
+    UDF_ENTER_ARGS(FN_cArrayScale, &source, &factor, &handle);
+    ArraySource in;
+    ArrayResult out;
+    CancelToken cancel;
+    LPXLOPER12 result;
+    int r, c;
+
+    if (!ArraySourceOpen(&in, source))
+    {
+        result = XlNewErr(xlerrValue);
+        UDF_RETURN(result);
+    }
+    if (!ArrayResultOpen(&out, in.rows, in.columns, handle != 0.0))
+    {
+        ArraySourceClose(&in);
+        result = XlNewErr(xlerrNum);
+        UDF_RETURN(result);
+    }
+    CancelBegin(&cancel, 0.0);
+    for (r = 0; r < in.rows && !CANCEL_POLL(&cancel); r++)
+        for (c = 0; c < in.columns; c++)
+            ArrayResultSet(&out, r, c, ArraySourceAt(&in, r, c) * factor);
+    CancelEnd(&cancel);
+    ArraySourceClose(&in);
+    if (cancel.reason != CANCEL_NONE)
+    {
+        ArrayResultDiscard(&out);
+        result = XlNewErr(CANCEL_ERROR);
+        UDF_RETURN(result);
+    }
+    result = ArrayResultClose(&out);
+    UDF_RETURN(result);
+}
+
+__declspec(dllexport) double WINAPI cArraySum(LPXLOPER12 source)
+{
+    UDF_ENTER_ARGS(FN_cArraySum, &source);
+    ArraySource in;
+    CancelToken cancel;
+    double sum = 0.0;
+    int r, c;
+
+    if (!ArraySourceOpen(&in, source))
+        UDF_RETURN(NAN);        // #NUM!: not a handle, or its object is gone
+    CancelBegin(&cancel, 0.0);
+    for (r = 0; r < in.rows && !CANCEL_POLL(&cancel); r++)
+        for (c = 0; c < in.columns; c++)
+            sum += ArraySourceAt(&in, r, c);
+    CancelEnd(&cancel);
+    ArraySourceClose(&in);
+    if (cancel.reason != CANCEL_NONE)
+        sum = NAN;              // #NUM!: a partial sum would look like an answer
+    UDF_RETURN(sum);
+}
+
+/*
+** cHandleStats
+** Handle store counters (see Common/HandleStore.h): live matrices and their bytes,
+** peaks, acquires, handles that had expired, matrices dropped by recalculation, and
+** the cells holding them
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cHandleStats(void)
+{
+    UDF_ENTER(FN_cHandleStats);
+    LPXLOPER12 result = HandleTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cPiSeries
+** 4 * (1 - 1/3 + 1/5 - ...) over 'terms' terms: a loop long enough to need cancelling.
+** It polls a cancellation token (Common/Cancel.h) every term. Past maxMs (<= 0: the
+** XLL_CALL_BUDGET_MS default, or none) it returns the sum so far when partial<>0 and
+** #N/A otherwise; after Esc it returns #N/A.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cPiSeries(double terms, double maxMs, double partial)
+{
+    UDF_ENTER_ARGS(FN_cPiSeries, &terms, &maxMs, &partial);
+    CancelToken cancel;
+    LPXLOPER12 result;
+    double sum = 0.0, sign = 1.0, k, n = floor(terms);
+
+    CancelBegin(&cancel, maxMs);
+    for (k = 0.0; k < n && !CANCEL_POLL(&cancel); k += 1.0)
+    {
+        sum += sign / (2.0 * k + 1.0);
+        sign = -sign;
+    }
+    CancelEnd(&cancel);
+    if (cancel.reason == CANCEL_NONE || (cancel.reason == CANCEL_DEADLINE && partial != 0.0))
+        result = XlNewNum(4.0 * sum);
+    else
+        result = XlNewErr(CANCEL_ERROR);
+    UDF_RETURN(result);
+}
+
+/*
+** cCancelStats
+** Cancellation counters (see Common/Cancel.h): calls stopped by Esc and by their
+** deadline, slow checks made, and how often xlAbort was actually called
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cCancelStats(void)
+{
+    UDF_ENTER(FN_cCancelStats);
+    LPXLOPER12 result = CancelTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cRangeAgg
+** A statistic of range (see Common/RangeAgg.h): each call fingerprints the range's
+** blocks against the snapshot kept for this cell and recomputes only the blocks that
+** changed. stat is count, sum (the default), mean, var, stdev, min or max.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cRangeAgg(LPXLOPER12 range, LPXLOPER12 stat, double full)
+{
+    UDF_ENTER_ARGS(FN_cRangeAgg, &range, &stat, &full);
+    LPXLOPER12 result = RangeAggCompute(range, RangeAggStatFromName(stat), full != 0.0);
+    UDF_RETURN(result);
+}
+
+/*
+** cRangeAggStats
+** Incremental aggregate counters: calls, snapshots found and rebuilt, and how many
+** of the blocks fingerprinted had to be recomputed
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cRangeAggStats(void)
+{
+    UDF_ENTER(FN_cRangeAggStats);
+    LPXLOPER12 result = RangeAggTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cThreadUsage
+** Starts tracking how busy each calc thread is per calculation cycle (see
+** Common/ThreadUsage.h), the CSV to be written to path; with an empty path stops
+** tracking, writes the CSV and returns the number of rows
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cThreadUsage(LPXLOPER12 path)
+{
+    UDF_ENTER_ARGS(FN_cThreadUsage, &path);
+    wchar_t file[MAX_PATH];
+    int rows;
+    LPXLOPER12 result;
+
+    XlArgStr(path, file, _countof(file));
+    if (file[0])
+        result = ThreadUsageStart(file) ? XlNewBool(TRUE) : XlNewErr(xlerrValue);
+    else
+    {
+        rows = ThreadUsageStop();
+        result = rows < 0 ? XlNewErr(xlerrValue) : XlNewNum((double)rows);
+    }
+    UDF_RETURN(result);
+}
+
+/*
+** cThreadUsageStats
+** One row per calc thread over the last cycles tracked (0: all kept): calls, busy
+** time and its share of the cycle windows, load against the mean thread, gaps,
+** the longest call, and the cycles it finished last in with the time it ran alone
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cThreadUsageStats(double cycles)
+{
+    UDF_ENTER_ARGS(FN_cThreadUsageStats, &cycles);
+    LPXLOPER12 result = ThreadUsageTable(cycles > 0.0 ? (int)cycles : 0);
+    UDF_RETURN(result);
+}
+
+/*
+** cReduce
+** A statistic of range (see Common/Reduce.h): count, sum (the default), mean, var,
+** stdev, min or max, with compensated sums over SIMD lanes. Large ranges are split
+** into chunks shared with helper threads; the result does not depend on how many.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cReduce(LPXLOPER12 range, LPXLOPER12 stat)
+{
+    UDF_ENTER_ARGS(FN_cReduce, &range, &stat);
+    LPXLOPER12 result = ReduceStat(range, ReduceStatFromName(stat));
+    UDF_RETURN(result);
+}
+
+/*
+** cPercentile
+** PERCENTILE.INC of the numbers in range at p, or at each p of an array
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cPercentile(LPXLOPER12 range, LPXLOPER12 p)
+{
+    UDF_ENTER_ARGS(FN_cPercentile, &range, &p);
+    LPXLOPER12 result = ReducePercentile(range, p);
+    UDF_RETURN(result);
+}
+
+/*
+** cHistogram
+** FREQUENCY of the numbers in range over ascending edges: a column with the count
+** up to each edge, then the count above the last one
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cHistogram(LPXLOPER12 range, LPXLOPER12 edges)
+{
+    UDF_ENTER_ARGS(FN_cHistogram, &range, &edges);
+    LPXLOPER12 result = ReduceHistogram(range, edges);
+    UDF_RETURN(result);
+}
+
+/*
+** cReduceStats
+** Reduction counters: calls and cells, calls shared with the helper threads or run
+** alone because the helpers were busy, and the chunks the helpers took
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cReduceStats(void)
+{
+    UDF_ENTER(FN_cReduceStats);
+    LPXLOPER12 result = ReduceTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cLookupIndex
+** Builds hash and sorted indexes over the first column of table (see Common/Lookup.h)
+** and returns their handle. A table with the same content as a live index gets that
+** index's handle back; a changed table gets a new one.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cLookupIndex(LPXLOPER12 table)
+{
+    UDF_ENTER_ARGS(FN_cLookupIndex, &table);
+    LPXLOPER12 result = LookupIndexBuild(table);
+    UDF_RETURN(result);
+}
+
+/*
+** cLookup
+** Finds key (or each key of an array) through an index handle: exact by hash, or
+** with mode 1 / -1 the nearest key below / above by binary search. Returns the
+** given column of the row found, or with column 0 its row number.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cLookup(LPXLOPER12 key, LPXLOPER12 index, double column, double mode)
+{
+    UDF_ENTER_ARGS(FN_cLookup, &key, &index, &column, &mode);
+    LPXLOPER12 result = LookupFind(key, index, (int)column, (int)mode);
+    UDF_RETURN(result);
+}
+
+/*
+** cLookupScan
+** cLookup without an index: scans the whole of table for every key
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cLookupScan(LPXLOPER12 key, LPXLOPER12 table, double column, double mode)
+{
+    UDF_ENTER_ARGS(FN_cLookupScan, &key, &table, &column, &mode);
+    LPXLOPER12 result = LookupScan(key, table, (int)column, (int)mode);
+    UDF_RETURN(result);
+}
+
+/*
+** cLookupStats
+** Lookup counters: indexes built and builds answered by a live index, fingerprint
+** collisions, keys looked up and found, and rows read by scans
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cLookupStats(void)
+{
+    UDF_ENTER(FN_cLookupStats);
+    LPXLOPER12 result = LookupTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cMetricsStats
+** The shared-memory metrics segment: its path, snapshots published, the interval
+** and how long the last publish took (see Common/Metrics.h)
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cMetricsStats(void)
+{
+    UDF_ENTER(FN_cMetricsStats);
+    LPXLOPER12 result = MetricsTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cMonteCarlo
+** Price and standard error of an arithmetic-average Asian call on steps fixings
+** (a European call with one step), by Monte Carlo over paths paths (see
+** Common/MonteCarlo.h). generator is philox (the default) or threefry; at most
+** threads threads share the paths (0: all). The result depends on the seed alone.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cMonteCarlo(double spot, double strike, double rate, double vol,
+    double maturity, double steps, double paths, double seed, LPXLOPER12 generator, LPXLOPER12 threads)
+{
+    UDF_ENTER_ARGS(FN_cMonteCarlo, &spot, &strike, &rate, &vol, &maturity, &steps, &paths, &seed, &generator, &threads);
+    LPXLOPER12 result;
+    McModel model;
+    double cap = XlArgNum(threads, 0.0);
+    model.spot = spot;
+    model.strike = strike;
+    model.rate = rate;
+    model.vol = vol;
+    model.maturity = maturity;
+    model.steps = steps >= 1.0 && steps <= MC_MAX_STEPS ? (int)steps : 0;
+    model.paths = paths >= 1.0 && paths <= (double)MC_MAX_PATHS ? (LONGLONG)paths : 0;
+    model.seed = (ULONGLONG)(seed >= 0.0 && seed < 18446744073709551616.0 ? seed : 0.0);
+    model.generator = McGeneratorFromName(generator);
+    if (model.generator < 0)
+        result = XlNewErr(xlerrValue);
+    else
+        result = McPrice(&model, cap > 0.0 ? (int)cap : 0);
+    UDF_RETURN(result);
+}
+
+/*
+** cRandom
+** count uniforms in (0, 1), numbers first to first + count - 1 of the seed's stream,
+** as a column. Number n is the same whatever first and count are.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cRandom(double seed, double first, double count, LPXLOPER12 generator)
+{
+    UDF_ENTER_ARGS(FN_cRandom, &seed, &first, &count, &generator);
+    LPXLOPER12 result;
+    int gen = McGeneratorFromName(generator);
+    if (gen < 0 || seed < 0.0 || first < 0.0)
+        result = XlNewErr(xlerrValue);
+    else
+        result = McUniforms((ULONGLONG)seed, (ULONGLONG)first, count >= 1.0 && count <= MC_MAX_UNIFORMS ? (int)count : 0, gen);
+    UDF_RETURN(result);
+}
+
+/*
+** cMonteCarloStats
+** Monte Carlo counters: calls, paths and path steps simulated, batches and uniforms drawn
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cMonteCarloStats(void)
+{
+    UDF_ENTER(FN_cMonteCarloStats);
+    LPXLOPER12 result = McTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cRefData
+** Looks key (or each key of an array) up in a dataset mapped from XLL_REFDATA (see
+** Common/RefData.h) and returns column of its row, read in place from the mapping.
+** column is a column name or a 1-based number; 0 gives the row number.
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cRefData(LPXLOPER12 dataset, LPXLOPER12 key, LPXLOPER12 column)
+{
+    UDF_ENTER_ARGS(FN_cRefData, &dataset, &key, &column);
+    LPXLOPER12 result = RefDataLookup(dataset, key, column);
+    UDF_RETURN(result);
+}
+
+/*
+** cRefDataInfo
+** The columns of a mapped dataset (name, type, bytes, whether it is the key), or
+** with no dataset one row per dataset: rows, columns, strings, bytes, open time, path
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cRefDataInfo(LPXLOPER12 dataset)
+{
+    UDF_ENTER_ARGS(FN_cRefDataInfo, &dataset);
+    LPXLOPER12 result = RefDataInfo(dataset);
+    UDF_RETURN(result);
+}
+
+/*
+** cRefDataStats
+** Reference data counters: datasets, bytes mapped and time to open them, lookups,
+** keys looked up and found, and index slots probed
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cRefDataStats(void)
+{
+    UDF_ENTER(FN_cRefDataStats);
+    LPXLOPER12 result = RefDataTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cMarshal<family><code><arity>
+** Marshalling probes generated from MARSHAL_KERNELS (Common/Marshal.h): one kernel per
+** argument type code, each returning the same checksum of its one or four arguments,
+** so that timing them against each other isolates what each code costs per call.
+*/
+#define MARSHAL_UDFS(family, code, type, T, read) \
+__declspec(dllexport) double WINAPI cMarshal##family##code##1(T a) \
+{ \
+    UDF_ENTER_ARGS(FN_cMarshal##family##code##1, &a); \
+    double result = read(a); \
+    UDF_RETURN(result); \
+} \
+__declspec(dllexport) double WINAPI cMarshal##family##code##4(T a, T b, T c, T d) \
+{ \
+    UDF_ENTER_ARGS(FN_cMarshal##family##code##4, &a, &b, &c, &d); \
+    double result = read(a) + read(b) + read(c) + read(d); \
+    UDF_RETURN(result); \
+}
+MARSHAL_KERNELS(MARSHAL_UDFS)
+#undef MARSHAL_UDFS
+
+/*
+** cAllocStats
+** Returns the allocation accounting table for this XLL (see Common/AllocTrack.h)
+** detail = 0 gives one row per function, non-zero one row per function and thread
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cAllocStats(double detail)
+{
+    UDF_ENTER_ARGS(FN_cAllocStats, &detail);
+    LPXLOPER12 result = AllocTrackTable(detail != 0.0);
+    UDF_RETURN(result);
+}
+
+/*
+** cAllocStatsDump
+** Writes the per function and thread table as CSV to path and returns the row count
+** An empty path uses %XLL_ALLOC_DUMP%/ThreadSafeC-alloc.csv
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cAllocStatsDump(LPXLOPER12 path)
+{
+    UDF_ENTER_ARGS(FN_cAllocStatsDump, &path);
+    wchar_t file[MAX_PATH];
+    int rows;
+    LPXLOPER12 result;
+
+    XlArgStr(path, file, _countof(file));
+    rows = AllocTrackDump(file);
+    result = rows < 0 ? XlNewErr(xlerrValue) : XlNewNum((double)rows);
+    UDF_RETURN(result);
+}
+
+/*
+** cCallTrace
+** Starts recording every UDF call to path (see Common/CallTrace.h) and returns TRUE,
+** or with an empty path stops recording and returns the number of calls written
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cCallTrace(LPXLOPER12 path)
+{
+    UDF_ENTER_ARGS(FN_cCallTrace, &path);
+    wchar_t file[MAX_PATH];
+    LPXLOPER12 result;
+
+    XlArgStr(path, file, _countof(file));
+    if (file[0])
+        result = CallTraceStart(file) ? XlNewBool(TRUE) : XlNewErr(xlerrValue);
+    else
+        result = XlNewNum((double)CallTraceStop());
+    UDF_RETURN(result);
+}
+
+/*
+** cTimeline
+** Starts recording UDF and callback begin/end events (see Common/Timeline.h) to be
+** written to path as Chrome trace JSON, or with an empty path stops recording, writes
+** the file and returns the number of events
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cTimeline(LPXLOPER12 path)
+{
+    UDF_ENTER_ARGS(FN_cTimeline, &path);
+    wchar_t file[MAX_PATH];
+    LONGLONG events;
+    LPXLOPER12 result;
+
+    XlArgStr(path, file, _countof(file));
+    if (file[0])
+        result = TimelineStart(file) ? XlNewBool(TRUE) : XlNewErr(xlerrValue);
+    else
+    {
+        events = TimelineStop();
+        result = events < 0 ? XlNewErr(xlerrValue) : XlNewNum((double)events);
+    }
+    UDF_RETURN(result);
+}
+
+/*
+** cEpochStats
+** Epoch reclamation counters for this XLL (see Common/Epoch.h)
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cEpochStats(void)
+{
+    UDF_ENTER(FN_cEpochStats);
+    LPXLOPER12 result = EpochTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cGovernorStats
+** Concurrency governors of this XLL (see Common/Governor.h): the limit each one
+** has tuned to, and how often callers had to wait for it
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cGovernorStats(void)
+{
+    UDF_ENTER(FN_cGovernorStats);
+    LPXLOPER12 result = GovernorTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cThreadContextStats
+** Per-thread argument contexts (see Common/ThreadContext.h): how many are in use and
+** pooled, and how threads attached to and detached from them
+*/
+__declspec(dllexport) LPXLOPER12 WINAPI cThreadContextStats(void)
+{
+    UDF_ENTER(FN_cThreadContextStats);
+    LPXLOPER12 result = ThreadContextTable();
+    UDF_RETURN(result);
+}
+
+/*
+** cCalcEnded, cCalcCanceled
+** Calculation event handlers, registered as commands and hooked up with xlEventRegister.
+** The calc threads are idle by then, so everything retired during the recalculation
+** is freed in one batch, handles published outside any cell and unused for a while
+** are dropped, a break seen through xlAbort (Common/Cancel.h) is forgotten, and the
+** thread usage cycle (Common/ThreadUsage.h) is closed.
+*/
+__declspec(dllexport) int WINAPI cCalcEnded(void)
+{
+    UDF_ENTER(FN_cCalcEnded);
+    int freed = EpochReclaim();
+    int dropped = HandleSweep();
+    CancelReset();
+    ThreadUsageCycleEnd();
+    if (freed || dropped)
+        DebugPrintW(L"Calculation ended: reclaimed %d retired objects, dropped %d handles\n", freed, dropped);
+    UDF_RETURN(1);
+}
+
+__declspec(dllexport) int WINAPI cCalcCanceled(void)
+{
+    UDF_ENTER(FN_cCalcCanceled);
+    int freed = EpochReclaim();
+    int dropped = HandleSweep();
+    CancelReset();
+    ThreadUsageCycleEnd();
+    if (freed || dropped)
+        DebugPrintW(L"Calculation canceled: reclaimed %d retired objects, dropped %d handles\n", freed, dropped);
+    UDF_RETURN(1);
+}
+
+/*
+** DllMain
+**
+** Loader notifications: per-thread contexts are prewarmed at load and reclaimed as
+** threads exit (Common/ThreadContext.h). Runs under the loader lock, so it only allocates.
+*/
+BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
+{
+    switch (fdwReason)
+    {
+    case DLL_PROCESS_ATTACH:
+        return ThreadContextProcessAttach(0);
+    case DLL_THREAD_DETACH:
+        ThreadContextThreadDetach();
+        break;
+    case DLL_PROCESS_DETACH:
+        // At process exit (lpvReserved set) the memory goes with the process
+        if (!lpvReserved)
+            ThreadContextProcessDetach();
+        break;
+    }
+    return TRUE;
 }
 
 /*
@@ -622,6 +1553,20 @@ __declspec(dllexport) int WINAPI xlAutoOpen(void)
     static XLOPER12 xDLL;
     int i;
 
+    UdfHooksInit(L"ThreadSafeC", &rgFuncs[0][0], rgFuncsRows, 8);
+    GovernorInit(&rgFuncs[0][0], rgFuncsRows, 8);
+
+    // Record from the start if XLL_CALL_TRACE / XLL_TIMELINE / XLL_THREAD_USAGE name a directory
+    CallTraceStart(NULL);
+    TimelineStart(NULL);
+    ThreadUsageStart(NULL);
+
+    // Publish live counters for XllMetrics if XLL_METRICS names a directory
+    MetricsOpen();
+
+    // Map the reference datasets named in XLL_REFDATA, read-only, for cRefData
+    RefDataOpen();
+
     // Get the name of this XLL
     Excel12f(xlGetName, &xDLL, 0);
 
@@ -661,6 +1606,10 @@ __declspec(dllexport) int WINAPI xlAutoOpen(void)
         }
     }
 
+    // Reclaim retired objects (Common/Epoch.h) whenever a recalculation finishes or stops
+    Excel12f(xlEventRegister, 0, 2, TempStr12(L"cCalcEnded"), TempInt12(xleventCalculationEnded));
+    Excel12f(xlEventRegister, 0, 2, TempStr12(L"cCalcCanceled"), TempInt12(xleventCalculationCanceled));
+
     // Free temporary memory used by framework
     Excel12f(xlFree, 0, 1, (LPXLOPER12)&xDLL);
 
@@ -679,6 +1628,22 @@ __declspec(dllexport) int WINAPI xlAutoClose(void)
     // Delete function names to clean up Excel's namespace
     for (i = 0; i < rgFuncsRows; i++)
         Excel12f(xlfSetName, 0, 1, TempStr12(rgFuncs[i][2]));
+
+    // Final allocation table, if XLL_ALLOC_DUMP names a directory
+    AllocTrackDump(NULL);
+
+    // Close any call trace still recording and write the timeline
+    CallTraceStop();
+    TimelineStop();
+    ThreadUsageStop();
+
+    // Last metrics snapshot before the modules it reads are torn down
+    MetricsClose();
+
+    // Free every matrix still held for a handle, and stop the reduction helpers
+    HandleStoreClose();
+    ReduceClose();
+    RefDataClose();
     
     return 1;
 }
@@ -692,6 +1657,7 @@ __declspec(dllexport) int WINAPI xlAutoClose(void)
 __declspec(dllexport) void WINAPI xlAutoFree12(LPXLOPER12 pxFree)
 {
     if (pxFree == NULL) return;
+    AllocTrackAutoFree(pxFree);
     
     // Handle different XLOPER12 types that we allocated
     switch (pxFree->xltype & ~xlbitDLLFree)
@@ -706,17 +1672,18 @@ __declspec(dllexport) void WINAPI xlAutoFree12(LPXLOPER12 pxFree)
             break;
             
         case xltypeMulti:
-            // Free array data allocated by AllocatedMemoryFunction
-            if (pxFree->val.array.lparray)
+            // Packed arrays (cXStringColumn) are one block, header included: free it whole
+            if (XlIsPacked(pxFree))
             {
-                GlobalFree(pxFree->val.array.lparray);
-                pxFree->val.array.lparray = NULL;
+                GlobalFree(pxFree);
+                return;
             }
+            // Free array data allocated by AllocatedMemoryFunction, and element strings (cAllocStats)
+            XlFreeResult(pxFree);
             break;
             
         case xltypeNum:
-            // For simple numbers (ThreadSafeXLOPER), no additional cleanup needed
-            // Just the XLOPER12 structure itself will be freed by Excel
+            // For simple numbers (ThreadSafeXLOPER), no payload to free
             break;
             
         default:
@@ -724,6 +1691,6 @@ __declspec(dllexport) void WINAPI xlAutoFree12(LPXLOPER12 pxFree)
             break;
     }
     
-    // Excel will free the main XLOPER12 structure itself
-    return;
+    // The XLOPER12 itself was GlobalAlloc'd by the UDF (or XlNew*): Excel never frees it
+    GlobalFree(pxFree);
 }
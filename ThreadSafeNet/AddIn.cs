@@ -1,5 +1,7 @@
 using ExcelDna.Integration;
 using System;
+using System.Diagnostics;
+using System.Runtime.InteropServices;
 using System.Threading;
 
 namespace ThreadSafeNet
@@ -29,6 +31,62 @@ namespace ThreadSafeNet
             return $"InnerThread:{innerThreadId}";
         }
 
+        // Nested-call latency probe, the .NET half of ThreadSafeC's cNestProbe: same arguments and rows
+        const int NestProbeColumns = 6;
+        const int NestProbeMaxDepth = 32;
+
+        [DllImport("kernel32.dll")]
+        static extern uint GetCurrentThreadId();
+
+        static double NestProbeNowUs()
+        {
+            return Stopwatch.GetTimestamp() * (1e6 / Stopwatch.Frequency);
+        }
+
+        [ExcelFunction(Description = "Calls itself via XlCall depth levels deep (alternate<>0: every other level is C cNestProbe); per level: level, add-in, thread, entry and exit us, round trip us", IsThreadSafe = true)]
+        public static object csNestProbe(double depth, double alternate)
+        {
+            var entryUs = NestProbeNowUs();
+            if (depth < 0 || depth > NestProbeMaxDepth || depth != Math.Floor(depth))
+                return ExcelError.ExcelErrorValue;
+
+            object? inner = null;
+            if (depth >= 1)
+            {
+                try
+                {
+                    inner = alternate != 0
+                        ? XlCall.Excel(XlCall.xlUDF, "cNestProbe", depth - 1, alternate)
+                        : XlCall.Excel(XlCall.xlUDF, _registerIds[nameof(csNestProbe)], depth - 1, alternate);
+                }
+                catch (XlCallException)
+                {
+                }
+            }
+            var exitUs = NestProbeNowUs();
+
+            // The array ends at the first level whose call failed, as in cNestProbe
+            var rows = inner as object[,];
+            int innerRows = rows != null && rows.GetLength(1) == NestProbeColumns && rows.GetLength(0) <= NestProbeMaxDepth ? rows.GetLength(0) : 0;
+            double Cell(int r, int c) => rows![r, c] is double d ? d : 0.0;
+            double innerUs = innerRows > 0 ? Cell(0, 4) - Cell(0, 3) : 0.0;
+
+            var result = new object[1 + innerRows, NestProbeColumns];
+            result[0, 0] = 0.0;
+            result[0, 1] = 1.0;
+            result[0, 2] = (double)GetCurrentThreadId();
+            result[0, 3] = entryUs;
+            result[0, 4] = exitUs;
+            result[0, 5] = exitUs - entryUs - innerUs;
+            for (int r = 0; r < innerRows; r++)
+            {
+                for (int c = 0; c < NestProbeColumns; c++)
+                    result[r + 1, c] = Cell(r, c);
+                result[r + 1, 0] = Cell(r, 0) + 1.0;
+            }
+            return result;
+        }
+
         [ExcelFunction(Description = "C# version of ThreadSafeCFunction - calculates sqrt(input*3) + thread ID", IsThreadSafe = true)]
         public static double csThreadSafeCFunction(double input)
         {
@@ -102,9 +160,11 @@ namespace ThreadSafeNet
 
         public void AutoOpen()
         {
-            var funcName = nameof(csDoubleInner);
-            var regId = (double)XlCall.Excel(XlCall.xlfEvaluate, funcName);
-            _registerIds[funcName] = regId;
+            foreach (var funcName in new[] { nameof(csDoubleInner), nameof(csNestProbe) })
+            {
+                var regId = (double)XlCall.Excel(XlCall.xlfEvaluate, funcName);
+                _registerIds[funcName] = regId;
+            }
         }
 
         public void AutoClose()
@@ -249,28 +249,29 @@ namespace ThreadSafeTest
             }
         }
 
-        [ExcelFunction(Description = "Performance test - use useCSharp=true for C# version", IsThreadSafe = true)]
-        public static object TestPerformance(double input, int iterations, bool useCSharp = false)
+        [ExcelFunction(Description = "Performance test - use useCSharp=true for C# version; stops on Esc or after maxMs (0: no limit)", IsThreadSafe = true)]
+        public static object TestPerformance(double input, int iterations, bool useCSharp = false, double maxMs = 0)
         {
             try
             {
                 if (iterations <= 0) iterations = 1;
-                if (iterations > 1000) iterations = 1000; // Limit to prevent Excel freezing
 
+                var budget = new CallBudget(maxMs);
                 var startTime = System.DateTime.Now;
                 object lastResult = 0.0;
                 string functionName = useCSharp ? "csThreadSafeCalc" : "ThreadSafeCalc";
+                int done = 0;
 
-                for (int i = 0; i < iterations; i++)
+                for (; done < iterations && !budget.ShouldStop(); done++)
                 {
-                    lastResult = XlCall.Excel(XlCall.xlUDF, GetRegisterId(functionName), input + i);
+                    lastResult = XlCall.Excel(XlCall.xlUDF, GetRegisterId(functionName), input + done);
                 }
 
                 var endTime = System.DateTime.Now;
                 var elapsed = endTime - startTime;
                 string version = useCSharp ? "C#" : "C";
 
-                return $"{version} - Iterations: {iterations}, Last Result: {lastResult}, Time: {elapsed.TotalMilliseconds:F2}ms";
+                return $"{version} - Iterations: {done}/{iterations}{budget.StopNote}, Last Result: {lastResult}, Time: {elapsed.TotalMilliseconds:F2}ms";
             }
             catch (System.Exception ex)
             {
@@ -278,35 +279,38 @@ namespace ThreadSafeTest
             }
         }
 
-        [ExcelFunction(Description = "Compare performance between C and C# versions", IsThreadSafe = true)]
-        public static object ComparePerformance(double input, int iterations)
+        [ExcelFunction(Description = "Compare performance between C and C# versions; each stops on Esc or after maxMs (0: no limit)", IsThreadSafe = true)]
+        public static object ComparePerformance(double input, int iterations, double maxMs = 0)
         {
             try
             {
                 if (iterations <= 0) iterations = 1;
-                if (iterations > 500) iterations = 500; // Lower limit for comparison
 
                 // Test C version
+                var budgetC = new CallBudget(maxMs);
                 var startTimeC = System.DateTime.Now;
                 object lastResultC = 0.0;
-                for (int i = 0; i < iterations; i++)
+                int doneC = 0;
+                for (; doneC < iterations && !budgetC.ShouldStop(); doneC++)
                 {
-                    lastResultC = XlCall.Excel(XlCall.xlUDF, GetRegisterId("ThreadSafeCalc"), input + i);
+                    lastResultC = XlCall.Excel(XlCall.xlUDF, GetRegisterId("ThreadSafeCalc"), input + doneC);
                 }
                 var endTimeC = System.DateTime.Now;
                 var elapsedC = endTimeC - startTimeC;
 
-                // Test C# version
+                // Test C# version, over as many iterations as the C version completed
+                var budgetCS = new CallBudget(maxMs);
                 var startTimeCS = System.DateTime.Now;
                 object lastResultCS = 0.0;
-                for (int i = 0; i < iterations; i++)
+                int doneCS = 0;
+                for (; doneCS < doneC && !budgetCS.ShouldStop(); doneCS++)
                 {
-                    lastResultCS = XlCall.Excel(XlCall.xlUDF, GetRegisterId("csThreadSafeCalc"), input + i);
+                    lastResultCS = XlCall.Excel(XlCall.xlUDF, GetRegisterId("csThreadSafeCalc"), input + doneCS);
                 }
                 var endTimeCS = System.DateTime.Now;
                 var elapsedCS = endTimeCS - startTimeCS;
 
-                return $"C: {elapsedC.TotalMilliseconds:F2}ms ({lastResultC}), C#: {elapsedCS.TotalMilliseconds:F2}ms ({lastResultCS})";
+                return $"C: {elapsedC.TotalMilliseconds:F2}ms x{doneC}{budgetC.StopNote} ({lastResultC}), C#: {elapsedCS.TotalMilliseconds:F2}ms x{doneCS}{budgetCS.StopNote} ({lastResultCS})";
             }
             catch (System.Exception ex)
             {
@@ -314,6 +318,42 @@ namespace ThreadSafeTest
             }
         }
 
+        // Cooperative cancellation for the loops above, the managed side of Common/Cancel.h:
+        // a deadline, and xlAbort asked at most once per slice rather than on every iteration
+        sealed class CallBudget
+        {
+            static readonly long SliceTicks = Stopwatch.Frequency / 1000;   // 1 ms
+            readonly Stopwatch _watch = Stopwatch.StartNew();
+            readonly long _deadline;
+            long _nextAbortCheck;
+            string _reason;
+
+            public CallBudget(double maxMs)
+            {
+                _deadline = maxMs > 0 ? (long)(maxMs * Stopwatch.Frequency / 1000) : 0;
+                _nextAbortCheck = SliceTicks;
+            }
+
+            public bool ShouldStop()
+            {
+                if (_reason != null)
+                    return true;
+                long now = _watch.ElapsedTicks;
+                if (_deadline > 0 && now >= _deadline)
+                    _reason = "deadline";
+                else if (now >= _nextAbortCheck)
+                {
+                    _nextAbortCheck = now + SliceTicks;
+                    // pxRetain TRUE leaves the break pending for Excel
+                    if (XlCall.Excel(XlCall.xlAbort, true) is bool abort && abort)
+                        _reason = "break";
+                }
+                return _reason != null;
+            }
+
+            public string StopNote => _reason == null ? "" : $" (stopped: {_reason})";
+        }
+
         static object GetRegisterId(string functionName)
         {
             if (AddIn.RegisterIds.TryGetValue(functionName, out var registerId))